@@ -23,25 +23,58 @@ class ImportPreviewCollectionItem: NSCollectionViewItem {
     
     /// Display name for the image
     @objc dynamic private var displayName: String? = nil
+    /// Incremented whenever the item changes, so thumbnails for a previous item are ignored
+    private var thumbGeneration: Int = 0
+    /// Outstanding thumbnail request for the current item
+    private var thumbRequest: ImportThumbnailRequest? = nil
     
     /**
-     * Cleans up the UI in prepearation for reuse.
+     * Cleans up the UI in prepearation for reuse. The thumbnail of the previous item is no longer needed, so it isn't read
+     * if it hasn't been yet.
      */
     override func prepareForReuse() {
         super.prepareForReuse()
         
+        self.cancelThumbnail()
         self.thumbView.image = nil
     }
     
+    /**
+     * Cancels the outstanding thumbnail request, and ignores any thumbnail it may still deliver.
+     */
+    private func cancelThumbnail() {
+        self.thumbRequest?.cancel()
+        self.thumbRequest = nil
+        
+        self.thumbGeneration += 1
+    }
+    
     /**
      * Updates the UI with the new item state.
      */
     private func updateFromItem() {
+        self.cancelThumbnail()
+        
         guard let item = self.item else {
             self.displayName = nil
             return
         }
         
         self.displayName = item.displayName
+        
+        // request the thumbnail; the item may have been reused by the time it arrives
+        let generation = self.thumbGeneration
+        
+        self.thumbRequest = item.getThumbnail { [weak self] result in
+            guard let self = self, self.thumbGeneration == generation else {
+                return
+            }
+            self.thumbRequest = nil
+            
+            guard case .success(let image) = result else {
+                return
+            }
+            self.thumbView.image = image
+        }
     }
 }
@@ -10,6 +10,8 @@ import Foundation
 import UniformTypeIdentifiers
 import OSLog
 
+import Paper
+
 /**
  * An import source that (possibly recursively) enumerates the contents of a directory for image files.
  */
@@ -27,6 +29,15 @@ internal class DirectoryImportSource: ImportSource {
     /// Whether the directory is recursively searched
     private(set) internal var recursive: Bool
     
+    /// Size of thumbnails produced for items; CR2 files can use their small embedded thumbnail at this size, which fills the
+    /// height of an import preview tile
+    fileprivate static let thumbSize: CGFloat = CR2PreviewReader.smallThumbSize
+    /// Queue on which thumbnails of non-CR2 files are read
+    fileprivate static let thumbQueue = DispatchQueue(label: "DirectoryImportSource.thumb", qos: .utility,
+                                                       attributes: .concurrent)
+    /// Type identifier of CR2 files, whose previews are read directly
+    fileprivate static let cr2Type = UTType("com.canon.cr2-raw-image")!
+    
     // MARK: - Initialization
     init(_ url: URL, recursive: Bool = true) throws {
         self.displayName = url.lastPathComponent
@@ -114,10 +125,33 @@ internal class DirectoryImportSource: ImportSource {
         }
         
         /**
-         * Requests a thumbnail for the given image.
+         * Requests a thumbnail for the given image. The callback is invoked on the main queue.
+         *
+         * CR2 files have their embedded preview read with only a few small reads, rather than reading the entire file;
+         * all other images go through the regular thumbnail readers.
          */
-        func getThumbnail(_ callback: @escaping (Result<NSImage, Error>) -> Void) {
-            // TODO: implement
+        func getThumbnail(_ callback: @escaping (Result<NSImage, Error>) -> Void) -> ImportThumbnailRequest? {
+            if let type = self.type, type.conforms(to: DirectoryImportSource.cr2Type) {
+                return CR2PreviewReader.shared.read(self.url, maxSize: DirectoryImportSource.thumbSize) { result in
+                    callback(result.map({ NSImage(cgImage: $0, size: .zero) }))
+                }
+            }
+            
+            let work = DispatchWorkItem {
+                guard let reader = ThumbReader(self.url),
+                      let image = reader.getThumb(DirectoryImportSource.thumbSize) else {
+                    return DispatchQueue.main.async {
+                        callback(.failure(Errors.failedToReadThumbnail))
+                    }
+                }
+                
+                DispatchQueue.main.async {
+                    callback(.success(NSImage(cgImage: image, size: .zero)))
+                }
+            }
+            
+            DirectoryImportSource.thumbQueue.async(execute: work)
+            return work
         }
     }
     
@@ -126,5 +160,11 @@ internal class DirectoryImportSource: ImportSource {
         case notADirectory
         /// Could not enumerate the directory
         case failedToEnumerateDirectory
+        /// No thumbnail could be read for an image
+        case failedToReadThumbnail
     }
 }
+
+// MARK: - Thumbnail requests
+extension CR2PreviewReader.Request: ImportThumbnailRequest {}
+extension DispatchWorkItem: ImportThumbnailRequest {}
@@ -103,8 +103,9 @@ internal class ImageCaptureCameraSource: ImportSource {
         /**
          * Requests a thumbnail for the given image.
          */
-        func getThumbnail(_ callback: @escaping (Result<NSImage, Error>) -> Void) {
+        func getThumbnail(_ callback: @escaping (Result<NSImage, Error>) -> Void) -> ImportThumbnailRequest? {
             // TODO: implement
+            return nil
         }
     }
 }
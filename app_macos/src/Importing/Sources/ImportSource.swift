@@ -41,8 +41,21 @@ internal protocol ImportSourceItem {
     
     /**
      * Requests a thumbnail image for the item
+     *
+     * - Returns: The request, if it may be cancelled; cancel it once the thumbnail is no longer needed
      */
-    func getThumbnail(_ callback: @escaping (Result<NSImage, Error>) -> Void)
+    func getThumbnail(_ callback: @escaping (Result<NSImage, Error>) -> Void) -> ImportThumbnailRequest?
+}
+
+/**
+ * An outstanding request for the thumbnail of an import source item
+ */
+internal protocol ImportThumbnailRequest {
+    /**
+     * Cancels the request. If the thumbnail hasn't been read yet, it won't be; a thumbnail that is already being read may
+     * still be delivered.
+     */
+    func cancel()
 }
 
 enum ImportSourceType {
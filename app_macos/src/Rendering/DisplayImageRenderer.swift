@@ -62,6 +62,24 @@ internal class DisplayImageRenderer {
         }
     }
     
+    /**
+     * Waits for the renderer to finish decoding the current image at full quality.
+     *
+     * - Parameter callback: Invoked with whether the full quality image is available, once its decode completes.
+     */
+    func waitForRefinedImage(_ callback: @escaping (Result<Bool, Error>) -> Void) {
+        guard self.proxy != nil else {
+            return callback(.failure(Errors.invalidProxy))
+        }
+        
+        self.proxy!.waitForRefinedImage() { err, refined in
+            if let err = err {
+                return callback(.failure(err))
+            }
+            return callback(.success(refined))
+        }
+    }
+    
     /**
      * Updates the renderer to display the provided image.
      *
@@ -121,7 +121,10 @@ class ImageRenderView: MTKView {
                 self.renderer?.redraw() { res in
                     self.shouldDrawViewport = true
                     self.postImageUpdatedNote()
-                    return callback(res)
+                    callback(res)
+                    
+                    // the first render uses a preview; redraw again once the full quality image is ready
+                    self.waitForRefinedImage(image)
                 }
             } catch {
                 Self.logger.error("Failed to update image: \(error.localizedDescription)")
@@ -618,6 +621,28 @@ class ImageRenderView: MTKView {
         }
     }
     
+    /**
+     * Waits for the render service to decode the given image at full quality, then redraws if it's still the current image.
+     */
+    private func waitForRefinedImage(_ image: Image) {
+        self.renderer?.waitForRefinedImage() { res in
+            do {
+                guard try res.get() else {
+                    return
+                }
+                
+                DispatchQueue.main.async {
+                    guard self.currentImage == image else {
+                        return
+                    }
+                    self.requestXpcRedraw() { _ in }
+                }
+            } catch {
+                Self.logger.error("Failed to refine image: \(error.localizedDescription)")
+            }
+        }
+    }
+    
     /**
      * Posts the "image updated" notification.
      */
@@ -94,6 +94,18 @@ import Waterpipe
      */
     func redraw(withReply reply: @escaping (_ error: Error?) -> Void)
     
+    /**
+     * Waits for the full quality version of the current image.
+     *
+     * Images are displayed from a quickly demosaiced preview at first, while the full quality image is decoded in the background.
+     * Once that's done, the reply is invoked, and the next redraw will use the full quality image.
+     *
+     * - Parameter reply: Callback invoked when the full quality decode finishes, fails, or is cancelled.
+     * - Parameter error: If non-nil, the error that caused the full quality decode to fail.
+     * - Parameter refined: Whether the full quality image is available; this is false if the image was changed in the meantime.
+     */
+    func waitForRefinedImage(withReply reply: @escaping (_ error: Error?, _ refined: Bool) -> Void)
+    
     /**
      * Releases all resources allocated by the renderer, including its output texture.
      *
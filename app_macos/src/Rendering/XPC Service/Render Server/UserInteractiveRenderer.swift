@@ -10,10 +10,15 @@ import OSLog
 import Metal
 import MetalKit
 
+import Bowl
+import Paper
 import Waterpipe
 
 /**
  * Implements a renderer optimized for user interactive display.
+ *
+ * Images are displayed progressively: a quickly demosaiced preview is decoded when the image is set, and the full quality image
+ * is decoded in the background afterwards. Changing the image cancels any background decode still in progress.
  */
 internal class UserInteractiveRenderer: Renderer, RendererUserInteractiveXPCProtocol {
     fileprivate static var logger = Logger(subsystem: Bundle(for: UserInteractiveRenderer.self).bundleIdentifier!,
@@ -39,6 +44,30 @@ internal class UserInteractiveRenderer: Renderer, RendererUserInteractiveXPCProt
     
     /// Texture clearer
     private var textureClearer: TextureFiller!
+    
+    /// Queue on which images are decoded at full quality, after their preview has been set up
+    private var refineQueue = DispatchQueue(label: "UserInteractiveRenderer.refine", qos: .utility)
+    /// Progress of the most recently started full quality decode; cancelled when the image changes
+    private var refineProgress: Progress? = nil
+    /// Error from the most recent full quality decode, if any; only accessed from the refine queue
+    private var refineError: Error? = nil
+    
+    /**
+     * Cache of decoded sensor data, shared by all renderers in the service. It lives in the service's group container, since
+     * the service only has read access to the libraries; entries are keyed by the contents of the raw file, so one cache
+     * serves images from any library.
+     */
+    private static let rawCache: RawCache? = {
+        let url = ContainerHelper.groupAppCache(component: .renderer)
+            .appendingPathComponent("Raw Data", isDirectory: true)
+        
+        do {
+            return try RawCache(directory: url)
+        } catch {
+            UserInteractiveRenderer.logger.error("Failed to open raw cache at \(url): \(error.localizedDescription)")
+            return nil
+        }
+    }()
 
     // MARK: - Initialization
     /**
@@ -62,6 +91,8 @@ internal class UserInteractiveRenderer: Renderer, RendererUserInteractiveXPCProt
      */
     deinit {
         Self.logger.debug("Releasing UI renderer \(String(describing: self))")
+        
+        self.refineProgress?.cancel()
     }
     
     // MARK: - XPC interface
@@ -80,22 +111,26 @@ internal class UserInteractiveRenderer: Renderer, RendererUserInteractiveXPCProt
             if descriptor.discardCaches || self.renderImage == nil ||
                 self.renderImage?.url != descriptor.url {
                 
-                let image = try RenderPipelineImage(url: descriptor.url)
-                self.pipelineState = try self.pipeline.createState(image: image)
+                // stop decoding the previous image at full quality
+                self.refineProgress?.cancel()
+                
+                let image = try RenderPipelineImage(url: descriptor.url, rawCache: Self.rawCache)
+                self.pipelineState = try self.pipeline.createState(image: image, progressive: true)
                 
                 self.renderImage = image
+                self.refine(self.pipelineState!)
             }
             guard self.renderImage != nil, self.pipelineState != nil else {
                 throw Errors.imageCreateFailed
             }
             progress.resignCurrent()
 
-            // allocate new output texture if needed
+            // allocate new output texture if needed; it must match the pipeline's half float format
             progress.becomeCurrent(withPendingUnitCount: 1)
             if self.renderOutput == nil ||
                self.renderOutput!.imageSize != self.renderImage!.size {
                 self.renderOutput = nil
-                guard let image = TiledImage(device: self.device, forImageSized: self.renderImage!.size, tileSize: 512, .rgba32Float, true) else {
+                guard let image = TiledImage(device: self.device, forImageSized: self.renderImage!.size, tileSize: 512, .rgba16Float, true) else {
                     throw Errors.renderOutputAllocFailed
                 }
                 self.renderOutput = image
@@ -130,15 +165,60 @@ internal class UserInteractiveRenderer: Renderer, RendererUserInteractiveXPCProt
         return reply(nil)
     }
     
+    /**
+     * Replies once the background decode of the current image has finished. Since the refine queue is serial, this runs after
+     * the decode that was started most recently.
+     */
+    func waitForRefinedImage(withReply reply: @escaping (Error?, Bool) -> Void) {
+        guard let state = self.pipelineState else {
+            return reply(Errors.noImage, false)
+        }
+        
+        self.refineQueue.async {
+            reply(self.refineError, state.image.isFullQuality)
+        }
+    }
+    
     /**
      * Releases the renderer.
      */
     func destroy() {
+        self.refineProgress?.cancel()
+        
         NotificationCenter.default.post(name: .rendererReleased, object: nil, userInfo: [
             "identifier": self.identifier
         ])
     }
     
+    // MARK: - Progressive decoding
+    /**
+     * Decodes the image of the given pipeline state at full quality in the background.
+     */
+    private func refine(_ state: RenderPipelineState) {
+        // this progress is not part of the one for setting the descriptor
+        let progress = Progress.discreteProgress(totalUnitCount: 1)
+        self.refineProgress = progress
+        
+        self.refineQueue.async { [weak self] in
+            guard let self = self, !progress.isCancelled else {
+                return
+            }
+            
+            progress.becomeCurrent(withPendingUnitCount: 1)
+            do {
+                try self.pipeline.refine(state)
+                self.refineError = nil
+            } catch {
+                // cancellation is expected whenever the image changes
+                if !progress.isCancelled {
+                    Self.logger.error("Failed to refine image: \(error.localizedDescription)")
+                    self.refineError = error
+                }
+            }
+            progress.resignCurrent()
+        }
+    }
+    
     // MARK: - Drawing    
     /**
      * Drawing that shit, happens synchronously
@@ -171,5 +251,7 @@ internal class UserInteractiveRenderer: Renderer, RendererUserInteractiveXPCProt
         
         /// Couldn't create the image when setting render descriptor
         case imageCreateFailed
+        /// No image has been set
+        case noImage
     }
 }
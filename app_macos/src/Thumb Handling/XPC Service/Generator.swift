@@ -35,6 +35,17 @@ internal class Generator {
     /// Observers on user defaults keys related to chunk generation
     private var kvos: [NSKeyValueObservation] = []
     
+    /**
+     * Develops raw files without a usable embedded preview. It's shared by all operations, so its memory budget
+     * bounds how many raw files are developed at once, however many operations the queue runs.
+     */
+    private var rawDecoder: CR2BatchDecoder = {
+        let decoder = CR2BatchDecoder()
+        // quarter size images develop much faster, and are still large enough for most thumb sizes
+        decoder.options.algorithm = 4
+        return decoder
+    }()
+    
     // MARK: - Initialization
     /**
      * Creates a new thumb generator using the provided directory as a data source.
@@ -64,6 +75,7 @@ internal class Generator {
      */
     deinit {
         self.queue.cancelAllOperations()
+        self.rawDecoder.cancelAll()
         self.kvos.removeAll()
     }
     
@@ -349,12 +361,24 @@ internal class Generator {
      */
     private func generateNew(_ request: ThumbRequest) throws {
         // attempt to create thumb reader and create thumb data
-        guard let reader = ThumbReader(request.imageUrl) else {
+        let data: Data
+        
+        if let reader = ThumbReader(request.imageUrl) {
+            data = try self.makeThumbData(reader.originalSize) {
+                reader.getThumb($0)
+            }
+        }
+        // without a usable preview, raw files are developed instead
+        else if Self.isRaw(request.imageUrl) {
+            let image = try self.developRaw(request.imageUrl)
+            
+            data = try self.makeThumbData(CGSize(width: image.width, height: image.height)) { _ in
+                image
+            }
+        } else {
             throw GeneratorErrors.thumbReaderFailed(request.imageUrl)
         }
         
-        let data = try self.makeThumbData(reader)
-        
         // create the thumbnail in the directory
         let thumb = try self.directory.makeThumb(request: request)
         
@@ -379,17 +403,96 @@ internal class Generator {
         // TODO: implement
     }
     
+    // MARK: Raw developing
+    /// Type of Canon raw files
+    private static let cr2Type = UTType("com.canon.cr2-raw-image")!
+    
+    /**
+     * Determines whether the file at the given URL is a raw file that can be developed.
+     */
+    private static func isRaw(_ url: URL) -> Bool {
+        guard let typeString = try? url.resourceValues(forKeys: [.typeIdentifierKey]).typeIdentifier,
+              let type = UTType(typeString) else {
+            return false
+        }
+        
+        return type.conforms(to: Self.cr2Type)
+    }
+    
+    /**
+     * Develops the raw file at the given URL at a quarter of its size, and returns it as an 8-bit sRGB image.
+     *
+     * This blocks the calling operation until the batch decoder has finished the file.
+     */
+    private func developRaw(_ url: URL) throws -> CGImage {
+        let sem = DispatchSemaphore(value: 0)
+        var result: Result<CR2BatchDecoder.Output, Error>?
+        
+        self.rawDecoder.decode([url], completion: { _, res in
+            result = res
+            sem.signal()
+        })
+        sem.wait()
+        
+        guard let output = try result?.get() else {
+            throw GeneratorErrors.rawDevelopFailed(url)
+        }
+        
+        // wrap the linear ProPhoto pixels in an image
+        let width = Int(output.size.width), height = Int(output.size.height)
+        let floatInfo = CGBitmapInfo.floatComponents.rawValue | CGBitmapInfo.byteOrder32Little.rawValue |
+                        CGImageAlphaInfo.noneSkipLast.rawValue
+        
+        guard let provider = CGDataProvider(data: output.pixels as CFData),
+              let developed = CGImage(width: width, height: height, bitsPerComponent: 32,
+                                      bitsPerPixel: 128, bytesPerRow: output.bytesPerRow,
+                                      space: Self.linearRomm, bitmapInfo: CGBitmapInfo(rawValue: floatInfo),
+                                      provider: provider, decode: nil, shouldInterpolate: false,
+                                      intent: .defaultIntent) else {
+            throw GeneratorErrors.rawDevelopFailed(url)
+        }
+        
+        // convert it to the same format as embedded previews, so the thumbs don't have to be scaled as floats
+        guard let context = CGContext(data: nil, width: width, height: height, bitsPerComponent: 8,
+                                      bytesPerRow: 0, space: CGColorSpace(name: CGColorSpace.sRGB)!,
+                                      bitmapInfo: CGImageAlphaInfo.noneSkipLast.rawValue) else {
+            throw GeneratorErrors.rawDevelopFailed(url)
+        }
+        
+        context.draw(developed, in: CGRect(x: 0, y: 0, width: width, height: height))
+        
+        guard let image = context.makeImage() else {
+            throw GeneratorErrors.rawDevelopFailed(url)
+        }
+        return image
+    }
+    
+    /// Linear ProPhoto (ROMM) color space, which the batch decoder develops into
+    private static let linearRomm: CGColorSpace = {
+        let whitePoint: [CGFloat] = [0.9642, 1.0, 0.8249]
+        let gamma: [CGFloat] = [1.0, 1.0, 1.0]
+        let matrix: [CGFloat] = [
+            0.7977, 0.2880, 0.0000,
+            0.1352, 0.7119, 0.0000,
+            0.0313, 0.0001, 0.8249,
+        ]
+        
+        return CGColorSpace(calibratedRGBWhitePoint: whitePoint, blackPoint: nil, gamma: gamma,
+                            matrix: matrix)!
+    }()
+    
     // MARK: Thumb drawing
     /**
-     * Given a thumbnail reader, creates a data object containing all of the thumbnail sizes we want.
+     * Creates a data object containing all of the thumbnail sizes we want, for an image of the given original size.
+     * Images to make each thumbnail from are requested from the given closure, by the length of their small edge.
      */
-    private func makeThumbData(_ reader: ThumbReader) throws -> Data {
+    private func makeThumbData(_ originalSize: CGSize, _ getThumb: (CGFloat) -> CGImage?) throws -> Data {
         // get all thumb sizes that aren't larger than the actual image
         var sizes = Self.thumbMap
         
         sizes.removeAll(where: {
-            return ($0.size.rawValue > Int(reader.originalSize.width)) ||
-                   ($0.size.rawValue > Int(reader.originalSize.height))
+            return ($0.size.rawValue > Int(originalSize.width)) ||
+                   ($0.size.rawValue > Int(originalSize.height))
         })
         
         // create an image destination
@@ -407,7 +510,7 @@ internal class Generator {
             let edge = info.size.rawValue
             
             // get a matching thumb from the generator
-            guard let thumb = reader.getThumb(CGFloat(edge)) else {
+            guard let thumb = getThumb(CGFloat(edge)) else {
                 throw GeneratorErrors.thumbReaderGetFailed
             }
             
@@ -571,6 +674,8 @@ internal class Generator {
         case thumbReaderGetFailed
         /// Resizing of an image failed
         case imageResizeFailed
+        /// The raw file at the given url couldn't be developed
+        case rawDevelopFailed(_ url: URL)
         
         /// The provided thumbnail has an invalid chunk or image id
         case invalidIdentifiers
@@ -0,0 +1,537 @@
+//
+//  CR2BatchDecoder.swift
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200830.
+//
+
+import Foundation
+import OSLog
+import simd
+
+/**
+ * Decodes large batches of CR2 files, such as when importing an entire memory card.
+ *
+ * Each file passes through a series of stages, each with its own work queue and number of workers: first, the file is
+ * mapped and read into memory; then its raw data is entropy decoded; and finally, it is demosaiced and converted to the
+ * working color space in a single pass. Files only enter the first stage while the memory needed by all files in flight
+ * fits into the memory budget, so the disk and all cores can be kept busy without running out of memory.
+ *
+ * Results are delivered through a completion handler, invoked on an arbitrary background thread once a file has made it
+ * through all stages or failed.
+ */
+public class CR2BatchDecoder {
+    fileprivate static var logger = Logger(subsystem: Bundle(for: CR2BatchDecoder.self).bundleIdentifier!,
+                                         category: "CR2BatchDecoder")
+
+    /// Options applied to every image decoded
+    public var options = Options()
+
+    /**
+     * Maximum number of bytes that may be used by all images in flight. A single image is always admitted, even if its
+     * estimate exceeds the budget.
+     */
+    public var memoryBudget: UInt64 = (ProcessInfo.processInfo.physicalMemory / 4) {
+        didSet {
+            self.admit()
+        }
+    }
+
+    /**
+     * Estimated ratio between the memory needed to decode a file and its size on disk. This is used to make room for
+     * files before they're decoded; once the actual raw image size is known, the estimate is replaced.
+     */
+    public var estimatedExpansion: Double = 12
+
+    /**
+     * Reads a file into memory; this runs on the I/O stage's workers. By default, the file is mapped and each of its
+     * pages touched, so the decode stage doesn't stall on page faults.
+     */
+    internal var readFile: (URL) throws -> Data = { url in
+        let data = try Data(contentsOf: url, options: [.alwaysMapped])
+        CR2BatchDecoder.prefetch(data)
+        return data
+    }
+
+    /// Queue for mapping and reading in files
+    private var ioQueue = OperationQueue()
+    /// Queue for entropy decoding raw data
+    private var decodeQueue = OperationQueue()
+    /// Queue for demosaicing and color conversion
+    private var developQueue = OperationQueue()
+
+    /// Lock protecting the scheduling state
+    private var lock = NSLock()
+    /// Images waiting to be admitted into the first stage
+    private var pending: [Job] = []
+    /// Index of the first image in `pending` that hasn't been admitted yet
+    private var pendingHead: Int = 0
+    /// Number of images currently in flight
+    private var inFlight: Int = 0
+    /// Number of bytes of memory reserved by in flight images
+    private var inFlightBytes: UInt64 = 0
+    /// Incremented whenever outstanding work is cancelled; jobs from earlier generations are discarded
+    private var generation: UInt = 0
+
+    /// Decompressors and buffers reused between images
+    private var context = PAPDecodeContext()
+    /// Lock serializing color info lookups from develop workers; separate from the scheduling lock, since a lookup may
+    /// have to read the color info database
+    private var matrixLock = NSLock()
+    /// Color conversion info database (protected by `matrixLock`)
+    private var colorInfo: CameraColorInfo? = CameraColorInfo()
+    /// Sensor to working space matrices for each camera model seen so far (protected by `matrixLock`)
+    private var matrices: [String: simd_float3x3] = [:]
+
+    // MARK: - Initialization
+    /**
+     * Creates a batch decoder. The worker counts of each stage default to values that suit the available cores.
+     */
+    public init() {
+        let cores = ProcessInfo.processInfo.activeProcessorCount
+
+        self.ioQueue.name = "CR2BatchDecoder I/O"
+        self.ioQueue.maxConcurrentOperationCount = 2
+
+        // each decode runs on a single core
+        self.decodeQueue.name = "CR2BatchDecoder Decode"
+        self.decodeQueue.maxConcurrentOperationCount = cores
+
+        // debayering already spreads each image over multiple cores
+        self.developQueue.name = "CR2BatchDecoder Develop"
+        self.developQueue.maxConcurrentOperationCount = max(1, cores / 4)
+
+        for queue in [self.ioQueue, self.decodeQueue, self.developQueue] {
+            queue.qualityOfService = .utility
+        }
+    }
+
+    /**
+     * Discards any outstanding work when deallocating.
+     */
+    deinit {
+        self.cancelAll()
+    }
+
+    // MARK: Configuration
+    /// Number of images currently in flight, and the number of bytes of memory reserved for them
+    internal var reservation: (images: Int, bytes: UInt64) {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+
+        return (self.inFlight, self.inFlightBytes)
+    }
+
+    /// Number of files that are read from disk concurrently
+    public var ioWorkers: Int {
+        get {
+            return self.ioQueue.maxConcurrentOperationCount
+        }
+        set(newValue) {
+            self.ioQueue.maxConcurrentOperationCount = newValue
+        }
+    }
+
+    /// Number of images whose raw data is entropy decoded concurrently
+    public var decodeWorkers: Int {
+        get {
+            return self.decodeQueue.maxConcurrentOperationCount
+        }
+        set(newValue) {
+            self.decodeQueue.maxConcurrentOperationCount = newValue
+        }
+    }
+
+    /// Number of images that are demosaiced and color converted concurrently
+    public var developWorkers: Int {
+        get {
+            return self.developQueue.maxConcurrentOperationCount
+        }
+        set(newValue) {
+            self.developQueue.maxConcurrentOperationCount = newValue
+        }
+    }
+
+    // MARK: - Public Interface
+    /**
+     * Decodes all images at the given URLs. The completion handler is invoked once for each URL, in no particular order, and
+     * the finished handler once all of them have completed.
+     */
+    public func decode(_ urls: [URL], completion: @escaping (URL, Result<Output, Error>) -> Void,
+                       finished: (() -> Void)? = nil) {
+        let group = DispatchGroup()
+        let options = self.options
+
+        // estimate the memory needed by each image from the size of its file
+        let jobs = urls.map { url -> Job in
+            let fileSize = (try? url.resourceValues(forKeys: [.fileSizeKey]))?.fileSize ?? 0
+            let estimate = UInt64(Double(fileSize) * self.estimatedExpansion)
+
+            group.enter()
+            return Job(url, options, estimate, group, completion)
+        }
+
+        if let handler = finished {
+            group.notify(queue: DispatchQueue.global(qos: .utility), execute: handler)
+        }
+
+        self.lock.lock()
+        jobs.forEach {
+            $0.generation = self.generation
+        }
+        self.pending.append(contentsOf: jobs)
+        self.lock.unlock()
+
+        self.admit()
+    }
+
+    /**
+     * Cancels all images that haven't finished decoding yet. Their completion handlers are invoked with a cancellation
+     * error.
+     */
+    public func cancelAll() {
+        self.lock.lock()
+        let waiting = self.pending[self.pendingHead...]
+        self.pending.removeAll()
+        self.pendingHead = 0
+        self.generation += 1
+        self.lock.unlock()
+
+        // images already in flight are discarded between stages
+        for job in waiting {
+            job.complete(.failure(Errors.cancelled))
+        }
+    }
+
+    // MARK: - Scheduling
+    /**
+     * Moves as many pending images into the first stage as the memory budget allows.
+     */
+    private func admit() {
+        var admitted: [Job] = []
+
+        self.lock.lock()
+        while self.pendingHead < self.pending.count {
+            let job = self.pending[self.pendingHead]
+
+            guard self.inFlight == 0 || (self.inFlightBytes + job.reserved) <= self.memoryBudget else {
+                break
+            }
+
+            self.pendingHead += 1
+            self.inFlight += 1
+            self.inFlightBytes += job.reserved
+            admitted.append(job)
+        }
+
+        // drop admitted images from the front of the queue every now and then
+        if self.pendingHead > 64 && (self.pendingHead * 2) > self.pending.count {
+            self.pending.removeFirst(self.pendingHead)
+            self.pendingHead = 0
+        }
+        self.lock.unlock()
+
+        for job in admitted {
+            self.ioQueue.addOperation {
+                self.read(job)
+            }
+        }
+    }
+
+    /**
+     * Replaces the memory reserved for an in flight image. If the reservation shrinks, more images may be admitted.
+     */
+    private func reserve(_ job: Job, _ bytes: UInt64) {
+        self.lock.lock()
+        let old = job.reserved
+        self.inFlightBytes = self.inFlightBytes - old + bytes
+        job.reserved = bytes
+        self.lock.unlock()
+
+        if bytes < old {
+            self.admit()
+        }
+    }
+
+    /**
+     * Releases an in flight image's memory reservation and invokes its completion handler.
+     */
+    private func finish(_ job: Job, _ result: Result<Output, Error>) {
+        self.lock.lock()
+        self.inFlight -= 1
+        self.inFlightBytes -= job.reserved
+        job.reserved = 0
+        self.lock.unlock()
+
+        job.data = nil
+        job.image = nil
+        job.complete(result)
+
+        self.admit()
+    }
+
+    /**
+     * Checks whether the image was cancelled after it was admitted; if so, it's finished with an error.
+     */
+    private func discardIfCancelled(_ job: Job) -> Bool {
+        self.lock.lock()
+        let cancelled = (job.generation != self.generation)
+        self.lock.unlock()
+
+        if cancelled {
+            self.finish(job, .failure(Errors.cancelled))
+        }
+        return cancelled
+    }
+
+    // MARK: - Stages
+    /**
+     * Reads all of the image's file into memory.
+     */
+    private func read(_ job: Job) {
+        guard !self.discardIfCancelled(job) else {
+            return
+        }
+
+        do {
+            job.data = try self.readFile(job.url)
+        } catch {
+            Self.logger.error("Failed to read '\(job.url)': \(error.localizedDescription)")
+            return self.finish(job, .failure(error))
+        }
+
+        self.decodeQueue.addOperation {
+            self.decodeRaw(job)
+        }
+    }
+
+    /**
+     * Parses the image's file and decompresses its raw data.
+     */
+    private func decodeRaw(_ job: Job) {
+        guard !self.discardIfCancelled(job) else {
+            return
+        }
+
+        do {
+            let reader = try CR2Reader(withData: job.data!, decodeRawData: true, decodeThumbs: false)
+            reader.decodeContext = self.context
+            reader.leanMemory = true
+            let image = try reader.decode()
+            job.data = nil
+
+            guard let raw = image.rawValues else {
+                throw Errors.noRawData(job.url)
+            }
+            job.image = image
+
+            // now that the image size is known, reserve what's actually needed for the remaining stages
+            let (size, bytesPerRow) = try Self.outputSize(image, job.options)
+            let bytes = UInt64(raw.count) + UInt64(bytesPerRow * Int(size.height))
+
+            self.reserve(job, bytes)
+        } catch {
+            Self.logger.error("Failed to decode '\(job.url)': \(error.localizedDescription)")
+            return self.finish(job, .failure(error))
+        }
+
+        self.developQueue.addOperation {
+            self.develop(job)
+        }
+    }
+
+    /**
+     * Demosaics the image's raw data and converts it to the working color space and output pixel format.
+     */
+    private func develop(_ job: Job) {
+        guard !self.discardIfCancelled(job) else {
+            return
+        }
+
+        do {
+            let image = job.image!
+            let (size, bytesPerRow) = try Self.outputSize(image, job.options)
+
+            let matrix = try self.getMatrix(image.meta.cameraModel)
+            let wb = image.rawWbMultiplier.map(NSNumber.init)
+
+            guard let output = self.context.buffer(withLength: UInt(bytesPerRow * Int(size.height))) else {
+                throw Errors.allocationFailed
+            }
+
+            // half floats are written directly, rather than narrowed from 32-bit floats afterwards
+            if job.options.halfFloat {
+                try PAPDebayerer.debayer(image.rawValues!, withHalfFloatOutput: output,
+                                         imageSize: image.visibleImageSize, andAlgorithm: job.options.algorithm,
+                                         vShift: image.rawValuesVshift, wbShift: wb,
+                                         blackLevel: image.rawBlackLevel as [NSNumber],
+                                         colorMatrix: matrix, scale: job.options.scale)
+            } else {
+                try PAPDebayerer.debayer(image.rawValues!, withFloatOutput: output,
+                                         imageSize: image.visibleImageSize, andAlgorithm: job.options.algorithm,
+                                         vShift: image.rawValuesVshift, wbShift: wb,
+                                         blackLevel: image.rawBlackLevel as [NSNumber],
+                                         colorMatrix: matrix, scale: job.options.scale)
+            }
+            image.rawValues = nil
+
+            let pixels = Data(wrapping: output)
+
+            self.finish(job, .success(Output(url: job.url, image: image, pixels: pixels, size: size,
+                                              bytesPerRow: bytesPerRow)))
+        } catch {
+            Self.logger.error("Failed to develop '\(job.url)': \(error.localizedDescription)")
+            self.finish(job, .failure(error))
+        }
+    }
+
+    // MARK: - Helpers
+    /**
+     * Advises the kernel that the entire mapping is needed, then touches each of its pages.
+     */
+    @inline(never) fileprivate static func prefetch(_ data: Data) {
+        data.withUnsafeBytes { buf in
+            guard let base = buf.baseAddress, !buf.isEmpty else {
+                return
+            }
+
+            madvise(UnsafeMutableRawPointer(mutating: base), buf.count, MADV_WILLNEED)
+
+            let page = Int(getpagesize())
+            var sum: UInt8 = 0
+
+            for offset in stride(from: 0, to: buf.count, by: page) {
+                sum &+= buf.load(fromByteOffset: offset, as: UInt8.self)
+            }
+
+            withExtendedLifetime(sum) {}
+        }
+    }
+
+    /**
+     * Gets the size and number of bytes per row of the pixels produced for the given image.
+     */
+    private static func outputSize(_ image: CR2Image, _ options: Options) throws -> (CGSize, Int) {
+        let factor = CGFloat(PAPDebayerer.scaleFactor(forAlgorithm: options.algorithm))
+        guard factor > 0 else {
+            throw Errors.invalidAlgorithm(options.algorithm)
+        }
+
+        let size = CGSize(width: floor(image.visibleImageSize.width / factor),
+                          height: floor(image.visibleImageSize.height / factor))
+        let componentSize = options.halfFloat ? 2 : MemoryLayout<Float>.stride
+
+        return (size, Int(size.width) * 4 * componentSize)
+    }
+
+    /**
+     * Gets the sensor to working space matrix for the given camera model, looking it up if needed. This is called from
+     * concurrent develop workers; lookups are serialized, so each model is only looked up once.
+     */
+    private func getMatrix(_ model: String?) throws -> simd_float3x3 {
+        guard let modelName = model else {
+            throw Errors.noConversionMatrixFor(model)
+        }
+
+        self.matrixLock.lock()
+        defer { self.matrixLock.unlock() }
+
+        if let matrix = self.matrices[modelName] {
+            return matrix
+        }
+
+        guard let xyz = try self.colorInfo?.xyzMatrixForModel(modelName) else {
+            throw Errors.noConversionMatrixFor(model)
+        }
+        let matrix = CameraColorInfo.conversionMatrixFrom(xyz: xyz)
+        self.matrices[modelName] = matrix
+
+        return matrix
+    }
+
+    // MARK: - Types
+    /**
+     * Options for how images are decoded
+     */
+    public struct Options {
+        /// Debayering algorithm; the reduced size algorithms are much faster
+        public var algorithm: UInt = 1
+        /// Factor to convert the 16-bit components to floating point; the default assumes 14-bit data
+        public var scale: Float = (1.0 / 16384.0)
+        /// When set, pixels are 16-bit rather than 32-bit floats
+        public var halfFloat: Bool = false
+
+        public init() {}
+    }
+
+    /**
+     * A successfully decoded image
+     */
+    public struct Output {
+        /// URL of the file the image was read from
+        public let url: URL
+        /// Decoded image, with its metadata and raw statistics; its raw values have been released
+        public let image: CR2Image
+        /// RGBA pixels in the working color space
+        public let pixels: Data
+        /// Size of the pixel data
+        public let size: CGSize
+        /// Number of bytes per line of pixel data
+        public let bytesPerRow: Int
+    }
+
+    /**
+     * State of a single image making its way through the stages
+     */
+    private class Job {
+        /// File to decode
+        let url: URL
+        /// Decoding options, captured when the image was submitted
+        let options: Options
+        /// Number of bytes of memory reserved for this image (protected by the decoder's lock)
+        var reserved: UInt64
+        /// Generation of the decoder this image was submitted in (protected by the decoder's lock)
+        var generation: UInt = 0
+
+        /// File contents, once read
+        var data: Data?
+        /// Decoded raw image
+        var image: CR2Image?
+
+        /// Batch this image belongs to
+        private let group: DispatchGroup
+        /// Completion handler of the batch
+        private let completion: (URL, Result<Output, Error>) -> Void
+
+        init(_ url: URL, _ options: Options, _ reserved: UInt64, _ group: DispatchGroup,
+             _ completion: @escaping (URL, Result<Output, Error>) -> Void) {
+            self.url = url
+            self.options = options
+            self.reserved = reserved
+            self.group = group
+            self.completion = completion
+        }
+
+        /**
+         * Invokes the completion handler and marks the image as done in its batch.
+         */
+        func complete(_ result: Result<Output, Error>) {
+            self.completion(self.url, result)
+            self.group.leave()
+        }
+    }
+
+    // MARK: - Errors
+    public enum Errors: Error {
+        /// Decoding was cancelled before the image was finished
+        case cancelled
+        /// The file at the given URL has no raw data
+        case noRawData(_ url: URL)
+        /// The debayering algorithm is invalid
+        case invalidAlgorithm(_ algorithm: UInt)
+        /// There is no color space conversion matrix for the given camera model
+        case noConversionMatrixFor(_ model: String?)
+        /// Memory for the output couldn't be allocated
+        case allocationFailed
+    }
+}
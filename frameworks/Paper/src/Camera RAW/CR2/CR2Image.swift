@@ -25,7 +25,7 @@ public class CR2Image {
     // MARK: - Raw image
     /// Size of the raw image, before trimming borders or any other processing to discard data
     internal(set) public var rawSize: CGSize = .zero
-    /// Raw bitplanes
+    /// Raw bitplanes, as output by the JPEG decompressor; empty when it unslices the image directly
     internal(set) public var rawPlanes: [Data] = []
 
     /// Dimensions of visible image data
@@ -37,9 +37,25 @@ public class CR2Image {
     
     /// Black level factors, for each CFA index
     internal(set) public var rawBlackLevel: [UInt16] = []
+    /// Histogram of raw sensor values in the visible area, for each CFA index; each bin covers 16 values
+    internal(set) public var rawHistogram: [[UInt32]] = []
     /// White balance compensation factors, in RG/GB order
     internal(set) public var rawWbMultiplier: [Double] = []
 
+    // MARK: - Processed image
+    /// Debayered pixels in the working color space (4 components per pixel), if the raw data was streamed
+    internal(set) public var processedValues: Data?
+    /// Size of the processed image, in pixels
+    internal(set) public var processedSize: CGSize = .zero
+    /// Number of bytes per line of the processed image
+    internal(set) public var processedBytesPerRow: Int = 0
+    /// Histogram of the processed pixels over [0, 1], if requested: counts for red, green, blue and luminance, one
+    /// after another
+    internal(set) public var processedHistogram: [UInt32] = []
+    /// Reduced size levels of the processed image, if requested; each is half the size of the previous one (rounding
+    /// down), with the same pixel format and no padding between lines
+    internal(set) public var processedLevels: [Data] = []
+
     // MARK: - Initialization
     internal init() {}
 }
@@ -0,0 +1,67 @@
+//
+//  CR2RawStream.h
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200829.
+//
+
+#import <Foundation/Foundation.h>
+#import <simd/simd.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+extern NSErrorDomain const CR2RawStreamErrorDomain;
+
+@class CJPEGDecompressor;
+@class PAPDecodeStats;
+
+/**
+ * Debayers and color converts raw data in bands while it's being decompressed, rather than after the full
+ * sensor image has been decoded and trimmed.
+ */
+@interface CR2RawStream : NSObject
+
+- (instancetype) initWithAlgorithm:(NSUInteger) algo colorMatrix:(simd_float3x3) matrix
+                             scale:(float) scale halfFloat:(BOOL) halfFloat;
+
+- (void) useOutputBuffer:(void *) buffer length:(NSUInteger) length bytesPerRow:(NSUInteger) bytesPerRow;
+- (void) collectOutputHistogramWithBuckets:(NSUInteger) buckets;
+- (void) buildPyramidWithLevels:(NSUInteger) levels;
+
+- (BOOL) startWithDecompressor:(CJPEGDecompressor *) input sensorSize:(CGSize) size
+                       borders:(NSArray<NSNumber *> *) borders wbShift:(NSArray<NSNumber *> *) wb
+                         error:(NSError **) error;
+- (BOOL) updateWithError:(NSError **) error;
+- (BOOL) finishWithError:(NSError **) error;
+
+/// If set, the time spent in each stage of processing the bands is recorded into these stats; set this before
+/// starting the stream
+@property (nonatomic, nullable) PAPDecodeStats *stats;
+
+/// Whether the stream has been started
+@property (nonatomic, readonly) BOOL isStarted;
+
+/// Output pixels, with 4 components per pixel; allocated when the stream is started, unless the caller
+/// supplied its own output buffer
+@property (nonatomic, readonly, nullable) NSMutableData *output;
+/// Size of the output image, in pixels
+@property (nonatomic, readonly) CGSize outputSize;
+/// Number of bytes per line of the output
+@property (nonatomic, readonly) NSUInteger bytesPerRow;
+
+/// Vertical shift of the Bayer matrix the image was debayered with
+@property (nonatomic, readonly) NSUInteger bayerShift;
+/// Black level for each of the 4 bayer components
+@property (nonatomic, readonly) NSArray<NSNumber *> *blackLevel;
+/// Histogram of visible raw values for each of the 4 bayer components; each is an array of `UInt32` bins
+@property (nonatomic, readonly) NSArray<NSData *> *histogram;
+/// Histogram of the output pixels, if requested: `UInt32` counts for red, green, blue and luminance, in that
+/// order, over the [0, 1] range
+@property (nonatomic, readonly, nullable) NSData *outputHistogram;
+/// Reduced size levels of the output, if requested, each half the size of the previous one (rounding down); they
+/// have the same pixel format as the output, with no padding between lines
+@property (nonatomic, readonly) NSArray<NSData *> *pyramidLevels;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,339 @@
+//
+//  CR2RawStream.m
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200829.
+//
+
+#import "CR2RawStream.h"
+#import "CJPEGDecompressor.h"
+#import "CJPEGDecompressor+Private.h"
+#import "PAPDecodeContext+Private.h"
+#import "PAPDecodeStats+Private.h"
+
+#import "rawstream.h"
+
+NSErrorDomain const CR2RawStreamErrorDomain = @"CR2RawStreamErrorDomain";
+
+@interface CR2RawStream ()
+
+// Streaming state, once started
+@property (nonatomic) cr2_stream_t *stream;
+// Decompressor the stream reads from; kept around since the stream reads its output plane
+@property (nonatomic) CJPEGDecompressor *input;
+
+// Processing configuration
+@property (nonatomic) NSUInteger algorithm;
+@property (nonatomic) simd_float3x3 matrix;
+@property (nonatomic) float scale;
+@property (nonatomic) BOOL halfFloat;
+
+// Caller supplied output buffer, if any
+@property (nonatomic) void *outputBuffer;
+@property (nonatomic) NSUInteger outputBufferLength;
+
+// Histogram of the output pixels, if requested; the stream counts into its buckets
+@property (nonatomic) pixel_histogram_t *outputHistogramInfo;
+@property (nonatomic, nullable) NSMutableData *outputHistogramData;
+
+// Number of pyramid levels to build from the output, if any
+@property (nonatomic) NSUInteger numPyramidLevels;
+@property (nonatomic) image_pyramid_t *pyramid;
+@property (nonatomic) NSArray<NSData *> *pyramidLevels;
+
+@property (nonatomic, nullable) NSMutableData *output;
+@property (nonatomic) CGSize outputSize;
+@property (nonatomic) NSUInteger bytesPerRow;
+
+// Results of the statistics collected while streaming
+@property (nonatomic) NSUInteger bayerShift;
+@property (nonatomic) NSArray<NSNumber *> *blackLevel;
+@property (nonatomic) NSArray<NSData *> *histogram;
+
+- (NSError *) errorForCode:(NSInteger) code;
+
+@end
+
+@implementation CR2RawStream
+
+/**
+ * Creates a new raw stream, which debayers with the given algorithm and multiplies each pixel by the
+ * matrix (as a row vector) after scaling it by the given factor.
+ */
+- (instancetype) initWithAlgorithm:(NSUInteger) algo colorMatrix:(simd_float3x3) matrix
+                             scale:(float) scale halfFloat:(BOOL) halfFloat {
+    self = [super init];
+    if (self) {
+        NSAssert(DebayerScaleFactor((debayer_algorithm_t) algo) != 0,
+                 @"Invalid debayer algorithm: %lu", (unsigned long)algo);
+        
+        self.algorithm = algo;
+        self.matrix = matrix;
+        self.scale = scale;
+        self.halfFloat = halfFloat;
+        
+        self.blackLevel = @[];
+        self.histogram = @[];
+        self.pyramidLevels = @[];
+    }
+    return self;
+}
+
+/**
+ * Writes the output pixels into the given buffer, rather than a newly allocated one. This lets them go
+ * straight into memory handed to the GPU, such as an IOSurface or a shared Metal buffer, without copying.
+ *
+ * The buffer must stay valid until the stream is finished; call this before starting it.
+ *
+ * @param length Number of bytes available in the buffer
+ * @param bytesPerRow Number of bytes between the starts of consecutive lines in the buffer
+ */
+- (void) useOutputBuffer:(void *) buffer length:(NSUInteger) length bytesPerRow:(NSUInteger) bytesPerRow {
+    NSAssert(self.stream == nil, @"Stream already started");
+    NSAssert(buffer != NULL, @"Invalid output buffer");
+    
+    self.outputBuffer = buffer;
+    self.outputBufferLength = length;
+    self.bytesPerRow = bytesPerRow;
+}
+
+/**
+ * Counts the output pixels into a histogram of the [0, 1] range with the given number of buckets, as they are
+ * written. Call this before starting the stream.
+ */
+- (void) collectOutputHistogramWithBuckets:(NSUInteger) buckets {
+    NSAssert(self.stream == nil, @"Stream already started");
+    NSAssert(buckets >= 2, @"Invalid number of buckets: %lu", (unsigned long) buckets);
+    
+    self.outputHistogramData = [NSMutableData dataWithLength:(4 * buckets * sizeof(uint32_t))];
+    
+    if (!self.outputHistogramInfo) {
+        self.outputHistogramInfo = calloc(1, sizeof(pixel_histogram_t));
+        NSAssert(self.outputHistogramInfo, @"Failed to allocate histogram info");
+    }
+    
+    self.outputHistogramInfo->buckets = buckets;
+    self.outputHistogramInfo->min = 0.f;
+    self.outputHistogramInfo->max = 1.f;
+    self.outputHistogramInfo->counts = self.outputHistogramData.mutableBytes;
+}
+
+/**
+ * Histogram of the output pixels, once the stream has finished. It holds `UInt32` counts for red, green, blue
+ * and luminance, in that order.
+ */
+- (NSData *) outputHistogram {
+    return self.outputHistogramData;
+}
+
+/**
+ * Builds reduced size levels of the output from each band, right after it's been written. Call this before
+ * starting the stream.
+ *
+ * The number of levels is limited by the height of the bands, and the size of the output.
+ */
+- (void) buildPyramidWithLevels:(NSUInteger) levels {
+    NSAssert(self.stream == nil, @"Stream already started");
+    self.numPyramidLevels = levels;
+}
+
+- (void) dealloc {
+    CR2StreamRelease(self.stream);
+    PyramidRelease(self.pyramid);
+    free(self.outputHistogramInfo);
+}
+
+/**
+ * Whether the stream has been started
+ */
+- (BOOL) isStarted {
+    return (self.stream != nil);
+}
+
+/**
+ * Sets up the stream to process the output of the given decompressor, and allocates the output buffer.
+ *
+ * @param size Size of the sensor, including its borders
+ * @param inBorders Array of border indices, starting with top and going cw.
+ * @param inWb White balance multipliers for each of the 4 bayer elements
+ */
+- (BOOL) startWithDecompressor:(CJPEGDecompressor *) input sensorSize:(CGSize) size
+                       borders:(NSArray<NSNumber *> *) inBorders wbShift:(NSArray<NSNumber *> *) inWb
+                         error:(NSError **) error {
+    cr2_stream_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    
+    // validate inputs
+    NSAssert(self.stream == nil, @"Stream already started");
+    NSAssert(inBorders.count == 4, @"Invalid border array length: %lu", inBorders.count);
+    NSAssert(inWb.count == 4, @"Invalid white balance array length: %lu", inWb.count);
+    
+    // build the configuration
+    cfg.rowWidth = size.width;
+    cfg.numRows = size.height;
+    
+    for (NSUInteger i = 0; i < 4; i++) {
+        cfg.borders[i] = inBorders[i].unsignedIntegerValue;
+        cfg.wb[i] = inWb[i].doubleValue;
+    }
+    
+    for (NSUInteger i = 0; i < 3; i++) {
+        for (NSUInteger j = 0; j < 3; j++) {
+            cfg.matrix[(i * 3) + j] = self.matrix.columns[i][j];
+        }
+    }
+    
+    cfg.algo = (debayer_algorithm_t) self.algorithm;
+    cfg.scale = self.scale;
+    
+    cfg.output.format = self.halfFloat ? kPixelFormatF16 : kPixelFormatF32;
+    cfg.output.channels = 4;
+    cfg.output.order = kPixelChannelOrderRGB;
+    cfg.output.histogram = self.outputHistogramInfo;
+    cfg.output.stats = self.stats.stats;
+    
+    // allocate the output, unless the caller provided one
+    const size_t factor = DebayerScaleFactor(cfg.algo);
+    const size_t width = ((cfg.borders[1] - cfg.borders[3]) + 1) / factor;
+    const size_t height = ((cfg.borders[2] - cfg.borders[0]) + 1) / factor;
+    
+    self.outputSize = CGSizeMake(width, height);
+    // buffers come from the decompressor's context, if it has one
+    PAPDecodeContext *context = input.context;
+    cfg.pool = context.pool;
+    
+    if (self.outputBuffer) {
+        cfg.output.base = self.outputBuffer;
+        cfg.outLength = self.outputBufferLength;
+    } else {
+        self.bytesPerRow = width * PixelLayoutBytesPerPixel(&cfg.output);
+        
+        if (context) {
+            self.output = [context bufferWithLength:(self.bytesPerRow * height)];
+        } else {
+            self.output = [NSMutableData dataWithLength:(self.bytesPerRow * height)];
+        }
+        
+        if (!self.output) {
+            if (error) *error = [self errorForCode:-1];
+            return NO;
+        }
+        
+        cfg.output.base = self.output.mutableBytes;
+        cfg.outLength = self.output.length;
+    }
+    
+    cfg.output.stride = self.bytesPerRow;
+    
+    // set up the pyramid; every level's lines must come from a single band
+    if (self.numPyramidLevels) {
+        const size_t bandLines = CR2StreamOutputBandLines(cfg.algo);
+        NSUInteger levels = self.numPyramidLevels;
+        
+        while (levels && (bandLines % (1 << levels))) {
+            levels--;
+        }
+        
+        self.pyramid = PyramidNew(cfg.output.format, width, height, levels);
+        cfg.pyramid = self.pyramid;
+    }
+    
+    // create the stream
+    self.input = input;
+    self.stream = CR2StreamNew(input.dec, &cfg);
+    
+    if (!self.stream) {
+        self.output = nil;
+        
+        if (error) *error = [self errorForCode:-1];
+        return NO;
+    }
+    
+    return YES;
+}
+
+/**
+ * Processes all bands for which enough lines have been decompressed. Call this whenever the decompressor
+ * has made progress.
+ */
+- (BOOL) updateWithError:(NSError **) error {
+    NSAssert(self.stream != nil, @"Stream not started");
+    
+    int err = CR2StreamUpdate(self.stream);
+    if (err != 0) {
+        if (error) *error = [self errorForCode:err];
+        return NO;
+    }
+    
+    return YES;
+}
+
+/**
+ * Processes the remaining bands once the decompressor is done, then derives the black levels and
+ * histogram from the statistics collected along the way.
+ */
+- (BOOL) finishWithError:(NSError **) error {
+    cr2_raw_stats_t *stats;
+    uint16_t outLevels[4] = {0, 0, 0, 0};
+    size_t vShift = 0;
+    
+    NSAssert(self.stream != nil, @"Stream not started");
+    
+    stats = malloc(sizeof(cr2_raw_stats_t));
+    NSAssert(stats, @"Failed to allocate stats");
+    
+    int err = CR2StreamFinish(self.stream, stats, &vShift);
+    if (err != 0) {
+        free(stats);
+        
+        if (error) *error = [self errorForCode:err];
+        return NO;
+    }
+    
+    // derive values from the stats
+    self.bayerShift = vShift;
+    
+    CR2CalculateBlackLevel(stats, outLevels);
+    
+    NSMutableArray *levels = [NSMutableArray new];
+    NSMutableArray *histograms = [NSMutableArray new];
+    
+    for (NSUInteger i = 0; i < 4; i++) {
+        [levels addObject:@(outLevels[i])];
+        [histograms addObject:[NSData dataWithBytes:stats->histogram[i]
+                                             length:sizeof(stats->histogram[i])]];
+    }
+    
+    self.blackLevel = [levels copy];
+    self.histogram = [histograms copy];
+    
+    // copy out the pyramid levels
+    if (self.pyramid) {
+        NSMutableArray *pyramidLevels = [NSMutableArray new];
+        
+        for (size_t i = 1; i <= PyramidNumLevels(self.pyramid); i++) {
+            pixel_layout_t level;
+            size_t levelHeight;
+            PyramidGetLevel(self.pyramid, i, &level, NULL, &levelHeight);
+            
+            [pyramidLevels addObject:[NSData dataWithBytes:level.base length:(level.stride * levelHeight)]];
+        }
+        
+        self.pyramidLevels = [pyramidLevels copy];
+        
+        PyramidRelease(self.pyramid);
+        self.pyramid = NULL;
+    }
+    
+    free(stats);
+    return YES;
+}
+
+/**
+ * Creates an error with the given code.
+ */
+- (NSError *) errorForCode:(NSInteger) code {
+    return [NSError errorWithDomain:CR2RawStreamErrorDomain code:code userInfo:nil];
+}
+
+@end
@@ -8,6 +8,7 @@
 import Foundation
 import CoreGraphics
 import OSLog
+import simd
 
 /**
  * Implements an event-driven reader for the Canon RAW version 2 files.
@@ -42,6 +43,35 @@ public class CR2Reader {
     private var shouldDecodeRaw: Bool = false
     /// Should thumbnails be decoded?
     private var shouldDecodeThumbs: Bool = false
+    
+    /**
+     * Invoked right before the raw data is decoded, with the metadata read so far. If it returns an output
+     * description, the raw data is debayered and color converted in bands while it's being decompressed; the
+     * image then has its `processedValues` set rather than `rawValues`.
+     */
+    public var streamingOutputProvider: ((CR2Image) throws -> StreamingOutput?)? = nil
+    
+    /**
+     * Context whose decompressor and buffers are reused for decoding the raw data. Sharing one context between
+     * readers of images with the same geometry avoids allocating fresh memory for each image; buffers return to the
+     * context once the decoded image is released.
+     */
+    public var decodeContext: PAPDecodeContext? = nil
+    
+    /**
+     * When set, the time spent in each stage of decoding the raw data (and, when streaming, processing it) is recorded
+     * into these stats, along with the decompressor's slow path events and the buffers requested.
+     */
+    public var stats: PAPDecodeStats? = nil
+    
+    /**
+     * When set, memory used for decoding is given back as soon as it's no longer needed: the decompressor frees its
+     * copy of the entropy coded data before the raw data is trimmed, and the trimmed image is copied into a buffer of
+     * its own size, so the full size plane goes back to the decode context (or is freed) right away. This keeps long
+     * lived decoded images (such as in the render service and batch decodes) as small as possible, at the cost of a
+     * copy of the image and the decompressor allocating its buffers afresh for the next decode.
+     */
+    public var leanMemory: Bool = false
 
     // MARK: - Initialization
     /**
@@ -385,7 +415,7 @@ public class CR2Reader {
     }
 
     // MARK: - Raw data
-    /// Destination buffer for unslicing
+    /// Unsliced sensor data; the JPEG decompressor writes into this buffer directly
     private var unsliceBuf: NSMutableData!
     /// Unslicing implementation (ObjC wrapper around the C functions)
     private var unslicer: CR2Unslicer!
@@ -427,34 +457,71 @@ public class CR2Reader {
             throw RawError.missingTag(0x0117)
         }
 
-        // decompress lossless JPEG data
+        // process the raw data while it's decompressed, if desired
+        self.image.meta = self.meta.finalize()
+        
+        if let output = try self.streamingOutputProvider?(self.image) {
+            try self.streamRawData(Int(offset.value), length: Int(length.value),
+                                   slices: slices.value, output: output)
+            return
+        }
+        
+        // decompress lossless JPEG data straight into the unsliced sensor layout
         try self.decompressRawData(Int(offset.value),
-                                   length: Int(length.value))
-
-        // allocate output buffer and unslice image
-        let bytes = Int(self.image.rawSize.width * self.image.rawSize.height * 2)
-        self.unsliceBuf = NSMutableData(length: bytes)
+                                   length: Int(length.value), slices: slices.value)
 
-        try self.unslice(slices.value)
+        self.unsliceBuf = self.jpeg.decompressor.output
+        self.makeUnslicer(slices.value)
         
-        // calculate some values from the image before trimming
-        self.image.rawValuesVshift = self.calculateRawVshift()
-        self.image.rawBlackLevel = self.calculateRawBlackLevel()
+        if self.leanMemory {
+            self.jpeg.decompressor.releaseBuffers()
+        }
+        
+        // calculate some values from the image while removing its borders, then copy data
+        self.collectRawStats()
         
-        // remove borders from image, then copy data
-        self.trimRawBorders()
+        if self.leanMemory {
+            self.unslicer.releaseTrimmedCapacity()
+            self.unsliceBuf = self.unslicer.output
+        }
 
-        self.image.rawValues = self.unsliceBuf as Data?
-        self.image.rawPlanes.append(self.jpeg.decompressor.output as Data)
+        self.image.rawValues = Data(wrapping: self.unsliceBuf, count: Int(self.unslicer.trimmedLength))
+        
+        // let the decompressor go back to the decode context for the next image
+        self.unslicer = nil
+        self.unsliceBuf = nil
+        self.jpeg = nil
     }
 
     /**
      * Decompresses raw data.
      *
-     * In the CR2 file, raw pixel data is compressed using the JPEG lossless (ITU-T81) algorithm.
+     * In the CR2 file, raw pixel data is compressed using the JPEG lossless (ITU-T81) algorithm. The
+     * image is stored as several vertical slices, which the decompressor reassembles as it decodes.
      */
-    private func decompressRawData(_ offset: Int, length: Int) throws {
+    private func decompressRawData(_ offset: Int, length: Int, slices: [UInt32],
+                                   stream: CR2RawStream? = nil) throws {
         self.jpeg = try JPEGDecoder(withData: &self.data, offset: offset)
+        self.jpeg.unslicingInfo = slices
+        self.jpeg.context = self.decodeContext
+        self.jpeg.stats = self.stats
+        
+        // hand decoded lines to the stream as they become available
+        if let stream = stream {
+            let size = CGSize(width: self.sensor.width, height: self.sensor.height)
+            let borders = self.sensorBorders as [NSNumber]
+            let wb = self.image.rawWbMultiplier.map(NSNumber.init)
+            
+            self.jpeg.linesPerChunk = Self.streamChunkLines
+            self.jpeg.chunkHandler = { decompressor in
+                if !stream.isStarted {
+                    try stream.start(with: decompressor, sensorSize: size, borders: borders,
+                                     wbShift: wb)
+                }
+                try stream.update()
+            }
+        }
+        
         try self.jpeg.decode()
         
         // get the raw decoded image size
@@ -477,11 +544,71 @@ public class CR2Reader {
     }
 
     /**
-     * Converts raw data from its sliced format into one big plane containing the RG/GB values.
+     * Decompresses raw data, passing bands of lines through trimming, debayering and color conversion on other
+     * cores as soon as they have been decoded.
+     *
+     * Since the slices of a CR2 image span its entire height, lines only complete once the last slice is being
+     * decoded; the black level and Bayer shift are determined from the preceding slices at that point. This
+     * path never keeps a trimmed copy of the sensor data or a full size intermediate buffer around.
      */
-    private func unslice(_ sliceInfo: [UInt32]) throws {
+    private func streamRawData(_ offset: Int, length: Int, slices: [UInt32],
+                               output: StreamingOutput) throws {
+        let stream = CR2RawStream(algorithm: output.algorithm, colorMatrix: output.colorMatrix,
+                                  scale: output.scale, halfFloat: output.halfFloat)
+        stream.stats = self.stats
+        
+        if let buffer = output.destination, let base = buffer.baseAddress {
+            stream.useOutputBuffer(base, length: UInt(buffer.count),
+                                   bytesPerRow: UInt(output.destinationBytesPerRow))
+        }
+        if output.histogramBuckets > 0 {
+            stream.collectOutputHistogram(withBuckets: UInt(output.histogramBuckets))
+        }
+        if output.pyramidLevels > 0 {
+            stream.buildPyramid(withLevels: UInt(output.pyramidLevels))
+        }
+        
+        try self.decompressRawData(offset, length: length, slices: slices, stream: stream)
+        try stream.finish()
+        
+        // the sensor data isn't needed anymore
+        if self.leanMemory {
+            self.jpeg.decompressor.releaseBuffers()
+        }
+        self.jpeg = nil
+        
+        // copy out the results
+        self.image.rawValuesVshift = stream.bayerShift
+        self.image.rawBlackLevel = stream.blackLevel.map({ $0.uint16Value })
+        self.image.rawHistogram = stream.histogram.map({ data in
+            return data.withUnsafeBytes({ Array($0.bindMemory(to: UInt32.self)) })
+        })
+        
+        self.image.visibleImageSize = CGSize(width: self.sensor.effectiveWidth,
+                                             height: self.sensor.effectiveHeight)
+        
+        self.image.processedValues = stream.output.map(Data.init(wrapping:))
+        self.image.processedSize = stream.outputSize
+        self.image.processedBytesPerRow = Int(stream.bytesPerRow)
+        self.image.processedHistogram = stream.outputHistogram.map({ data in
+            return data.withUnsafeBytes({ Array($0.bindMemory(to: UInt32.self)) })
+        }) ?? []
+        self.image.processedLevels = stream.pyramidLevels
+    }
+    
+    /// Positions of the sensor borders, starting with the top and going clockwise
+    private var sensorBorders: [Int] {
+        return [
+            self.sensor.borderTop, self.sensor.borderRight,
+            self.sensor.borderBottom, self.sensor.borderLeft
+        ]
+    }
 
-        // create and configure unslicer
+    /**
+     * Sets up the unslicer helper on the unsliced plane, which is used to derive some information about
+     * the image and trim its borders.
+     */
+    private func makeUnslicer(_ sliceInfo: [UInt32]) {
         var slicingInfo: [NSNumber] = []
         for x in sliceInfo {
             slicingInfo.append(NSNumber(value: x))
@@ -492,60 +619,70 @@ public class CR2Reader {
         self.unslicer = CR2Unslicer(input: self.jpeg.decompressor,
                                     andOutput: self.unsliceBuf,
                                     slicingInfo: slicingInfo, sensorSize: size)
-
-        // let er rip
-        self.unslicer.unslice()
+        self.unslicer.stats = self.stats
     }
     
     /**
-     * Trims the image buffer in place to remove borders.
+     * Determines the Bayer shift, black levels and raw histogram of the image, while trimming the image
+     * buffer in place to remove borders. The calculations are implemented in C, in a single pass.
      */
-    private func trimRawBorders() {
+    private func collectRawStats() {
         // we don't need to trim if the borders are zero
-        if self.sensor.effectiveWidth == self.sensor.width &&
-           self.sensor.effectiveHeight == self.sensor.height {
-            return
-        }
+        let trim = self.sensor.effectiveWidth != self.sensor.width ||
+                   self.sensor.effectiveHeight != self.sensor.height
         
-        // perform trimming; this is implemented in C
-        let borders: [Int] = [
-            self.sensor.borderTop, self.sensor.borderRight,
-            self.sensor.borderBottom, self.sensor.borderLeft
-        ]
+        self.unslicer.collectStats(withBorders: self.sensorBorders as [NSNumber], trim: trim)
         
-        self.unslicer.trimBorders(borders as [NSNumber])
+        // copy out the results
+        self.image.rawValuesVshift = self.unslicer.bayerShift
+        self.image.rawBlackLevel = self.unslicer.blackLevel.map({ $0.uint16Value })
+        self.image.rawHistogram = self.unslicer.histogram.map({ data in
+            return data.withUnsafeBytes({ Array($0.bindMemory(to: UInt32.self)) })
+        })
         
         // store trimmed size
-        self.image.visibleImageSize = CGSize(width: self.sensor.effectiveWidth,
-                                          height: self.sensor.effectiveHeight)
+        if trim {
+            self.image.visibleImageSize = CGSize(width: self.sensor.effectiveWidth,
+                                                 height: self.sensor.effectiveHeight)
+        }
     }
-    
+
+    // MARK: - Types
     /**
-     * Determine whether the first row of image data is likely to be the RG row of the Bayer array, or if it is
-     * shifted by one and is the GB row.
+     * Describes how raw data is processed while it's being decoded
      */
-    private func calculateRawVshift() -> UInt {
-        let borders: [Int] = [
-            self.sensor.borderTop, self.sensor.borderRight,
-            self.sensor.borderBottom, self.sensor.borderLeft
-        ]
+    public struct StreamingOutput {
+        /// Debayering algorithm to use; see `PAPDebayerer`
+        public var algorithm: UInt
+        /// Matrix converting sensor RGB to the working color space
+        public var colorMatrix: simd_float3x3
+        /// Factor to convert the 16-bit components to floating point, e.g. 1/16384 for 14-bit data
+        public var scale: Float
+        /// When set, pixels are 16-bit rather than 32-bit floats
+        public var halfFloat: Bool
         
-        return self.unslicer.calculateBayerShift(withBorders: borders as [NSNumber])
-    }
-    
-    /**
-     * Calculates the black levels in the image.
-     */
-    private func calculateRawBlackLevel() -> [UInt16] {
-        let borders: [Int] = [
-            self.sensor.borderTop, self.sensor.borderRight,
-            self.sensor.borderBottom, self.sensor.borderLeft
-        ]
-        let shift = self.unslicer.calculateBlackLevel(withBorders: borders as [NSNumber])
+        /// Memory to write the pixels into, such as the contents of a locked IOSurface or a shared Metal
+        /// buffer; if not set, a buffer is allocated and stored in the image's processed values instead. It
+        /// must stay valid until decoding completes.
+        public var destination: UnsafeMutableRawBufferPointer? = nil
+        /// Number of bytes between the starts of consecutive lines in the destination
+        public var destinationBytesPerRow: Int = 0
+        
+        /// If nonzero, a histogram of the output pixels with this many buckets is counted while they're written,
+        /// and stored in the image's processed histogram
+        public var histogramBuckets: Int = 0
+        /// Number of reduced size levels to build from the output pixels while they're written, and store in the
+        /// image's processed levels; fewer may be built for small images
+        public var pyramidLevels: Int = 0
         
-        return shift.map({ $0.uint16Value })
+        public init(algorithm: UInt, colorMatrix: simd_float3x3, scale: Float, halfFloat: Bool) {
+            self.algorithm = algorithm
+            self.colorMatrix = colorMatrix
+            self.scale = scale
+            self.halfFloat = halfFloat
+        }
     }
-
+    
     // MARK: - Errors
     enum HeaderError: Error {
         /// The Canon RAW header is invalid. ('CR' signature missing)
@@ -589,6 +726,9 @@ public class CR2Reader {
     static let rawIfdAddressOffset: Int = 12
     
     // MARK: - Constants
+    /// Number of lines decompressed at a time when streaming raw data
+    private static let streamChunkLines: UInt = 16
+    
     /**
      * Array of supported camera types
      */
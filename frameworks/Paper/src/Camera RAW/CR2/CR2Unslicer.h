@@ -10,15 +10,29 @@
 NS_ASSUME_NONNULL_BEGIN
 
 @class CJPEGDecompressor;
+@class PAPDecodeStats;
 
 @interface CR2Unslicer : NSObject
 
 - (instancetype) initWithInput:(CJPEGDecompressor *) input andOutput:(NSMutableData *) outBuf slicingInfo:(NSArray<NSNumber *> *) slices sensorSize:(CGSize) size;
 
 - (void) unslice;
-- (NSUInteger) calculateBayerShiftWithBorders:(NSArray<NSNumber *> *) borders;
-- (NSArray<NSNumber *> *) calculateBlackLevelWithBorders:(NSArray<NSNumber *> *) inBorders;
-- (void) trimBorders:(NSArray<NSNumber *> *) borders;
+- (void) collectStatsWithBorders:(NSArray<NSNumber *> *) borders trim:(BOOL) trim;
+- (void) releaseTrimmedCapacity;
+
+/// If set, the time spent unslicing and collecting statistics is recorded into these stats
+@property (nonatomic, nullable) PAPDecodeStats *stats;
+
+/// Vertical shift of the Bayer matrix, determined by the last call to `collectStatsWithBorders:trim:`
+@property (nonatomic, readonly) NSUInteger bayerShift;
+/// Black level for each of the 4 bayer components
+@property (nonatomic, readonly) NSArray<NSNumber *> *blackLevel;
+/// Histogram of visible raw values for each of the 4 bayer components; each is an array of `UInt32` bins
+@property (nonatomic, readonly) NSArray<NSData *> *histogram;
+/// Number of bytes at the start of the output that hold the image; less than its length once trimmed
+@property (nonatomic, readonly) NSUInteger trimmedLength;
+/// Plane holding the image; replaced by a buffer of the trimmed size by `releaseTrimmedCapacity`
+@property (nonatomic, readonly) NSMutableData *output;
 
 @end
 
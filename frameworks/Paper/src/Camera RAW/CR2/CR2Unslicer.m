@@ -8,6 +8,8 @@
 #import "CR2Unslicer.h"
 #import "CJPEGDecompressor.h"
 #import "CJPEGDecompressor+Private.h"
+#import "PAPDecodeContext.h"
+#import "PAPDecodeStats+Private.h"
 
 #import "unslice.h"
 
@@ -23,6 +25,12 @@
 // Sensor size
 @property (nonatomic) CGSize sensorSize;
 
+// Results of the statistics pass
+@property (nonatomic) NSUInteger bayerShift;
+@property (nonatomic) NSArray<NSNumber *> *blackLevel;
+@property (nonatomic) NSArray<NSData *> *histogram;
+@property (nonatomic) NSUInteger trimmedLength;
+
 @end
 
 @implementation CR2Unslicer
@@ -38,6 +46,10 @@
 
         self.slicing = slices;
         self.sensorSize = size;
+
+        self.blackLevel = @[];
+        self.histogram = @[];
+        self.trimmedLength = outBuf.length;
     }
     return self;
 }
@@ -60,17 +72,30 @@
     NSAssert(outPtr, @"Failed to get output pointer");
 
     // call into C code
+    stage_interval_t interval = StageBegin(self.stats.stats, kStageUnslice);
+
     err = CR2Unslice(dec, outPtr, slices, self.sensorSize.width,
                      self.sensorSize.height);
     NSAssert(outPtr, @"Failed to unslice: %d", err);
+
+    StageEnd(self.stats.stats, &interval, err ? 0 : self.output.length);
+    StageFail(self.stats.stats, kStageUnslice, err);
 }
 
 /**
- * Calculates the bayer vertical shift.
+ * Collects statistics about the raw data (the Bayer shift, black levels and histogram) and optionally
+ * trims the image borders away, all in a single pass over the image.
+ *
+ * The output keeps its length when trimmed, since it may belong to a decode context's pool; only the first
+ * `trimmedLength` bytes hold the image afterwards.
  *
  * @param inBorders Array of border indices, starting with top and going cw.
+ * @param trim Whether the borders should be removed
  */
-- (NSUInteger) calculateBayerShiftWithBorders:(NSArray<NSNumber *> *) inBorders {
+- (void) collectStatsWithBorders:(NSArray<NSNumber *> *) inBorders trim:(BOOL) trim {
+    cr2_raw_stats_t *stats;
+    uint16_t outLevels[4] = {0, 0, 0, 0};
+    
     // validate inputs
     NSAssert(inBorders.count == 4, @"Invalid border array length: %lu", inBorders.count);
     
@@ -83,62 +108,68 @@
     uint16_t *outPtr = self.output.mutableBytes;
     NSAssert(outPtr, @"Failed to get output pointer");
     
-    return CR2CalculateBayerShift(outPtr, self.sensorSize.width, borders);
-}
+    stats = malloc(sizeof(cr2_raw_stats_t));
+    NSAssert(stats, @"Failed to allocate stats");
+    
+    // do it and remember how much of the buffer is left if trimmed
+    stage_interval_t interval = StageBegin(self.stats.stats, kStageRawStats);
 
-/**
- * Determine black level for each of the 4 bayer components
- */
-- (NSArray<NSNumber *> *) calculateBlackLevelWithBorders:(NSArray<NSNumber *> *) inBorders {
-    uint16_t outLevels[4];
+    size_t new = CR2CollectStats(outPtr, self.sensorSize.width, self.sensorSize.height,
+                                 borders, trim, stats);
+
+    StageEnd(self.stats.stats, &interval, trim ? new : 0);
     
-    // convert borders
-    NSAssert(inBorders.count == 4, @"Invalid border array length: %lu", inBorders.count);
+    if (trim) {
+        NSAssert(new > 0, @"Failed to trim image");
+        self.trimmedLength = new;
+    }
     
-    size_t borders[] = {
-        inBorders[0].unsignedIntegerValue, inBorders[1].unsignedIntegerValue,
-        inBorders[2].unsignedIntegerValue, inBorders[3].unsignedIntegerValue,
-    };
-
-    // get pointers
-    uint16_t *plane = self.output.mutableBytes;
-    NSAssert(plane, @"Failed to get output pointer");
+    // derive values from the stats
+    self.bayerShift = CR2CalculateBayerShift(stats);
     
-    // do it
-    CR2CalculateBlackLevel(plane, self.sensorSize.width,
-                           self.sensorSize.height, borders, outLevels);
+    CR2CalculateBlackLevel(stats, outLevels);
     
-    // convert output
-    NSMutableArray *arr = [NSMutableArray new];
+    NSMutableArray *levels = [NSMutableArray new];
+    NSMutableArray *histograms = [NSMutableArray new];
     
     for (NSUInteger i = 0; i < 4; i++) {
-        [arr addObject:@(outLevels[i])];
+        [levels addObject:@(outLevels[i])];
+        [histograms addObject:[NSData dataWithBytes:stats->histogram[i]
+                                             length:sizeof(stats->histogram[i])]];
     }
     
-    return [arr copy];
+    self.blackLevel = [levels copy];
+    self.histogram = [histograms copy];
+    
+    free(stats);
 }
 
 /**
- * Trims the image borders away.
+ * Moves the trimmed image into a buffer of its own size, so that the full size plane it was decoded into can
+ * go back to the decode context's pool (or be freed) once the decompressor is released. The new buffer is
+ * taken from the same context as the plane, if any.
+ *
+ * Nothing happens if the image wasn't trimmed.
  */
-- (void) trimBorders:(NSArray<NSNumber *> *) inBorders {
-    // validate inputs
-    NSAssert(inBorders.count == 4, @"Invalid border array length: %lu", inBorders.count);
-    
-    // build inputs
-    size_t borders[] = {
-        inBorders[0].unsignedIntegerValue, inBorders[1].unsignedIntegerValue,
-        inBorders[2].unsignedIntegerValue, inBorders[3].unsignedIntegerValue,
-    };
+- (void) releaseTrimmedCapacity {
+    NSMutableData *compact;
 
-    uint16_t *outPtr = self.output.mutableBytes;
-    NSAssert(outPtr, @"Failed to get output pointer");
-    
-    // do it and resize the buffer
-    size_t new = CR2Trim(outPtr, self.sensorSize.width, borders);
-    NSAssert(new > 0, @"Failed to trim image");
-    
-    [self.output setLength:new];
+    if (self.trimmedLength >= self.output.length) {
+        return;
+    }
+
+    PAPDecodeContext *context = self.input.context;
+
+    if (context) {
+        compact = [context bufferWithLength:self.trimmedLength];
+    } else {
+        compact = [NSMutableData dataWithLength:self.trimmedLength];
+    }
+
+    NSAssert(compact != nil, @"Failed to allocate trimmed plane (%lu bytes)", (unsigned long) self.trimmedLength);
+
+    memcpy(compact.mutableBytes, self.output.bytes, self.trimmedLength);
+    self.output = compact;
 }
 
 @end
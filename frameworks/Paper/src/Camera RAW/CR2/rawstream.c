@@ -0,0 +1,415 @@
+//
+//  rawstream.c
+//  Paper (macOS)
+//
+//  Processes the raw data of a CR2 file in bands of lines while it's being
+//  decompressed.
+//
+//  Created by Tristan Seifert on 20200829.
+//
+
+#include "rawstream.h"
+#include "decompress.h"
+#include "stagestats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <pthread/qos.h>
+#include <dispatch/dispatch.h>
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+// MARK: Constants
+/**
+ * Number of visible lines processed in each band. This is a multiple of the largest binning factor, so bands
+ * always start on a block boundary.
+ */
+#define kBandLines 128
+/// Maximum number of buffers in the ring
+#define kMaxSlots 8
+
+// MARK: Types
+/**
+ * Single buffer of the ring, along with the band it's currently processing
+ */
+typedef struct cr2_stream_slot {
+    /// Stream the slot belongs to
+    struct cr2_stream *stream;
+    /// Signalled when the slot is free to process another band
+    dispatch_semaphore_t free;
+
+    /// Index of the band being processed
+    size_t band;
+    /// Trimmed raw lines of the band, plus its context lines
+    uint16_t *lines;
+
+    /// Statistics of all bands processed in this slot
+    cr2_raw_stats_t stats;
+} cr2_stream_slot_t;
+
+/**
+ * Streaming state
+ */
+struct cr2_stream {
+    /// Decompressor producing the raw image
+    jpeg_decompressor_t *dec;
+    /// Raw image, as written by the decompressor
+    const uint16_t *plane;
+
+    cr2_stream_config_t cfg;
+
+    /// Size of the visible area of the image
+    size_t visibleWidth, visibleHeight;
+    /// Binning factor of the debayering algorithm
+    size_t factor;
+    /// Context lines above and below each band; a multiple of the binning factor
+    size_t halo;
+    /// Size of the output image
+    size_t outWidth, outHeight;
+
+    /// Number of bands, and the index of the next one to start
+    size_t numBands, nextBand;
+
+    /// Set once the black level and Bayer shift have been determined
+    bool ready;
+    /// Statistics used to determine the black level and Bayer shift
+    cr2_raw_stats_t prelimStats;
+    /// Black level for each CFA index
+    uint16_t black[4];
+    /// Vertical shift of the Bayer matrix
+    size_t vShift;
+
+    /// Ring of band buffers
+    cr2_stream_slot_t *slots;
+    size_t numSlots;
+    /// Size of each slot's line and pixel buffers, in bytes
+    size_t linesBytes;
+
+    /// Bands in flight
+    dispatch_group_t group;
+    /// Queue on which bands are processed
+    dispatch_queue_t queue;
+
+    /// Set if processing any of the bands failed
+    atomic_int err;
+};
+
+static void DetermineLevels(cr2_stream_t *stream);
+static bool BandIsReady(const cr2_stream_t *stream, size_t band);
+static void BandLines(const cr2_stream_t *stream, size_t band, size_t *first, size_t *last);
+static void ProcessBand(void *ctx);
+
+// MARK: - Setup
+/**
+ * Creates a stream for the given decompressor and configuration.
+ */
+cr2_stream_t *CR2StreamNew(jpeg_decompressor_t *dec, const cr2_stream_config_t *config) {
+    assert(dec);
+    assert(config);
+    assert(config->output.base);
+
+    const size_t *borders = config->borders;
+
+    // the decompressor must write the raw image in its final layout
+    if(!dec->outBuf || dec->lines != config->numRows) {
+        return NULL;
+    }
+    if((dec->unsliceOutput ? dec->unslicedWidth : (dec->samplesPerLine * dec->numComponents)) != config->rowWidth) {
+        return NULL;
+    }
+    if(borders[1] < borders[3] || borders[2] < borders[0] ||
+       borders[1] >= config->rowWidth || borders[2] >= config->numRows) {
+        return NULL;
+    }
+
+    const size_t factor = DebayerScaleFactor(config->algo);
+    if(!factor) return NULL;
+
+    // allocate it
+    cr2_stream_t *stream = calloc(1, sizeof(cr2_stream_t));
+    if(!stream) return NULL;
+
+    stream->dec = dec;
+    dec->refCount++;
+
+    stream->plane = dec->outBuf;
+    stream->cfg = *config;
+
+    stream->visibleWidth = (borders[1] - borders[3]) + 1;
+    stream->visibleHeight = (borders[2] - borders[0]) + 1;
+    stream->factor = factor;
+    stream->halo = (DebayerHaloLines(config->algo) + 3) & ~((size_t) 3);
+    stream->outWidth = stream->visibleWidth / factor;
+    stream->outHeight = stream->visibleHeight / factor;
+
+    atomic_init(&stream->err, 0);
+
+    // ensure the output is large enough
+    if(!stream->outWidth || !stream->outHeight ||
+       PixelLayoutValidate(&config->output, stream->outWidth, stream->outHeight, config->outLength) != 0) {
+        goto fail;
+    }
+
+    const size_t outBandLines = CR2StreamOutputBandLines(config->algo);
+
+    // bands must be aligned to the pyramid's smallest level, so they can each build their part of it
+    if(config->pyramid) {
+        if(PyramidValidate(config->pyramid, &config->output, stream->outWidth, stream->outHeight) != 0 ||
+           (outBandLines % PyramidLineAlignment(config->pyramid))) {
+            goto fail;
+        }
+    }
+
+    stream->numBands = (stream->outHeight + outBandLines - 1) / outBandLines;
+
+    // set up the ring of band buffers; about one per CPU
+    const size_t cpus = (size_t) MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    stream->numSlots = MAX(MIN(cpus, kMaxSlots), 2);
+
+    stream->slots = calloc(stream->numSlots, sizeof(cr2_stream_slot_t));
+    if(!stream->slots) goto fail;
+
+    stream->linesBytes = (kBandLines + (stream->halo * 2)) * stream->visibleWidth * sizeof(uint16_t);
+
+    for(size_t i = 0; i < stream->numSlots; i++) {
+        cr2_stream_slot_t *slot = &stream->slots[i];
+        slot->stream = stream;
+        slot->free = dispatch_semaphore_create(1);
+
+        slot->lines = BufferPoolGet(config->pool, stream->linesBytes);
+        if(!slot->lines) goto fail;
+        StageCountAllocation(config->output.stats, stream->linesBytes);
+    }
+
+    stream->group = dispatch_group_create();
+    stream->queue = dispatch_get_global_queue(qos_class_self(), 0);
+
+    // done
+    return stream;
+
+fail:;
+    CR2StreamRelease(stream);
+    return NULL;
+}
+
+/**
+ * Gets the number of output lines in each band.
+ */
+size_t CR2StreamOutputBandLines(debayer_algorithm_t algo) {
+    const size_t factor = DebayerScaleFactor(algo);
+    return factor ? (kBandLines / factor) : 0;
+}
+
+/**
+ * Releases the stream, after waiting for any bands in flight.
+ */
+void CR2StreamRelease(cr2_stream_t *stream) {
+    if(!stream) return;
+
+    if(stream->group) {
+        dispatch_group_wait(stream->group, DISPATCH_TIME_FOREVER);
+        dispatch_release(stream->group);
+    }
+
+    if(stream->slots) {
+        for(size_t i = 0; i < stream->numSlots; i++) {
+            if(stream->slots[i].free) {
+                dispatch_release(stream->slots[i].free);
+            }
+            BufferPoolPut(stream->cfg.pool, stream->slots[i].lines, stream->linesBytes);
+        }
+        free(stream->slots);
+    }
+
+    JPEGDecompressorRelease(stream->dec);
+    free(stream);
+}
+
+// MARK: - Processing
+/**
+ * Starts processing all bands whose lines (including their context) have been completely decompressed.
+ */
+int CR2StreamUpdate(cr2_stream_t *stream) {
+    assert(stream);
+
+    // the black level and Bayer shift are needed before anything can be debayered
+    if(!stream->ready) {
+        DetermineLevels(stream);
+        if(!stream->ready) return 0;
+    }
+
+    while(stream->nextBand < stream->numBands && BandIsReady(stream, stream->nextBand)) {
+        // wait for the band previously processed in this slot to complete
+        cr2_stream_slot_t *slot = &stream->slots[stream->nextBand % stream->numSlots];
+        dispatch_semaphore_wait(slot->free, DISPATCH_TIME_FOREVER);
+
+        slot->band = stream->nextBand++;
+        dispatch_group_async_f(stream->group, stream->queue, slot, ProcessBand);
+    }
+
+    return atomic_load(&stream->err);
+}
+
+/**
+ * Processes any remaining bands and waits for all of them, then combines the statistics of all slots.
+ */
+int CR2StreamFinish(cr2_stream_t *stream, cr2_raw_stats_t *stats, size_t *outVShift) {
+    assert(stream);
+    assert(stats);
+    assert(outVShift);
+
+    int err = CR2StreamUpdate(stream);
+    dispatch_group_wait(stream->group, DISPATCH_TIME_FOREVER);
+
+    if(!err) {
+        err = atomic_load(&stream->err);
+    }
+    if(!err && stream->nextBand != stream->numBands) {
+        err = -1;
+    }
+
+    // black levels cover the entire image; everything else was collected band by band
+    memset(stats, 0, sizeof(*stats));
+
+    memcpy(stats->blackSums, stream->prelimStats.blackSums, sizeof(stats->blackSums));
+    memcpy(stats->blackCounts, stream->prelimStats.blackCounts, sizeof(stats->blackCounts));
+
+    for(size_t i = 0; i < stream->numSlots; i++) {
+        const cr2_raw_stats_t *slotStats = &stream->slots[i].stats;
+
+        for(size_t c = 0; c < 4; c++) {
+            stats->sums[c] += slotStats->sums[c];
+
+            for(size_t bin = 0; bin < CR2_HISTOGRAM_BINS; bin++) {
+                stats->histogram[c][bin] += slotStats->histogram[c][bin];
+            }
+        }
+    }
+
+    *outVShift = stream->vShift;
+    return err;
+}
+
+/**
+ * Determines the black level and Bayer shift, if enough of the image has been decompressed.
+ *
+ * Once decoding reaches the last slice, all columns to its left are complete; if they include the entire
+ * left border, the black level is exactly the same as if the whole image had been decoded. The Bayer shift
+ * is decided from the visible part of those columns, which is the majority of the image.
+ */
+static void DetermineLevels(cr2_stream_t *stream) {
+    jpeg_decompressor_t *dec = stream->dec;
+    const size_t *borders = stream->cfg.borders;
+
+    // lines only start to complete in the last slice
+    const size_t maxCol = JPEGDecompressorCompletedColumns(dec);
+
+    if(!JPEGDecompressorIsDone(dec) &&
+       (!JPEGDecompressorCompletedLines(dec) || maxCol <= borders[3])) {
+        return;
+    }
+
+    stage_interval_t interval = StageBegin(stream->cfg.output.stats, kStageRawStats);
+
+    memset(&stream->prelimStats, 0, sizeof(stream->prelimStats));
+    CR2AccumulateStats(stream->plane, stream->cfg.rowWidth, 0, stream->cfg.numRows, borders, maxCol,
+                       &stream->prelimStats);
+
+    StageEnd(stream->cfg.output.stats, &interval, 0);
+
+    CR2CalculateBlackLevel(&stream->prelimStats, stream->black);
+    stream->vShift = CR2CalculateBayerShift(&stream->prelimStats);
+
+    stream->ready = true;
+}
+
+/**
+ * Gets the range of visible lines covered by the given band.
+ */
+static void BandLines(const cr2_stream_t *stream, size_t band, size_t *first, size_t *last) {
+    const size_t outBandLines = kBandLines / stream->factor;
+    const size_t outFirst = band * outBandLines;
+    const size_t outLast = MIN(outFirst + outBandLines, stream->outHeight);
+
+    *first = outFirst * stream->factor;
+    *last = outLast * stream->factor;
+}
+
+/**
+ * Checks whether all lines needed to process the band have been decompressed.
+ */
+static bool BandIsReady(const cr2_stream_t *stream, size_t band) {
+    size_t first, last;
+    BandLines(stream, band, &first, &last);
+
+    const size_t needed = stream->cfg.borders[0] + MIN(last + stream->halo, stream->visibleHeight);
+    return JPEGDecompressorCompletedLines(stream->dec) >= needed;
+}
+
+/**
+ * Processes a single band in its slot: the visible part of its lines (and their context) is copied into the
+ * slot's buffer, which is then debayered and color converted into the output, and reduced into the pyramid.
+ */
+static void ProcessBand(void *ctx) {
+    cr2_stream_slot_t *slot = (cr2_stream_slot_t *) ctx;
+    cr2_stream_t *stream = slot->stream;
+    const cr2_stream_config_t *cfg = &stream->cfg;
+    int err;
+
+    size_t first, last;
+    BandLines(stream, slot->band, &first, &last);
+
+    // lines to copy; the top is a multiple of the binning factor, so the Bayer pattern is unchanged
+    const size_t top = (first > stream->halo) ? (first - stream->halo) : 0;
+    const size_t bottom = MIN(last + stream->halo, stream->visibleHeight);
+    const size_t width = stream->visibleWidth;
+
+    // collect statistics of the band's own lines; the last band also covers any lines left over by binning
+    const size_t statsLast = (slot->band == (stream->numBands - 1)) ? stream->visibleHeight : last;
+    stage_interval_t interval = StageBegin(cfg->output.stats, kStageRawStats);
+
+    CR2AccumulateStats(stream->plane, cfg->rowWidth, cfg->borders[0] + first, statsLast - first,
+                       cfg->borders, cfg->rowWidth, &slot->stats);
+
+    StageEnd(cfg->output.stats, &interval, 0);
+
+    // trim
+    interval = StageBegin(cfg->output.stats, kStageTrim);
+
+    for(size_t line = top; line < bottom; line++) {
+        const uint16_t *row = stream->plane + ((cfg->borders[0] + line) * cfg->rowWidth) + cfg->borders[3];
+        memcpy(slot->lines + ((line - top) * width), row, width * sizeof(uint16_t));
+    }
+
+    StageEnd(cfg->output.stats, &interval, (bottom - top) * width * sizeof(uint16_t));
+
+    // debayer and convert straight into the output, starting at the band's first line
+    pixel_layout_t out = cfg->output;
+    out.base = ((uint8_t *) out.base) + ((first / stream->factor) * out.stride);
+
+    err = DebayerRegionToLayout(cfg->algo, slot->lines, width, bottom - top,
+                                stream->vShift, cfg->wb, stream->black, cfg->matrix, cfg->scale,
+                                0, first - top, width, last - first, &out);
+
+    // then reduce the band's output into the pyramid, while it's still in the cache
+    if(!err && cfg->pyramid) {
+        err = PyramidBuild(cfg->pyramid, &cfg->output, first / stream->factor, (last - first) / stream->factor);
+    }
+
+    if(err != 0) {
+        StageFail(cfg->output.stats, kStageDemosaic, err);
+        atomic_store(&stream->err, err);
+    }
+
+    // the slot can take the next band
+    dispatch_semaphore_signal(slot->free);
+}
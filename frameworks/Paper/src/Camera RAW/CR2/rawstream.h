@@ -0,0 +1,111 @@
+//
+//  rawstream.h
+//  Paper (macOS)
+//
+//  Processes the raw data of a CR2 file in bands of lines while it's being
+//  decompressed.
+//
+//  Created by Tristan Seifert on 20200829.
+//
+
+#ifndef rawstream_h
+#define rawstream_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "unslice.h"
+#include "debayer.h"
+#include "bufpool.h"
+#include "pixel_layout.h"
+#include "pyramid.h"
+
+// forward declarations
+typedef struct jpeg_decompressor jpeg_decompressor_t;
+typedef struct cr2_stream cr2_stream_t;
+
+/**
+ * Describes how the raw data is processed, and where the results are written
+ */
+typedef struct cr2_stream_config {
+    /// Number of pixels (including border area) per line
+    size_t rowWidth;
+    /// Total number of lines (including border) in the image
+    size_t numRows;
+    /// Position of borders in image, starting with top and going clockwise.
+    size_t borders[4];
+
+    /// Debayering algorithm to use
+    debayer_algorithm_t algo;
+    /// White balance multipliers for each of the 4 bayer elements
+    double wb[4];
+    /// Row major 3x3 color conversion matrix applied to each pixel
+    float matrix[9];
+    /// Factor to convert the 16-bit components to floating point, e.g. 1/16384 for 14-bit data
+    float scale;
+
+    /// Output buffer and its pixel format; its size is reduced by the algorithm's scale factor. If it has stats
+    /// set, the raw statistics and trimming of each band are recorded into them as well.
+    pixel_layout_t output;
+    /// Number of bytes in the output buffer
+    size_t outLength;
+    /// If set, the levels of this pyramid are built from each band as soon as it's been written to the output,
+    /// while it's still in the cache. It must match the output's size and format, and its line alignment must
+    /// divide the output lines of each band (see `CR2StreamOutputBandLines`)
+    image_pyramid_t *pyramid;
+
+    /// Pool from which the band buffers are taken, or NULL to allocate them
+    buffer_pool_t *pool;
+} cr2_stream_config_t;
+
+/**
+ * Creates a stream that processes the output of the given decompressor while it decodes an image.
+ *
+ * Whenever enough lines have been decompressed, they are handed off to another core in bands: each band
+ * is trimmed into one of a small ring of buffers, its statistics are collected, and it's debayered and
+ * converted to the working color space straight into the output buffer. At most a handful of bands are in
+ * flight at a time, so besides the decompressed image and the output, little memory is needed.
+ *
+ * The black level and Bayer shift must be known before the first band can be debayered. They are
+ * determined from all slices preceding the last one, once decoding reaches it, if that area covers the left
+ * border of the image; otherwise, no bands are processed until the entire image has been decoded.
+ *
+ * @param dec Decompressor writing the raw image; it must have an output buffer set
+ * @param config Processing configuration, which is copied
+ * @return Stream, or NULL if the configuration is invalid or memory couldn't be allocated
+ */
+cr2_stream_t *CR2StreamNew(jpeg_decompressor_t *dec, const cr2_stream_config_t *config);
+
+/**
+ * Gets the number of output lines in each band (except the last one) when debayering with the given
+ * algorithm.
+ *
+ * @return Number of lines, or 0 if the algorithm is invalid
+ */
+size_t CR2StreamOutputBandLines(debayer_algorithm_t algo);
+
+/**
+ * Releases a stream, waiting for any bands still in flight.
+ */
+void CR2StreamRelease(cr2_stream_t *stream);
+
+/**
+ * Starts processing all bands for which enough lines have been decompressed, blocking if all buffers of
+ * the ring are in use. Call this whenever the decompressor has made progress.
+ *
+ * @return 0 on success, or a negative error code
+ */
+int CR2StreamUpdate(cr2_stream_t *stream);
+
+/**
+ * Processes the remaining bands once the decompressor is done, and waits for all of them to complete.
+ *
+ * @param stats Statistics structure to fill in; the black level is taken from the left border of the
+ * entire image, the sums and histogram from its visible area.
+ * @param outVShift Vertical shift of the Bayer matrix the image was debayered with
+ * @return 0 on success, or a negative error code (including if the image wasn't fully decompressed)
+ */
+int CR2StreamFinish(cr2_stream_t *stream, cr2_raw_stats_t *stats, size_t *outVShift);
+
+#endif /* rawstream_h */
@@ -14,6 +14,10 @@
 #include <assert.h>
 #include <math.h>
 
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
 /// Bayer color component for the given line and column (assuming RG/GB)
 #define BAYER_COLOR(l, c) ((((l)&1)<<1) | (c&1))
 
@@ -35,6 +39,11 @@ int CR2Unslice(jpeg_decompressor_t *jpeg,
     assert(outPlane);
     assert(slices);
 
+    // nothing to do if the decompressor already wrote the unsliced image
+    if(jpeg->unsliceOutput) {
+        return (jpeg->outBuf == outPlane) ? 0 : -1;
+    }
+
     // calculate width of each slice
     sliceWidth = (slices[1]) / jpeg->numComponents;
 
@@ -80,131 +89,182 @@ int CR2Unslice(jpeg_decompressor_t *jpeg,
 }
 
 /**
- * Calculates whether the Bayer color array is shifted vertically.
- *
- * When taking sensor borders into account, the first visible line may actually be the second row
- * of the Bayer array (G2/B) so we need to account for that.
+ * Accumulates the statistics of a single line of the raw image, ignoring all columns at and beyond the
+ * given limit.
  *
- * This works by calculating the sums for each of the R/G1-G2/B values; the absolute difference
- * between G1-G2 must be smaller than that between R-B; otherwise, assume the color matrix must be
- * shifted down one line.
- *
- * @param inPlane Image data plane (1 component)
+ * @param row Pixels of the line, including its border area
+ * @param line Index of the line in the raw image
  * @param borders Position of borders in image, starting with top and going clockwise.
- * @param rowWidth Number of pixels (including border area) per line
- * @return Vertical shift for bayer matrix, either 0 or 1.
+ * @param maxCol Number of columns at the left of the line to consider
+ * @param stats Statistics structure to add to
  */
-int CR2CalculateBayerShift(uint16_t *inPlane, size_t rowWidth, size_t *borders) {
-    assert(inPlane);
-    assert(borders);
+static void CollectLineStats(const uint16_t *row, size_t line, const size_t *borders, size_t maxCol,
+                             cr2_raw_stats_t *stats) {
+    size_t col;
     
-    double sums[4] = {0, 0, 0, 0};
-    size_t line, l, rowOff;
-    size_t col, c;
+    // accumulate the left border
+    const size_t borderEnd = MIN(borders[3], maxCol);
     
-    // iterate each line
-    for (line = borders[0], l = 0; line <= borders[2]; line++, l++) {
-        rowOff = (line * rowWidth);
+    for (col = 2; col < borderEnd; col++) {
+        const uint8_t color = BAYER_COLOR(line, col);
         
-        // iterate each column in the line
-        for (col = borders[3], c = 0; col <= borders[1]; col++, c++) {
-            sums[BAYER_COLOR(l, c)] += inPlane[rowOff + col];
-        }
+        stats->blackSums[color] += row[col];
+        stats->blackCounts[color]++;
     }
     
-    // detect whether difference between greens is larger than red/blue
-    if (fabs(sums[0] - sums[3]) < fabs(sums[1] - sums[2])) {
-        return 1;
+    // the rest only applies to visible lines
+    if (line < borders[0] || line > borders[2] || maxCol <= borders[3]) {
+        return;
     }
-    // first line is R/G1; no shift needed
-    else {
-        return 0;
+    
+    const size_t pixelsPerLine = MIN((borders[1] - borders[3]) + 1, maxCol - borders[3]);
+    const size_t l = line - borders[0];
+    const uint16_t *visible = row + borders[3];
+    
+    const uint8_t evenColor = BAYER_COLOR(l, 0), oddColor = BAYER_COLOR(l, 1);
+    uint32_t *evenHist = stats->histogram[evenColor];
+    uint32_t *oddHist = stats->histogram[oddColor];
+    uint64_t evenSum = 0, oddSum = 0;
+    
+    // columns alternate between two colors
+    for (col = 0; (col + 2) <= pixelsPerLine; col += 2) {
+        const uint16_t even = visible[col], odd = visible[col + 1];
+        
+        evenSum += even;
+        oddSum += odd;
+        
+        evenHist[MIN(even >> CR2_HISTOGRAM_SHIFT, CR2_HISTOGRAM_BINS - 1)]++;
+        oddHist[MIN(odd >> CR2_HISTOGRAM_SHIFT, CR2_HISTOGRAM_BINS - 1)]++;
+    }
+    
+    if (col < pixelsPerLine) {
+        evenSum += visible[col];
+        evenHist[MIN(visible[col] >> CR2_HISTOGRAM_SHIFT, CR2_HISTOGRAM_BINS - 1)]++;
     }
+    
+    stats->sums[evenColor] += evenSum;
+    stats->sums[oddColor] += oddSum;
 }
 
 /**
- * Calculates the black level of the image by taking an average of black values in the border of the image.
- *
- * We currently just look at the left border of the image, completely ignoring all of the other borders; this could
- * be changed later. The first and last two columns are ignored since they might be more noisy than usual.
- *
- * Technically, the border area of the sensor doesn't have a Bayer array; however, there seems to be some
- * column-specific noise in some cameras, but taking an average for each component of the 2x2 CFA hides
- * that pretty nicely.
+ * Collects statistics about the raw image, and optionally trims it in place to remove borders.
  *
- * TODO: we probably should take vShift into account…
+ * Black levels are taken from the left border of the image, ignoring the first two columns since they
+ * might be more noisy than usual. Sums and histograms are taken over the visible area only.
  *
  * @param inPlane Image data plane (1 component)
  * @param rowWidth Number of pixels (including border area) per line
  * @param numRows Total number of lines (including border) in the image
  * @param borders Position of borders in image, starting with top and going clockwise.
- * @param outLevels Calculated black levels, one for each component in the Bayer array
+ * @param trim Whether the image should be trimmed
+ * @param stats Statistics structure to fill in
+ * @return Total number of bytes required for trimmed image, or 0 if not trimming
  */
-void CR2CalculateBlackLevel(uint16_t *inPlane, size_t rowWidth, size_t numRows, size_t *borders, uint16_t *outLevels) {
+size_t CR2CollectStats(uint16_t *inPlane, size_t rowWidth, size_t numRows, size_t *borders,
+                       bool trim, cr2_raw_stats_t *stats) {
     assert(inPlane);
     assert(borders);
-    assert(outLevels);
+    assert(stats);
+    
+    size_t outPixel = 0;
+    
+    memset(stats, 0, sizeof(*stats));
     
-    size_t rowOff;
-    size_t line, l, col, c;
-    uint8_t color;
-    size_t levels[4] = {0,0,0,0};
-    size_t levelsCount[4] = {0,0,0,0};
+    // calculate some constants
+    const size_t pixelsPerLine = (borders[1] - borders[3]) + 1;
     
-    // iterate over the left and right borders in the image
-    for (line = 0, l = 0; line <= numRows; line++, l++) {
-        rowOff = (line * rowWidth);
+    for (size_t line = 0; line < numRows; line++) {
+        uint16_t *row = inPlane + (line * rowWidth);
+        
+        CollectLineStats(row, line, borders, rowWidth, stats);
         
-        // iterate each column in the left border
-        for (col = 2, c = 0; col < borders[3]; col++, c++) {
-            color = BAYER_COLOR(l, c);
-            
-            levels[color] += inPlane[rowOff + col];
-            levelsCount[color]++;
+        // move the visible part of the line into place
+        if (trim && line >= borders[0] && line <= borders[2]) {
+            memmove((inPlane + outPixel), row + borders[3], pixelsPerLine * sizeof(uint16_t));
+            outPixel += pixelsPerLine;
         }
     }
     
-    // calculate averages and write into output
-    for (l = 0; l < 4; l++) {
-        if(!levelsCount[l]) continue;
-        
-        size_t avg = levels[l] / levelsCount[l];
-        outLevels[l] = (uint16_t) avg;
-    }
+    return (outPixel * sizeof(uint16_t));
 }
 
 /**
- * Trims the raw image in place to remove borders.
+ * Adds the statistics of some lines of the raw image to the given structure, without modifying the image.
  *
  * @param inPlane Image data plane (1 component)
  * @param rowWidth Number of pixels (including border area) per line
+ * @param firstLine First line to process
+ * @param numLines Number of lines to process
  * @param borders Position of borders in image, starting with top and going clockwise.
- * @return Total number of bytes required for trimmed image
+ * @param maxCol Columns at and beyond this are ignored
+ * @param stats Statistics structure to add to
  */
-size_t CR2Trim(uint16_t *inPlane, size_t rowWidth, size_t *borders) {
+void CR2AccumulateStats(const uint16_t *inPlane, size_t rowWidth, size_t firstLine, size_t numLines,
+                        const size_t *borders, size_t maxCol, cr2_raw_stats_t *stats) {
     assert(inPlane);
     assert(borders);
+    assert(stats);
     
-    size_t line, l, inRowOff;
-//    size_t col, c;
-    size_t outPixel = 0;
+    maxCol = MIN(maxCol, rowWidth);
     
-    // calculate some constants
-    const size_t pixelsPerLine = (borders[1] - borders[3]) + 1;
+    for (size_t line = firstLine; line < (firstLine + numLines); line++) {
+        CollectLineStats(inPlane + (line * rowWidth), line, borders, maxCol, stats);
+    }
+}
+
+/**
+ * Calculates whether the Bayer color array is shifted vertically.
+ *
+ * When taking sensor borders into account, the first visible line may actually be the second row
+ * of the Bayer array (G2/B) so we need to account for that.
+ *
+ * This works by calculating the sums for each of the R/G1-G2/B values; the absolute difference
+ * between G1-G2 must be smaller than that between R-B; otherwise, assume the color matrix must be
+ * shifted down one line.
+ *
+ * @param stats Statistics collected for the image
+ * @return Vertical shift for bayer matrix, either 0 or 1.
+ */
+int CR2CalculateBayerShift(const cr2_raw_stats_t *stats) {
+    assert(stats);
     
-    // iterate each line
-    for (line = borders[0], l = 0; line <= borders[2]; line++, l++) {
-        inRowOff = (line * rowWidth);
-        
-        // iterate each column in the line
-        size_t bytes = pixelsPerLine * sizeof(uint16_t);
-        memmove((inPlane + outPixel), (inPlane + inRowOff + borders[3]), bytes);
-        outPixel += pixelsPerLine;
+    const int64_t redBlue = (int64_t) stats->sums[0] - (int64_t) stats->sums[3];
+    const int64_t greens = (int64_t) stats->sums[1] - (int64_t) stats->sums[2];
+    
+    // detect whether difference between greens is larger than red/blue
+    if (llabs(redBlue) < llabs(greens)) {
+        return 1;
+    }
+    // first line is R/G1; no shift needed
+    else {
+        return 0;
+    }
+}
+
+/**
+ * Calculates the black level of the image by taking an average of black values in the border of the image.
+ *
+ * We currently just look at the left border of the image, completely ignoring all of the other borders; this could
+ * be changed later.
+ *
+ * Technically, the border area of the sensor doesn't have a Bayer array; however, there seems to be some
+ * column-specific noise in some cameras, but taking an average for each component of the 2x2 CFA hides
+ * that pretty nicely.
+ *
+ * TODO: we probably should take vShift into account…
+ *
+ * @param stats Statistics collected for the image
+ * @param outLevels Calculated black levels, one for each component in the Bayer array
+ */
+void CR2CalculateBlackLevel(const cr2_raw_stats_t *stats, uint16_t *outLevels) {
+    assert(stats);
+    assert(outLevels);
+    
+    // calculate averages and write into output
+    for (size_t l = 0; l < 4; l++) {
+        if(!stats->blackCounts[l]) continue;
         
-//        for (col = borders[3], c = 0; col <= borders[1]; col++, c++) {
-//            inPlane[outPixel++] = inPlane[inRowOff + col];
-//        }
+        uint64_t avg = stats->blackSums[l] / stats->blackCounts[l];
+        outLevels[l] = (uint16_t) avg;
     }
-            
-    return (outPixel * sizeof(uint16_t));
 }
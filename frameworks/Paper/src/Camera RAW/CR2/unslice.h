@@ -10,6 +10,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 // forward declarations
 typedef struct jpeg_decompressor jpeg_decompressor_t;
@@ -24,43 +25,81 @@ int CR2Unslice(jpeg_decompressor_t *jpeg,
                uint16_t *outPlane, uint16_t *slices,
                size_t sensorWidth, size_t sensorHeight);
 
+/// Number of bins in the raw histogram, for each CFA index
+#define CR2_HISTOGRAM_BINS 1024
+/// Number of low bits dropped from raw values to get their histogram bin; larger values go into the last bin
+#define CR2_HISTOGRAM_SHIFT 4
+
 /**
- * Calculates whether the Bayer color array is shifted vertically.
- *
- * When taking sensor borders into account, the first visible line may actually be the second row
- * of the Bayer array (G2/B) so we need to account for that.
+ * Statistics about the raw sensor data, gathered in a single pass over the image
+ */
+typedef struct cr2_raw_stats {
+    /// Sum of the values in the left border, for each CFA index
+    uint64_t blackSums[4];
+    /// Number of values in the left border, for each CFA index
+    uint64_t blackCounts[4];
+
+    /// Sum of the visible values for each CFA index, relative to the top left of the visible area
+    uint64_t sums[4];
+
+    /// Histogram of visible values for each CFA index, relative to the top left of the visible area
+    uint32_t histogram[4][CR2_HISTOGRAM_BINS];
+} cr2_raw_stats_t;
+
+/**
+ * Collects statistics about the raw image, and optionally trims it in place to remove borders.
  *
- * This works by calculating the sums for each of the R/G1-G2/B values; the absolute difference
- * between G1-G2 must be smaller than that between R-B; otherwise, assume the color matrix must be
- * shifted down one line.
+ * Each line is only read once: its border and visible values are accumulated, then it is moved into
+ * place in the trimmed image while still in cache.
  *
  * @param inPlane Image data plane (1 component)
  * @param rowWidth Number of pixels (including border area) per line
+ * @param numRows Total number of lines (including border) in the image
  * @param borders Position of borders in image, starting with top and going clockwise.
- * @return Vertical shift for bayer matrix, either 0 or 1.
+ * @param trim Whether the image should be trimmed
+ * @param stats Statistics structure to fill in
+ * @return Total number of bytes required for trimmed image, or 0 if not trimming
  */
-int CR2CalculateBayerShift(uint16_t *inPlane, size_t rowWidth, size_t *borders);
+size_t CR2CollectStats(uint16_t *inPlane, size_t rowWidth, size_t numRows, size_t *borders,
+                       bool trim, cr2_raw_stats_t *stats);
 
 /**
- * Calculates the black level of the image by taking an average of black values in the border of the image.
+ * Adds the statistics of some lines of the raw image to the given structure, without modifying the image.
+ * Only columns to the left of `maxCol` are considered, so statistics can be gathered from the part of an
+ * image that has been decoded so far.
  *
  * @param inPlane Image data plane (1 component)
  * @param rowWidth Number of pixels (including border area) per line
- * @param numRows Total number of lines (including border) in the image 
+ * @param firstLine First line to process
+ * @param numLines Number of lines to process
  * @param borders Position of borders in image, starting with top and going clockwise.
- * @param outLevels Calculated black levels, one for each component in the Bayer array
+ * @param maxCol Columns at and beyond this are ignored
+ * @param stats Statistics structure to add to; it must be zeroed before the first call
+ */
+void CR2AccumulateStats(const uint16_t *inPlane, size_t rowWidth, size_t firstLine, size_t numLines,
+                        const size_t *borders, size_t maxCol, cr2_raw_stats_t *stats);
+
+/**
+ * Calculates whether the Bayer color array is shifted vertically.
+ *
+ * When taking sensor borders into account, the first visible line may actually be the second row
+ * of the Bayer array (G2/B) so we need to account for that.
+ *
+ * This works by calculating the sums for each of the R/G1-G2/B values; the absolute difference
+ * between G1-G2 must be smaller than that between R-B; otherwise, assume the color matrix must be
+ * shifted down one line.
+ *
+ * @param stats Statistics collected for the image
+ * @return Vertical shift for bayer matrix, either 0 or 1.
  */
-void CR2CalculateBlackLevel(uint16_t *inPlane, size_t rowWidth, size_t numRows,
-                            size_t *borders, uint16_t *outLevels);
+int CR2CalculateBayerShift(const cr2_raw_stats_t *stats);
 
 /**
- * Trims the raw image in place to remove borders.
+ * Calculates the black level of the image by taking an average of black values in the border of the image.
  *
- * @param inPlane Image data plane (1 component)
- * @param rowWidth Number of pixels (including border area) per line
- * @param borders Position of borders in image, starting with top and going clockwise.
- * @return Total number of bytes required for trimmed image
+ * @param stats Statistics collected for the image
+ * @param outLevels Calculated black levels, one for each component in the Bayer array
  */
-size_t CR2Trim(uint16_t *inPlane, size_t rowWidth, size_t *borders);
+void CR2CalculateBlackLevel(const cr2_raw_stats_t *stats, uint16_t *outLevels);
 
 #endif /* unslice_h */
@@ -19,6 +19,8 @@ public class LibRawReader {
     
     /// Debayered image data
     private(set) public var debayered: NSMutableData? = nil
+    /// Quickly debayered preview of the image; cleared once the full quality image is decoded
+    private(set) public var preview: NSMutableData? = nil
     
     // MARK: - Initialization
     /// Whether the thumb data should be decoded
@@ -26,11 +28,36 @@ public class LibRawReader {
     /// Whether raw image data should be decoded
     private var decodeRaw = false
     
+    /// Whether the raw data and thumbs have been unpacked already
+    private var rawUnpacked = false
+    private var thumbsUnpacked = false
+    
     /// Size of the original image
     public var size: CGSize {
         return self.reader.size
     }
     
+    /// Whether decoded images are RGBA half floats rather than 16-bit integers. The full quality image keeps the format that
+    /// was set when it was decoded.
+    public var halfFloat: Bool {
+        get {
+            return self.reader.halfFloat
+        }
+        set {
+            self.reader.halfFloat = newValue
+        }
+    }
+    
+    /// Number of median filter passes applied to the full quality image, to suppress color artifacts
+    public var medianPasses: UInt {
+        get {
+            return self.reader.medianPasses
+        }
+        set {
+            self.reader.medianPasses = newValue
+        }
+    }
+    
     /**
      * Creates a raw file reader by reading from the given URL.
      */
@@ -46,16 +73,30 @@ public class LibRawReader {
     }
     
     /**
-     * Decodes the image.
+     * Decodes the image, at the given quality.
+     *
+     * Preview decodes can be followed up by a full quality decode later. The full quality decode can be cancelled through the
+     * current `Progress`.
      */
-    public func decode() throws {
+    public func decode(quality: PAPLibRawDebayerQuality = .full) throws {
         if self.decodeRaw {
-            try self.reader.unpackRawData()
-            self.debayered = try self.reader.debayerRawData()
+            if !self.rawUnpacked {
+                try self.reader.unpackRawData()
+                self.rawUnpacked = true
+            }
+            
+            switch quality {
+            case .preview:
+                self.preview = try self.reader.debayerRawData(with: .preview)
+            default:
+                self.debayered = try self.reader.debayerRawData(with: .full)
+                self.preview = nil
+            }
         }
         
-        if self.decodeThumbs {
+        if self.decodeThumbs && !self.thumbsUnpacked {
             try self.reader.unpackThumbs()
+            self.thumbsUnpacked = true
         }
     }
     
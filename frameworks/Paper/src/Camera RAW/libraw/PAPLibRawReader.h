@@ -11,6 +11,16 @@ NS_ASSUME_NONNULL_BEGIN
 
 extern NSErrorDomain const PAPLibRawErrorDomain;
 
+/**
+ * Quality levels at which the raw data can be debayered
+ */
+typedef NS_ENUM(NSUInteger, PAPLibRawDebayerQuality) {
+    /// Each 2x2 block of the CFA is collapsed into a single color; very fast, but soft
+    PAPLibRawDebayerQualityPreview,
+    /// AHD interpolation
+    PAPLibRawDebayerQualityFull,
+};
+
 /**
  * Implements a generic camera raw reader that uses libraw.
  */
@@ -29,6 +39,10 @@ extern NSErrorDomain const PAPLibRawErrorDomain;
 @property (nonatomic) BOOL adjustMax;
 /// Whether colors are scaled
 @property (nonatomic) BOOL scaleColors;
+/// Number of median filter passes over the color differences after a full quality interpolation; 0 to skip filtering
+@property (nonatomic) NSUInteger medianPasses;
+/// Whether debayered images are RGBA half floats in [0, 1], ready for the GPU, rather than 16-bit integers
+@property (nonatomic) BOOL halfFloat;
 
 - (instancetype _Nullable) initFromUrl:(NSURL *) url outError:(NSError * _Nullable __autoreleasing *) error;
 
@@ -36,6 +50,8 @@ extern NSErrorDomain const PAPLibRawErrorDomain;
 
 - (BOOL) unpackRawDataWithError:(NSError * _Nullable __autoreleasing *) error;
 - (NSMutableData * _Nullable) debayerRawData:(NSError * _Nullable __autoreleasing *) error;
+- (NSMutableData * _Nullable) debayerRawDataWithQuality:(PAPLibRawDebayerQuality) quality
+                                                  error:(NSError * _Nullable __autoreleasing *) error;
 
 @end
 
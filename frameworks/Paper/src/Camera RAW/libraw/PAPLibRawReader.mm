@@ -18,11 +18,15 @@
 #import <Cocoa/Cocoa.h>
 #import <os/log.h>
 
+#include <errno.h>
+
 NSErrorDomain const PAPLibRawErrorDomain = @"PAPLibRawErrorDomain";
 
 // logger instance shared by all LibRAW readers
 static os_log_t gLogger = nil;
 
+static bool IsProgressCancelled(void *info);
+
 @interface PAPLibRawReader ()
 
 @property (nonatomic) LibRaw *raw;
@@ -31,6 +35,8 @@ static os_log_t gLogger = nil;
 @property (nonatomic) NSMutableArray<NSValue *> *cgThumbs;
 /// Output image buffer
 @property (nonatomic) NSMutableData *imageBuffer;
+/// Bayer data with black level and white balance applied, until it's been interpolated at full quality
+@property (nonatomic) NSMutableData *bayerBuffer;
 
 /// Histogram used for color space conversion
 @property (nonatomic) int *histogram;
@@ -38,6 +44,8 @@ static os_log_t gLogger = nil;
 @property (nonatomic) uint16_t *gamma;
 
 - (void) updateOutThumbs;
+- (BOOL) prepareBayerData;
+- (BOOL) convertToRGB:(uint16_t (*)[4]) buffer error:(NSError * _Nullable __autoreleasing *) error;
 
 - (BOOL) foundationErrorFrom:(int) error to:(NSError  * _Nullable  __autoreleasing *) error;
 
@@ -182,21 +190,97 @@ static os_log_t gLogger = nil;
 }
 
 /**
- * Debayers raw data.
+ * Debayers raw data at full quality.
  */
 - (NSMutableData * _Nullable) debayerRawData:(NSError * _Nullable __autoreleasing *) error {
+    return [self debayerRawDataWithQuality:PAPLibRawDebayerQualityFull error:error];
+}
+
+/**
+ * Debayers raw data at the given quality.
+ *
+ * Previews are produced in a new buffer each time, leaving the bayer data intact so it can be interpolated at full
+ * quality later. The full quality image is only produced once; it can be cancelled through the current progress, in which
+ * case nil is returned with a `NSUserCancelledError` and the next call starts over. If the interpolation or color
+ * conversion can't allocate memory, a POSIX `ENOMEM` error is returned instead, and the bayer data is kept for another
+ * attempt.
+ */
+- (NSMutableData * _Nullable) debayerRawDataWithQuality:(PAPLibRawDebayerQuality) quality
+                                                  error:(NSError * _Nullable __autoreleasing *) error {
     NSAssert(self.raw != nil, @"LibRaw not initialized");
     
-    // allocate output buffer (or bail if already done)
-    if(self.imageBuffer == nil) {
-        NSUInteger length = (self.raw->imgdata.sizes.width * 4 * sizeof(uint16_t)) * self.raw->imgdata.sizes.height;
-        self.imageBuffer = [NSMutableData dataWithLength:length];
-    } else {
+    // bail if the full quality image was produced already
+    if(self.imageBuffer != nil) {
         return self.imageBuffer;
     }
     
+    if(![self prepareBayerData]) {
+        return nil;
+    }
+    
+    // previews fill in each 2x2 block of a copy of the bayer data
+    if(quality == PAPLibRawDebayerQualityPreview) {
+        NSMutableData *preview = [self.bayerBuffer mutableCopy];
+        auto outBuf = (uint16_t(*)[4]) preview.mutableBytes;
+        
+        TSRawSuperpixelInterpolate(&self.raw->imgdata, outBuf);
+        if(![self convertToRGB:outBuf error:error]) {
+            return nil;
+        }
+        
+        return preview;
+    }
+    
+    // interpolate colour data
+    NSProgress *progress = [NSProgress progressWithTotalUnitCount:1];
+    auto outBuf = (uint16_t(*)[4]) self.bayerBuffer.mutableBytes;
+    
+    const ahd_result_t result = ahd_interpolate_mod_cancellable(&self.raw->imgdata, outBuf, IsProgressCancelled,
+                                                                (__bridge void *) progress);
+    if(result == kAHDResultCancelled) {
+        if(error) {
+            *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSUserCancelledError userInfo:nil];
+        }
+        return nil;
+    } else if(result != kAHDResultSuccess) {
+        if(error) {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:ENOMEM userInfo:nil];
+        }
+        return nil;
+    }
+    
+    // clean up color artifacts left over from interpolation
+    if(self.medianPasses) {
+        TSRawPostInterpolationMedianFilter(&self.raw->imgdata, outBuf, (int) self.medianPasses);
+    }
+    
+    // convert color espacen
+    if(![self convertToRGB:outBuf error:error]) {
+        return nil;
+    }
+    progress.completedUnitCount = 1;
+    
+    self.imageBuffer = self.bayerBuffer;
+    self.bayerBuffer = nil;
+    
+    return self.imageBuffer;
+}
+
+/**
+ * Copies the bayer data out of LibRaw, then applies black level and white balance. This only happens once, since it
+ * updates the LibRaw state.
+ */
+- (BOOL) prepareBayerData {
+    if(self.bayerBuffer != nil) {
+        return YES;
+    }
+    
+    // allocate output buffer
+    NSUInteger length = (self.raw->imgdata.sizes.width * 4 * sizeof(uint16_t)) * self.raw->imgdata.sizes.height;
+    NSMutableData *buffer = [NSMutableData dataWithLength:length];
+    
     // copy bayer data
-    auto outBuf = (uint16_t(*)[4]) self.imageBuffer.mutableBytes;
+    auto outBuf = (uint16_t(*)[4]) buffer.mutableBytes;
     
     unsigned short cblack[4] = {0,0,0,0};
     unsigned short dmax = 0;
@@ -206,7 +290,7 @@ static os_log_t gLogger = nil;
     } else {
         os_log_error(gLogger, "Got an unsupported RAW format: filters = 0x%x, colours = %i",
                    self.raw->imgdata.idata.filters, self.raw->imgdata.idata.colors);
-        return nil;
+        return NO;
     }
     
     // adjust black level
@@ -219,26 +303,49 @@ static os_log_t gLogger = nil;
     TSRawPreInterpolationApplyWB(&self.raw->imgdata, outBuf);
     TSRawPreInterpolation(&self.raw->imgdata, outBuf);
     
-    
-    // interpolate colour data
-    ahd_interpolate_mod(&self.raw->imgdata, outBuf);
-//        lmmse_interpolate(&self.raw->imgdata, outBuf);
-    
-    // convert color espacen
+    self.bayerBuffer = buffer;
+    return YES;
+}
+
+/**
+ * Converts an interpolated buffer to the output color space in place.
+ *
+ * @return Whether the buffer was converted; if memory for the conversion couldn't be allocated, a POSIX `ENOMEM` error
+ * is returned and the buffer is left as it was.
+ */
+- (BOOL) convertToRGB:(uint16_t (*)[4]) buffer error:(NSError * _Nullable __autoreleasing *) error {
     if(!self.histogram) {
-        static const size_t kHistogramSz = sizeof(int) * 4 * 0x2000;
-        self.histogram = (int *) malloc(kHistogramSz);
-        memset(self.histogram, 0, kHistogramSz);
+        self.histogram = (int *) calloc(4 * 0x2000, sizeof(int));
     } if(!self.gamma) {
-        static const size_t kGammaSz = sizeof(uint16_t) * 0x10000;
-        self.gamma = (uint16_t *) malloc(kGammaSz);
-        memset(self.gamma, 0, kGammaSz);
+        self.gamma = (uint16_t *) calloc(0x10000, sizeof(uint16_t));
     }
     
-    TSRawConvertToRGB(&self.raw->imgdata, outBuf, outBuf, self.histogram, self.gamma);
-
+    // half floats are as large as the integer components, so either format is converted in place
+    int err = -1;
     
-    return self.imageBuffer;
+    if(self.histogram && self.gamma) {
+        if(self.halfFloat) {
+            err = TSRawConvertToRGBHalf(&self.raw->imgdata, buffer, (__fp16 (*)[4]) buffer, self.histogram, self.gamma);
+        } else {
+            err = TSRawConvertToRGB(&self.raw->imgdata, buffer, buffer, self.histogram, self.gamma);
+        }
+    }
+    
+    if(err != 0) {
+        if(error) {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:ENOMEM userInfo:nil];
+        }
+        return NO;
+    }
+    
+    return YES;
+}
+
+/**
+ * Cancellation callback for the AHD interpolation; the info pointer is the progress of the debayering.
+ */
+static bool IsProgressCancelled(void *info) {
+    return ((__bridge NSProgress *) info).isCancelled;
 }
 
 // MARK: - Helpers
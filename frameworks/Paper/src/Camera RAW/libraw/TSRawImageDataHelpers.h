@@ -60,6 +60,16 @@ void TSRawPreInterpolation(libraw_data_t *libRaw, uint16_t (*image)[4]);
  */
 void TSRawPreInterpolationApplyWB(libraw_data_t *libRaw, uint16_t (*image)[4]);
 
+/**
+ * Fills in the missing components of each pixel from its 2x2 block of the CFA.
+ * This is much faster than a proper interpolation, but only about as sharp as
+ * a half size image; it is meant for previews.
+ *
+ * @param libRaw LibRaw instance from which to acquire some image info
+ * @param image Image buffer, after pre-interpolation
+ */
+void TSRawSuperpixelInterpolate(libraw_data_t *libRaw, uint16_t (*image)[4]);
+
 /**
  * Performs post-interpolation green channel mixing.
  *
@@ -88,8 +98,26 @@ void TSRawPostInterpolationMedianFilter(libraw_data_t *libRaw, uint16_t (*image)
  * @param histogram Pointer to the histogram to be created. Has 0x2000 bins,
  * times four for four possible colours.
  * @param gammaCurve Gamma curve buffer
+ *
+ * @return 0 on success, or -1 if the output curve couldn't be allocated.
+ */
+int TSRawConvertToRGB(libraw_data_t *libRaw, uint16_t (*image)[4], uint16_t (*outBuf)[4], int *histogram, uint16_t *gammaCurve);
+
+/**
+ * Converts the output data to RGB format, as half precision floats in the
+ * [0, 1] range with an opaque alpha component, so it can be uploaded to the
+ * GPU as is. This may be done in place.
+ *
+ * @param libRaw LibRaw instance from which to acquire some image info
+ * @param image Image buffer (after interpolation)
+ * @param outBuf Output data buffer, with four components per pixel
+ * @param histogram Pointer to the histogram to be created. Has 0x2000 bins,
+ * times four for four possible colours.
+ * @param gammaCurve Gamma curve buffer
+ *
+ * @return 0 on success, or -1 if the output curve couldn't be allocated.
  */
-void TSRawConvertToRGB(libraw_data_t *libRaw, uint16_t (*image)[4], uint16_t (*outBuf)[4], int *histogram, uint16_t *gammaCurve);
+int TSRawConvertToRGBHalf(libraw_data_t *libRaw, uint16_t (*image)[4], __fp16 (*outBuf)[4], int *histogram, uint16_t *gammaCurve);
 
 /**
  * Uses bilinear interpolation to interpolate the value of a single component at
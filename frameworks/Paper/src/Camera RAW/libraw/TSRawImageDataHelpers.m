@@ -8,12 +8,19 @@
 
 #include "TSRawImageDataHelpers.h"
 #include "interpolation_shared.h"
+#include "wb_scale.h"
+#include "median.h"
 
 #include <float.h>
+#include <stdbool.h>
 #include <string.h>
 #include <memory.h>
 #include <stdlib.h>
 #include <math.h>
+#include <unistd.h>
+
+#include <dispatch/dispatch.h>
+#include <simd/simd.h>
 
 /**
  * Set to 1 to print out some additional debugging information, such as
@@ -27,9 +34,58 @@
 /// color struct
 #define C libRaw->color
 
+/// Number of bins in the histogram of each colour
+#define kHistogramBins	0x2000
+
+/**
+ * State shared by the workers converting an image to RGB; each converts a
+ * contiguous band of lines.
+ */
+typedef struct {
+	uint16_t (*image)[4];
+	/// Output pixels; either 16-bit unsigned or half float components
+	void *outBuf;
+	bool halfFloat;
+	size_t width, height;
+	int colors;
+	size_t numWorkers;
+
+	/// Columns of the output camera matrix, one per input colour
+	simd_float4 matrix[4];
+	/// Histograms of each worker; the first is the caller's
+	int **histograms;
+	/// Composed output curve and gamma curve
+	const uint16_t *lut;
+	/// The composed curve, normalized to [0, 1] half floats, for half float output
+	const __fp16 *halfLut;
+} rgb_convert_ctx_t;
+
+/**
+ * State shared by the workers median filtering an image; each filters a
+ * contiguous band of the interior lines.
+ */
+typedef struct {
+	uint16_t (*image)[4];
+	size_t width, height;
+	size_t numWorkers;
+	/// Colour currently being filtered
+	int c;
+
+	/// Working planes of each worker: its band's colour differences, with one
+	/// line of context on either side, followed by the filtered differences
+	float *planes;
+	size_t planeSize;
+} median_filter_ctx_t;
+
 #pragma mark Helpers
 static void TSBuildGammaCurve(double pwr, double ts, int mode, int imax, uint16_t *curve, double *gamm);
 
+static int TSRawConvertToRGBInternal(libraw_data_t *libRaw, uint16_t (*image)[4], void *outBuf, bool halfFloat, int *histogram, uint16_t *gammaCurve);
+
+static void TSRawConvertMatrixWorker(void *_ctx, size_t worker);
+static void TSRawConvertCurveWorker(void *_ctx, size_t worker);
+static void TSRawMedianFilterWorker(void *_ctx, size_t worker);
+
 #pragma mark Conversion and Copying
 /**
  * Copies single component Bayer data from the given LibRaw instance into the
@@ -184,12 +240,11 @@ void TSRawSubtractBlack(libraw_data_t *libRaw, uint16_t (*image)[4]) {
 				if(dmax < val) dmax = val;
 			}
 		} else {
-			for(i = 0; i < (size * 4); i++) {
-				int val = image[0][i];
-				val -= cblk[i & 3];
-				image[0][i] = CLIP(val);
-				if(dmax < val) dmax = val;
-			}
+			uint16_t black[4];
+			for(i = 0; i < 4; i++)
+				black[i] = MIN(cblk[i], 65535);
+			
+			dmax = WBScaleInterleaved(image, size, black, NULL);
 		}
 		
 		C.data_maximum = dmax & 0xffff;
@@ -203,15 +258,9 @@ void TSRawSubtractBlack(libraw_data_t *libRaw, uint16_t (*image)[4]) {
 	} else {
 		// Nothing to do, maximum is already calculated, black level is 0, so no change
 		// only calculate channel maximum;
-		int idx;
-		ushort *p = (ushort*) image;
-		int dmax = 0;
-		
-		for(idx=0; idx < (S.iheight * S.iwidth * 4); idx++) {
-			if(dmax < p[idx]) dmax = p[idx];
-		}
+		static const uint16_t black[4] = {0, 0, 0, 0};
 		
-		C.data_maximum = dmax;
+		C.data_maximum = WBScaleInterleaved(image, S.iheight * S.iwidth, black, NULL);
 	}
 }
 
@@ -259,20 +308,13 @@ static inline void TSRawScaleColourLoop(libraw_data_t *libRaw, uint16_t (*image)
 			val *= scale_mul[i & 3];
 			image[0][i] = CLIP(val);
 		}
-	} else if(C.cblack[0] || C.cblack[1] || C.cblack[2] || C.cblack[3]) {
-		for(size_t i=0; i < size*4; i++) {
-			int val = image[0][i];
-			if (!val) continue;
-			val -= C.cblack[i & 3];
-			val *= scale_mul[i & 3];
-			image[0][i] = CLIP(val);
-		}
-	} else { // BL is zero
-		for(size_t i=0; i < size*4; i++) {
-			int val = image[0][i];
-			val *= scale_mul[i & 3];
-			image[0][i] = CLIP(val);
-		}
+	} else {
+		// this also covers a zero black level
+		uint16_t black[4];
+		for(int c = 0; c < 4; c++)
+			black[c] = MIN(C.cblack[c], 65535);
+		
+		WBScaleInterleaved(image, size, black, scale_mul);
 	}
 }
 
@@ -347,6 +389,61 @@ void TSRawPreInterpolationApplyWB(libraw_data_t *libRaw, uint16_t (*image)[4]) {
 	TSRawScaleColourLoop(libRaw, image, scale_mul);
 }
 
+#pragma mark - Interpolation
+/**
+ * Fills in the missing components of each pixel from the other pixels in its
+ * 2x2 block of the CFA. Every block ends up a single colour, so the result is
+ * only about as sharp as a half size image, but it's very fast to produce.
+ *
+ * @param libRaw LibRaw instance from which to acquire some image info
+ * @param image Image buffer, after pre-interpolation
+ */
+void TSRawSuperpixelInterpolate(libraw_data_t *libRaw, uint16_t (*image)[4]) {
+	size_t row, col, y, x, top, left;
+	unsigned int sum[4], count[4];
+	int c, f;
+	
+	// get some data from the struct
+	ushort width = libRaw->sizes.width;
+	ushort height = libRaw->sizes.height;
+	
+	unsigned int filters = libRaw->idata.filters;
+	int colors = libRaw->idata.colors;
+	
+	if(width < 2 || height < 2) return;
+	
+	for(row = 0; row < height; row += 2) {
+		for(col = 0; col < width; col += 2) {
+			memset(sum, 0, sizeof sum);
+			memset(count, 0, sizeof count);
+			
+			// average each colour in the block; with an odd size, blocks at the
+			// edges are cut off, so their colours come from the previous block
+			top = MIN(row, height - 2);
+			left = MIN(col, width - 2);
+			
+			for(y = top; y < top + 2; y++)
+				for(x = left; x < left + 2; x++) {
+					c = FC(y, x, filters);
+					sum[c] += image[y*width+x][c];
+					count[c]++;
+				}
+			
+			FORC4 if(count[c]) sum[c] /= count[c];
+			
+			// and write them to all pixels of the block that lack that colour
+			for(y = row; y < MIN(row + 2, height); y++)
+				for(x = col; x < MIN(col + 2, width); x++) {
+					f = FC(y, x, filters);
+					
+					FORCC if(c != f && count[c]) {
+						image[y*width+x][c] = sum[c];
+					}
+				}
+		}
+	}
+}
+
 #pragma mark - Post-interpolation
 /**
  * Performs post-interpolation green channel mixing.
@@ -374,41 +471,89 @@ void TSRawPostInterpolationMixGreen(libraw_data_t *libRaw, uint16_t (*image)[4])
  * @param med_passes How many passes of the median filter to go through.
  */
 void TSRawPostInterpolationMedianFilter(libraw_data_t *libRaw, uint16_t (*image)[4], int med_passes) {
-	ushort (*pix)[4];
-	int pass, c, i, j, k, med[9];
+	median_filter_ctx_t ctx;
+	size_t i, maxLines;
+	int pass;
+	
+	memset(&ctx, 0, sizeof ctx);
 	
 	// get some data from the struct
-	ushort width = libRaw->sizes.width;
-	ushort height = libRaw->sizes.height;
+	ctx.image = image;
+	ctx.width = libRaw->sizes.width;
+	ctx.height = libRaw->sizes.height;
+	
+	// nothing to do without any interior pixels
+	if(ctx.width < 3 || ctx.height < 3 || med_passes <= 0) return;
 	
-	static const uchar opt[] =	/* Optimal 9-element median search */
-	{ 1,2, 4,5, 7,8, 0,1, 3,4, 6,7, 1,2, 4,5, 7,8,
-		0,3, 5,8, 4,7, 3,6, 1,4, 2,5, 4,7, 4,2, 6,4, 4,2 };
+	// allocate each worker's planes for its band of interior lines
+	ctx.numWorkers = (size_t) MIN(MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), 64), ctx.height - 2);
+	maxLines = ((ctx.height - 2) + ctx.numWorkers - 1) / ctx.numWorkers;
+	ctx.planeSize = ((maxLines + 2) + maxLines) * ctx.width;
+	
+	ctx.planes = (float *) malloc(ctx.numWorkers * ctx.planeSize * sizeof(float));
+	if(!ctx.planes) return;
 	
 	for (pass=1; pass <= med_passes; pass++) {
 #if PRINT_DEBUG_INFO
 		DDLogDebug(@"Began median filter pass %i", pass);
 #endif
 		
-		for (c = 0; c < 3; c += 2) {
-			for (pix = image; pix < image+width*height; pix++)
-				pix[0][3] = pix[0][c];
-			for (pix = image+width; pix < image+width*(height-1); pix++) {
-				if ((pix-image+1) % width < 2) continue;
-				for (k=0, i = -width; i <= width; i += width)
-					for (j = i-1; j <= i+1; j++)
-						med[k++] = pix[j][3] - pix[j][1];
-				for (i=0; i < sizeof opt; i+=2)
-					if     (med[opt[i]] > med[opt[i+1]])
-						SWAP (med[opt[i]] , med[opt[i+1]]);
-				pix[0][c] = CLIP(med[4] + pix[0][1]);
-			}
+		for (ctx.c = 0; ctx.c < 3; ctx.c += 2) {
+			// snapshot the colour, so bands may be written while their
+			// neighbours still read the unfiltered values
+			for (i = 0; i < (ctx.width * ctx.height); i++)
+				image[i][3] = image[i][ctx.c];
+			
+			dispatch_apply_f(ctx.numWorkers, DISPATCH_APPLY_AUTO, &ctx, TSRawMedianFilterWorker);
 		}
 		
 #if PRINT_DEBUG_INFO
 		DDLogDebug(@"Completed median filter pass %i", pass);
 #endif
 	}
+	
+	free(ctx.planes);
+}
+
+/**
+ * Median filters the difference between the snapshot of the colour (in the
+ * fourth component) and green over a worker's band of interior lines, and
+ * rebuilds the colour from it.
+ */
+static void TSRawMedianFilterWorker(void *_ctx, size_t worker) {
+	const median_filter_ctx_t *ctx = (const median_filter_ctx_t *) _ctx;
+	const size_t width = ctx->width;
+	const int c = ctx->c;
+	size_t row, col;
+	
+	// interior lines (excluding the first and last) handled by this worker
+	const size_t interior = ctx->height - 2;
+	const size_t first = 1 + ((interior * worker) / ctx->numWorkers);
+	const size_t last = 1 + ((interior * (worker + 1)) / ctx->numWorkers);
+	const size_t lines = last - first;
+	
+	if(!lines) return;
+	
+	float *diff = ctx->planes + (worker * ctx->planeSize);
+	float *med = diff + ((lines + 2) * width);
+	
+	// colour differences of the band and the lines either side of it
+	const uint16_t (*pix)[4] = ctx->image + ((first - 1) * width);
+	for(row = 0; row < ((lines + 2) * width); row++) {
+		diff[row] = (float) pix[row][3] - (float) pix[row][1];
+	}
+	
+	MedianFilter3x3(diff, width, med, width, width, lines);
+	
+	// rebuild the colour for all but the first and last columns
+	for(row = 0; row < lines; row++) {
+		uint16_t (*out)[4] = ctx->image + ((first + row) * width);
+		const float *m = med + (row * width);
+		
+		for(col = 1; col < (width - 1); col++) {
+			out[col][c] = CLIP(m[col] + out[col][1]);
+		}
+	}
 }
 
 #pragma mark - Output
@@ -422,12 +567,55 @@ void TSRawPostInterpolationMedianFilter(libraw_data_t *libRaw, uint16_t (*image)
  * @param histogram Pointer to the histogram to be created. Has 0x2000 bins,
  * times four for four possible colours.
  * @param gammaCurve Gamma curve buffer
+ *
+ * @return 0 on success, or -1 if the output curve couldn't be allocated; the
+ * image is unchanged in that case.
+ */
+int TSRawConvertToRGB(libraw_data_t *libRaw, uint16_t (*image)[4], uint16_t (*outBuf)[4], int *histogram, uint16_t *gammaCurve) {
+	return TSRawConvertToRGBInternal(libRaw, image, outBuf, false, histogram, gammaCurve);
+}
+
+/**
+ * Converts the output data to RGB format, writing half precision floats in
+ * the [0, 1] range with an opaque alpha component, ready to be uploaded to the
+ * GPU. This should be run after interpolation.
+ *
+ * The output pixels are as large as the input pixels, so this may be done in
+ * place.
+ *
+ * @param libRaw LibRaw instance from which to acquire some image info
+ * @param image Image buffer (after interpolation)
+ * @param outBuf Output data buffer
+ * @param histogram Pointer to the histogram to be created. Has 0x2000 bins,
+ * times four for four possible colours.
+ * @param gammaCurve Gamma curve buffer
+ *
+ * @return 0 on success, or -1 if the output curve couldn't be allocated; the
+ * image and output buffer are unchanged in that case.
+ */
+int TSRawConvertToRGBHalf(libraw_data_t *libRaw, uint16_t (*image)[4], __fp16 (*outBuf)[4], int *histogram, uint16_t *gammaCurve) {
+	return TSRawConvertToRGBInternal(libRaw, image, outBuf, true, histogram, gammaCurve);
+}
+
+/**
+ * Converts the output data to RGB, in either output format.
+ *
+ * The output curves are allocated before any pixels are touched, so a failed
+ * allocation leaves the image as it was.
  */
-void TSRawConvertToRGB(libraw_data_t *libRaw, uint16_t (*image)[4], uint16_t (*outBuf)[4], int *histogram, uint16_t *gammaCurve) {
-	size_t i, j, k;
-	size_t row, col, c;
-	uint16_t *img;
-	uint16_t *outPtr;
+static int TSRawConvertToRGBInternal(libraw_data_t *libRaw, uint16_t (*image)[4], void *outBuf, bool halfFloat, int *histogram, uint16_t *gammaCurve) {
+	size_t i, j, k, c;
+	
+	// the output curve is composed with the gamma curve, so each component needs
+	// only a single lookup; for half float output, it also does the conversion
+	uint16_t *lut = (uint16_t *) malloc(sizeof(uint16_t) * 0x10000);
+	__fp16 *halfLut = halfFloat ? (__fp16 *) malloc(sizeof(__fp16) * 0x10000) : NULL;
+	
+	if(!lut || (halfFloat && !halfLut)) {
+		free(halfLut);
+		free(lut);
+		return -1;
+	}
 	
 	// fill the gamma array
 	double gamm[6];
@@ -463,7 +651,7 @@ void TSRawConvertToRGB(libraw_data_t *libRaw, uint16_t (*image)[4], uint16_t (*o
 	ushort height = libRaw->sizes.height;
 	
 	// build the camera output profile
-	float out[3], out_cam[3][4];
+	float out_cam[3][4];
 	
 #if PRINT_DEBUG_INFO
 	// print gamma curves
@@ -497,38 +685,55 @@ void TSRawConvertToRGB(libraw_data_t *libRaw, uint16_t (*image)[4], uint16_t (*o
 		}
 	}
 	
-	// Set up for conversion to RGB
-	img = image[0];
+	// set up the workers; each gets a band of lines, and all but the first
+	// (which uses the caller's buffer) get a private histogram
+	rgb_convert_ctx_t ctx;
+	memset(&ctx, 0, sizeof ctx);
+	
+	ctx.image = image;
+	ctx.outBuf = outBuf;
+	ctx.halfFloat = halfFloat;
+	ctx.width = width;
+	ctx.height = height;
+	ctx.colors = libRaw->idata.colors;
+	
+	for(c = 0; c < 4; c++) {
+		ctx.matrix[c] = simd_make_float4(out_cam[0][c], out_cam[1][c], out_cam[2][c], 0.f);
+	}
+	
+	const size_t histogramSz = sizeof(int) * kHistogramBins * 4;
+	int *privateHistograms = NULL;
+	int *histograms[64];
+	
+	ctx.numWorkers = (size_t) MIN(MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), 64), MAX(height, 1));
+	if(ctx.numWorkers > 1) {
+		privateHistograms = (int *) calloc(ctx.numWorkers - 1, histogramSz);
+		if(!privateHistograms) ctx.numWorkers = 1;
+	}
+	
+	memset(histogram, 0, histogramSz);
+	histograms[0] = histogram;
+	
+	for(i = 1; i < ctx.numWorkers; i++) {
+		histograms[i] = privateHistograms + ((i - 1) * kHistogramBins * 4);
+	}
+	ctx.histograms = histograms;
 	
 #if PRINT_DEBUG_INFO
 	DDLogVerbose(@"Colours: %i", libRaw->idata.colors);
 #endif
 	
-	memset(histogram, 0, sizeof(int) * 0x2000 * 4);
+	// convert to RGB, then merge the histograms
+	dispatch_apply_f(ctx.numWorkers, DISPATCH_APPLY_AUTO, &ctx, TSRawConvertMatrixWorker);
 	
-	for(row = 0; row < height; row++) {
-		for(col = 0; col < width; col++, img += 4) {
-			// perform conversion
-			out[0] = out[1] = out[2] = 0;
-			
-			for(c = 0; c < libRaw->idata.colors; c++) {
-				out[0] += out_cam[0][c] * img[c];
-				out[1] += out_cam[1][c] * img[c];
-				out[2] += out_cam[2][c] * img[c];
-			}
-			
-			// write it back into the image buffer, as an integer value
-			for(c = 0; c < 3; c++) {
-				img[c] = CLIP((int) out[c]);
-			}
-			
-			// update histogram
-			for(c = 0; c < libRaw->idata.colors; c++) {
-				histogram[(c * 0x2000) + (img[c] >> 3)]++;
-			}
+	for(i = 1; i < ctx.numWorkers; i++) {
+		for(j = 0; j < (kHistogramBins * 4); j++) {
+			histogram[j] += histograms[i][j];
 		}
 	}
 	
+	free(privateHistograms);
+	
 	// calculate gamma curve based off histogram? idk
 	int perc, val, total, t_white = 0x2000;
 	perc = S.width * S.height;
@@ -545,17 +750,110 @@ void TSRawConvertToRGB(libraw_data_t *libRaw, uint16_t (*image)[4], uint16_t (*o
 #endif
 	TSBuildGammaCurve(gamm[0], gamm[1], 2, (t_white << 3), gammaCurve, gamm);
 	
+	// compose the output curve with the gamma curve
+	for(i = 0; i < 0x10000; i++) {
+		lut[i] = libRaw->color.curve[gammaCurve[i]];
+	}
+	
+	if(halfFloat) {
+		for(i = 0; i < 0x10000; i++) {
+			halfLut[i] = (__fp16) (lut[i] / 65536.f);
+		}
+	}
+	
 	// do gamma correction
-	img = image[0];
-	outPtr = outBuf[0];
-	
-	for(row = 0; row < height; row++) {
-		for(col = 0; col < width; col++, img += 4, outPtr += 4) {
-			for(c = 0; c < 3; c++) {
-				// apply curve
-				outPtr[c] = libRaw->color.curve[gammaCurve[img[c]]];
-				//				outPtr[c] = libRaw->color.curve[img[c]];
-			}
+	ctx.lut = lut;
+	ctx.halfLut = halfLut;
+	dispatch_apply_f(ctx.numWorkers, DISPATCH_APPLY_AUTO, &ctx, TSRawConvertCurveWorker);
+	
+	free(halfLut);
+	free(lut);
+	
+	return 0;
+}
+
+/**
+ * Gets the first and last (exclusive) line of a worker's band.
+ */
+static inline void TSRawConvertWorkerLines(const rgb_convert_ctx_t *ctx, size_t worker, size_t *first, size_t *last) {
+	*first = (ctx->height * worker) / ctx->numWorkers;
+	*last = (ctx->height * (worker + 1)) / ctx->numWorkers;
+}
+
+/**
+ * Multiplies each pixel in a worker's band by the output camera matrix, in
+ * place, and adds its components to the worker's histogram.
+ */
+static void TSRawConvertMatrixWorker(void *_ctx, size_t worker) {
+	const rgb_convert_ctx_t *ctx = (const rgb_convert_ctx_t *) _ctx;
+	int *histogram = ctx->histograms[worker];
+	const int colors = ctx->colors;
+	size_t first, last, i;
+	int c;
+	
+	TSRawConvertWorkerLines(ctx, worker, &first, &last);
+	
+	uint16_t *img = ctx->image[first * ctx->width];
+	const size_t pixels = (last - first) * ctx->width;
+	
+	const simd_float4 m0 = ctx->matrix[0], m1 = ctx->matrix[1];
+	const simd_float4 m2 = ctx->matrix[2], m3 = ctx->matrix[3];
+	const simd_float4 lo = 0.f, hi = 65535.f;
+	
+	for(i = 0; i < pixels; i++, img += 4) {
+		// perform conversion
+		simd_float4 out = (m0 * (float) img[0]) + (m1 * (float) img[1]) + (m2 * (float) img[2]);
+		if(colors > 3) {
+			out += m3 * (float) img[3];
+		}
+		
+		// write it back into the image buffer, as an integer value
+		const simd_ushort4 px = simd_ushort(simd_clamp(out, lo, hi));
+		img[0] = px.x;
+		img[1] = px.y;
+		img[2] = px.z;
+		
+		// update histogram
+		for(c = 0; c < colors; c++) {
+			histogram[(c * kHistogramBins) + (img[c] >> 3)]++;
+		}
+	}
+}
+
+/**
+ * Applies the composed curve to each pixel in a worker's band, writing it in
+ * the output format.
+ */
+static void TSRawConvertCurveWorker(void *_ctx, size_t worker) {
+	const rgb_convert_ctx_t *ctx = (const rgb_convert_ctx_t *) _ctx;
+	size_t first, last, i;
+	
+	TSRawConvertWorkerLines(ctx, worker, &first, &last);
+	
+	const uint16_t *img = ctx->image[first * ctx->width];
+	const size_t pixels = (last - first) * ctx->width;
+	
+	if(ctx->halfFloat) {
+		const __fp16 *lut = ctx->halfLut;
+		__fp16 *outPtr = ((__fp16 (*)[4]) ctx->outBuf)[first * ctx->width];
+		
+		// every component of a pixel is read before any are written
+		for(i = 0; i < pixels; i++, img += 4, outPtr += 4) {
+			const __fp16 r = lut[img[0]], g = lut[img[1]], b = lut[img[2]];
+			
+			outPtr[0] = r;
+			outPtr[1] = g;
+			outPtr[2] = b;
+			outPtr[3] = (__fp16) 1.f;
+		}
+	} else {
+		const uint16_t *lut = ctx->lut;
+		uint16_t *outPtr = ((uint16_t (*)[4]) ctx->outBuf)[first * ctx->width];
+		
+		for(i = 0; i < pixels; i++, img += 4, outPtr += 4) {
+			outPtr[0] = lut[img[0]];
+			outPtr[1] = lut[img[1]];
+			outPtr[2] = lut[img[2]];
 		}
 	}
 }
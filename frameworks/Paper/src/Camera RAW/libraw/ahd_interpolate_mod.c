@@ -11,6 +11,16 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <dispatch/dispatch.h>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
 
 #include "interpolation_shared.h"
 
@@ -53,6 +63,40 @@ the work of Keigo Hirakawa, Thomas Parks, and Paul Lee.
 AHD interpolation with built-in anti-aliasing feature
 */
 #define TS 256		/* Tile Size */
+#define TILE_BUFFER_SIZE (26*TS*TS)	/* rgb, lab and homo for one tile */
+
+/**
+ * State shared between all workers interpolating tiles of an image.
+ */
+typedef struct ahd_context {
+	ushort (*image)[4];
+	int width, height, colors;
+	unsigned int filters;
+
+	/// Camera RGB to XYZ conversion
+	float xyz_cam[3][4];
+	/// Cube root lookup table used for the CIELab conversion
+	const float *cbrt;
+
+	/// Scratch buffers, one for each worker
+	char *buffers;
+
+	/// Number of tiles in each row, and in total
+	int tilesAcross, numTiles;
+	/// Index of the next tile to be interpolated
+	atomic_int nextTile;
+
+	/// Polled between tiles; once it returns true, no more tiles are started
+	ahd_cancel_callback_t isCancelled;
+	void *cancelInfo;
+	/// Set once a worker has seen the cancellation
+	atomic_bool cancelled;
+} ahd_context_t;
+
+static void ahd_worker(void *ctx, size_t worker);
+static void ahd_interpolate_tile(ahd_context_t *ctx, int top, int left, char *buffer);
+static void cielab_row(ahd_context_t *ctx, const ushort (*rgb)[3], short *l, short *a, short *b, int n);
+static void homogeneity_row(short (*lab)[3][TS][TS], char (*homo)[TS][TS], int tr, int tc, int end);
 
 static const float d65_white[3] =  { 0.950456f, 1.0f, 1.088754f };
 
@@ -84,166 +128,405 @@ static inline void border_interpolate(int border, int width, int height, ushort
 /**
  * @param imageData Pointer to the libraw structure
  * @param image Image pointer, input
+ *
+ * Tiles are distributed over all cores; each worker thread has its own scratch
+ * buffer and pulls tiles until none are left.
  */
 void ahd_interpolate_mod(libraw_data_t *imageData, uint16_t (*image)[4]) {
-	int i, j, k, top, left, row, col, tr, tc, c, d, val, hm[2];
-	ushort (*pix)[4], (*rix)[3];
-	static const int dir[4] = { -1, 1, -TS, TS };
-	unsigned ldiff[2][4], abdiff[2][4], leps, abeps;
-	float r, cbrt[0x10000], xyz[3], xyz_cam[3][4];
-	ushort (*rgb)[TS][TS][3];
-	short (*lab)[TS][TS][3], (*lix)[3];
-	char (*homo)[TS][TS], *buffer;
+	ahd_interpolate_mod_cancellable(imageData, image, NULL, NULL);
+}
+
+/**
+ * @param imageData Pointer to the libraw structure
+ * @param image Image pointer, input
+ * @param isCancelled Invoked with the info pointer before each tile; may be NULL
+ * @param info Pointer passed to the cancellation callback
+ *
+ * @return Whether the image was interpolated, cancelled, or failed
+ */
+ahd_result_t ahd_interpolate_mod_cancellable(libraw_data_t *imageData, uint16_t (*image)[4],
+	ahd_cancel_callback_t isCancelled, void *info) {
+	int i, j, k, tilesDown, numWorkers = 0;
+	float r, cbrt[0x10000];
+	ahd_context_t ctx;
+
+	memset(&ctx, 0, sizeof ctx);
+	ctx.isCancelled = isCancelled;
+	ctx.cancelInfo = info;
+	atomic_init(&ctx.cancelled, false);
 	
 	// read out a bunch of data
-	ushort width = imageData->sizes.width;
-	ushort height = imageData->sizes.height;
-	unsigned int filters = imageData->idata.filters;
+	ctx.image = image;
+	ctx.width = imageData->sizes.width;
+	ctx.height = imageData->sizes.height;
+	ctx.filters = imageData->idata.filters;
 	ushort top_margin = imageData->sizes.top_margin;
 	ushort left_margin = imageData->sizes.left_margin;
 	
-	int colors = imageData->idata.colors;
+	int colors = ctx.colors = imageData->idata.colors;
 
 	// some sort of thingie generated
 	for (i=0; i < 0x10000; i++) {
 		r = i / 65535.0;
 		cbrt[i] = r > 0.008856 ? pow((double)r,1/3.0) : 7.787*r + 16/116.0;
 	}
+	ctx.cbrt = cbrt;
 	
 	// do some interpolation?
 	for (i=0; i < 3; i++)
 		for (j=0; j < colors; j++)
-			for (xyz_cam[i][j] = k=0; k < 3; k++)
-				xyz_cam[i][j] += xyz_rgb[i][k] * imageData->color.rgb_cam[k][j] / d65_white[i];
+			for (ctx.xyz_cam[i][j] = k=0; k < 3; k++)
+				ctx.xyz_cam[i][j] += xyz_rgb[i][k] * imageData->color.rgb_cam[k][j] / d65_white[i];
+
+	// tiles start at 3 and overlap their neighbours by 7 pixels
+	ctx.tilesAcross = (ctx.width > 9) ? (ctx.width - 9 + TS - 8) / (TS - 7) : 0;
+	tilesDown = (ctx.height > 9) ? (ctx.height - 9 + TS - 8) / (TS - 7) : 0;
+	ctx.numTiles = ctx.tilesAcross * tilesDown;
+	atomic_init(&ctx.nextTile, 0);
+
+	// allocate a scratch buffer for each worker, before anything is written
+	if (ctx.numTiles) {
+		numWorkers = (int) MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), ctx.numTiles);
+		ctx.buffers = (char *) malloc ((size_t) numWorkers * TILE_BUFFER_SIZE);		/* 1664 kB each */
+		if (!ctx.buffers) return kAHDResultNoMemory;
+	}
+
+	border_interpolate(6, ctx.width, ctx.height, image, ctx.filters, top_margin, left_margin, colors);
+
+	if (!ctx.numTiles) return kAHDResultSuccess;
+
+	dispatch_apply_f(numWorkers, DISPATCH_APPLY_AUTO, &ctx, ahd_worker);
+
+	free(ctx.buffers);
+	return atomic_load(&ctx.cancelled) ? kAHDResultCancelled : kAHDResultSuccess;
+}
+
+/**
+ * Interpolates tiles with this worker's scratch buffer until all tiles have
+ * been claimed.
+ */
+static void ahd_worker(void *_ctx, size_t worker) {
+	ahd_context_t *ctx = (ahd_context_t *) _ctx;
+	char *buffer = ctx->buffers + (worker * TILE_BUFFER_SIZE);
+	int tile;
+
+	while ((tile = atomic_fetch_add(&ctx->nextTile, 1)) < ctx->numTiles) {
+		if (atomic_load(&ctx->cancelled)) return;
+		if (ctx->isCancelled && ctx->isCancelled(ctx->cancelInfo)) {
+			atomic_store(&ctx->cancelled, true);
+			return;
+		}
+
+		ahd_interpolate_tile(ctx, 3 + (tile / ctx->tilesAcross) * (TS-7),
+			3 + (tile % ctx->tilesAcross) * (TS-7), buffer);
+	}
+}
+
+/**
+ * Interpolates a single tile whose top left corner is at the given position.
+ *
+ * Tiles only ever read the CFA value of each pixel, and only write back the
+ * interpolated components, so any number of them may be processed at once.
+ */
+static void ahd_interpolate_tile(ahd_context_t *ctx, int top, int left, char *buffer) {
+	int row, col, tr, tc, c, d, i, j, val, hm[2], f;
+	ushort (*pix)[4], (*rix)[3];
+	ushort (*rgb)[TS][TS][3];
+	short (*lab)[3][TS][TS];
+	char (*homo)[TS][TS];
+
+	ushort (*image)[4] = ctx->image;
+	const int width = ctx->width, height = ctx->height;
+	const unsigned int filters = ctx->filters;
 
-	border_interpolate(6, width, height, image, filters, top_margin, left_margin, colors);
-	buffer = (char *) malloc (26*TS*TS);		/* 1664 kB */
-//	merror (buffer, "ahd_interpolate()");
 	rgb  = (ushort(*)[TS][TS][3]) buffer;
-	lab  = (short (*)[TS][TS][3])(buffer + 12*TS*TS);
+	lab  = (short (*)[3][TS][TS])(buffer + 12*TS*TS);
 	homo = (char  (*)[TS][TS])   (buffer + 24*TS*TS);
 
-	for (top=3; top < height-6; top += TS-7)
-		for (left=3; left < width-6; left += TS-7) {
-			/*  Interpolate green horizontally and vertically: */
-			for (row = top; row < top+TS && row < height-3; row++) {
-				col = left + (FC(row, left, filters) & 1);
-				for (c = FC(row, col, filters); col < left+TS && col < width-3; col+=2) {
-					pix = image + row*width+col;
-					val = ((pix[-1][1] + pix[0][c] + pix[1][1]) * 2
-						- pix[-2][c] - pix[2][c] + 2) >> 2;
-					if (val < 0 || val > 65535) {
-						val = (pix[-3][1] + pix[3][1] +
-							18*(2*pix[0][c] - pix[-2][c] - pix[2][c]) +
-							63*(pix[-1][1] + pix[1][1]) + 64) >> 7;
-						if (val < 0 || val > 65535) {
-							val = (4*(pix[-1][1] + pix[1][1]) +
-								2*pix[0][c]-pix[-2][c]-pix[2][c] + 4) >> 3;
-							if (val < 0 || val > 65535)
-								val = (pix[-1][1] + pix[1][1] + 1) >> 1; }}
-					rgb[0][row-top][col-left][1] = val;
-					val = ((pix[-width][1] + pix[0][c] + pix[width][1]) * 2
-						- pix[-2*width][c] - pix[2*width][c] + 2) >> 2;
-					if (val < 0 || val > 65535) {
-						val = (pix[-3*width][1] + pix[3*width][1] +
-							18*(2*pix[0][c] - pix[-2*width][c] - pix[2*width][c]) +
-							63*(pix[-width][1] + pix[width][1]) + 64) >> 7;
-						if (val < 0 || val > 65535) {
-							val = (4*(pix[-width][1] + pix[width][1]) +
-								2*pix[0][c]-pix[-2*width][c]-pix[2*width][c] + 4) >> 3;
-							if (val < 0 || val > 65535)
-								val = (pix[-width][1] + pix[width][1] + 1) >> 1; }}
-					rgb[1][row-top][col-left][1] = val;
-				}
+	/*  Interpolate green horizontally and vertically: */
+	for (row = top; row < top+TS && row < height-3; row++) {
+		col = left + (FC(row, left, filters) & 1);
+		for (c = FC(row, col, filters); col < left+TS && col < width-3; col+=2) {
+			pix = image + row*width+col;
+			val = ((pix[-1][1] + pix[0][c] + pix[1][1]) * 2
+				- pix[-2][c] - pix[2][c] + 2) >> 2;
+			if (val < 0 || val > 65535) {
+				val = (pix[-3][1] + pix[3][1] +
+					18*(2*pix[0][c] - pix[-2][c] - pix[2][c]) +
+					63*(pix[-1][1] + pix[1][1]) + 64) >> 7;
+				if (val < 0 || val > 65535) {
+					val = (4*(pix[-1][1] + pix[1][1]) +
+						2*pix[0][c]-pix[-2][c]-pix[2][c] + 4) >> 3;
+					if (val < 0 || val > 65535)
+						val = (pix[-1][1] + pix[1][1] + 1) >> 1; }}
+			rgb[0][row-top][col-left][1] = val;
+			val = ((pix[-width][1] + pix[0][c] + pix[width][1]) * 2
+				- pix[-2*width][c] - pix[2*width][c] + 2) >> 2;
+			if (val < 0 || val > 65535) {
+				val = (pix[-3*width][1] + pix[3*width][1] +
+					18*(2*pix[0][c] - pix[-2*width][c] - pix[2*width][c]) +
+					63*(pix[-width][1] + pix[width][1]) + 64) >> 7;
+				if (val < 0 || val > 65535) {
+					val = (4*(pix[-width][1] + pix[width][1]) +
+						2*pix[0][c]-pix[-2*width][c]-pix[2*width][c] + 4) >> 3;
+					if (val < 0 || val > 65535)
+						val = (pix[-width][1] + pix[width][1] + 1) >> 1; }}
+			rgb[1][row-top][col-left][1] = val;
+		}
+	}
+	
+	/*  Interpolate red and blue, and convert to CIELab: */
+	for (d=0; d < 2; d++)
+		for (row=top+1; row < top+TS-1 && row < height-4; row++) {
+			for (col=left+1; col < left+TS-1 && col < width-4; col++) {
+				pix = image + row*width+col;
+				rix = &rgb[d][row-top][col-left];
+				if ((c = 2 - FC(row, col, filters)) == 1) {
+					c = FC(row+1, col, filters);
+					val = pix[0][1] + (( pix[-1][2-c] + pix[1][2-c]
+					- rix[-1][1] - rix[1][1] + 1) >> 1);
+					if (val < 0 || val > 65535)
+						val = (pix[-1][2-c] + pix[1][2-c] + 1) >> 1;
+					rix[0][2-c] = val;
+					val = pix[0][1] + (( pix[-width][c] + pix[width][c]
+					- rix[-TS][1] - rix[TS][1] + 1) >> 1);
+					if (val < 0 || val > 65535)
+						val = (pix[-width][c] + pix[width][c] + 1) >> 1;
+				} else {
+					val = rix[0][1] + (( pix[-width-1][c] + pix[-width+1][c]
+					+ pix[+width-1][c] + pix[+width+1][c]
+					- rix[-TS-1][1] - rix[-TS+1][1]
+					- rix[+TS-1][1] - rix[+TS+1][1] + 2) >> 2);
+					if (val < 0 || val > 65535)
+						val = (pix[-width-1][c] + pix[-width+1][c] +
+						pix[ width-1][c] + pix[ width+1][c] + 2) >> 2; }
+				rix[0][c] = val;
+				c = FC(row, col, filters);
+				rix[0][c] = pix[0][c];
 			}
-			
-			/*  Interpolate red and blue, and convert to CIELab: */
-			for (d=0; d < 2; d++)
-				for (row=top+1; row < top+TS-1 && row < height-4; row++)
-					for (col=left+1; col < left+TS-1 && col < width-4; col++) {
-						pix = image + row*width+col;
-						rix = &rgb[d][row-top][col-left];
-						lix = &lab[d][row-top][col-left];
-						if ((c = 2 - FC(row, col, filters)) == 1) {
-							c = FC(row+1, col, filters);
-							val = pix[0][1] + (( pix[-1][2-c] + pix[1][2-c]
-							- rix[-1][1] - rix[1][1] + 1) >> 1);
-							if (val < 0 || val > 65535)
-								val = (pix[-1][2-c] + pix[1][2-c] + 1) >> 1;
-							rix[0][2-c] = val;
-							val = pix[0][1] + (( pix[-width][c] + pix[width][c]
-							- rix[-TS][1] - rix[TS][1] + 1) >> 1);
-							if (val < 0 || val > 65535)
-								val = (pix[-width][c] + pix[width][c] + 1) >> 1;
-						} else {
-							val = rix[0][1] + (( pix[-width-1][c] + pix[-width+1][c]
-							+ pix[+width-1][c] + pix[+width+1][c]
-							- rix[-TS-1][1] - rix[-TS+1][1]
-							- rix[+TS-1][1] - rix[+TS+1][1] + 2) >> 2);
-							if (val < 0 || val > 65535)
-								val = (pix[-width-1][c] + pix[-width+1][c] +
-								pix[ width-1][c] + pix[ width+1][c] + 2) >> 2; }
-						rix[0][c] = val;
-						c = FC(row, col, filters);
-						rix[0][c] = pix[0][c];
-						xyz[0] = xyz[1] = xyz[2] = 0.5;
-						FORCC {
-							xyz[0] += xyz_cam[0][c] * rix[0][c];
-							xyz[1] += xyz_cam[1][c] * rix[0][c];
-							xyz[2] += xyz_cam[2][c] * rix[0][c];
-						}
-						xyz[0] = cbrt[CLIP((int) xyz[0])];
-						xyz[1] = cbrt[CLIP((int) xyz[1])];
-						xyz[2] = cbrt[CLIP((int) xyz[2])];
-						lix[0][0] = 64 * (116 * xyz[1] - 16);
-						lix[0][1] = 64 * 500 * (xyz[0] - xyz[1]);
-						lix[0][2] = 64 * 200 * (xyz[1] - xyz[2]);
-					}
-			
-					/*  Build homogeneity maps from the CIELab images: */
-					memset (homo, 0, 2*TS*TS);
-					for (row=top+2; row < top+TS-2 && row < height-5; row++) {
-						tr = row-top;
-						for (col=left+2; col < left+TS-2 && col < width-5; col++) {
-							tc = col-left;
-							for (d=0; d < 2; d++) {
-								lix = &lab[d][tr][tc];
-								for (i=0; i < 4; i++) {
-									ldiff[d][i] = ABS(lix[0][0]-lix[dir[i]][0]);
-									abdiff[d][i] = SQR(lix[0][1]-lix[dir[i]][1])
-										+ SQR(lix[0][2]-lix[dir[i]][2]);
-								}
-							}
-							leps = MIN(MAX(ldiff[0][0],ldiff[0][1]),
-								MAX(ldiff[1][2],ldiff[1][3]));
-							abeps = MIN(MAX(abdiff[0][0],abdiff[0][1]),
-								MAX(abdiff[1][2],abdiff[1][3]));
-							for (d=0; d < 2; d++)
-								for (i=0; i < 4; i++)
-									if (ldiff[d][i] <= leps && abdiff[d][i] <= abeps)
-										homo[d][tr][tc]++;
-						}
-					}
-			
-					/* Combine the most homogenous pixels for the final result: */
-					for (row=top+3; row < top+TS-3 && row < height-6; row++) {
-						tr = row-top;
-						for (col=left+3; col < left+TS-3 && col < width-6; col++) {
-							tc = col-left;
-							for (d=0; d < 2; d++)
-								for (hm[d]=0, i=tr-1; i <= tr+1; i++)
-									for (j=tc-1; j <= tc+1; j++)
-										hm[d] += homo[d][i][j];
-							if (hm[0] != hm[1])
-								FORC3 image[row*width+col][c] = rgb[hm[1] > hm[0]][tr][tc][c];
-							else
-								FORC3 image[row*width+col][c] =
-								(rgb[0][tr][tc][c] + rgb[1][tr][tc][c] + 1) >> 1;
-						}
-					}
+
+			// convert the entire line at once
+			tr = row-top;
+			cielab_row(ctx, &rgb[d][tr][1], &lab[d][0][tr][1], &lab[d][1][tr][1],
+				&lab[d][2][tr][1], col-left-1);
 		}
 	
-		free(buffer);
+	/*  Build homogeneity maps from the CIELab images: */
+	memset (homo, 0, 2*TS*TS);
+	for (row=top+2; row < top+TS-2 && row < height-5; row++) {
+		homogeneity_row(lab, homo, row-top, 2, MIN(TS-2, width-5-left));
+	}
+	
+	/* Combine the most homogenous pixels for the final result: */
+	for (row=top+3; row < top+TS-3 && row < height-6; row++) {
+		tr = row-top;
+		for (col=left+3; col < left+TS-3 && col < width-6; col++) {
+			tc = col-left;
+			for (d=0; d < 2; d++)
+				for (hm[d]=0, i=tr-1; i <= tr+1; i++)
+					for (j=tc-1; j <= tc+1; j++)
+						hm[d] += homo[d][i][j];
+			/* the CFA value is unchanged, and may be read by other tiles */
+			f = FC(row, col, filters);
+			if (hm[0] != hm[1]) {
+				FORC3 if (c != f) image[row*width+col][c] = rgb[hm[1] > hm[0]][tr][tc][c];
+			} else {
+				FORC3 if (c != f) image[row*width+col][c] =
+				(rgb[0][tr][tc][c] + rgb[1][tr][tc][c] + 1) >> 1;
+			}
+		}
+	}
+}
+
+/**
+ * Converts a line of interpolated pixels to CIELab. The L, a and b components
+ * are written to separate planes.
+ */
+static void cielab_row(ahd_context_t *ctx, const ushort (*rgb)[3], short *l, short *a, short *b, int n) {
+	int i = 0, c;
+	float xyz[3];
+	const int colors = ctx->colors;
+	const float (*xyz_cam)[4] = ctx->xyz_cam;
+	const float *cbrt = ctx->cbrt;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+	if (colors == 3) {
+		for (; (i + 4) <= n; i += 4) {
+			int32_t idx[3][4];
+			float cube[3][4];
+			const uint16x4x3_t px = vld3_u16(rgb[i]);
+			const float32x4_t r = vcvtq_f32_u32(vmovl_u16(px.val[0]));
+			const float32x4_t g = vcvtq_f32_u32(vmovl_u16(px.val[1]));
+			const float32x4_t bl = vcvtq_f32_u32(vmovl_u16(px.val[2]));
+
+			for (c = 0; c < 3; c++) {
+				float32x4_t v = vaddq_f32(vdupq_n_f32(0.5f), vmulq_n_f32(r, xyz_cam[c][0]));
+				v = vaddq_f32(v, vmulq_n_f32(g, xyz_cam[c][1]));
+				v = vaddq_f32(v, vmulq_n_f32(bl, xyz_cam[c][2]));
+				vst1q_s32(idx[c], vminq_s32(vmaxq_s32(vcvtq_s32_f32(v), vdupq_n_s32(0)), vdupq_n_s32(65535)));
+			}
+			for (c = 0; c < 3; c++) {
+				cube[c][0] = cbrt[idx[c][0]];
+				cube[c][1] = cbrt[idx[c][1]];
+				cube[c][2] = cbrt[idx[c][2]];
+				cube[c][3] = cbrt[idx[c][3]];
+			}
+
+			const float32x4_t x = vld1q_f32(cube[0]), y = vld1q_f32(cube[1]), z = vld1q_f32(cube[2]);
+			vst1_s16(l + i, vmovn_s32(vcvtq_s32_f32(vmulq_n_f32(vsubq_f32(vmulq_n_f32(y, 116.f), vdupq_n_f32(16.f)), 64.f))));
+			vst1_s16(a + i, vmovn_s32(vcvtq_s32_f32(vmulq_n_f32(vsubq_f32(x, y), 64.f * 500.f))));
+			vst1_s16(b + i, vmovn_s32(vcvtq_s32_f32(vmulq_n_f32(vsubq_f32(y, z), 64.f * 200.f))));
+		}
+	}
+#elif defined(__SSE4_1__)
+	if (colors == 3) {
+		for (; (i + 4) <= n; i += 4) {
+			int32_t idx[3][4];
+			float cube[3][4];
+			const __m128 r = _mm_setr_ps(rgb[i][0], rgb[i+1][0], rgb[i+2][0], rgb[i+3][0]);
+			const __m128 g = _mm_setr_ps(rgb[i][1], rgb[i+1][1], rgb[i+2][1], rgb[i+3][1]);
+			const __m128 bl = _mm_setr_ps(rgb[i][2], rgb[i+1][2], rgb[i+2][2], rgb[i+3][2]);
+
+			for (c = 0; c < 3; c++) {
+				__m128 v = _mm_add_ps(_mm_set1_ps(0.5f), _mm_mul_ps(r, _mm_set1_ps(xyz_cam[c][0])));
+				v = _mm_add_ps(v, _mm_mul_ps(g, _mm_set1_ps(xyz_cam[c][1])));
+				v = _mm_add_ps(v, _mm_mul_ps(bl, _mm_set1_ps(xyz_cam[c][2])));
+				_mm_storeu_si128((__m128i *) idx[c], _mm_min_epi32(_mm_max_epi32(_mm_cvttps_epi32(v),
+					_mm_setzero_si128()), _mm_set1_epi32(65535)));
+			}
+			for (c = 0; c < 3; c++) {
+				cube[c][0] = cbrt[idx[c][0]];
+				cube[c][1] = cbrt[idx[c][1]];
+				cube[c][2] = cbrt[idx[c][2]];
+				cube[c][3] = cbrt[idx[c][3]];
+			}
+
+			const __m128 x = _mm_loadu_ps(cube[0]), y = _mm_loadu_ps(cube[1]), z = _mm_loadu_ps(cube[2]);
+			const __m128i lv = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(_mm_mul_ps(y, _mm_set1_ps(116.f)), _mm_set1_ps(16.f)), _mm_set1_ps(64.f)));
+			const __m128i av = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(x, y), _mm_set1_ps(64.f * 500.f)));
+			const __m128i bv = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(y, z), _mm_set1_ps(64.f * 200.f)));
+			_mm_storel_epi64((__m128i *) (l + i), _mm_packs_epi32(lv, lv));
+			_mm_storel_epi64((__m128i *) (a + i), _mm_packs_epi32(av, av));
+			_mm_storel_epi64((__m128i *) (b + i), _mm_packs_epi32(bv, bv));
+		}
+	}
+#endif
+
+	// remaining pixels
+	for (; i < n; i++) {
+		xyz[0] = xyz[1] = xyz[2] = 0.5;
+		FORCC {
+			xyz[0] += xyz_cam[0][c] * rgb[i][c];
+			xyz[1] += xyz_cam[1][c] * rgb[i][c];
+			xyz[2] += xyz_cam[2][c] * rgb[i][c];
+		}
+		xyz[0] = cbrt[CLIP((int) xyz[0])];
+		xyz[1] = cbrt[CLIP((int) xyz[1])];
+		xyz[2] = cbrt[CLIP((int) xyz[2])];
+		l[i] = 64 * (116 * xyz[1] - 16);
+		a[i] = 64 * 500 * (xyz[0] - xyz[1]);
+		b[i] = 64 * 200 * (xyz[1] - xyz[2]);
+	}
+}
+
+/**
+ * Builds the homogeneity maps for columns [tc, end) of a line of the tile.
+ */
+static void homogeneity_row(short (*lab)[3][TS][TS], char (*homo)[TS][TS], int tr, int tc, int end) {
+	static const int dir[4] = { -1, 1, -TS, TS };
+	unsigned ldiff[2][4], abdiff[2][4], leps, abeps;
+	int d, i;
+	const short *lix, *aix, *bix;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+	for (; (tc + 4) <= end; tc += 4) {
+		uint32x4_t lv[2][4], abv[2][4], lepsv, abepsv, count;
+
+		for (d=0; d < 2; d++) {
+			lix = &lab[d][0][tr][tc];
+			aix = &lab[d][1][tr][tc];
+			bix = &lab[d][2][tr][tc];
+			const int16x4_t l0 = vld1_s16(lix), a0 = vld1_s16(aix), b0 = vld1_s16(bix);
+
+			for (i=0; i < 4; i++) {
+				const int32x4_t da = vsubl_s16(a0, vld1_s16(aix + dir[i]));
+				const int32x4_t db = vsubl_s16(b0, vld1_s16(bix + dir[i]));
+				lv[d][i] = vreinterpretq_u32_s32(vabdl_s16(l0, vld1_s16(lix + dir[i])));
+				abv[d][i] = vreinterpretq_u32_s32(vaddq_s32(vmulq_s32(da, da), vmulq_s32(db, db)));
+			}
+		}
+		lepsv = vminq_u32(vmaxq_u32(lv[0][0], lv[0][1]), vmaxq_u32(lv[1][2], lv[1][3]));
+		abepsv = vminq_u32(vmaxq_u32(abv[0][0], abv[0][1]), vmaxq_u32(abv[1][2], abv[1][3]));
+
+		for (d=0; d < 2; d++) {
+			count = vdupq_n_u32(0);
+			for (i=0; i < 4; i++)
+				count = vsubq_u32(count, vandq_u32(vcleq_u32(lv[d][i], lepsv), vcleq_u32(abv[d][i], abepsv)));
+
+			const uint8x8_t bytes = vmovn_u16(vcombine_u16(vmovn_u32(count), vdup_n_u16(0)));
+			vst1_lane_u32((uint32_t *) &homo[d][tr][tc], vreinterpret_u32_u8(bytes), 0);
+		}
+	}
+#elif defined(__SSE4_1__)
+	for (; (tc + 4) <= end; tc += 4) {
+		__m128i lv[2][4], abv[2][4], lepsv, abepsv, count;
+
+		for (d=0; d < 2; d++) {
+			lix = &lab[d][0][tr][tc];
+			aix = &lab[d][1][tr][tc];
+			bix = &lab[d][2][tr][tc];
+			const __m128i l0 = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *) lix));
+			const __m128i a0 = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *) aix));
+			const __m128i b0 = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *) bix));
+
+			for (i=0; i < 4; i++) {
+				const __m128i ln = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *) (lix + dir[i])));
+				const __m128i da = _mm_sub_epi32(a0, _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *) (aix + dir[i]))));
+				const __m128i db = _mm_sub_epi32(b0, _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *) (bix + dir[i]))));
+				lv[d][i] = _mm_abs_epi32(_mm_sub_epi32(l0, ln));
+				abv[d][i] = _mm_add_epi32(_mm_mullo_epi32(da, da), _mm_mullo_epi32(db, db));
+			}
+		}
+		lepsv = _mm_min_epu32(_mm_max_epu32(lv[0][0], lv[0][1]), _mm_max_epu32(lv[1][2], lv[1][3]));
+		abepsv = _mm_min_epu32(_mm_max_epu32(abv[0][0], abv[0][1]), _mm_max_epu32(abv[1][2], abv[1][3]));
+
+		for (d=0; d < 2; d++) {
+			count = _mm_setzero_si128();
+			for (i=0; i < 4; i++) {
+				/* unsigned a <= b if min(a, b) == a */
+				const __m128i lle = _mm_cmpeq_epi32(_mm_min_epu32(lv[d][i], lepsv), lv[d][i]);
+				const __m128i able = _mm_cmpeq_epi32(_mm_min_epu32(abv[d][i], abepsv), abv[d][i]);
+				count = _mm_sub_epi32(count, _mm_and_si128(lle, able));
+			}
+
+			const __m128i words = _mm_packs_epi32(count, count);
+			const int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+			memcpy(&homo[d][tr][tc], &bytes, 4);
+		}
+	}
+#endif
+
+	// remaining pixels
+	for (; tc < end; tc++) {
+		for (d=0; d < 2; d++) {
+			lix = &lab[d][0][tr][tc];
+			aix = &lab[d][1][tr][tc];
+			bix = &lab[d][2][tr][tc];
+			for (i=0; i < 4; i++) {
+				ldiff[d][i] = ABS(lix[0]-lix[dir[i]]);
+				abdiff[d][i] = SQR(aix[0]-aix[dir[i]])
+					+ SQR(bix[0]-bix[dir[i]]);
+			}
+		}
+		leps = MIN(MAX(ldiff[0][0],ldiff[0][1]),
+			MAX(ldiff[1][2],ldiff[1][3]));
+		abeps = MIN(MAX(abdiff[0][0],abdiff[0][1]),
+			MAX(abdiff[1][2],abdiff[1][3]));
+		for (d=0; d < 2; d++)
+			for (i=0; i < 4; i++)
+				if (ldiff[d][i] <= leps && abdiff[d][i] <= abeps)
+					homo[d][tr][tc]++;
+	}
 }
 
-#undef TS
\ No newline at end of file
+#undef TS
@@ -10,6 +10,7 @@
 #define ahd_interpolate_mod_h
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "libraw.h"
 
@@ -23,6 +24,38 @@ extern "C" {
  */
 void ahd_interpolate_mod(libraw_data_t *imageData, uint16_t (*image)[4]);
 
+/**
+ * Callback polled to determine whether an interpolation should be cancelled.
+ */
+typedef bool (*ahd_cancel_callback_t)(void *info);
+
+/**
+ * Results of a cancellable interpolation
+ */
+typedef enum ahd_result {
+	/// All tiles were interpolated
+	kAHDResultSuccess = 0,
+	/// The image was only partially interpolated, since it was cancelled
+	kAHDResultCancelled = 1,
+	/// Scratch buffers couldn't be allocated; the image wasn't modified
+	kAHDResultNoMemory = -1,
+} ahd_result_t;
+
+/**
+ * Interpolates the image like ahd_interpolate_mod(), but checks whether it
+ * should stop before starting each tile. Tiles only read the CFA value of each
+ * pixel, so a cancelled image can be interpolated again later.
+ *
+ * @param imageData Pointer to the libraw structure
+ * @param image Image pointer, input
+ * @param isCancelled Invoked with the info pointer before each tile; may be NULL
+ * @param info Pointer passed to the cancellation callback
+ *
+ * @return Whether the image was interpolated, cancelled, or failed
+ */
+ahd_result_t ahd_interpolate_mod_cancellable(libraw_data_t *imageData, uint16_t (*image)[4],
+	ahd_cancel_callback_t isCancelled, void *info);
+
 #ifdef __cplusplus
 }
 #endif
@@ -22,8 +22,10 @@ extern "C" {
  *
  * @param imageData Pointer to the libraw structure
  * @param image Image pointer, input
+ * @param medianPasses Number of median filter passes used to refine the colour
+ * differences (up to 3), or 0 to skip them
  */
-void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4]);
+void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4], int medianPasses);
 
 
 #ifdef __cplusplus
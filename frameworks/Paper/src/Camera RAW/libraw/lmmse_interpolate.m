@@ -21,8 +21,13 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <dispatch/dispatch.h>
 
 #include "interpolation_shared.h"
+#include "median.h"
 #include <libraw.h>
 
 #import <os/log.h>
@@ -39,69 +44,168 @@ static void InitLogger() {
     gLmsseSignpost = os_signpost_id_generate(gLogger);
 }
 
+// LSMME demosaicing algorithm
+// L. Zhang and X. Wu,
+// Color demosaicking via directional linear minimum mean square-error
+// estimation, IEEE Trans. on Image Processing, vol. 14, pp. 2167-2178,
+// Dec. 2005.
+
 /**
- * Set to 1 to evaluate the time taken for various subcomponents of the LMMSE
- * interpolation.
+ * Lines of context around each tile that are interpolated along with it. This
+ * covers the reach of all filters (including the median filter) and is a
+ * multiple of 8, so the CFA pattern lines up the same way in every tile.
  */
-#define DEBUG_TIME_PROFILE	1
+#define HALO_LINES	16
+/// Size of the tiles the image is interpolated in, not including the halo
+#define TILE_SIZE	256
+/// Border of zeros around each tile in the working buffer
+#define BORDER		10
+/// Most median filter passes supported within the halo
+#define MAX_MEDIAN_PASSES	3
 
 /**
- * Set to 0 to disable the median filter. It takes up a _massive_ amount of
- * processing time (more than thrice than every other part of the algorithm)
- * but has a very negligible impact on the final image.
+ * State shared by all workers interpolating the tiles of an image
  */
-#define USE_MEDIAN_FILTER	0
+typedef struct {
+	uint16_t (*image)[4];
+	int width, height;
+	unsigned int filters;
+	int medianPasses;
 
-// LSMME demosaicing algorithm
-// L. Zhang and X. Wu,
-// Color demosaicking via directional linear minimum mean square-error
-// estimation, IEEE Trans. on Image Processing, vol. 14, pp. 2167-2178,
-// Dec. 2005.
-#define PIX_SORT(a,b) { if ((a)>(b)) {temp=(a);(a)=(b);(b)=temp;} }
+	/// Number of tiles across, and in total
+	int tilesAcross, numTiles;
+	/// Index of the next tile to be interpolated
+	atomic_int nextTile;
+
+	/// Working buffer of each worker; the tile buffer followed by the median planes
+	char *buffers;
+	size_t bufferSize;
+	/// Number of pixels in the largest tile, including its halo and boundary
+	size_t tilePixels;
+} lmmse_ctx_t;
+
+static void lmmse_worker(void *_ctx, size_t worker);
+static void lmmse_interpolate_tile(uint16_t (*image)[4], int width, int height,
+	unsigned int filters, int top, int left, int tileRows, int tileCols,
+	int medianPasses, float (*qix)[6], float *planes);
+static void lmmse_median_refine(float (*qix)[6], int rr1, int cc1,
+	unsigned int filters, int passes, float *planes);
 
 /**
  * Interpolates missing colour components in a Bayer image, using the LSMME
  * algorithm, as demonstrated by Wu-Zhang.
  *
+ * The image is processed in tiles, so the working buffers only need to hold a
+ * single tile and its halo rather than the entire image; tiles are spread over
+ * all CPUs.
+ *
  * @param imageData Pointer to the libraw structure
  * @param image Image pointer, input
- * @param gamma_apply Whether gamma should be applied
+ * @param medianPasses Number of median filter passes used to refine the colour
+ * differences, or 0 to skip this (slower) step
  */
-void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4]) {
-	ushort (*pix)[4];
-	int row, col, c, w1, w2, w3, w4, ii, ba, rr1, cc1, rr, cc;
-	float h0, h1, h2, h3, h4, hs;
-	float p1, p2, p3, p4, p5, p6, p7, p8, p9;
-	float Y, v0, mu, vx, vn, xh, vh, xv, vv;
-	float (*rix)[6], (*qix)[6];
-	char  *buffer;
+void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4], int medianPasses) {
+	lmmse_ctx_t ctx;
+	int tilesDown, numWorkers;
 	
-#if USE_MEDIAN_FILTER
-	int d, pass;
-	float temp;
-#endif
-    
     static dispatch_once_t onceToken;
     dispatch_once(&onceToken, ^{
         InitLogger();
     });
 	
-    os_signpost_interval_begin(gLogger, gLmsseSignpost, "LMSSE Interpolate");
+	memset(&ctx, 0, sizeof ctx);
 	
 	// read out a bunch of data
-	ushort width = imageData->sizes.width;
-	ushort height = imageData->sizes.height;
-	unsigned int filters = imageData->idata.filters;
+	ctx.image = image;
+	ctx.width = imageData->sizes.width;
+	ctx.height = imageData->sizes.height;
+	ctx.filters = imageData->idata.filters;
+	ctx.medianPasses = LIM(medianPasses, 0, MAX_MEDIAN_PASSES);
+	
+	ctx.tilesAcross = (ctx.width + TILE_SIZE - 1) / TILE_SIZE;
+	tilesDown = (ctx.height + TILE_SIZE - 1) / TILE_SIZE;
+	ctx.numTiles = ctx.tilesAcross * tilesDown;
+	atomic_init(&ctx.nextTile, 0);
+	
+	if(!ctx.numTiles) return;
+	
+    os_signpost_interval_begin(gLogger, gLmsseSignpost, "LMSSE Interpolate");
+	
+	// allocate work for the largest tile, with halo and boundary, per worker
+	int maxRows = MIN(TILE_SIZE, ctx.height) + (2 * HALO_LINES) + (2 * BORDER);
+	int maxCols = MIN(TILE_SIZE, ctx.width) + (2 * HALO_LINES) + (2 * BORDER);
+	
+	ctx.tilePixels = (size_t) maxRows * maxCols;
+	ctx.bufferSize = ctx.tilePixels * sizeof(float[6]);
+	if(ctx.medianPasses) {
+		ctx.bufferSize += ctx.tilePixels * sizeof(float) * 2;
+	}
+	
+	numWorkers = (int) MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), ctx.numTiles);
+	ctx.buffers = (char *) malloc((size_t) numWorkers * ctx.bufferSize);
+	if(!ctx.buffers) {
+		os_signpost_interval_end(gLogger, gLmsseSignpost, "LMSSE Interpolate");
+		return;
+	}
+	
+	dispatch_apply_f(numWorkers, DISPATCH_APPLY_AUTO, &ctx, lmmse_worker);
+	
+    os_signpost_interval_end(gLogger, gLmsseSignpost, "LMSSE Interpolate");
+	
+	// Done
+	free(ctx.buffers);
+}
+
+/**
+ * Interpolates tiles with this worker's buffers until all tiles have been
+ * claimed.
+ *
+ * Tiles only ever read the CFA value of each pixel, and only write back the
+ * interpolated components, so any number of them may be processed at once.
+ */
+static void lmmse_worker(void *_ctx, size_t worker) {
+	lmmse_ctx_t *ctx = (lmmse_ctx_t *) _ctx;
+	char *buffer = ctx->buffers + (worker * ctx->bufferSize);
+	float (*qix)[6] = (float (*)[6]) buffer;
+	float *planes = ctx->medianPasses ? (float *) (qix + ctx->tilePixels) : NULL;
+	int tile;
+	
+	while((tile = atomic_fetch_add(&ctx->nextTile, 1)) < ctx->numTiles) {
+		const int top = (tile / ctx->tilesAcross) * TILE_SIZE;
+		const int left = (tile % ctx->tilesAcross) * TILE_SIZE;
+		
+		lmmse_interpolate_tile(ctx->image, ctx->width, ctx->height, ctx->filters,
+			top, left, MIN(TILE_SIZE, ctx->height - top),
+			MIN(TILE_SIZE, ctx->width - left), ctx->medianPasses, qix, planes);
+	}
+}
+
+/**
+ * Interpolates a single tile of the image. The tile and its halo are copied
+ * into the working buffer, but only pixels inside the tile are written back.
+ */
+static void lmmse_interpolate_tile(uint16_t (*image)[4], int width, int height,
+	unsigned int filters, int top, int left, int tileRows, int tileCols,
+	int medianPasses, float (*qix)[6], float *planes) {
+	ushort (*pix)[4];
+	int row, col, c, w1, w2, w3, w4, ii, ba, rr1, cc1, rr, cc;
+	float h0, h1, h2, h3, h4, hs;
+	float p1, p2, p3, p4, p5, p6, p7, p8, p9;
+	float Y, v0, mu, vx, vn, xh, vh, xv, vv;
+	float (*rix)[6];
 	
-	// allocate work with boundary
-	ba = 10;
-	rr1 = height + (2 * ba);
-	cc1 = width + (2 * ba);
+	// region of the image read for this tile
+	int regionTop = MAX(top - HALO_LINES, 0);
+	int regionBottom = MIN(top + tileRows + HALO_LINES, height);
+	int regionLeft = MAX(left - HALO_LINES, 0);
+	int regionRight = MIN(left + tileCols + HALO_LINES, width);
 	
-	buffer = (char *) calloc(rr1*cc1*6*sizeof(float), 1);
+	// clear work area with boundary
+	ba = BORDER;
+	rr1 = (regionBottom - regionTop) + (2 * ba);
+	cc1 = (regionRight - regionLeft) + (2 * ba);
 	
-	// merror(buffer,"lmmse_interpolate()");
-	qix = (float (*)[6])buffer;
+	memset(qix, 0, rr1*cc1*6*sizeof(float));
 	
 	// indices
 	w1 = cc1;
@@ -123,14 +227,13 @@ void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4]) {
 	h4 /= hs;
 	
 	// copy CFA values
-    os_signpost_event_emit(gLogger, gLmsseSignpost, "Copy CFA values 1");
-	
 	for(rr = 0; rr < rr1; rr++) {
-		for(cc = 0, row = (rr - ba); cc < cc1; cc++) {
-			col = cc - ba;
+		for(cc = 0, row = (rr - ba) + regionTop; cc < cc1; cc++) {
+			col = (cc - ba) + regionLeft;
 			rix = qix + rr*cc1 + cc;
-			
-			if((row >= 0) & (row < height) & (col >= 0) & (col < width)) {
+	
+			if((row >= regionTop) & (row < regionBottom) &
+			   (col >= regionLeft) & (col < regionRight)) {
 				rix[0][4] = (double)image[row*width+col][FC(row,col,filters)]/65535.0;
 			} else {
 				rix[0][4] = 0;
@@ -139,8 +242,6 @@ void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4]) {
 	}
 	
 	// G-R(B)
-    os_signpost_event_emit(gLogger, gLmsseSignpost, "Interpolate G-R(B)");
-	
 	for(rr = 2; rr < (rr1 - 2); rr++) {
 		// G-R(B) at R(B) location
 		for(cc = 2+(FC(rr,2,filters)&1); cc < (cc1 - 2); cc += 2) {
@@ -189,8 +290,6 @@ void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4]) {
 	}
 	
 	// apply low pass filter on differential colors
-    os_signpost_event_emit(gLogger, gLmsseSignpost, "Differential colors LPF");
-	
 	for(rr = 4; rr < (rr1 - 4); rr++) {
 		for (cc = 4; cc < (cc1 - 4); cc++) {
 			rix = qix + rr*cc1 + cc;
@@ -204,8 +303,6 @@ void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4]) {
 	}
 	
 	// interpolate G-R(B) at R(B)
-    os_signpost_event_emit(gLogger, gLmsseSignpost, "Interpolate G-R(B) at R(B)");
-	
 	for (rr = 4; rr < (rr1 - 4); rr++) {
 		for (cc = 4+(FC(rr,4,filters)&1); cc < (cc1 - 4); cc += 2) {
 			rix = qix + rr*cc1 + cc;
@@ -266,15 +363,14 @@ void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4]) {
 	}
 	
 	// copy CFA values
-    os_signpost_event_emit(gLogger, gLmsseSignpost, "Copy CFA values 2");
-	
 	for(rr = 0; rr < rr1; rr++) {
-		for(cc = 0, row = (rr-ba); cc < cc1; cc++) {
-			col=cc-ba;
+		for(cc = 0, row = (rr-ba) + regionTop; cc < cc1; cc++) {
+			col = (cc-ba) + regionLeft;
 			rix = qix + rr*cc1 + cc;
 			c = FC(rr,cc,filters);
-			
-			if ((row >= 0) & (row < height) & (col >= 0) & (col < width)) {
+	
+			if ((row >= regionTop) & (row < regionBottom) &
+				(col >= regionLeft) & (col < regionRight)) {
 				rix[0][c] = (double)image[row*width+col][c]/65535.0;
 			} else {
 				rix[0][c] = 0;
@@ -288,8 +384,6 @@ void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4]) {
 
 	// bilinear interpolation for R/B
 	// interpolate R/B at G location
-    os_signpost_event_emit(gLogger, gLmsseSignpost, "Interpolate R/B at G location");
-	
 	for(rr = 1; rr < (rr1 - 1); rr++) {
 		for(cc=1+(FC(rr,2,filters)&1), c=FC(rr,cc+1,filters); cc < cc1-1; cc+=2) {
 			rix = qix + rr*cc1 + cc;
@@ -303,8 +397,6 @@ void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4]) {
 	}
 	
 	// interpolate R/B at B/R location
-    os_signpost_event_emit(gLogger, gLmsseSignpost, "Interpolate R/B at B/R location");
-	
 	for(rr = 1; rr < (rr1 -1 ); rr++) {
 		for(cc=1+(FC(rr,1,filters)&1), c=2-FC(rr,cc,filters); cc < cc1-1; cc+=2) {
 			rix = qix + rr*cc1 + cc;
@@ -314,42 +406,59 @@ void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4]) {
 		}
 	}
 	
-#if USE_MEDIAN_FILTER
 	// median filter
-    os_signpost_event_emit(gLogger, gLmsseSignpost, "Median filter");
+	if(medianPasses) {
+		lmmse_median_refine(qix, rr1, cc1, filters, medianPasses, planes);
+	}
 	
-	for(pass = 1; pass <= 3; pass++) {
+	// copy result back to image matrix
+	for(row = top; row < (top + tileRows); row++) {
+		for(col = left, rr = (row - regionTop) + ba; col < (left + tileCols); col++) {
+			cc = (col - regionLeft) + ba;
+			pix = image + row*width + col;
+			rix = qix + rr*cc1 + cc;
+			c = FC(row, col, filters);
+			
+			for(ii = 0; ii < 3; ii++) {
+				if(ii != c) {
+					pix[0][ii] = CLIP((int) (65535.0 * rix[0][ii] + 0.5));
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Refines the interpolated tile in the working buffer by median filtering its
+ * R-G and B-G colour differences, then rebuilding the missing components from
+ * them.
+ *
+ * @param planes Buffer for two planes of `rr1 * cc1` floats
+ */
+static void lmmse_median_refine(float (*qix)[6], int rr1, int cc1,
+	unsigned int filters, int passes, float *planes) {
+	int c, d, rr, cc, ii, pass;
+	float (*rix)[6];
+	
+	float *diff = planes;
+	float *med = planes + (rr1 * cc1);
+	
+	for(pass = 1; pass <= passes; pass++) {
 		for(c = 0; c < 3; c += 2) {
 			// Compute median(R-G) and median(B-G)
 			d = c + 3;
 			for(ii = 0; ii < (rr1 * cc1); ii++) {
-				qix[ii][d] = qix[ii][c] - qix[ii][1];
+				diff[ii] = qix[ii][c] - qix[ii][1];
 			}
 			
-			// Apply 3x3 median fileter
-			for(rr = 1; rr < (rr1 - 1); rr++) {
-				for(cc = 1; cc < (cc1 - 1); cc++) {
-					rix = qix + rr*cc1 + cc;
-					// Assign 3x3 differential color values
-					p1 = rix[-w1-1][d]; p2 = rix[-w1][d]; p3 = rix[-w1+1][d];
-					p4 = rix[   -1][d]; p5 = rix[  0][d]; p6 = rix[    1][d];
-					p7 = rix[ w1-1][d]; p8 = rix[ w1][d]; p9 = rix[ w1+1][d];
-					
-					// Sort for median of 9 values
-					PIX_SORT(p2,p3); PIX_SORT(p5,p6); PIX_SORT(p8,p9);
-					PIX_SORT(p1,p2); PIX_SORT(p4,p5); PIX_SORT(p7,p8);
-					PIX_SORT(p2,p3); PIX_SORT(p5,p6); PIX_SORT(p8,p9);
-					PIX_SORT(p1,p4); PIX_SORT(p6,p9); PIX_SORT(p5,p8);
-					PIX_SORT(p4,p7); PIX_SORT(p2,p5); PIX_SORT(p3,p6);
-					PIX_SORT(p5,p8); PIX_SORT(p5,p3); PIX_SORT(p7,p5);
-					PIX_SORT(p5,p3);
-					
-					rix[0][4] = p5;
-				}
-			}
+			// Apply 3x3 median filter; the outermost lines are in the border
+			MedianFilter3x3(diff, cc1, med + cc1, cc1, cc1, rr1 - 2);
+			
+			memcpy(med, diff, cc1 * sizeof(float));
+			memcpy(med + ((rr1 - 1) * cc1), diff + ((rr1 - 1) * cc1), cc1 * sizeof(float));
 			
 			for(ii = 0; ii < (rr1 * cc1); ii++) {
-				qix[ii][d] = qix[ii][4];
+				qix[ii][d] = med[ii];
 			}
 		}
 		
@@ -367,32 +476,8 @@ void lmmse_interpolate(libraw_data_t *imageData, uint16_t (*image)[4]) {
 			for(cc=(FC(rr,0,filters)&1), c=2-FC(rr,cc,filters), d=c+3; cc < cc1; cc+=2) {
 				rix = qix + rr*cc1 + cc;
 				rix[0][c] = rix[0][1] + rix[0][d];
-				rix[0][1] = 0.5*(rix[0][0] - rix[0][3] + rix[0][2] - rix[0][5]); }
-		}
-	}
-
-#endif
-	
-	// copy result back to image matrix
-    os_signpost_event_emit(gLogger, gLmsseSignpost, "Copy result");
-	
-	for(row = 0; row < height; row++) {
-		for(col = 0, rr= (row + ba); col < width; col++) {
-			cc = col + ba;
-			pix = image + row*width + col;
-			rix = qix + rr*cc1 + cc;
-			c = FC(row, col, filters);
-			
-			for(ii = 0; ii < 3; ii++) {
-				if(ii != c) {
-					pix[0][ii] = CLIP((int) (65535.0 * rix[0][ii] + 0.5));
-				}
+				rix[0][1] = 0.5*(rix[0][0] - rix[0][3] + rix[0][2] - rix[0][5]);
 			}
 		}
 	}
-	
-    os_signpost_interval_end(gLogger, gLmsseSignpost, "LMSSE Interpolate");
-    
-	// Done
-	free(buffer);
 }
@@ -17,6 +17,19 @@ extern NSString const *PAPColorSpaceConverterErrorDomain;
 
 - (void) convert:(NSMutableData *) pixels withModel:(NSString *) modelName
             size:(CGSize) size andError:(NSError **) error;
+- (void) convert:(NSMutableData *) pixels withModel:(NSString *) modelName
+            size:(CGSize) size halfFloat:(BOOL) halfFloat andError:(NSError **) error;
+- (void) convert:(NSMutableData *) pixels withModel:(NSString *) modelName
+            size:(CGSize) size halfFloat:(BOOL) halfFloat histogram:(nullable NSMutableData *) histogram
+        andError:(NSError **) error;
+
+- (void) convert:(NSData *) pixels region:(CGRect) region withModel:(NSString *) modelName
+            size:(CGSize) size output:(NSMutableData *) output bytesPerRow:(NSUInteger) bytesPerRow
+        andError:(NSError **) error;
+
+- (void) convert:(NSData *) pixels region:(CGRect) region withModel:(NSString *) modelName
+            size:(CGSize) size intoBuffer:(void *) buffer length:(NSUInteger) length
+     bytesPerRow:(NSUInteger) bytesPerRow halfFloat:(BOOL) halfFloat andError:(NSError **) error;
 
 @end
 
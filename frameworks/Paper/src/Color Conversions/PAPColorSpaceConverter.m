@@ -21,6 +21,7 @@ NSString *PAPColorSpaceConverterErrorDomain = @"PAPColorSpaceConverterErrorDomai
 @property (nonatomic) NSDictionary *aliases;
 
 - (NSError *) errorForCode:(NSInteger) code;
+- (BOOL) getMatrix:(double [3][3]) camXyz forModel:(NSString *) inModelName;
 
 @end
 
@@ -68,33 +69,143 @@ NSString *PAPColorSpaceConverterErrorDomain = @"PAPColorSpaceConverterErrorDomai
  */
 - (void) convert:(NSMutableData *) pixels withModel:(NSString *) inModelName
             size:(CGSize) size andError:(NSError **) error {
+    [self convert:pixels withModel:inModelName size:size halfFloat:NO andError:error];
+}
+
+/**
+ * Converts pixel data to the working color space, in place. Half float components fit in the space of the
+ * input components, so the buffer only needs to be grown for 32-bit floats.
+ */
+- (void) convert:(NSMutableData *) pixels withModel:(NSString *) inModelName
+            size:(CGSize) size halfFloat:(BOOL) halfFloat andError:(NSError **) error {
+    [self convert:pixels withModel:inModelName size:size halfFloat:halfFloat histogram:nil andError:error];
+}
+
+/**
+ * Converts pixel data to the working color space, in place, while counting the converted pixels into a
+ * histogram of the [0, 1] range.
+ *
+ * The histogram holds `UInt32` counts for red, green, blue and luminance, in that order; its number of
+ * buckets is derived from its length. Its existing counts are added to.
+ */
+- (void) convert:(NSMutableData *) pixels withModel:(NSString *) inModelName
+            size:(CGSize) size halfFloat:(BOOL) halfFloat histogram:(NSMutableData *) histogramData
+        andError:(NSError **) error {
     long err;
     double camXyz[3][3];
     
-    // look up alias for model name if needed
-    NSString *modelName = inModelName;
+    // read conversion info and make matrix
+    if(![self getMatrix:camXyz forModel:inModelName]) {
+        *error = [self errorForCode:-1];
+        return;
+    }
     
-    if(self.aliases[inModelName]) {
-        modelName = self.aliases[inModelName];
+    // get data pointers
+    uint16_t *ptr = pixels.mutableBytes;
+    NSAssert(ptr, @"Failed to get mutable pixel pointer from %@", pixels);
+    
+    // set up the histogram, if desired
+    pixel_histogram_t histogram = {
+        .min = 0.f,
+        .max = 1.f,
+    };
+    
+    if(histogramData) {
+        histogram.buckets = histogramData.length / (4 * sizeof(uint32_t));
+        histogram.counts = histogramData.mutableBytes;
+        NSAssert(histogram.buckets >= 2, @"Histogram buffer too small: %lu",
+                 (unsigned long) histogramData.length);
     }
     
+    // run conversion
+    pixel_histogram_t *hist = histogramData ? &histogram : NULL;
+    
+    if(halfFloat) {
+        err = ConvertToWorkingHalf(ptr, size.width, size.height, (double *) camXyz, hist);
+    } else {
+        err = ConvertToWorking(ptr, size.width, size.height, (double *) camXyz, hist);
+    }
+    
+    if(err != 0) {
+        *error = [self errorForCode:err];
+        return;
+    }
+}
+
+/**
+ * Converts a region of the pixel data to the working color space, writing 3 component floating point pixels
+ * into the output buffer, starting at its beginning. The conversion matrix is read for the given model.
+ */
+- (void) convert:(NSData *) pixels region:(CGRect) region withModel:(NSString *) inModelName
+            size:(CGSize) size output:(NSMutableData *) output bytesPerRow:(NSUInteger) bytesPerRow
+        andError:(NSError **) error {
+    long err;
+    double camXyz[3][3];
+    
     // read conversion info and make matrix
-    NSDictionary *info = self.camToXyzInfo[modelName];
-    if(!info) {
+    if(![self getMatrix:camXyz forModel:inModelName]) {
         *error = [self errorForCode:-1];
         return;
     }
     
-    for (NSUInteger i = 0; i < 9; i++) {
-        camXyz[i / 3][i % 3] = [info[@"matrix"][i] doubleValue] / 10000.f;
+    // get data pointers
+    const uint16_t *inPtr = pixels.bytes;
+    NSAssert(inPtr, @"Failed to get pixel pointer from %@", pixels);
+    
+    float *outPtr = output.mutableBytes;
+    NSAssert(outPtr, @"Failed to get mutable output pointer from %@", output);
+    NSAssert(output.length >= (bytesPerRow * region.size.height),
+             @"Output buffer too small: %lu", (unsigned long) output.length);
+    
+    // run conversion
+    err = ConvertRegionToWorking(inPtr, size.width, size.height, (double *) camXyz,
+                                 region.origin.x, region.origin.y,
+                                 region.size.width, region.size.height,
+                                 outPtr, bytesPerRow);
+    
+    if(err != 0) {
+        *error = [self errorForCode:err];
+        return;
+    }
+}
+
+/**
+ * Converts a region of the pixel data to the working color space, writing 4 component (RGBA) floating point
+ * pixels straight into memory owned by the caller, such as an IOSurface or Metal buffer.
+ */
+- (void) convert:(NSData *) pixels region:(CGRect) region withModel:(NSString *) inModelName
+            size:(CGSize) size intoBuffer:(void *) buffer length:(NSUInteger) length
+     bytesPerRow:(NSUInteger) bytesPerRow halfFloat:(BOOL) halfFloat andError:(NSError **) error {
+    long err;
+    double camXyz[3][3];
+    
+    // read conversion info and make matrix
+    if(![self getMatrix:camXyz forModel:inModelName]) {
+        *error = [self errorForCode:-1];
+        return;
     }
     
-    // get data pointers
-    uint16_t *ptr = pixels.mutableBytes;
-    NSAssert(ptr, @"Failed to get mutable pixel pointer from %@", pixels);
+    const uint16_t *inPtr = pixels.bytes;
+    NSAssert(inPtr, @"Failed to get pixel pointer from %@", pixels);
+    
+    // describe the output and make sure it fits
+    const pixel_layout_t layout = {
+        .format = halfFloat ? kPixelFormatF16 : kPixelFormatF32,
+        .channels = 4,
+        .order = kPixelChannelOrderRGB,
+        .base = buffer,
+        .stride = bytesPerRow,
+    };
+    
+    if(PixelLayoutValidate(&layout, region.size.width, region.size.height, length) != 0) {
+        *error = [self errorForCode:-1];
+        return;
+    }
     
     // run conversion
-    err = ConvertToWorking(ptr, size.width, size.height, (double *) camXyz);
+    err = ConvertRegionToLayout(inPtr, size.width, size.height, (double *) camXyz, 1.f / 16384.f,
+                                region.origin.x, region.origin.y,
+                                region.size.width, region.size.height, &layout);
     
     if(err != 0) {
         *error = [self errorForCode:err];
@@ -103,6 +214,32 @@ NSString *PAPColorSpaceConverterErrorDomain = @"PAPColorSpaceConverterErrorDomai
 }
 
 // MARK: - Helpers
+/**
+ * Reads the camera to XYZ conversion matrix for the given model, resolving aliases as needed.
+ *
+ * @return Whether a matrix was found for the model
+ */
+- (BOOL) getMatrix:(double [3][3]) camXyz forModel:(NSString *) inModelName {
+    // look up alias for model name if needed
+    NSString *modelName = inModelName;
+    
+    if(self.aliases[inModelName]) {
+        modelName = self.aliases[inModelName];
+    }
+    
+    // read conversion info and make matrix
+    NSDictionary *info = self.camToXyzInfo[modelName];
+    if(!info) {
+        return NO;
+    }
+    
+    for (NSUInteger i = 0; i < 9; i++) {
+        camXyz[i / 3][i % 3] = [info[@"matrix"][i] doubleValue] / 10000.f;
+    }
+    
+    return YES;
+}
+
 /**
  * Creates an error with the given code.
  */
@@ -12,6 +12,7 @@
 //
 
 #include "colorspace.h"
+#include "stagestats.h"
 
 #include <stdio.h>
 
@@ -19,13 +20,14 @@
 
 // MARK: Declarations
 static void MakeConversionMatrix(const double *camXyz, double *outCam);
+static void MakeLayoutMatrix(const double *camXyz, float scale, float *outMatrix);
 
 static void MatrixPseudoInverse3x3(const double *in, double *out);
 
 
-static long MakePlanarF(uint16_t *pixels, size_t width, size_t height,
+static long MakePlanarF(const uint16_t *pixels, size_t inStride, size_t width, size_t height,
                        vImage_Buffer *buffers);
-static long MakeChunky(uint16_t *outPixels, size_t width, size_t height,
+static long MakeChunky(float *outPixels, size_t outStride, size_t width, size_t height,
                        vImage_Buffer *buffers);
 static long MultiplyImage(vImage_Buffer *buffers, size_t width, size_t height,
                           const double *rgbCam);
@@ -67,15 +69,101 @@ static const double ProPhotoRgbMatrix[3][3] = {
  * Converts RGB pixel data to the working color space, in place. The pixel buffer will contain 32-bit floating
  * point image components when done, so it should be sized appropriately.
  *
+ * Each output line takes up as much space as two input lines, so writing line L overwrites input lines 2L and
+ * 2L + 1. Going from the bottom up, those have always been converted already; only the first line overlaps
+ * its own input, so it's copied aside first. This needs no planar intermediate buffers, and lets the layout
+ * writer fill in the histogram as it goes.
+ *
  * @param pixels The 3-component pixel buffer
  * @param width Number of pixels per line
  * @param height Total number of lines
  * @param camXyz Camera-specific 3x3 conversion matrix
+ * @param histogram Histogram to add the converted pixels to, or NULL
  */
 long ConvertToWorking(uint16_t *pixels, size_t width, size_t height,
-                 const double *camXyz) {
+                      const double *camXyz, pixel_histogram_t *histogram) {
+    assert(pixels);
+    
+    if(!width || !height) {
+        return -1;
+    }
+    
+    const pixel_layout_t layout = {
+        .format = kPixelFormatF32,
+        .channels = 3,
+        .order = kPixelChannelOrderRGB,
+        .base = pixels,
+        .stride = (width * 3 * sizeof(float)),
+        .histogram = histogram,
+    };
+    
+    float matrix[9];
+    MakeLayoutMatrix(camXyz, 1.f / 16384.f, matrix);
+    
+    const size_t inLineBytes = width * 3 * sizeof(uint16_t);
+    uint16_t *firstLine = malloc(inLineBytes);
+    if(!firstLine) {
+        return -1;
+    }
+    memcpy(firstLine, pixels, inLineBytes);
+    
+    for(size_t line = height - 1; line > 0; line--) {
+        PixelLayoutWriteRow(&layout, line, 0, pixels + (line * width * 3), 3, width, matrix);
+    }
+    PixelLayoutWriteRow(&layout, 0, 0, firstLine, 3, width, matrix);
+    
+    free(firstLine);
+    return 0;
+}
+
+/**
+ * Converts RGB pixel data to the working color space, in place, as 16-bit floating point components.
+ *
+ * Each output pixel is exactly as large as its input pixel, and every pixel is read before it's written, so
+ * this goes straight through the layout writer without any intermediate buffers.
+ */
+long ConvertToWorkingHalf(uint16_t *pixels, size_t width, size_t height,
+                          const double *camXyz, pixel_histogram_t *histogram) {
+    const pixel_layout_t layout = {
+        .format = kPixelFormatF16,
+        .channels = 3,
+        .order = kPixelChannelOrderRGB,
+        .base = pixels,
+        .stride = (width * 3 * sizeof(uint16_t)),
+        .histogram = histogram,
+    };
+    
+    return ConvertRegionToLayout(pixels, width, height, camXyz, 1.f / 16384.f, 0, 0, width, height,
+                                 &layout);
+}
+
+/**
+ * Converts a region of RGB pixel data to the working color space, writing 32-bit floating point RGB pixels
+ * into a caller supplied buffer.
+ *
+ * @param pixels The 3-component pixel buffer, covering the entire image
+ * @param width Number of pixels per line
+ * @param height Total number of lines
+ * @param camXyz Camera-specific 3x3 conversion matrix
+ * @param regionX Leftmost column of the region
+ * @param regionY Topmost line of the region
+ * @param regionWidth Number of columns in the region
+ * @param regionHeight Number of lines in the region
+ * @param outPixels Output buffer; its first pixel corresponds to the top left of the region
+ * @param outStride Number of bytes between the starts of consecutive lines in the output buffer
+ */
+long ConvertRegionToWorking(const uint16_t *pixels, size_t width, size_t height,
+                            const double *camXyz,
+                            size_t regionX, size_t regionY, size_t regionWidth, size_t regionHeight,
+                            float *outPixels, size_t outStride) {
     long err = 0;
     
+    // validate the region
+    if(!regionWidth || !regionHeight || (regionX + regionWidth) > width ||
+       (regionY + regionHeight) > height) {
+        return -1;
+    }
+    
     vImage_Buffer buffers[3];
     memset(buffers, 0, sizeof(buffers));
     
@@ -84,21 +172,22 @@ long ConvertToWorking(uint16_t *pixels, size_t width, size_t height,
     MakeConversionMatrix(camXyz, (double *) outCam);
 
     // create buffers for each component and copy data in
-    err = MakePlanarF(pixels, width, height, buffers);
+    const uint16_t *regionPixels = pixels + (((regionY * width) + regionX) * 3);
+    err = MakePlanarF(regionPixels, (width * 3), regionWidth, regionHeight, buffers);
     if(err != 0) {
         fprintf(stderr, "MakePlanar() failed: %lu\n", err);
         goto cleanup;
     }
     
     // multiply by matrix
-    err = MultiplyImage(buffers, width, height, (double *) outCam);
+    err = MultiplyImage(buffers, regionWidth, regionHeight, (double *) outCam);
     if(err != 0) {
         fprintf(stderr, "MultiplyImage() failed: %lu\n", err);
         goto cleanup;
     }
     
     // copy buffers back into output planes
-    err = MakeChunky(pixels, width, height, buffers);
+    err = MakeChunky(outPixels, outStride, regionWidth, regionHeight, buffers);
     if(err != 0) {
         fprintf(stderr, "MakeChunky() failed: %lu\n", err);
         goto cleanup;
@@ -115,6 +204,44 @@ cleanup:;
     return err;
 }
 
+/**
+ * Converts a region of RGB pixel data to the working color space, writing it in the format and layout
+ * described by the output descriptor.
+ *
+ * Rather than going through planar buffers, each line is multiplied and converted as it's written out, so
+ * no intermediate copy of the region is needed.
+ */
+long ConvertRegionToLayout(const uint16_t *pixels, size_t width, size_t height,
+                           const double *camXyz, float scale,
+                           size_t regionX, size_t regionY, size_t regionWidth, size_t regionHeight,
+                           const pixel_layout_t *out) {
+    assert(pixels);
+    assert(out);
+    
+    // validate the region
+    if(!regionWidth || !regionHeight || (regionX + regionWidth) > width ||
+       (regionY + regionHeight) > height) {
+        return -1;
+    }
+    if(!out->base || !PixelLayoutBytesPerPixel(out)) {
+        return -1;
+    }
+    
+    float matrix[9];
+    MakeLayoutMatrix(camXyz, scale, matrix);
+    
+    // convert each line
+    stage_interval_t interval = StageBegin(out->stats, kStageColorConvert);
+    
+    for (size_t line = 0; line < regionHeight; line++) {
+        const uint16_t *row = pixels + ((((regionY + line) * width) + regionX) * 3);
+        PixelLayoutWriteRow(out, line, 0, row, 3, regionWidth, matrix);
+    }
+    
+    StageEnd(out->stats, &interval, regionWidth * regionHeight * PixelLayoutBytesPerPixel(out));
+    return 0;
+}
+
 // MARK: Matrix helpers
 /**
  * Derives the matrix necessary for converting pixel data from the sensor color space to our working color
@@ -151,6 +278,25 @@ static void MakeConversionMatrix(const double *camXyz, double *outCam) {
     MatrixPseudoInverse3x3((double *) temp, outCam);
 }
 
+/**
+ * Derives the conversion matrix in the form the layout writer expects: the conversion matrix multiplies row
+ * vectors, so it's transposed to multiply columns, and the scale is folded in.
+ *
+ * @param camXyz Camera-specific XYZ conversion matrix
+ * @param scale Factor applied along with the conversion
+ * @param outMatrix Row major 3x3 matrix to multiply pixels by
+ */
+static void MakeLayoutMatrix(const double *camXyz, float scale, float *outMatrix) {
+    double outCam[3][3];
+    MakeConversionMatrix(camXyz, (double *) outCam);
+    
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 3; j++) {
+            outMatrix[(j * 3) + i] = (float) outCam[i][j] * scale;
+        }
+    }
+}
+
 /**
  * Calculates the pseudo inverse of a matrix
  */
@@ -200,8 +346,10 @@ static void MatrixPseudoInverse3x3(const double *in, double *out) {
  * Allocates buffers for each image component, and performs the interleaved -> planar conversion. During
  * this process, each of the input components is converted from a 16-bit unsigned quantity to a floating
  * point component.
+ *
+ * @param inStride Number of components between the starts of consecutive lines of the input
  */
-static long MakePlanarF(uint16_t *pixels, size_t width, size_t height,
+static long MakePlanarF(const uint16_t *pixels, size_t inStride, size_t width, size_t height,
                         vImage_Buffer *buffers) {
     assert(buffers);
     
@@ -220,12 +368,14 @@ static long MakePlanarF(uint16_t *pixels, size_t width, size_t height,
     }
     
     // unpack the chunky input buffer while converting to float
-    uint16_t *readPtr = pixels;
-    float *writePtrs[3] = {
-        buffers[0].data, buffers[1].data, buffers[2].data,
-    };
-    
     for (line = 0; line < height; line++) {
+        const uint16_t *readPtr = pixels + (line * inStride);
+        float *writePtrs[3] = {
+            (float *) (((uint8_t *) buffers[0].data) + (line * buffers[0].rowBytes)),
+            (float *) (((uint8_t *) buffers[1].data) + (line * buffers[1].rowBytes)),
+            (float *) (((uint8_t *) buffers[2].data) + (line * buffers[2].rowBytes)),
+        };
+        
         for (col = 0; col < width; col++) {
             // for each component
             for (comp = 0; comp < 3; comp++) {
@@ -244,7 +394,7 @@ cleanup:;
 /**
  * Converts the working planar buffers back into interleaved format.
  */
-static long MakeChunky(uint16_t *outPixels, size_t width, size_t height,
+static long MakeChunky(float *outPixels, size_t outStride, size_t width, size_t height,
                        vImage_Buffer *buffers) {
     assert(buffers);
    
@@ -254,7 +404,7 @@ static long MakeChunky(uint16_t *outPixels, size_t width, size_t height,
     vImage_Buffer out = {
         .width = width,
         .height = height,
-        .rowBytes = (width * 3 * 4),
+        .rowBytes = outStride,
         .data = outPixels
     };
     
@@ -11,6 +11,8 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include "pixel_layout.h"
+
 /**
  * Converts RGB pixel data to the working color space, in place. The pixel buffer will contain 32-bit floating
  * point image components when done, so it should be sized appropriately.
@@ -19,8 +21,67 @@
  * @param width Number of pixels per line
  * @param height Total number of lines
  * @param camXyz Camera-specific 3x3 conversion matrix
+ * @param histogram Histogram to add the converted pixels to (in the working space, after scaling), or NULL
+ * @return 0 on success, or an error code
  */
 long ConvertToWorking(uint16_t *pixels, size_t width, size_t height,
-                      const double *camXyz);
+                      const double *camXyz, pixel_histogram_t *histogram);
+
+/**
+ * Converts RGB pixel data to the working color space, in place, leaving 16-bit (half precision) floating point
+ * components in the buffer. These take up as much space as the input components, so unlike the 32-bit
+ * conversion, the buffer doesn't need to be any larger than the input.
+ *
+ * @param pixels The 3-component pixel buffer
+ * @param width Number of pixels per line
+ * @param height Total number of lines
+ * @param camXyz Camera-specific 3x3 conversion matrix
+ * @param histogram Histogram to add the converted pixels to (in the working space, after scaling), or NULL
+ * @return 0 on success, or an error code
+ */
+long ConvertToWorkingHalf(uint16_t *pixels, size_t width, size_t height,
+                          const double *camXyz, pixel_histogram_t *histogram);
+
+/**
+ * Converts a region of RGB pixel data to the working color space, writing 32-bit floating point RGB pixels
+ * into a caller supplied buffer with an arbitrary stride.
+ *
+ * @param pixels The 3-component pixel buffer, covering the entire image
+ * @param width Number of pixels per line
+ * @param height Total number of lines
+ * @param camXyz Camera-specific 3x3 conversion matrix
+ * @param regionX Leftmost column of the region
+ * @param regionY Topmost line of the region
+ * @param regionWidth Number of columns in the region
+ * @param regionHeight Number of lines in the region
+ * @param outPixels Output buffer; its first pixel corresponds to the top left of the region
+ * @param outStride Number of bytes between the starts of consecutive lines in the output buffer
+ * @return 0 on success, or an error code (-1 if the region isn't inside the image)
+ */
+long ConvertRegionToWorking(const uint16_t *pixels, size_t width, size_t height,
+                            const double *camXyz,
+                            size_t regionX, size_t regionY, size_t regionWidth, size_t regionHeight,
+                            float *outPixels, size_t outStride);
+
+/**
+ * Converts a region of RGB pixel data to the working color space, writing the pixels in the format and
+ * layout described by the output descriptor; for example, straight into an IOSurface or Metal buffer.
+ *
+ * @param pixels The 3-component pixel buffer, covering the entire image
+ * @param width Number of pixels per line
+ * @param height Total number of lines
+ * @param camXyz Camera-specific 3x3 conversion matrix
+ * @param scale Factor applied along with the conversion, e.g. 1/16384 for 14-bit data
+ * @param regionX Leftmost column of the region
+ * @param regionY Topmost line of the region
+ * @param regionWidth Number of columns in the region
+ * @param regionHeight Number of lines in the region
+ * @param out Output descriptor; its first pixel corresponds to the top left of the region
+ * @return 0 on success, or an error code (-1 if the region isn't inside the image)
+ */
+long ConvertRegionToLayout(const uint16_t *pixels, size_t width, size_t height,
+                           const double *camXyz, float scale,
+                           size_t regionX, size_t regionY, size_t regionWidth, size_t regionHeight,
+                           const pixel_layout_t *out);
 
 #endif /* colorspace_h */
@@ -6,16 +6,44 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <simd/simd.h>
 
 NS_ASSUME_NONNULL_BEGIN
 
+extern NSErrorDomain const PAPDebayererErrorDomain;
+
 @interface PAPDebayerer : NSObject
 
++ (NSUInteger) scaleFactorForAlgorithm:(NSUInteger) algo;
+
 + (void) debayer:(NSData *) input withOutput:(NSMutableData *) output
        imageSize:(CGSize) size andAlgorithm:(NSUInteger) algo
           vShift:(NSUInteger) vShift wbShift:(NSArray<NSNumber *> *) wb
       blackLevel:(NSArray<NSNumber *> *) black;
 
++ (BOOL) debayer:(NSData *) input withFloatOutput:(NSMutableData *) output
+       imageSize:(CGSize) size andAlgorithm:(NSUInteger) algo
+          vShift:(NSUInteger) vShift wbShift:(NSArray<NSNumber *> *) wb
+      blackLevel:(NSArray<NSNumber *> *) black
+     colorMatrix:(simd_float3x3) matrix scale:(float) scale error:(NSError **) error;
+
++ (BOOL) debayer:(NSData *) input withHalfFloatOutput:(NSMutableData *) output
+       imageSize:(CGSize) size andAlgorithm:(NSUInteger) algo
+          vShift:(NSUInteger) vShift wbShift:(NSArray<NSNumber *> *) wb
+      blackLevel:(NSArray<NSNumber *> *) black
+     colorMatrix:(simd_float3x3) matrix scale:(float) scale error:(NSError **) error;
+
++ (void) debayer:(NSData *) input region:(CGRect) region withOutput:(NSMutableData *) output
+     bytesPerRow:(NSUInteger) bytesPerRow imageSize:(CGSize) size andAlgorithm:(NSUInteger) algo
+          vShift:(NSUInteger) vShift wbShift:(NSArray<NSNumber *> *) wb
+      blackLevel:(NSArray<NSNumber *> *) black;
+
++ (void) debayer:(NSData *) input region:(CGRect) region withFloatOutput:(NSMutableData *) output
+     bytesPerRow:(NSUInteger) bytesPerRow imageSize:(CGSize) size andAlgorithm:(NSUInteger) algo
+          vShift:(NSUInteger) vShift wbShift:(NSArray<NSNumber *> *) wb
+      blackLevel:(NSArray<NSNumber *> *) black
+     colorMatrix:(simd_float3x3) matrix scale:(float) scale;
+
 @end
 
 NS_ASSUME_NONNULL_END
@@ -9,8 +9,18 @@
 
 #import "debayer.h"
 
+NSErrorDomain const PAPDebayererErrorDomain = @"PAPDebayererErrorDomain";
+
 @implementation PAPDebayerer
 
+/**
+ * Returns the factor by which the given algorithm shrinks the image in each dimension; this is 1 for all
+ * algorithms that interpolate a full size image.
+ */
++ (NSUInteger) scaleFactorForAlgorithm:(NSUInteger) algo {
+    return DebayerScaleFactor((debayer_algorithm_t) algo);
+}
+
 /**
  * Debayers the given 1 component input buffer into the provided 3 component RGB output buffer.
  */
@@ -19,36 +29,228 @@
          wbShift:(NSArray<NSNumber *> *) inWb
       blackLevel:(NSArray<NSNumber *> *) inBlack {
     int err;
+    uint16_t black[4];
+    double wb[4];
     
-    // convert black level array
-    NSAssert(inBlack.count <= 4, @"Invalid black level array: %@", inBlack);
-    uint16_t black[4] = {0, 0, 0, 0};
+    [self convertWb:inWb blackLevel:inBlack toWb:wb black:black];
+    
+    // get pointers
+    const uint16_t *inPtr = input.bytes;
+    NSAssert(inPtr, @"Failed to get input plane pointer");
+    
+    uint16_t *outPtr = output.mutableBytes;
+    NSAssert(outPtr, @"Failed to get output plane pointer");
+    
+    NSAssert(DebayerScaleFactor((debayer_algorithm_t) algo) != 0,
+             @"Invalid debayer algorithm: %lu", (unsigned long)algo);
+    
+    err = Debayer((debayer_algorithm_t) algo, inPtr, outPtr, size.width,
+                  size.height, vShift, wb, black);
+    NSAssert(err == 0, @"Failed to debayer: %d", err);
+}
+
+/**
+ * Debayers the given 1 component input buffer, and converts it to 32-bit float RGBA in the working color
+ * space in the same pass. Pixels are multiplied as row vectors by the matrix (that is, `rgb * matrix`)
+ * after being scaled by the given factor.
+ *
+ * Fails with an error rather than raising if the buffers don't fit the image size, or the image can't be
+ * debayered, since the input may come from a damaged file.
+ */
++ (BOOL) debayer:(NSData *) input withFloatOutput:(NSMutableData *) output
+       imageSize:(CGSize) size andAlgorithm:(NSUInteger) algo vShift:(NSUInteger) vShift
+         wbShift:(NSArray<NSNumber *> *) inWb
+      blackLevel:(NSArray<NSNumber *> *) inBlack
+     colorMatrix:(simd_float3x3) matrix scale:(float) scale error:(NSError **) error {
+    int err;
+    uint16_t black[4];
+    double wb[4];
     
-    for (NSUInteger i = 0; i < inBlack.count; i++) {
-        black[i] = inBlack[i].unsignedShortValue;
+    if (![self validateInput:input output:output imageSize:size algorithm:algo
+                componentSize:sizeof(float) wbShift:inWb blackLevel:inBlack]) {
+        if (error) *error = [self errorForCode:-1];
+        return NO;
     }
     
-    // convert wb shift array
-    NSAssert(inWb.count <= 4, @"Invalid wb shift array: %@", inWb);
-    double wb[4] = {1, 1, 1, 1};
+    [self convertWb:inWb blackLevel:inBlack toWb:wb black:black];
     
-    for (NSUInteger i = 0; i < inWb.count; i++) {
-        wb[i] = inWb[i].doubleValue;
+    float rowMajor[9];
+    [self convertMatrix:matrix toRowMajor:rowMajor];
+    
+    err = DebayerToFloat((debayer_algorithm_t) algo, input.bytes, output.mutableBytes, size.width,
+                         size.height, vShift, wb, black, rowMajor, scale);
+    if (err != 0) {
+        if (error) *error = [self errorForCode:err];
+        return NO;
     }
     
+    return YES;
+}
+
+/**
+ * Debayers the given 1 component input buffer into the provided 4 component half float output buffer,
+ * converting to the working color space along the way, so it's ready to be uploaded to the GPU.
+ *
+ * Fails with an error rather than raising if the buffers don't fit the image size, or the image can't be
+ * debayered, since the input may come from a damaged file.
+ */
++ (BOOL) debayer:(NSData *) input withHalfFloatOutput:(NSMutableData *) output
+       imageSize:(CGSize) size andAlgorithm:(NSUInteger) algo vShift:(NSUInteger) vShift
+         wbShift:(NSArray<NSNumber *> *) inWb
+      blackLevel:(NSArray<NSNumber *> *) inBlack
+     colorMatrix:(simd_float3x3) matrix scale:(float) scale error:(NSError **) error {
+    int err;
+    uint16_t black[4];
+    double wb[4];
+    
+    if (![self validateInput:input output:output imageSize:size algorithm:algo
+                componentSize:sizeof(__fp16) wbShift:inWb blackLevel:inBlack]) {
+        if (error) *error = [self errorForCode:-1];
+        return NO;
+    }
+    
+    [self convertWb:inWb blackLevel:inBlack toWb:wb black:black];
+    
+    float rowMajor[9];
+    [self convertMatrix:matrix toRowMajor:rowMajor];
+    
+    err = DebayerToHalf((debayer_algorithm_t) algo, input.bytes, output.mutableBytes, size.width,
+                        size.height, vShift, wb, black, rowMajor, scale);
+    if (err != 0) {
+        if (error) *error = [self errorForCode:err];
+        return NO;
+    }
+    
+    return YES;
+}
+
+/**
+ * Debayers a region of the given 1 component input buffer into the provided 4 component 16-bit output
+ * buffer. Only the pixels inside the region are written, starting at the beginning of the output buffer.
+ */
++ (void) debayer:(NSData *) input region:(CGRect) region withOutput:(NSMutableData *) output
+     bytesPerRow:(NSUInteger) bytesPerRow imageSize:(CGSize) size andAlgorithm:(NSUInteger) algo
+          vShift:(NSUInteger) vShift wbShift:(NSArray<NSNumber *> *) inWb
+      blackLevel:(NSArray<NSNumber *> *) inBlack {
+    int err;
+    uint16_t black[4];
+    double wb[4];
+    
+    [self convertWb:inWb blackLevel:inBlack toWb:wb black:black];
+    
     // get pointers
     const uint16_t *inPtr = input.bytes;
     NSAssert(inPtr, @"Failed to get input plane pointer");
     
     uint16_t *outPtr = output.mutableBytes;
     NSAssert(outPtr, @"Failed to get output plane pointer");
+    NSAssert(DebayerScaleFactor((debayer_algorithm_t) algo) != 0,
+             @"Invalid debayer algorithm: %lu", (unsigned long)algo);
+    
+    const size_t factor = DebayerScaleFactor((debayer_algorithm_t) algo);
+    NSAssert(output.length >= (bytesPerRow * (size_t) (region.size.height / factor)),
+             @"Output buffer too small: %lu", (unsigned long) output.length);
     
-    NSAssert((algo == kBayerAlgorithmBilinear) || (algo == kBayerAlgorithmLMMSE),
+    err = DebayerRegion((debayer_algorithm_t) algo, inPtr, size.width, size.height, vShift, wb, black,
+                        region.origin.x, region.origin.y, region.size.width, region.size.height,
+                        outPtr, bytesPerRow);
+    NSAssert(err == 0, @"Failed to debayer region: %d", err);
+}
+
+/**
+ * Debayers a region of the given 1 component input buffer, and converts it to 32-bit float RGBA in the
+ * working color space in the same pass. Only the pixels inside the region are written, starting at the
+ * beginning of the output buffer.
+ */
++ (void) debayer:(NSData *) input region:(CGRect) region withFloatOutput:(NSMutableData *) output
+     bytesPerRow:(NSUInteger) bytesPerRow imageSize:(CGSize) size andAlgorithm:(NSUInteger) algo
+          vShift:(NSUInteger) vShift wbShift:(NSArray<NSNumber *> *) inWb
+      blackLevel:(NSArray<NSNumber *> *) inBlack
+     colorMatrix:(simd_float3x3) matrix scale:(float) scale {
+    int err;
+    uint16_t black[4];
+    double wb[4];
+    float rowMajor[9];
+    
+    [self convertWb:inWb blackLevel:inBlack toWb:wb black:black];
+    [self convertMatrix:matrix toRowMajor:rowMajor];
+    
+    // get pointers
+    const uint16_t *inPtr = input.bytes;
+    NSAssert(inPtr, @"Failed to get input plane pointer");
+    
+    float *outPtr = output.mutableBytes;
+    NSAssert(outPtr, @"Failed to get output plane pointer");
+    NSAssert(DebayerScaleFactor((debayer_algorithm_t) algo) != 0,
              @"Invalid debayer algorithm: %lu", (unsigned long)algo);
     
-    err = Debayer((debayer_algorithm_t) algo, inPtr, outPtr, size.width,
-                  size.height, vShift, wb, black);
-    NSAssert(err == 0, @"Failed to debayer: %d", err);
+    const size_t factor = DebayerScaleFactor((debayer_algorithm_t) algo);
+    NSAssert(output.length >= (bytesPerRow * (size_t) (region.size.height / factor)),
+             @"Output buffer too small: %lu", (unsigned long) output.length);
+    
+    err = DebayerRegionToFloat((debayer_algorithm_t) algo, inPtr, size.width, size.height, vShift,
+                               wb, black, rowMajor, scale,
+                               region.origin.x, region.origin.y, region.size.width, region.size.height,
+                               outPtr, bytesPerRow);
+    NSAssert(err == 0, @"Failed to debayer region: %d", err);
+}
+
+/**
+ * Converts the white balance and black level arrays into the form expected by the debayering code.
+ */
++ (void) convertWb:(NSArray<NSNumber *> *) inWb blackLevel:(NSArray<NSNumber *> *) inBlack
+              toWb:(double *) wb black:(uint16_t *) black {
+    // convert black level array
+    NSAssert(inBlack.count <= 4, @"Invalid black level array: %@", inBlack);
+    
+    for (NSUInteger i = 0; i < 4; i++) {
+        black[i] = (i < inBlack.count) ? inBlack[i].unsignedShortValue : 0;
+    }
+    
+    // convert wb shift array
+    NSAssert(inWb.count <= 4, @"Invalid wb shift array: %@", inWb);
+    
+    for (NSUInteger i = 0; i < 4; i++) {
+        wb[i] = (i < inWb.count) ? inWb[i].doubleValue : 1;
+    }
+}
+
+/**
+ * Checks that the input holds an image of the given size, and that the output can hold the 4 component
+ * result of debayering it with the given algorithm.
+ */
++ (BOOL) validateInput:(NSData *) input output:(NSMutableData *) output imageSize:(CGSize) size
+             algorithm:(NSUInteger) algo componentSize:(size_t) componentSize
+               wbShift:(NSArray<NSNumber *> *) wb blackLevel:(NSArray<NSNumber *> *) black {
+    const size_t factor = DebayerScaleFactor((debayer_algorithm_t) algo);
+    if (!factor || wb.count > 4 || black.count > 4) {
+        return NO;
+    }
+    
+    const size_t inBytes = (size_t) size.width * (size_t) size.height * sizeof(uint16_t);
+    const size_t outBytes = (size_t) (size.width / factor) * (size_t) (size.height / factor) * 4 * componentSize;
+    
+    return input.bytes && output.mutableBytes && input.length >= inBytes && output.length >= outBytes;
+}
+
+/**
+ * Creates an error with the given code; -1 indicates invalid arguments, anything else is an error returned by
+ * the debayering code.
+ */
++ (NSError *) errorForCode:(NSInteger) code {
+    return [NSError errorWithDomain:PAPDebayererErrorDomain code:code userInfo:nil];
+}
+
+/**
+ * Flattens a color matrix into row major order, such that each output component is the dot product with
+ * one column of the matrix.
+ */
++ (void) convertMatrix:(simd_float3x3) matrix toRowMajor:(float *) rowMajor {
+    for (NSUInteger i = 0; i < 3; i++) {
+        for (NSUInteger j = 0; j < 3; j++) {
+            rowMajor[(i * 3) + j] = matrix.columns[i][j];
+        }
+    }
 }
 
 @end
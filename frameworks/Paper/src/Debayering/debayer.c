@@ -9,6 +9,11 @@
 //
 
 #include "debayer.h"
+#include "wb_scale.h"
+#include "bufpool.h"
+#include "pixel_layout.h"
+#include "median.h"
+#include "stagestats.h"
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -16,20 +21,51 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
-#include <time.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <dispatch/dispatch.h>
 
 static inline size_t GetColor(size_t line, size_t col);
+static buffer_pool_t *ScratchPool(void);
+
+struct debayer_bands;
+
+static int Interpolate(debayer_algorithm_t algo, const uint16_t *inPlane, uint16_t *outPlane,
+                       size_t width, size_t height, size_t vShift, stage_stats_t *stats);
+static size_t BandLines(size_t height);
+static int DebayerBands(struct debayer_bands *info);
+static void DebayerBand(void *ctx, size_t band);
+static int DebayerRect(const struct debayer_bands *info, const pixel_layout_t *out, size_t x, size_t y, size_t w,
+                       size_t h, size_t outLine);
+static int BinRect(const struct debayer_bands *info, const pixel_layout_t *out, size_t x, size_t y, size_t w,
+                   size_t h, size_t outLine);
+static size_t HaloLines(debayer_algorithm_t algo);
 
-static void CopyAndApplyWB(const uint16_t *inPlane, uint16_t *outPlane,
+static void CopyAndApplyWB(const uint16_t *inPlane, size_t inStride, uint16_t *outPlane,
                            size_t width, size_t height, size_t vShift,
                            const double *wb, const uint16_t *black);
 
 // Debayering algorithms
 static int InterpolateBilinear(const uint16_t *inPlane, uint16_t *outPlane, size_t width, size_t height, size_t vShift);
-static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t width, size_t height, size_t vShift);
+static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t width, size_t height, size_t vShift,
+                            bool medianFilter, stage_stats_t *stats);
+static void LMMSETile(uint16_t *outPlane, size_t width, size_t height, size_t top, size_t left,
+                      size_t tileRows, size_t tileCols, size_t halo, int medianPasses, float (*qix)[6],
+                      float *planes);
+static void LMMSEMedianRefine(float (*qix)[6], int rr1, int cc1, unsigned int filters, int passes,
+                              float *planes);
 
 // MARK: Helpers
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
 /**
  * Gets the bayer color for the given column and line.
  *
@@ -44,7 +80,68 @@ static inline size_t GetColor(size_t line, size_t col) {
     return ((((line) & 1) << 1) | (col & 1));
 }
 
+/// Maximum number of bytes held in idle scratch buffers between calls
+#define kScratchPoolBytes (256 * 1024 * 1024)
+
+/**
+ * Creates the scratch buffer pool.
+ */
+static void CreateScratchPool(void *ctx) {
+    *((buffer_pool_t **) ctx) = BufferPoolNew(kScratchPoolBytes);
+}
+
+/**
+ * Gets the pool scratch buffers are taken from, so debayering a series of images of the same size doesn't
+ * allocate and fault in fresh memory for every band.
+ */
+static buffer_pool_t *ScratchPool(void) {
+    static buffer_pool_t *pool = NULL;
+    static dispatch_once_t once;
+
+    dispatch_once_f(&once, &pool, CreateScratchPool);
+    return pool;
+}
+
 // MARK: Debayering
+/**
+ * Minimum number of lines in a band; smaller images are debayered in one go.
+ */
+#define kMinBandLines 64
+
+/**
+ * Information shared by all bands of an image region being debayered in parallel
+ */
+typedef struct debayer_bands {
+    debayer_algorithm_t algo;
+
+    const uint16_t *inPlane;
+    size_t width, height, vShift;
+
+    const double *wb;
+    const uint16_t *black;
+
+    /// Region of the image to output
+    size_t regionX, regionY, regionWidth, regionHeight;
+
+    /// Output buffer, starting with the top left pixel of the region
+    pixel_layout_t out;
+    /// Size of the square CFA blocks binned into each output pixel, or 1 if the image is interpolated
+    size_t factor;
+
+    /// When set, output pixels are multiplied by the matrix
+    bool convert;
+    /// Color conversion matrix, with the scale factor folded in
+    float matrix[9];
+
+    /// Number of lines in each band (except the last one)
+    size_t bandLines;
+    /// Context lines required above and below each band
+    size_t halo;
+
+    /// Set if any of the bands failed
+    atomic_int err;
+} debayer_bands_t;
+
 /**
  * Performs debayering on the given 1 component input image, writing outputs into the 3 component output
  * image plane.
@@ -68,29 +165,466 @@ int Debayer(debayer_algorithm_t algo, const uint16_t *inPlane,
     assert(wb);
     assert(black);
     
-    // apply WB compensation and copy colors
-    CopyAndApplyWB(inPlane, outPlane, width, height, vShift, wb, black);
+    const size_t factor = DebayerScaleFactor(algo);
+    
+    // small images are processed in place
+    if(factor == 1 && BandLines(height) >= height) {
+        CopyAndApplyWB(inPlane, width, outPlane, width, height, vShift, wb, black);
+        return Interpolate(algo, inPlane, outPlane, width, height, vShift, NULL);
+    }
+    
+    // otherwise, debayer all bands concurrently
+    return DebayerRegion(algo, inPlane, width, height, vShift, wb, black,
+                         0, 0, width, height, outPlane, (width / MAX(factor, 1)) * 4 * sizeof(uint16_t));
+}
+
+/**
+ * Debayers the input image and converts it to 32-bit float RGBA in the working color space, one band at a
+ * time.
+ *
+ * @param algo Debayering algorithm to use
+ * @param inPlane Input plane
+ * @param outPlane Output plane; 4 floats per pixel, with alpha set to 1
+ * @param width Image width
+ * @param height Image height
+ * @param vShift Vertical shift for the debayering pattern
+ * @param wb White balance multipliers for each of the 4 bayer elements
+ * @param black Black level for each CFA index
+ * @param matrix Row major 3x3 color conversion matrix applied to each pixel, or NULL for none
+ * @param scale Factor to convert the 16-bit components to floating point
+ */
+int DebayerToFloat(debayer_algorithm_t algo, const uint16_t *inPlane,
+                   float *outPlane, size_t width, size_t height, size_t vShift,
+                   const double *wb, const uint16_t *black, const float *matrix, float scale) {
+    const size_t factor = MAX(DebayerScaleFactor(algo), 1);
+    
+    return DebayerRegionToFloat(algo, inPlane, width, height, vShift, wb, black, matrix, scale,
+                                0, 0, width, height, outPlane, (width / factor) * 4 * sizeof(float));
+}
+
+/**
+ * Debayers the input image and converts it to half float RGBA in the working color space, one band at a
+ * time.
+ */
+int DebayerToHalf(debayer_algorithm_t algo, const uint16_t *inPlane,
+                  __fp16 *outPlane, size_t width, size_t height, size_t vShift,
+                  const double *wb, const uint16_t *black, const float *matrix, float scale) {
+    assert(outPlane);
+    
+    const size_t factor = MAX(DebayerScaleFactor(algo), 1);
+    const pixel_layout_t layout = {
+        .format = kPixelFormatF16, .channels = 4, .order = kPixelChannelOrderRGB,
+        .base = outPlane, .stride = (width / factor) * 4 * sizeof(__fp16),
+    };
+    
+    // float output is always scaled, even without a color matrix
+    static const float identity[9] = { 1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 1.f };
+    
+    return DebayerRegionToLayout(algo, inPlane, width, height, vShift, wb, black,
+                                 (matrix ? matrix : identity), scale,
+                                 0, 0, width, height, &layout);
+}
+
+/**
+ * Gets the factor by which the given algorithm shrinks the image in each dimension.
+ */
+size_t DebayerScaleFactor(debayer_algorithm_t algo) {
+    switch(algo) {
+        case kBayerAlgorithmBilinear:
+        case kBayerAlgorithmLMMSE:
+        case kBayerAlgorithmLMMSEMedian:
+            return 1;
+            
+        case kBayerAlgorithmHalfSize:
+            return 2;
+        case kBayerAlgorithmQuarterSize:
+            return 4;
+    }
+    
+    return 0;
+}
+
+/**
+ * Gets the number of context lines the given algorithm needs around a region.
+ */
+size_t DebayerHaloLines(debayer_algorithm_t algo) {
+    return HaloLines(algo);
+}
+
+/**
+ * Debayers a region of the input image into a 4 component, 16-bit output buffer.
+ *
+ * @param algo Debayering algorithm to use
+ * @param inPlane Input plane, covering the entire image
+ * @param width Image width
+ * @param height Image height
+ * @param vShift Vertical shift for the debayering pattern
+ * @param wb White balance multipliers for each of the 4 bayer elements
+ * @param black Black level for each CFA index
+ * @param regionX Leftmost column of the region
+ * @param regionY Topmost line of the region
+ * @param regionWidth Number of columns in the region
+ * @param regionHeight Number of lines in the region
+ * @param outPlane Output buffer; its first pixel corresponds to the top left of the region
+ * @param outStride Number of bytes between the starts of consecutive lines in the output buffer
+ */
+int DebayerRegion(debayer_algorithm_t algo, const uint16_t *inPlane,
+                  size_t width, size_t height, size_t vShift,
+                  const double *wb, const uint16_t *black,
+                  size_t regionX, size_t regionY, size_t regionWidth, size_t regionHeight,
+                  uint16_t *outPlane, size_t outStride) {
+    assert(inPlane);
+    assert(outPlane);
+    assert(wb);
+    assert(black);
+    
+    const pixel_layout_t layout = {
+        .format = kPixelFormatU16, .channels = 4, .order = kPixelChannelOrderRGB,
+        .base = outPlane, .stride = outStride,
+    };
+    
+    return DebayerRegionToLayout(algo, inPlane, width, height, vShift, wb, black, NULL, 1.f,
+                                 regionX, regionY, regionWidth, regionHeight, &layout);
+}
+
+/**
+ * Debayers a region of the input image and converts it to 32-bit float RGBA in the working color space.
+ *
+ * @param algo Debayering algorithm to use
+ * @param inPlane Input plane, covering the entire image
+ * @param width Image width
+ * @param height Image height
+ * @param vShift Vertical shift for the debayering pattern
+ * @param wb White balance multipliers for each of the 4 bayer elements
+ * @param black Black level for each CFA index
+ * @param matrix Row major 3x3 color conversion matrix applied to each pixel, or NULL for none
+ * @param scale Factor to convert the 16-bit components to floating point
+ * @param regionX Leftmost column of the region
+ * @param regionY Topmost line of the region
+ * @param regionWidth Number of columns in the region
+ * @param regionHeight Number of lines in the region
+ * @param outPlane Output buffer; 4 floats per pixel, starting with the top left of the region
+ * @param outStride Number of bytes between the starts of consecutive lines in the output buffer
+ */
+int DebayerRegionToFloat(debayer_algorithm_t algo, const uint16_t *inPlane,
+                         size_t width, size_t height, size_t vShift,
+                         const double *wb, const uint16_t *black, const float *matrix, float scale,
+                         size_t regionX, size_t regionY, size_t regionWidth, size_t regionHeight,
+                         float *outPlane, size_t outStride) {
+    assert(inPlane);
+    assert(outPlane);
+    assert(wb);
+    assert(black);
+    
+    const pixel_layout_t layout = {
+        .format = kPixelFormatF32, .channels = 4, .order = kPixelChannelOrderRGB,
+        .base = outPlane, .stride = outStride,
+    };
+    
+    // float output is always scaled, even without a color matrix
+    static const float identity[9] = { 1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 1.f };
+    
+    return DebayerRegionToLayout(algo, inPlane, width, height, vShift, wb, black,
+                                 (matrix ? matrix : identity), scale,
+                                 regionX, regionY, regionWidth, regionHeight, &layout);
+}
+
+/**
+ * Debayers a region of the input image, writing the pixels in the format and layout described by the
+ * output descriptor.
+ *
+ * @param algo Debayering algorithm to use
+ * @param inPlane Input plane, covering the entire image
+ * @param width Image width
+ * @param height Image height
+ * @param vShift Vertical shift for the debayering pattern
+ * @param wb White balance multipliers for each of the 4 bayer elements
+ * @param black Black level for each CFA index
+ * @param matrix Row major 3x3 color conversion matrix applied to each pixel, or NULL for none
+ * @param scale Factor applied along with the matrix
+ * @param regionX Leftmost column of the region
+ * @param regionY Topmost line of the region
+ * @param regionWidth Number of columns in the region
+ * @param regionHeight Number of lines in the region
+ * @param out Output descriptor; its first pixel corresponds to the top left of the region
+ */
+int DebayerRegionToLayout(debayer_algorithm_t algo, const uint16_t *inPlane,
+                          size_t width, size_t height, size_t vShift,
+                          const double *wb, const uint16_t *black, const float *matrix, float scale,
+                          size_t regionX, size_t regionY, size_t regionWidth, size_t regionHeight,
+                          const pixel_layout_t *out) {
+    assert(inPlane);
+    assert(out);
+    assert(out->base);
+    assert(wb);
+    assert(black);
     
-    // invoke the appropriate algorithm
+    debayer_bands_t info = {
+        .algo = algo,
+        .inPlane = inPlane,
+        .width = width, .height = height, .vShift = vShift,
+        .wb = wb, .black = black,
+        .regionX = regionX, .regionY = regionY,
+        .regionWidth = regionWidth, .regionHeight = regionHeight,
+        .out = *out,
+        .convert = (matrix != NULL),
+    };
+    
+    if(!PixelLayoutBytesPerPixel(out)) {
+        return -1;
+    }
+    
+    // fold the scale factor into the matrix
+    for(size_t i = 0; matrix && i < 9; i++) {
+        info.matrix[i] = matrix[i] * scale;
+    }
+    
+    return DebayerBands(&info);
+}
+
+/**
+ * Debayers the region described by the band info, splitting it into bands that are processed concurrently.
+ */
+static int DebayerBands(debayer_bands_t *info) {
+    info->factor = DebayerScaleFactor(info->algo);
+    if(!info->factor) {
+        return -1;
+    }
+    
+    // validate the region; binned regions must start on a block boundary
+    if(!info->regionWidth || !info->regionHeight ||
+       (info->regionX + info->regionWidth) > info->width ||
+       (info->regionY + info->regionHeight) > info->height ||
+       (info->regionX % info->factor) || (info->regionY % info->factor)) {
+        return -1;
+    }
+    
+    // bands are counted in output lines
+    const size_t outLines = info->regionHeight / info->factor;
+    if(!outLines || !(info->regionWidth / info->factor)) {
+        return -1;
+    }
+    
+    info->bandLines = BandLines(outLines);
+    info->halo = HaloLines(info->algo);
+    atomic_init(&info->err, 0);
+    
+    const size_t numBands = (outLines + info->bandLines - 1) / info->bandLines;
+    dispatch_apply_f(numBands, DISPATCH_APPLY_AUTO, info, DebayerBand);
+    
+    // yeet
+    return atomic_load(&info->err);
+}
+
+/**
+ * Invokes the appropriate interpolation algorithm on an image that has had its white balance applied.
+ */
+static int Interpolate(debayer_algorithm_t algo, const uint16_t *inPlane, uint16_t *outPlane,
+                       size_t width, size_t height, size_t vShift, stage_stats_t *stats) {
     switch(algo) {
         case kBayerAlgorithmBilinear:
             return InterpolateBilinear(inPlane, outPlane, width, height, vShift);
 
         case kBayerAlgorithmLMMSE:
-            return InterpolateLMMSE(inPlane, outPlane, width, height, vShift);
+            return InterpolateLMMSE(inPlane, outPlane, width, height, vShift, false, stats);
+        case kBayerAlgorithmLMMSEMedian:
+            return InterpolateLMMSE(inPlane, outPlane, width, height, vShift, true, stats);
+            
+        // binning doesn't interpolate anything
+        case kBayerAlgorithmHalfSize:
+        case kBayerAlgorithmQuarterSize:
+            return -1;
     }
     
+    return 0;
+}
+
+/**
+ * Debayers a single band of the region.
+ */
+static void DebayerBand(void *ctx, size_t band) {
+    debayer_bands_t *info = (debayer_bands_t *) ctx;
+    int err;
+    
+    // lines to output
+    const size_t outLines = info->regionHeight / info->factor;
+    const size_t first = band * info->bandLines;
+    const size_t last = MIN(first + info->bandLines, outLines);
     
-    // yeet
+    // each band counts its pixels into a private histogram, merged once the band is done
+    pixel_layout_t out = info->out;
+    pixel_histogram_t histogram;
+    
+    if(info->out.histogram) {
+        histogram = *info->out.histogram;
+        histogram.counts = calloc(4 * histogram.buckets, sizeof(uint32_t));
+        
+        if(!histogram.counts) {
+            atomic_store(&info->err, -1);
+            return;
+        }
+        StageCountAllocation(out.stats, 4 * histogram.buckets * sizeof(uint32_t));
+        out.histogram = &histogram;
+    }
+    
+    if(info->factor > 1) {
+        err = BinRect(info, &out, info->regionX, info->regionY + (first * info->factor),
+                      info->regionWidth / info->factor, last - first, first);
+    } else {
+        err = DebayerRect(info, &out, info->regionX, info->regionY + first, info->regionWidth,
+                          last - first, first);
+    }
+    
+    if(out.histogram) {
+        PixelHistogramMerge(info->out.histogram, out.histogram);
+        free(histogram.counts);
+    }
+    
+    if(err != 0) {
+        atomic_store(&info->err, err);
+    }
+}
+
+/**
+ * Debayers a rectangle of the image, writing it to the band's output starting at the given line.
+ *
+ * The rectangle, plus enough pixels around it for the interpolation to produce the same results as on the
+ * full image, is white balanced into a private buffer and interpolated there. Only the pixels inside the
+ * rectangle are then written to the output, so no two bands ever write the same memory; they're color
+ * converted and packed into the output format on the way. Each of these steps is recorded as its own stage.
+ */
+static int DebayerRect(const debayer_bands_t *info, const pixel_layout_t *out, size_t x, size_t y, size_t w,
+                       size_t h, size_t outLine) {
+    const size_t halo = info->halo;
+    
+    // area to process; it starts on an even line and column so the bayer pattern is unchanged
+    const size_t top = ((y > halo) ? (y - halo) : 0) & ~((size_t) 1);
+    const size_t left = ((x > halo) ? (x - halo) : 0) & ~((size_t) 1);
+    const size_t bottom = MIN(y + h + halo, info->height);
+    const size_t right = MIN(x + w + halo, info->width);
+    
+    const size_t lines = bottom - top;
+    const size_t cols = right - left;
+    
+    // bilinear interpolation of images with an odd height reads one line past the end, so allocate an
+    // extra zeroed line; all others are written before they're read
+    const size_t scratchBytes = (lines + 1) * cols * 4 * sizeof(uint16_t);
+    
+    uint16_t *scratch = BufferPoolGet(ScratchPool(), scratchBytes);
+    if(!scratch) {
+        return -1;
+    }
+    StageCountAllocation(out->stats, scratchBytes);
+    memset(scratch + (lines * cols * 4), 0, cols * 4 * sizeof(uint16_t));
+    
+    const uint16_t *in = info->inPlane + (top * info->width) + left;
+    const size_t scratchPixelBytes = lines * cols * 4 * sizeof(uint16_t);
+    
+    stage_interval_t interval = StageBegin(out->stats, kStageWhiteBalance);
+    CopyAndApplyWB(in, info->width, scratch, cols, lines, info->vShift, info->wb, info->black);
+    StageEnd(out->stats, &interval, scratchPixelBytes);
+    
+    interval = StageBegin(out->stats, kStageDemosaic);
+    int err = Interpolate(info->algo, in, scratch, cols, lines, info->vShift, out->stats);
+    StageEnd(out->stats, &interval, scratchPixelBytes);
+    
+    // copy out the requested pixels
+    interval = StageBegin(out->stats, kStageColorConvert);
+    
+    for(size_t line = 0; !err && line < h; line++) {
+        const uint16_t *src = scratch + ((((y - top) + line) * cols) + (x - left)) * 4;
+        
+        PixelLayoutWriteRow(out, outLine + line, 0, src, 4, w,
+                            (info->convert ? info->matrix : NULL));
+    }
+    
+    StageEnd(out->stats, &interval, err ? 0 : (h * w * PixelLayoutBytesPerPixel(out)));
+    
+    BufferPoolPut(ScratchPool(), scratch, scratchBytes);
+    return err;
+}
+
+/**
+ * Bins a rectangle of the image into superpixels, writing `w` by `h` output pixels starting at the given
+ * output line. The rectangle starts at the given input pixel, which must be on an even line and column.
+ *
+ * Each output pixel is made from a square block of CFA values, `factor` pixels wide, that are black level
+ * corrected and white balanced, then averaged per color; both greens are averaged together. No values are
+ * interpolated, so the output is exact (if soft) at a fraction of the cost of demosaicing. Since lines are
+ * converted to the output format as soon as they're binned, all of this is recorded as demosaicing.
+ */
+static int BinRect(const debayer_bands_t *info, const pixel_layout_t *out, size_t x, size_t y, size_t w,
+                   size_t h, size_t outLine) {
+    const size_t factor = info->factor;
+    float mul[4];
+    
+    // number of values of each CFA color in a block
+    const float perColor = (float) ((factor * factor) / 4);
+    
+    // fold the averaging into the white balance; the greens are summed so they get half the weight
+    for(size_t color = 0; color < 4; color++) {
+        mul[color] = info->wb[color] / perColor;
+    }
+    mul[1] /= 2.f;
+    mul[2] /= 2.f;
+    
+    // lines are binned into a buffer, then converted to the output format
+    const size_t pxBytes = w * 3 * sizeof(uint16_t);
+    
+    uint16_t *px = BufferPoolGet(ScratchPool(), pxBytes);
+    if(!px) {
+        return -1;
+    }
+    StageCountAllocation(out->stats, pxBytes);
+    
+    stage_interval_t interval = StageBegin(out->stats, kStageDemosaic);
+    
+    for(size_t line = 0; line < h; line++) {
+        const size_t top = y + (line * factor);
+        
+        for(size_t outCol = 0; outCol < w; outCol++) {
+            const size_t left = x + (outCol * factor);
+            float sum[4] = { 0.f, 0.f, 0.f, 0.f };
+            
+            // total up each color in the block
+            for(size_t dy = 0; dy < factor; dy++) {
+                const uint16_t *in = info->inPlane + ((top + dy) * info->width) + left;
+                
+                for(size_t dx = 0; dx < factor; dx++) {
+                    const size_t color = GetColor(dy, dx);
+                    const uint16_t black = info->black[color];
+                    
+                    sum[color] += (in[dx] > black) ? (in[dx] - black) : 0;
+                }
+            }
+            
+            const float r = (sum[0] * mul[0]) + 0.5f;
+            const float g = (sum[1] * mul[1]) + (sum[2] * mul[2]) + 0.5f;
+            const float b = (sum[3] * mul[3]) + 0.5f;
+            
+            px[(outCol * 3) + 0] = (r < 65535.f) ? (uint16_t) r : 65535;
+            px[(outCol * 3) + 1] = (g < 65535.f) ? (uint16_t) g : 65535;
+            px[(outCol * 3) + 2] = (b < 65535.f) ? (uint16_t) b : 65535;
+        }
+        
+        PixelLayoutWriteRow(out, outLine + line, 0, px, 3, w,
+                            (info->convert ? info->matrix : NULL));
+    }
+    
+    StageEnd(out->stats, &interval, h * w * PixelLayoutBytesPerPixel(out));
+    
+    BufferPoolPut(ScratchPool(), px, pxBytes);
     return 0;
 }
 
 // MARK: White Balance
 /**
  * Copies pixels from the single component input plane to the proper place in the output plane, while
- * applying white balance compensation and black levels.
+ * applying white balance compensation and black levels. All other components of each output pixel are
+ * cleared.
  *
  * @param inPlane Input plane
+ * @param inStride Number of pixels between the starts of consecutive lines in the input plane
  * @param outPlane Output plane
  * @param width Image width
  * @param height Image height
@@ -98,36 +632,22 @@ int Debayer(debayer_algorithm_t algo, const uint16_t *inPlane,
  * @param wb White balance multipliers for each of the 4 bayer elements
  * @param black Black level for each CFA index
  */
-static void CopyAndApplyWB(const uint16_t *inPlane, uint16_t *outPlane,
+static void CopyAndApplyWB(const uint16_t *inPlane, size_t inStride, uint16_t *outPlane,
                            size_t width, size_t height, size_t vShift,
                            const double *wb, const uint16_t *black) {
-    size_t line, col;
-    uint8_t color;
-    size_t inRowOff, outRowOff;
-    uint16_t inPixel;
+    size_t line, color;
+    float mul[4];
     
+    for(color = 0; color < 4; color++) {
+        mul[color] = wb[color];
+    }
+    
+    // each line contains only two of the CFA colors, so choose them once per line
     for(line = 0; line < height; line++) {
-        inRowOff = (line * width);
-        outRowOff = (line * width * 4);
+        color = GetColor(line, 0);
         
-        for(col = 0; col < width; col++) {
-            // get input pixel value
-            color = GetColor(line, col);
-            inPixel = inPlane[inRowOff + col];
-            
-            // apply black level compensation
-            if(inPixel > black[color]) {
-                inPixel -= black[color];
-            } else {
-                inPixel = 0;
-            }
-            
-            // multiply it by the white balance coefficient
-            inPixel *= wb[color];
-            
-            // write to output
-            outPlane[outRowOff + (col * 4) + color] = inPixel;
-        }
+        WBScaleBayerLine(inPlane + (line * inStride), outPlane + (line * width * 4), width,
+                         color, black + color, mul + color);
     }
 }
 
@@ -266,57 +786,59 @@ static int InterpolateBilinear(const uint16_t *inPlane, uint16_t *outPlane, size
  * pp. 2167-2178, Dec. 2005.
  */
 /**
- * Set to 1 to evaluate the time taken for various subcomponents of the LMMSE interpolation.
- */
-#define LMMSE_DEBUG_TIME_PROFILE    1
-
-/**
- * Set to 0 to disable the median filter. It takes up a _massive_ amount of processing time (more than thrice than every other part of the
- * algorithm) but has a very negligible impact on the final image.
+ * Number of median filter passes used to refine the color differences, for the algorithm variant that does so. The filter
+ * itself is vectorized, but it still adds a fair bit of processing time for a small impact on the final image.
  */
-#define LMMSE_USE_MEDIAN_FILTER    0
+#define LMMSE_MEDIAN_PASSES 3
 
-#define PIX_SORT(a,b) { if ((a)>(b)) {temp=(a);(a)=(b);(b)=temp;} }
 #define FC(row, col, filters)  (filters >> ((((row) << 1 & 14) + ((col) & 1)) << 1) & 3)
-#define MIN(a,b) ((a) < (b) ? (a) : (b))
-#define MAX(a,b) ((a) > (b) ? (a) : (b))
 #define LIM(x,min,max) MAX(min,MIN(x,max))
 #define ULIM(x,y,z) ((y) < (z) ? LIM(x,y,z) : LIM(x,z,y))
 #define CLIP(x) LIM((int)(x),0,65535)
 //#define FC(row,col,filters) GetColor(row,col)
 
-static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t width, size_t height, size_t vShift) {
+/**
+ * Lines of context to either side of a pixel that LMMSE interpolation reads from: the low pass filter and
+ * G-R(B) interpolation each use 4 lines, the initial G-R(B) estimate and the two R/B passes add another
+ * 4 between them, and each median filter pass adds one more (rounded up to keep the bayer pattern.)
+ */
+#define LMMSE_HALO_LINES    12
+/// Lines of context for LMMSE interpolation with median filter refinement
+#define LMMSE_MEDIAN_HALO_LINES 16
+
+/// Size of the tiles LMMSE interpolation works on, not including the halo
+#define LMMSE_TILE_SIZE     256
+/// Border of zeros around each tile in the working buffer
+#define LMMSE_BORDER        10
+
+/**
+ * Interpolates a single tile of the image. The tile and the halo of lines around it are copied into the
+ * working buffer, but only pixels inside the tile are written back to the output plane.
+ */
+static void LMMSETile(uint16_t *outPlane, size_t width, size_t height, size_t top, size_t left,
+                      size_t tileRows, size_t tileCols, size_t halo, int medianPasses, float (*qix)[6],
+                      float *planes) {
     int row, col, c, w1, w2, w3, w4, ii, ba, rr1, cc1, rr, cc;
     float h0, h1, h2, h3, h4, hs;
     float p1, p2, p3, p4, p5, p6, p7, p8, p9;
     float Y, v0, mu, vx, vn, xh, vh, xv, vv;
-    float (*rix)[6], (*qix)[6];
-    char  *buffer;
-    
-#if USE_MEDIAN_FILTER
-    int d, pass;
-    float temp;
-#endif
-    
-#if LMMSE_DEBUG_TIME_PROFILE
-    clock_t t1, t2;
-    t2 = clock();
-    
-    fprintf(stderr, "Begin lmmse_interpolate: %f s\n", ((double) t2) / CLOCKS_PER_SEC);
-#endif
+    float (*rix)[6];
     
     // read out a bunch of data (TODO: lol)
     unsigned int filters = 0x94949494;
     
-    // allocate work with boundary
-    ba = 10;
-    rr1 = height + (2 * ba);
-    cc1 = width + (2 * ba);
+    // region of the image read for this tile
+    const int regionTop = (top > halo) ? (top - halo) : 0;
+    const int regionBottom = MIN(top + tileRows + halo, height);
+    const int regionLeft = (left > halo) ? (left - halo) : 0;
+    const int regionRight = MIN(left + tileCols + halo, width);
     
-    buffer = (char *) calloc(rr1*cc1*6*sizeof(float), 1);
+    // clear work area with boundary
+    ba = LMMSE_BORDER;
+    rr1 = (regionBottom - regionTop) + (2 * ba);
+    cc1 = (regionRight - regionLeft) + (2 * ba);
     
-    // merror(buffer,"lmmse_interpolate()");
-    qix = (float (*)[6])buffer;
+    memset(qix, 0, rr1*cc1*6*sizeof(float));
     
     // indices
     w1 = cc1;
@@ -338,16 +860,12 @@ static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t
     h4 /= hs;
     
     // copy CFA values
-#if LMMSE_DEBUG_TIME_PROFILE
-    t1 = clock();
-#endif
-    
     for(rr = 0; rr < rr1; rr++) {
-        for(cc = 0, row = (rr - ba); cc < cc1; cc++) {
-            col = cc - ba;
+        for(cc = 0, row = (rr - ba) + regionTop; cc < cc1; cc++) {
+            col = (cc - ba) + regionLeft;
             rix = qix + rr*cc1 + cc;
             
-            if((row >= 0) & (row < height) & (col >= 0) & (col < width)) {
+            if((row >= regionTop) & (row < regionBottom) & (col >= regionLeft) & (col < regionRight)) {
 //                rix[0][4] = (double)image[row*width+col][FC(row,col,filters)]/65535.0;
 //                rix[0][4] = ((double) inPlane[(row * width) + col]) / 65535.0;
                 rix[0][4] = ((double) outPlane[(row * width * 4) + (col * 4) + FC(row,col,filters)]) / 65535.0;
@@ -357,14 +875,7 @@ static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t
         }
     }
     
-#if LMMSE_DEBUG_TIME_PROFILE
-    fprintf(stderr, "\tcopy CFA values: %f s\n", ((double)(clock() - t1)) / CLOCKS_PER_SEC);
-#endif
-    
     // G-R(B)
-#if LMMSE_DEBUG_TIME_PROFILE
-    t1 = clock();
-#endif
     
     for(rr = 2; rr < (rr1 - 2); rr++) {
         // G-R(B) at R(B) location
@@ -413,14 +924,7 @@ static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t
         }
     }
     
-#if LMMSE_DEBUG_TIME_PROFILE
-    fprintf(stderr, "\tG-R(B): %f s\n", ((double)(clock() - t1)) / CLOCKS_PER_SEC);
-#endif
-    
     // apply low pass filter on differential colors
-#if LMMSE_DEBUG_TIME_PROFILE
-    t1 = clock();
-#endif
     
     for(rr = 4; rr < (rr1 - 4); rr++) {
         for (cc = 4; cc < (cc1 - 4); cc++) {
@@ -434,14 +938,7 @@ static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t
         }
     }
     
-#if LMMSE_DEBUG_TIME_PROFILE
-    fprintf(stderr, "\tLow pass filter on differential colors: %f s\n", ((double)(clock() - t1)) / CLOCKS_PER_SEC);
-#endif
-    
     // interpolate G-R(B) at R(B)
-#if LMMSE_DEBUG_TIME_PROFILE
-    t1 = clock();
-#endif
     
     for (rr = 4; rr < (rr1 - 4); rr++) {
         for (cc = 4+(FC(rr,4,filters)&1); cc < (cc1 - 4); cc += 2) {
@@ -502,22 +999,15 @@ static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t
         }
     }
     
-#if LMMSE_DEBUG_TIME_PROFILE
-    fprintf(stderr, "\tInterpolate G-R(B) at R(B): %f s\n", ((double)(clock() - t1)) / CLOCKS_PER_SEC);
-#endif
-    
     // copy CFA values
-#if LMMSE_DEBUG_TIME_PROFILE
-    t1 = clock();
-#endif
     
     for(rr = 0; rr < rr1; rr++) {
-        for(cc = 0, row = (rr-ba); cc < cc1; cc++) {
-            col=cc-ba;
+        for(cc = 0, row = (rr-ba) + regionTop; cc < cc1; cc++) {
+            col = (cc-ba) + regionLeft;
             rix = qix + rr*cc1 + cc;
             c = FC(rr,cc,filters);
             
-            if ((row >= 0) & (row < height) & (col >= 0) & (col < width)) {
+            if ((row >= regionTop) & (row < regionBottom) & (col >= regionLeft) & (col < regionRight)) {
 //                rix[0][c] = (double)image[row*width+col][c]/65535.0;
 //                rix[0][c] = (double) inPlane[(row * width) + col] / 65535.0;
                 rix[0][c] = ((double) outPlane[(row * width * 4) + (col * 4) + c]) / 65535.0;
@@ -531,15 +1021,8 @@ static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t
         }
     }
     
-#if LMMSE_DEBUG_TIME_PROFILE
-    fprintf(stderr, "\tCopy CFA values: %f s\n", ((double)(clock() - t1)) / CLOCKS_PER_SEC);
-#endif
-    
     // bilinear interpolation for R/B
     // interpolate R/B at G location
-#if LMMSE_DEBUG_TIME_PROFILE
-    t1 = clock();
-#endif
     
     for(rr = 1; rr < (rr1 - 1); rr++) {
         for(cc=1+(FC(rr,2,filters)&1), c=FC(rr,cc+1,filters); cc < cc1-1; cc+=2) {
@@ -553,14 +1036,7 @@ static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t
         }
     }
     
-#if LMMSE_DEBUG_TIME_PROFILE
-    fprintf(stderr, "\tInterpolate R/B at G location: %f s\n", ((double)(clock() - t1)) / CLOCKS_PER_SEC);
-#endif
-    
     // interpolate R/B at B/R location
-#if LMMSE_DEBUG_TIME_PROFILE
-    t1 = clock();
-#endif
     
     for(rr = 1; rr < (rr1 -1 ); rr++) {
         for(cc=1+(FC(rr,1,filters)&1), c=2-FC(rr,cc,filters); cc < cc1-1; cc+=2) {
@@ -571,48 +1047,58 @@ static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t
         }
     }
     
-#if LMMSE_DEBUG_TIME_PROFILE
-    fprintf(stderr, "\tInterpolate R/B at B/R location: %f s\n", ((double)(clock() - t1)) / CLOCKS_PER_SEC);
-#endif
-    
-#if LMMSE_USE_MEDIAN_FILTER
-#if LMMSE_DEBUG_TIME_PROFILE
     // median filter
-    t1 = clock();
-#endif
+    if(medianPasses) {
+        LMMSEMedianRefine(qix, rr1, cc1, filters, medianPasses, planes);
+    }
+    
+    // copy result back to image matrix
+    
+    for(row = top; row < (top + tileRows); row++) {
+        for(col = left, rr = (row - regionTop) + ba; col < (left + tileCols); col++) {
+            cc = (col - regionLeft) + ba;
+            rix = qix + rr*cc1 + cc;
+            c = FC(row, col, filters);
+            
+            for(ii = 0; ii < 3; ii++) {
+                if(ii != c) {
+                    outPlane[row*width*4 + col*4 + ii] = CLIP((int) (65535.0 * rix[0][ii] + 0.5));
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Refines the interpolated tile in the working buffer by median filtering its R-G and B-G color differences, then
+ * rebuilding the missing components from them.
+ *
+ * @param planes Buffer for two planes of `rr1 * cc1` floats: the color differences, and their filtered values
+ */
+static void LMMSEMedianRefine(float (*qix)[6], int rr1, int cc1, unsigned int filters, int passes,
+                              float *planes) {
+    int c, d, rr, cc, ii, pass;
+    float (*rix)[6];
+    
+    float *diff = planes;
+    float *med = planes + (rr1 * cc1);
     
-    for(pass = 1; pass <= 3; pass++) {
+    for(pass = 1; pass <= passes; pass++) {
         for(c = 0; c < 3; c += 2) {
             // Compute median(R-G) and median(B-G)
             d = c + 3;
             for(ii = 0; ii < (rr1 * cc1); ii++) {
-                qix[ii][d] = qix[ii][c] - qix[ii][1];
+                diff[ii] = qix[ii][c] - qix[ii][1];
             }
             
-            // Apply 3x3 median fileter
-            for(rr = 1; rr < (rr1 - 1); rr++) {
-                for(cc = 1; cc < (cc1 - 1); cc++) {
-                    rix = qix + rr*cc1 + cc;
-                    // Assign 3x3 differential color values
-                    p1 = rix[-w1-1][d]; p2 = rix[-w1][d]; p3 = rix[-w1+1][d];
-                    p4 = rix[   -1][d]; p5 = rix[  0][d]; p6 = rix[    1][d];
-                    p7 = rix[ w1-1][d]; p8 = rix[ w1][d]; p9 = rix[ w1+1][d];
-                    
-                    // Sort for median of 9 values
-                    PIX_SORT(p2,p3); PIX_SORT(p5,p6); PIX_SORT(p8,p9);
-                    PIX_SORT(p1,p2); PIX_SORT(p4,p5); PIX_SORT(p7,p8);
-                    PIX_SORT(p2,p3); PIX_SORT(p5,p6); PIX_SORT(p8,p9);
-                    PIX_SORT(p1,p4); PIX_SORT(p6,p9); PIX_SORT(p5,p8);
-                    PIX_SORT(p4,p7); PIX_SORT(p2,p5); PIX_SORT(p3,p6);
-                    PIX_SORT(p5,p8); PIX_SORT(p5,p3); PIX_SORT(p7,p5);
-                    PIX_SORT(p5,p3);
-                    
-                    rix[0][4] = p5;
-                }
-            }
+            // Apply 3x3 median filter; the outermost lines are in the border, so they're left as is
+            MedianFilter3x3(diff, cc1, med + cc1, cc1, cc1, rr1 - 2);
+            
+            memcpy(med, diff, cc1 * sizeof(float));
+            memcpy(med + ((rr1 - 1) * cc1), diff + ((rr1 - 1) * cc1), cc1 * sizeof(float));
             
             for(ii = 0; ii < (rr1 * cc1); ii++) {
-                qix[ii][d] = qix[ii][4];
+                qix[ii][d] = med[ii];
             }
         }
         
@@ -630,40 +1116,95 @@ static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t
             for(cc=(FC(rr,0,filters)&1), c=2-FC(rr,cc,filters), d=c+3; cc < cc1; cc+=2) {
                 rix = qix + rr*cc1 + cc;
                 rix[0][c] = rix[0][1] + rix[0][d];
-                rix[0][1] = 0.5*(rix[0][0] - rix[0][3] + rix[0][2] - rix[0][5]); }
+                rix[0][1] = 0.5*(rix[0][0] - rix[0][3] + rix[0][2] - rix[0][5]);
+            }
         }
     }
+}
+
+/**
+ * Performs LMMSE interpolation on the image, one tile at a time. Each tile is processed with enough lines
+ * of context around it to produce the same output as the whole image would, so only a single tile needs
+ * to be held in the working buffer.
+ *
+ * @param medianFilter Whether the color differences are refined with a few passes of a median filter
+ */
+static int InterpolateLMMSE(const uint16_t *inPlane, uint16_t *outPlane, size_t width, size_t height, size_t vShift,
+                            bool medianFilter, stage_stats_t *stats) {
+    const int medianPasses = medianFilter ? LMMSE_MEDIAN_PASSES : 0;
+    const size_t halo = medianFilter ? LMMSE_MEDIAN_HALO_LINES : LMMSE_HALO_LINES;
     
-#if LMMSE_DEBUG_TIME_PROFILE
-    fprintf(stderr, "\tMedian filter: %f s\n", ((double)(clock() - t1)) / CLOCKS_PER_SEC);
-#endif
-#endif
+    // allocate working buffer for the largest tile, with halo and boundary
+    const size_t maxRows = MIN(LMMSE_TILE_SIZE, height) + (2 * halo) + (2 * LMMSE_BORDER);
+    const size_t maxCols = MIN(LMMSE_TILE_SIZE, width) + (2 * halo) + (2 * LMMSE_BORDER);
     
-    // copy result back to image matrix
-#if LMMSE_DEBUG_TIME_PROFILE
-    t1 = clock();
-#endif
+    const size_t bufferBytes = maxRows * maxCols * sizeof(float[6]);
     
-    for(row = 0; row < height; row++) {
-        for(col = 0, rr= (row + ba); col < width; col++) {
-            cc = col + ba;
-            rix = qix + rr*cc1 + cc;
-            c = FC(row, col, filters);
-            
-            for(ii = 0; ii < 3; ii++) {
-                if(ii != c) {
-                    outPlane[row*width*4 + col*4 + ii] = CLIP((int) (65535.0 * rix[0][ii] + 0.5));
-                }
-            }
+    float (*buffer)[6] = BufferPoolGet(ScratchPool(), bufferBytes);
+    if(!buffer) {
+        return -1;
+    }
+    StageCountAllocation(stats, bufferBytes);
+    
+    // the median filter works on two more planes of the same size
+    const size_t planesBytes = medianPasses ? (maxRows * maxCols * sizeof(float) * 2) : 0;
+    float *planes = NULL;
+    
+    if(medianPasses) {
+        planes = BufferPoolGet(ScratchPool(), planesBytes);
+        if(!planes) {
+            BufferPoolPut(ScratchPool(), buffer, bufferBytes);
+            return -1;
         }
+        StageCountAllocation(stats, planesBytes);
     }
     
-#if LMMSE_DEBUG_TIME_PROFILE
-    fprintf(stderr, "\tCopy result to image matrix: %f s\n", ((double)(clock() - t1)) / CLOCKS_PER_SEC);
-    fprintf(stderr, "Total time for lmmse_interpolate: %f s\n", ((double)(clock() - t2)) / CLOCKS_PER_SEC);
-#endif
+    // interpolate each tile
+    for(size_t top = 0; top < height; top += LMMSE_TILE_SIZE) {
+        for(size_t left = 0; left < width; left += LMMSE_TILE_SIZE) {
+            LMMSETile(outPlane, width, height, top, left, MIN(LMMSE_TILE_SIZE, height - top),
+                      MIN(LMMSE_TILE_SIZE, width - left), halo, medianPasses, buffer, planes);
+        }
+    }
     
     // Done
-    free(buffer);
+    BufferPoolPut(ScratchPool(), planes, planesBytes);
+    BufferPoolPut(ScratchPool(), buffer, bufferBytes);
+    return 0;
+}
+
+// MARK: Band processing
+/**
+ * Gets the number of lines in each band of an image processed in parallel. Bands have an even number of
+ * lines, and there are about two per CPU.
+ */
+static size_t BandLines(size_t height) {
+    const size_t cpus = (size_t) MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    size_t bandLines = (height + (cpus * 2) - 1) / (cpus * 2);
+    
+    return MAX((bandLines + 1) & ~((size_t) 1), kMinBandLines);
+}
+
+/**
+ * Gets the number of lines above and below a band that the given algorithm needs, for a band to be
+ * debayered identically to the full image. This is always even.
+ */
+static size_t HaloLines(debayer_algorithm_t algo) {
+    switch(algo) {
+        // only direct neighbours are read
+        case kBayerAlgorithmBilinear:
+            return 2;
+
+        case kBayerAlgorithmLMMSE:
+            return LMMSE_HALO_LINES;
+        case kBayerAlgorithmLMMSEMedian:
+            return LMMSE_MEDIAN_HALO_LINES;
+            
+        // each output pixel only depends on its own block
+        case kBayerAlgorithmHalfSize:
+        case kBayerAlgorithmQuarterSize:
+            return 0;
+    }
+
     return 0;
 }
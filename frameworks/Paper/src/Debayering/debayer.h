@@ -10,6 +10,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "pixel_layout.h"
 
 /**
  * Debayering algorithms
@@ -19,8 +20,32 @@ typedef enum debayer_algorithm {
     kBayerAlgorithmBilinear = 1,
     /// LSMME demosaicing algorithm (L. Zhang and X. Wu)
     kBayerAlgorithmLMMSE = 2,
+    /// Half size output: each 2x2 CFA block is binned into one pixel (superpixel)
+    kBayerAlgorithmHalfSize = 3,
+    /// Quarter size output: each 4x4 CFA block is binned into one pixel
+    kBayerAlgorithmQuarterSize = 4,
+    /// LSMME demosaicing followed by median filter refinement of the color differences; noticeably slower,
+    /// so it's meant for final output (such as exports) rather than interactive use
+    kBayerAlgorithmLMMSEMedian = 5,
 } debayer_algorithm_t;
 
+/**
+ * Gets the factor by which the given algorithm shrinks the image in each dimension. Binning algorithms
+ * output `width / factor` by `height / factor` pixels (rounded down); all others output full size images.
+ *
+ * @return Scale factor (1, 2 or 4), or 0 if the algorithm is invalid
+ */
+size_t DebayerScaleFactor(debayer_algorithm_t algo);
+
+/**
+ * Gets the number of lines above and below a region that the given algorithm reads to produce the region's
+ * output. A region debayered from an image that only contains this many lines of context around it is
+ * identical to the same area of the fully debayered image.
+ *
+ * @return Number of context lines; this is always even
+ */
+size_t DebayerHaloLines(debayer_algorithm_t algo);
+
 /**
  * Performs debayering on the given 1 component input image, writing outputs into the 3 component output
  * image plane.
@@ -29,7 +54,7 @@ typedef enum debayer_algorithm {
  *
  * @param algo Debayering algorithm to use
  * @param inPlane Input plane
- * @param outPlane Output plane
+ * @param outPlane Output plane; for binning algorithms, this is reduced by the algorithm's scale factor
  * @param width Image width
  * @param height Image height
  * @param vShift Vertical shift for the debayering pattern
@@ -40,4 +65,131 @@ int Debayer(debayer_algorithm_t algo, const uint16_t *inPlane,
             uint16_t *outPlane, size_t width, size_t height, size_t vShift,
             const double *wb, const uint16_t *black);
 
+/**
+ * Debayers the given 1 component input image and converts it to the working color space in a single pass,
+ * writing 32-bit floating point RGBA pixels. Strips of the image are white balanced, interpolated and
+ * multiplied by the color matrix while they're still in cache, so no full size intermediate buffers are
+ * needed.
+ *
+ * @param algo Debayering algorithm to use
+ * @param inPlane Input plane
+ * @param outPlane Output plane; 4 floats per pixel, with alpha set to 1. For binning algorithms, this is
+ * reduced by the algorithm's scale factor
+ * @param width Image width
+ * @param height Image height
+ * @param vShift Vertical shift for the debayering pattern
+ * @param wb White balance multipliers for each of the 4 bayer elements
+ * @param black Black level for each CFA index
+ * @param matrix Row major 3x3 color conversion matrix applied to each pixel, or NULL for none
+ * @param scale Factor to convert the 16-bit components to floating point, e.g. 1/16384 for 14-bit data
+ */
+int DebayerToFloat(debayer_algorithm_t algo, const uint16_t *inPlane,
+                   float *outPlane, size_t width, size_t height, size_t vShift,
+                   const double *wb, const uint16_t *black, const float *matrix, float scale);
+
+/**
+ * Debayers the given 1 component input image and converts it to the working color space in a single pass,
+ * like `DebayerToFloat`, but writes 16-bit (half precision) floating point RGBA pixels that can be uploaded
+ * to the GPU as is. The color conversion is done in single precision; only the results are narrowed.
+ *
+ * @param outPlane Output plane; 4 half floats per pixel, with alpha set to 1. For binning algorithms,
+ * this is reduced by the algorithm's scale factor
+ * @param scale Factor to convert the 16-bit components to floating point, e.g. 1/16384 for 14-bit data
+ */
+int DebayerToHalf(debayer_algorithm_t algo, const uint16_t *inPlane,
+                  __fp16 *outPlane, size_t width, size_t height, size_t vShift,
+                  const double *wb, const uint16_t *black, const float *matrix, float scale);
+
+/**
+ * Debayers a region of the given 1 component input image, writing 4 component 16-bit pixels into a
+ * caller supplied buffer with an arbitrary stride. Pixels around the region are taken into account as
+ * needed by the algorithm, so the output is identical to the same area of a fully debayered image.
+ *
+ * For binning algorithms, the region's origin must be a multiple of the scale factor; its size is reduced by
+ * the factor (rounding down) to get the number of output pixels.
+ *
+ * @param algo Debayering algorithm to use
+ * @param inPlane Input plane, covering the entire image
+ * @param width Image width
+ * @param height Image height
+ * @param vShift Vertical shift for the debayering pattern
+ * @param wb White balance multipliers for each of the 4 bayer elements
+ * @param black Black level for each CFA index
+ * @param regionX Leftmost column of the region
+ * @param regionY Topmost line of the region
+ * @param regionWidth Number of columns in the region
+ * @param regionHeight Number of lines in the region
+ * @param outPlane Output buffer; its first pixel corresponds to the top left of the region
+ * @param outStride Number of bytes between the starts of consecutive lines in the output buffer
+ * @return 0 on success, or a negative error code (including if the region isn't inside the image)
+ */
+int DebayerRegion(debayer_algorithm_t algo, const uint16_t *inPlane,
+                  size_t width, size_t height, size_t vShift,
+                  const double *wb, const uint16_t *black,
+                  size_t regionX, size_t regionY, size_t regionWidth, size_t regionHeight,
+                  uint16_t *outPlane, size_t outStride);
+
+/**
+ * Debayers a region of the given 1 component input image and converts it to the working color space,
+ * like `DebayerToFloat`, writing 32-bit floating point RGBA pixels into a caller supplied buffer with an
+ * arbitrary stride.
+ *
+ * @param algo Debayering algorithm to use
+ * @param inPlane Input plane, covering the entire image
+ * @param width Image width
+ * @param height Image height
+ * @param vShift Vertical shift for the debayering pattern
+ * @param wb White balance multipliers for each of the 4 bayer elements
+ * @param black Black level for each CFA index
+ * @param matrix Row major 3x3 color conversion matrix applied to each pixel, or NULL for none
+ * @param scale Factor to convert the 16-bit components to floating point, e.g. 1/16384 for 14-bit data
+ * @param regionX Leftmost column of the region
+ * @param regionY Topmost line of the region
+ * @param regionWidth Number of columns in the region
+ * @param regionHeight Number of lines in the region
+ * @param outPlane Output buffer; 4 floats per pixel, starting with the top left of the region
+ * @param outStride Number of bytes between the starts of consecutive lines in the output buffer
+ * @return 0 on success, or a negative error code (including if the region isn't inside the image)
+ */
+int DebayerRegionToFloat(debayer_algorithm_t algo, const uint16_t *inPlane,
+                         size_t width, size_t height, size_t vShift,
+                         const double *wb, const uint16_t *black, const float *matrix, float scale,
+                         size_t regionX, size_t regionY, size_t regionWidth, size_t regionHeight,
+                         float *outPlane, size_t outStride);
+
+/**
+ * Debayers a region of the given 1 component input image, writing the pixels in the format and layout
+ * described by the output descriptor. This lets the pixels go straight into memory owned by the consumer,
+ * such as an IOSurface or Metal buffer, without an intermediate copy or conversion pass.
+ *
+ * If a matrix is specified, each pixel is multiplied by it and the scale factor; float formats store the
+ * result as is, while integer formats round and clamp it. Without a matrix, the interpolated 16-bit
+ * components are stored unchanged.
+ *
+ * If the output descriptor has a histogram, the written pixels are added to it. Bands count into private
+ * histograms that are merged when they complete, so several regions may be debayered into the same
+ * histogram at once.
+ *
+ * @param algo Debayering algorithm to use
+ * @param inPlane Input plane, covering the entire image
+ * @param width Image width
+ * @param height Image height
+ * @param vShift Vertical shift for the debayering pattern
+ * @param wb White balance multipliers for each of the 4 bayer elements
+ * @param black Black level for each CFA index
+ * @param matrix Row major 3x3 color conversion matrix applied to each pixel, or NULL for none
+ * @param scale Factor applied along with the matrix; ignored if there is no matrix
+ * @param regionX Leftmost column of the region
+ * @param regionY Topmost line of the region
+ * @param regionWidth Number of columns in the region
+ * @param regionHeight Number of lines in the region
+ * @param out Output descriptor; its first pixel corresponds to the top left of the region
+ * @return 0 on success, or a negative error code (including if the region isn't inside the image)
+ */
+int DebayerRegionToLayout(debayer_algorithm_t algo, const uint16_t *inPlane,
+                          size_t width, size_t height, size_t vShift,
+                          const double *wb, const uint16_t *black, const float *matrix, float scale,
+                          size_t regionX, size_t regionY, size_t regionWidth, size_t regionHeight,
+                          const pixel_layout_t *out);
+
 #endif /* debayer_h */
@@ -0,0 +1,123 @@
+//
+//  median.c
+//  Paper (macOS)
+//
+//  Vectorized 3x3 median filter, used by the post-interpolation refinement of
+//  the built in debayering code and the LibRaw helpers.
+//
+//  The median of each neighbourhood is found with the usual 19 element
+//  exchange network; since it's made up only of min/max operations, it runs
+//  on a vector of adjacent pixels at a time without any branches.
+//
+//  Created by Tristan Seifert on 20200902.
+//
+
+#include "median.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// MARK: Kernels
+/**
+ * Exchange network for the median of 9 values; once it has run, the median is in p[4]. The network is written
+ * in terms of a SORT(a, b) macro that orders two values so a <= b.
+ */
+#define MEDIAN9_NETWORK(p) { \
+    SORT(p[1], p[2]); SORT(p[4], p[5]); SORT(p[7], p[8]); \
+    SORT(p[0], p[1]); SORT(p[3], p[4]); SORT(p[6], p[7]); \
+    SORT(p[1], p[2]); SORT(p[4], p[5]); SORT(p[7], p[8]); \
+    SORT(p[0], p[3]); SORT(p[5], p[8]); SORT(p[4], p[7]); \
+    SORT(p[3], p[6]); SORT(p[1], p[4]); SORT(p[2], p[5]); \
+    SORT(p[4], p[7]); SORT(p[4], p[2]); SORT(p[6], p[4]); \
+    SORT(p[4], p[2]); \
+}
+
+/**
+ * Gets the median of the neighbourhood of a single value.
+ */
+static inline float Median9(const float *above, const float *line, const float *below) {
+    float p[9] = {
+        above[-1], above[0], above[1],
+        line[-1], line[0], line[1],
+        below[-1], below[0], below[1],
+    };
+    float temp;
+
+#define SORT(a, b) { if((a) > (b)) { temp = (a); (a) = (b); (b) = temp; } }
+    MEDIAN9_NETWORK(p);
+#undef SORT
+
+    return p[4];
+}
+
+// MARK: Filtering
+/**
+ * Applies a 3x3 median filter to a band of lines.
+ */
+void MedianFilter3x3(const float *in, size_t inStride, float *out, size_t outStride,
+                     size_t width, size_t lines) {
+    assert(in);
+    assert(out);
+
+    for(size_t line = 0; line < lines; line++) {
+        const float *above = in + (line * inStride);
+        const float *middle = above + inStride;
+        const float *below = middle + inStride;
+        float *dst = out + (line * outStride);
+
+        // the edges lack a full neighbourhood
+        if(width < 3) {
+            memcpy(dst, middle, width * sizeof(float));
+            continue;
+        }
+
+        dst[0] = middle[0];
+        dst[width - 1] = middle[width - 1];
+
+        size_t col = 1;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        for(; (col + 4) <= (width - 1); col += 4) {
+            float32x4_t p[9] = {
+                vld1q_f32(above + col - 1), vld1q_f32(above + col), vld1q_f32(above + col + 1),
+                vld1q_f32(middle + col - 1), vld1q_f32(middle + col), vld1q_f32(middle + col + 1),
+                vld1q_f32(below + col - 1), vld1q_f32(below + col), vld1q_f32(below + col + 1),
+            };
+            float32x4_t temp;
+
+#define SORT(a, b) { temp = vminq_f32((a), (b)); (b) = vmaxq_f32((a), (b)); (a) = temp; }
+            MEDIAN9_NETWORK(p);
+#undef SORT
+
+            vst1q_f32(dst + col, p[4]);
+        }
+#elif defined(__SSE2__)
+        for(; (col + 4) <= (width - 1); col += 4) {
+            __m128 p[9] = {
+                _mm_loadu_ps(above + col - 1), _mm_loadu_ps(above + col), _mm_loadu_ps(above + col + 1),
+                _mm_loadu_ps(middle + col - 1), _mm_loadu_ps(middle + col), _mm_loadu_ps(middle + col + 1),
+                _mm_loadu_ps(below + col - 1), _mm_loadu_ps(below + col), _mm_loadu_ps(below + col + 1),
+            };
+            __m128 temp;
+
+#define SORT(a, b) { temp = _mm_min_ps((a), (b)); (b) = _mm_max_ps((a), (b)); (a) = temp; }
+            MEDIAN9_NETWORK(p);
+#undef SORT
+
+            _mm_storeu_ps(dst + col, p[4]);
+        }
+#endif
+
+        // remaining values
+        for(; col < (width - 1); col++) {
+            dst[col] = Median9(above + col, middle + col, below + col);
+        }
+    }
+}
@@ -0,0 +1,35 @@
+//
+//  median.h
+//  Paper (macOS)
+//
+//  Vectorized 3x3 median filter, used by the post-interpolation refinement of
+//  the built in debayering code and the LibRaw helpers.
+//
+//  Created by Tristan Seifert on 20200902.
+//
+
+#ifndef MEDIAN_H
+#define MEDIAN_H
+
+#include <stddef.h>
+
+/**
+ * Applies a 3x3 median filter to a band of lines of a single component plane.
+ *
+ * Output line `i` is computed from input lines `i`, `i + 1` and `i + 2`, so the input must have two more
+ * lines than the output: pass a pointer to the line above the first one to filter. The first and last
+ * columns have no complete neighbourhood and are copied from the middle input line unchanged.
+ *
+ * Any number of bands may be filtered at once, as long as their outputs don't overlap the inputs.
+ *
+ * @param in First input line
+ * @param inStride Number of values between the starts of consecutive input lines
+ * @param out First output line
+ * @param outStride Number of values between the starts of consecutive output lines
+ * @param width Number of values in each line
+ * @param lines Number of output lines
+ */
+void MedianFilter3x3(const float *in, size_t inStride, float *out, size_t outStride,
+                     size_t width, size_t lines);
+
+#endif /* MEDIAN_H */
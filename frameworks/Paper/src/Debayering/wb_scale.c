@@ -0,0 +1,257 @@
+//
+//  wb_scale.c
+//  Paper (macOS)
+//
+//  Vectorized black level subtraction and white balance scaling, shared by the
+//  built in debayering code and the LibRaw helpers.
+//
+//  Created by Tristan Seifert on 20200822.
+//
+
+#include "wb_scale.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <smmintrin.h>
+
+/// The SSE4.1 kernels are always compiled, even if the deployment target's baseline doesn't include it, and are
+/// only used if the CPU supports it
+#define HAVE_SSE41_KERNELS 1
+#define SSE41_TARGET __attribute__((target("sse4.1")))
+#endif
+
+// MARK: Kernels
+/**
+ * Subtracts the black level from a single value, then scales and clamps it.
+ */
+static inline uint16_t ScaleValue(uint16_t value, uint16_t black, float mul) {
+    const float scaled = (float) ((value > black) ? (value - black) : 0) * mul;
+    return (scaled < 65535.f) ? (uint16_t) scaled : 65535;
+}
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+/**
+ * Subtracts the black level from eight values, then scales and clamps them.
+ */
+static inline uint16x8_t Scale8(uint16x8_t value, uint16x8_t black, float32x4_t mul) {
+    value = vqsubq_u16(value, black);
+
+    const float32x4_t lo = vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(value))), mul);
+    const float32x4_t hi = vmulq_f32(vcvtq_f32_u32(vmovl_high_u16(value)), mul);
+
+    // conversion to integer truncates and saturates
+    return vcombine_u16(vqmovn_u32(vcvtq_u32_f32(lo)), vqmovn_u32(vcvtq_u32_f32(hi)));
+}
+#elif HAVE_SSE41_KERNELS
+/**
+ * Whether the SSE4.1 kernels can be used; unless the entire build targets it, this is checked at runtime.
+ */
+static inline bool CanUseSSE41(void) {
+#if defined(__SSE4_1__)
+    return true;
+#else
+    return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+/**
+ * Subtracts the black level from eight values, then scales and clamps them.
+ */
+static inline SSE41_TARGET __m128i Scale8(__m128i value, __m128i black, __m128 mul) {
+    const __m128 max = _mm_set1_ps(65535.f);
+    const __m128i zero = _mm_setzero_si128();
+
+    value = _mm_subs_epu16(value, black);
+
+    const __m128 lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(value, zero)), mul);
+    const __m128 hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(value, zero)), mul);
+
+    return _mm_packus_epi32(_mm_cvttps_epi32(_mm_min_ps(lo, max)),
+                            _mm_cvttps_epi32(_mm_min_ps(hi, max)));
+}
+
+/**
+ * Scales and expands one line of CFA data, eight columns at a time.
+ *
+ * @return Number of columns processed; the remainder is left for the scalar path
+ */
+static SSE41_TARGET size_t BayerLineSSE41(const uint16_t *in, uint16_t *out, size_t width, size_t color,
+                                          const uint16_t black[2], const float mul[2]) {
+    size_t col = 0;
+
+    const __m128i blackVec = _mm_set1_epi32(black[0] | ((uint32_t) black[1] << 16));
+    const __m128 mulVec = _mm_setr_ps(mul[0], mul[1], mul[0], mul[1]);
+    const __m128i evenMask = _mm_set1_epi32(0xffff);
+    const __m128i zero = _mm_setzero_si128();
+
+    for(; (col + 8) <= width; col += 8) {
+        const __m128i v = Scale8(_mm_loadu_si128((const __m128i *) (in + col)), blackVec, mulVec);
+
+        // 32-bit words holding the component pair of each pixel, in order
+        const __m128i even = _mm_and_si128(v, evenMask);
+        const __m128i odd = _mm_andnot_si128(evenMask, v);
+        const __m128i lo = _mm_unpacklo_epi32(even, odd);
+        const __m128i hi = _mm_unpackhi_epi32(even, odd);
+
+        // the pair is the first half of the pixel for color 0, the second for color 2
+        __m128i *outPtr = (__m128i *) (out + (col * 4));
+
+        if(color == 0) {
+            _mm_storeu_si128(outPtr + 0, _mm_unpacklo_epi32(lo, zero));
+            _mm_storeu_si128(outPtr + 1, _mm_unpackhi_epi32(lo, zero));
+            _mm_storeu_si128(outPtr + 2, _mm_unpacklo_epi32(hi, zero));
+            _mm_storeu_si128(outPtr + 3, _mm_unpackhi_epi32(hi, zero));
+        } else {
+            _mm_storeu_si128(outPtr + 0, _mm_unpacklo_epi32(zero, lo));
+            _mm_storeu_si128(outPtr + 1, _mm_unpackhi_epi32(zero, lo));
+            _mm_storeu_si128(outPtr + 2, _mm_unpacklo_epi32(zero, hi));
+            _mm_storeu_si128(outPtr + 3, _mm_unpackhi_epi32(zero, hi));
+        }
+    }
+
+    return col;
+}
+
+/**
+ * Scales interleaved values in place, eight at a time.
+ *
+ * @param outMax Largest value written
+ * @return Number of values processed; the remainder is left for the scalar path
+ */
+static SSE41_TARGET size_t InterleavedSSE41(uint16_t *values, size_t count, const uint16_t black[4],
+                                            const float *mul, uint16_t *outMax) {
+    size_t i = 0;
+
+    const __m128i blackHalf = _mm_loadl_epi64((const __m128i *) black);
+    const __m128i blackVec = _mm_unpacklo_epi64(blackHalf, blackHalf);
+    __m128i maxVec = _mm_setzero_si128();
+    uint16_t maxLanes[8];
+
+    if(mul) {
+        const __m128 mulVec = _mm_loadu_ps(mul);
+
+        for(; (i + 8) <= count; i += 8) {
+            const __m128i v = Scale8(_mm_loadu_si128((const __m128i *) (values + i)), blackVec, mulVec);
+            maxVec = _mm_max_epu16(maxVec, v);
+            _mm_storeu_si128((__m128i *) (values + i), v);
+        }
+    } else {
+        for(; (i + 8) <= count; i += 8) {
+            const __m128i v = _mm_subs_epu16(_mm_loadu_si128((const __m128i *) (values + i)), blackVec);
+            maxVec = _mm_max_epu16(maxVec, v);
+            _mm_storeu_si128((__m128i *) (values + i), v);
+        }
+    }
+
+    _mm_storeu_si128((__m128i *) maxLanes, maxVec);
+
+    uint16_t max = 0;
+    for(size_t j = 0; j < 8; j++) {
+        if(maxLanes[j] > max) max = maxLanes[j];
+    }
+
+    *outMax = max;
+    return i;
+}
+#endif
+
+// MARK: Bayer lines
+/**
+ * Scales one line of single component CFA data and expands it into a four component line.
+ */
+void WBScaleBayerLine(const uint16_t *in, uint16_t *out, size_t width, size_t color,
+                      const uint16_t black[2], const float mul[2]) {
+    size_t col = 0;
+
+    assert(color == 0 || color == 2);
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    const float mulLanes[4] = { mul[0], mul[1], mul[0], mul[1] };
+    const uint16x8_t blackVec = vreinterpretq_u16_u32(vdupq_n_u32(black[0] | ((uint32_t) black[1] << 16)));
+    const float32x4_t mulVec = vld1q_f32(mulLanes);
+    const uint16x8_t evenMask = vreinterpretq_u16_u32(vdupq_n_u32(0xffff));
+
+    for(; (col + 8) <= width; col += 8) {
+        const uint16x8_t v = Scale8(vld1q_u16(in + col), blackVec, mulVec);
+
+        // even columns go to the first component of the pair, odd ones to the second
+        uint16x8x4_t px;
+        px.val[0] = px.val[1] = px.val[2] = px.val[3] = vdupq_n_u16(0);
+        px.val[color] = vandq_u16(v, evenMask);
+        px.val[color + 1] = vbicq_u16(v, evenMask);
+
+        vst4q_u16(out + (col * 4), px);
+    }
+#elif HAVE_SSE41_KERNELS
+    if(CanUseSSE41()) {
+        col = BayerLineSSE41(in, out, width, color, black, mul);
+    }
+#endif
+
+    // remaining pixels
+    for(; col < width; col++) {
+        uint16_t *px = out + (col * 4);
+
+        px[0] = px[1] = px[2] = px[3] = 0;
+        px[color + (col & 1)] = ScaleValue(in[col], black[col & 1], mul[col & 1]);
+    }
+}
+
+// MARK: Interleaved pixels
+/**
+ * Scales four component pixels in place.
+ */
+uint16_t WBScaleInterleaved(uint16_t (*image)[4], size_t pixels, const uint16_t black[4],
+                            const float *mul) {
+    static const float unity[4] = { 1.f, 1.f, 1.f, 1.f };
+
+    uint16_t *values = (uint16_t *) image;
+    const size_t count = pixels * 4;
+    uint16_t max = 0;
+    size_t i = 0;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    const uint16x4_t blackHalf = vld1_u16(black);
+    const uint16x8_t blackVec = vcombine_u16(blackHalf, blackHalf);
+    uint16x8_t maxVec = vdupq_n_u16(0);
+
+    if(mul) {
+        const float32x4_t mulVec = vld1q_f32(mul);
+
+        for(; (i + 8) <= count; i += 8) {
+            const uint16x8_t v = Scale8(vld1q_u16(values + i), blackVec, mulVec);
+            maxVec = vmaxq_u16(maxVec, v);
+            vst1q_u16(values + i, v);
+        }
+    } else {
+        for(; (i + 8) <= count; i += 8) {
+            const uint16x8_t v = vqsubq_u16(vld1q_u16(values + i), blackVec);
+            maxVec = vmaxq_u16(maxVec, v);
+            vst1q_u16(values + i, v);
+        }
+    }
+
+    max = vmaxvq_u16(maxVec);
+#elif HAVE_SSE41_KERNELS
+    if(CanUseSSE41()) {
+        i = InterleavedSSE41(values, count, black, mul, &max);
+    }
+#endif
+
+    // remaining values
+    if(!mul) mul = unity;
+
+    for(; i < count; i++) {
+        const uint16_t v = ScaleValue(values[i], black[i & 3], mul[i & 3]);
+        if(v > max) max = v;
+        values[i] = v;
+    }
+
+    return max;
+}
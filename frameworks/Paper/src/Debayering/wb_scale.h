@@ -0,0 +1,48 @@
+//
+//  wb_scale.h
+//  Paper (macOS)
+//
+//  Vectorized black level subtraction and white balance scaling, shared by the
+//  built in debayering code and the LibRaw helpers.
+//
+//  Created by Tristan Seifert on 20200822.
+//
+
+#ifndef WB_SCALE_H
+#define WB_SCALE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Scales one line of single component CFA data and expands it into a four component line.
+ *
+ * Even columns are written to component `color`, odd columns to component `color + 1`; all other
+ * components of each output pixel are cleared. Each value has the black level for its column
+ * subtracted (clamping at zero), is multiplied by the matching scale factor and clamped to 16 bits.
+ *
+ * @param in Input line, `width` values
+ * @param out Output line, `width` pixels of four components each
+ * @param width Number of pixels in the line
+ * @param color Component written for even columns; either 0 or 2
+ * @param black Black levels for even and odd columns
+ * @param mul Scale factors for even and odd columns
+ */
+void WBScaleBayerLine(const uint16_t *in, uint16_t *out, size_t width, size_t color,
+                      const uint16_t black[2], const float mul[2]);
+
+/**
+ * Scales four component pixels in place. Every component has its black level subtracted (clamping at
+ * zero), is multiplied by its scale factor and clamped to 16 bits.
+ *
+ * @param image Pixel data
+ * @param pixels Number of pixels
+ * @param black Black levels for each component
+ * @param mul Scale factors for each component, or NULL to only subtract the black level
+ *
+ * @return Largest output value
+ */
+uint16_t WBScaleInterleaved(uint16_t (*image)[4], size_t pixels, const uint16_t black[4],
+                            const float *mul);
+
+#endif /* WB_SCALE_H */
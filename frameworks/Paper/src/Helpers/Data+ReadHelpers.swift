@@ -69,3 +69,28 @@ extension UInt16: EndianConvertible {}
 extension Int32: EndianConvertible {}
 extension UInt32: EndianConvertible {}
 
+
+/**
+ * Allows buffers to be handed out as data objects without copying them.
+ */
+extension Data {
+    /**
+     * Wraps a mutable buffer without copying its contents. The buffer is kept alive (and, if it was taken from a decode
+     * context, returned to it) until the data object is released; it must not be modified or resized in the meantime.
+     */
+    internal init(wrapping buffer: NSMutableData) {
+        self.init(wrapping: buffer, count: buffer.length)
+    }
+    
+    /**
+     * Wraps the first `count` bytes of a mutable buffer without copying them; the rest of the buffer is kept
+     * alive along with them.
+     */
+    internal init(wrapping buffer: NSMutableData, count: Int) {
+        precondition(count <= buffer.length, "Wrapped range exceeds buffer (\(count) > \(buffer.length))")
+        
+        self.init(bytesNoCopy: buffer.mutableBytes, count: count, deallocator: .custom({ _, _ in
+            withExtendedLifetime(buffer) {}
+        }))
+    }
+}
@@ -0,0 +1,25 @@
+//
+//  PAPDecodeContext+Private.h
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200830.
+//
+
+#import "PAPDecodeContext.h"
+
+#import "bufpool.h"
+#import "decompress.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+@interface PAPDecodeContext ()
+
+@property (nonatomic, readonly) buffer_pool_t *pool;
+
+- (nullable jpeg_decompressor_t *) decompressorWithCols:(NSUInteger) cols rows:(NSUInteger) rows
+                                              precision:(NSUInteger) bits numPlanes:(NSUInteger) planes;
+- (void) recycleDecompressor:(jpeg_decompressor_t *) dec;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,34 @@
+//
+//  PAPDecodeContext.h
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200830.
+//
+
+#import <Foundation/Foundation.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+/**
+ * State that can be shared between subsequent decodes, so that decoding a series of images of the same
+ * geometry (such as a shoot from one camera) doesn't allocate and fault in fresh memory for each image.
+ *
+ * A context holds on to a decompressor, whose internal buffers are reused for the next image, and a pool of
+ * size classed buffers for output planes and scratch space. Buffers handed out by the context return to its
+ * pool once the last reference to them goes away. Contexts may be used from multiple threads at once.
+ */
+@interface PAPDecodeContext : NSObject
+
+- (instancetype) init;
+- (instancetype) initWithMaxIdleBytes:(NSUInteger) maxIdleBytes NS_DESIGNATED_INITIALIZER;
+
+- (nullable NSMutableData *) bufferWithLength:(NSUInteger) length;
+
+- (void) purge;
+
+/// Number of bytes held by buffers that aren't currently in use
+@property (nonatomic, readonly) NSUInteger idleBytes;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,138 @@
+//
+//  PAPDecodeContext.m
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200830.
+//
+
+#import "PAPDecodeContext.h"
+#import "PAPDecodeContext+Private.h"
+
+#import <os/lock.h>
+
+@interface PAPDecodeContext () {
+    /// Protects the idle decompressor
+    os_unfair_lock _lock;
+}
+
+// Decompressor that finished decoding, kept around for the next image
+@property (nonatomic, nullable) jpeg_decompressor_t *idleDecompressor;
+
+@end
+
+@implementation PAPDecodeContext
+
+/**
+ * Creates a context whose pool holds on to a share of the system's memory that fits a few full size images.
+ */
+- (instancetype) init {
+    const NSUInteger totalMem = NSProcessInfo.processInfo.physicalMemory;
+    const NSUInteger maxIdle = MIN(MAX(totalMem / 16, 512 * 1024 * 1024), 2048ULL * 1024 * 1024);
+
+    return [self initWithMaxIdleBytes:maxIdle];
+}
+
+/**
+ * Creates a context whose pool holds at most the given number of bytes in buffers that aren't in use.
+ */
+- (instancetype) initWithMaxIdleBytes:(NSUInteger) maxIdleBytes {
+    self = [super init];
+    if (self) {
+        _lock = OS_UNFAIR_LOCK_INIT;
+
+        _pool = BufferPoolNew(maxIdleBytes);
+        NSAssert(_pool != nil, @"BufferPoolNew() failed");
+    }
+    return self;
+}
+
+- (void) dealloc {
+    if (self.idleDecompressor) {
+        JPEGDecompressorRelease(self.idleDecompressor);
+    }
+    BufferPoolRelease(_pool);
+}
+
+// MARK: - Buffers
+/**
+ * Gets a buffer of the given length from the pool. Its contents are undefined; it's returned to the pool
+ * when deallocated, and must not be resized.
+ *
+ * The buffer is filed back under the length it was allocated with, rather than whatever length the data
+ * object has when it goes away.
+ */
+- (nullable NSMutableData *) bufferWithLength:(NSUInteger) length {
+    void *bytes = BufferPoolGet(_pool, length);
+    if (!bytes) {
+        return nil;
+    }
+
+    // the buffer keeps the context (and thus the pool) alive
+    return [[NSMutableData alloc] initWithBytesNoCopy:bytes length:length
+                                          deallocator:^(void *bytes, NSUInteger currentLength) {
+        BufferPoolPut(self.pool, bytes, length);
+    }];
+}
+
+/**
+ * Frees all buffers that aren't in use, as well as the idle decompressor.
+ */
+- (void) purge {
+    os_unfair_lock_lock(&_lock);
+    jpeg_decompressor_t *dec = self.idleDecompressor;
+    self.idleDecompressor = NULL;
+    os_unfair_lock_unlock(&_lock);
+
+    if (dec) {
+        JPEGDecompressorRelease(dec);
+    }
+    BufferPoolPurge(_pool);
+}
+
+/**
+ * Number of bytes held by idle buffers
+ */
+- (NSUInteger) idleBytes {
+    return BufferPoolIdleBytes(_pool);
+}
+
+// MARK: - Decompressors
+/**
+ * Gets a decompressor for an image of the given size, reusing the idle decompressor if there is one.
+ */
+- (nullable jpeg_decompressor_t *) decompressorWithCols:(NSUInteger) cols rows:(NSUInteger) rows
+                                              precision:(NSUInteger) bits numPlanes:(NSUInteger) planes {
+    os_unfair_lock_lock(&_lock);
+    jpeg_decompressor_t *dec = self.idleDecompressor;
+    self.idleDecompressor = NULL;
+    os_unfair_lock_unlock(&_lock);
+
+    if (dec) {
+        int err = JPEGDecompressorReset(dec, cols, rows, bits, planes);
+        NSAssert(err == 0, @"Failed to reset decompressor: %d", err);
+        return dec;
+    }
+
+    return JPEGDecompressorNew(cols, rows, bits, planes);
+}
+
+/**
+ * Takes back a decompressor once its owner is done with it. It's kept for the next image, unless it's
+ * still referenced elsewhere or another decompressor is already idle.
+ */
+- (void) recycleDecompressor:(jpeg_decompressor_t *) dec {
+    if (dec->refCount == 1) {
+        os_unfair_lock_lock(&_lock);
+        if (!self.idleDecompressor) {
+            self.idleDecompressor = dec;
+            dec = NULL;
+        }
+        os_unfair_lock_unlock(&_lock);
+    }
+
+    if (dec) {
+        JPEGDecompressorRelease(dec);
+    }
+}
+
+@end
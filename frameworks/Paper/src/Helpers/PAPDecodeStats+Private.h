@@ -0,0 +1,20 @@
+//
+//  PAPDecodeStats+Private.h
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200910.
+//
+
+#import "PAPDecodeStats.h"
+
+#import "stagestats.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+@interface PAPDecodeStats ()
+
+@property (nonatomic, readonly) stage_stats_t *stats;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,79 @@
+//
+//  PAPDecodeStats.h
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200910.
+//
+
+#import <Foundation/Foundation.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+/**
+ * Stages of decoding and developing raw sensor data
+ */
+typedef NS_ENUM(NSUInteger, PAPDecodeStage) {
+    /// Lossless JPEG decompression
+    PAPDecodeStageDecompress = 0,
+    /// Reassembling the slices of the image
+    PAPDecodeStageUnslice = 1,
+    /// Collecting the raw histogram, black levels and Bayer shift (and trimming, if done in the same pass)
+    PAPDecodeStageRawStats = 2,
+    /// Copying the visible area of the sensor data
+    PAPDecodeStageTrim = 3,
+    /// Black level subtraction and white balance
+    PAPDecodeStageWhiteBalance = 4,
+    /// Interpolating or binning the CFA
+    PAPDecodeStageDemosaic = 5,
+    /// Conversion to the working color space and output format
+    PAPDecodeStageColorConvert = 6,
+};
+
+/// Number of decode stages
+extern const NSUInteger PAPDecodeStageCount;
+
+/**
+ * Timings and counters of a decode, recorded by the C kernels as they run.
+ *
+ * Set the same stats object on all parts of a decode (the decompressor, unslicer and raw stream) to find out
+ * where its time went. Each stage is also marked as a signpost interval in the "stages" category, so it
+ * can be inspected in Instruments. Stats may be updated from several threads at once; read them once the
+ * decode has completed.
+ */
+@interface PAPDecodeStats : NSObject
+
+- (instancetype) init;
+
+- (void) reset;
+
+- (NSTimeInterval) durationOfStage:(PAPDecodeStage) stage;
+- (NSUInteger) bytesOfStage:(PAPDecodeStage) stage;
+- (NSUInteger) intervalsOfStage:(PAPDecodeStage) stage;
+
++ (NSString *) nameOfStage:(PAPDecodeStage) stage;
+
+/// Time from the start of the first stage to the end of the last one
+@property (nonatomic, readonly) NSTimeInterval elapsed;
+
+/// Bit buffer refills that had to check each byte for markers
+@property (nonatomic, readonly) NSUInteger slowRefills;
+/// Huffman codes that weren't resolved by a single table lookup
+@property (nonatomic, readonly) NSUInteger treeWalks;
+/// Number of buffers requested by the kernels
+@property (nonatomic, readonly) NSUInteger allocations;
+/// Total size of those buffers, in bytes
+@property (nonatomic, readonly) NSUInteger allocatedBytes;
+/// Size of the largest of those buffers, in bytes
+@property (nonatomic, readonly) NSUInteger largestAllocation;
+
+/// Code of the first error raised by a stage, or 0 if none failed
+@property (nonatomic, readonly) NSInteger errorCode;
+/// Stage that raised the error; only meaningful if there was one
+@property (nonatomic, readonly) PAPDecodeStage errorStage;
+
+/// All values, keyed by stage name and counter name, for logging
+@property (nonatomic, readonly) NSDictionary<NSString *, id> *dictionaryRepresentation;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,167 @@
+//
+//  PAPDecodeStats.m
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200910.
+//
+
+#import "PAPDecodeStats.h"
+#import "PAPDecodeStats+Private.h"
+
+const NSUInteger PAPDecodeStageCount = kStageCount;
+
+@implementation PAPDecodeStats
+
+/**
+ * Creates a stats object with all values cleared.
+ */
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        _stats = StageStatsNew();
+        NSAssert(_stats != nil, @"StageStatsNew() failed");
+    }
+    return self;
+}
+
+- (void) dealloc {
+    StageStatsRelease(_stats);
+}
+
+/**
+ * Clears all values, so the stats can be used for another decode. No decode may be using them.
+ */
+- (void) reset {
+    StageStatsReset(self.stats);
+}
+
+// MARK: - Stages
+/**
+ * Gets the time spent in the given stage. Stages that process bands concurrently add up the time of each
+ * band, so this may exceed the elapsed time.
+ */
+- (NSTimeInterval) durationOfStage:(PAPDecodeStage) stage {
+    NSAssert(stage < PAPDecodeStageCount, @"Invalid stage: %lu", (unsigned long) stage);
+
+    stage_summary_t summary;
+    StageStatsGetSummary(self.stats, (stage_t) stage, &summary);
+    return ((NSTimeInterval) summary.nanos) / NSEC_PER_SEC;
+}
+
+/**
+ * Gets the number of bytes produced by the given stage.
+ */
+- (NSUInteger) bytesOfStage:(PAPDecodeStage) stage {
+    NSAssert(stage < PAPDecodeStageCount, @"Invalid stage: %lu", (unsigned long) stage);
+
+    stage_summary_t summary;
+    StageStatsGetSummary(self.stats, (stage_t) stage, &summary);
+    return summary.bytes;
+}
+
+/**
+ * Gets the number of times the given stage ran.
+ */
+- (NSUInteger) intervalsOfStage:(PAPDecodeStage) stage {
+    NSAssert(stage < PAPDecodeStageCount, @"Invalid stage: %lu", (unsigned long) stage);
+
+    stage_summary_t summary;
+    StageStatsGetSummary(self.stats, (stage_t) stage, &summary);
+    return summary.intervals;
+}
+
+/**
+ * Gets a short name for the stage, matching its signpost name.
+ */
++ (NSString *) nameOfStage:(PAPDecodeStage) stage {
+    switch (stage) {
+        case PAPDecodeStageDecompress:
+            return @"Decompress";
+        case PAPDecodeStageUnslice:
+            return @"Unslice";
+        case PAPDecodeStageRawStats:
+            return @"Raw Stats";
+        case PAPDecodeStageTrim:
+            return @"Trim";
+        case PAPDecodeStageWhiteBalance:
+            return @"White Balance";
+        case PAPDecodeStageDemosaic:
+            return @"Demosaic";
+        case PAPDecodeStageColorConvert:
+            return @"Color Convert";
+    }
+
+    return [NSString stringWithFormat:@"Stage %lu", (unsigned long) stage];
+}
+
+- (NSTimeInterval) elapsed {
+    return ((NSTimeInterval) StageStatsGetElapsed(self.stats)) / NSEC_PER_SEC;
+}
+
+// MARK: - Counters
+- (NSUInteger) slowRefills {
+    return StageStatsGetCounter(self.stats, kStageCounterSlowRefills);
+}
+- (NSUInteger) treeWalks {
+    return StageStatsGetCounter(self.stats, kStageCounterTreeWalks);
+}
+- (NSUInteger) allocations {
+    return StageStatsGetCounter(self.stats, kStageCounterAllocations);
+}
+- (NSUInteger) allocatedBytes {
+    return StageStatsGetCounter(self.stats, kStageCounterAllocatedBytes);
+}
+- (NSUInteger) largestAllocation {
+    return StageStatsGetCounter(self.stats, kStageCounterLargestAllocation);
+}
+
+// MARK: - Errors
+- (NSInteger) errorCode {
+    return StageStatsGetError(self.stats, NULL);
+}
+
+- (PAPDecodeStage) errorStage {
+    stage_t stage = kStageDecompress;
+    StageStatsGetError(self.stats, &stage);
+    return (PAPDecodeStage) stage;
+}
+
+// MARK: - Logging
+/**
+ * Builds a dictionary of all values. Each stage that ran is a dictionary of its duration (in seconds), bytes
+ * produced and number of intervals, keyed by its name.
+ */
+- (NSDictionary<NSString *, id> *) dictionaryRepresentation {
+    NSMutableDictionary *dict = [NSMutableDictionary new];
+
+    for (NSUInteger i = 0; i < PAPDecodeStageCount; i++) {
+        stage_summary_t summary;
+        StageStatsGetSummary(self.stats, (stage_t) i, &summary);
+
+        if (!summary.intervals) {
+            continue;
+        }
+
+        dict[[PAPDecodeStats nameOfStage:i]] = @{
+            @"duration": @(((NSTimeInterval) summary.nanos) / NSEC_PER_SEC),
+            @"bytes": @(summary.bytes),
+            @"intervals": @(summary.intervals),
+        };
+    }
+
+    dict[@"elapsed"] = @(self.elapsed);
+    dict[@"slowRefills"] = @(self.slowRefills);
+    dict[@"treeWalks"] = @(self.treeWalks);
+    dict[@"allocations"] = @(self.allocations);
+    dict[@"allocatedBytes"] = @(self.allocatedBytes);
+    dict[@"largestAllocation"] = @(self.largestAllocation);
+
+    if (self.errorCode) {
+        dict[@"error"] = @(self.errorCode);
+        dict[@"errorStage"] = [PAPDecodeStats nameOfStage:self.errorStage];
+    }
+
+    return [dict copy];
+}
+
+@end
@@ -0,0 +1,41 @@
+//
+//  PAPRawPacker.h
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200908.
+//
+
+#import <Foundation/Foundation.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+extern NSErrorDomain const PAPRawPackerErrorDomain;
+
+@class PAPDecodeContext;
+
+/**
+ * Reads and writes trimmed sensor data in a compact format that decodes much faster than lossless JPEG, so that
+ * decoded raw data can be cached on disk. Packed data can be read straight from a memory mapped file.
+ */
+@interface PAPRawPacker : NSObject
+
++ (nullable NSData *) packValues:(NSData *) values size:(CGSize) size bytesPerRow:(NSUInteger) bytesPerRow
+                          vShift:(NSUInteger) vShift blackLevel:(NSArray<NSNumber *> *) blackLevel
+                        userInfo:(nullable NSData *) userInfo error:(NSError **) error;
+
+- (nullable instancetype) initWithData:(NSData *) data error:(NSError **) error;
+
+- (nullable NSMutableData *) unpackWithContext:(nullable PAPDecodeContext *) context error:(NSError **) error;
+
+/// Size of the sensor data, in pixels
+@property (nonatomic, readonly) CGSize size;
+/// Vertical shift of the Bayer matrix
+@property (nonatomic, readonly) NSUInteger vShift;
+/// Black level for each of the 4 bayer components
+@property (nonatomic, readonly) NSArray<NSNumber *> *blackLevel;
+/// Data stored along with the sensor data, if any
+@property (nonatomic, readonly, nullable) NSData *userInfo;
+
+@end
+
+NS_ASSUME_NONNULL_END
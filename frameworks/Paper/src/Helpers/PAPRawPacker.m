@@ -0,0 +1,146 @@
+//
+//  PAPRawPacker.m
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200908.
+//
+
+#import "PAPRawPacker.h"
+#import "PAPDecodeContext.h"
+
+#import "rawpack.h"
+
+NSErrorDomain const PAPRawPackerErrorDomain = @"PAPRawPackerErrorDomain";
+
+@interface PAPRawPacker ()
+
+// Packed data; kept around since unpacking reads from it
+@property (nonatomic) NSData *data;
+
+@property (nonatomic) CGSize size;
+@property (nonatomic) NSUInteger vShift;
+@property (nonatomic) NSArray<NSNumber *> *blackLevel;
+@property (nonatomic, nullable) NSData *userInfo;
+
++ (NSError *) errorForCode:(NSInteger) code;
+
+@end
+
+@implementation PAPRawPacker
+
+/**
+ * Packs trimmed sensor data, along with the info needed to process it.
+ *
+ * @param values Sensor data, one 16-bit value per pixel
+ * @param size Size of the sensor data, in pixels
+ * @param bytesPerRow Number of bytes between the starts of consecutive lines of the sensor data
+ * @param blackLevel Black level for each of the 4 bayer components
+ * @param userInfo Arbitrary data to store with the sensor data, such as metadata of the image
+ */
++ (nullable NSData *) packValues:(NSData *) values size:(CGSize) size bytesPerRow:(NSUInteger) bytesPerRow
+                          vShift:(NSUInteger) vShift blackLevel:(NSArray<NSNumber *> *) blackLevel
+                        userInfo:(nullable NSData *) userInfo error:(NSError **) error {
+    rawpack_info_t info;
+    memset(&info, 0, sizeof(info));
+    
+    NSAssert(blackLevel.count == 4, @"Invalid black level array length: %lu", blackLevel.count);
+    NSAssert(values.length >= (bytesPerRow * (NSUInteger) size.height), @"Sensor data too short");
+    
+    info.width = size.width;
+    info.height = size.height;
+    info.vShift = vShift;
+    
+    for (NSUInteger i = 0; i < 4; i++) {
+        info.blackLevel[i] = blackLevel[i].unsignedShortValue;
+    }
+    
+    info.userInfo = userInfo.bytes;
+    info.userInfoLength = userInfo.length;
+    
+    // pack into a worst case sized buffer, then give back what's left over
+    const size_t maxLength = RawPackMaxLength(&info);
+    NSMutableData *packed = maxLength ? [NSMutableData dataWithLength:maxLength] : nil;
+    
+    if (!packed) {
+        if (error) *error = [self errorForCode:-1];
+        return nil;
+    }
+    
+    size_t written = 0;
+    int err = RawPackEncode(values.bytes, bytesPerRow, &info, packed.mutableBytes, packed.length, &written);
+    if (err != 0) {
+        if (error) *error = [self errorForCode:err];
+        return nil;
+    }
+    
+    packed.length = written;
+    return packed;
+}
+
+/**
+ * Reads the info of packed sensor data, so it can be unpacked later.
+ *
+ * The data is read in place, so it may be a memory mapped file; it's retained until the packer is deallocated.
+ */
+- (nullable instancetype) initWithData:(NSData *) data error:(NSError **) error {
+    self = [super init];
+    if (self) {
+        rawpack_info_t info;
+        
+        int err = RawPackReadInfo(data.bytes, data.length, &info);
+        if (err != 0) {
+            if (error) *error = [[self class] errorForCode:err];
+            return nil;
+        }
+        
+        self.data = data;
+        
+        self.size = CGSizeMake(info.width, info.height);
+        self.vShift = info.vShift;
+        self.blackLevel = @[@(info.blackLevel[0]), @(info.blackLevel[1]),
+                            @(info.blackLevel[2]), @(info.blackLevel[3])];
+        
+        if (info.userInfoLength) {
+            self.userInfo = [NSData dataWithBytes:info.userInfo length:info.userInfoLength];
+        }
+    }
+    return self;
+}
+
+/**
+ * Unpacks the sensor data into a new buffer without padding between lines. The buffer comes from the given
+ * context, if any.
+ */
+- (nullable NSMutableData *) unpackWithContext:(nullable PAPDecodeContext *) context error:(NSError **) error {
+    const NSUInteger bytesPerRow = ((NSUInteger) self.size.width) * sizeof(uint16_t);
+    const NSUInteger length = bytesPerRow * ((NSUInteger) self.size.height);
+    
+    NSMutableData *values = nil;
+    if (context) {
+        values = [context bufferWithLength:length];
+    } else {
+        values = [NSMutableData dataWithLength:length];
+    }
+    
+    if (!values) {
+        if (error) *error = [[self class] errorForCode:-1];
+        return nil;
+    }
+    
+    int err = RawPackDecode(self.data.bytes, self.data.length, values.mutableBytes, bytesPerRow);
+    if (err != 0) {
+        if (error) *error = [[self class] errorForCode:err];
+        return nil;
+    }
+    
+    return values;
+}
+
+/**
+ * Creates an error with the given code.
+ */
++ (NSError *) errorForCode:(NSInteger) code {
+    return [NSError errorWithDomain:PAPRawPackerErrorDomain code:code userInfo:nil];
+}
+
+@end
@@ -0,0 +1,295 @@
+//
+//  RawCache.swift
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200908.
+//
+
+import Foundation
+import CryptoKit
+import OSLog
+
+/**
+ * Persistent cache of decoded raw images, so that images opened again (such as while culling) skip decompressing and
+ * trimming their sensor data entirely.
+ *
+ * Entries are keyed by the contents of the raw file they were decoded from, so they stay valid when the file is moved or
+ * renamed. Each holds the trimmed sensor data, packed by `PAPRawPacker`, along with the metadata needed to develop it, and
+ * is read from a memory mapped file. Once the entries grow beyond the size limit, the least recently used ones are removed.
+ */
+public class RawCache {
+    fileprivate static var logger = Logger(subsystem: Bundle(for: RawCache.self).bundleIdentifier!,
+                                         category: "RawCache")
+
+    /// Default maximum size of the cache, in bytes; enough for a few hundred images
+    public static let defaultSizeLimit = 8 * 1024 * 1024 * 1024
+    /// File extension of cache entries
+    private static let pathExtension = "praw"
+    /// Number of bytes at the start and end of a raw file its key is derived from
+    private static let keyBytes = 256 * 1024
+
+    /// Directory holding the cache entries
+    private(set) public var directory: URL
+    /// Maximum number of bytes taken up by all entries
+    public var sizeLimit: Int {
+        didSet {
+            self.queue.async {
+                self.evict()
+            }
+        }
+    }
+
+    /// Queue on which the list of entries is accessed, and entries are written
+    private let queue = DispatchQueue(label: "RawCache", qos: .utility)
+    /// Size and last use of each entry, by key
+    private var entries: [String: EntryInfo] = [:]
+    /// Total number of bytes of all entries
+    private var totalSize: Int = 0
+
+    // MARK: - Initialization
+    /**
+     * Opens the cache in the given directory, creating it if needed.
+     */
+    public init(directory: URL, sizeLimit: Int = RawCache.defaultSizeLimit) throws {
+        self.directory = directory
+        self.sizeLimit = sizeLimit
+
+        if !FileManager.default.fileExists(atPath: directory.path) {
+            try FileManager.default.createDirectory(at: directory, withIntermediateDirectories: true,
+                                                    attributes: nil)
+        }
+
+        // the entries are only needed for eviction, so they can be listed in the background
+        self.queue.async {
+            self.loadEntries()
+        }
+    }
+
+    /**
+     * Builds the list of entries from the files in the cache directory; the modification date of each is its last use.
+     */
+    private func loadEntries() {
+        let keys: [URLResourceKey] = [.fileSizeKey, .contentModificationDateKey]
+
+        guard let urls = try? FileManager.default.contentsOfDirectory(at: self.directory,
+                                                                     includingPropertiesForKeys: keys,
+                                                                     options: .skipsHiddenFiles) else {
+            Self.logger.error("Failed to list raw cache at \(self.directory)")
+            return
+        }
+
+        for url in urls where url.pathExtension == Self.pathExtension {
+            guard let values = try? url.resourceValues(forKeys: Set(keys)),
+                  let size = values.fileSize else {
+                continue
+            }
+
+            let key = url.deletingPathExtension().lastPathComponent
+            self.entries[key] = EntryInfo(size: size, lastUsed: values.contentModificationDate ?? .distantPast)
+            self.totalSize += size
+        }
+
+        Self.logger.debug("Raw cache has \(self.entries.count) entries (\(self.totalSize) bytes)")
+        self.evict()
+    }
+
+    // MARK: - Keys
+    /**
+     * Derives the cache key for the raw file at the given url.
+     *
+     * Rather than reading all of the file, the key is a hash of its size and the data at either end: the start holds the
+     * metadata (including capture time and shot count), and the end the last slices of sensor data. Camera files that
+     * match in all of these are, in practice, the same file.
+     */
+    public static func key(forFileAt url: URL) throws -> String {
+        let data = try Data(contentsOf: url, options: .alwaysMapped)
+
+        var hash = SHA256()
+        withUnsafeBytes(of: UInt64(data.count).littleEndian) {
+            hash.update(bufferPointer: $0)
+        }
+
+        hash.update(data: data.prefix(Self.keyBytes))
+        if data.count > Self.keyBytes {
+            hash.update(data: data.suffix(min(Self.keyBytes, data.count - Self.keyBytes)))
+        }
+
+        return hash.finalize().map({ String(format: "%02x", $0) }).joined()
+    }
+
+    /**
+     * Gets the url of the entry with the given key.
+     */
+    private func url(forKey key: String) -> URL {
+        return self.directory.appendingPathComponent(key, isDirectory: false)
+                             .appendingPathExtension(Self.pathExtension)
+    }
+
+    // MARK: - Reading
+    /**
+     * Reads the cached image with the given key, if there is one. The image has its sensor data (and everything needed to
+     * develop it) and metadata set, but no thumbnails or raw histogram.
+     *
+     * - Parameter context: If set, the sensor data is unpacked into a buffer from this context
+     * - Returns: The cached image, or `nil` if there's no valid entry for the key.
+     */
+    public func image(forKey key: String, context: PAPDecodeContext? = nil) -> CR2Image? {
+        let url = self.url(forKey: key)
+
+        guard let data = try? Data(contentsOf: url, options: .alwaysMapped) else {
+            return nil
+        }
+
+        do {
+            let packer = try PAPRawPacker(data: data)
+
+            guard let infoData = packer.userInfo else {
+                throw Errors.missingInfo
+            }
+            let info = try PropertyListDecoder().decode(StoredInfo.self, from: infoData)
+
+            let image = CR2Image()
+            image.meta = info.meta
+            image.rawSize = info.rawSize
+            image.visibleImageSize = packer.size
+            image.rawValues = try packer.unpack(with: context) as Data
+            image.rawValuesVshift = packer.vShift
+            image.rawBlackLevel = packer.blackLevel.map({ $0.uint16Value })
+            image.rawWbMultiplier = info.wbMultiplier
+
+            self.queue.async {
+                self.touch(key)
+            }
+
+            return image
+        } catch {
+            Self.logger.error("Removing invalid raw cache entry \(key): \(error.localizedDescription)")
+
+            self.queue.async {
+                self.remove(key)
+            }
+            return nil
+        }
+    }
+
+    // MARK: - Writing
+    /**
+     * Stores the sensor data of a decoded image under the given key. The data is packed and written in the background.
+     *
+     * - Throws: If the image doesn't have trimmed sensor data, such as when it was decoded with a streaming output.
+     */
+    public func store(_ image: CR2Image, forKey key: String) throws {
+        guard let values = image.rawValues, image.rawBlackLevel.count == 4,
+              image.visibleImageSize != .zero else {
+            throw Errors.missingRawData
+        }
+
+        let info = StoredInfo(meta: image.meta, rawSize: image.rawSize, wbMultiplier: image.rawWbMultiplier)
+        let size = image.visibleImageSize
+        let vShift = image.rawValuesVshift
+        let black = image.rawBlackLevel.map(NSNumber.init)
+
+        self.queue.async {
+            do {
+                let encoder = PropertyListEncoder()
+                encoder.outputFormat = .binary
+
+                let packed = try PAPRawPacker.packValues(values, size: size,
+                                                         bytesPerRow: UInt(size.width) * 2,
+                                                         vShift: vShift, blackLevel: black,
+                                                         userInfo: try encoder.encode(info))
+                try packed.write(to: self.url(forKey: key), options: .atomic)
+
+                self.remove(key, deleteFile: false)
+                self.entries[key] = EntryInfo(size: packed.count, lastUsed: Date())
+                self.totalSize += packed.count
+
+                self.evict()
+            } catch {
+                Self.logger.error("Failed to write raw cache entry \(key): \(error.localizedDescription)")
+            }
+        }
+    }
+
+    // MARK: - Eviction
+    /**
+     * Marks the entry as most recently used. This is persisted as the modification date of its file.
+     */
+    private func touch(_ key: String) {
+        let now = Date()
+        self.entries[key]?.lastUsed = now
+
+        try? FileManager.default.setAttributes([.modificationDate: now], ofItemAtPath: self.url(forKey: key).path)
+    }
+
+    /**
+     * Removes an entry from the list, and optionally deletes its file.
+     */
+    private func remove(_ key: String, deleteFile: Bool = true) {
+        if let entry = self.entries.removeValue(forKey: key) {
+            self.totalSize -= entry.size
+        }
+
+        if deleteFile {
+            try? FileManager.default.removeItem(at: self.url(forKey: key))
+        }
+    }
+
+    /**
+     * Removes the least recently used entries until the cache fits into its size limit.
+     */
+    private func evict() {
+        guard self.totalSize > self.sizeLimit else {
+            return
+        }
+
+        let oldest = self.entries.sorted(by: { $0.value.lastUsed < $1.value.lastUsed })
+
+        for (key, _) in oldest {
+            guard self.totalSize > self.sizeLimit else {
+                break
+            }
+
+            Self.logger.debug("Evicting raw cache entry \(key)")
+            self.remove(key)
+        }
+    }
+
+    /**
+     * Removes all entries.
+     */
+    public func removeAll() {
+        self.queue.async {
+            for key in Array(self.entries.keys) {
+                self.remove(key)
+            }
+        }
+    }
+
+    // MARK: - Types
+    /// Size and last use of an entry
+    private struct EntryInfo {
+        /// Size of the entry's file, in bytes
+        var size: Int
+        /// When the entry was last written or read
+        var lastUsed: Date
+    }
+
+    /// Info about the image stored along with its packed sensor data
+    private struct StoredInfo: Codable {
+        /// Image metadata
+        var meta: ImageMeta?
+        /// Size of the raw image, before trimming
+        var rawSize: CGSize
+        /// White balance compensation factors, in RG/GB order
+        var wbMultiplier: [Double]
+    }
+
+    // MARK: - Errors
+    enum Errors: Error {
+        /// The image doesn't have trimmed sensor data to cache
+        case missingRawData
+        /// A cache entry is missing its image info
+        case missingInfo
+    }
+}
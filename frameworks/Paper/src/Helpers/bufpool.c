@@ -0,0 +1,204 @@
+//
+//  bufpool.c
+//  Paper (macOS)
+//
+//  Size classed pool of large buffers, so repeated decodes of images with the
+//  same geometry reuse memory rather than allocating (and faulting in) fresh
+//  pages every time.
+//
+//  Created by Tristan Seifert on 20200830.
+//
+
+#include "bufpool.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+/// Maximum number of idle buffers held by a pool
+#define kMaxIdleBuffers 32
+/// Smallest size class; also the granularity of the smallest classes
+#define kMinClassSize 4096
+
+/**
+ * A buffer that isn't currently in use
+ */
+typedef struct buffer_pool_entry {
+    /// Start of the buffer
+    void *buffer;
+    /// Size class of the buffer
+    size_t size;
+} buffer_pool_entry_t;
+
+/**
+ * Buffer pool state
+ */
+struct buffer_pool {
+    /// Lock protecting all idle buffers
+    pthread_mutex_t lock;
+
+    /// Maximum number of bytes in idle buffers
+    size_t maxIdleBytes;
+    /// Number of bytes currently in idle buffers
+    size_t idleBytes;
+
+    /// Idle buffers, least recently returned first
+    buffer_pool_entry_t idle[kMaxIdleBuffers];
+    /// Number of idle buffers
+    size_t numIdle;
+};
+
+/**
+ * Rounds a size up to its size class. There are eight classes for each power of two, so no more than an
+ * eighth of a buffer is wasted, while images of the same geometry always end up in the same class.
+ */
+static size_t ClassSize(size_t size) {
+    if(size <= kMinClassSize) {
+        return kMinClassSize;
+    }
+
+    // largest power of two below the size
+    const size_t msb = (size_t) 1 << ((sizeof(unsigned long long) * 8) - 1 - __builtin_clzll(size - 1));
+    const size_t step = (msb / 8) > kMinClassSize ? (msb / 8) : kMinClassSize;
+
+    return (size + step - 1) & ~(step - 1);
+}
+
+/**
+ * Removes the idle buffer at the given index. The lock must be held.
+ */
+static void RemoveIdle(buffer_pool_t *pool, size_t i) {
+    pool->idleBytes -= pool->idle[i].size;
+
+    memmove(&pool->idle[i], &pool->idle[i + 1], (pool->numIdle - i - 1) * sizeof(buffer_pool_entry_t));
+    pool->numIdle--;
+}
+
+// MARK: - Setup
+/**
+ * Creates a buffer pool.
+ */
+buffer_pool_t *BufferPoolNew(size_t maxIdleBytes) {
+    buffer_pool_t *pool = calloc(1, sizeof(buffer_pool_t));
+    if(!pool) return NULL;
+
+    if(pthread_mutex_init(&pool->lock, NULL) != 0) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->maxIdleBytes = maxIdleBytes;
+
+    return pool;
+}
+
+/**
+ * Releases a buffer pool and all idle buffers in it.
+ */
+void BufferPoolRelease(buffer_pool_t *pool) {
+    if(!pool) return;
+
+    BufferPoolPurge(pool);
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// MARK: - Buffers
+/**
+ * Gets a buffer of at least the given size, reusing an idle one of the same size class if possible.
+ */
+void *BufferPoolGet(buffer_pool_t *pool, size_t size) {
+    const size_t classSize = ClassSize(size);
+    void *buffer = NULL;
+
+    // most recently returned buffers are most likely to still be resident
+    if(pool) {
+        pthread_mutex_lock(&pool->lock);
+
+        for(size_t i = pool->numIdle; i > 0; i--) {
+            if(pool->idle[i - 1].size == classSize) {
+                buffer = pool->idle[i - 1].buffer;
+                RemoveIdle(pool, i - 1);
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if(!buffer && posix_memalign(&buffer, 64, classSize) != 0) {
+        return NULL;
+    }
+
+    return buffer;
+}
+
+/**
+ * Returns a buffer to the pool, evicting the least recently returned buffers if it's full.
+ */
+void BufferPoolPut(buffer_pool_t *pool, void *buffer, size_t size) {
+    const size_t classSize = ClassSize(size);
+
+    if(!buffer) return;
+
+    if(!pool || classSize > pool->maxIdleBytes) {
+        free(buffer);
+        return;
+    }
+
+    // collect evicted buffers, so they're freed without holding the lock
+    void *evicted[kMaxIdleBuffers];
+    size_t numEvicted = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while(pool->numIdle && (pool->numIdle == kMaxIdleBuffers ||
+                            (pool->idleBytes + classSize) > pool->maxIdleBytes)) {
+        evicted[numEvicted++] = pool->idle[0].buffer;
+        RemoveIdle(pool, 0);
+    }
+
+    pool->idle[pool->numIdle].buffer = buffer;
+    pool->idle[pool->numIdle].size = classSize;
+    pool->numIdle++;
+    pool->idleBytes += classSize;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    for(size_t i = 0; i < numEvicted; i++) {
+        free(evicted[i]);
+    }
+}
+
+/**
+ * Frees all idle buffers in the pool.
+ */
+void BufferPoolPurge(buffer_pool_t *pool) {
+    assert(pool);
+
+    pthread_mutex_lock(&pool->lock);
+
+    for(size_t i = 0; i < pool->numIdle; i++) {
+        free(pool->idle[i].buffer);
+    }
+    pool->numIdle = 0;
+    pool->idleBytes = 0;
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Gets the number of bytes held in idle buffers.
+ */
+size_t BufferPoolIdleBytes(buffer_pool_t *pool) {
+    assert(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    const size_t bytes = pool->idleBytes;
+    pthread_mutex_unlock(&pool->lock);
+
+    return bytes;
+}
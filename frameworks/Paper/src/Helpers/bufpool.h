@@ -0,0 +1,61 @@
+//
+//  bufpool.h
+//  Paper (macOS)
+//
+//  Size classed pool of large buffers, so repeated decodes of images with the
+//  same geometry reuse memory rather than allocating (and faulting in) fresh
+//  pages every time.
+//
+//  Created by Tristan Seifert on 20200830.
+//
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+// forward declarations
+typedef struct buffer_pool buffer_pool_t;
+
+/**
+ * Creates a buffer pool.
+ *
+ * @param maxIdleBytes Maximum number of bytes held in buffers that aren't in use; when a returned buffer
+ * would exceed this, the least recently returned buffers are freed.
+ * @return Pool, or NULL if it couldn't be allocated
+ */
+buffer_pool_t *BufferPoolNew(size_t maxIdleBytes);
+
+/**
+ * Releases a buffer pool and all idle buffers in it. Buffers still in use must not be returned to it.
+ */
+void BufferPoolRelease(buffer_pool_t *pool);
+
+/**
+ * Gets a buffer of at least the given size, aligned to 64 bytes. Its contents are undefined.
+ *
+ * Sizes are rounded up to a size class, and an idle buffer of the same class is reused if available. A NULL
+ * pool is allowed, in which case a new buffer is always allocated.
+ *
+ * @return Buffer, or NULL if it couldn't be allocated
+ */
+void *BufferPoolGet(buffer_pool_t *pool, size_t size);
+
+/**
+ * Returns a buffer to the pool, or frees it if the pool is NULL or full.
+ *
+ * @param size Size the buffer was requested with
+ */
+void BufferPoolPut(buffer_pool_t *pool, void *buffer, size_t size);
+
+/**
+ * Frees all idle buffers in the pool.
+ */
+void BufferPoolPurge(buffer_pool_t *pool);
+
+/**
+ * Gets the number of bytes held in idle buffers.
+ */
+size_t BufferPoolIdleBytes(buffer_pool_t *pool);
+
+#endif /* BUFPOOL_H */
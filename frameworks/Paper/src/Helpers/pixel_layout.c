@@ -0,0 +1,362 @@
+//
+//  pixel_layout.c
+//  Paper (macOS)
+//
+//  Describes the layout of RGB pixel buffers written by the debayering and
+//  color conversion code, so results can go straight into memory owned by
+//  someone else (such as an IOSurface or Metal buffer) in the format it
+//  expects.
+//
+//  Created by Tristan Seifert on 20200901.
+//
+
+#include "pixel_layout.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <math.h>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/**
+ * Loads the color components of an input pixel as floats, multiplying them by the matrix if there is one.
+ */
+static inline void LoadPixel(const uint16_t *in, const float *matrix, float *out) {
+    const float r = in[0], g = in[1], b = in[2];
+
+    if(matrix) {
+        out[0] = (matrix[0] * r) + (matrix[1] * g) + (matrix[2] * b);
+        out[1] = (matrix[3] * r) + (matrix[4] * g) + (matrix[5] * b);
+        out[2] = (matrix[6] * r) + (matrix[7] * g) + (matrix[8] * b);
+    } else {
+        out[0] = r;
+        out[1] = g;
+        out[2] = b;
+    }
+}
+
+/**
+ * Rounds a component to a 16-bit integer, clamping it to the valid range.
+ */
+static inline uint16_t ClampU16(float value) {
+    if(!(value > 0.f)) return 0;
+    if(value >= 65535.f) return 65535;
+
+    return (uint16_t) (value + 0.5f);
+}
+
+/**
+ * Buckets of a histogram being filled, with its range prepared for normalizing values
+ */
+typedef struct {
+    uint32_t *r, *g, *b, *y;
+
+    /// Value of the first bucket, and the factor to normalize values to [0, 1]
+    float min, invRange;
+    /// Index of the last bucket
+    float last;
+} histogram_bins_t;
+
+/**
+ * Sets up the buckets of a histogram for counting pixels.
+ */
+static inline void HistogramBinsInit(histogram_bins_t *bins, const pixel_histogram_t *histogram) {
+    const size_t n = histogram->buckets;
+
+    bins->r = histogram->counts;
+    bins->g = histogram->counts + n;
+    bins->b = histogram->counts + (2 * n);
+    bins->y = histogram->counts + (3 * n);
+
+    bins->min = histogram->min;
+    bins->invRange = 1.f / (histogram->max - histogram->min);
+    bins->last = (float) (n - 1);
+}
+
+/**
+ * Normalizes a value to the histogram's range, clamping it to [0, 1].
+ */
+static inline float HistogramNormalize(const histogram_bins_t *bins, float value) {
+    const float t = (value - bins->min) * bins->invRange;
+
+    if(!(t > 0.f)) return 0.f;
+    if(t >= 1.f) return 1.f;
+
+    return t;
+}
+
+/**
+ * Adds a pixel to the histogram: each of its components, and its luminance.
+ */
+static inline void HistogramCount(const histogram_bins_t *bins, float r, float g, float b) {
+    r = HistogramNormalize(bins, r);
+    g = HistogramNormalize(bins, g);
+    b = HistogramNormalize(bins, b);
+
+    // HSP perceived brightness; the weights sum to 1, so this stays in [0, 1]
+    const float y = sqrtf((0.299f * r * r) + (0.587f * g * g) + (0.114f * b * b));
+
+    bins->r[(size_t) ((r * bins->last) + 0.5f)]++;
+    bins->g[(size_t) ((g * bins->last) + 0.5f)]++;
+    bins->b[(size_t) ((b * bins->last) + 0.5f)]++;
+    bins->y[(size_t) ((y * bins->last) + 0.5f)]++;
+}
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+/**
+ * Normalizes four values to the histogram's range, clamping them to [0, 1].
+ */
+static inline float32x4_t HistogramNormalizex4(const histogram_bins_t *bins, float32x4_t value) {
+    const float32x4_t t = vmulq_n_f32(vsubq_f32(value, vdupq_n_f32(bins->min)), bins->invRange);
+
+    // unlike vmaxq, this turns NaN into 0
+    return vminq_f32(vmaxnmq_f32(t, vdupq_n_f32(0.f)), vdupq_n_f32(1.f));
+}
+
+/**
+ * Gets the buckets four normalized values go into.
+ */
+static inline uint32x4_t HistogramBucketx4(const histogram_bins_t *bins, float32x4_t t) {
+    return vcvtq_u32_f32(vfmaq_n_f32(vdupq_n_f32(0.5f), t, bins->last));
+}
+
+/**
+ * Adds four pixels to the histogram. Normalizing and finding the buckets is vectorized; only the increments
+ * themselves are done one at a time.
+ */
+static inline void HistogramCountx4(const histogram_bins_t *bins, float32x4_t r, float32x4_t g,
+                                    float32x4_t b) {
+    r = HistogramNormalizex4(bins, r);
+    g = HistogramNormalizex4(bins, g);
+    b = HistogramNormalizex4(bins, b);
+
+    float32x4_t y = vmulq_n_f32(vmulq_f32(r, r), 0.299f);
+    y = vfmaq_n_f32(y, vmulq_f32(g, g), 0.587f);
+    y = vsqrtq_f32(vfmaq_n_f32(y, vmulq_f32(b, b), 0.114f));
+
+    uint32_t idx[4][4];
+    vst1q_u32(idx[0], HistogramBucketx4(bins, r));
+    vst1q_u32(idx[1], HistogramBucketx4(bins, g));
+    vst1q_u32(idx[2], HistogramBucketx4(bins, b));
+    vst1q_u32(idx[3], HistogramBucketx4(bins, y));
+
+    for(size_t i = 0; i < 4; i++) {
+        bins->r[idx[0][i]]++;
+        bins->g[idx[1][i]]++;
+        bins->b[idx[2][i]]++;
+        bins->y[idx[3][i]]++;
+    }
+}
+
+/**
+ * Writes pixels as four component half floats, four at a time. The matrix is applied in single precision, and
+ * only its results are narrowed to half precision.
+ *
+ * @param r Position of the red component in the output
+ * @param bins Histogram to add the pixels to, or NULL
+ * @return Number of pixels written; the remainder is left for the scalar path
+ */
+static size_t WriteRowF16x4(__fp16 *out, const uint16_t *in, size_t inChannels, size_t pixels,
+                            const float *m, size_t r, const histogram_bins_t *bins) {
+    size_t i = 0;
+
+    const float16x4_t alpha = vdup_n_f16((float16_t) 1.f);
+    float32x4_t fr, fg, fb;
+
+    for(; (i + 4) <= pixels; i += 4, in += (4 * inChannels), out += 16) {
+        // deinterleave and widen the components
+        if(inChannels == 4) {
+            const uint16x4x4_t px = vld4_u16(in);
+            fr = vcvtq_f32_u32(vmovl_u16(px.val[0]));
+            fg = vcvtq_f32_u32(vmovl_u16(px.val[1]));
+            fb = vcvtq_f32_u32(vmovl_u16(px.val[2]));
+        } else {
+            const uint16x4x3_t px = vld3_u16(in);
+            fr = vcvtq_f32_u32(vmovl_u16(px.val[0]));
+            fg = vcvtq_f32_u32(vmovl_u16(px.val[1]));
+            fb = vcvtq_f32_u32(vmovl_u16(px.val[2]));
+        }
+
+        // multiply by the matrix, then narrow and interleave
+        float32x4_t o0 = vfmaq_n_f32(vfmaq_n_f32(vmulq_n_f32(fr, m[0]), fg, m[1]), fb, m[2]);
+        float32x4_t o1 = vfmaq_n_f32(vfmaq_n_f32(vmulq_n_f32(fr, m[3]), fg, m[4]), fb, m[5]);
+        float32x4_t o2 = vfmaq_n_f32(vfmaq_n_f32(vmulq_n_f32(fr, m[6]), fg, m[7]), fb, m[8]);
+
+        float16x4x4_t res;
+        res.val[r] = vcvt_f16_f32(o0);
+        res.val[1] = vcvt_f16_f32(o1);
+        res.val[2 - r] = vcvt_f16_f32(o2);
+        res.val[3] = alpha;
+
+        vst4_f16(out, res);
+
+        if(bins) {
+            HistogramCountx4(bins, o0, o1, o2);
+        }
+    }
+
+    return i;
+}
+#endif
+
+/**
+ * Gets the number of bytes taken up by each pixel.
+ */
+size_t PixelLayoutBytesPerPixel(const pixel_layout_t *layout) {
+    assert(layout);
+
+    if(layout->channels != 3 && layout->channels != 4) {
+        return 0;
+    }
+
+    switch(layout->format) {
+        case kPixelFormatU16:
+        case kPixelFormatF16:
+            return layout->channels * sizeof(uint16_t);
+
+        case kPixelFormatF32:
+            return layout->channels * sizeof(float);
+    }
+
+    return 0;
+}
+
+/**
+ * Checks whether the layout can hold an image of the given size.
+ */
+int PixelLayoutValidate(const pixel_layout_t *layout, size_t width, size_t height, size_t length) {
+    assert(layout);
+
+    const size_t bpp = PixelLayoutBytesPerPixel(layout);
+
+    if(!bpp || !layout->base || !width || !height ||
+       (layout->order != kPixelChannelOrderRGB && layout->order != kPixelChannelOrderBGR)) {
+        return -1;
+    }
+
+    // the last line doesn't need to be padded out to the full stride
+    if(layout->stride < (width * bpp) ||
+       length < ((layout->stride * (height - 1)) + (width * bpp))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes a run of pixels into the given line of the output.
+ */
+void PixelLayoutWriteRow(const pixel_layout_t *layout, size_t line, size_t col, const uint16_t *in,
+                         size_t inChannels, size_t pixels, const float *matrix) {
+    assert(layout);
+    assert(in);
+
+    const size_t bpp = PixelLayoutBytesPerPixel(layout);
+    assert(bpp);
+
+    uint8_t *row = ((uint8_t *) layout->base) + (line * layout->stride) + (col * bpp);
+
+    const size_t channels = layout->channels;
+    const bool alpha = (channels == 4);
+
+    // positions of the red and blue components
+    const size_t r = (layout->order == kPixelChannelOrderBGR) ? 2 : 0;
+    const size_t b = 2 - r;
+
+    histogram_bins_t binStorage, *bins = NULL;
+    if(layout->histogram) {
+        HistogramBinsInit(&binStorage, layout->histogram);
+        bins = &binStorage;
+    }
+
+    float px[3];
+
+    switch(layout->format) {
+        case kPixelFormatU16: {
+            uint16_t *out = (uint16_t *) row;
+
+            for(size_t i = 0; i < pixels; i++, in += inChannels, out += channels) {
+                if(matrix) {
+                    LoadPixel(in, matrix, px);
+
+                    out[r] = ClampU16(px[0]);
+                    out[1] = ClampU16(px[1]);
+                    out[b] = ClampU16(px[2]);
+                } else {
+                    out[r] = in[0];
+                    out[1] = in[1];
+                    out[b] = in[2];
+                }
+
+                if(bins) HistogramCount(bins, out[r], out[1], out[b]);
+
+                if(alpha) out[3] = UINT16_MAX;
+            }
+            break;
+        }
+
+        case kPixelFormatF16: {
+            __fp16 *out = (__fp16 *) row;
+            size_t i = 0;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+            // RGBA output (what Metal textures want) is written natively
+            if(alpha) {
+                static const float identity[9] = { 1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 1.f };
+
+                i = WriteRowF16x4(out, in, inChannels, pixels, matrix ? matrix : identity, r, bins);
+                in += (i * inChannels);
+                out += (i * channels);
+            }
+#endif
+
+            for(; i < pixels; i++, in += inChannels, out += channels) {
+                LoadPixel(in, matrix, px);
+
+                out[r] = px[0];
+                out[1] = px[1];
+                out[b] = px[2];
+
+                if(alpha) out[3] = 1.f;
+
+                if(bins) HistogramCount(bins, px[0], px[1], px[2]);
+            }
+            break;
+        }
+
+        case kPixelFormatF32: {
+            float *out = (float *) row;
+
+            for(size_t i = 0; i < pixels; i++, in += inChannels, out += channels) {
+                LoadPixel(in, matrix, px);
+
+                out[r] = px[0];
+                out[1] = px[1];
+                out[b] = px[2];
+
+                if(alpha) out[3] = 1.f;
+
+                if(bins) HistogramCount(bins, px[0], px[1], px[2]);
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * Adds the counts of one histogram to another.
+ */
+void PixelHistogramMerge(pixel_histogram_t *into, const pixel_histogram_t *from) {
+    assert(into && into->counts);
+    assert(from && from->counts);
+    assert(into->buckets == from->buckets);
+
+    for(size_t i = 0; i < (4 * from->buckets); i++) {
+        if(from->counts[i]) {
+            __atomic_fetch_add(&into->counts[i], from->counts[i], __ATOMIC_RELAXED);
+        }
+    }
+}
@@ -0,0 +1,126 @@
+//
+//  pixel_layout.h
+//  Paper (macOS)
+//
+//  Describes the layout of RGB pixel buffers written by the debayering and
+//  color conversion code, so results can go straight into memory owned by
+//  someone else (such as an IOSurface or Metal buffer) in the format it
+//  expects.
+//
+//  Created by Tristan Seifert on 20200901.
+//
+
+#ifndef PIXEL_LAYOUT_H
+#define PIXEL_LAYOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// forward declarations
+typedef struct stage_stats stage_stats_t;
+
+/**
+ * Format of each pixel component
+ */
+typedef enum pixel_format {
+    /// 16-bit unsigned integers
+    kPixelFormatU16 = 1,
+    /// 16-bit (half precision) floats
+    kPixelFormatF16 = 2,
+    /// 32-bit floats
+    kPixelFormatF32 = 3,
+} pixel_format_t;
+
+/**
+ * Order of the color components in each pixel; alpha (if any) always comes last
+ */
+typedef enum pixel_channel_order {
+    /// Red, green, blue
+    kPixelChannelOrderRGB = 0,
+    /// Blue, green, red
+    kPixelChannelOrderBGR = 1,
+} pixel_channel_order_t;
+
+/**
+ * Histogram of the pixels written through a layout: one set of buckets each for red, green, blue and luminance
+ * (HSP perceived brightness), in that order.
+ *
+ * Values are normalized to the given range, clamped, and placed in the nearest bucket; this matches the buckets
+ * of the GPU histogram calculation, so either can be displayed.
+ */
+typedef struct pixel_histogram {
+    /// Number of buckets per channel
+    size_t buckets;
+    /// Value that goes into the first bucket
+    float min;
+    /// Value that goes into the last bucket
+    float max;
+
+    /// Counts for each bucket of each channel; must be 4 * buckets long
+    uint32_t *counts;
+} pixel_histogram_t;
+
+/**
+ * Describes an output pixel buffer.
+ */
+typedef struct pixel_layout {
+    /// Format of each component
+    pixel_format_t format;
+    /// Number of components per pixel: 3, or 4 if there's an alpha component; alpha is always opaque
+    size_t channels;
+    /// Order of the color components
+    pixel_channel_order_t order;
+
+    /// First pixel of the buffer
+    void *base;
+    /// Number of bytes between the starts of consecutive lines
+    size_t stride;
+
+    /// If set, every pixel written is added to this histogram, as it's stored in the output
+    pixel_histogram_t *histogram;
+    /// If set, the kernels producing the pixels record the time spent in each of their stages into these stats
+    stage_stats_t *stats;
+} pixel_layout_t;
+
+/**
+ * Gets the number of bytes taken up by each pixel.
+ *
+ * @return Bytes per pixel, or 0 if the layout is invalid
+ */
+size_t PixelLayoutBytesPerPixel(const pixel_layout_t *layout);
+
+/**
+ * Checks whether the layout can hold an image of the given size.
+ *
+ * @param length Number of bytes available at the base pointer
+ * @return 0 if the layout is valid and large enough, -1 otherwise
+ */
+int PixelLayoutValidate(const pixel_layout_t *layout, size_t width, size_t height, size_t length);
+
+/**
+ * Writes a run of 16-bit RGB pixels into the given line of the output, converting them to its format.
+ *
+ * If a matrix is specified, each pixel is multiplied by it (as a column vector) first: for float formats,
+ * the result is stored as is; for integer formats, it's rounded and clamped. Without a matrix, the
+ * components are stored unchanged, still in the 0-65535 range for float formats.
+ *
+ * If the layout has a histogram, it's updated with the stored values; it must not be shared with
+ * concurrent writers.
+ *
+ * @param line Output line to write
+ * @param col First output column to write
+ * @param in Input pixels; only the first three (red, green, blue) components of each are read
+ * @param inChannels Number of components per input pixel, 3 or 4
+ * @param pixels Number of pixels to write
+ * @param matrix Row major 3x3 matrix applied to each pixel, or NULL
+ */
+void PixelLayoutWriteRow(const pixel_layout_t *layout, size_t line, size_t col, const uint16_t *in,
+                         size_t inChannels, size_t pixels, const float *matrix);
+
+/**
+ * Adds the counts of one histogram to another with the same buckets and range. This may be called from
+ * several threads at once for the same destination.
+ */
+void PixelHistogramMerge(pixel_histogram_t *into, const pixel_histogram_t *from);
+
+#endif /* PIXEL_LAYOUT_H */
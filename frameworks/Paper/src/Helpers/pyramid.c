@@ -0,0 +1,362 @@
+//
+//  pyramid.c
+//  Paper (macOS)
+//
+//  Builds all the reduced size levels of an image (each half the size of the
+//  previous one) in a single pass over it, so downscaled versions of a decoded
+//  image are available without reading the full size image again.
+//
+//  Every pixel has four components, so each one fits exactly into a vector;
+//  reducing a 2x2 block is then just three vector adds and a multiply.
+//
+//  Created by Tristan Seifert on 20200907.
+//
+
+#include "pyramid.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#include <dispatch/dispatch.h>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+#endif
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+/**
+ * Minimum number of full size lines in the bands built concurrently by `PyramidBuildImage`; the bands are
+ * rounded up to the alignment.
+ */
+#define kMinBandLines 64
+
+// MARK: Types
+/**
+ * Levels of an image and their memory
+ */
+struct image_pyramid {
+    /// Format of the components of the image and its levels
+    pixel_format_t format;
+    /// Size of the full size image
+    size_t width, height;
+
+    /// Number of reduced levels
+    size_t numLevels;
+    /// Layout and size of each level, starting with the first reduced one
+    pixel_layout_t levels[kPyramidMaxLevels];
+    size_t levelWidth[kPyramidMaxLevels], levelHeight[kPyramidMaxLevels];
+
+    /// Memory holding all levels
+    void *buffer;
+};
+
+/**
+ * State shared by the workers building an image's levels; each builds one band.
+ */
+typedef struct {
+    image_pyramid_t *pyramid;
+    const pixel_layout_t *src;
+
+    /// Number of full size lines in each band (except the last one)
+    size_t bandLines;
+    /// Set if any of the bands failed
+    atomic_int err;
+} pyramid_bands_t;
+
+static void BuildBand(void *ctx, size_t band);
+
+// MARK: - Kernels
+/**
+ * Reduces two lines of 32-bit float pixels into one line half as wide.
+ */
+static void ReduceRowF32(const float *top, const float *bottom, float *out, size_t outWidth) {
+    size_t i = 0;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    for(; i < outWidth; i++, top += 8, bottom += 8, out += 4) {
+        const float32x4_t sum = vaddq_f32(vaddq_f32(vld1q_f32(top), vld1q_f32(top + 4)),
+                                          vaddq_f32(vld1q_f32(bottom), vld1q_f32(bottom + 4)));
+        vst1q_f32(out, vmulq_n_f32(sum, 0.25f));
+    }
+#elif defined(__SSE2__)
+    const __m128 quarter = _mm_set1_ps(0.25f);
+
+    for(; i < outWidth; i++, top += 8, bottom += 8, out += 4) {
+        const __m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(top), _mm_loadu_ps(top + 4)),
+                                      _mm_add_ps(_mm_loadu_ps(bottom), _mm_loadu_ps(bottom + 4)));
+        _mm_storeu_ps(out, _mm_mul_ps(sum, quarter));
+    }
+#endif
+
+    for(; i < outWidth; i++, top += 8, bottom += 8, out += 4) {
+        for(size_t c = 0; c < 4; c++) {
+            out[c] = (top[c] + top[c + 4] + bottom[c] + bottom[c + 4]) * 0.25f;
+        }
+    }
+}
+
+/**
+ * Reduces two lines of half float pixels into one line half as wide. The averages are calculated in single
+ * precision.
+ */
+static void ReduceRowF16(const __fp16 *top, const __fp16 *bottom, __fp16 *out, size_t outWidth) {
+    size_t i = 0;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    for(; i < outWidth; i++, top += 8, bottom += 8, out += 4) {
+        const float16x8_t t = vld1q_f16(top), b = vld1q_f16(bottom);
+
+        const float32x4_t sum = vaddq_f32(vaddq_f32(vcvt_f32_f16(vget_low_f16(t)), vcvt_high_f32_f16(t)),
+                                          vaddq_f32(vcvt_f32_f16(vget_low_f16(b)), vcvt_high_f32_f16(b)));
+        vst1_f16(out, vcvt_f16_f32(vmulq_n_f32(sum, 0.25f)));
+    }
+#elif defined(__SSE2__) && defined(__F16C__)
+    const __m128 quarter = _mm_set1_ps(0.25f);
+
+    for(; i < outWidth; i++, top += 8, bottom += 8, out += 4) {
+        const __m128 t0 = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *) top));
+        const __m128 t1 = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *) (top + 4)));
+        const __m128 b0 = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *) bottom));
+        const __m128 b1 = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *) (bottom + 4)));
+
+        const __m128 sum = _mm_add_ps(_mm_add_ps(t0, t1), _mm_add_ps(b0, b1));
+        _mm_storel_epi64((__m128i *) out, _mm_cvtps_ph(_mm_mul_ps(sum, quarter), _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+
+    for(; i < outWidth; i++, top += 8, bottom += 8, out += 4) {
+        for(size_t c = 0; c < 4; c++) {
+            const float sum = (float) top[c] + (float) top[c + 4] + (float) bottom[c] + (float) bottom[c + 4];
+            out[c] = (__fp16) (sum * 0.25f);
+        }
+    }
+}
+
+/**
+ * Reduces lines of one image into the given lines of the next smaller level.
+ *
+ * @param first First line of the output to write
+ * @param last Last line (exclusive) of the output to write
+ */
+static void ReduceLines(pixel_format_t format, const pixel_layout_t *in, const pixel_layout_t *out,
+                        size_t outWidth, size_t first, size_t last) {
+    for(size_t line = first; line < last; line++) {
+        const uint8_t *top = ((const uint8_t *) in->base) + ((line * 2) * in->stride);
+        const uint8_t *bottom = top + in->stride;
+        uint8_t *row = ((uint8_t *) out->base) + (line * out->stride);
+
+        if(format == kPixelFormatF32) {
+            ReduceRowF32((const float *) top, (const float *) bottom, (float *) row, outWidth);
+        } else {
+            ReduceRowF16((const __fp16 *) top, (const __fp16 *) bottom, (__fp16 *) row, outWidth);
+        }
+    }
+}
+
+// MARK: - Setup
+/**
+ * Creates a pyramid, allocating all of its levels in a single buffer.
+ */
+image_pyramid_t *PyramidNew(pixel_format_t format, size_t width, size_t height, size_t levels) {
+    if(format != kPixelFormatF16 && format != kPixelFormatF32) {
+        return NULL;
+    }
+
+    // limit the levels to those that are at least a pixel in size
+    levels = MIN(levels, kPyramidMaxLevels);
+    while(levels && (!(width >> levels) || !(height >> levels))) {
+        levels--;
+    }
+    if(!levels) {
+        return NULL;
+    }
+
+    image_pyramid_t *pyramid = calloc(1, sizeof(image_pyramid_t));
+    if(!pyramid) return NULL;
+
+    pyramid->format = format;
+    pyramid->width = width;
+    pyramid->height = height;
+    pyramid->numLevels = levels;
+
+    // lay out the levels one after another
+    const pixel_layout_t proto = {
+        .format = format,
+        .channels = 4,
+        .order = kPixelChannelOrderRGB,
+    };
+    const size_t bpp = PixelLayoutBytesPerPixel(&proto);
+
+    size_t bytes = 0;
+    for(size_t i = 0; i < levels; i++) {
+        pyramid->levelWidth[i] = width >> (i + 1);
+        pyramid->levelHeight[i] = height >> (i + 1);
+
+        pyramid->levels[i] = proto;
+        pyramid->levels[i].stride = pyramid->levelWidth[i] * bpp;
+
+        bytes += pyramid->levels[i].stride * pyramid->levelHeight[i];
+    }
+
+    pyramid->buffer = malloc(bytes);
+    if(!pyramid->buffer) {
+        free(pyramid);
+        return NULL;
+    }
+
+    uint8_t *base = pyramid->buffer;
+    for(size_t i = 0; i < levels; i++) {
+        pyramid->levels[i].base = base;
+        base += pyramid->levels[i].stride * pyramid->levelHeight[i];
+    }
+
+    return pyramid;
+}
+
+/**
+ * Releases the pyramid and its levels.
+ */
+void PyramidRelease(image_pyramid_t *pyramid) {
+    if(!pyramid) return;
+
+    free(pyramid->buffer);
+    free(pyramid);
+}
+
+/**
+ * Gets the number of reduced levels.
+ */
+size_t PyramidNumLevels(const image_pyramid_t *pyramid) {
+    assert(pyramid);
+    return pyramid->numLevels;
+}
+
+/**
+ * Gets the alignment of bands: a line of the smallest level is made from this many full size lines.
+ */
+size_t PyramidLineAlignment(const image_pyramid_t *pyramid) {
+    assert(pyramid);
+    return ((size_t) 1) << pyramid->numLevels;
+}
+
+/**
+ * Describes the pixels of a level.
+ */
+int PyramidGetLevel(const image_pyramid_t *pyramid, size_t level, pixel_layout_t *outLayout, size_t *outWidth,
+                    size_t *outHeight) {
+    assert(pyramid);
+
+    if(!level || level > pyramid->numLevels) {
+        return -1;
+    }
+
+    if(outLayout) *outLayout = pyramid->levels[level - 1];
+    if(outWidth) *outWidth = pyramid->levelWidth[level - 1];
+    if(outHeight) *outHeight = pyramid->levelHeight[level - 1];
+
+    return 0;
+}
+
+// MARK: - Building
+/**
+ * Checks whether the levels can be built from the given image.
+ */
+int PyramidValidate(const image_pyramid_t *pyramid, const pixel_layout_t *src, size_t width, size_t height) {
+    assert(pyramid);
+    assert(src);
+
+    if(width != pyramid->width || height != pyramid->height) {
+        return -1;
+    }
+    if(!src->base || src->format != pyramid->format || src->channels != 4 ||
+       src->stride < (width * PixelLayoutBytesPerPixel(src))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Builds all levels of a band of full size lines, one chunk of lines at a time.
+ */
+int PyramidBuild(image_pyramid_t *pyramid, const pixel_layout_t *src, size_t firstLine, size_t numLines) {
+    assert(pyramid);
+    assert(src);
+
+    const size_t align = PyramidLineAlignment(pyramid);
+    const size_t lastLine = firstLine + numLines;
+
+    // validate the image and band
+    if(PyramidValidate(pyramid, src, pyramid->width, pyramid->height) != 0) {
+        return -1;
+    }
+    if(lastLine > pyramid->height || (firstLine % align) ||
+       ((numLines % align) && lastLine != pyramid->height)) {
+        return -1;
+    }
+
+    for(size_t chunk = firstLine; chunk < lastLine; chunk += align) {
+        const size_t chunkEnd = MIN(chunk + align, lastLine);
+        const pixel_layout_t *in = src;
+
+        for(size_t i = 0; i < pyramid->numLevels; i++) {
+            // the bottom of the image may leave a partial chunk; its last odd line is dropped
+            const size_t shift = i + 1;
+            const size_t first = chunk >> shift;
+            const size_t last = (chunkEnd == pyramid->height) ? pyramid->levelHeight[i] : (chunkEnd >> shift);
+
+            ReduceLines(pyramid->format, in, &pyramid->levels[i], pyramid->levelWidth[i], first, last);
+            in = &pyramid->levels[i];
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Builds all levels, in bands of at least `kMinBandLines` lines that are processed concurrently.
+ */
+int PyramidBuildImage(image_pyramid_t *pyramid, const pixel_layout_t *src) {
+    assert(pyramid);
+    assert(src);
+
+    const size_t align = PyramidLineAlignment(pyramid);
+
+    pyramid_bands_t info = {
+        .pyramid = pyramid,
+        .src = src,
+        .bandLines = ((kMinBandLines + align - 1) / align) * align,
+    };
+    atomic_init(&info.err, 0);
+
+    const size_t numBands = (pyramid->height + info.bandLines - 1) / info.bandLines;
+    dispatch_apply_f(numBands, DISPATCH_APPLY_AUTO, &info, BuildBand);
+
+    return atomic_load(&info.err);
+}
+
+/**
+ * Builds a single band of the image.
+ */
+static void BuildBand(void *ctx, size_t band) {
+    pyramid_bands_t *info = (pyramid_bands_t *) ctx;
+
+    const size_t first = band * info->bandLines;
+    const size_t last = MIN(first + info->bandLines, info->pyramid->height);
+
+    const int err = PyramidBuild(info->pyramid, info->src, first, last - first);
+    if(err != 0) {
+        atomic_store(&info->err, err);
+    }
+}
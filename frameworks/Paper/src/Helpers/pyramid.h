@@ -0,0 +1,103 @@
+//
+//  pyramid.h
+//  Paper (macOS)
+//
+//  Builds all the reduced size levels of an image (each half the size of the
+//  previous one) in a single pass over it, so downscaled versions of a decoded
+//  image are available without reading the full size image again.
+//
+//  Created by Tristan Seifert on 20200907.
+//
+
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pixel_layout.h"
+
+/// Largest number of reduced levels a pyramid can have
+#define kPyramidMaxLevels 12
+
+// forward declarations
+typedef struct image_pyramid image_pyramid_t;
+
+/**
+ * Creates a pyramid for an image of the given size, and allocates its levels.
+ *
+ * Level n (starting at 1) is reduced by a factor of 2^n in each dimension, rounding down; each of its pixels
+ * is the average of a 2x2 block of pixels of the previous level. Pixels have four components (the color
+ * components, plus alpha) in the given format.
+ *
+ * @param format Format of the components of both the image and its levels; either 16 or 32-bit floats
+ * @param width Width of the full size image
+ * @param height Height of the full size image
+ * @param levels Number of reduced levels; this is clamped to the number of levels at least a pixel in size
+ * @return Pyramid, or NULL if the arguments are invalid or memory couldn't be allocated
+ */
+image_pyramid_t *PyramidNew(pixel_format_t format, size_t width, size_t height, size_t levels);
+
+/**
+ * Releases a pyramid, along with the memory of its levels.
+ */
+void PyramidRelease(image_pyramid_t *pyramid);
+
+/**
+ * Gets the number of reduced levels of the pyramid.
+ */
+size_t PyramidNumLevels(const image_pyramid_t *pyramid);
+
+/**
+ * Gets the number of full size lines by which bands passed to `PyramidBuild` must be aligned: every level
+ * line of a band is then made from full size lines of the same band.
+ */
+size_t PyramidLineAlignment(const image_pyramid_t *pyramid);
+
+/**
+ * Describes the pixels of a level of the pyramid.
+ *
+ * @param level Level to get, starting at 1 for the first reduced level
+ * @param outLayout Layout of the level's pixels
+ * @param outWidth Width of the level, in pixels
+ * @param outHeight Height of the level, in pixels
+ * @return 0 on success, or -1 if there's no such level
+ */
+int PyramidGetLevel(const image_pyramid_t *pyramid, size_t level, pixel_layout_t *outLayout, size_t *outWidth,
+                    size_t *outHeight);
+
+/**
+ * Checks whether the pyramid's levels can be built from the given image.
+ *
+ * @param src Full size image
+ * @param width Width of the image
+ * @param height Height of the image
+ * @return 0 if the image matches the pyramid's size and format and has four components per pixel, -1 otherwise
+ */
+int PyramidValidate(const image_pyramid_t *pyramid, const pixel_layout_t *src, size_t width, size_t height);
+
+/**
+ * Builds the part of every level that's made from a band of lines of the full size image.
+ *
+ * The band is processed in chunks of as many lines as the alignment: all levels of a chunk are built before
+ * moving to the next, so the lines read by each level were just written and are still in the cache. Bands
+ * don't overlap in any of the levels, so several may be built at once, such as while an image is being
+ * decoded in bands.
+ *
+ * @param src Full size image; it must have four components per pixel, in the pyramid's format
+ * @param firstLine First line of the band; this must be a multiple of the alignment
+ * @param numLines Number of lines in the band; this must be a multiple of the alignment, unless the band
+ * ends at the bottom of the image
+ * @return 0 on success, or -1 if the image or band are invalid
+ */
+int PyramidBuild(image_pyramid_t *pyramid, const pixel_layout_t *src, size_t firstLine, size_t numLines);
+
+/**
+ * Builds all levels from the full size image, splitting it into bands that are built concurrently.
+ *
+ * @param src Full size image; it must have four components per pixel, in the pyramid's format
+ * @return 0 on success, or -1 if the image is invalid
+ */
+int PyramidBuildImage(image_pyramid_t *pyramid, const pixel_layout_t *src);
+
+#endif /* PYRAMID_H */
@@ -0,0 +1,586 @@
+//
+//  rawpack.c
+//  Paper (macOS)
+//
+//  Compact format for trimmed sensor data, which is much faster to decode than
+//  the lossless JPEG it came from.
+//
+//  Packed data starts with a header, followed by the caller's user info, the
+//  bit width of each block, and the offset of each band's blocks. Each block
+//  holds 128 residuals (zigzag encoded, so small negative differences have
+//  small values too) of the same width. Within a block, the residuals are
+//  split into eight lanes (one per position within a group of 8 consecutive
+//  values), and the bits of each lane are stored in its own stream of 16-bit
+//  words, interleaved with the other lanes. A single vector load then yields a
+//  word for each lane, and the same shifts extract a group of values from all
+//  of them; since residuals are relative to two lines up rather than to their
+//  neighbours, there's no dependency between values of the same line.
+//
+//  All values are stored in the byte order of the machine; caches aren't
+//  moved between machines.
+//
+//  Created by Tristan Seifert on 20200908.
+//
+
+#include "rawpack.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#include <dispatch/dispatch.h>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+/// Identifies packed sensor data ('PRAW')
+#define kRawPackMagic 0x57415250
+/// Current version of the format
+#define kRawPackVersion 1
+
+/// Number of values per group (and vector) in a block
+#define kGroupValues 8
+/// Number of groups in a block
+#define kBlockGroups (kRawPackBlockValues / kGroupValues)
+
+// MARK: Types
+/**
+ * Header at the start of packed data
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    /// Number of lines per band
+    uint16_t bandLines;
+
+    uint32_t width, height;
+    uint32_t vShift;
+    uint16_t blackLevel[4];
+
+    /// Number of bytes of user info following the header
+    uint32_t userInfoLength;
+    uint32_t reserved;
+
+    /// Number of bytes of packed blocks
+    uint64_t payloadLength;
+} rawpack_header_t;
+
+/**
+ * Positions of the sections of packed data, which follow from its size
+ */
+typedef struct {
+    size_t blocksPerLine, numBands;
+
+    /// Offset to the width table (a byte per block)
+    size_t widthsOffset;
+    /// Offset to the band table (a 64-bit payload offset for each band, plus the payload length)
+    size_t bandsOffset;
+    /// Offset to the first block; this is aligned to a vector
+    size_t payloadOffset;
+} rawpack_layout_t;
+
+/**
+ * State shared by the workers encoding or decoding bands
+ */
+typedef struct {
+    rawpack_layout_t layout;
+    size_t width, height;
+
+    /// Start of the packed data
+    uint8_t *packed;
+    /// Payload offset of each band, plus the payload length
+    uint64_t *bands;
+
+    /// Sensor data, and the number of values between the starts of its lines
+    uint16_t *values;
+    size_t stride;
+
+    /// Set if any of the bands failed
+    atomic_int err;
+} rawpack_bands_t;
+
+static void MeasureBand(void *ctx, size_t band);
+static void EncodeBand(void *ctx, size_t band);
+static void DecodeBand(void *ctx, size_t band);
+
+// MARK: - Kernels
+/**
+ * Calculates zigzag encoded residuals of up to a block of values, relative to the same values two lines up (or
+ * zero, if there is no such line.) Values past the end of the line get zero residuals.
+ *
+ * @return Number of bits needed for the largest of the residuals
+ */
+static unsigned BlockResiduals(const uint16_t *line, const uint16_t *pred, size_t count,
+                               uint16_t *z) {
+    uint32_t all = 0;
+
+    for(size_t i = 0; i < kRawPackBlockValues; i++) {
+        uint16_t res = 0;
+
+        if(i < count) {
+            const uint16_t d = (uint16_t) (line[i] - (pred ? pred[i] : 0));
+            res = (uint16_t) ((d << 1) ^ (uint16_t) -(d >> 15));
+        }
+
+        z[i] = res;
+        all |= res;
+    }
+
+    return all ? (32 - __builtin_clz(all)) : 0;
+}
+
+/**
+ * Packs a block of residuals with the given bit width into `bits` words for each lane.
+ */
+static void PackBlock(const uint16_t *z, unsigned bits, uint16_t *out) {
+    for(size_t lane = 0; lane < kGroupValues; lane++) {
+        uint32_t acc = 0;
+        unsigned filled = 0;
+        size_t word = 0;
+
+        for(size_t j = 0; j < kBlockGroups; j++) {
+            acc |= ((uint32_t) z[(j * kGroupValues) + lane]) << filled;
+            filled += bits;
+
+            if(filled >= 16) {
+                out[(word++ * kGroupValues) + lane] = (uint16_t) acc;
+                acc >>= 16;
+                filled -= 16;
+            }
+        }
+    }
+}
+
+/**
+ * Unpacks a block of residuals with the given bit width. Group j of the block starts at bit j * bits of each
+ * lane's words, and may continue into the next word.
+ */
+static void UnpackBlock(const uint16_t *in, unsigned bits, uint16_t *z) {
+    if(!bits) {
+        memset(z, 0, kRawPackBlockValues * sizeof(uint16_t));
+        return;
+    }
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    const uint16x8_t mask = vdupq_n_u16((uint16_t) ((1u << bits) - 1));
+
+    for(unsigned j = 0; j < kBlockGroups; j++) {
+        const unsigned bit = j * bits, word = bit >> 4, shift = bit & 15;
+
+        uint16x8_t v = vshlq_u16(vld1q_u16(in + (word * kGroupValues)), vdupq_n_s16(-(int16_t) shift));
+        if((shift + bits) > 16) {
+            const uint16x8_t next = vld1q_u16(in + ((word + 1) * kGroupValues));
+            v = vorrq_u16(v, vshlq_u16(next, vdupq_n_s16((int16_t) (16 - shift))));
+        }
+
+        vst1q_u16(z + (j * kGroupValues), vandq_u16(v, mask));
+    }
+#elif defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi16((int16_t) ((1u << bits) - 1));
+
+    for(unsigned j = 0; j < kBlockGroups; j++) {
+        const unsigned bit = j * bits, word = bit >> 4, shift = bit & 15;
+
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + (word * kGroupValues)));
+        v = _mm_srl_epi16(v, _mm_cvtsi32_si128((int) shift));
+        if((shift + bits) > 16) {
+            const __m128i next = _mm_loadu_si128((const __m128i *) (in + ((word + 1) * kGroupValues)));
+            v = _mm_or_si128(v, _mm_sll_epi16(next, _mm_cvtsi32_si128((int) (16 - shift))));
+        }
+
+        _mm_storeu_si128((__m128i *) (z + (j * kGroupValues)), _mm_and_si128(v, mask));
+    }
+#else
+    const uint32_t mask = (1u << bits) - 1;
+
+    for(size_t lane = 0; lane < kGroupValues; lane++) {
+        for(unsigned j = 0; j < kBlockGroups; j++) {
+            const unsigned bit = j * bits, word = bit >> 4, shift = bit & 15;
+
+            uint32_t v = in[(word * kGroupValues) + lane] >> shift;
+            if((shift + bits) > 16) {
+                v |= ((uint32_t) in[((word + 1) * kGroupValues) + lane]) << (16 - shift);
+            }
+
+            z[(j * kGroupValues) + lane] = (uint16_t) (v & mask);
+        }
+    }
+#endif
+}
+
+/**
+ * Reconstructs values from their zigzag encoded residuals, relative to the same values two lines up (if any.)
+ */
+static void ApplyResiduals(const uint16_t *z, const uint16_t *pred, uint16_t *out, size_t count) {
+    size_t i = 0;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    const uint16x8_t one = vdupq_n_u16(1);
+
+    for(; (i + kGroupValues) <= count; i += kGroupValues) {
+        const uint16x8_t v = vld1q_u16(z + i);
+        uint16x8_t res = veorq_u16(vshrq_n_u16(v, 1), vtstq_u16(v, one));
+
+        if(pred) {
+            res = vaddq_u16(res, vld1q_u16(pred + i));
+        }
+        vst1q_u16(out + i, res);
+    }
+#elif defined(__SSE2__)
+    const __m128i one = _mm_set1_epi16(1), zero = _mm_setzero_si128();
+
+    for(; (i + kGroupValues) <= count; i += kGroupValues) {
+        const __m128i v = _mm_loadu_si128((const __m128i *) (z + i));
+        __m128i res = _mm_xor_si128(_mm_srli_epi16(v, 1), _mm_sub_epi16(zero, _mm_and_si128(v, one)));
+
+        if(pred) {
+            res = _mm_add_epi16(res, _mm_loadu_si128((const __m128i *) (pred + i)));
+        }
+        _mm_storeu_si128((__m128i *) (out + i), res);
+    }
+#endif
+
+    for(; i < count; i++) {
+        const uint16_t d = (uint16_t) ((z[i] >> 1) ^ (uint16_t) -(z[i] & 1));
+        out[i] = (uint16_t) (d + (pred ? pred[i] : 0));
+    }
+}
+
+// MARK: - Layout
+/**
+ * Determines where the sections of packed data of the given size are.
+ *
+ * @return 0 on success, -1 if the size is invalid
+ */
+static int GetLayout(size_t width, size_t height, size_t userInfoLength, rawpack_layout_t *out) {
+    if(!width || !height || width > UINT32_MAX || height > UINT32_MAX || userInfoLength > UINT32_MAX) {
+        return -1;
+    }
+
+    out->blocksPerLine = (width + kRawPackBlockValues - 1) / kRawPackBlockValues;
+    out->numBands = (height + kRawPackBandLines - 1) / kRawPackBandLines;
+
+    out->widthsOffset = sizeof(rawpack_header_t) + userInfoLength;
+    out->bandsOffset = (out->widthsOffset + (out->blocksPerLine * height) + 7) & ~((size_t) 7);
+    out->payloadOffset = (out->bandsOffset + ((out->numBands + 1) * sizeof(uint64_t)) + 15) & ~((size_t) 15);
+
+    return 0;
+}
+
+/**
+ * Gets the lines of a band.
+ */
+static void GetBandLines(const rawpack_bands_t *info, size_t band, size_t *first, size_t *last) {
+    *first = band * kRawPackBandLines;
+    *last = MIN(*first + kRawPackBandLines, info->height);
+}
+
+// MARK: - Encoding
+/**
+ * Gets the worst case size: every block needs the full 16 bits per value.
+ */
+size_t RawPackMaxLength(const rawpack_info_t *info) {
+    assert(info);
+
+    rawpack_layout_t layout;
+    if(GetLayout(info->width, info->height, info->userInfoLength, &layout) != 0) {
+        return 0;
+    }
+
+    return layout.payloadOffset + (layout.blocksPerLine * info->height * kRawPackBlockValues * sizeof(uint16_t));
+}
+
+/**
+ * Packs sensor data in two passes over each band, which run concurrently: the first determines the widths of
+ * its blocks (and thus where each band starts), the second packs them.
+ */
+int RawPackEncode(const uint16_t *in, size_t bytesPerRow, const rawpack_info_t *info, void *out,
+                  size_t outLength, size_t *outWritten) {
+    assert(in);
+    assert(info);
+    assert(out);
+
+    rawpack_bands_t bands = {
+        .width = info->width,
+        .height = info->height,
+        .packed = out,
+        .values = (uint16_t *) in,
+        .stride = bytesPerRow / sizeof(uint16_t),
+    };
+    atomic_init(&bands.err, 0);
+
+    // validate the input
+    if(GetLayout(info->width, info->height, info->userInfoLength, &bands.layout) != 0) {
+        return -1;
+    }
+    if(info->vShift > 1 || (bytesPerRow % sizeof(uint16_t)) || bands.stride < info->width ||
+       (info->userInfoLength && !info->userInfo) || outLength < bands.layout.payloadOffset) {
+        return -1;
+    }
+
+    const size_t numBands = bands.layout.numBands;
+    bands.bands = calloc(numBands + 1, sizeof(uint64_t));
+    if(!bands.bands) return -1;
+
+    // find the widths of all blocks, then lay out the bands one after another
+    dispatch_apply_f(numBands, DISPATCH_APPLY_AUTO, &bands, MeasureBand);
+
+    uint64_t payloadLength = 0;
+    for(size_t i = 0; i < numBands; i++) {
+        const uint64_t bandLength = bands.bands[i];
+        bands.bands[i] = payloadLength;
+        payloadLength += bandLength;
+    }
+    bands.bands[numBands] = payloadLength;
+
+    if(outLength < (bands.layout.payloadOffset + payloadLength)) {
+        free(bands.bands);
+        return -1;
+    }
+
+    dispatch_apply_f(numBands, DISPATCH_APPLY_AUTO, &bands, EncodeBand);
+
+    // write the header, user info and band table
+    rawpack_header_t header = {
+        .magic = kRawPackMagic,
+        .version = kRawPackVersion,
+        .bandLines = kRawPackBandLines,
+        .width = (uint32_t) info->width,
+        .height = (uint32_t) info->height,
+        .vShift = (uint32_t) info->vShift,
+        .userInfoLength = (uint32_t) info->userInfoLength,
+        .payloadLength = payloadLength,
+    };
+    memcpy(header.blackLevel, info->blackLevel, sizeof(header.blackLevel));
+
+    const rawpack_layout_t *layout = &bands.layout;
+    const size_t widthsEnd = layout->widthsOffset + (layout->blocksPerLine * info->height);
+    const size_t bandsEnd = layout->bandsOffset + ((numBands + 1) * sizeof(uint64_t));
+
+    uint8_t *packed = out;
+    memcpy(packed, &header, sizeof(header));
+    if(info->userInfoLength) {
+        memcpy(packed + sizeof(header), info->userInfo, info->userInfoLength);
+    }
+
+    memset(packed + widthsEnd, 0, layout->bandsOffset - widthsEnd);
+    memcpy(packed + layout->bandsOffset, bands.bands, (numBands + 1) * sizeof(uint64_t));
+    memset(packed + bandsEnd, 0, layout->payloadOffset - bandsEnd);
+
+    free(bands.bands);
+
+    if(outWritten) {
+        *outWritten = bands.layout.payloadOffset + payloadLength;
+    }
+    return 0;
+}
+
+/**
+ * Determines the widths of the blocks of a band, and the number of bytes they take up.
+ */
+static void MeasureBand(void *ctx, size_t band) {
+    rawpack_bands_t *info = (rawpack_bands_t *) ctx;
+    const size_t blocks = info->layout.blocksPerLine;
+
+    size_t first, last;
+    GetBandLines(info, band, &first, &last);
+
+    uint8_t *widths = info->packed + info->layout.widthsOffset;
+    uint16_t z[kRawPackBlockValues];
+    uint64_t bytes = 0;
+
+    for(size_t line = first; line < last; line++) {
+        const uint16_t *row = info->values + (line * info->stride);
+        const uint16_t *pred = ((line - first) >= 2) ? (row - (2 * info->stride)) : NULL;
+
+        for(size_t b = 0; b < blocks; b++) {
+            const size_t x = b * kRawPackBlockValues;
+            const unsigned bits = BlockResiduals(row + x, pred ? (pred + x) : NULL,
+                                                 MIN(kRawPackBlockValues, info->width - x), z);
+
+            widths[(line * blocks) + b] = (uint8_t) bits;
+            bytes += bits * kGroupValues * sizeof(uint16_t);
+        }
+    }
+
+    // the band table holds each band's length until the bands are laid out
+    info->bands[band] = bytes;
+}
+
+/**
+ * Packs the blocks of a band.
+ */
+static void EncodeBand(void *ctx, size_t band) {
+    rawpack_bands_t *info = (rawpack_bands_t *) ctx;
+    const size_t blocks = info->layout.blocksPerLine;
+
+    size_t first, last;
+    GetBandLines(info, band, &first, &last);
+
+    const uint8_t *widths = info->packed + info->layout.widthsOffset;
+    uint8_t *payload = info->packed + info->layout.payloadOffset + info->bands[band];
+    uint16_t z[kRawPackBlockValues];
+
+    for(size_t line = first; line < last; line++) {
+        const uint16_t *row = info->values + (line * info->stride);
+        const uint16_t *pred = ((line - first) >= 2) ? (row - (2 * info->stride)) : NULL;
+
+        for(size_t b = 0; b < blocks; b++) {
+            const size_t x = b * kRawPackBlockValues;
+            const unsigned bits = BlockResiduals(row + x, pred ? (pred + x) : NULL,
+                                                 MIN(kRawPackBlockValues, info->width - x), z);
+            assert(bits == widths[(line * blocks) + b]);
+
+            PackBlock(z, bits, (uint16_t *) payload);
+            payload += bits * kGroupValues * sizeof(uint16_t);
+        }
+    }
+}
+
+// MARK: - Decoding
+/**
+ * Reads and validates the header of packed data.
+ */
+static int ReadHeader(const void *in, size_t inLength, rawpack_header_t *outHeader, rawpack_layout_t *outLayout) {
+    if(inLength < sizeof(rawpack_header_t)) {
+        return -1;
+    }
+
+    memcpy(outHeader, in, sizeof(rawpack_header_t));
+
+    if(outHeader->magic != kRawPackMagic || outHeader->version != kRawPackVersion ||
+       outHeader->bandLines != kRawPackBandLines || outHeader->vShift > 1) {
+        return -1;
+    }
+    if(GetLayout(outHeader->width, outHeader->height, outHeader->userInfoLength, outLayout) != 0) {
+        return -1;
+    }
+    if(inLength < outLayout->payloadOffset || (inLength - outLayout->payloadOffset) < outHeader->payloadLength) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the info from the header of packed data.
+ */
+int RawPackReadInfo(const void *in, size_t inLength, rawpack_info_t *outInfo) {
+    assert(in);
+    assert(outInfo);
+
+    rawpack_header_t header;
+    rawpack_layout_t layout;
+    if(ReadHeader(in, inLength, &header, &layout) != 0) {
+        return -1;
+    }
+
+    outInfo->width = header.width;
+    outInfo->height = header.height;
+    outInfo->vShift = header.vShift;
+    memcpy(outInfo->blackLevel, header.blackLevel, sizeof(header.blackLevel));
+
+    outInfo->userInfoLength = header.userInfoLength;
+    outInfo->userInfo = header.userInfoLength ? (((const uint8_t *) in) + sizeof(rawpack_header_t)) : NULL;
+
+    return 0;
+}
+
+/**
+ * Unpacks all bands concurrently, after checking the band table is consistent.
+ */
+int RawPackDecode(const void *in, size_t inLength, uint16_t *out, size_t bytesPerRow) {
+    assert(in);
+    assert(out);
+
+    rawpack_header_t header;
+    rawpack_bands_t bands = {
+        .packed = (uint8_t *) in,
+        .values = out,
+        .stride = bytesPerRow / sizeof(uint16_t),
+    };
+    atomic_init(&bands.err, 0);
+
+    if(ReadHeader(in, inLength, &header, &bands.layout) != 0) {
+        return -1;
+    }
+    bands.width = header.width;
+    bands.height = header.height;
+
+    // blocks are read as 16-bit words
+    if(((uintptr_t) in) & 1 || (bytesPerRow % sizeof(uint16_t)) || bands.stride < bands.width) {
+        return -1;
+    }
+
+    // the bands must follow each other, and end with the payload
+    const size_t numBands = bands.layout.numBands;
+    bands.bands = malloc((numBands + 1) * sizeof(uint64_t));
+    if(!bands.bands) return -1;
+
+    memcpy(bands.bands, bands.packed + bands.layout.bandsOffset, (numBands + 1) * sizeof(uint64_t));
+
+    bool valid = (bands.bands[0] == 0) && (bands.bands[numBands] == header.payloadLength);
+    for(size_t i = 0; valid && i < numBands; i++) {
+        valid = (bands.bands[i] <= bands.bands[i + 1]);
+    }
+
+    if(valid) {
+        dispatch_apply_f(numBands, DISPATCH_APPLY_AUTO, &bands, DecodeBand);
+    }
+
+    free(bands.bands);
+    return valid ? atomic_load(&bands.err) : -1;
+}
+
+/**
+ * Unpacks the blocks of a band, checking that they exactly fill the band's part of the payload.
+ */
+static void DecodeBand(void *ctx, size_t band) {
+    rawpack_bands_t *info = (rawpack_bands_t *) ctx;
+    const size_t blocks = info->layout.blocksPerLine;
+
+    size_t first, last;
+    GetBandLines(info, band, &first, &last);
+
+    const uint8_t *widths = info->packed + info->layout.widthsOffset;
+    const uint8_t *payload = info->packed + info->layout.payloadOffset;
+    uint64_t offset = info->bands[band];
+    const uint64_t end = info->bands[band + 1];
+
+    uint16_t z[kRawPackBlockValues];
+
+    for(size_t line = first; line < last; line++) {
+        uint16_t *row = info->values + (line * info->stride);
+        const uint16_t *pred = ((line - first) >= 2) ? (row - (2 * info->stride)) : NULL;
+
+        for(size_t b = 0; b < blocks; b++) {
+            const unsigned bits = widths[(line * blocks) + b];
+            const uint64_t bytes = bits * kGroupValues * sizeof(uint16_t);
+
+            if(bits > 16 || (end - offset) < bytes) {
+                atomic_store(&info->err, -1);
+                return;
+            }
+
+            const size_t x = b * kRawPackBlockValues;
+            UnpackBlock((const uint16_t *) (payload + offset), bits, z);
+            ApplyResiduals(z, pred ? (pred + x) : NULL, row + x, MIN(kRawPackBlockValues, info->width - x));
+
+            offset += bytes;
+        }
+    }
+
+    if(offset != end) {
+        atomic_store(&info->err, -1);
+    }
+}
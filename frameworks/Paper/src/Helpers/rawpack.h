@@ -0,0 +1,89 @@
+//
+//  rawpack.h
+//  Paper (macOS)
+//
+//  Compact format for trimmed sensor data, which is much faster to decode than
+//  the lossless JPEG it came from: each value is stored as the difference to
+//  the value of the same color two lines up, and these are bit packed in
+//  blocks with a fixed width each. It's used to cache decoded raw data on disk.
+//
+//  Created by Tristan Seifert on 20200908.
+//
+
+#ifndef RAWPACK_H
+#define RAWPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Number of consecutive values of a line packed together with the same width. They are stored as 16 groups of
+ * 8 values, so a group is exactly one vector.
+ */
+#define kRawPackBlockValues 128
+
+/**
+ * Number of lines in each band; bands are encoded and decoded independently of each other, and concurrently.
+ */
+#define kRawPackBandLines 64
+
+/**
+ * Describes packed sensor data
+ */
+typedef struct rawpack_info {
+    /// Size of the sensor data, in pixels
+    size_t width, height;
+    /// Vertical shift of the Bayer pattern
+    size_t vShift;
+    /// Black levels, for each CFA index
+    uint16_t blackLevel[4];
+
+    /// Arbitrary data stored along with the sensor data; when reading, this points into the packed data
+    const void *userInfo;
+    /// Number of bytes of user info
+    size_t userInfoLength;
+} rawpack_info_t;
+
+/**
+ * Gets the largest number of bytes that sensor data with the given info can be packed into.
+ *
+ * @return Number of bytes, or 0 if the info is invalid
+ */
+size_t RawPackMaxLength(const rawpack_info_t *info);
+
+/**
+ * Packs sensor data.
+ *
+ * @param in Sensor data, one value per pixel
+ * @param bytesPerRow Number of bytes between the starts of consecutive lines of the sensor data
+ * @param info Size of the sensor data, and other info to store with it
+ * @param out Buffer to write the packed data into
+ * @param outLength Number of bytes available in the buffer; this should be at least `RawPackMaxLength`
+ * @param outWritten Number of bytes of packed data written
+ * @return 0 on success, -1 if the info is invalid or the buffer too small
+ */
+int RawPackEncode(const uint16_t *in, size_t bytesPerRow, const rawpack_info_t *info, void *out,
+                  size_t outLength, size_t *outWritten);
+
+/**
+ * Reads the info of packed sensor data.
+ *
+ * @param in Packed data
+ * @param inLength Number of bytes of packed data
+ * @param outInfo Info read from the packed data
+ * @return 0 on success, -1 if the data isn't valid packed sensor data
+ */
+int RawPackReadInfo(const void *in, size_t inLength, rawpack_info_t *outInfo);
+
+/**
+ * Unpacks sensor data.
+ *
+ * @param in Packed data, such as a memory mapped file
+ * @param inLength Number of bytes of packed data
+ * @param out Buffer for the sensor data; it must be large enough to hold all lines
+ * @param bytesPerRow Number of bytes between the starts of consecutive lines in the output buffer
+ * @return 0 on success, -1 if the packed data is invalid or truncated
+ */
+int RawPackDecode(const void *in, size_t inLength, uint16_t *out, size_t bytesPerRow);
+
+#endif /* RAWPACK_H */
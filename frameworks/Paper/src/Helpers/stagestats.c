@@ -0,0 +1,307 @@
+//
+//  stagestats.c
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200910.
+//
+
+#include "stagestats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <dispatch/dispatch.h>
+#include <os/log.h>
+#include <os/signpost.h>
+
+/**
+ * Values of a single stage
+ */
+typedef struct stage_values {
+    _Atomic(uint64_t) intervals;
+    _Atomic(uint64_t) nanos;
+    _Atomic(uint64_t) bytes;
+} stage_values_t;
+
+/**
+ * Stats of a decode; all values may be updated from several threads at once
+ */
+struct stage_stats {
+    stage_values_t stages[kStageCount];
+    _Atomic(uint64_t) counters[kStageCounterCount];
+
+    /// Start of the first and end of the last interval, or 0 if there hasn't been one yet
+    _Atomic(uint64_t) firstStart, lastEnd;
+
+    /// First error recorded, and the stage that raised it
+    atomic_int error;
+    atomic_int errorStage;
+};
+
+static os_log_t StageLog(void);
+static void AtomicMin(_Atomic(uint64_t) *value, uint64_t candidate);
+static void AtomicMax(_Atomic(uint64_t) *value, uint64_t candidate);
+
+// MARK: - Setup
+/**
+ * Allocates a stats object with all values cleared.
+ */
+stage_stats_t *StageStatsNew(void) {
+    stage_stats_t *stats = malloc(sizeof(stage_stats_t));
+    if(!stats) return NULL;
+
+    StageStatsReset(stats);
+    return stats;
+}
+
+/**
+ * Releases a stats object.
+ */
+void StageStatsRelease(stage_stats_t *stats) {
+    free(stats);
+}
+
+/**
+ * Clears all values of the stats.
+ */
+void StageStatsReset(stage_stats_t *stats) {
+    assert(stats);
+
+    for(size_t i = 0; i < kStageCount; i++) {
+        atomic_init(&stats->stages[i].intervals, 0);
+        atomic_init(&stats->stages[i].nanos, 0);
+        atomic_init(&stats->stages[i].bytes, 0);
+    }
+    for(size_t i = 0; i < kStageCounterCount; i++) {
+        atomic_init(&stats->counters[i], 0);
+    }
+
+    atomic_init(&stats->firstStart, 0);
+    atomic_init(&stats->lastEnd, 0);
+    atomic_init(&stats->error, 0);
+    atomic_init(&stats->errorStage, 0);
+}
+
+// MARK: - Signposts
+/**
+ * Creates the log the stage signposts are emitted on.
+ */
+static void CreateLog(void *ctx) {
+    *((os_log_t *) ctx) = os_log_create("me.tseifert.smokeshed.paper", "stages");
+}
+
+/**
+ * Gets the log the stage signposts are emitted on.
+ */
+static os_log_t StageLog(void) {
+    static dispatch_once_t once;
+    static os_log_t log;
+
+    dispatch_once_f(&once, &log, CreateLog);
+    return log;
+}
+
+/**
+ * Begins or ends (depending on `kind`) the signpost interval of a stage; signpost names must be string
+ * literals, so each stage needs its own invocation.
+ */
+#define STAGE_SIGNPOST(kind, log, id, stage) \
+    switch(stage) { \
+        case kStageDecompress: \
+            os_signpost_interval_##kind(log, id, "Decompress"); \
+            break; \
+        case kStageUnslice: \
+            os_signpost_interval_##kind(log, id, "Unslice"); \
+            break; \
+        case kStageRawStats: \
+            os_signpost_interval_##kind(log, id, "Raw Stats"); \
+            break; \
+        case kStageTrim: \
+            os_signpost_interval_##kind(log, id, "Trim"); \
+            break; \
+        case kStageWhiteBalance: \
+            os_signpost_interval_##kind(log, id, "White Balance"); \
+            break; \
+        case kStageDemosaic: \
+            os_signpost_interval_##kind(log, id, "Demosaic"); \
+            break; \
+        case kStageColorConvert: \
+            os_signpost_interval_##kind(log, id, "Color Convert"); \
+            break; \
+    }
+
+// MARK: - Recording
+/**
+ * Gets the current time, in nanoseconds.
+ */
+uint64_t StageTime(void) {
+    return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+/**
+ * Starts timing a stage. Signposts get an identifier of their own, since bands of the same stage may be in
+ * flight on several threads at once.
+ */
+stage_interval_t StageBegin(stage_stats_t *stats, stage_t stage) {
+    stage_interval_t interval = {
+        .stage = stage, .start = 0, .signpost = OS_SIGNPOST_ID_NULL,
+    };
+
+    if(!stats) {
+        return interval;
+    }
+
+    os_log_t log = StageLog();
+
+    if(os_signpost_enabled(log)) {
+        interval.signpost = os_signpost_id_generate(log);
+        STAGE_SIGNPOST(begin, log, interval.signpost, stage);
+    }
+
+    interval.start = StageTime();
+    return interval;
+}
+
+/**
+ * Stops timing a stage, and adds its duration and the bytes it produced to the stats.
+ */
+void StageEnd(stage_stats_t *stats, const stage_interval_t *interval, uint64_t bytes) {
+    assert(interval);
+
+    if(!stats) {
+        return;
+    }
+
+    const uint64_t end = StageTime();
+    stage_values_t *values = &stats->stages[interval->stage];
+
+    atomic_fetch_add_explicit(&values->intervals, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&values->nanos, end - interval->start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&values->bytes, bytes, memory_order_relaxed);
+
+    AtomicMin(&stats->firstStart, interval->start);
+    AtomicMax(&stats->lastEnd, end);
+
+    if(interval->signpost != OS_SIGNPOST_ID_NULL) {
+        os_log_t log = StageLog();
+        STAGE_SIGNPOST(end, log, interval->signpost, interval->stage);
+    }
+}
+
+/**
+ * Adds to a counter; the largest allocation is kept as a maximum instead.
+ */
+void StageCount(stage_stats_t *stats, stage_counter_t counter, uint64_t value) {
+    if(!stats || !value) {
+        return;
+    }
+
+    if(counter == kStageCounterLargestAllocation) {
+        AtomicMax(&stats->counters[counter], value);
+    } else {
+        atomic_fetch_add_explicit(&stats->counters[counter], value, memory_order_relaxed);
+    }
+}
+
+/**
+ * Records a buffer requested by a kernel.
+ */
+void StageCountAllocation(stage_stats_t *stats, size_t bytes) {
+    StageCount(stats, kStageCounterAllocations, 1);
+    StageCount(stats, kStageCounterAllocatedBytes, bytes);
+    StageCount(stats, kStageCounterLargestAllocation, bytes);
+}
+
+/**
+ * Records an error, unless one was recorded before.
+ */
+void StageFail(stage_stats_t *stats, stage_t stage, int error) {
+    int expected = 0;
+
+    if(!stats || !error) {
+        return;
+    }
+
+    // the stage is written after the error, so readers must wait for all stages to complete
+    if(atomic_compare_exchange_strong(&stats->error, &expected, error)) {
+        atomic_store(&stats->errorStage, stage);
+    }
+}
+
+// MARK: - Reading
+/**
+ * Gets the values of a stage.
+ */
+void StageStatsGetSummary(const stage_stats_t *stats, stage_t stage, stage_summary_t *outSummary) {
+    assert(stats);
+    assert(outSummary);
+    assert(stage < kStageCount);
+
+    stage_values_t *values = (stage_values_t *) &stats->stages[stage];
+
+    outSummary->intervals = atomic_load_explicit(&values->intervals, memory_order_relaxed);
+    outSummary->nanos = atomic_load_explicit(&values->nanos, memory_order_relaxed);
+    outSummary->bytes = atomic_load_explicit(&values->bytes, memory_order_relaxed);
+}
+
+/**
+ * Gets the value of a counter.
+ */
+uint64_t StageStatsGetCounter(const stage_stats_t *stats, stage_counter_t counter) {
+    assert(stats);
+    assert(counter < kStageCounterCount);
+
+    return atomic_load_explicit((_Atomic(uint64_t) *) &stats->counters[counter], memory_order_relaxed);
+}
+
+/**
+ * Gets the time between the start of the first and the end of the last interval.
+ */
+uint64_t StageStatsGetElapsed(const stage_stats_t *stats) {
+    assert(stats);
+
+    const uint64_t first = atomic_load((_Atomic(uint64_t) *) &stats->firstStart);
+    const uint64_t last = atomic_load((_Atomic(uint64_t) *) &stats->lastEnd);
+
+    return (first && last > first) ? (last - first) : 0;
+}
+
+/**
+ * Gets the first error recorded.
+ */
+int StageStatsGetError(const stage_stats_t *stats, stage_t *outStage) {
+    assert(stats);
+
+    const int error = atomic_load((atomic_int *) &stats->error);
+
+    if(error && outStage) {
+        *outStage = (stage_t) atomic_load((atomic_int *) &stats->errorStage);
+    }
+    return error;
+}
+
+// MARK: - Helpers
+/**
+ * Replaces the value with the candidate if it's smaller, or if the value is still unset (0).
+ */
+static void AtomicMin(_Atomic(uint64_t) *value, uint64_t candidate) {
+    uint64_t current = atomic_load_explicit(value, memory_order_relaxed);
+
+    while((!current || candidate < current) &&
+          !atomic_compare_exchange_weak_explicit(value, &current, candidate, memory_order_relaxed,
+                                                 memory_order_relaxed)) {}
+}
+
+/**
+ * Replaces the value with the candidate if it's larger.
+ */
+static void AtomicMax(_Atomic(uint64_t) *value, uint64_t candidate) {
+    uint64_t current = atomic_load_explicit(value, memory_order_relaxed);
+
+    while(candidate > current &&
+          !atomic_compare_exchange_weak_explicit(value, &current, candidate, memory_order_relaxed,
+                                                 memory_order_relaxed)) {}
+}
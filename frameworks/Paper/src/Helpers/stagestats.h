@@ -0,0 +1,173 @@
+//
+//  stagestats.h
+//  Paper (macOS)
+//
+//  Records where the time of a decode goes: the C kernels time each of their
+//  stages, count the bytes they produce and some events of interest, and mark
+//  each stage as an os_signpost interval so it shows up in Instruments.
+//
+//  Created by Tristan Seifert on 20200910.
+//
+
+#ifndef STAGESTATS_H
+#define STAGESTATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <os/signpost.h>
+
+/**
+ * Stages of decoding and developing raw sensor data
+ */
+typedef enum stage {
+    /// Lossless JPEG decompression
+    kStageDecompress = 0,
+    /// Reassembling the slices of a CR2 image into the sensor layout
+    kStageUnslice = 1,
+    /// Collecting the raw histogram, black levels and Bayer shift; when the image is trimmed in the same pass,
+    /// that's included as well
+    kStageRawStats = 2,
+    /// Copying the visible area of the sensor data
+    kStageTrim = 3,
+    /// Black level subtraction and white balance scaling
+    kStageWhiteBalance = 4,
+    /// Interpolating or binning the CFA; binned output is color converted as it's binned, which is included too
+    kStageDemosaic = 5,
+    /// Conversion to the working color space and the output format
+    kStageColorConvert = 6,
+} stage_t;
+
+/// Number of stages
+#define kStageCount 7
+
+/**
+ * Events counted while decoding
+ */
+typedef enum stage_counter {
+    /// Bit buffer refills that read the entropy coded data a byte at a time, checking for markers, rather than
+    /// loading from the unstuffed copy of the scan
+    kStageCounterSlowRefills = 0,
+    /// Huffman codes that weren't resolved by a single lookup table probe, and were instead looked up in the
+    /// canonical code ranges
+    kStageCounterTreeWalks = 1,
+    /// Number of buffers requested by the kernels, from a pool or the system
+    kStageCounterAllocations = 2,
+    /// Total size of those buffers, in bytes
+    kStageCounterAllocatedBytes = 3,
+    /// Size of the largest of them, in bytes
+    kStageCounterLargestAllocation = 4,
+} stage_counter_t;
+
+/// Number of counters
+#define kStageCounterCount 5
+
+// forward declarations
+typedef struct stage_stats stage_stats_t;
+
+/**
+ * A stage that's being timed
+ */
+typedef struct stage_interval {
+    /// Stage being timed
+    stage_t stage;
+    /// When it started, in nanoseconds
+    uint64_t start;
+    /// Signpost of the interval, or OS_SIGNPOST_ID_NULL when signposts are disabled
+    os_signpost_id_t signpost;
+} stage_interval_t;
+
+/**
+ * Summary of the time spent in a stage
+ */
+typedef struct stage_summary {
+    /// Number of intervals recorded for the stage
+    uint64_t intervals;
+    /// Total duration of those intervals, in nanoseconds. Stages that run in concurrent bands record each band,
+    /// so this is the processor time spent in them, and may exceed the elapsed time of the decode.
+    uint64_t nanos;
+    /// Number of bytes produced by the stage
+    uint64_t bytes;
+} stage_summary_t;
+
+/**
+ * Allocates a stats object with all values cleared.
+ *
+ * @return Stats, or NULL if memory couldn't be allocated
+ */
+stage_stats_t *StageStatsNew(void);
+
+/**
+ * Releases a stats object. It must no longer be referenced by any kernel.
+ */
+void StageStatsRelease(stage_stats_t *stats);
+
+/**
+ * Clears all values of the stats, so it can be used for another decode. No stages may be running.
+ */
+void StageStatsReset(stage_stats_t *stats);
+
+/**
+ * Gets the current time, in nanoseconds, for timing stages.
+ */
+uint64_t StageTime(void);
+
+/**
+ * Starts timing a stage, and begins its signpost interval.
+ *
+ * All functions that take stats accept NULL, in which case nothing is recorded and no signposts are emitted;
+ * the kernels then don't pay for reading the clock.
+ */
+stage_interval_t StageBegin(stage_stats_t *stats, stage_t stage);
+
+/**
+ * Stops timing a stage, and ends its signpost interval. This may be called from a different thread than the
+ * one that began the interval.
+ *
+ * @param bytes Number of bytes produced by the stage during the interval
+ */
+void StageEnd(stage_stats_t *stats, const stage_interval_t *interval, uint64_t bytes);
+
+/**
+ * Adds an event count to a counter. This is meant to be called once per call into a kernel, with the events
+ * it counted locally; for the largest allocation counter, the value replaces the current one if it's larger.
+ */
+void StageCount(stage_stats_t *stats, stage_counter_t counter, uint64_t value);
+
+/**
+ * Records a buffer requested by a kernel in all of the allocation counters.
+ */
+void StageCountAllocation(stage_stats_t *stats, size_t bytes);
+
+/**
+ * Records an error raised by a stage. Only the first error is kept.
+ *
+ * @param error Nonzero error code; its meaning depends on the stage
+ */
+void StageFail(stage_stats_t *stats, stage_t stage, int error);
+
+/**
+ * Gets the time spent in a stage, and the number of bytes it produced.
+ */
+void StageStatsGetSummary(const stage_stats_t *stats, stage_t stage, stage_summary_t *outSummary);
+
+/**
+ * Gets the value of a counter.
+ */
+uint64_t StageStatsGetCounter(const stage_stats_t *stats, stage_counter_t counter);
+
+/**
+ * Gets the time from the start of the first interval to the end of the last one, in nanoseconds; this is the
+ * elapsed time of the decode.
+ */
+uint64_t StageStatsGetElapsed(const stage_stats_t *stats);
+
+/**
+ * Gets the first error recorded.
+ *
+ * @param outStage Stage that raised the error; only set if there was one
+ * @return Error code, or 0 if no stage failed
+ */
+int StageStatsGetError(const stage_stats_t *stats, stage_t *outStage);
+
+#endif /* STAGESTATS_H */
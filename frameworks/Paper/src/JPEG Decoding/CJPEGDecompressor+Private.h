@@ -16,7 +16,10 @@ NS_ASSUME_NONNULL_BEGIN
 @property (nonatomic) jpeg_decompressor_t *dec;
 
 @property (nonatomic) NSMutableData *output;
+/// Size of the output plane, in bytes
+@property (nonatomic) NSUInteger planeBytes;
 @property (nonatomic) NSMutableDictionary<NSNumber *, CJPEGHuffmanTable *> *tables;
+@property (nonatomic, nullable) PAPDecodeContext *context;
 
 @end
 
@@ -9,6 +9,9 @@
 
 #import "CJPEGHuffmanTable.h"
 
+@class PAPDecodeContext;
+@class PAPDecodeStats;
+
 NS_ASSUME_NONNULL_BEGIN
 
 /**
@@ -20,22 +23,40 @@ NS_ASSUME_NONNULL_BEGIN
 @property (nonatomic) NSInteger predictor;
 /// JPEG input data
 @property (nonatomic) NSData *input;
+/// Whether the scan is unstuffed into a separate buffer before decoding
+@property (nonatomic) BOOL unstuffInput;
 /// Whether decoder is finished
 @property (nonatomic, readonly) BOOL isDone;
 
-/// Readonly output buffer
+/// Readonly output buffer; allocated when decompression starts unless an unsliced output was set
 @property (nonatomic, readonly) NSMutableData *output;
+/// Context the decompressor state and output buffer were taken from, if any
+@property (nonatomic, readonly, nullable) PAPDecodeContext *context;
+/// If set, the time spent decompressing and the slow paths taken are recorded into these stats
+@property (nonatomic, nullable) PAPDecodeStats *stats;
+/// Error raised by the last call to decompress, as a `jpeg_decompress_error_t`; 0 if it succeeded
+@property (nonatomic, readonly) NSInteger lastError;
 
 - (instancetype) initWithCols:(NSUInteger) cols rows:(NSUInteger) rows
                     precision:(NSUInteger) bits numPlanes:(NSInteger) planes;
+- (instancetype) initWithCols:(NSUInteger) cols rows:(NSUInteger) rows
+                    precision:(NSUInteger) bits numPlanes:(NSInteger) planes
+                      context:(nullable PAPDecodeContext *) context;
 
 - (void) writeTable:(CJPEGHuffmanTable *) table intoSlot:(NSUInteger) slot;
 
 - (void) setTableIndex:(NSUInteger) index forPlane:(NSUInteger) plane;
 
+- (void) setUnslicedOutputWithSlicingInfo:(NSArray<NSNumber *> *) slices;
+
 - (NSInteger) decompressFrom:(NSInteger) inOffset
                didFindMarker:(out BOOL *) foundMarker;
 
+/// Frees the decompressor's internal scan and line buffers; decoding must not be paused
+- (void) releaseBuffers;
+- (NSInteger) decompressFrom:(NSInteger) inOffset maxLines:(NSUInteger) maxLines
+               didFindMarker:(out BOOL *) foundMarker;
+
 @end
 
 NS_ASSUME_NONNULL_END
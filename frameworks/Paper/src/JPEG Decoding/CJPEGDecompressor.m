@@ -9,6 +9,9 @@
 #import "CJPEGDecompressor+Private.h"
 #import "CJPEGHuffmanTable+Private.h"
 
+#import "PAPDecodeContext+Private.h"
+#import "PAPDecodeStats+Private.h"
+
 #import "decompress.h"
 #import "huffman.h"
 
@@ -18,28 +21,43 @@
  * Creates a new decompressor.
  */
 - (instancetype) initWithCols:(NSUInteger) cols rows:(NSUInteger) rows precision:(NSUInteger) bits numPlanes:(NSInteger) planes {
-    int err;
+    return [self initWithCols:cols rows:rows precision:bits numPlanes:planes context:nil];
+}
 
+/**
+ * Creates a new decompressor. If a context is provided, its idle decompressor state is reused and the
+ * output plane is taken from its buffer pool; the plane's contents are then undefined until decoded.
+ */
+- (instancetype) initWithCols:(NSUInteger) cols rows:(NSUInteger) rows precision:(NSUInteger) bits
+                    numPlanes:(NSInteger) planes context:(nullable PAPDecodeContext *) context {
     self = [super init];
     if (self) {
         self.tables = [NSMutableDictionary new];
+        self.context = context;
 
         // create decompressor
-        self.dec = JPEGDecompressorNew(cols, rows, bits, planes);
+        if (context) {
+            self.dec = [context decompressorWithCols:cols rows:rows precision:bits numPlanes:planes];
+        } else {
+            self.dec = JPEGDecompressorNew(cols, rows, bits, planes);
+        }
         NSAssert(self.dec != nil, @"JPEGDecompressorNew() failed");
 
-        // allocate bit plane
-        NSUInteger planeBytes = cols * rows * 2 * planes;
-        self.output = [NSMutableData dataWithLength:planeBytes];
-
-        err = JPEGDecompressorSetOutput(self.dec, self.output.mutableBytes, self.output.length);
-        NSAssert(err == 0, @"Failed to add plane: %d", err);
+        // the bit plane is allocated once the output format is known
+        self.planeBytes = cols * rows * 2 * planes;
     }
     return self;
 }
 
 - (void) dealloc {
-    JPEGDecompressorRelease(self.dec);
+    // the stats may go away before a recycled decompressor is used again
+    JPEGDecompressorSetStats(self.dec, NULL);
+
+    if (self.context) {
+        [self.context recycleDecompressor:self.dec];
+    } else {
+        JPEGDecompressorRelease(self.dec);
+    }
 }
 
 /**
@@ -53,6 +71,16 @@
     NSAssert(err == 0, @"Failed to set input: %d", err);
 }
 
+/**
+ * Sets the stats that decoding is recorded into; they're retained for as long as the decompressor uses them.
+ */
+- (void) setStats:(PAPDecodeStats *) stats {
+    _stats = stats;
+
+    int err = JPEGDecompressorSetStats(self.dec, stats.stats);
+    NSAssert(err == 0, @"Failed to set stats: %d", err);
+}
+
 /**
  * Sets the predictor to use when decoding the image.
  */
@@ -63,6 +91,16 @@
     NSAssert(err == 0, @"Failed to set predictor: %d", err);
 }
 
+/**
+ * Sets whether the entropy coded data is unstuffed before decoding.
+ */
+- (void) setUnstuffInput:(BOOL) unstuffInput {
+    _unstuffInput = unstuffInput;
+
+    int err = JPEGDecompressorSetUnstuffInput(self.dec, unstuffInput);
+    NSAssert(err == 0, @"Failed to set unstuffing: %d", err);
+}
+
 /**
  * Writes a Huffman compression table into the correct slot.
  */
@@ -85,6 +123,75 @@
     NSAssert(err == 0, @"Failed to set table index: %d", err);
 }
 
+/**
+ * Allocates an output plane into which samples are written in unsliced order, using the given CR2
+ * slicing info.
+ */
+- (void) setUnslicedOutputWithSlicingInfo:(NSArray<NSNumber *> *) slicing {
+    int err;
+
+    NSAssert(slicing.count == 3, @"Invalid slicing info: %@", slicing);
+    NSAssert(self.output == nil, @"Output plane already allocated");
+
+    uint16_t slices[3] = {0, 0, 0};
+    for(NSUInteger i = 0; i < 3; i++) {
+        slices[i] = slicing[i].unsignedShortValue;
+    }
+
+    self.output = [self allocatePlane];
+
+    err = JPEGDecompressorSetUnslicedOutput(self.dec, self.output.mutableBytes, self.output.length,
+                                            slices);
+    NSAssert(err == 0, @"Failed to set unsliced output: %d", err);
+}
+
+/**
+ * Allocates the default interleaved output plane, if no other output has been set up yet.
+ */
+- (void) allocateOutputIfNeeded {
+    int err;
+
+    if(self.output != nil) {
+        return;
+    }
+
+    self.output = [self allocatePlane];
+
+    err = JPEGDecompressorSetOutput(self.dec, self.output.mutableBytes, self.output.length);
+    NSAssert(err == 0, @"Failed to add plane: %d", err);
+}
+
+/**
+ * Allocates an output plane, taking it from the context's pool if there is one.
+ */
+- (NSMutableData *) allocatePlane {
+    NSMutableData *plane;
+
+    if (self.context) {
+        plane = [self.context bufferWithLength:self.planeBytes];
+    } else {
+        plane = [NSMutableData dataWithLength:self.planeBytes];
+    }
+
+    NSAssert(plane != nil, @"Failed to allocate output plane (%lu bytes)", (unsigned long) self.planeBytes);
+    return plane;
+}
+
+/**
+ * Frees the internal buffers of the decompressor once it's done. The output plane is unaffected.
+ */
+- (void) releaseBuffers {
+    int err = JPEGDecompressorReleaseBuffers(self.dec);
+    NSAssert(err == 0, @"Failed to release buffers: %d", err);
+}
+
+/**
+ * Error raised by the last call to decompress
+ */
+- (NSInteger) lastError {
+    return self.dec->error;
+}
+
 /**
  * Whether the decompressor read all bytes or not
  */
@@ -99,10 +206,23 @@
  */
 - (NSInteger) decompressFrom:(NSInteger) inOffset
                 didFindMarker:(BOOL *) foundMarker {
+    return [self decompressFrom:inOffset maxLines:NSUIntegerMax didFindMarker:foundMarker];
+}
+
+/**
+ * Decodes at most the given number of lines, setting the flag if we encountered a marker. If the previous
+ * call stopped at its line limit, decoding resumes from there and the offset is ignored.
+ *
+ * @return Byte offset immediately after the last byte processed. This is either EoF or a marker.
+ */
+- (NSInteger) decompressFrom:(NSInteger) inOffset maxLines:(NSUInteger) maxLines
+               didFindMarker:(BOOL *) foundMarker {
     size_t offset;
     bool found = false;
 
-    offset = JPEGDecompressorGo(self.dec, inOffset, &found);
+    [self allocateOutputIfNeeded];
+
+    offset = JPEGDecompressorGoLines(self.dec, inOffset, maxLines, &found);
 
     if(foundMarker) {
         *foundMarker = (BOOL) found;
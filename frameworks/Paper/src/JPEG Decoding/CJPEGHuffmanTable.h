@@ -14,6 +14,17 @@ NS_ASSUME_NONNULL_BEGIN
  */
 @interface CJPEGHuffmanTable : NSObject
 
+/**
+ * Gets the table for the contents of a DHT segment from the shared table cache. Such tables are
+ * immutable, so no more codes may be added to them.
+ *
+ * @param counts Number of codes of each length from 1 to 16 bits
+ * @param values Values of all codes, in the order they appear in the segment
+ * @param numValues Number of values; must be the sum of all counts
+ */
+- (nullable instancetype) initWithCounts:(const uint8_t *) counts values:(const uint8_t *) values
+                               numValues:(NSUInteger) numValues;
+
 - (void) addCode:(uint16_t) code length: (NSInteger) bits andValue:(uint8_t) value;
 
 @end
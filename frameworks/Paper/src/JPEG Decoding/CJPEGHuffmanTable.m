@@ -21,12 +21,24 @@
     return self;
 }
 
+- (instancetype) initWithCounts:(const uint8_t *) counts values:(const uint8_t *) values
+                      numValues:(NSUInteger) numValues {
+    self = [super init];
+    if (self) {
+        self.huff = JPEGHuffmanCacheGet(counts, values, numValues);
+        if (!self.huff) return nil;
+    }
+    return self;
+}
+
 - (void) dealloc {
     JPEGHuffmanRelease(self.huff);
 }
 
 - (void) addCode:(uint16_t) code length: (NSInteger) bits
         andValue:(uint8_t) value {
+    NSAssert(!self.huff->immutable, @"Can't add codes to a shared table");
+
     int err;
     err = JPEGHuffmanAdd(self.huff, code, bits, value);
     NSAssert(err == 0, @"Failed to add code: %d", err);
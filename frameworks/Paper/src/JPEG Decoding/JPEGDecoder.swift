@@ -6,6 +6,7 @@
 //
 
 import Foundation
+import OSLog
 
 /**
  * Decodes JPEG images encoded using the lossless encoding scheme.
@@ -14,6 +15,9 @@ import Foundation
  * specifically, no extensions (such as JFIF or Exif) are implemented.
  */
 internal class JPEGDecoder {
+    fileprivate static var logger = Logger(subsystem: Bundle(for: JPEGDecoder.self).bundleIdentifier!,
+                                         category: "JPEGDecoder")
+
     /// Data object containing the JPEG file data
     private var data: Data
     /// Start offset
@@ -22,6 +26,25 @@ internal class JPEGDecoder {
     /// Huffman coding
     private var huffman: JPEGHuffman!
 
+    /**
+     * Canon RAW slicing info (tag 0xc640); when set, the decompressor writes samples directly into an
+     * unsliced output plane instead of the interleaved frame layout.
+     */
+    internal var unslicingInfo: [UInt32]? = nil
+    
+    /**
+     * When set, image data is decompressed this many lines at a time, and the handler is invoked after each
+     * chunk. This lets the decompressed output be consumed while the rest of the image is decoded.
+     */
+    internal var linesPerChunk: UInt = 0
+    /// Invoked after each chunk of lines has been decompressed
+    internal var chunkHandler: ((CJPEGDecompressor) throws -> Void)? = nil
+    
+    /// When set, the decompressor state and output plane are reused from this context
+    internal var context: PAPDecodeContext? = nil
+    /// When set, the time spent decompressing is recorded into these stats
+    internal var stats: PAPDecodeStats? = nil
+
     // MARK: - Initialization
     /**
      * Creates a JPEG decoder with the given data as input.
@@ -169,17 +192,28 @@ internal class JPEGDecoder {
             }
         }
 
-        // ensure the predictor is type 1
-        guard scan.predictor == 1 else {
+        // all lossless predictors are supported, but not point transforms
+        guard (1...7).contains(scan.predictor) else {
             throw DecompressError.unsupportedPredictor(scan.predictor)
         }
+        guard scan.ptTransform == 0 else {
+            throw DecompressError.unsupportedPointTransform(scan.ptTransform)
+        }
 
         // allocate decompressor
         self.decompressor = CJPEGDecompressor(cols: UInt(frame.samplesPerLine),
                                               rows: UInt(frame.numLines),
                                               precision: UInt(frame.precision),
-                                              numPlanes: frame.components.count)
+                                              numPlanes: frame.components.count,
+                                              context: self.context)
         self.decompressor.input = self.data
+        self.decompressor.stats = self.stats
+        // decode from an unstuffed copy of the scan, which avoids per-byte marker checks
+        self.decompressor.unstuffInput = true
+
+        if let slices = self.unslicingInfo {
+            self.decompressor.setUnslicedOutput(withSlicingInfo: slices.map(NSNumber.init))
+        }
     }
 
     /**
@@ -210,7 +244,22 @@ internal class JPEGDecoder {
         self.decompressor.predictor = scan.predictor
 
         // decompress until a marker or end of image is encountered
-        let doneOff = self.decompressor.decompress(from: startingAt, didFindMarker: &foundMarker)
+        var doneOff: Int
+        
+        if let handler = self.chunkHandler, self.linesPerChunk > 0 {
+            repeat {
+                doneOff = self.decompressor.decompress(from: startingAt, maxLines: self.linesPerChunk,
+                                                       didFindMarker: &foundMarker)
+                try handler(self.decompressor)
+            } while !foundMarker.boolValue && !self.decompressor.isDone
+        } else {
+            doneOff = self.decompressor.decompress(from: startingAt, didFindMarker: &foundMarker)
+        }
+
+        // the decompressor stops at the offset it failed at; the markers after it decide what happens next
+        if self.decompressor.lastError != 0 {
+            Self.logger.error("Decompression failed at offset \(doneOff): error \(self.decompressor.lastError)")
+        }
 
         if foundMarker.boolValue {
             self.isDecoding = false
@@ -290,6 +339,8 @@ internal class JPEGDecoder {
         case unsupportedSampling(_ component: JPEGFrame.Component)
         /// Unsupported predictor configuration
         case unsupportedPredictor(_ predictor: Int)
+        /// Point transforms are not supported
+        case unsupportedPointTransform(_ transform: Int)
         /// A marker was encountered
         case encounteredMarker
     }
@@ -102,34 +102,20 @@ class JPEGHuffman {
             Li.append(chunk.read(Self.offsetLi0 + i))
         }
 
-        // build a Huffman map of (length, code) -> value
-        let table = Table()
+        // read the values for all codes; canonical codes are assigned by the C side
+        let numValues = Li.reduce(0, { $0 + Int($1) })
+        var values: [UInt8] = []
 
-        var huffvalOff = Self.offsetVij0
-        var code: UInt16 = 0
-
-        var huffBytesRead = 0
-
-        for i in 0..<16 {
-            for _ in 0..<Li[i] {
-                // read a byte from the Vij table
-                let val: UInt8 = chunk.read(huffvalOff)
-                huffBytesRead = huffBytesRead + 1
-
-                table.addValue(length: (i + 1), code: code, val)
-
-                // value for the next code word
-                code = code + 1
-                // read the next HUFFVAL byte
-                huffvalOff = huffvalOff + 1
-            }
+        for i in 0..<numValues {
+            values.append(chunk.read(Self.offsetVij0 + i))
+        }
 
-            // next code is one bit longer
-            code = code << 1
+        guard let table = Table(counts: Li, values: values) else {
+            throw ReadError.invalidTable
         }
 
         // bytes read: T + Li[0..15] + mt
-        return ((huffBytesRead + 16 + 1), slot, table)
+        return ((numValues + 16 + 1), slot, table)
     }
 
     // MARK: Offsets
@@ -154,18 +140,15 @@ class JPEGHuffman {
         private(set) internal var cTree: CJPEGHuffmanTable!
 
         /**
-         * Creates an uninitialized table. You must call `addValue(length:code:_:)` to populate
-         * the table.
-         */
-        init() {
-            self.cTree = CJPEGHuffmanTable()
-        }
-
-        /**
-         * Adds a new value to the table.
+         * Gets the table for the given code counts (Li) and values (Vij). Tables with the same contents
+         * are shared between all decoders.
          */
-        internal func addValue(length: Int, code: UInt16, _ value: UInt8) {
-            self.cTree.addCode(code, length: length, andValue: value)
+        init?(counts: [UInt8], values: [UInt8]) {
+            guard let table = CJPEGHuffmanTable(counts: counts, values: values,
+                                                numValues: UInt(values.count)) else {
+                return nil
+            }
+            self.cTree = table
         }
 
         /// Pretty debug print the table
@@ -186,6 +169,8 @@ class JPEGHuffman {
         case illegalTh(_ actual: UInt8)
         /// Something weird is going on reading the tables; DHT marker had too much/too little data
         case invalidLength(read: Int, actual: Int)
+        /// The code counts and values don't describe a valid set of canonical codes
+        case invalidTable
     }
 
     /**
@@ -9,22 +9,44 @@
 
 #include "decompress.h"
 #include "huffman.h"
+#include "stagestats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 static uint8_t BitstreamNextByte(jpeg_decompressor_t *dec, bool *foundMarker);
 static void BitstreamSeek(jpeg_decompressor_t *dec, size_t offset);
 static uint64_t BitstreamPeek(jpeg_decompressor_t *dec, size_t count, bool *foundMarker);
 static int BitstreamConsume(jpeg_decompressor_t *dec, size_t count);
 static uint64_t BitstreamGet(jpeg_decompressor_t *dec, size_t count, bool *foundMarker);
 
-static uint16_t Predict(jpeg_decompressor_t *dec, int component, int delta, size_t bufferOffset);
-static uint16_t PredictorAlgo1(jpeg_decompressor_t *dec, int component, int delta, size_t bufferOffset);
+static int BitstreamUnstuff(jpeg_decompressor_t *dec, size_t offset);
+static size_t Unstuff(const uint8_t *in, size_t length, uint8_t *out, size_t *outLength);
+static inline void BitstreamRefill(jpeg_decompressor_t *dec);
+static inline bool BitstreamOverrun(jpeg_decompressor_t *dec);
+
+static uint16_t Predict(jpeg_decompressor_t *dec, int component, int delta);
+static inline int PredictSample(const int algorithm, const int ra, const int rb, const int rc);
+static int AllocLineBuffers(jpeg_decompressor_t *dec);
+static inline void SwapLineBuffers(jpeg_decompressor_t *dec);
+
+static inline void WriteSample(jpeg_decompressor_t *dec, size_t offset, uint16_t value);
+static void WriteLine(jpeg_decompressor_t *dec, const uint16_t *samples, size_t count);
+static void UnsliceAdvance(jpeg_decompressor_t *dec);
 
-static uint8_t ReadCodeFast(jpeg_decompressor_t *dec, jpeg_huffman_t *table, bool *found, bool *foundMarker);
+static int ReadDeltaFast(jpeg_decompressor_t *dec, jpeg_huffman_t *table, bool *found, bool *foundMarker);
+static inline int ReadDeltaUnstuffed(jpeg_decompressor_t *dec, jpeg_huffman_t *table, bool *found);
+
+static size_t DecodeLines(jpeg_decompressor_t *dec, size_t offset, size_t maxLines, bool *outFoundMarker);
+static bool DecodeLinesSpecialized(jpeg_decompressor_t *dec, bool *foundCode, bool *foundMarker);
 static uint8_t ReadCode(jpeg_decompressor_t *dec, jpeg_huffman_t *table, bool *found, bool *foundMarker);
 
 // MARK: - Macros
@@ -33,18 +55,15 @@ static uint8_t ReadCode(jpeg_decompressor_t *dec, jpeg_huffman_t *table, bool *f
 /// Whether the value n occurrs anywhere inside x
 #define hasvalue(x,n) (haszero((x) ^ (~0UL/255 * (n))))
 
-// MARK: - Constants
-/**
- * Mask for delta values bit lengths 0-15
- */
-static const uint16_t kDeltaMask[17] = {
-    0x0000,
-    0x0001, 0x0003, 0x0007, 0x000F,
-    0x001F, 0x003F, 0x007F, 0x00FF,
-    0x01FF, 0x03FF, 0x07FF, 0x0FFF,
-    0x1FFF, 0x3FFF, 0x7FFF, 0xFFFF
-};
+/// Branch prediction hints
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+/// Forces a function to be inlined, so it can be specialized on constant arguments
+#define ALWAYS_INLINE inline __attribute__((always_inline))
 
+// MARK: - Constants
+/// Bytes of zero padding following the unstuffed scan data, so refills never read out of bounds
+#define kScanPadding 8
 
 // MARK: - Bitstream reading
 /**
@@ -90,6 +109,141 @@ static void BitstreamSeek(jpeg_decompressor_t *dec, size_t offset) {
     dec->bitBuf = 0;
     dec->bitCount = 0;
     dec->numBitBufReads = 0;
+    dec->readUnstuffed = false;
+}
+
+/**
+ * Unstuffs the entropy coded data starting at the given offset into the scan buffer, and points the
+ * bitstream at it.
+ *
+ * @return 0 on success, or an error code if the scan buffer couldn't be allocated
+ */
+static int BitstreamUnstuff(jpeg_decompressor_t *dec, size_t offset) {
+    assert(offset <= dec->inBufSz);
+
+    // unstuffing never grows the data, so the rest of the input always fits
+    const size_t length = dec->inBufSz - offset;
+    const size_t needed = length + kScanPadding;
+
+    if(dec->scanBufSz < needed) {
+        free(dec->scanBuf);
+        dec->scanBuf = NULL;
+        dec->scanBufSz = 0;
+
+        if(posix_memalign((void **) &dec->scanBuf, 64, needed) != 0) {
+            dec->scanBuf = NULL;
+            return -1;
+        }
+        dec->scanBufSz = needed;
+
+        StageCountAllocation(dec->stats, needed);
+    }
+
+    size_t unstuffed;
+    const size_t markerOff = Unstuff(((const uint8_t *) dec->inBuf) + offset, length,
+                                     dec->scanBuf, &unstuffed);
+    memset(dec->scanBuf + unstuffed, 0, kScanPadding);
+
+    // set up the bit reader
+    dec->readPtr = dec->scanBuf;
+    dec->scanEnd = dec->scanBuf + unstuffed;
+    dec->scanPadBytes = 0;
+    dec->scanMarkerOffset = offset + markerOff;
+
+    dec->bitBuf = 0;
+    dec->bitCount = 0;
+    dec->numBitBufReads = 0;
+    dec->readUnstuffed = true;
+
+    return 0;
+}
+
+/**
+ * Copies entropy coded data to the output buffer, replacing each stuffed 0xFF00 pair with 0xFF, until
+ * a marker or the end of the input is found. Runs of bytes without 0xFF in them are copied 16 at a time.
+ *
+ * @param outLength Number of bytes written to the output buffer
+ * @return Offset of the marker relative to the start of the input, or its length if there is none
+ */
+static size_t Unstuff(const uint8_t *in, size_t length, uint8_t *out, size_t *outLength) {
+    size_t i = 0, o = 0;
+
+    while(i < length) {
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        const uint8x16_t ff = vdupq_n_u8(0xFF);
+
+        while((i + 16) <= length) {
+            const uint8x16_t block = vld1q_u8(in + i);
+            if(vmaxvq_u8(vceqq_u8(block, ff))) break;
+
+            vst1q_u8(out + o, block);
+            i += 16;
+            o += 16;
+        }
+#elif defined(__SSE2__)
+        const __m128i ff = _mm_set1_epi8((char) 0xFF);
+
+        while((i + 16) <= length) {
+            const __m128i block = _mm_loadu_si128((const __m128i *) (in + i));
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(block, ff))) break;
+
+            _mm_storeu_si128((__m128i *) (out + o), block);
+            i += 16;
+            o += 16;
+        }
+#endif
+
+        // handle the block containing a 0xFF byte one byte at a time
+        const size_t end = ((i + 16) < length) ? (i + 16) : length;
+
+        for(; i < end; i++) {
+            if(in[i] != 0xFF) {
+                out[o++] = in[i];
+            }
+            // stuffed byte
+            else if((i + 1) < length && in[i + 1] == 0x00) {
+                out[o++] = 0xFF;
+                i++;
+            }
+            // found a marker
+            else {
+                *outLength = o;
+                return i;
+            }
+        }
+    }
+
+    *outLength = o;
+    return length;
+}
+
+/**
+ * Refills the bit buffer from the unstuffed scan buffer so that it holds at least 56 bits, using a single
+ * unaligned load.
+ */
+static inline void BitstreamRefill(jpeg_decompressor_t *dec) {
+    uint64_t next;
+    memcpy(&next, dec->readPtr, sizeof(next));
+
+    dec->bitBuf |= __builtin_bswap64(next) >> dec->bitCount;
+    dec->readPtr += (63 - dec->bitCount) >> 3;
+    dec->bitCount |= 56;
+
+    // past the end of the scan, keep feeding zero padding
+    if(dec->readPtr > dec->scanEnd) {
+        dec->scanPadBytes += (dec->readPtr - dec->scanEnd);
+        dec->readPtr = dec->scanEnd;
+    }
+}
+
+/**
+ * Whether more bits have been consumed than the unstuffed scan contains.
+ */
+static inline bool BitstreamOverrun(jpeg_decompressor_t *dec) {
+    const size_t loaded = (dec->readPtr - dec->scanBuf) + dec->scanPadBytes;
+    const size_t available = (dec->scanEnd - dec->scanBuf);
+
+    return ((loaded * 8) - dec->bitCount) > (available * 8);
 }
 
 /**
@@ -106,6 +260,11 @@ static void BitstreamPrefetch4(jpeg_decompressor_t *dec) {
     if(dec->bitCount > 31) {
         return;
     }
+    // unstuffed data can always be refilled
+    if(dec->readUnstuffed) {
+        BitstreamRefill(dec);
+        return;
+    }
     // there must be at least 4 bytes left in the file
     if ((((void*) dec->readPtr) - dec->inBuf) >= (dec->inBufSz - 4)) {
         return;
@@ -122,6 +281,7 @@ static void BitstreamPrefetch4(jpeg_decompressor_t *dec) {
     // insert it into the buffer
     dec->bitBuf |= ((uint64_t) read) << (32 - dec->bitCount);
     dec->bitCount += 32;
+    dec->slowRefills++;
 
     dec->readPtr += 4;
     dec->numBitBufReads += 4;
@@ -135,11 +295,21 @@ static uint64_t BitstreamPeek(jpeg_decompressor_t *dec, size_t count, bool *foun
     assert(dec);
     assert(count >= 1 && count <= 57);
 
+    // unstuffed data never contains markers
+    if(dec->readUnstuffed) {
+        if(dec->bitCount < count) {
+            BitstreamRefill(dec);
+        }
+        return (dec->bitBuf >> (64 - count));
+    }
+
     // read more bits if needed
     while(dec->bitCount < count) {
         uint8_t next = BitstreamNextByte(dec, foundMarker);
         if(*foundMarker) return 0;
 
+        dec->slowRefills++;
+
         dec->bitBuf |= ((uint64_t) next) << (56 - dec->bitCount);
         dec->bitCount += 8;
     }
@@ -170,6 +340,23 @@ static uint64_t BitstreamGet(jpeg_decompressor_t *dec, size_t count, bool *found
 }
 
 // MARK: - Setup
+/**
+ * Sets up the initial values of a cleared decompressor for an image of the given size.
+ */
+static void InitState(jpeg_decompressor_t *dec, size_t cols, size_t rows, uint8_t bits,
+                      size_t components) {
+    dec->refCount = 1;
+
+    dec->samplesPerLine = cols;
+    dec->lines = rows;
+    dec->stride = cols * sizeof(uint16_t);
+
+    dec->precision = bits;
+    dec->predictorDefault = (1 << (bits - 1));
+
+    dec->numComponents = components;
+}
+
 /**
  * Allocates a new decompressor state object with the given image size.
  */
@@ -179,21 +366,86 @@ jpeg_decompressor_t *JPEGDecompressorNew(size_t cols, size_t rows, uint8_t bits,
     if(!out) return NULL;
 
     memset(out, 0, sizeof(jpeg_decompressor_t));
+    InitState(out, cols, rows, bits, components);
 
-    // set up initial values
-    out->refCount = 1;
+    // done
+    return out;
+}
 
-    out->samplesPerLine = cols;
-    out->lines = rows;
-    out->stride = cols * sizeof(uint16_t);
+/**
+ * Resets a decompressor so it can decode another image of the given size.
+ *
+ * All decoding state and Huffman tables are discarded, and the input and output buffers are cleared. The
+ * scan buffer is kept, as are the line buffers if the width of a line is unchanged, so decoding a series of
+ * images of the same geometry needs no further allocations.
+ *
+ * @return 0 on success, or an error code if the decompressor is still referenced elsewhere
+ */
+int JPEGDecompressorReset(jpeg_decompressor_t *dec, size_t cols, size_t rows, uint8_t bits,
+                          size_t components) {
+    assert(dec);
 
-    out->precision = bits;
-    out->predictorDefault = (1 << (bits - 1));
+    if(dec->refCount != 1) {
+        return -1;
+    }
 
-    out->numComponents = components;
+    for (int i = 0; i < 4; i++) {
+        if (dec->tables[i]) {
+            JPEGHuffmanRelease(dec->tables[i]);
+        }
+    }
 
-    // done
-    return out;
+    // hold on to the buffers that can be reused
+    uint8_t *scanBuf = dec->scanBuf;
+    const size_t scanBufSz = dec->scanBufSz;
+
+    uint16_t *lineBuf = dec->lineBuf;
+    if(lineBuf && (dec->samplesPerLine * dec->numComponents) != (cols * components)) {
+        free(lineBuf);
+        lineBuf = NULL;
+    }
+
+    memset(dec, 0, sizeof(jpeg_decompressor_t));
+    InitState(dec, cols, rows, bits, components);
+
+    dec->scanBuf = scanBuf;
+    dec->scanBufSz = scanBufSz;
+
+    if(lineBuf) {
+        dec->lineBuf = lineBuf;
+        dec->prevLine = lineBuf;
+        dec->curLine = lineBuf + (cols * components);
+    }
+
+    return 0;
+}
+
+/**
+ * Frees the scan and line buffers of a decompressor that isn't in the middle of decoding. They're allocated
+ * again if it's used to decode another image.
+ *
+ * @return 0 on success, or an error code if decoding was paused and still needs the buffers
+ */
+int JPEGDecompressorReleaseBuffers(jpeg_decompressor_t *dec) {
+    assert(dec);
+
+    if(dec->paused) {
+        return -1;
+    }
+
+    free(dec->scanBuf);
+    dec->scanBuf = NULL;
+    dec->scanBufSz = 0;
+
+    dec->readPtr = NULL;
+    dec->scanEnd = NULL;
+
+    free(dec->lineBuf);
+    dec->lineBuf = NULL;
+    dec->prevLine = NULL;
+    dec->curLine = NULL;
+
+    return 0;
 }
 
 /**
@@ -212,6 +464,8 @@ jpeg_decompressor_t * JPEGDecompressorRelease(jpeg_decompressor_t *dec) {
         }
 
         // lastly, deallocate the decompressor
+        free(dec->scanBuf);
+        free(dec->lineBuf);
         free(dec);
         return NULL;
     }
@@ -264,6 +518,72 @@ int JPEGDecompressorSetOutput(jpeg_decompressor_t *dec, void *plane, size_t leng
     return 0;
 }
 
+/**
+ * Sets an output bit plane that receives the image in unsliced order, as used by Canon RAW files.
+ *
+ * Slices are stored one after another in the compressed data; each one spans the full height of the
+ * image. The decoder keeps track of the position in the current slice line, so each sample can be
+ * written directly to its final location.
+ *
+ * @param slices Slicing info (tag 0xc640): number of full slices, width of each slice and width of
+ * the last slice, in output samples
+ */
+int JPEGDecompressorSetUnslicedOutput(jpeg_decompressor_t *dec, void *plane, size_t length,
+                                      const uint16_t *slices) {
+    assert(dec);
+    assert(slices);
+
+    // lines of the unsliced image are as wide as the decoded frame; the last slice fills the rest of it,
+    // unless the slicing info says it's narrower
+    const size_t rowWidth = dec->samplesPerLine * dec->numComponents;
+    const size_t sliceWidth = (slices[1] / dec->numComponents) * dec->numComponents;
+
+    if(!sliceWidth || (slices[0] * sliceWidth) > rowWidth) {
+        return -1;
+    }
+    if(length < (rowWidth * dec->lines * sizeof(uint16_t))) {
+        return -1;
+    }
+
+    size_t lastSliceWidth = rowWidth - (slices[0] * sliceWidth);
+    if(slices[2] && slices[2] < lastSliceWidth) {
+        lastSliceWidth = (slices[2] / dec->numComponents) * dec->numComponents;
+    }
+    if(!slices[0] && !lastSliceWidth) {
+        return -1;
+    }
+
+    dec->outBuf = plane;
+    dec->outBufSz = length;
+
+    dec->unsliceOutput = true;
+    dec->numSlices = slices[0];
+    dec->sliceWidth = sliceWidth;
+    dec->lastSliceWidth = lastSliceWidth;
+    dec->unslicedWidth = rowWidth;
+
+    // start writing at the top left of the first slice
+    dec->writeSlice = 0;
+    dec->writeSliceLine = 0;
+    dec->writeSliceCol = 0;
+    dec->writeOff = 0;
+    dec->writeRunLeft = (dec->numSlices ? dec->sliceWidth : dec->lastSliceWidth);
+    dec->writeFull = false;
+
+    return 0;
+}
+
+/**
+ * Enables or disables unstuffing of the entropy coded data before decoding.
+ */
+int JPEGDecompressorSetUnstuffInput(jpeg_decompressor_t *dec, bool unstuff) {
+    assert(dec);
+
+    dec->unstuffInput = unstuff;
+
+    return 0;
+}
+
 /**
  * Sets the table index to use for decoding a particular plane.
  */
@@ -290,6 +610,17 @@ int JPEGDecompressorSetPredictionAlgo(jpeg_decompressor_t *dec, uint8_t algorith
     return 0;
 }
 
+/**
+ * Sets the stats that decoding is recorded into.
+ */
+int JPEGDecompressorSetStats(jpeg_decompressor_t *dec, stage_stats_t *stats) {
+    assert(dec);
+
+    dec->stats = stats;
+
+    return 0;
+}
+
 /**
  * Indicate whether the decompressor has written data for every sample.
  */
@@ -299,12 +630,95 @@ bool JPEGDecompressorIsDone(jpeg_decompressor_t *dec) {
     return dec->isDone;
 }
 
+/**
+ * Gets the number of lines at the top of the output that have been completely written.
+ */
+size_t JPEGDecompressorCompletedLines(jpeg_decompressor_t *dec) {
+    assert(dec);
+
+    if(dec->isDone || !dec->unsliceOutput) {
+        return dec->currentLine;
+    }
+
+    // only lines above the write position in the last slice are complete
+    if(dec->writeSlice < dec->numSlices) {
+        return 0;
+    }
+    return (dec->writeSlice == dec->numSlices) ? dec->writeSliceLine : dec->lines;
+}
+
+/**
+ * Gets the number of columns at the left of the output that have been written for every line.
+ */
+size_t JPEGDecompressorCompletedColumns(jpeg_decompressor_t *dec) {
+    assert(dec);
+
+    if(dec->isDone) {
+        return dec->unsliceOutput ? dec->unslicedWidth : (dec->samplesPerLine * dec->numComponents);
+    }
+
+    // interleaved lines are written left to right, so no column is complete until the end
+    if(!dec->unsliceOutput) {
+        return 0;
+    }
+    return (dec->writeSlice <= dec->numSlices) ? dec->writeSliceCol : dec->unslicedWidth;
+}
+
 // MARK: - Decompression
+/**
+ * Gets the offset into the input buffer at which decoding stopped. For unstuffed scans, this is always
+ * the offset of the marker that terminates it.
+ */
+static inline size_t CurrentOffset(jpeg_decompressor_t *dec, size_t offset) {
+    if(dec->readUnstuffed) {
+        return dec->scanMarkerOffset;
+    }
+    return offset + dec->numBitBufReads;
+}
+
 /**
  * Decompresses image data from the given offset until either the end of the data is reached, or a marker
  * is discovered.
  */
 size_t JPEGDecompressorGo(jpeg_decompressor_t *dec, size_t offset, bool *outFoundMarker) {
+    return JPEGDecompressorGoLines(dec, offset, SIZE_MAX, outFoundMarker);
+}
+
+/**
+ * Decompresses at most the given number of lines of image data, recording the time taken, the lines decoded
+ * and the slow path events counted along the way into the stats.
+ */
+size_t JPEGDecompressorGoLines(jpeg_decompressor_t *dec, size_t offset, size_t maxLines,
+                               bool *outFoundMarker) {
+    assert(dec);
+
+    const size_t firstLine = dec->currentLine;
+    stage_interval_t interval = StageBegin(dec->stats, kStageDecompress);
+
+    dec->error = kJPEGErrorNone;
+    const size_t end = DecodeLines(dec, offset, maxLines, outFoundMarker);
+
+    const size_t lineBytes = dec->samplesPerLine * dec->numComponents * sizeof(uint16_t);
+    StageEnd(dec->stats, &interval, (dec->currentLine - firstLine) * lineBytes);
+
+    StageCount(dec->stats, kStageCounterSlowRefills, dec->slowRefills);
+    StageCount(dec->stats, kStageCounterTreeWalks, dec->treeWalks);
+    dec->slowRefills = 0;
+    dec->treeWalks = 0;
+
+    if(dec->error != kJPEGErrorNone) {
+        dec->errorOffset = end;
+        StageFail(dec->stats, kStageDecompress, dec->error);
+    }
+
+    return end;
+}
+
+/**
+ * Decodes image data for `JPEGDecompressorGoLines`. When the previous call stopped at its line limit, the
+ * bit reader is still positioned at the next sample, so it's not seeked again.
+ */
+static size_t DecodeLines(jpeg_decompressor_t *dec, size_t offset, size_t maxLines, bool *outFoundMarker) {
     int delta = 0;
     bool foundMarker = false;
 
@@ -315,11 +729,33 @@ size_t JPEGDecompressorGo(jpeg_decompressor_t *dec, size_t offset, bool *outFoun
     assert(dec);
     assert(outFoundMarker);
 
-    // seek bitstream
-    BitstreamSeek(dec, offset);
+    // predictors other than 1 need the previous line
+    if(dec->predictionAlgorithm != 1 && AllocLineBuffers(dec) != 0) {
+        dec->error = kJPEGErrorNoMemory;
+        *outFoundMarker = true;
+        return offset;
+    }
+
+    // resume where the last call stopped, or seek bitstream, unstuffing the scan if desired
+    if(dec->paused) {
+        dec->paused = false;
+        offset = dec->pausedOffset;
+    } else if(!dec->unstuffInput || BitstreamUnstuff(dec, offset) != 0) {
+        BitstreamSeek(dec, offset);
+    }
+
+    const size_t linesLeft = dec->lines - dec->currentLine;
+    dec->lineLimit = dec->currentLine + ((maxLines < linesLeft) ? maxLines : linesLeft);
+
+    // decode as many lines as possible with a specialized kernel
+    bool kernelFoundCode = true;
+    if(!DecodeLinesSpecialized(dec, &kernelFoundCode, &foundMarker)) {
+        if (foundMarker) goto gotMarker;
+        if (!kernelFoundCode) goto noCode;
+    }
 
     // read all lines
-    for (; dec->currentLine < dec->lines; dec->currentLine++) {
+    for (; dec->currentLine < dec->lineLimit; dec->currentLine++) {
         // read all samples in this line
         for(; dec->currentSample < dec->samplesPerLine; dec->currentSample++) {
             // calculate pixel offset
@@ -332,152 +768,546 @@ size_t JPEGDecompressorGo(jpeg_decompressor_t *dec, size_t offset, bool *outFoun
                 // prefetch bit buffer
                 BitstreamPrefetch4(dec);
 
-                // read huffman bit count (fast for all but last line)
+                // decode the delta (fast for all but last line)
                 jpeg_huffman_t *table = dec->tables[dec->tableForComponent[c]];
 
-                if(dec->currentLine != (dec->lines - 1)) {
-                    bits = ReadCodeFast(dec, table, &foundCode, &foundMarker);
+                if(dec->readUnstuffed || dec->currentLine != (dec->lines - 1)) {
+                    delta = ReadDeltaFast(dec, table, &foundCode, &foundMarker);
+
+                    if (foundMarker) goto gotMarker;
+                    if (!foundCode) goto noCode;
                 } else {
                     // this handles markers much better
                     bits = ReadCode(dec, table, &foundCode, &foundMarker);
-                }
 
-                if (foundMarker) goto gotMarker;
-                if (!foundCode) goto noCode;
-
-                // read value
-                if(bits) {
-                    rawDiff = BitstreamGet(dec, bits, &foundMarker);
                     if (foundMarker) goto gotMarker;
-                } else {
-                    rawDiff = 0;
-                }
+                    if (!foundCode) goto noCode;
 
-                // copy positive values as is
-                if ((rawDiff & (1 << (bits - 1))) != 0) {
-                    delta = (rawDiff & kDeltaMask[bits]);
-                }
-                // for negative values, take the bitwise inverse
-                else {
-                    uint16_t inverse = ~rawDiff;
-                    inverse &= kDeltaMask[bits];
-                    delta = -((int) inverse);
+                    // read value
+                    if(bits && bits != 16) {
+                        rawDiff = BitstreamGet(dec, bits, &foundMarker);
+                        if (foundMarker) goto gotMarker;
+                    } else {
+                        rawDiff = 0;
+                    }
+
+                    delta = JPEGHuffmanExtend((int) rawDiff, bits);
                 }
 
                 // shove it into predictor
-                uint16_t actual = Predict(dec, c, delta, off);
+                uint16_t actual = Predict(dec, c, delta);
+                dec->lastValue[c] = actual;
+
+                if(dec->currentSample == 0) {
+                    dec->lineStart[c] = actual;
+                }
+                if(dec->curLine) {
+                    dec->curLine[(dec->currentSample * dec->numComponents) + c] = actual;
+                }
 
                 // write it into buffer
-                dec->outBuf[off + c] = actual;
+                WriteSample(dec, off + c, actual);
             }
         }
 
         // reset for next row
         dec->currentSample = 0;
+        SwapLineBuffers(dec);
+
+        // if the scan ended early, we ran into its marker
+        if(dec->readUnstuffed && BitstreamOverrun(dec)) goto gotMarker;
+    }
+
+    // stopped at the line limit; the next call picks up from here
+    if(dec->currentLine < dec->lines) {
+        dec->paused = true;
+        dec->pausedOffset = offset;
+        return CurrentOffset(dec, offset);
     }
 
     // if we get here, decoding finished due to reading all pixels
     dec->isDone = true;
-    return offset + dec->numBitBufReads;
+    return CurrentOffset(dec, offset);
 
     // failed to match a Huffman code
 noCode:;
-    fprintf(stderr, "Failed to find huffman code (offset: %lu %lu read)\n", (offset + dec->numBitBufReads), dec->numBitBufReads);
+    dec->error = kJPEGErrorInvalidCode;
     *outFoundMarker = true;
-    return offset + dec->numBitBufReads;
+    return CurrentOffset(dec, offset);
 
     // found a marker
 gotMarker:;
-    fprintf(stderr, "Found unhandled marker\n");
-
+    dec->error = kJPEGErrorUnexpectedMarker;
     *outFoundMarker = true;
-    return offset + dec->numBitBufReads;
+    return CurrentOffset(dec, offset);
+}
+
+// MARK: Kernels
+/**
+ * Decodes entire lines of predictor 1 data from an unstuffed scan, for a fixed number of components and
+ * output mode.
+ *
+ * Since all arguments besides the decompressor are constants at each call site, this is inlined into
+ * one kernel per combination: components and their predictor values stay in registers, and each sample
+ * is decoded with a single table probe, an add and a store. The first column is predicted from the line
+ * above outside of the inner loop.
+ *
+ * @return Whether all lines up to the line limit were decoded; if not, one of the flags indicates why.
+ */
+static ALWAYS_INLINE bool DecodeLinesPredictor1(jpeg_decompressor_t *dec, const size_t nc,
+                                                const bool unsliced, bool *foundCode,
+                                                bool *foundMarker) {
+    jpeg_huffman_t *tables[4];
+    uint16_t pred[4];
+
+    for(size_t c = 0; c < nc; c++) {
+        tables[c] = dec->tables[dec->tableForComponent[c]];
+    }
+
+    const size_t lineWidth = dec->samplesPerLine * nc;
+
+    for(; dec->currentLine < dec->lineLimit; dec->currentLine++) {
+        uint16_t *out = dec->outBuf + (dec->currentLine * lineWidth);
+
+        for(size_t c = 0; c < nc; c++) {
+            pred[c] = dec->currentLine ? dec->lineStart[c] : dec->predictorDefault;
+        }
+
+        for(size_t sample = 0; sample < dec->samplesPerLine; sample++) {
+            for(size_t c = 0; c < nc; c++) {
+                const int delta = ReadDeltaUnstuffed(dec, tables[c], foundCode);
+
+                if(unlikely(!*foundCode)) {
+                    dec->currentSample = sample;
+                    return false;
+                }
+
+                pred[c] = (uint16_t) (pred[c] + delta);
+
+                if(unsliced) {
+                    WriteSample(dec, 0, pred[c]);
+                } else {
+                    out[c] = pred[c];
+                }
+            }
+
+            out += nc;
+
+            // remember the first column for the next line
+            if(sample == 0) {
+                for(size_t c = 0; c < nc; c++) {
+                    dec->lineStart[c] = pred[c];
+                }
+            }
+        }
+
+        // if the scan ended early, we ran into its marker
+        if(unlikely(BitstreamOverrun(dec))) {
+            *foundMarker = true;
+            return false;
+        }
+    }
+
+    for(size_t c = 0; c < nc; c++) {
+        dec->lastValue[c] = pred[c];
+    }
+
+    return true;
+}
+
+/**
+ * Decodes entire lines of data using one of predictors 2-7 from an unstuffed scan, for a fixed number of
+ * components and predictor.
+ *
+ * Samples are decoded into a line buffer, since the line above is needed for prediction, then copied
+ * to the output. As with the predictor 1 kernel, each combination of arguments is inlined into its own
+ * kernel so that the predictor is selected at compile time. Per ITU-T81 H.1.2.1, the first line uses
+ * predictor 1 and the first column of every other line uses predictor 2.
+ */
+static ALWAYS_INLINE bool DecodeLinesPredictorN(jpeg_decompressor_t *dec, const size_t nc,
+                                                const int algorithm, bool *foundCode,
+                                                bool *foundMarker) {
+    jpeg_huffman_t *tables[4];
+
+    for(size_t c = 0; c < nc; c++) {
+        tables[c] = dec->tables[dec->tableForComponent[c]];
+    }
+
+    const size_t lineWidth = dec->samplesPerLine * nc;
+
+    for(; dec->currentLine < dec->lineLimit; dec->currentLine++) {
+        uint16_t *cur = dec->curLine;
+        const uint16_t *prev = dec->prevLine;
+
+        // first column
+        for(size_t c = 0; c < nc; c++) {
+            const int delta = ReadDeltaUnstuffed(dec, tables[c], foundCode);
+            if(unlikely(!*foundCode)) return false;
+
+            const int pred = dec->currentLine ? prev[c] : dec->predictorDefault;
+            cur[c] = (uint16_t) (pred + delta);
+        }
+
+        // remaining columns
+        if(dec->currentLine == 0) {
+            for(size_t i = nc; i < lineWidth; i++) {
+                const int delta = ReadDeltaUnstuffed(dec, tables[i % nc], foundCode);
+                if(unlikely(!*foundCode)) return false;
+
+                cur[i] = (uint16_t) (cur[i - nc] + delta);
+            }
+        } else {
+            for(size_t i = nc; i < lineWidth; i++) {
+                const int delta = ReadDeltaUnstuffed(dec, tables[i % nc], foundCode);
+                if(unlikely(!*foundCode)) return false;
+
+                const int pred = PredictSample(algorithm, cur[i - nc], prev[i], prev[i - nc]);
+                cur[i] = (uint16_t) (pred + delta);
+            }
+        }
+
+        // if the scan ended early, we ran into its marker
+        if(unlikely(BitstreamOverrun(dec))) {
+            *foundMarker = true;
+            return false;
+        }
+
+        WriteLine(dec, cur, lineWidth);
+
+        for(size_t c = 0; c < nc; c++) {
+            dec->lineStart[c] = cur[c];
+            dec->lastValue[c] = cur[lineWidth - nc + c];
+        }
+
+        SwapLineBuffers(dec);
+    }
+
+    return true;
+}
+
+/**
+ * Invokes the predictor 2-7 kernel for the decompressor's predictor, with the given component count.
+ */
+static ALWAYS_INLINE bool DecodeLinesAnyPredictorN(jpeg_decompressor_t *dec, const size_t nc,
+                                                   bool *foundCode, bool *foundMarker) {
+    switch(dec->predictionAlgorithm) {
+        case 2:
+            return DecodeLinesPredictorN(dec, nc, 2, foundCode, foundMarker);
+        case 3:
+            return DecodeLinesPredictorN(dec, nc, 3, foundCode, foundMarker);
+        case 4:
+            return DecodeLinesPredictorN(dec, nc, 4, foundCode, foundMarker);
+        case 5:
+            return DecodeLinesPredictorN(dec, nc, 5, foundCode, foundMarker);
+        case 6:
+            return DecodeLinesPredictorN(dec, nc, 6, foundCode, foundMarker);
+        case 7:
+            return DecodeLinesPredictorN(dec, nc, 7, foundCode, foundMarker);
+
+        default:
+            return true;
+    }
+}
+
+/**
+ * Decodes lines using a kernel specialized for the image format, if there is one. This is only done
+ * from the start of a line in an unstuffed scan; otherwise, the generic decoder handles the image.
+ *
+ * @return Whether decoding should continue with the generic decoder
+ */
+static bool DecodeLinesSpecialized(jpeg_decompressor_t *dec, bool *foundCode, bool *foundMarker) {
+    if(!dec->readUnstuffed || dec->currentSample != 0) {
+        return true;
+    }
+
+    // predictors that use the line above
+    if(dec->predictionAlgorithm != 1) {
+        switch(dec->numComponents) {
+            case 2:
+                return DecodeLinesAnyPredictorN(dec, 2, foundCode, foundMarker);
+            case 4:
+                return DecodeLinesAnyPredictorN(dec, 4, foundCode, foundMarker);
+
+            default:
+                return true;
+        }
+    }
+
+    switch(dec->numComponents) {
+        case 2:
+            return dec->unsliceOutput ? DecodeLinesPredictor1(dec, 2, true, foundCode, foundMarker) :
+                                        DecodeLinesPredictor1(dec, 2, false, foundCode, foundMarker);
+        case 4:
+            return dec->unsliceOutput ? DecodeLinesPredictor1(dec, 4, true, foundCode, foundMarker) :
+                                        DecodeLinesPredictor1(dec, 4, false, foundCode, foundMarker);
+
+        // no specialized kernel available
+        default:
+            return true;
+    }
+}
+
+// MARK: Output
+/**
+ * Writes a decoded sample into the output buffer.
+ *
+ * @param offset Offset of the sample in the interleaved output; ignored when unslicing
+ */
+static inline void WriteSample(jpeg_decompressor_t *dec, size_t offset, uint16_t value) {
+    // interleaved output
+    if(!dec->unsliceOutput) {
+        dec->outBuf[offset] = value;
+        return;
+    }
+
+    // samples past the last slice have nowhere to go
+    if(unlikely(dec->writeFull)) {
+        dec->error = kJPEGErrorOutputOverrun;
+        return;
+    }
+
+    // write at the current unsliced position
+    dec->outBuf[dec->writeOff++] = value;
+
+    if(--dec->writeRunLeft == 0) {
+        UnsliceAdvance(dec);
+    }
+}
+
+/**
+ * Moves the unslicing write position to the start of the next slice line. Once the last line of a slice
+ * has been written, the first line of the next slice is started.
+ */
+static void UnsliceAdvance(jpeg_decompressor_t *dec) {
+    // go to the next line in the slice…
+    if(++dec->writeSliceLine == dec->lines) {
+        // …or the top of the next slice
+        dec->writeSliceLine = 0;
+        dec->writeSliceCol += dec->sliceWidth;
+
+        // past the last slice (or an empty last slice): any further samples are out of bounds
+        if(++dec->writeSlice > dec->numSlices ||
+           (dec->writeSlice == dec->numSlices && !dec->lastSliceWidth)) {
+            dec->writeFull = true;
+            dec->writeRunLeft = 0;
+            return;
+        }
+    }
+
+    dec->writeOff = (dec->writeSliceLine * dec->unslicedWidth) + dec->writeSliceCol;
+    dec->writeRunLeft = (dec->writeSlice < dec->numSlices) ? dec->sliceWidth : dec->lastSliceWidth;
+}
+
+/**
+ * Writes an entire line of interleaved samples to the output. For unsliced output, the line is split into
+ * runs that fall into the same slice line.
+ */
+static void WriteLine(jpeg_decompressor_t *dec, const uint16_t *samples, size_t count) {
+    // interleaved output
+    if(!dec->unsliceOutput) {
+        memcpy(dec->outBuf + (dec->currentLine * count), samples, count * sizeof(uint16_t));
+        return;
+    }
+
+    // copy runs until the next slice line
+    while(count) {
+        if(unlikely(dec->writeFull)) {
+            dec->error = kJPEGErrorOutputOverrun;
+            return;
+        }
+
+        const size_t run = (count < dec->writeRunLeft) ? count : dec->writeRunLeft;
+
+        memcpy(dec->outBuf + dec->writeOff, samples, run * sizeof(uint16_t));
+        samples += run;
+        count -= run;
+
+        dec->writeOff += run;
+        dec->writeRunLeft -= run;
+
+        if(dec->writeRunLeft == 0) {
+            UnsliceAdvance(dec);
+        }
+    }
+}
+
+/**
+ * Allocates the buffers for the current and previous lines, if needed.
+ */
+static int AllocLineBuffers(jpeg_decompressor_t *dec) {
+    if(dec->lineBuf) {
+        return 0;
+    }
+
+    const size_t lineWidth = dec->samplesPerLine * dec->numComponents;
+
+    dec->lineBuf = calloc(lineWidth * 2, sizeof(uint16_t));
+    if(!dec->lineBuf) return -1;
+
+    StageCountAllocation(dec->stats, lineWidth * 2 * sizeof(uint16_t));
+
+    dec->prevLine = dec->lineBuf;
+    dec->curLine = dec->lineBuf + lineWidth;
+
+    return 0;
+}
+
+/**
+ * Makes the line just decoded the previous line.
+ */
+static inline void SwapLineBuffers(jpeg_decompressor_t *dec) {
+    uint16_t *temp = dec->prevLine;
+    dec->prevLine = dec->curLine;
+    dec->curLine = temp;
 }
 
 // MARK: Predictors
 /**
  * Runs the appropriate predictor.
  *
+ * As specified in ITU-T81 H.1.2.1, the first sample of the first line is predicted from the default
+ * value, the rest of the first line from the sample to the left, and the first sample of every other
+ * line from the sample above it.
+ *
  * @param dec Decompressor instance
  * @param component Input image component we need prediction for
  * @param delta Signed delta value read from file
- * @param bufferOffset Offset into the output buffer for the current sample
  * @return Actual value
  */
-static uint16_t Predict(jpeg_decompressor_t *dec, int component, int delta, size_t bufferOffset) {
-    switch (dec->predictionAlgorithm) {
-        case 1:
-            return PredictorAlgo1(dec, component, delta, bufferOffset);
+static uint16_t Predict(jpeg_decompressor_t *dec, int component, int delta) {
+    int pred;
+    const size_t x = dec->currentSample;
 
-        // unimplemented predictor algorithm
-        default:
-            return 0;
+    if(x == 0) {
+        pred = dec->currentLine ? dec->lineStart[component] : dec->predictorDefault;
+    } else if(dec->currentLine == 0 || dec->predictionAlgorithm == 1) {
+        pred = dec->lastValue[component];
+    } else {
+        const size_t nc = dec->numComponents;
+
+        const int rb = dec->prevLine[(x * nc) + component];
+        const int rc = dec->prevLine[((x - 1) * nc) + component];
+
+        pred = PredictSample(dec->predictionAlgorithm, dec->lastValue[component], rb, rc);
     }
+
+    return (uint16_t) (pred + delta);
 }
 
 /**
- * Predicts the value of the current pixel in the given plane using prediction type 1 (difference from sample
- * directly to the left)
+ * Calculates the prediction for a sample from its neighbours to the left (a), above (b) and diagonally
+ * above-left (c), per table H.1 in ITU-T81. The algorithm is expected to be a constant, so that the
+ * selection is resolved at compile time.
  */
-static uint16_t PredictorAlgo1(jpeg_decompressor_t *dec, int component, int delta, size_t bufferOffset) {
-    uint16_t last = dec->predictorDefault;
+static ALWAYS_INLINE int PredictSample(const int algorithm, const int ra, const int rb, const int rc) {
+    switch(algorithm) {
+        case 1:
+            return ra;
+        case 2:
+            return rb;
+        case 3:
+            return rc;
+        case 4:
+            return ra + rb - rc;
+        case 5:
+            return ra + ((rb - rc) >> 1);
+        case 6:
+            return rb + ((ra - rc) >> 1);
+        case 7:
+            return (ra + rb) >> 1;
 
-    if (dec->currentSample > 0) {
-        last = dec->outBuf[bufferOffset + component - dec->numComponents];
+        // unimplemented predictor algorithm
+        default:
+            return 0;
     }
-
-    return (uint16_t) (((int) last) + delta);
 }
 
 // MARK: Huffman codes
 /**
- * Reads an entire 16-bit word and asks the Huffman table code to find the corresponding value and
- * bit length.
+ * Decodes the next Huffman code and its diff bits into a signed delta.
+ *
+ * The next bits are looked up in the table's primary lookup table, which for most codes yields the
+ * delta directly. Codes too long for it are resolved from the canonical code ranges, after which the
+ * diff bits are read separately.
  */
-static uint8_t ReadCodeFast(jpeg_decompressor_t *dec, jpeg_huffman_t *table, bool *found, bool *foundMarker) {
-    // outputs from the Huffman code
-    uint8_t value = 0;
-    size_t bitsRead;
+static int ReadDeltaFast(jpeg_decompressor_t *dec, jpeg_huffman_t *table, bool *found, bool *foundMarker) {
+    size_t bits, codeBits;
+    uint8_t value;
 
     // peek at the topmost 16 bits
     uint16_t next = BitstreamPeek(dec, 16, foundMarker);
     if (*foundMarker) return 0;
 
-    // perform the lookup
-    *found = JPEGHuffmanFind(table, next, &bitsRead, &value);
+    // probe the lookup table
+    const jpeg_huffman_lookup_t *entry = &table->lookup[next >> (16 - JPEG_HUFFMAN_LOOKUP_BITS)];
+
+    if (entry->length) {
+        *found = true;
+        BitstreamConsume(dec, entry->length);
 
-    if (*found) {
-        BitstreamConsume(dec, bitsRead);
+        if (!entry->diffBits) {
+            return entry->delta;
+        }
+        bits = entry->diffBits;
     }
+    // long code
+    else {
+        dec->treeWalks++;
 
-    return value;
+        *found = JPEGHuffmanFind(table, next, &codeBits, &value);
+        if (!*found) return 0;
+
+        BitstreamConsume(dec, codeBits);
+
+        bits = value;
+        if (bits == 0 || bits == 16) {
+            return JPEGHuffmanExtend(0, bits);
+        }
+    }
+
+    // read the diff bits
+    uint64_t rawDiff = BitstreamGet(dec, bits, foundMarker);
+    if (*foundMarker) return 0;
+
+    return JPEGHuffmanExtend((int) rawDiff, bits);
+}
+
+/**
+ * Decodes the next Huffman code and diff bits from an unstuffed scan. A single refill check up front
+ * guarantees enough bits for both the code and its diff bits.
+ */
+static ALWAYS_INLINE int ReadDeltaUnstuffed(jpeg_decompressor_t *dec, jpeg_huffman_t *table, bool *found) {
+    if(dec->bitCount < 32) {
+        BitstreamRefill(dec);
+    }
+
+    const jpeg_huffman_lookup_t *entry = &table->lookup[dec->bitBuf >> (64 - JPEG_HUFFMAN_LOOKUP_BITS)];
+
+    // common case: code and diff bits decoded in one go
+    if(likely(entry->length && !entry->diffBits)) {
+        *found = true;
+        BitstreamConsume(dec, entry->length);
+        return entry->delta;
+    }
+
+    // otherwise, this can't hit a marker
+    bool marker = false;
+    return ReadDeltaFast(dec, table, found, &marker);
 }
 
 /**
  * Tries to read a Huffman code from the current position in the stream.
  *
- * We peek at the contents of the read buffer bit by bit, until we've either matched a code, or read 16 total
- * bits (which indicates the code wasn't found)
+ * We read the stream bit by bit, checking the canonical code range of each length as we go, until we've
+ * either matched a code, or read 16 total bits (which indicates the code wasn't found)
  */
 static uint8_t ReadCode(jpeg_decompressor_t *dec, jpeg_huffman_t *table, bool *found, bool *foundMarker) {
-    jpeg_huffman_node_t *next = &table->root;
-
     size_t bitsRead = 0;
     uint16_t code = 0;
 
-    // iterate for as long as we've got a node
-    while (next) {
-        // abort if we've read 16 bits already
-        if (bitsRead == 16) {
-            goto failed;
-        }
-
-        // if this node is a leaf, return its value
-        if (next->children[0] == NULL && next->children[1] == NULL) {
-            *found = true;
-            return next->value;
-        }
+    dec->treeWalks++;
 
+    while (bitsRead < 16) {
         // read one more bit of code
         uint8_t bit = BitstreamGet(dec, 1, foundMarker);
         if (*foundMarker) goto failed;
@@ -485,19 +1315,17 @@ static uint8_t ReadCode(jpeg_decompressor_t *dec, jpeg_huffman_t *table, bool *f
         bitsRead += 1;
         code = (code << 1) | (bit & 0x01);
 
-        // right node is for 1 bit
-        if (bit != 0) {
-            next = next->children[1];
-        }
-        // left node is for 0 bit
-        else {
-            next = next->children[0];
+        // is it in the range of codes of this length?
+        const uint16_t index = code - table->firstCode[bitsRead];
+
+        if (table->numCodes[bitsRead] && code >= table->firstCode[bitsRead] &&
+            index < table->numCodes[bitsRead]) {
+            *found = true;
+            return table->values[table->firstIndex[bitsRead] + index];
         }
     }
 
 failed:;
-    fprintf(stderr, "Failed to find value for code: %04x (%zu bits, x = %zu, y = %zu)\n", code, bitsRead, dec->currentSample, dec->currentLine);
-
     // failed to find a code
     *found = false;
     return 0;
@@ -14,6 +14,23 @@
 
 // Forward declarations
 typedef struct jpeg_huffman jpeg_huffman_t;
+typedef struct stage_stats stage_stats_t;
+
+/**
+ * Reasons why decoding stopped before all samples of the image were decoded
+ */
+typedef enum jpeg_decompress_error {
+    /// No error occurred
+    kJPEGErrorNone = 0,
+    /// The line buffers needed by the predictor couldn't be allocated
+    kJPEGErrorNoMemory = 1,
+    /// The entropy coded data contained bits that don't match any code of the Huffman table
+    kJPEGErrorInvalidCode = 2,
+    /// A marker was found before all samples of the scan were decoded
+    kJPEGErrorUnexpectedMarker = 3,
+    /// More samples were decoded than the slices of the unsliced output hold; the extra ones were dropped
+    kJPEGErrorOutputOverrun = 4,
+} jpeg_decompress_error_t;
 
 /**
  * Decompressor state
@@ -35,6 +52,8 @@ typedef struct jpeg_decompressor {
     size_t currentLine;
     /// Current sample
     size_t currentSample;
+    // Line at which the current call to the decompressor stops
+    size_t lineLimit;
 
     /// Stride (bytes per row)
     size_t stride;
@@ -49,6 +68,41 @@ typedef struct jpeg_decompressor {
     /// Number of bytes in the output buffer
     size_t outBufSz;
 
+    /// When set, samples are written in unsliced (CR2 sensor) order rather than interleaved
+    bool unsliceOutput;
+    /// Number of full width slices
+    size_t numSlices;
+    /// Width of each full slice, in output samples
+    size_t sliceWidth;
+    /// Width of the last slice, in output samples
+    size_t lastSliceWidth;
+    /// Width of an unsliced output row, in samples
+    size_t unslicedWidth;
+
+    // Index of the slice currently being written
+    size_t writeSlice;
+    // Line inside the current slice
+    size_t writeSliceLine;
+    // First output column of the current slice
+    size_t writeSliceCol;
+    // Offset into the output buffer of the next sample
+    size_t writeOff;
+    // Samples left before the end of the current slice line
+    size_t writeRunLeft;
+    // Set once the last line of the last slice has been written; any further samples are dropped
+    bool writeFull;
+
+    // Most recently decoded value of each component, used for prediction
+    uint16_t lastValue[4];
+    // First sample of each component on the previous line, used to predict the first column
+    uint16_t lineStart[4];
+    // Storage for two lines of interleaved samples, used by predictors 2-7
+    uint16_t *lineBuf;
+    // Samples of the previous line
+    uint16_t *prevLine;
+    // Samples of the line being decoded
+    uint16_t *curLine;
+
     /// Address of JPEG data input buffer
     const void *inBuf;
     /// Number of bytes in that buffer
@@ -63,6 +117,26 @@ typedef struct jpeg_decompressor {
     // Number of bytes read to refill the bit buffer
     size_t numBitBufReads;
 
+    /// When set, the scan is unstuffed into a separate buffer before decoding
+    bool unstuffInput;
+    // Whether the bit reader currently reads from the unstuffed scan buffer
+    bool readUnstuffed;
+    // Unstuffed entropy coded data, followed by zero padding
+    uint8_t *scanBuf;
+    // Allocated size of the scan buffer
+    size_t scanBufSz;
+    // End of the unstuffed data in the scan buffer
+    uint8_t *scanEnd;
+    // Bytes of zero padding read past the end of the scan
+    size_t scanPadBytes;
+    // Offset of the marker terminating the scan in the input buffer
+    size_t scanMarkerOffset;
+
+    // Set when decoding stopped at a line limit, and will continue from the current bit position
+    bool paused;
+    // Offset passed to the call that started decoding the scan
+    size_t pausedOffset;
+
     // Reached EoF
     bool reachedEoF;
     // Finished decoding
@@ -72,6 +146,18 @@ typedef struct jpeg_decompressor {
     uint8_t predictionAlgorithm;
     // Default value for predictor
     uint16_t predictorDefault;
+
+    /// If set, decoding time and events are recorded into these stats
+    stage_stats_t *stats;
+    // Slow path bit buffer refills during the current call; added to the stats when it returns
+    size_t slowRefills;
+    // Codes resolved without the lookup table during the current call
+    size_t treeWalks;
+
+    /// Why the last call stopped before the end of the image, if it did
+    jpeg_decompress_error_t error;
+    /// Offset into the input buffer at which the error occurred
+    size_t errorOffset;
 } jpeg_decompressor_t;
 
 /**
@@ -79,6 +165,19 @@ typedef struct jpeg_decompressor {
  */
 jpeg_decompressor_t *JPEGDecompressorNew(size_t cols, size_t rows, uint8_t bits, size_t components);
 
+/**
+ * Resets a decompressor so it can decode another image of the given size, keeping any buffers that can be
+ * reused. The decompressor must not be referenced anywhere else.
+ */
+int JPEGDecompressorReset(jpeg_decompressor_t *dec, size_t cols, size_t rows, uint8_t bits,
+                          size_t components);
+
+/**
+ * Frees the scan and line buffers once decoding has finished, so an idle decompressor holds on to as little
+ * memory as possible.
+ */
+int JPEGDecompressorReleaseBuffers(jpeg_decompressor_t *dec);
+
 /**
  * Deallocates a previously allocated JPEG decompressor. Internal state (such as Huffman tables) are
  * released automatically, but bit planes are not.
@@ -102,6 +201,29 @@ int JPEGDecompressorAddTable(jpeg_decompressor_t *dec, size_t slot, jpeg_huffman
  */
 int JPEGDecompressorSetOutput(jpeg_decompressor_t *dec, void *plane, size_t length);
 
+/**
+ * Sets an output bit plane that receives the image in unsliced order, as used by Canon RAW files.
+ *
+ * Rather than writing samples into an interleaved buffer that must later be unsliced, each decoded
+ * sample is placed directly at its final position in the sensor layout.
+ *
+ * If the slices are narrower than the frame, the columns to their right aren't written; decoding then fails
+ * with `kJPEGErrorOutputOverrun` once they're full, rather than writing past them.
+ *
+ * @param slices Slicing info (tag 0xc640): number of full slices, width of each slice and width of
+ * the last slice, in output samples. A last slice width of 0 extends it to the right edge of the frame.
+ */
+int JPEGDecompressorSetUnslicedOutput(jpeg_decompressor_t *dec, void *plane, size_t length,
+                                      const uint16_t *slices);
+
+/**
+ * Enables or disables unstuffing of the entropy coded data before decoding.
+ *
+ * When enabled, the scan is searched for its terminating marker and copied with all stuffed 0xFF00
+ * pairs removed before decoding begins. This lets the bit reader refill without checking every byte.
+ */
+int JPEGDecompressorSetUnstuffInput(jpeg_decompressor_t *dec, bool unstuff);
+
 /**
  * Sets the table index to use for decoding a particular plane.
  */
@@ -112,6 +234,12 @@ int JPEGDecompressorSetTableForPlane(jpeg_decompressor_t *dec, size_t plane, siz
  */
 int JPEGDecompressorSetPredictionAlgo(jpeg_decompressor_t *dec, uint8_t algorithm);
 
+/**
+ * Sets the stats into which decoding time, slow path events and errors are recorded, or NULL to stop
+ * recording. The stats must stay valid as long as they're set.
+ */
+int JPEGDecompressorSetStats(jpeg_decompressor_t *dec, stage_stats_t *stats);
+
 
 /**
  * Indicate whether the decompressor has written data for every sample.
@@ -119,10 +247,38 @@ int JPEGDecompressorSetPredictionAlgo(jpeg_decompressor_t *dec, uint8_t algorith
 bool JPEGDecompressorIsDone(jpeg_decompressor_t *dec);
 
 
+/**
+ * Gets the number of lines at the top of the output that have been completely written.
+ *
+ * For unsliced output, a line is only complete once its part of the final slice has been decoded, so this
+ * stays at zero until the decompressor reaches the last slice.
+ */
+size_t JPEGDecompressorCompletedLines(jpeg_decompressor_t *dec);
+
+/**
+ * Gets the number of columns at the left of the output that have been written for every line. For unsliced
+ * output, these are the columns of all slices decoded so far.
+ */
+size_t JPEGDecompressorCompletedColumns(jpeg_decompressor_t *dec);
+
+
 /**
  * Decompresses image data from the given offset until either the end of the data is reached, or a marker
  * is discovered.
+ *
+ * If decoding stops before the end of the image because of an error, the marker flag is set and the error
+ * is stored in the decompressor (and its stats, if any).
  */
 size_t JPEGDecompressorGo(jpeg_decompressor_t *dec, size_t offset, bool *outFoundMarker);
 
+/**
+ * Decompresses at most the given number of lines of image data, stopping early at the end of the data or
+ * a marker.
+ *
+ * If the previous call stopped because it reached its line limit, decoding continues exactly where it left
+ * off and the offset is ignored; this allows the output to be consumed while the image is decoded.
+ */
+size_t JPEGDecompressorGoLines(jpeg_decompressor_t *dec, size_t offset, size_t maxLines,
+                               bool *outFoundMarker);
+
 #endif /* PAPER_JPEG_DECOMPRESS_H */
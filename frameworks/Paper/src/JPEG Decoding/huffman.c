@@ -8,25 +8,42 @@
 #include "huffman.h"
 
 #include <stdlib.h>
-#include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
-static void ReleaseChildren(jpeg_huffman_node_t *node);
-static jpeg_huffman_node_t *MakeNode(void);
+static int AddLookupEntries(jpeg_huffman_t *huff, uint16_t code, size_t bits, uint8_t value);
+static uint64_t HashDHT(const uint8_t counts[16], const uint8_t *values, size_t numValues);
 
 // MARK: - Constants
+/// Number of tables held by the table cache
+#define kCacheSize 16
+
 /**
- * Table used to reverse the bits in an integer Very Fast™
- *
- * Source: https://graphics.stanford.edu/~seander/bithacks.html#ReverseByteWith64BitsDiv
+ * Entry in the table cache
  */
-static const unsigned char BitReverseTable256[256] = {
-#   define R2(n)     n,     n + 2*64,     n + 1*64,     n + 3*64
-#   define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
-#   define R6(n) R4(n), R4(n + 2*4 ), R4(n + 1*4 ), R4(n + 3*4 )
-    R6(0), R6(2), R6(1), R6(3)
-};
+typedef struct jpeg_huffman_cache_entry {
+    /// Table for this entry, or NULL if the entry is unused
+    jpeg_huffman_t *table;
+    /// Value of the cache clock when this entry was last used
+    uint64_t lastUse;
+
+    /// Hash of the DHT contents
+    uint64_t hash;
+    /// Number of codes of each length
+    uint8_t counts[16];
+    /// Values of all codes
+    uint8_t values[256];
+    /// Number of values
+    size_t numValues;
+} jpeg_huffman_cache_entry_t;
+
+/// Lock protecting the table cache
+static pthread_mutex_t gCacheLock = PTHREAD_MUTEX_INITIALIZER;
+/// All cached tables
+static jpeg_huffman_cache_entry_t gCache[kCacheSize];
+/// Incremented on every cache access, to find the least recently used entry
+static uint64_t gCacheClock = 0;
 
 // MARK: - Initialization
 /**
@@ -37,29 +54,63 @@ jpeg_huffman_t *JPEGHuffmanNew(void) {
     jpeg_huffman_t *out = malloc(sizeof(jpeg_huffman_t));
     if(!out) return NULL;
 
-    memset((void*) &out->root, 0, sizeof(jpeg_huffman_node_t));
-    memset(out->table, 0xFF, 0x10000 * sizeof(uint16_t));
+    memset(out, 0, sizeof(jpeg_huffman_t));
 
-    out->refCount = 1;
+    atomic_init(&out->refCount, 1);
 
     // done!
     return out;
 }
 
 /**
- * Releases a previously allocated Huffman table.
+ * Builds an immutable Huffman table from the contents of a DHT segment. Codes are generated in canonical
+ * order, as described in ITU-T81 section C.2.
  */
-jpeg_huffman_t *JPEGHuffmanRelease(jpeg_huffman_t *huff) {
-    assert(huff);
+jpeg_huffman_t *JPEGHuffmanNewFromDHT(const uint8_t counts[16], const uint8_t *values, size_t numValues) {
+    assert(counts);
+    assert(values || !numValues);
+
+    // validate the number of values
+    size_t total = 0;
+    for(size_t i = 0; i < 16; i++) {
+        total += counts[i];
+    }
+    if(total != numValues || numValues > 256) {
+        return NULL;
+    }
+
+    jpeg_huffman_t *huff = JPEGHuffmanNew();
+    if(!huff) return NULL;
 
-    // release children
-    if(--huff->refCount == 0) {
-        for(int i = 0; i < 2; i++) {
-            if(huff->root.children[i]) {
-                ReleaseChildren(huff->root.children[i]);
+    // add each code; codes of one length are consecutive, and the next length starts one bit further
+    uint32_t code = 0;
+    size_t valueIdx = 0;
+
+    for(size_t bits = 1; bits <= 16; bits++) {
+        for(size_t i = 0; i < counts[bits - 1]; i++) {
+            if(code >= (1U << bits) ||
+               JPEGHuffmanAdd(huff, (uint16_t) code, bits, values[valueIdx++]) != 0) {
+                JPEGHuffmanRelease(huff);
+                return NULL;
             }
+
+            code++;
         }
 
+        code <<= 1;
+    }
+
+    huff->immutable = true;
+    return huff;
+}
+
+/**
+ * Releases a previously allocated Huffman table.
+ */
+jpeg_huffman_t *JPEGHuffmanRelease(jpeg_huffman_t *huff) {
+    assert(huff);
+
+    if(atomic_fetch_sub_explicit(&huff->refCount, 1, memory_order_acq_rel) == 1) {
         free(huff);
         return NULL;
     }
@@ -73,102 +124,198 @@ jpeg_huffman_t *JPEGHuffmanRelease(jpeg_huffman_t *huff) {
 jpeg_huffman_t *JPEGHuffmanRetain(jpeg_huffman_t *huff) {
     assert(huff);
 
-    huff->refCount++;
+    atomic_fetch_add_explicit(&huff->refCount, 1, memory_order_relaxed);
     return huff;
 }
 
+// MARK: - Table cache
 /**
- * Releases the memory held by all children of this node, recursively.
+ * Gets an immutable table for the contents of a DHT segment from the table cache.
+ *
+ * The table is built outside of the lock; if another thread inserted the same table in the meantime, the
+ * cached table wins so all decompressors share one copy.
  */
-static void ReleaseChildren(jpeg_huffman_node_t *node) {
-    // release its children, if any
-    for(int i = 0; i < 2; i++) {
-        if(node->children[i]) {
-            ReleaseChildren(node->children[i]);
+jpeg_huffman_t *JPEGHuffmanCacheGet(const uint8_t counts[16], const uint8_t *values, size_t numValues) {
+    assert(counts);
+
+    if(numValues > 256) return NULL;
+
+    const uint64_t hash = HashDHT(counts, values, numValues);
+    jpeg_huffman_t *table = NULL, *evicted = NULL;
+
+    // find an existing entry
+    pthread_mutex_lock(&gCacheLock);
+
+    for(size_t i = 0; i < kCacheSize; i++) {
+        jpeg_huffman_cache_entry_t *entry = &gCache[i];
+
+        if(entry->table && entry->hash == hash && entry->numValues == numValues &&
+           !memcmp(entry->counts, counts, 16) && !memcmp(entry->values, values, numValues)) {
+            entry->lastUse = ++gCacheClock;
+            table = JPEGHuffmanRetain(entry->table);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&gCacheLock);
+
+    if(table) return table;
+
+    // build the table, then insert it in place of the least recently used entry
+    table = JPEGHuffmanNewFromDHT(counts, values, numValues);
+    if(!table) return NULL;
+
+    pthread_mutex_lock(&gCacheLock);
+
+    jpeg_huffman_cache_entry_t *slot = &gCache[0];
+
+    for(size_t i = 0; i < kCacheSize; i++) {
+        jpeg_huffman_cache_entry_t *entry = &gCache[i];
+
+        if(entry->table && entry->hash == hash && entry->numValues == numValues &&
+           !memcmp(entry->counts, counts, 16) && !memcmp(entry->values, values, numValues)) {
+            entry->lastUse = ++gCacheClock;
+
+            evicted = table;
+            table = JPEGHuffmanRetain(entry->table);
+            slot = NULL;
+            break;
+        }
+
+        if(!entry->table || (slot->table && entry->lastUse < slot->lastUse)) {
+            slot = entry;
         }
     }
 
-    // finally, release the node itself
-    free(node);
+    if(slot) {
+        evicted = slot->table;
+
+        slot->table = JPEGHuffmanRetain(table);
+        slot->lastUse = ++gCacheClock;
+        slot->hash = hash;
+        slot->numValues = numValues;
+        memcpy(slot->counts, counts, 16);
+        memcpy(slot->values, values, numValues);
+    }
+
+    pthread_mutex_unlock(&gCacheLock);
+
+    if(evicted) {
+        JPEGHuffmanRelease(evicted);
+    }
+
+    return table;
 }
 
-// MARK: - Tree manipulation
 /**
- * Creates a new tree node.
+ * Removes all tables from the cache.
  */
-static jpeg_huffman_node_t *MakeNode() {
-    jpeg_huffman_node_t *n = malloc(sizeof(jpeg_huffman_node_t));
-    if(!n) return NULL;
+void JPEGHuffmanCachePurge(void) {
+    jpeg_huffman_t *tables[kCacheSize];
+    size_t numTables = 0;
+
+    pthread_mutex_lock(&gCacheLock);
+
+    for(size_t i = 0; i < kCacheSize; i++) {
+        if(gCache[i].table) {
+            tables[numTables++] = gCache[i].table;
+            gCache[i].table = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&gCacheLock);
 
-    memset(n, 0, sizeof(jpeg_huffman_node_t));
+    for(size_t i = 0; i < numTables; i++) {
+        JPEGHuffmanRelease(tables[i]);
+    }
+}
+
+/**
+ * Hashes the contents of a DHT segment (64-bit FNV-1a)
+ */
+static uint64_t HashDHT(const uint8_t counts[16], const uint8_t *values, size_t numValues) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
 
-    return n;
+    for(size_t i = 0; i < 16; i++) {
+        hash = (hash ^ counts[i]) * 0x100000001b3ULL;
+    }
+    for(size_t i = 0; i < numValues; i++) {
+        hash = (hash ^ values[i]) * 0x100000001b3ULL;
+    }
 
+    return hash;
 }
 
+// MARK: - Table building
 /**
  * Adds a codeword to the Huffman table.
  */
 int JPEGHuffmanAdd(jpeg_huffman_t *huff, uint16_t inCode, size_t bits, uint8_t value) {
     // validate inputs
     assert(huff);
-    assert(bits <= 16);
-
-    // start at the root of the tree
-    jpeg_huffman_node_t *next = &huff->root;
-
-    // the code should be built in reverse
-    uint16_t code =
-        (BitReverseTable256[(inCode >> 0) & 0xff] << 8) |
-        (BitReverseTable256[(inCode >> 8) & 0xff]);
-    code >>= (16 - bits);
-
-    // iterate over the code to add nodes
-    for (int i = 1; i <= bits; i++) {
-        // extract next bit of codeword
-        uint8_t lsb = (code & 0x0001);
-        code >>= 1;
-
-        // adding a leaf node here?
-        if (i == bits) {
-            jpeg_huffman_node_t *new = MakeNode();
-            new->value = value;
-            next->children[lsb] = new;
-        }
-        // otherwise, continue down the tree
-        else {
-            // is there a child for the bit value?
-            if (next->children[lsb]) {
-                next = next->children[lsb];
-            }
-            // create one
-            else {
-                jpeg_huffman_node_t *new = MakeNode();
-                next->children[lsb] = new;
-                next = new;
-            }
-        }
+    assert(!huff->immutable);
+    assert(bits >= 1 && bits <= 16);
+
+    // record it in the canonical code ranges; codes of one length must be consecutive
+    if(bits < huff->lastLength || huff->numValues == 256) {
+        return -1;
+    }
+
+    if(huff->numCodes[bits] == 0) {
+        huff->firstCode[bits] = inCode;
+        huff->firstIndex[bits] = huff->numValues;
+    } else if(inCode != (huff->firstCode[bits] + huff->numCodes[bits])) {
+        return -1;
     }
 
-    // insert it into the table
-    size_t numFillBits = (16 - bits);
-    uint16_t shiftedCode = inCode << numFillBits;
+    huff->numCodes[bits]++;
+    huff->values[huff->numValues++] = value;
+    huff->lastLength = bits;
+
+    // short codes also go into the lookup table
+    if(bits <= JPEG_HUFFMAN_LOOKUP_BITS) {
+        return AddLookupEntries(huff, inCode, bits, value);
+    }
+
+    // successfully added
+    return 0;
+}
 
-//    printf("Right aligned 0x%04x: 0x%04x (num bits: %zu)\n", inCode, shiftedCode, numFillBits);
+/**
+ * Fills all lookup table entries whose index starts with the given code. When the diff bits following
+ * the code fit in the remainder of the index, the delta is decoded as well.
+ */
+static int AddLookupEntries(jpeg_huffman_t *huff, uint16_t code, size_t bits, uint8_t value) {
+    const size_t numFillBits = (JPEG_HUFFMAN_LOOKUP_BITS - bits);
+    const size_t shiftedCode = ((size_t) code) << numFillBits;
 
-    for(size_t i = 0; i < (1 << numFillBits); i++) {
-        uint16_t index = shiftedCode | i;
+    for(size_t i = 0; i < ((size_t) 1 << numFillBits); i++) {
+        jpeg_huffman_lookup_t *entry = &huff->lookup[shiftedCode | i];
 
-        if(huff->table[index] != 0xFFFF) {
-            printf("Value at index 0x%04x (code 0x%04x, %zu bits): 0x%04x\n",
-                   index, code, bits, huff->table[index]);
+        // codes overlap, so the table is invalid
+        if(entry->length) {
             return -1;
         }
 
-        huff->table[index] = (bits << 8) | value;
+        // no diff bits follow (a value of 16 implies a delta of 32768)
+        if(value == 0 || value == 16) {
+            entry->length = bits;
+            entry->delta = (value == 16) ? INT16_MIN : 0;
+        }
+        // the diff bits are part of the index
+        else if((bits + value) <= JPEG_HUFFMAN_LOOKUP_BITS) {
+            const int raw = (int) ((i >> (numFillBits - value)) & ((1 << value) - 1));
+
+            entry->length = bits + value;
+            entry->delta = JPEGHuffmanExtend(raw, value);
+        }
+        // diff bits must be read separately
+        else {
+            entry->length = bits;
+            entry->diffBits = value;
+        }
     }
 
-    // successfully added
     return 0;
 }
 
@@ -179,14 +326,16 @@ int JPEGHuffmanAdd(jpeg_huffman_t *huff, uint16_t inCode, size_t bits, uint8_t v
 bool JPEGHuffmanFind(jpeg_huffman_t *huff, uint16_t code, size_t *bitsRead, uint8_t *value) {
     assert(huff);
 
-    // read table entry
-    uint16_t entry = huff->table[code];
+    // check the code ranges for each length, shortest first
+    for(size_t bits = 1; bits <= 16; bits++) {
+        const uint16_t prefix = code >> (16 - bits);
+        const uint16_t index = prefix - huff->firstCode[bits];
 
-    // we found something
-    if(entry != 0xFFFF) {
-        if(bitsRead) *bitsRead = (entry >> 8);
-        if(value) *value = (entry & 0x00FF);
-        return true;
+        if(huff->numCodes[bits] && prefix >= huff->firstCode[bits] && index < huff->numCodes[bits]) {
+            if(bitsRead) *bitsRead = bits;
+            if(value) *value = huff->values[huff->firstIndex[bits] + index];
+            return true;
+        }
     }
 
     // failed to find the code
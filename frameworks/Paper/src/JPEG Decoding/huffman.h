@@ -11,28 +11,58 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdatomic.h>
+
+/// Number of bits used to index the primary lookup table
+#define JPEG_HUFFMAN_LOOKUP_BITS 11
 
 /**
- * Single node in a Huffman tree
+ * Entry in the primary lookup table of a Huffman table.
+ *
+ * If both the code and the diff bits following it fit in the index, the entry is fully decoded: `diffBits`
+ * is 0 and `delta` holds the signed difference. Otherwise, only the code was decoded and another
+ * `diffBits` bits need to be read from the stream. An entry with a length of 0 is a code longer than the
+ * lookup table.
  */
-typedef struct jpeg_huffman_node {
-    /// Node value
-    uint8_t value;
-
-    /// Children: index by bit value
-    struct jpeg_huffman_node *children[2];
-} jpeg_huffman_node_t;
+typedef struct jpeg_huffman_lookup {
+    /// Total number of bits consumed by this entry
+    uint8_t length;
+    /// Number of diff bits that still have to be read
+    uint8_t diffBits;
+    /// Decoded delta (modulo 2^16) when no diff bits remain
+    int16_t delta;
+} jpeg_huffman_lookup_t;
 
 /**
- * Huffman decoding table; this is a thin wrapper around a tree of code words.
+ * Huffman decoding table.
+ *
+ * Short codes are decoded with a single probe of the lookup table. Longer codes are found from the
+ * canonical code ranges of each length, as described in ITU-T81 section F.2.2.3.
+ *
+ * Tables built from a DHT segment with `JPEGHuffmanNewFromDHT` or taken from the cache are immutable, and
+ * may be shared between decompressors on any number of threads.
  */
 typedef struct jpeg_huffman {
     /// Reference count
-    size_t refCount;
-    /// Root node
-    jpeg_huffman_node_t root;
-    /// Symbol table: 0xFFFF means invalid
-    uint16_t table[0x10000];
+    atomic_size_t refCount;
+    /// When set, no more codes may be added
+    bool immutable;
+
+    /// Primary lookup table, indexed by the next bits in the stream
+    jpeg_huffman_lookup_t lookup[1 << JPEG_HUFFMAN_LOOKUP_BITS];
+
+    /// Number of codes of each length (1-16)
+    uint16_t numCodes[17];
+    /// First (smallest) code of each length
+    uint16_t firstCode[17];
+    /// Index into the value table of the first code of each length
+    uint16_t firstIndex[17];
+    /// Values for all codes, in canonical order
+    uint8_t values[256];
+    /// Number of values in the table
+    size_t numValues;
+    /// Length of the most recently added code
+    size_t lastLength;
 } jpeg_huffman_t;
 
 
@@ -42,6 +72,31 @@ typedef struct jpeg_huffman {
  */
 jpeg_huffman_t *JPEGHuffmanNew(void);
 
+/**
+ * Builds an immutable Huffman table from the contents of a DHT segment.
+ *
+ * @param counts Number of codes of each length (Li), from 1 to 16 bits
+ * @param values Values for all codes (Vij), in the order they appear in the segment
+ * @param numValues Number of values; must be the sum of all counts
+ * @return Table, or NULL if the segment is invalid or allocation failed
+ */
+jpeg_huffman_t *JPEGHuffmanNewFromDHT(const uint8_t counts[16], const uint8_t *values, size_t numValues);
+
+/**
+ * Gets an immutable table for the contents of a DHT segment from the process-wide table cache, building
+ * and inserting it if needed. Files from the same camera body tend to share their tables, so this is
+ * usually just a hash lookup.
+ *
+ * The arguments are the same as for `JPEGHuffmanNewFromDHT`. The returned table is retained, and must
+ * be released by the caller.
+ */
+jpeg_huffman_t *JPEGHuffmanCacheGet(const uint8_t counts[16], const uint8_t *values, size_t numValues);
+
+/**
+ * Removes all tables from the cache. Tables still in use remain valid until they're released.
+ */
+void JPEGHuffmanCachePurge(void);
+
 /**
  * Releases a previously allocated Huffman table.
  */
@@ -53,7 +108,8 @@ jpeg_huffman_t *JPEGHuffmanRelease(jpeg_huffman_t *huff);
 jpeg_huffman_t *JPEGHuffmanRetain(jpeg_huffman_t *huff);
 
 /**
- * Adds a codeword to the Huffman table.
+ * Adds a codeword to the Huffman table. Codes must be added in canonical order, as they are stored in
+ * a DHT segment, and the table must not be immutable.
  */
 int JPEGHuffmanAdd(jpeg_huffman_t *huff, uint16_t code, size_t bits, uint8_t value);
 
@@ -63,4 +119,19 @@ int JPEGHuffmanAdd(jpeg_huffman_t *huff, uint16_t code, size_t bits, uint8_t val
  */
 bool JPEGHuffmanFind(jpeg_huffman_t *huff, uint16_t code, size_t *bitsRead, uint8_t *value);
 
+/**
+ * Converts the diff bits following a code into a signed delta, as described in ITU-T81 section F.2.2.1.
+ * A bit count of 16 has no diff bits and always indicates a delta of 32768.
+ */
+static inline int JPEGHuffmanExtend(int raw, size_t bits) {
+    if(bits == 0) return 0;
+    if(bits == 16) return 32768;
+
+    // values with the top bit clear are negative
+    if(raw < (1 << (bits - 1))) {
+        return raw - (1 << bits) + 1;
+    }
+    return raw;
+}
+
 #endif /* JPEG_HUFFMAN_H */
@@ -12,8 +12,18 @@
 #import "CJPEGDecompressor.h"
 #import "CJPEGHuffmanTable.h"
 
+// buffer reuse between decodes
+#import "PAPDecodeContext.h"
+
+// per stage timings of decodes
+#import "PAPDecodeStats.h"
+
+// caching of decoded sensor data
+#import "PAPRawPacker.h"
+
 // CR2
 #import "CR2Unslicer.h"
+#import "CR2RawStream.h"
 
 // LibRaw reading
 #import "PAPLibRawReader.h"
@@ -0,0 +1,461 @@
+//
+//  CR2PreviewReader.swift
+//  Paper (macOS)
+//
+//  Created by Tristan Seifert on 20200909.
+//
+
+import Foundation
+import ImageIO
+import OSLog
+
+/**
+ * Reads the embedded JPEG previews of many CR2 files, touching only the bytes needed to find and read them.
+ *
+ * Rather than mapping and parsing the whole file, each preview is found with a few small reads: the file header, IFD0 (which
+ * points to the 1/4 size preview) and IFD1 (which points to the 160x120 thumbnail), followed by a single read of the chosen
+ * JPEG. All reads are asynchronous, and several files are read at once, so previews of a card or network volume stream in
+ * at roughly the speed of the device's seeks instead of its throughput.
+ */
+public class CR2PreviewReader {
+    fileprivate static var logger = Logger(subsystem: Bundle(for: CR2PreviewReader.self).bundleIdentifier!,
+                                         category: "CR2PreviewReader")
+
+    /// Shared reader, used for import previews
+    public static let shared = CR2PreviewReader()
+
+    /// Largest size (in pixels) for which the small thumbnail in IFD1 is used, rather than the preview in IFD0
+    public static let smallThumbSize: CGFloat = 160
+    /// Number of bytes read for an IFD at first; this covers the entries of all IFDs written by Canon cameras
+    private static let ifdReadLength = 2048
+
+    /// Maximum number of files read at the same time
+    private(set) public var maxConcurrentFiles: Int
+    /// Queue on which requests are scheduled and reads complete
+    private let queue = DispatchQueue(label: "CR2PreviewReader", qos: .utility)
+    /// Queue on which the previews are decoded
+    private let decodeQueue = DispatchQueue(label: "CR2PreviewReader.decode", qos: .utility,
+                                            attributes: .concurrent)
+
+    /// Requests that haven't been started yet, oldest first
+    private var pending: [Request] = []
+    /// Number of files currently being read
+    private var active: Int = 0
+
+    // MARK: - Initialization
+    /**
+     * Creates a preview reader that reads at most the given number of files at once.
+     */
+    public init(maxConcurrentFiles: Int = 8) {
+        precondition(maxConcurrentFiles > 0, "Must read at least one file at a time")
+        self.maxConcurrentFiles = maxConcurrentFiles
+    }
+
+    // MARK: - Requests
+    /**
+     * Reads the preview of a CR2 file, decoding it so that its larger edge is at most the given size.
+     *
+     * - Parameter maxSize: Maximum size of the decoded preview, in pixels. Sizes up to `smallThumbSize` are read from the
+     * small thumbnail where possible.
+     * - Parameter handler: Invoked on the given queue once the preview is read, unless the request is cancelled first
+     * - Returns: Request object; cancel it if the preview is no longer needed
+     */
+    @discardableResult
+    public func read(_ url: URL, maxSize: CGFloat, queue: DispatchQueue = .main,
+                     _ handler: @escaping (Result<CGImage, Error>) -> Void) -> Request {
+        return self.read([url], maxSize: maxSize, queue: queue, { _, result in handler(result) }).first!
+    }
+
+    /**
+     * Reads the previews of a batch of CR2 files. They are read in order, with several files in flight at once.
+     *
+     * - Parameter handler: Invoked on the given queue once each preview is read, with the url of the file
+     * - Returns: A request for each file, in the same order as the urls
+     */
+    @discardableResult
+    public func read(_ urls: [URL], maxSize: CGFloat, queue: DispatchQueue = .main,
+                     _ handler: @escaping (URL, Result<CGImage, Error>) -> Void) -> [Request] {
+        let requests = urls.map({ Request(reader: self, url: $0, maxSize: maxSize, queue: queue, handler: handler) })
+
+        self.queue.async {
+            self.pending.append(contentsOf: requests)
+            self.startPending()
+        }
+
+        return requests
+    }
+
+    /**
+     * Starts reading pending files, up to the concurrency limit.
+     */
+    private func startPending() {
+        while self.active < self.maxConcurrentFiles, !self.pending.isEmpty {
+            let request = self.pending.removeFirst()
+            guard !request.isCancelled else {
+                continue
+            }
+
+            self.active += 1
+            self.readPreview(request) { result in
+                self.active -= 1
+                request.complete(result)
+
+                self.startPending()
+            }
+        }
+    }
+
+    /**
+     * Removes a cancelled request that hasn't been started yet.
+     */
+    fileprivate func cancel(_ request: Request) {
+        self.queue.async {
+            self.pending.removeAll(where: { $0 === request })
+        }
+    }
+
+    // MARK: - Reading
+    /**
+     * Finds, reads and decodes the preview of a single file. The completion is invoked on the reader's queue.
+     */
+    private func readPreview(_ request: Request, _ completion: @escaping (Result<CGImage, Error>) -> Void) {
+        let fd = open(request.url.path, O_RDONLY)
+        guard fd >= 0 else {
+            return completion(.failure(Errors.openFailed(errno: errno)))
+        }
+
+        let file = FileReader(fd: fd, queue: self.queue)
+
+        // the header has the byte order and the offset of IFD0
+        file.read(0, 16) { result in
+            do {
+                let header = try result.get()
+                let order = try Self.validateHeader(header)
+
+                let ifd0Off: UInt32 = header.readEndian(4, order)
+                self.readIfd(file, Int(ifd0Off), order) { result in
+                    do {
+                        let ifd0 = try result.get()
+                        let range = try self.previewRange(file, ifd0, order, request, completion)
+
+                        if let range = range {
+                            self.readJpeg(file, range, request, completion)
+                        }
+                    } catch {
+                        completion(.failure(error))
+                    }
+                }
+            } catch {
+                completion(.failure(error))
+            }
+        }
+    }
+
+    /**
+     * Determines which JPEG to read. For small sizes, this reads IFD1 to find the small thumbnail; the preview in IFD0 is
+     * used otherwise, or if there's no thumbnail.
+     *
+     * - Returns: Byte range of the JPEG data, or `nil` if IFD1 is read first; it then continues reading the preview itself.
+     */
+    private func previewRange(_ file: FileReader, _ ifd0: IFD, _ order: Data.ByteOrder, _ request: Request,
+                              _ completion: @escaping (Result<CGImage, Error>) -> Void) throws -> Range<Int>? {
+        let preview = ifd0.range(offsetTag: 0x0111, lengthTag: 0x0117)
+
+        guard request.maxSize <= Self.smallThumbSize, ifd0.next != 0, !request.isCancelled else {
+            guard let range = preview else {
+                throw Errors.missingPreview
+            }
+            return range
+        }
+
+        self.readIfd(file, ifd0.next, order) { result in
+            let thumb = (try? result.get())?.range(offsetTag: 0x0201, lengthTag: 0x0202)
+
+            guard let range = thumb ?? preview else {
+                return completion(.failure(Errors.missingPreview))
+            }
+            self.readJpeg(file, range, request, completion)
+        }
+
+        return nil
+    }
+
+    /**
+     * Reads an IFD's entries. Most IFDs fit into the first read; larger ones are read again in full.
+     */
+    private func readIfd(_ file: FileReader, _ offset: Int, _ order: Data.ByteOrder,
+                         _ completion: @escaping (Result<IFD, Error>) -> Void) {
+        file.read(offset, Self.ifdReadLength) { result in
+            do {
+                let data = try result.get()
+                guard data.count >= 2 else {
+                    throw Errors.truncatedIfd
+                }
+
+                let count: UInt16 = data.readEndian(0, order)
+                let length = 2 + (Int(count) * 12) + 4
+
+                if data.count >= length {
+                    return completion(.success(IFD(data, order)))
+                } else if data.count < Self.ifdReadLength {
+                    throw Errors.truncatedIfd
+                }
+
+                file.read(offset, length) { result in
+                    completion(result.flatMap({ data in
+                        return (data.count >= length) ? .success(IFD(data, order)) : .failure(Errors.truncatedIfd)
+                    }))
+                }
+            } catch {
+                completion(.failure(error))
+            }
+        }
+    }
+
+    /**
+     * Reads the JPEG data in the given range, then decodes it on the decode queue.
+     */
+    private func readJpeg(_ file: FileReader, _ range: Range<Int>, _ request: Request,
+                          _ completion: @escaping (Result<CGImage, Error>) -> Void) {
+        guard !request.isCancelled else {
+            return completion(.failure(Errors.cancelled))
+        }
+
+        file.read(range.lowerBound, range.count) { result in
+            guard case .success(let data) = result, data.count == range.count else {
+                return completion(.failure(Errors.truncatedPreview))
+            }
+
+            self.decodeQueue.async {
+                let decoded = Self.decodeJpeg(data, request.maxSize)
+
+                self.queue.async {
+                    completion(decoded)
+                }
+            }
+        }
+    }
+
+    // MARK: - Parsing
+    /**
+     * Validates the TIFF and CR2 headers, and returns the byte order of the file.
+     */
+    private static func validateHeader(_ header: Data) throws -> Data.ByteOrder {
+        guard header.count == 16 else {
+            throw Errors.invalidHeader
+        }
+
+        let order: Data.ByteOrder
+        switch (header[0], header[1]) {
+            case (0x49, 0x49):
+                order = .little
+            case (0x4D, 0x4D):
+                order = .big
+            default:
+                throw Errors.invalidHeader
+        }
+
+        // TIFF magic, then the 'CR' signature and major version 2
+        let magic: UInt16 = header.readEndian(2, order)
+        guard magic == 42, header[8] == 0x43, header[9] == 0x52, header[10] == 2 else {
+            throw Errors.invalidHeader
+        }
+
+        return order
+    }
+
+    /**
+     * Decodes JPEG data, scaling it so that its larger edge is at most the given size. ImageIO decodes JPEGs at reduced
+     * sizes directly, so large previews are cheap to scale down.
+     */
+    private static func decodeJpeg(_ data: Data, _ maxSize: CGFloat) -> Result<CGImage, Error> {
+        guard let source = CGImageSourceCreateWithData(data as CFData, nil) else {
+            return .failure(Errors.failedToDecodePreview)
+        }
+
+        let opts: [CFString: Any] = [
+            kCGImageSourceCreateThumbnailFromImageAlways: true,
+            kCGImageSourceThumbnailMaxPixelSize: maxSize,
+            kCGImageSourceShouldCacheImmediately: true
+        ]
+
+        guard let image = CGImageSourceCreateThumbnailAtIndex(source, 0, opts as CFDictionary) else {
+            return .failure(Errors.failedToDecodePreview)
+        }
+        return .success(image)
+    }
+
+    // MARK: - Types
+    /**
+     * A request for the preview of a single file
+     */
+    public class Request {
+        /// Reader handling the request
+        private weak var reader: CR2PreviewReader?
+
+        /// URL of the file to read the preview of
+        public let url: URL
+        /// Maximum size of the decoded preview
+        public let maxSize: CGFloat
+
+        /// Queue on which the handler is invoked
+        private let queue: DispatchQueue
+        /// Invoked once the preview is read
+        private let handler: (URL, Result<CGImage, Error>) -> Void
+
+        /// Lock protecting the cancellation flag
+        private let lock = NSLock()
+        private var cancelled: Bool = false
+
+        fileprivate init(reader: CR2PreviewReader, url: URL, maxSize: CGFloat, queue: DispatchQueue,
+                         handler: @escaping (URL, Result<CGImage, Error>) -> Void) {
+            self.reader = reader
+            self.url = url
+            self.maxSize = maxSize
+            self.queue = queue
+            self.handler = handler
+        }
+
+        /// Whether the request was cancelled
+        public var isCancelled: Bool {
+            self.lock.lock()
+            defer { self.lock.unlock() }
+            return self.cancelled
+        }
+
+        /**
+         * Cancels the request. Files that are already being read stop before reading the preview itself, and the handler
+         * isn't invoked.
+         */
+        public func cancel() {
+            self.lock.lock()
+            self.cancelled = true
+            self.lock.unlock()
+
+            self.reader?.cancel(self)
+        }
+
+        /**
+         * Invokes the handler with the result, unless cancelled.
+         */
+        fileprivate func complete(_ result: Result<CGImage, Error>) {
+            guard !self.isCancelled else {
+                return
+            }
+
+            self.queue.async {
+                // it may have been cancelled since
+                if !self.isCancelled {
+                    self.handler(self.url, result)
+                }
+            }
+        }
+    }
+
+    /**
+     * Asynchronous positional reads from an open file; the file is closed once the last reference goes away.
+     */
+    private class FileReader {
+        private let io: DispatchIO
+        private let queue: DispatchQueue
+
+        init(fd: Int32, queue: DispatchQueue) {
+            self.queue = queue
+            self.io = DispatchIO(type: .random, fileDescriptor: fd, queue: queue, cleanupHandler: { _ in
+                close(fd)
+            })
+        }
+
+        deinit {
+            self.io.close()
+        }
+
+        /**
+         * Reads up to the given number of bytes at an offset; fewer bytes are returned at the end of the file.
+         */
+        func read(_ offset: Int, _ length: Int, _ completion: @escaping (Result<Data, Error>) -> Void) {
+            var buffer = Data(capacity: length)
+
+            // the handler refers to the reader, so the file stays open until the read is done
+            self.io.read(offset: off_t(offset), length: length, queue: self.queue) { done, data, error in
+                if let data = data {
+                    buffer.append(contentsOf: data)
+                }
+
+                if done {
+                    withExtendedLifetime(self) {
+                        completion((error == 0) ? .success(buffer) : .failure(Errors.readFailed(errno: error)))
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Entries of an IFD that hold a single integer
+     */
+    private struct IFD {
+        /// Values of the entries, by tag
+        private var values: [UInt16: Int] = [:]
+        /// Offset of the next IFD, or 0 if this is the last one
+        private(set) var next: Int = 0
+
+        init(_ data: Data, _ order: Data.ByteOrder) {
+            let count: UInt16 = data.readEndian(0, order)
+
+            for i in 0..<Int(count) {
+                let base = 2 + (i * 12)
+
+                let tag: UInt16 = data.readEndian(base, order)
+                let type: UInt16 = data.readEndian(base + 2, order)
+                let valueCount: UInt32 = data.readEndian(base + 4, order)
+
+                guard valueCount == 1 else {
+                    continue
+                }
+
+                // short or long; shorts are at the start of the value field
+                if type == 3 {
+                    let value: UInt16 = data.readEndian(base + 8, order)
+                    self.values[tag] = Int(value)
+                } else if type == 4 {
+                    let value: UInt32 = data.readEndian(base + 8, order)
+                    self.values[tag] = Int(value)
+                }
+            }
+
+            let next: UInt32 = data.readEndian(2 + (Int(count) * 12), order)
+            self.next = Int(next)
+        }
+
+        /**
+         * Gets the byte range described by an offset and a length tag, if both exist.
+         */
+        func range(offsetTag: UInt16, lengthTag: UInt16) -> Range<Int>? {
+            guard let offset = self.values[offsetTag], let length = self.values[lengthTag], length > 0 else {
+                return nil
+            }
+            return offset..<(offset + length)
+        }
+    }
+
+    // MARK: - Errors
+    enum Errors: Error {
+        /// The file couldn't be opened
+        case openFailed(errno: Int32)
+        /// Reading from the file failed
+        case readFailed(errno: Int32)
+        /// The file isn't a CR2 file
+        case invalidHeader
+        /// An IFD extends past the end of the file
+        case truncatedIfd
+        /// Neither IFD0 nor IFD1 point to a JPEG preview
+        case missingPreview
+        /// The preview extends past the end of the file
+        case truncatedPreview
+        /// The preview couldn't be decoded
+        case failedToDecodePreview
+        /// The request was cancelled while it was being read
+        case cancelled
+    }
+}
@@ -162,6 +162,25 @@ public class HistogramCalculator {
             self.lumaData.reserveCapacity(self.buckets)
         }
         
+        /**
+         * Initializes histogram data with counts calculated elsewhere, such as while the image was decoded. The counts
+         * are in RGBY order, with all buckets of one channel before the next.
+         */
+        internal init(buckets: Int, counts: [UInt32]) {
+            precondition(counts.count == buckets * 4)
+            
+            self.buckets = buckets
+            
+            let channels = stride(from: 0, to: counts.count, by: buckets).map({ start in
+                return counts[start..<(start + buckets)].map({ UInt($0) })
+            })
+            
+            self.redData = channels[0]
+            self.greenData = channels[1]
+            self.blueData = channels[2]
+            self.lumaData = channels[3]
+        }
+        
         /**
          * Copies data out of the given Metal buffers (in RGBY order) and into this histogram.
          */
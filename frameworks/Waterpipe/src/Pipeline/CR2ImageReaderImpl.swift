@@ -6,8 +6,8 @@
 //
 
 import Foundation
+import OSLog
 import UniformTypeIdentifiers
-import Accelerate
 import simd
 import Paper
 
@@ -15,6 +15,9 @@ import Paper
  * Implements support for reading Canon CR2 files.
  */
 internal class CR2ImageReaderImpl: ImageReaderImpl {
+    fileprivate static var logger = Logger(subsystem: Bundle(for: CR2ImageReaderImpl.self).bundleIdentifier!,
+                                         category: "CR2ImageReaderImpl")
+    
     /// URL from which the image file was read
     private(set) var url: URL?
     /// Type of the file read from disk
@@ -28,14 +31,34 @@ internal class CR2ImageReaderImpl: ImageReaderImpl {
         return image.visibleImageSize
     }
     
-    /// CR2 reader instance
-    private var reader: CR2Reader!
-    /// Decoded raw image
+    /// CR2 reader instance; each reader decodes the file once
+    private var reader: CR2Reader?
+    /// Most recently decoded raw image
     private var image: CR2Image?
     
     /// Sensor  -> Working color space matrix
     private var sensorMatrix: simd_float3x3?
     
+    /// Persistent cache of decoded sensor data, if any
+    private var rawCache: RawCache?
+    
+    /// Decompressor state and buffers shared by all CR2 decodes, so flipping through images needs no large allocations
+    private static let decodeContext = PAPDecodeContext()
+    /// Number of buckets of the histogram counted while decoding; the same as the edit view's histogram
+    private static let histogramBuckets = 256
+    
+    /**
+     * Size at which the image is decoded. Reduced sizes bin blocks of raw pixels together rather than demosaicing the full
+     * image, which is much faster and good enough for previews and thumbnails.
+     */
+    var sizeHint: SizeHint = .full
+    
+    /// Size of the bitmap produced by decoding, taking into account the size hint
+    var decodedSize: CGSize {
+        let factor = CGFloat(PAPDebayerer.scaleFactor(forAlgorithm: self.sizeHint.rawValue))
+        return CGSize(width: floor(self.size.width / factor), height: floor(self.size.height / factor))
+    }
+    
     // MARK: - Initialization
     /**
      * Initializes a new CR2 reader with the given file.
@@ -53,107 +76,154 @@ internal class CR2ImageReaderImpl: ImageReaderImpl {
     /**
      * Decodes the image and returns a bitmap buffer with the specified pixel format.
      *
-     * The decoded CR2 data is kept around memory, including the sensor-native format bitmap. After the first call has decoded
-     * the image, further calls just convert that bitmap to the requested format.
+     * The raw data is debayered and converted to the working color space and requested pixel format in bands, while
+     * it's being decompressed; no full size intermediate buffers are kept around. Each call decodes the file again.
      */
     func decode(_ format: ImageReader.BitmapFormat) throws -> ImageBuffer {
-        // decode image if needed
-        if self.image == nil {
-            self.image = try self.reader.decode()
+        guard let url = self.url else {
+            throw Errors.cr2DecodeFailed
         }
-        guard let image = self.image else {
+        
+        // readers can only decode once, so further calls need a new one
+        let reader = try self.reader ?? CR2Reader(fromUrl: url, decodeRawData: true, decodeThumbs: false)
+        self.reader = nil
+        reader.decodeContext = Self.decodeContext
+        
+        let stats = PAPDecodeStats()
+        reader.stats = stats
+        
+        // components are scaled assuming 14-bit input
+        let algorithm = self.sizeHint.rawValue
+        
+        reader.streamingOutputProvider = { image in
+            let matrix = CameraColorInfo.conversionMatrixFrom(xyz: try self.getSensorMatrix(image.meta.cameraModel))
+            
+            var output = CR2Reader.StreamingOutput(algorithm: algorithm, colorMatrix: matrix,
+                                                   scale: (1.0 / 16384.0), halfFloat: (format == .float16))
+            output.histogramBuckets = Self.histogramBuckets
+            return output
+        }
+        
+        let image = try reader.decode()
+        self.image = image
+        
+        Self.logger.debug("Decoded \(url.lastPathComponent): \(stats.dictionaryRepresentation)")
+        
+        guard let pixels = image.processedValues else {
             throw Errors.cr2DecodeFailed
         }
         
-        // debayer
-        let wb = self.image!.rawWbMultiplier.map(NSNumber.init)
+        // the histogram is counted while the pixels are written, so it comes with the decode
+        var histogram: HistogramCalculator.HistogramData? = nil
+        if !image.processedHistogram.isEmpty {
+            histogram = HistogramCalculator.HistogramData(buckets: Self.histogramBuckets,
+                                                          counts: image.processedHistogram)
+        }
         
-        let bytes = image.visibleImageSize.width * image.visibleImageSize.height * 4 * 2
-        let outData = NSMutableData(length: Int(bytes))!
+        return ImageBuffer(data: pixels, bytesPerRow: image.processedBytesPerRow,
+                           rows: UInt(image.processedSize.height), cols: UInt(image.processedSize.width),
+                           histogram: histogram)
+    }
+    
+    /**
+     * Full quality decodes hand the raw sensor data to the GPU for demosaicing with AHD, and exports with the slower
+     * LMMSE. Previews and reduced size decodes still bin the CFA on the CPU, which is faster than uploading all of it.
+     */
+    func decodeRaw(quality: ImageReader.DecodeQuality) throws -> ImageReader.RawBuffer? {
+        guard quality != .preview, self.sizeHint == .full, let url = self.url else {
+            return nil
+        }
         
-        PAPDebayerer.debayer(image.rawValues!, withOutput: outData,
-                             imageSize: image.visibleImageSize, andAlgorithm: 1,
-                             vShift: UInt(image.rawValuesVshift), wbShift: wb,
-                             blackLevel: image.rawBlackLevel as [NSNumber])
+        let image = try self.decodeSensorData(url)
+        self.image = image
         
-        // lastly, convert to the output pixel format
-        switch format {
-        case .float32:
-            return try self.convert16UTo32F(outData, image)
-        case .float16:
-            /// XXX: completely untested lmfao
-            return try self.convert16UTo16FInPlace(outData, image)
+        guard let values = image.rawValues, image.rawWbMultiplier.count == 4,
+              image.rawBlackLevel.count == 4 else {
+            throw Errors.cr2DecodeFailed
         }
+        
+        let matrix = try self.getSensorMatrix(image.meta.cameraModel)
+        
+        // components are scaled assuming 14-bit input
+        return ImageReader.RawBuffer(data: values, bytesPerRow: Int(image.visibleImageSize.width) * 2,
+                                     size: image.visibleImageSize, vShift: image.rawValuesVshift,
+                                     wb: SIMD4<Float>(image.rawWbMultiplier.map({ Float($0) })),
+                                     black: SIMD4<Float>(image.rawBlackLevel.map({ Float($0) })),
+                                     matrix: matrix, scale: (1.0 / 16384.0),
+                                     algorithm: (quality == .export) ? .lmmse : .ahd)
     }
     
     /**
-     * Converts a 16-bit unsigned buffer into a 32-bit float buffer.
+     * Decodes the trimmed sensor data of the image, or reads it from the raw cache if it was decoded before; newly decoded
+     * data is added to the cache.
      */
-    private func convert16UTo32F(_ inData: NSMutableData, _ image: CR2Image) throws -> ImageBuffer {
-        // create descriptor for input buffer
-        var inBuf = vImage_Buffer(data: inData.mutableBytes,
-                                   height: UInt(image.visibleImageSize.height),
-                                   width: UInt(image.visibleImageSize.width) * 4,
-                                   rowBytes: Int(image.visibleImageSize.width * 4 * 2))
-        
-        // allocate output buffer
-        let bytes = image.visibleImageSize.width * image.visibleImageSize.height * 4 * 4
-        let floatData = NSMutableData(length: Int(bytes))!
-        
-        var outBuf = vImage_Buffer(data: floatData.mutableBytes,
-                                   height: UInt(image.visibleImageSize.height),
-                                   width: UInt(image.visibleImageSize.width) * 4,
-                                   rowBytes: Int(image.visibleImageSize.width * 4 * 4))
-        
-        // perform the conversion (assuming 14-bit components on input)
-        let err = vImageConvert_16UToF(&inBuf, &outBuf, 0, (1.0 / 16384.0), .zero)
-        guard err == kvImageNoError else {
-            throw Errors.bufferConvertFailed(err)
+    private func decodeSensorData(_ url: URL) throws -> CR2Image {
+        var key: String? = nil
+        
+        if self.rawCache != nil {
+            do {
+                key = try RawCache.key(forFileAt: url)
+            } catch {
+                Self.logger.error("Failed to get raw cache key for \(url): \(error.localizedDescription)")
+            }
+        }
+        
+        if let key = key, let image = self.rawCache?.image(forKey: key, context: Self.decodeContext) {
+            return image
+        }
+        
+        // readers can only decode once, so further calls need a new one
+        let reader = try self.reader ?? CR2Reader(fromUrl: url, decodeRawData: true, decodeThumbs: false)
+        self.reader = nil
+        reader.decodeContext = Self.decodeContext
+        // the decoded image is kept around, so it shouldn't hold on to the full size plane
+        reader.leanMemory = true
+        
+        let image = try reader.decode()
+        
+        if let key = key {
+            do {
+                try self.rawCache?.store(image, forKey: key)
+            } catch {
+                Self.logger.error("Failed to cache sensor data of \(url): \(error.localizedDescription)")
+            }
         }
         
-        return ImageBuffer(data: floatData as Data, bytesPerRow: Int(image.visibleImageSize.width) * 4 * 4,
-                           rows: UInt(image.visibleImageSize.height), cols: UInt(image.visibleImageSize.width))
+        return image
     }
     
     /**
-     * Converts a 16-bit unsigned buffer into a 16-bit float buffer, in place.
+     * Gets the sensor to XYZ matrix for the image's camera model, looking it up if needed.
      */
-    private func convert16UTo16FInPlace(_ inData: NSMutableData, _ image: CR2Image) throws -> ImageBuffer {
-        // the same descriptor is used for input and output
-        var buf = vImage_Buffer(data: inData.mutableBytes,
-                                height: UInt(image.visibleImageSize.height),
-                                width: UInt(image.visibleImageSize.width) * 4,
-                                rowBytes: Int(image.visibleImageSize.width * 4 * 2))
-        
-        // perform the conversion (assuming 14-bit components on input)
-        let err = vImageConvert_16Uto16F(&buf, &buf, .zero)
-        guard err == kvImageNoError else {
-            throw Errors.bufferConvertFailed(err)
+    private func getSensorMatrix(_ model: String?) throws -> simd_float3x3 {
+        if let matrix = self.sensorMatrix {
+            return matrix
         }
         
-        return ImageBuffer(data: inData as Data, bytesPerRow: Int(image.visibleImageSize.width) * 4 * 2,
-                           rows: UInt(image.visibleImageSize.height), cols: UInt(image.visibleImageSize.width))
+        guard let modelName = model,
+              let colorInfo = CameraColorInfo(),
+              let matrix = try colorInfo.xyzMatrixForModel(modelName) else {
+            throw Errors.noConversionMatrixFor(model)
+        }
+        
+        self.sensorMatrix = matrix
+        return matrix
+    }
+    
+    /**
+     * Full quality decodes of the raw sensor data are read from and stored into the cache; bitmap decodes are not cached,
+     * since they're processed while decompressing.
+     */
+    func useRawCache(_ cache: RawCache) {
+        self.rawCache = cache
     }
     
     // MARK: - Pipeline support
     /**
-     * Adds color space conversion to the start of all pipeline state objects created with this image.
+     * No elements are inserted: the conversion from sensor RGB to the working color space already happens
+     * while the image is debayered, or while it's developed from raw data on the GPU.
      */
     func insertProcessingElements(_ state: RenderPipelineState) throws {
-        // get the color conversion matrix for the image
-        if self.sensorMatrix == nil {
-            guard let modelName = self.image?.meta.cameraModel,
-                  let colorInfo = CameraColorInfo(),
-                  let matrix = try colorInfo.xyzMatrixForModel(modelName) else {
-                throw Errors.noConversionMatrixFor(self.image?.meta.cameraModel)
-            }
-            
-            self.sensorMatrix = matrix
-        }
-        
-        // convert from sensor RGB to working color space
-        let converter = try MatrixMultiply(state.device, matrix: self.sensorMatrix!)
-        state.add(converter, group: .readerImpl)
     }
     
     // MARK: - Type identification
@@ -167,12 +237,21 @@ internal class CR2ImageReaderImpl: ImageReaderImpl {
         return type.conforms(to: Self.uti)
     }
     
+    // MARK: - Types
+    /// Sizes the image can be decoded at; the raw values are the debayering algorithms used for each
+    enum SizeHint: UInt {
+        /// Full size, demosaiced with bilinear interpolation
+        case full = 1
+        /// Half size in each dimension, binning 2x2 blocks of the CFA
+        case half = 3
+        /// Quarter size in each dimension, binning 4x4 blocks of the CFA
+        case quarter = 4
+    }
+    
     // MARK: - Errors
     enum Errors: Error {
         /// The CR2 decode failed for some reason
         case cr2DecodeFailed
-        /// An error occurred in converting from the raw pixel format to the pipeline pixel format
-        case bufferConvertFailed(_ error: vImage_Error)
         /// There is no color space conversion matrix for the given camera model
         case noConversionMatrixFor(_ model: String?)
     }
@@ -0,0 +1,262 @@
+//
+//  DemosaicAHD.metal
+//  Waterpipe (macOS)
+//
+//  Adaptive homogeneity-directed demosaicing, following the CPU
+//  implementation in Paper's ahd_interpolate_mod.c: the image is interpolated
+//  both horizontally and vertically, and each pixel is taken from whichever
+//  interpolation is more homogenous in CIELab space around it.
+//
+//  Created by Tristan Seifert on 20200906.
+//
+
+#include <metal_stdlib>
+using namespace metal;
+
+#include "TiledCFA.h"
+
+/*
+ * Uniforms passed into the compute kernels
+ */
+typedef struct {
+    // Position of pixels in the tiled images
+    TiledCFALayout layout;
+    // Camera RGB to working (ProPhoto) color space conversion matrix, used for the CIELab conversion
+    float3x3 conversion;
+    // Factor applied to the final [0, 1] RGB values
+    float outputScale;
+} UniformIn;
+
+/*
+ * Converts camera RGB to CIELab (relative to the D50 white point of the working space.)
+ */
+static inline float3 AHDToLab(float3 rgb, constant UniformIn &uniforms) {
+    const float3 working = max(rgb * uniforms.conversion, 0.f);
+
+    // ProPhoto (linear) -> XYZ, normalized to the white point; Z only depends on blue, and is 1 for white
+    float3 xyz = float3(dot(float3(0.7976749f, 0.1351917f, 0.0313534f), working) / 0.9642f,
+                        dot(float3(0.2880402f, 0.7118741f, 0.0000857f), working),
+                        working.z);
+
+    xyz = select((7.787f * xyz) + (16.f / 116.f), powr(xyz, 1.f / 3.f), xyz > 0.008856f);
+
+    return float3((116.f * xyz.y) - 16.f, 500.f * (xyz.x - xyz.y), 200.f * (xyz.y - xyz.z));
+}
+
+/*
+ * Step 1: Interpolates green at red and blue pixels, once horizontally (x) and once vertically (y). If the estimate
+ * overshoots, successively smoother estimates are used.
+ */
+kernel void RPE_AHDGreen(texture2d_array<float, access::read> cfa [[ texture(0) ]],
+                         texture2d_array<float, access::write> green [[ texture(1) ]],
+                         constant UniformIn &uniforms [[ buffer(0) ]],
+                         uint3 id [[ thread_position_in_grid ]]) {
+    constant TiledCFALayout &L = uniforms.layout;
+
+    int2 pos;
+    if(!TiledPosition(L, id, pos)) {
+        return;
+    }
+
+    const float x0 = cfa.read(id.xy, id.z).r;
+
+    if(TiledCFAColor(L, pos) == 1) {
+        green.write(float4(x0, x0, 0, 0), id.xy, id.z);
+        return;
+    }
+
+    float est[2];
+
+    for(int d = 0; d < 2; d++) {
+        const int2 step = (d == 0) ? int2(1, 0) : int2(0, 1);
+
+        // neighbours at odd distances are green
+        const float g1 = TiledRead(cfa, L, pos - step).r + TiledRead(cfa, L, pos + step).r;
+        const float g3 = TiledRead(cfa, L, pos - (3 * step)).r + TiledRead(cfa, L, pos + (3 * step)).r;
+        const float x2 = TiledRead(cfa, L, pos - (2 * step)).r + TiledRead(cfa, L, pos + (2 * step)).r;
+
+        float val = (((g1 + x0) * 2.f) - x2) / 4.f;
+
+        if(val < 0.f || val > 1.f) {
+            val = (g3 + 18.f * ((2.f * x0) - x2) + 63.f * g1) / 128.f;
+
+            if(val < 0.f || val > 1.f) {
+                val = ((4.f * g1) + (2.f * x0) - x2) / 8.f;
+
+                if(val < 0.f || val > 1.f) {
+                    val = g1 / 2.f;
+                }
+            }
+        }
+
+        est[d] = val;
+    }
+
+    green.write(float4(est[0], est[1], 0, 0), id.xy, id.z);
+}
+
+/*
+ * Step 2: Interpolates red and blue using each of the directional green estimates, producing a horizontally and a
+ * vertically interpolated image.
+ */
+kernel void RPE_AHDColor(texture2d_array<float, access::read> cfa [[ texture(0) ]],
+                         texture2d_array<float, access::read> green [[ texture(1) ]],
+                         texture2d_array<float, access::write> rgbH [[ texture(2) ]],
+                         texture2d_array<float, access::write> rgbV [[ texture(3) ]],
+                         constant UniformIn &uniforms [[ buffer(0) ]],
+                         uint3 id [[ thread_position_in_grid ]]) {
+    constant TiledCFALayout &L = uniforms.layout;
+
+    int2 pos;
+    if(!TiledPosition(L, id, pos)) {
+        return;
+    }
+
+    const float x0 = cfa.read(id.xy, id.z).r;
+    const int f = TiledCFAColor(L, pos);
+
+    for(int d = 0; d < 2; d++) {
+        float3 out = 0;
+        out[f] = x0;
+
+        if(f == 1) {
+            // colors of the horizontal and vertical neighbours
+            const int ch = TiledCFAColor(L, pos + int2(1, 0));
+            const int2 l = pos + int2(-1, 0), r = pos + int2(1, 0);
+            const int2 u = pos + int2(0, -1), b = pos + int2(0, 1);
+
+            const float xh = TiledRead(cfa, L, l).r + TiledRead(cfa, L, r).r;
+            float val = x0 + ((xh - TiledRead(green, L, l)[d] - TiledRead(green, L, r)[d]) / 2.f);
+            out[ch] = (val < 0.f || val > 1.f) ? (xh / 2.f) : val;
+
+            const float xv = TiledRead(cfa, L, u).r + TiledRead(cfa, L, b).r;
+            val = x0 + ((xv - TiledRead(green, L, u)[d] - TiledRead(green, L, b)[d]) / 2.f);
+            out[2 - ch] = (val < 0.f || val > 1.f) ? (xv / 2.f) : val;
+        } else {
+            const float g = green.read(id.xy, id.z)[d];
+            out.g = g;
+
+            // the missing color is at the diagonal neighbours
+            float xs = 0, gs = 0;
+
+            const int2 offsets[4] = { int2(-1, -1), int2(1, -1), int2(-1, 1), int2(1, 1) };
+            for(int i = 0; i < 4; i++) {
+                xs += TiledRead(cfa, L, pos + offsets[i]).r;
+                gs += TiledRead(green, L, pos + offsets[i])[d];
+            }
+
+            const float val = g + ((xs - gs) / 4.f);
+            out[2 - f] = (val < 0.f || val > 1.f) ? (xs / 4.f) : val;
+        }
+
+        if(d == 0) {
+            rgbH.write(float4(out, 1), id.xy, id.z);
+        } else {
+            rgbV.write(float4(out, 1), id.xy, id.z);
+        }
+    }
+}
+
+/*
+ * Converts a pixel and its direct neighbours (left, right, up, down) to CIELab.
+ */
+static inline void AHDNeighbourhoodLab(texture2d_array<float, access::read> rgb, constant UniformIn &uniforms,
+                                       int2 pos, uint3 id, thread float3 (&lab)[5]) {
+    const int2 offsets[4] = { int2(-1, 0), int2(1, 0), int2(0, -1), int2(0, 1) };
+
+    lab[0] = AHDToLab(rgb.read(id.xy, id.z).rgb, uniforms);
+
+    for(int i = 0; i < 4; i++) {
+        lab[i + 1] = AHDToLab(TiledRead(rgb, uniforms.layout, pos + offsets[i]).rgb, uniforms);
+    }
+}
+
+/*
+ * Step 3: Builds the homogeneity maps: for each direction, the number of direct neighbours whose CIELab luminance and
+ * chrominance differ from the pixel's by no more than an adaptive threshold.
+ */
+kernel void RPE_AHDHomogeneity(texture2d_array<float, access::read> rgbH [[ texture(0) ]],
+                               texture2d_array<float, access::read> rgbV [[ texture(1) ]],
+                               texture2d_array<uint, access::write> homo [[ texture(2) ]],
+                               constant UniformIn &uniforms [[ buffer(0) ]],
+                               uint3 id [[ thread_position_in_grid ]]) {
+    int2 pos;
+    if(!TiledPosition(uniforms.layout, id, pos)) {
+        return;
+    }
+
+    float3 lab[2][5];
+    AHDNeighbourhoodLab(rgbH, uniforms, pos, id, lab[0]);
+    AHDNeighbourhoodLab(rgbV, uniforms, pos, id, lab[1]);
+
+    float ldiff[2][4], abdiff[2][4];
+
+    for(int d = 0; d < 2; d++) {
+        for(int i = 0; i < 4; i++) {
+            const float2 ab = lab[d][0].yz - lab[d][i + 1].yz;
+
+            ldiff[d][i] = fabs(lab[d][0].x - lab[d][i + 1].x);
+            abdiff[d][i] = dot(ab, ab);
+        }
+    }
+
+    // horizontal neighbours of the horizontal interpolation, vertical neighbours of the vertical one
+    const float leps = min(max(ldiff[0][0], ldiff[0][1]), max(ldiff[1][2], ldiff[1][3]));
+    const float abeps = min(max(abdiff[0][0], abdiff[0][1]), max(abdiff[1][2], abdiff[1][3]));
+
+    uint count[2] = { 0, 0 };
+
+    for(int d = 0; d < 2; d++) {
+        for(int i = 0; i < 4; i++) {
+            if(ldiff[d][i] <= leps && abdiff[d][i] <= abeps) {
+                count[d]++;
+            }
+        }
+    }
+
+    homo.write(uint4(count[0], count[1], 0, 0), id.xy, id.z);
+}
+
+/*
+ * Step 4: Picks each pixel from the direction whose homogeneity, summed over the surrounding 3x3 block, is higher;
+ * if both are equally homogenous, they're averaged. The results are clipped to [0, 1] and scaled.
+ */
+kernel void RPE_AHDCombine(texture2d_array<float, access::read> rgbH [[ texture(0) ]],
+                           texture2d_array<float, access::read> rgbV [[ texture(1) ]],
+                           texture2d_array<uint, access::read> homo [[ texture(2) ]],
+                           texture2d_array<float, access::write> output [[ texture(3) ]],
+                           constant UniformIn &uniforms [[ buffer(0) ]],
+                           uint3 id [[ thread_position_in_grid ]]) {
+    constant TiledCFALayout &L = uniforms.layout;
+
+    int2 pos;
+    if(!TiledPosition(L, id, pos)) {
+        return;
+    }
+
+    // sum the homogeneity of the block; edges are clamped rather than mirrored here
+    const int2 size = int2(L.imageSize);
+    uint2 hm = 0;
+
+    for(int y = -1; y <= 1; y++) {
+        for(int x = -1; x <= 1; x++) {
+            const uint2 p = uint2(clamp(pos + int2(x, y), int2(0), size - 1));
+            const uint2 tile = p / L.tileSize;
+
+            hm += homo.read(p % L.tileSize, (tile.y * L.tilesPerRow) + tile.x).rg;
+        }
+    }
+
+    const float3 h = rgbH.read(id.xy, id.z).rgb;
+    const float3 v = rgbV.read(id.xy, id.z).rgb;
+
+    float3 out;
+    if(hm.x != hm.y) {
+        out = (hm.y > hm.x) ? v : h;
+    } else {
+        out = (h + v) / 2.f;
+    }
+
+    out = clamp(out, 0.f, 1.f) * uniforms.outputScale;
+    output.write(float4(out, 1), id.xy, id.z);
+}
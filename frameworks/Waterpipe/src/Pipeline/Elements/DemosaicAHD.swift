@@ -0,0 +1,168 @@
+//
+//  DemosaicAHD.swift
+//  Waterpipe (macOS)
+//
+//  Created by Tristan Seifert on 20200906.
+//
+
+import Foundation
+import Metal
+import simd
+
+import Paper
+
+/**
+ * Demosaics white balanced CFA data (as output by `RawWhiteBalance`) with the AHD (adaptive homogeneity-directed)
+ * algorithm, producing camera RGB.
+ *
+ * The homogeneity of the interpolated images is measured in CIELab, so the element needs the camera's color matrix.
+ */
+internal class DemosaicAHD: RenderPipelineElement {
+    /// Tag value
+    private(set) internal var tag: Tag?
+    /// Metal device
+    private(set) internal var device: MTLDevice!
+
+    /// Shader code library
+    private var library: MTLLibrary! = nil
+    /// Compute pipeline states for each step, in the order they're run
+    private var states: [MTLComputePipelineState] = []
+
+    /// Vertical shift of the Bayer pattern
+    private(set) internal var vShift: UInt = 0
+    /// XYZ to camera RGB matrix
+    private(set) internal var matrix = simd_float3x3(1)
+    /// Factor applied to the output RGB values, which are otherwise normalized to [0, 1]
+    private(set) internal var outputScale: Float = 1
+
+    // MARK: - Initialization
+    /**
+     * Creates a new AHD demosaicing pipeline element.
+     */
+    required init(_ device: MTLDevice, tag: Tag? = nil) throws {
+        self.device = device
+        self.tag = tag
+
+        try self.initMetalResources(device)
+    }
+
+    /**
+     * Creates a new AHD demosaicing pipeline element, for the given CFA layout, camera matrix and output scale.
+     */
+    required init(_ device: MTLDevice, tag: Tag? = nil, vShift: UInt, matrix: simd_float3x3,
+                  outputScale: Float) throws {
+        self.device = device
+        self.tag = tag
+        self.vShift = vShift
+        self.matrix = matrix
+        self.outputScale = outputScale
+
+        try self.initMetalResources(device)
+    }
+
+    /**
+     * Initializes Metal resources for the given device.
+     */
+    private func initMetalResources(_ device: MTLDevice) throws {
+        // get the shader library
+        let bundle = Bundle(for: type(of: self))
+        self.library = try device.makeDefaultLibrary(bundle: bundle)
+
+        // set up compute pipeline states
+        for name in ["RPE_AHDGreen", "RPE_AHDColor", "RPE_AHDHomogeneity", "RPE_AHDCombine"] {
+            guard let state = try self.library.makeComputeState(name) else {
+                throw Errors.failedLoadingFunction
+            }
+            self.states.append(state)
+        }
+    }
+
+    // MARK: - Encoding
+    /**
+     * The output is RGB, in half precision.
+     */
+    func outputPixelFormat(_ input: MTLPixelFormat) -> MTLPixelFormat {
+        return .rgba16Float
+    }
+
+    /**
+     * Encodes the demosaicing into the given buffer.
+     */
+    func encode(_ buffer: MTLCommandBuffer, in inImage: TiledImage, out: TiledImage) throws {
+        guard inImage.texture != nil, out.texture != nil else {
+            throw Errors.invalidImage
+        }
+
+        // allocate the intermediate images; the interpolated images are only needed in half precision
+        let size = inImage.imageSize, tileSize = inImage.tileSize
+
+        guard let green = TiledImage(buffer: buffer, imageSize: size, tileSize: tileSize, .rg32Float),
+              let rgbH = TiledImage(buffer: buffer, imageSize: size, tileSize: tileSize, .rgba16Float),
+              let rgbV = TiledImage(buffer: buffer, imageSize: size, tileSize: tileSize, .rgba16Float),
+              let homo = TiledImage(buffer: buffer, imageSize: size, tileSize: tileSize, .rg8Uint) else {
+            throw Errors.failedMakeImage
+        }
+
+        // create command encoder
+        guard let encoder = buffer.makeComputeCommandEncoder() else {
+            throw Errors.failedMakeCommandEncoder
+        }
+        encoder.label = "DemosaicAHD.encode(_:_:_:)"
+
+        // create a buffer with the info required by the compute functions
+        let conversionMatrix = CameraColorInfo.conversionMatrixFrom(xyz: self.matrix)
+
+        var uniforms = Uniforms(layout: TiledCFALayout(inImage, vShift: self.vShift),
+                                conversionMatrix: conversionMatrix, outputScale: self.outputScale)
+        let uniformBuf = self.device.makeBuffer(bytes: &uniforms,
+                                                length: MemoryLayout<Uniforms>.stride)
+        encoder.setBuffer(uniformBuf, offset: 0, index: 0)
+
+        // each step reads the neighbourhood of its pixels from the outputs of the previous ones
+        let steps: [[TiledImage]] = [
+            [inImage, green],
+            [inImage, green, rgbH, rgbV],
+            [rgbH, rgbV, homo],
+            [rgbH, rgbV, homo, out],
+        ]
+
+        for (state, images) in zip(self.states, steps) {
+            for (i, image) in images.enumerated() {
+                encoder.setTexture(image.texture, index: i)
+            }
+
+            encoder.dispatchTiles(inImage, state)
+            encoder.memoryBarrier(scope: .textures)
+        }
+
+        encoder.endEncoding()
+
+        // the intermediate images can be reused once the passes are done
+        [green, rgbH, rgbV, homo].forEach { $0.didRead() }
+    }
+
+    // MARK: - Errors
+    enum Errors: Error {
+        /// Failed to load one of the compute functions
+        case failedLoadingFunction
+        /// Failed to create a command encoder
+        case failedMakeCommandEncoder
+        /// Failed to allocate an intermediate image
+        case failedMakeImage
+        /// Invalid images were passed in (no texture)
+        case invalidImage
+    }
+
+    // MARK: - Types
+    /**
+     * Uniform buffer passed to the compute shaders
+     */
+    private struct Uniforms {
+        /// Position of pixels in the tiled images
+        var layout: TiledCFALayout
+        /// Camera RGB to working space conversion matrix
+        var conversionMatrix: simd_float3x3
+        /// Factor applied to the output RGB values
+        var outputScale: Float
+    }
+}
@@ -0,0 +1,258 @@
+//
+//  DemosaicLMMSE.metal
+//  Waterpipe (macOS)
+//
+//  LMMSE demosaicing, split up into one kernel for each of the steps of the
+//  CPU implementation in Paper's debayer.c. Every kernel reads the whole
+//  neighbourhood it needs from the previous step's output, so they can run on
+//  any number of tiles at once.
+//
+//  Created by Tristan Seifert on 20200906.
+//
+
+#include <metal_stdlib>
+using namespace metal;
+
+#include "TiledCFA.h"
+
+/*
+ * Uniforms passed into the compute kernels
+ */
+typedef struct {
+    // Position of pixels in the tiled images
+    TiledCFALayout layout;
+    // Factor applied to the final [0, 1] RGB values
+    float outputScale;
+} UniformIn;
+
+/*
+ * Gaussian low pass filter (sigma = 2, L = 4) applied to the color differences: exp(-k^2 / 8) for k = 0...4,
+ * normalized to sum to 1.
+ */
+constant float kLowPass[5] = { 0.2041637f, 0.1801738f, 0.1238315f, 0.0662826f, 0.0276305f };
+
+// Clamps x between y and z, in whichever order they are
+static inline float ULim(float x, float y, float z) {
+    return clamp(x, min(y, z), max(y, z));
+}
+
+/*
+ * Step 1: Estimates the green minus red (or blue) color difference at each pixel, both horizontally (x) and
+ * vertically (y).
+ */
+kernel void RPE_LMMSEDifferences(texture2d_array<float, access::read> cfa [[ texture(0) ]],
+                                 texture2d_array<float, access::write> diff [[ texture(1) ]],
+                                 constant UniformIn &uniforms [[ buffer(0) ]],
+                                 uint3 id [[ thread_position_in_grid ]]) {
+    constant TiledCFALayout &L = uniforms.layout;
+
+    int2 pos;
+    if(!TiledPosition(L, id, pos)) {
+        return;
+    }
+
+    const float x0 = cfa.read(id.xy, id.z).r;
+    const float l1 = TiledRead(cfa, L, pos + int2(-1, 0)).r, r1 = TiledRead(cfa, L, pos + int2(1, 0)).r;
+    const float l2 = TiledRead(cfa, L, pos + int2(-2, 0)).r, r2 = TiledRead(cfa, L, pos + int2(2, 0)).r;
+    const float u1 = TiledRead(cfa, L, pos + int2(0, -1)).r, d1 = TiledRead(cfa, L, pos + int2(0, 1)).r;
+    const float u2 = TiledRead(cfa, L, pos + int2(0, -2)).r, d2 = TiledRead(cfa, L, pos + int2(0, 2)).r;
+
+    float h, v;
+
+    // G-R(B) at R(B) location
+    if(TiledCFAColor(L, pos) != 1) {
+        // v0 = 0.25R + 0.25B, Y = 0.25R + 0.5G + 0.25B
+        const float v0 = 0.0625f * (TiledRead(cfa, L, pos + int2(-1, -1)).r + TiledRead(cfa, L, pos + int2(1, -1)).r +
+                                    TiledRead(cfa, L, pos + int2(-1, 1)).r + TiledRead(cfa, L, pos + int2(1, 1)).r) +
+                         (0.25f * x0);
+
+        // horizontal
+        h = -0.25f * (l2 + r2) + 0.5f * (l1 + x0 + r1);
+        h = (x0 > 1.75f * (v0 + 0.5f * h)) ? ULim(h, l1, r1) : clamp(h, 0.f, 1.f);
+        h -= x0;
+
+        // vertical
+        v = -0.25f * (u2 + d2) + 0.5f * (u1 + x0 + d1);
+        v = (x0 > 1.75f * (v0 + 0.5f * v)) ? ULim(v, u1, d1) : clamp(v, 0.f, 1.f);
+        v -= x0;
+    }
+    // G-R(B) at G location
+    else {
+        h = 0.25f * (l2 + r2) - 0.5f * (l1 + x0 + r1);
+        v = 0.25f * (u2 + d2) - 0.5f * (u1 + x0 + d1);
+
+        h = clamp(h, -1.f, 0.f) + x0;
+        v = clamp(v, -1.f, 0.f) + x0;
+    }
+
+    diff.write(float4(h, v, 0, 0), id.xy, id.z);
+}
+
+/*
+ * Step 2: Low pass filters the horizontal color differences horizontally, and the vertical ones vertically.
+ */
+kernel void RPE_LMMSELowPass(texture2d_array<float, access::read> diff [[ texture(0) ]],
+                             texture2d_array<float, access::write> lowpass [[ texture(1) ]],
+                             constant UniformIn &uniforms [[ buffer(0) ]],
+                             uint3 id [[ thread_position_in_grid ]]) {
+    constant TiledCFALayout &L = uniforms.layout;
+
+    int2 pos;
+    if(!TiledPosition(L, id, pos)) {
+        return;
+    }
+
+    const float2 center = diff.read(id.xy, id.z).rg;
+    float h = kLowPass[0] * center.x;
+    float v = kLowPass[0] * center.y;
+
+    for(int k = 1; k <= 4; k++) {
+        h += kLowPass[k] * (TiledRead(diff, L, pos + int2(-k, 0)).r + TiledRead(diff, L, pos + int2(k, 0)).r);
+        v += kLowPass[k] * (TiledRead(diff, L, pos + int2(0, -k)).g + TiledRead(diff, L, pos + int2(0, k)).g);
+    }
+
+    lowpass.write(float4(h, v, 0, 0), id.xy, id.z);
+}
+
+/*
+ * Step 3: Fuses the horizontal and vertical color difference estimates at red and blue pixels, weighted by their
+ * estimated noise, to interpolate the green component. Green pixels are copied.
+ */
+kernel void RPE_LMMSEGreen(texture2d_array<float, access::read> cfa [[ texture(0) ]],
+                           texture2d_array<float, access::read> diff [[ texture(1) ]],
+                           texture2d_array<float, access::read> lowpass [[ texture(2) ]],
+                           texture2d_array<float, access::write> green [[ texture(3) ]],
+                           constant UniformIn &uniforms [[ buffer(0) ]],
+                           uint3 id [[ thread_position_in_grid ]]) {
+    constant TiledCFALayout &L = uniforms.layout;
+
+    int2 pos;
+    if(!TiledPosition(L, id, pos)) {
+        return;
+    }
+
+    const float x0 = cfa.read(id.xy, id.z).r;
+
+    if(TiledCFAColor(L, pos) == 1) {
+        green.write(float4(x0), id.xy, id.z);
+        return;
+    }
+
+    // read the 9 sample windows in each direction
+    float dh[9], dv[9], lh[9], lv[9];
+    float muH = 0, muV = 0;
+
+    for(int k = -4; k <= 4; k++) {
+        const float2 hd = TiledRead(diff, L, pos + int2(k, 0)).rg;
+        const float2 vd = TiledRead(diff, L, pos + int2(0, k)).rg;
+        const float2 hl = TiledRead(lowpass, L, pos + int2(k, 0)).rg;
+        const float2 vl = TiledRead(lowpass, L, pos + int2(0, k)).rg;
+
+        dh[k + 4] = hd.x;
+        dv[k + 4] = vd.y;
+        lh[k + 4] = hl.x;
+        lv[k + 4] = vl.y;
+
+        muH += hl.x;
+        muV += vl.y;
+    }
+
+    muH /= 9.f;
+    muV /= 9.f;
+
+    // variance of the signal and of the noise, in each direction
+    float vxH = 1e-7f, vnH = 1e-7f, vxV = 1e-7f, vnV = 1e-7f;
+
+    for(int k = 0; k < 9; k++) {
+        vxH += (lh[k] - muH) * (lh[k] - muH);
+        vnH += (dh[k] - lh[k]) * (dh[k] - lh[k]);
+        vxV += (lv[k] - muV) * (lv[k] - muV);
+        vnV += (dv[k] - lv[k]) * (dv[k] - lv[k]);
+    }
+
+    const float xh = (dh[4] * vxH + lh[4] * vnH) / (vxH + vnH);
+    const float vh = vxH * vnH / (vxH + vnH);
+    const float xv = (dv[4] * vxV + lv[4] * vnV) / (vxV + vnV);
+    const float vv = vxV * vnV / (vxV + vnV);
+
+    // interpolated G-R(B)
+    const float d = (xh * vv + xv * vh) / (vh + vv);
+
+    green.write(float4(x0 + d), id.xy, id.z);
+}
+
+/*
+ * Step 4: Bilinearly interpolates red and blue at green pixels, using the color differences of their neighbours.
+ * At red and blue pixels, the CFA value and green are copied; the remaining component is filled in by step 5.
+ */
+kernel void RPE_LMMSEColorAtGreen(texture2d_array<float, access::read> cfa [[ texture(0) ]],
+                                  texture2d_array<float, access::read> green [[ texture(1) ]],
+                                  texture2d_array<float, access::write> rgb [[ texture(2) ]],
+                                  constant UniformIn &uniforms [[ buffer(0) ]],
+                                  uint3 id [[ thread_position_in_grid ]]) {
+    constant TiledCFALayout &L = uniforms.layout;
+
+    int2 pos;
+    if(!TiledPosition(L, id, pos)) {
+        return;
+    }
+
+    const float x0 = cfa.read(id.xy, id.z).r;
+    const float g = green.read(id.xy, id.z).r;
+    float3 out = float3(0, g, 0);
+
+    const int c = TiledCFAColor(L, pos);
+
+    if(c != 1) {
+        out[c] = x0;
+    } else {
+        // color of the horizontal neighbours
+        const int ch = TiledCFAColor(L, pos + int2(1, 0));
+
+        const int2 l = pos + int2(-1, 0), r = pos + int2(1, 0);
+        const int2 u = pos + int2(0, -1), d = pos + int2(0, 1);
+
+        out[ch] = g + 0.5f * (TiledRead(cfa, L, l).r - TiledRead(green, L, l).r +
+                              TiledRead(cfa, L, r).r - TiledRead(green, L, r).r);
+        out[2 - ch] = g + 0.5f * (TiledRead(cfa, L, u).r - TiledRead(green, L, u).r +
+                                  TiledRead(cfa, L, d).r - TiledRead(green, L, d).r);
+    }
+
+    rgb.write(float4(out, 1), id.xy, id.z);
+}
+
+/*
+ * Step 5: Interpolates blue at red pixels (and red at blue pixels) from the color differences of the four direct
+ * neighbours, which are all green pixels. The results are clipped to [0, 1] and scaled.
+ */
+kernel void RPE_LMMSEColorAtRB(texture2d_array<float, access::read> rgb [[ texture(0) ]],
+                               texture2d_array<float, access::write> output [[ texture(1) ]],
+                               constant UniformIn &uniforms [[ buffer(0) ]],
+                               uint3 id [[ thread_position_in_grid ]]) {
+    constant TiledCFALayout &L = uniforms.layout;
+
+    int2 pos;
+    if(!TiledPosition(L, id, pos)) {
+        return;
+    }
+
+    float3 out = rgb.read(id.xy, id.z).rgb;
+    const int c = TiledCFAColor(L, pos);
+
+    if(c != 1) {
+        // the missing color
+        const int m = 2 - c;
+        float sum = 0;
+
+        const int2 offsets[4] = { int2(0, -1), int2(-1, 0), int2(1, 0), int2(0, 1) };
+        for(int i = 0; i < 4; i++) {
+            const float3 n = TiledRead(rgb, L, pos + offsets[i]).rgb;
+            sum += n[m] - n.g;
+        }
+
+        out[m] = out.g + 0.25f * sum;
+    }
+
+    out = clamp(out, 0.f, 1.f) * uniforms.outputScale;
+    output.write(float4(out, 1), id.xy, id.z);
+}
@@ -0,0 +1,48 @@
+//
+//  RawWhiteBalance.metal
+//  Waterpipe (macOS)
+//
+//  Created by Tristan Seifert on 20200906.
+//
+
+#include <metal_stdlib>
+using namespace metal;
+
+#include "TiledCFA.h"
+
+/*
+ * Uniforms passed into the compute kernel
+ */
+typedef struct {
+    // Position of pixels in the tiled image
+    TiledCFALayout layout;
+    // White balance multipliers, for each CFA index
+    float4 wb;
+    // Black levels, for each CFA index
+    float4 black;
+    // Factor to normalize values to [0, 1]
+    float scale;
+} UniformIn;
+
+
+/*
+ * Subtracts the black level from each raw sensor value and scales it by the white balance multiplier of its color.
+ * The results are clamped and normalized to [0, 1].
+ */
+kernel void RPE_RawWhiteBalance(texture2d_array<ushort, access::read> input [[ texture(0) ]],
+                                texture2d_array<float, access::write> output [[ texture(1) ]],
+                                constant UniformIn &uniforms [[ buffer(0) ]],
+                                uint3 id [[ thread_position_in_grid ]]) {
+    int2 pos;
+    if(!TiledPosition(uniforms.layout, id, pos)) {
+        return;
+    }
+
+    const uint index = TiledCFAIndex(uniforms.layout, pos);
+
+    // subtract black level (clamping at zero) and apply white balance
+    float value = float(input.read(id.xy, id.z).r);
+    value = max(value - uniforms.black[index], 0.f) * uniforms.wb[index];
+
+    output.write(float4(clamp(value * uniforms.scale, 0.f, 1.f)), id.xy, id.z);
+}
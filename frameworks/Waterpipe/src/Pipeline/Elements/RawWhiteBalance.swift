@@ -0,0 +1,138 @@
+//
+//  RawWhiteBalance.swift
+//  Waterpipe (macOS)
+//
+//  Created by Tristan Seifert on 20200906.
+//
+
+import Foundation
+import Metal
+import simd
+
+/**
+ * Subtracts the black level from raw sensor values, and applies the white balance multipliers. The input is a single
+ * component 16-bit unsigned integer image of CFA values; the output has them normalized to [0, 1], ready for demosaicing.
+ */
+internal class RawWhiteBalance: RenderPipelineElement {
+    /// Tag value
+    private(set) internal var tag: Tag?
+    /// Metal device
+    private(set) internal var device: MTLDevice!
+
+    /// Shader code library
+    private var library: MTLLibrary! = nil
+    /// Compute pipeline state
+    private var state: MTLComputePipelineState! = nil
+
+    /// Vertical shift of the Bayer pattern
+    private(set) internal var vShift: UInt = 0
+    /// White balance multipliers, for each CFA index
+    private(set) internal var wb = SIMD4<Float>(repeating: 1)
+    /// Black levels, for each CFA index
+    private(set) internal var black = SIMD4<Float>(repeating: 0)
+
+    // MARK: - Initialization
+    /**
+     * Creates a new white balance pipeline element, which only normalizes the input values.
+     */
+    required init(_ device: MTLDevice, tag: Tag? = nil) throws {
+        self.device = device
+        self.tag = tag
+
+        try self.initMetalResources(device)
+    }
+
+    /**
+     * Creates a new white balance pipeline element, with the given CFA layout and per color factors.
+     */
+    required init(_ device: MTLDevice, tag: Tag? = nil, vShift: UInt, wb: SIMD4<Float>,
+                  black: SIMD4<Float>) throws {
+        self.device = device
+        self.tag = tag
+        self.vShift = vShift
+        self.wb = wb
+        self.black = black
+
+        try self.initMetalResources(device)
+    }
+
+    /**
+     * Initializes Metal resources for the given device.
+     */
+    private func initMetalResources(_ device: MTLDevice) throws {
+        // get the shader library
+        let bundle = Bundle(for: type(of: self))
+        self.library = try device.makeDefaultLibrary(bundle: bundle)
+
+        // set up compute pipeline state
+        guard let state = try self.library.makeComputeState("RPE_RawWhiteBalance") else {
+            throw Errors.failedLoadingFunction
+        }
+        self.state = state
+    }
+
+    // MARK: - Encoding
+    /**
+     * Values are normalized to [0, 1] in a 16-bit format, which is exactly as precise as the input.
+     */
+    func outputPixelFormat(_ input: MTLPixelFormat) -> MTLPixelFormat {
+        return .r16Unorm
+    }
+
+    /**
+     * Encodes the white balance scaling into the given buffer.
+     */
+    func encode(_ buffer: MTLCommandBuffer, in inImage: TiledImage, out: TiledImage) throws {
+        // create command encoder
+        guard let encoder = buffer.makeComputeCommandEncoder() else {
+            throw Errors.failedMakeCommandEncoder
+        }
+        encoder.label = "RawWhiteBalance.encode(_:_:_:)"
+
+        // grab textures
+        guard let inTexture = inImage.texture, let outTexture = out.texture,
+              inTexture.pixelFormat == .r16Uint else {
+            throw Errors.invalidImage
+        }
+
+        // create a buffer with the info required by the compute functions
+        var uniforms = Uniforms(layout: TiledCFALayout(inImage, vShift: self.vShift), wb: self.wb,
+                                black: self.black, scale: (1.0 / 65535.0))
+        let uniformBuf = self.device.makeBuffer(bytes: &uniforms,
+                                                length: MemoryLayout<Uniforms>.stride)
+
+        // invoke the function
+        encoder.setTexture(inTexture, index: 0)
+        encoder.setTexture(outTexture, index: 1)
+
+        encoder.setBuffer(uniformBuf, offset: 0, index: 0)
+
+        encoder.dispatchTiles(inImage, self.state)
+        encoder.endEncoding()
+    }
+
+    // MARK: - Errors
+    enum Errors: Error {
+        /// Failed to load the compute function
+        case failedLoadingFunction
+        /// Failed to create a command encoder
+        case failedMakeCommandEncoder
+        /// Invalid images were passed in (no texture, or the input isn't 16-bit raw data)
+        case invalidImage
+    }
+
+    // MARK: - Types
+    /**
+     * Uniform buffer passed to the compute shader
+     */
+    private struct Uniforms {
+        /// Position of pixels in the tiled image
+        var layout: TiledCFALayout
+        /// White balance multipliers
+        var wb: SIMD4<Float>
+        /// Black levels
+        var black: SIMD4<Float>
+        /// Factor to normalize values to [0, 1]
+        var scale: Float
+    }
+}
@@ -0,0 +1,78 @@
+//
+//  TiledCFA.h
+//  Waterpipe (macOS)
+//
+//  Helpers shared by the raw development kernels. These address pixels by
+//  their position in the whole image rather than in a single tile, so that
+//  filters can read across tile boundaries.
+//
+//  Created by Tristan Seifert on 20200906.
+//
+
+#ifndef TILEDCFA_H
+#define TILEDCFA_H
+
+#include <metal_stdlib>
+using namespace metal;
+
+/*
+ * Describes how an image is split up into the slices of a tiled image's array texture
+ */
+typedef struct {
+    // Size of the image, in pixels
+    uint2 imageSize;
+    // Size of each (square) tile
+    uint tileSize;
+    // Number of tiles in each row of the image
+    uint tilesPerRow;
+    // Vertical shift of the Bayer pattern: if odd, the first line contains GB pixels
+    uint vShift;
+    // Unused; pads the struct to a multiple of its alignment
+    uint reserved;
+} TiledCFALayout;
+
+/*
+ * Gets the position in the image of the pixel a thread (dispatched over all slices of the tiled image) works on.
+ *
+ * Returns false if the position lies in the unused area of an edge tile.
+ */
+static inline bool TiledPosition(constant TiledCFALayout &layout, uint3 id, thread int2 &pos) {
+    pos = int2(((id.z % layout.tilesPerRow) * layout.tileSize) + id.x,
+               ((id.z / layout.tilesPerRow) * layout.tileSize) + id.y);
+
+    return (pos.x < int(layout.imageSize.x)) && (pos.y < int(layout.imageSize.y));
+}
+
+/*
+ * Gets the CFA color at the given position: 0 is red, 1 is green and 2 is blue.
+ */
+static inline int TiledCFAColor(constant TiledCFALayout &layout, int2 pos) {
+    return int((uint(pos.y) + layout.vShift) & 1) + (pos.x & 1);
+}
+
+/*
+ * Gets the CFA index (as used for the white balance and black levels) at the given position: 0 is red, 1 and 2 are
+ * the greens in red and blue lines, and 3 is blue.
+ */
+static inline uint TiledCFAIndex(constant TiledCFALayout &layout, int2 pos) {
+    return (((uint(pos.y) + layout.vShift) & 1) << 1) | uint(pos.x & 1);
+}
+
+/*
+ * Reads the pixel at the given position of the image. Positions outside the image are mirrored back into it, which
+ * keeps the CFA color at each position the same.
+ */
+static inline float4 TiledRead(texture2d_array<float, access::read> texture, constant TiledCFALayout &layout,
+                               int2 pos) {
+    const int2 size = int2(layout.imageSize);
+
+    pos = abs(pos);
+    pos = select(pos, (2 * (size - 1)) - pos, pos >= size);
+
+    const uint2 p = uint2(clamp(pos, int2(0), size - 1));
+    const uint2 tile = p / layout.tileSize;
+
+    return texture.read(p % layout.tileSize, (tile.y * layout.tilesPerRow) + tile.x);
+}
+
+#endif /* TILEDCFA_H */
@@ -0,0 +1,71 @@
+//
+//  TiledCFA.swift
+//  Waterpipe (macOS)
+//
+//  Created by Tristan Seifert on 20200906.
+//
+
+import Foundation
+import Metal
+
+/**
+ * Describes how an image is split into tiles, for the raw development kernels. They address pixels by their position in
+ * the whole image, so filters can read across tile boundaries.
+ *
+ * This must match the `TiledCFALayout` struct in `TiledCFA.h`.
+ */
+internal struct TiledCFALayout {
+    /// Size of the image, in pixels
+    var imageSize = SIMD2<UInt32>()
+    /// Size of each (square) tile
+    var tileSize: UInt32 = 0
+    /// Number of tiles in each row of the image
+    var tilesPerRow: UInt32 = 0
+    /// Vertical shift of the Bayer pattern
+    var vShift: UInt32 = 0
+    /// Padding, so the size matches the Metal struct when embedded in other structs
+    var reserved: UInt32 = 0
+
+    /**
+     * Creates the layout for the given tiled image.
+     */
+    init(_ image: TiledImage, vShift: UInt = 0) {
+        self.imageSize = SIMD2<UInt32>(UInt32(image.imageSize.width), UInt32(image.imageSize.height))
+        self.tileSize = UInt32(image.tileSize)
+        self.tilesPerRow = UInt32(image.tilesPerRow)
+        self.vShift = UInt32(vShift)
+    }
+}
+
+extension MTLComputeCommandEncoder {
+    /**
+     * Dispatches one thread for each pixel of every tile of the image, using the given compute pipeline state.
+     */
+    internal func dispatchTiles(_ image: TiledImage, _ state: MTLComputePipelineState) {
+        let w = state.threadExecutionWidth
+        let h = state.maxTotalThreadsPerThreadgroup / w
+        let threadsPerThreadgroup = MTLSize(width: w, height: h, depth: 1)
+        let threadsPerGrid = MTLSize(width: image.texture.width, height: image.texture.height,
+                                     depth: image.texture.arrayLength)
+
+        self.setComputePipelineState(state)
+        self.dispatchThreads(threadsPerGrid, threadsPerThreadgroup: threadsPerThreadgroup)
+    }
+}
+
+extension MTLLibrary {
+    /**
+     * Creates a compute pipeline state for the named function, or returns `nil` if the library has no such function.
+     */
+    internal func makeComputeState(_ name: String) throws -> MTLComputePipelineState? {
+        guard let function = self.makeFunction(name: name) else {
+            return nil
+        }
+
+        let desc = MTLComputePipelineDescriptor()
+        desc.computeFunction = function
+        desc.buffers[0].mutability = .immutable
+
+        return try self.device.makeComputePipelineState(descriptor: desc, options: [], reflection: nil)
+    }
+}
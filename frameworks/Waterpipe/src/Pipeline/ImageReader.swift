@@ -6,6 +6,7 @@
 //
 
 import Foundation
+import simd
 import UniformTypeIdentifiers
 
 import Paper
@@ -30,10 +31,11 @@ internal class ImageReader {
      * Returns an image object for the image at the given url, if a reader exists to handle it.
      *
      * - Parameter url: Location of the image to read
+     * - Parameter rawCache: Persistent cache to read decoded sensor data from, and store it into, if the reader supports it
      * - Returns Read image, or nil if the format isn't supported.
      * - Throws If the file type can't be determined, or something goes wrong while reading the image.
      */
-    internal func read(url: URL) throws -> ImageReaderImpl? {
+    internal func read(url: URL, rawCache: RawCache? = nil) throws -> ImageReaderImpl? {
         // get the type
         guard let resVals = try? url.resourceValues(forKeys: [.typeIdentifierKey]),
               let typeString = resVals.typeIdentifier,
@@ -44,7 +46,12 @@ internal class ImageReader {
         // query each reader implementation
         for reader in Self.readers {
             if reader.supportsType(type) {
-                return try reader.init(withFileAt: url, type)
+                let image = try reader.init(withFileAt: url, type)
+                
+                if let cache = rawCache {
+                    image.useRawCache(cache)
+                }
+                return image
             }
         }
         
@@ -74,6 +81,16 @@ internal class ImageReader {
         case float32
     }
     
+    /// Quality at which images are decoded
+    enum DecodeQuality {
+        /// Fast decode for immediate display, which may be lower quality (e.g. a simpler demosaic)
+        case preview
+        /// Decode at the best quality supported
+        case full
+        /// Best quality, plus refinements that are too slow for interactive use (e.g. median filtering after demosaicing)
+        case export
+    }
+    
     /// Describes an image buffer returned from a decode command.
     public struct ImageBuffer {
         /// Data buffer containing image data. Must be at least `bytesPerRow` * `rows` bytes.
@@ -84,6 +101,41 @@ internal class ImageReader {
         var rows: UInt
         /// Number of columns in the image
         var cols: UInt
+        
+        /// Histogram of the pixels, if the reader counted one while decoding
+        var histogram: HistogramCalculator.HistogramData? = nil
+    }
+    
+    /// Describes undemosaiced sensor data returned from a raw decode, so it can be developed on the GPU.
+    public struct RawBuffer {
+        /// Raw sensor values, one 16-bit value per pixel; the first line contains RG pixels, unless shifted
+        var data: Data
+        /// Bytes per row of sensor data
+        var bytesPerRow: Int
+        /// Size of the image, in pixels
+        var size: CGSize
+        /// Vertical shift of the Bayer pattern
+        var vShift: UInt
+        
+        /// White balance multipliers, for each CFA index
+        var wb: SIMD4<Float>
+        /// Black levels, for each CFA index
+        var black: SIMD4<Float>
+        /// XYZ to camera RGB matrix
+        var matrix: simd_float3x3
+        /// Factor applied to the demosaiced values (in the 0-65535 range) before color conversion
+        var scale: Float
+        
+        /// Demosaicing algorithm to use
+        var algorithm: DemosaicAlgorithm
+    }
+    
+    /// Demosaicing algorithms available for developing raw buffers on the GPU
+    enum DemosaicAlgorithm {
+        /// Adaptive homogeneity-directed interpolation
+        case ahd
+        /// Linear minimum mean square error interpolation; slower, but handles noise better
+        case lmmse
     }
     
     // MARK: - Errors
@@ -9,6 +9,8 @@ import Foundation
 import simd
 import UniformTypeIdentifiers
 
+import Paper
+
 /**
  * Protocol describing the interface of image reader implementations
  */
@@ -35,6 +37,27 @@ protocol ImageReaderImpl {
      */
     func decode(_ format: ImageReader.BitmapFormat) throws -> ImageReader.ImageBuffer
     
+    /**
+     * Decodes the image at the given quality. A preview decode is expected to be much faster than a full quality decode, which
+     * may follow later; full quality decodes should stop early if the current `Progress` is cancelled.
+     */
+    func decode(_ format: ImageReader.BitmapFormat, quality: ImageReader.DecodeQuality) throws -> ImageReader.ImageBuffer
+    
+    /**
+     * Decodes the image's raw sensor data at the given quality, without demosaicing it, so that it can be developed on the
+     * GPU instead.
+     *
+     * - Returns: The raw sensor data, or `nil` if the image should be decoded to a bitmap instead; this may depend on
+     * the quality.
+     */
+    func decodeRaw(quality: ImageReader.DecodeQuality) throws -> ImageReader.RawBuffer?
+    
+    /**
+     * Reads decoded sensor data from the given persistent cache, if the image was decoded before, and adds it to the cache
+     * otherwise.
+     */
+    func useRawCache(_ cache: RawCache)
+    
     /**
      * Allows the image reader to insert some format specific processing elements at the start of a pipeline state object.
      */
@@ -47,3 +70,25 @@ protocol ImageReaderImpl {
     /// Dimensions of image
     var size: CGSize { get }
 }
+
+extension ImageReaderImpl {
+    /**
+     * Readers without a faster preview decode always decode at full quality.
+     */
+    func decode(_ format: ImageReader.BitmapFormat, quality: ImageReader.DecodeQuality) throws -> ImageReader.ImageBuffer {
+        return try self.decode(format)
+    }
+    
+    /**
+     * Readers that don't expose raw sensor data always decode to bitmaps.
+     */
+    func decodeRaw(quality: ImageReader.DecodeQuality) throws -> ImageReader.RawBuffer? {
+        return nil
+    }
+    
+    /**
+     * Readers that don't expose raw sensor data have nothing to cache.
+     */
+    func useRawCache(_ cache: RawCache) {
+    }
+}
@@ -49,27 +49,46 @@ internal class LibRawImageReaderImpl: ImageReaderImpl {
      * the image, further calls just convert that bitmap to the requested format.
      */
     func decode(_ format: ImageReader.BitmapFormat) throws -> ImageBuffer {
-        // decode image if needed
-        try self.reader.decode()
-        
-        // lastly, convert to the output pixel format
-        switch format {
-        case .float32:
-            return try self.convert16UTo32F()
-        case .float16:
-            /// XXX: completely untested lmfao
-            fatalError("unimplemented")
-        }
+        return try self.decode(format, quality: .full)
     }
     
     /**
-     * Converts a 16-bit unsigned buffer into a 32-bit float buffer.
+     * Decodes the image at the given quality. Previews are demosaiced by collapsing each 2x2 block of the CFA, rather than
+     * with AHD interpolation.
      */
-    private func convert16UTo32F() throws -> ImageBuffer {
-        guard let inData = self.reader.debayered else {
+    func decode(_ format: ImageReader.BitmapFormat, quality: ImageReader.DecodeQuality) throws -> ImageBuffer {
+        // half floats come straight out of the decoder; the full quality image keeps its format once decoded
+        if self.reader.debayered == nil {
+            self.reader.halfFloat = (format == .float16)
+        }
+        
+        // decode image if needed
+        self.reader.medianPasses = (quality == .export) ? 3 : 0
+        try self.reader.decode(quality: (quality == .preview) ? .preview : .full)
+        
+        // the preview is gone once the full quality image was decoded
+        guard let inData = self.reader.preview ?? self.reader.debayered else {
             throw Errors.invalidDecode
         }
         
+        // lastly, convert to the output pixel format if needed
+        switch (format, self.reader.halfFloat) {
+        case (.float16, true):
+            return ImageBuffer(data: Data(referencing: inData), bytesPerRow: Int(self.size.width) * 4 * 2,
+                               rows: UInt(self.size.height), cols: UInt(self.size.width))
+        case (.float16, false):
+            return try self.convert32FTo16F(self.convert16UTo32F(inData))
+        case (.float32, true):
+            return try self.convert16FTo32F(inData)
+        case (.float32, false):
+            return try self.convert16UTo32F(inData)
+        }
+    }
+    
+    /**
+     * Converts a 16-bit unsigned buffer into a 32-bit float buffer.
+     */
+    private func convert16UTo32F(_ inData: NSMutableData) throws -> ImageBuffer {
         // create descriptor for input buffer
         var inBuf = vImage_Buffer(data: inData.mutableBytes,
                                   height: UInt(self.size.height),
@@ -95,6 +114,60 @@ internal class LibRawImageReaderImpl: ImageReaderImpl {
                            rows: UInt(self.size.height), cols: UInt(self.size.width))
     }
     
+    /**
+     * Converts a half float buffer into a 32-bit float buffer.
+     */
+    private func convert16FTo32F(_ inData: NSMutableData) throws -> ImageBuffer {
+        var inBuf = vImage_Buffer(data: inData.mutableBytes,
+                                  height: UInt(self.size.height),
+                                  width: UInt(self.size.width) * 4,
+                                  rowBytes: Int(self.size.width * 4 * 2))
+        
+        let bytes = self.size.height * self.size.width * 4 * 4
+        let floatData = NSMutableData(length: Int(bytes))!
+        
+        var outBuf = vImage_Buffer(data: floatData.mutableBytes,
+                                   height: UInt(self.size.height),
+                                   width: UInt(self.size.width) * 4,
+                                   rowBytes: Int(self.size.width * 4 * 4))
+        
+        let err = vImageConvert_Planar16FtoPlanarF(&inBuf, &outBuf, vImage_Flags(kvImageNoFlags))
+        guard err == kvImageNoError else {
+            throw Errors.bufferConvertFailed(err)
+        }
+        
+        return ImageBuffer(data: floatData as Data, bytesPerRow: Int(self.size.width) * 4 * 4,
+                           rows: UInt(self.size.height), cols: UInt(self.size.width))
+    }
+    
+    /**
+     * Narrows a 32-bit float buffer to half floats. This is only needed if the full quality image was decoded to 16-bit
+     * integers before half floats were requested.
+     */
+    private func convert32FTo16F(_ input: ImageBuffer) throws -> ImageBuffer {
+        var data = input.data
+        let halfData = NSMutableData(length: Int(self.size.height * self.size.width * 4 * 2))!
+        
+        var outBuf = vImage_Buffer(data: halfData.mutableBytes,
+                                   height: UInt(self.size.height),
+                                   width: UInt(self.size.width) * 4,
+                                   rowBytes: Int(self.size.width * 4 * 2))
+        
+        let err = data.withUnsafeMutableBytes { (bytes: UnsafeMutableRawBufferPointer) -> vImage_Error in
+            var inBuf = vImage_Buffer(data: bytes.baseAddress!,
+                                      height: UInt(self.size.height),
+                                      width: UInt(self.size.width) * 4,
+                                      rowBytes: input.bytesPerRow)
+            return vImageConvert_PlanarFtoPlanar16F(&inBuf, &outBuf, vImage_Flags(kvImageNoFlags))
+        }
+        guard err == kvImageNoError else {
+            throw Errors.bufferConvertFailed(err)
+        }
+        
+        return ImageBuffer(data: halfData as Data, bytesPerRow: Int(self.size.width) * 4 * 2,
+                           rows: UInt(self.size.height), cols: UInt(self.size.width))
+    }
+    
     // MARK: - Pipeline support
     /**
      * Adds color space conversion to the start of all pipeline state objects created with this image.
@@ -44,9 +44,12 @@ public class RenderPipeline {
     /**
      * Creates a pipeline state object for the image at the given url.
      *
+     * For progressive display, the image is only decoded at preview quality. States created this way can be rendered right
+     * away, then later upgraded to the full quality image with `refine(_:)`.
+     *
      * - Note: `Progress` reporting is supported. All processing takes place synchronously.
      */
-    public func createState(image: RenderPipelineImage) throws -> RenderPipelineState {
+    public func createState(image: RenderPipelineImage, progressive: Bool = false) throws -> RenderPipelineState {
         let progress = Progress(totalUnitCount: 3)
         
         // decode the image
@@ -56,7 +59,8 @@ public class RenderPipeline {
             throw Errors.makeCommandBufferFailed
         }
         
-        try image.decode(device: self.device, commandBuffer: buffer)
+        try image.decode(device: self.device, commandBuffer: buffer,
+                         quality: progressive ? .preview : .full)
         progress.resignCurrent()
         
         progress.becomeCurrent(withPendingUnitCount: 1)
@@ -77,6 +81,45 @@ public class RenderPipeline {
         return state
     }
 
+    /**
+     * Decodes the image of a pipeline state created for progressive display at full quality, replacing the preview image
+     * it was created with. This is a no-op if the image is already decoded at full quality.
+     *
+     * - Note: `Progress` reporting and cancellation are supported. All processing takes place synchronously; the state may
+     * still be rendered from other threads in the meantime.
+     */
+    public func refine(_ state: RenderPipelineState) throws {
+        let progress = Progress(totalUnitCount: 2)
+        
+        guard self.device.registryID == state.device.registryID else {
+            throw Errors.invalidDevice
+        }
+        guard !state.image.isFullQuality else {
+            return
+        }
+        
+        // decode the image again
+        progress.becomeCurrent(withPendingUnitCount: 1)
+        
+        guard let buffer = self.commandQueue.makeCommandBuffer() else {
+            throw Errors.makeCommandBufferFailed
+        }
+        
+        do {
+            try state.image.decode(device: self.device, commandBuffer: buffer, quality: .full)
+            progress.resignCurrent()
+        } catch {
+            // most likely, the decode was cancelled
+            progress.resignCurrent()
+            throw error
+        }
+        
+        progress.becomeCurrent(withPendingUnitCount: 1)
+        buffer.commit()
+        buffer.waitUntilCompleted()
+        progress.resignCurrent()
+    }
+
     /**
      * Renders the given pipeline state synchronously. The output is rendered into the given tiled image.
      *
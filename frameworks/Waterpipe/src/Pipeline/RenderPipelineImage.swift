@@ -8,6 +8,7 @@
 import Foundation
 
 import Metal
+import Paper
 
 /**
  * Represents a single image to ingest into the render pipeline.
@@ -38,11 +39,14 @@ public class RenderPipelineImage {
      * This will automatically determine how to get at the image data (by invoking the correct camera raw reader) and read some
      * preliminary metadata from it.
      *
+     * - Parameter rawCache: If set, decoded sensor data is read from this cache if the image was decoded before (skipping
+     * its decompression), and added to it otherwise.
+     *
      * - Note: `Progress` reporting is supported. All processing takes place synchronously.
      */
-    public init(url: URL, transient: Bool = false) throws {
+    public init(url: URL, transient: Bool = false, rawCache: RawCache? = nil) throws {
         // try to read image
-        guard let image = try ImageReader.shared.read(url: url) else {
+        guard let image = try ImageReader.shared.read(url: url, rawCache: rawCache) else {
             throw Errors.readImageFailed(url)
         }
         
@@ -58,19 +62,66 @@ public class RenderPipelineImage {
     }
     
     // MARK: - Decoding
+    /**
+     * Everything produced by decoding the image. Decodes build a new one off to the side and swap it in once they're done, so
+     * the image can be rendered from other threads while it's refined at full quality.
+     */
+    private struct DecodedState {
+        /// Device on which the image was decoded
+        var device: MTLDevice? = nil
+        /// Has the image been decoded yet?
+        var isDecoded: Bool = false
+        /// Was the image decoded at full quality, rather than as a preview?
+        var isFullQuality: Bool = false
+        
+        /// Tiled image containing pixel data
+        var tiledImage: TiledImage? = nil
+        /// Histogram of the decoded image, if its reader calculated one
+        var histogram: HistogramCalculator.HistogramData? = nil
+        /// Buffer on the GPU containing the image data
+        var pixelBuffer: MTLBuffer? = nil
+    }
+    
+    /// Protects the decoded state; it's only held to read or swap it, never during a decode
+    private let stateLock = NSLock()
+    /// Held for the entire duration of a decode, so decodes of the same image run one after another
+    private let decodeLock = NSLock()
+    /// Current decoded state of the image
+    private var state = DecodedState()
+    
+    /// Copy of the current decoded state
+    private var decodedState: DecodedState {
+        self.stateLock.lock()
+        defer { self.stateLock.unlock() }
+        
+        return self.state
+    }
+    
     /**
      * Device on which the image was most recently decoded. This is the device that contains the image tile texture and image
      * data buffer objects.
      */
-    private(set) public var device: MTLDevice? = nil
+    public var device: MTLDevice? {
+        return self.decodedState.device
+    }
     /// Has the image been decoded yet?
-    private(set) internal var isDecoded: Bool = false
+    internal var isDecoded: Bool {
+        return self.decodedState.isDecoded
+    }
+    /// Was the image decoded at full quality, rather than as a preview?
+    public var isFullQuality: Bool {
+        return self.decodedState.isFullQuality
+    }
     
     /// Tiled image containing pixel data
-    private(set) internal var tiledImage: TiledImage? = nil
-    
-    /// Buffer on the GPU containing the image data
-    private var pixelBuffer: MTLBuffer? = nil
+    internal var tiledImage: TiledImage? {
+        return self.decodedState.tiledImage
+    }
+    /// Histogram of the decoded image, if its reader calculated one while decoding; this matches the histogram of an
+    /// unedited render, without having to calculate it on the GPU
+    public var decodedHistogram: HistogramCalculator.HistogramData? {
+        return self.decodedState.histogram
+    }
     
     /**
      * Decodes the image.
@@ -79,51 +130,121 @@ public class RenderPipelineImage {
      * the current decode is requested, the call is a no-op. Otherwise, the contents of the image will not be valid until the
      * commands encoded into the command buffer have been executed.
      *
+     * Decoding a preview first and then decoding at full quality on the same device updates the existing tiled image in place,
+     * so pipeline states created with the preview pick up the full quality image. The decoded state is swapped in only once the
+     * decode succeeded, so the preview may be rendered from other threads in the meantime.
+     *
      * - Note: `Progress` reporting is supported. This runs synchronously on the caller thread, and may take a not
-     * insignificant amount of time.
+     * insignificant amount of time. Full quality decodes can be cancelled through the progress. Transient images (used for
+     * batch exports) are decoded with the slower export quality refinements rather than at full quality.
      */
-    internal func decode(device: MTLDevice, commandBuffer: MTLCommandBuffer) throws {
+    internal func decode(device: MTLDevice, commandBuffer: MTLCommandBuffer,
+                         quality: ImageReader.DecodeQuality = .full) throws {
+        let quality: ImageReader.DecodeQuality = (quality == .full && self.isTransient) ? .export : quality
+        
+        self.decodeLock.lock()
+        defer { self.decodeLock.unlock() }
+        
         // short circuit if decode is valid
-        if self.isDecoded, let lastDevice = self.device,
-           lastDevice.registryID == device.registryID {
+        let current = self.decodedState
+        let sameDevice = current.isDecoded && current.device?.registryID == device.registryID
+        if sameDevice, current.isFullQuality || quality == .preview {
             return
         }
         
         // set up for progress reporting
         let progress = Progress(totalUnitCount: 2)
         
-        // decode the image to an RGBA data buffer and copy to GPU
-        // TODO: support 16 bit formats
+        // readers with raw sensor data hand it over undemosaiced; others decode to a half float RGBA data buffer (which
+        // readers can produce directly.) Either is copied to the GPU.
         // TODO: use .shared storage mode on iOS
         progress.becomeCurrent(withPendingUnitCount: 1)
         
-        let decoded = try self.image.decode(.float32)
-        try decoded.data.withUnsafeBytes {
+        let raw: ImageReader.RawBuffer?
+        let decoded: ImageReader.ImageBuffer?
+        do {
+            raw = try self.image.decodeRaw(quality: quality)
+            decoded = (raw == nil) ? try self.image.decode(.float16, quality: quality) : nil
+        } catch {
+            progress.resignCurrent()
+            throw error
+        }
+        
+        var new = DecodedState(device: device, isDecoded: true, isFullQuality: (quality != .preview),
+                               histogram: decoded?.histogram)
+        
+        let data = raw?.data ?? decoded!.data
+        let pixelBuffer: MTLBuffer = try data.withUnsafeBytes {
             guard let buf = device.makeBuffer(bytes: $0.baseAddress!,
-                                              length: decoded.data.count,
+                                              length: data.count,
                                               options: .storageModeManaged) else {
                 throw Errors.makeBufferFailed
             }
-            self.pixelBuffer = buf
+            return buf
         }
+        new.pixelBuffer = pixelBuffer
         
         progress.resignCurrent()
         
-        // allocate a tiled image and copy the buffer into it
+        // allocate a tiled image (unless refining a preview) and copy the buffer into it, developing raw data on the way
         progress.becomeCurrent(withPendingUnitCount: 1)
-        guard let tiled = TiledImage(device: device, forImageSized: self.image.size,
-                                     tileSize: 512) else {
-            throw Errors.makeTiledImageFailed
+        if sameDevice, let tiled = current.tiledImage {
+            new.tiledImage = tiled
+        } else {
+            guard let tiled = TiledImage(device: device, forImageSized: self.image.size,
+                                         tileSize: 512, .rgba16Float) else {
+                throw Errors.makeTiledImageFailed
+            }
+            new.tiledImage = tiled
+        }
+        
+        if let raw = raw {
+            try self.develop(raw, pixelBuffer, into: new.tiledImage!, device: device, commandBuffer: commandBuffer)
+        } else {
+            try TiledImage.copyBufferToImage(commandBuffer, pixelBuffer, image.size,
+                                             decoded!.bytesPerRow, .rgba16Float, new.tiledImage!)
         }
-        try TiledImage.copyBufferToImage(commandBuffer, self.pixelBuffer!, image.size,
-                                         decoded.bytesPerRow, .rgba32Float, tiled)
         
-        self.tiledImage = tiled        
         progress.resignCurrent()
         
-        // ensure we won't decode on the same device again later
-        self.device = device
-        self.isDecoded = true
+        // swap in the new state; this also ensures we won't decode on the same device again later
+        self.stateLock.lock()
+        self.state = new
+        self.stateLock.unlock()
+    }
+    
+    /**
+     * Develops raw sensor data (already copied into the pixel buffer) into the tiled image on the GPU: the black level
+     * and white balance are applied, then it's demosaiced and converted to the working color space.
+     */
+    private func develop(_ raw: ImageReader.RawBuffer, _ pixelBuffer: MTLBuffer, into tiledImage: TiledImage,
+                         device: MTLDevice, commandBuffer: MTLCommandBuffer) throws {
+        guard let cfa = TiledImage(buffer: commandBuffer, imageSize: raw.size,
+                                   tileSize: tiledImage.tileSize, .r16Uint) else {
+            throw Errors.makeTiledImageFailed
+        }
+        try TiledImage.copyBufferToImage(commandBuffer, pixelBuffer, raw.size, raw.bytesPerRow,
+                                         .r16Uint, cfa)
+        
+        // demosaicing outputs values in [0, 1], rather than the 0-65535 range the scale is relative to
+        let outputScale = raw.scale * 65535
+        
+        let demosaic: RenderPipelineElement
+        switch raw.algorithm {
+        case .ahd:
+            demosaic = try DemosaicAHD(device, vShift: raw.vShift, matrix: raw.matrix,
+                                       outputScale: outputScale)
+        case .lmmse:
+            demosaic = try DemosaicLMMSE(device, vShift: raw.vShift, outputScale: outputScale)
+        }
+        
+        let elements: [RenderPipelineElement] = [
+            try RawWhiteBalance(device, vShift: raw.vShift, wb: raw.wb, black: raw.black),
+            demosaic,
+            try MatrixMultiply(device, matrix: raw.matrix),
+        ]
+        
+        _ = try RenderPipelineState.encode(elements, commandBuffer, in: cfa, out: tiledImage)
     }
     
     /**
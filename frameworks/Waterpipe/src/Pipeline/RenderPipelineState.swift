@@ -54,34 +54,55 @@ public class RenderPipelineState {
      * - Returns: The output image, or `nil` if no image processing took place.
      */
     internal func render(buffer: MTLCommandBuffer) throws -> TiledImage {
-        var input: TiledImage? = self.image.tiledImage
-        var output: TiledImage? = self.image.tiledImage
+        return try Self.encode(self.elements, buffer, in: self.image.tiledImage!)
+    }
+    
+    /**
+     * Encodes a chain of processing elements, each reading the output of the previous one. Each element's output is
+     * a temporary image in the pixel format it produces, except that of the last element, which may be specified.
+     *
+     * - Parameter finalOutput: Image written by the last element; it must be in the format that element produces. If
+     * there are no elements, it's not written at all.
+     *
+     * - Returns: The output image of the last element, or the input image if there are no elements.
+     */
+    internal class func encode(_ elements: [RenderPipelineElement], _ buffer: MTLCommandBuffer,
+                               in image: TiledImage, out finalOutput: TiledImage? = nil) throws -> TiledImage {
+        var input = image
         
-        // encode each element        
-        try self.elements.forEach { element in
+        // encode each element
+        for (i, element) in elements.enumerated() {
             // allocate an output texture
-            let tempOut = TiledImage(buffer: buffer, imageSize: input!.imageSize,
-                                     tileSize: input!.tileSize, input!.pixelFormat, 1)
-            output = tempOut
+            let format = element.outputPixelFormat(input.pixelFormat)
+            let output: TiledImage
             
-            // encode the element
-            precondition(input != nil)
-            precondition(output != nil)
+            if i == (elements.count - 1), let final = finalOutput {
+                output = final
+            } else {
+                guard let tempOut = TiledImage(buffer: buffer, imageSize: input.imageSize,
+                                               tileSize: input.tileSize, format, 1) else {
+                    throw Errors.makeImageFailed
+                }
+                output = tempOut
+            }
             
-            try element.encode(buffer, in: input!, out: output!)
-            input!.didRead()
+            // encode the element
+            try element.encode(buffer, in: input, out: output)
+            input.didRead()
             
             // use the output of this element as the input of the next
             input = output
         }
         
-        return output!
+        return input
     }
     
     // MARK: - Errors
     public enum Errors: Error {
         /// Image is not decoded
         case imageNotDecoded
+        /// Failed to allocate an intermediate image
+        case makeImageFailed
     }
     
     // MARK: - Types
@@ -112,4 +133,18 @@ public protocol RenderPipelineElement {
      * Encodes the element into the given command buffer, with the specified input and output images.
      */
     func encode(_ buffer: MTLCommandBuffer, in: TiledImage, out: TiledImage) throws
+    
+    /**
+     * Gets the pixel format of the images the element outputs, given the format of its input.
+     */
+    func outputPixelFormat(_ input: MTLPixelFormat) -> MTLPixelFormat
+}
+
+extension RenderPipelineElement {
+    /**
+     * Most elements output images in the same format as their input.
+     */
+    public func outputPixelFormat(_ input: MTLPixelFormat) -> MTLPixelFormat {
+        return input
+    }
 }
@@ -150,10 +150,13 @@ public class TiledImage {
      */
     public class func copyBufferToImage(_ commandBuffer: MTLCommandBuffer, _ imageBuffer: MTLBuffer,
             _ imageSize: CGSize, _ bytesPerRow: Int, _ pixelFormat: MTLPixelFormat, _ destination: TiledImage) throws {
-        // validate size
+        // validate size and format
         guard imageSize == destination.imageSize else {
             throw Errors.invalidDestinationSize
         }
+        guard let bytesPerPixel = Self.bytesPerPixel(pixelFormat) else {
+            throw Errors.unsupportedPixelFormat(pixelFormat)
+        }
         // set up a blit command encoder
         guard let encoder = commandBuffer.makeBlitCommandEncoder() else {
             throw Errors.invalidBlitEncoder
@@ -184,8 +187,8 @@ public class TiledImage {
                 
                 // calculate index into texture array and buffer and perform copy
                 let index = (row * tilesPerRow) + col
-                let bytesPerPixel = Int(destination.tileSize) * 4 * 4
-                let offset = (row * Int(destination.tileSize) * bytesPerRow) + (col * bytesPerPixel)
+                let bytesPerTileRow = Int(destination.tileSize) * bytesPerPixel
+                let offset = (row * Int(destination.tileSize) * bytesPerRow) + (col * bytesPerTileRow)
                 
                 encoder.copy(from: imageBuffer, sourceOffset: offset,
                              sourceBytesPerRow: bytesPerRow, sourceBytesPerImage: 0,
@@ -202,6 +205,22 @@ public class TiledImage {
     }
     
     // MARK: Helpers
+    /**
+     * Gets the number of bytes per pixel of the buffer pixel formats that can be copied into tiles.
+     */
+    private class func bytesPerPixel(_ format: MTLPixelFormat) -> Int? {
+        switch format {
+        case .rgba32Float:
+            return 16
+        case .rgba16Float:
+            return 8
+        case .r16Uint:
+            return 2
+        default:
+            return nil
+        }
+    }
+    
     /**
      * Informs that the image has been read from.
      *
@@ -351,6 +370,8 @@ public class TiledImage {
         case invalidDestinationSize
         /// Failed to create a blit command encoder
         case invalidBlitEncoder
+        /// Buffers in the given pixel format can't be copied into tiles
+        case unsupportedPixelFormat(_ format: MTLPixelFormat)
     }
 
     // MARK: - Types
@@ -0,0 +1,379 @@
+//
+//  bench.c
+//  PaperBench
+//
+//  Created by Tristan Seifert on 20200911.
+//
+
+#include "bench.h"
+#include "inputs.h"
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include <mach/mach.h>
+
+/// Interval at which the memory footprint is sampled while an iteration runs, in microseconds
+#define kSampleInterval 500
+/// Stack size of the threads running jobs; some kernels keep large tables on the stack
+#define kWorkerStackSize (8 * 1024 * 1024)
+
+// MARK: - Memory footprint
+/**
+ * Gets the physical memory footprint of the process, which is what the system charges it for: this counts
+ * dirty and compressed pages, but not clean ones that can be paged out.
+ */
+static uint64_t Footprint(void) {
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+
+    if(task_info(mach_task_self(), TASK_VM_INFO, (task_info_t) &info, &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return info.phys_footprint;
+}
+
+/**
+ * Samples the memory footprint on a thread of its own, keeping the largest value seen
+ */
+typedef struct sampler {
+    pthread_t thread;
+    atomic_bool stop;
+    _Atomic(uint64_t) peak;
+} sampler_t;
+
+static void *SamplerMain(void *ctx) {
+    sampler_t *sampler = ctx;
+
+    do {
+        const uint64_t footprint = Footprint();
+        if(footprint > atomic_load(&sampler->peak)) {
+            atomic_store(&sampler->peak, footprint);
+        }
+
+        usleep(kSampleInterval);
+    } while(!atomic_load(&sampler->stop));
+
+    return NULL;
+}
+
+static int SamplerStart(sampler_t *sampler) {
+    atomic_init(&sampler->stop, false);
+    atomic_init(&sampler->peak, Footprint());
+
+    return pthread_create(&sampler->thread, NULL, SamplerMain, sampler);
+}
+
+/**
+ * Stops sampling, and takes a last sample in case anything grew since.
+ *
+ * @return Peak footprint while the sampler ran
+ */
+static uint64_t SamplerStop(sampler_t *sampler) {
+    atomic_store(&sampler->stop, true);
+    pthread_join(sampler->thread, NULL);
+
+    return MAX(atomic_load(&sampler->peak), Footprint());
+}
+
+// MARK: - Running jobs
+/**
+ * Holds the workers of an iteration until all of them are ready to go
+ */
+typedef struct gate {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    /// Number of workers waiting
+    size_t ready;
+    /// Set once the workers may start
+    bool open;
+} gate_t;
+
+/**
+ * A thread running a single job
+ */
+typedef struct worker {
+    pthread_t thread;
+    gate_t *gate;
+
+    const bench_case_t *bc;
+    void *job;
+    stage_stats_t *stats;
+
+    /// Result of the run, and when it finished
+    int result;
+    uint64_t end;
+} worker_t;
+
+static void *WorkerMain(void *ctx) {
+    worker_t *worker = ctx;
+    gate_t *gate = worker->gate;
+
+    pthread_mutex_lock(&gate->lock);
+    gate->ready++;
+    pthread_cond_broadcast(&gate->changed);
+
+    while(!gate->open) {
+        pthread_cond_wait(&gate->changed, &gate->lock);
+    }
+    pthread_mutex_unlock(&gate->lock);
+
+    worker->result = worker->bc->run(worker->job, worker->stats);
+    worker->end = StageTime();
+
+    return NULL;
+}
+
+/**
+ * Runs all jobs once, concurrently. Threads are created before timing starts, and the iteration lasts until
+ * the last job finished.
+ *
+ * @param outSeconds Duration of the iteration
+ * @return 0 on success, or the first error returned by a job
+ */
+static int RunIteration(const bench_case_t *bc, void **jobs, size_t threads, stage_stats_t *stats,
+                        double *outSeconds) {
+    int err = 0;
+    size_t started = 0;
+    pthread_attr_t attr;
+    gate_t gate;
+
+    worker_t *workers = calloc(threads, sizeof(worker_t));
+    if(!workers) return -1;
+
+    pthread_mutex_init(&gate.lock, NULL);
+    pthread_cond_init(&gate.changed, NULL);
+    gate.ready = 0;
+    gate.open = false;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, kWorkerStackSize);
+
+    for(; started < threads; started++) {
+        worker_t *worker = &workers[started];
+        worker->gate = &gate;
+        worker->bc = bc;
+        worker->job = jobs[started];
+        worker->stats = stats;
+
+        if(pthread_create(&worker->thread, &attr, WorkerMain, worker)) {
+            err = -1;
+            break;
+        }
+    }
+
+    // release all workers at once (even if some couldn't be created, so they can exit)
+    pthread_mutex_lock(&gate.lock);
+    while(gate.ready < started) {
+        pthread_cond_wait(&gate.changed, &gate.lock);
+    }
+
+    const uint64_t start = StageTime();
+    gate.open = true;
+    pthread_cond_broadcast(&gate.changed);
+    pthread_mutex_unlock(&gate.lock);
+
+    uint64_t end = start;
+
+    for(size_t i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+
+        end = MAX(end, workers[i].end);
+        if(!err) err = workers[i].result;
+    }
+
+    *outSeconds = (double) (end - start) / 1e9;
+
+    pthread_attr_destroy(&attr);
+    pthread_cond_destroy(&gate.changed);
+    pthread_mutex_destroy(&gate.lock);
+    free(workers);
+
+    return err;
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+    const double x = *((const double *) a), y = *((const double *) b);
+    return (x > y) - (x < y);
+}
+
+/**
+ * Benchmarks a case with the given input.
+ */
+int BenchRun(const bench_case_t *bc, const bench_input_t *input, size_t threads, size_t iterations,
+             bench_result_t *outResult) {
+    int err = 0;
+    size_t numJobs = 0;
+    bench_work_t work = {0, 0};
+
+    iterations = MAX(iterations, 1);
+    memset(outResult, 0, sizeof(*outResult));
+    outResult->threads = threads;
+    outResult->iterations = iterations;
+
+    void **jobs = calloc(threads, sizeof(void *));
+    double *seconds = calloc(iterations, sizeof(double));
+    stage_stats_t *stats = StageStatsNew();
+
+    if(!jobs || !seconds || !stats) {
+        err = -1;
+        goto done;
+    }
+
+    // set up all jobs; a case that declines the input does so for all of them
+    for(; numJobs < threads; numJobs++) {
+        if(!(jobs[numJobs] = bc->setup(input, &work))) {
+            err = numJobs ? -1 : 1;
+            goto done;
+        }
+    }
+
+    // one warmup iteration, then the timed ones
+    for(size_t i = 0; i <= iterations; i++) {
+        sampler_t sampler;
+
+        for(size_t j = 0; j < numJobs; j++) {
+            if(bc->prepare && (err = bc->prepare(jobs[j]))) goto done;
+        }
+        StageStatsReset(stats);
+
+        const uint64_t baseline = Footprint();
+        if(SamplerStart(&sampler)) {
+            err = -1;
+            goto done;
+        }
+
+        double duration = 0;
+        err = RunIteration(bc, jobs, threads, stats, &duration);
+
+        const uint64_t peak = SamplerStop(&sampler);
+        if(peak > baseline) {
+            outResult->peakScratchBytes = MAX(outResult->peakScratchBytes, peak - baseline);
+        }
+
+        if(err) goto done;
+        if(i) seconds[i - 1] = duration;
+    }
+
+    // summarize the timed iterations
+    qsort(seconds, iterations, sizeof(double), CompareDoubles);
+
+    outResult->work = work;
+    outResult->minSeconds = seconds[0];
+    outResult->maxSeconds = seconds[iterations - 1];
+    outResult->medianSeconds = (iterations & 1) ? seconds[iterations / 2] :
+        ((seconds[(iterations / 2) - 1] + seconds[iterations / 2]) / 2.);
+
+    if(outResult->medianSeconds > 0) {
+        outResult->itemsPerSecond = (double) (work.items * threads) / outResult->medianSeconds;
+        outResult->bytesPerSecond = (double) (work.bytes * threads) / outResult->medianSeconds;
+    }
+
+    for(size_t c = 0; c < kStageCounterCount; c++) {
+        const uint64_t value = StageStatsGetCounter(stats, (stage_counter_t) c);
+        outResult->counters[c] = (c == kStageCounterLargestAllocation) ? value : (value / threads);
+    }
+
+done:;
+    if(err < 0) outResult->error = err;
+
+    for(size_t j = 0; j < numJobs; j++) {
+        bc->teardown(jobs[j]);
+    }
+
+    if(stats) StageStatsRelease(stats);
+    free(seconds);
+    free(jobs);
+
+    return err;
+}
+
+// MARK: - Output
+/// Names of the counters, as they're output
+static const char *kCounterNames[kStageCounterCount] = {
+    "slowRefills", "treeWalks", "allocations", "allocatedBytes", "largestAllocation",
+};
+
+/**
+ * Writes a string as a JSON string literal.
+ */
+static void PrintJSONString(FILE *out, const char *str) {
+    fputc('"', out);
+
+    for(; *str; str++) {
+        if(*str == '"' || *str == '\\') {
+            fprintf(out, "\\%c", *str);
+        } else if((unsigned char) *str < 0x20) {
+            fprintf(out, "\\u%04x", *str);
+        } else {
+            fputc(*str, out);
+        }
+    }
+
+    fputc('"', out);
+}
+
+/**
+ * Writes the header of the output, if the format has one.
+ */
+void BenchPrintHeader(FILE *out, bench_format_t format) {
+    if(format != kBenchFormatCSV) return;
+
+    fprintf(out, "case,unit,input,width,height,threads,iterations,items,bytes,minSeconds,medianSeconds,"
+            "maxSeconds,itemsPerSecond,megapixelsPerSecond,bytesPerSecond,peakScratchBytes");
+    for(size_t c = 0; c < kStageCounterCount; c++) {
+        fprintf(out, ",%s", kCounterNames[c]);
+    }
+    fprintf(out, ",error\n");
+}
+
+/**
+ * Writes a single result. Throughput is in items (and bytes) per second of all concurrent jobs combined;
+ * megapixels per second are only output for cases that count pixels.
+ */
+void BenchPrintResult(FILE *out, bench_format_t format, const bench_case_t *bc, const bench_input_t *input,
+                      const bench_result_t *result) {
+    const bool pixels = !strcmp(bc->unit, "pixel");
+
+    if(format == kBenchFormatCSV) {
+        fprintf(out, "%s,%s,\"%s\",%zu,%zu,%zu,%zu,%" PRIu64 ",%" PRIu64 ",%.6f,%.6f,%.6f,%.1f,",
+                bc->name, bc->unit, input->name, input->sensorWidth, input->sensorHeight, result->threads,
+                result->iterations, result->work.items, result->work.bytes, result->minSeconds,
+                result->medianSeconds, result->maxSeconds, result->itemsPerSecond);
+
+        if(pixels) fprintf(out, "%.3f", result->itemsPerSecond / 1e6);
+        fprintf(out, ",%.1f,%" PRIu64, result->bytesPerSecond, result->peakScratchBytes);
+
+        for(size_t c = 0; c < kStageCounterCount; c++) {
+            fprintf(out, ",%" PRIu64, result->counters[c]);
+        }
+        fprintf(out, ",%d\n", result->error);
+    } else {
+        fprintf(out, "{\"case\":\"%s\",\"unit\":\"%s\",\"input\":", bc->name, bc->unit);
+        PrintJSONString(out, input->name);
+        fprintf(out, ",\"synthetic\":%s,\"width\":%zu,\"height\":%zu,\"threads\":%zu,\"iterations\":%zu,"
+                "\"items\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"minSeconds\":%.6f,\"medianSeconds\":%.6f,"
+                "\"maxSeconds\":%.6f,\"itemsPerSecond\":%.1f,", input->synthetic ? "true" : "false", input->sensorWidth,
+                input->sensorHeight, result->threads, result->iterations, result->work.items, result->work.bytes,
+                result->minSeconds, result->medianSeconds, result->maxSeconds, result->itemsPerSecond);
+
+        if(pixels) {
+            fprintf(out, "\"megapixelsPerSecond\":%.3f,", result->itemsPerSecond / 1e6);
+        }
+        fprintf(out, "\"bytesPerSecond\":%.1f,\"peakScratchBytes\":%" PRIu64, result->bytesPerSecond,
+                result->peakScratchBytes);
+
+        for(size_t c = 0; c < kStageCounterCount; c++) {
+            fprintf(out, ",\"%s\":%" PRIu64, kCounterNames[c], result->counters[c]);
+        }
+        fprintf(out, ",\"error\":%d}\n", result->error);
+    }
+
+    fflush(out);
+}
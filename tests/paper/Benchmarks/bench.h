@@ -0,0 +1,126 @@
+//
+//  bench.h
+//  PaperBench
+//
+//  Drives the C kernels of Paper directly, outside of any Swift or Objective-C
+//  wrappers, and measures their throughput. Each case times one kernel on one
+//  input; several copies of a case may run concurrently to see how the kernels
+//  scale when many images are decoded at once.
+//
+//  Created by Tristan Seifert on 20200911.
+//
+
+#ifndef PAPERBENCH_BENCH_H
+#define PAPERBENCH_BENCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "stagestats.h"
+
+// forward declarations
+typedef struct bench_input bench_input_t;
+
+/**
+ * Amount of work done by a single run of a case
+ */
+typedef struct bench_work {
+    /// Number of items processed: pixels for most cases, codes for Huffman lookups
+    uint64_t items;
+    /// Number of bytes produced
+    uint64_t bytes;
+} bench_work_t;
+
+/**
+ * A kernel to benchmark
+ *
+ * Each concurrent copy of a case is a job, which owns all of the buffers the kernel reads and writes. Only the
+ * run callback is timed; anything that must be restored between runs (such as buffers the kernel works on in
+ * place) is done in the prepare callback.
+ */
+typedef struct bench_case {
+    /// Name of the case, as it's reported
+    const char *name;
+    /// What each of the items processed is
+    const char *unit;
+
+    /**
+     * Allocates a job for the given input and fills in the work done by each of its runs. Buffers should be
+     * written to here, so that page faults for them aren't counted as part of the run.
+     *
+     * @return Job, or NULL if the input isn't supported by the case or memory couldn't be allocated
+     */
+    void *(*setup)(const bench_input_t *input, bench_work_t *outWork);
+    /// Gets the job ready for the next run; may be NULL
+    int (*prepare)(void *job);
+    /// Runs the kernel once, recording its stages into the stats if it supports that
+    int (*run)(void *job, stage_stats_t *stats);
+    /// Releases the job and all of its buffers
+    void (*teardown)(void *job);
+} bench_case_t;
+
+/// All cases, in the order they're run
+extern const bench_case_t kBenchCases[];
+/// Number of cases
+extern const size_t kBenchNumCases;
+
+/**
+ * Result of benchmarking a case
+ */
+typedef struct bench_result {
+    /// Number of concurrent jobs, and the number of timed iterations
+    size_t threads, iterations;
+    /// Work done by each job per iteration
+    bench_work_t work;
+
+    /// Shortest, median and longest time of an iteration, in seconds; this is from releasing the jobs until the
+    /// last of them finished.
+    double minSeconds, medianSeconds, maxSeconds;
+    /// Items and bytes of all jobs per second, based on the median time
+    double itemsPerSecond, bytesPerSecond;
+
+    /// Largest growth of the process' memory footprint while an iteration ran, in bytes
+    uint64_t peakScratchBytes;
+    /// Counters recorded by the kernels during the last iteration, per job
+    uint64_t counters[kStageCounterCount];
+
+    /// Error returned by a job, or 0 if all succeeded
+    int error;
+} bench_result_t;
+
+/**
+ * Benchmarks a case with the given input. An untimed warmup iteration runs first; it's still included in the
+ * peak scratch memory, since buffer pools used by the kernels are filled during it.
+ *
+ * @param threads Number of jobs that run concurrently in each iteration
+ * @param iterations Number of timed iterations
+ * @param outResult Result to fill in
+ * @return 0 on success, 1 if the case doesn't support the input, or a negative error code
+ */
+int BenchRun(const bench_case_t *bc, const bench_input_t *input, size_t threads, size_t iterations,
+             bench_result_t *outResult);
+
+/**
+ * Output formats for results
+ */
+typedef enum bench_format {
+    /// One JSON object per line
+    kBenchFormatJSON = 0,
+    /// Comma separated values, with a header line
+    kBenchFormatCSV = 1,
+} bench_format_t;
+
+/**
+ * Writes the header of the output, if the format has one.
+ */
+void BenchPrintHeader(FILE *out, bench_format_t format);
+
+/**
+ * Writes a single result.
+ */
+void BenchPrintResult(FILE *out, bench_format_t format, const bench_case_t *bc, const bench_input_t *input,
+                      const bench_result_t *result);
+
+#endif /* PAPERBENCH_BENCH_H */
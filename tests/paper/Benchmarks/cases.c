@@ -0,0 +1,622 @@
+//
+//  cases.c
+//  PaperBench
+//
+//  Created by Tristan Seifert on 20200911.
+//
+
+#include "bench.h"
+#include "inputs.h"
+
+#include "decompress.h"
+#include "huffman.h"
+#include "unslice.h"
+#include "debayer.h"
+#include "colorspace.h"
+#include "ahd_interpolate_mod.h"
+#include "TSRawImageDataHelpers.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+/// Number of codes looked up by each run of the Huffman lookup case
+#define kHuffmanCodes (4 * 1024 * 1024)
+
+/// Camera to XYZ matrix the color conversion runs with (that of the EOS 5D Mark III)
+static const double kCamXyz[9] = {
+     0.6722, -0.0635, -0.0963,
+    -0.4287,  1.2460,  0.2028,
+    -0.0908,  0.2162,  0.5668,
+};
+
+/**
+ * Allocates a buffer, and writes to all of it so it's faulted in before any runs.
+ */
+static void *AllocTouched(size_t bytes) {
+    void *buffer = malloc(bytes);
+    if(buffer) memset(buffer, 0, bytes);
+    return buffer;
+}
+
+// MARK: - Huffman lookups
+typedef struct huffman_job {
+    jpeg_huffman_t *table;
+    /// Codes to look up, with the most significant bit of each code in the most significant bit of the word
+    uint16_t *codes;
+    /// Sum of all values found, so the lookups can't be optimized away
+    uint64_t sink;
+} huffman_job_t;
+
+static void HuffmanTeardown(void *ctx) {
+    huffman_job_t *job = ctx;
+    if(job->table) JPEGHuffmanRelease(job->table);
+    free(job->codes);
+    free(job);
+}
+
+/**
+ * Generates random codes of the first component's table, followed by random bits. Drawing the words
+ * uniformly means each code occurs with probability 2^-length, which is what the table was built for; words
+ * that don't start with a code are redrawn.
+ */
+static void *HuffmanSetup(const bench_input_t *input, bench_work_t *outWork) {
+    huffman_job_t *job = calloc(1, sizeof(huffman_job_t));
+    if(!job) return NULL;
+
+    const bench_dht_t *dht = BenchInputTable(input, 0);
+    job->table = JPEGHuffmanNewFromDHT(dht->counts, dht->values, dht->numValues);
+    job->codes = malloc(kHuffmanCodes * sizeof(uint16_t));
+
+    if(!job->table || !job->codes) {
+        HuffmanTeardown(job);
+        return NULL;
+    }
+
+    // first code and number of codes of each length
+    uint32_t first[17], count[17];
+
+    for(size_t l = 1, code = 0; l <= 16; l++, code <<= 1) {
+        first[l] = (uint32_t) code;
+        count[l] = dht->counts[l - 1];
+        code += count[l];
+    }
+
+    uint32_t seed = 0xC0DE5EED;
+
+    for(size_t i = 0; i < kHuffmanCodes;) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+
+        const uint16_t word = (uint16_t) (seed >> 8);
+
+        for(size_t l = 1; l <= 16; l++) {
+            const uint32_t prefix = word >> (16 - l);
+
+            if(prefix >= first[l] && prefix < first[l] + count[l]) {
+                job->codes[i++] = word;
+                break;
+            }
+        }
+    }
+
+    outWork->items = kHuffmanCodes;
+    outWork->bytes = kHuffmanCodes;
+    return job;
+}
+
+static int HuffmanRun(void *ctx, stage_stats_t *stats) {
+    huffman_job_t *job = ctx;
+    uint64_t sum = 0;
+
+    for(size_t i = 0; i < kHuffmanCodes; i++) {
+        size_t bits;
+        uint8_t value;
+
+        if(!JPEGHuffmanFind(job->table, job->codes[i], &bits, &value)) {
+            return -1;
+        }
+        sum += value + bits;
+    }
+
+    job->sink = sum;
+    return 0;
+}
+
+// MARK: - Decompression
+typedef struct decompress_job {
+    const bench_input_t *input;
+    jpeg_decompressor_t *dec;
+    bool unsliced;
+
+    uint16_t *plane;
+    size_t planeBytes;
+} decompress_job_t;
+
+static void DecompressTeardown(void *ctx) {
+    decompress_job_t *job = ctx;
+    if(job->dec) JPEGDecompressorRelease(job->dec);
+    free(job->plane);
+    free(job);
+}
+
+static void *DecompressSetupCommon(const bench_input_t *input, bench_work_t *outWork, bool unsliced) {
+    decompress_job_t *job = calloc(1, sizeof(decompress_job_t));
+    if(!job) return NULL;
+
+    job->input = input;
+    job->unsliced = unsliced;
+    job->planeBytes = input->sensorWidth * input->sensorHeight * sizeof(uint16_t);
+    job->plane = AllocTouched(job->planeBytes);
+    job->dec = JPEGDecompressorNew(input->cols, input->rows, input->precision, input->components);
+
+    if(!job->plane || !job->dec) {
+        DecompressTeardown(job);
+        return NULL;
+    }
+
+    outWork->items = input->sensorWidth * input->sensorHeight;
+    outWork->bytes = job->planeBytes;
+    return job;
+}
+
+static void *DecompressSetup(const bench_input_t *input, bench_work_t *outWork) {
+    return DecompressSetupCommon(input, outWork, false);
+}
+
+static void *DecompressUnslicedSetup(const bench_input_t *input, bench_work_t *outWork) {
+    return DecompressSetupCommon(input, outWork, true);
+}
+
+/**
+ * Resets the decompressor, like the framework's decode context does when it reuses one. The scan buffer for
+ * unstuffing is kept, so it's only allocated during the warmup run.
+ */
+static int DecompressPrepare(void *ctx) {
+    decompress_job_t *job = ctx;
+    const bench_input_t *input = job->input;
+
+    int err = JPEGDecompressorReset(job->dec, input->cols, input->rows, input->precision, input->components);
+    if(err) return err;
+
+    return BenchInputConfigureDecompressor(input, job->dec, job->plane, job->planeBytes, job->unsliced);
+}
+
+static int DecompressRun(void *ctx, stage_stats_t *stats) {
+    decompress_job_t *job = ctx;
+    bool marker;
+
+    JPEGDecompressorSetStats(job->dec, stats);
+    JPEGDecompressorGo(job->dec, 0, &marker);
+    JPEGDecompressorSetStats(job->dec, NULL);
+
+    if(!JPEGDecompressorIsDone(job->dec)) {
+        return job->dec->error ? -((int) job->dec->error) : -1;
+    }
+    return 0;
+}
+
+// MARK: - Unslicing
+typedef struct unslice_job {
+    const bench_input_t *input;
+    /// Decompressor holding the image in frame order
+    jpeg_decompressor_t *dec;
+    uint16_t *frame;
+
+    uint16_t *plane;
+    uint16_t slices[3];
+} unslice_job_t;
+
+static void UnsliceTeardown(void *ctx) {
+    unslice_job_t *job = ctx;
+    if(job->dec) JPEGDecompressorRelease(job->dec);
+    free(job->frame);
+    free(job->plane);
+    free(job);
+}
+
+/**
+ * Decompresses the image in frame order once, which is then unsliced by each run.
+ */
+static void *UnsliceSetup(const bench_input_t *input, bench_work_t *outWork) {
+    bool marker;
+    unslice_job_t *job = calloc(1, sizeof(unslice_job_t));
+    if(!job) return NULL;
+
+    const size_t bytes = input->sensorWidth * input->sensorHeight * sizeof(uint16_t);
+
+    job->input = input;
+    memcpy(job->slices, input->slices, sizeof(job->slices));
+    job->frame = AllocTouched(bytes);
+    job->plane = AllocTouched(bytes);
+    job->dec = JPEGDecompressorNew(input->cols, input->rows, input->precision, input->components);
+
+    if(!job->frame || !job->plane || !job->dec ||
+       BenchInputConfigureDecompressor(input, job->dec, job->frame, bytes, false)) {
+        UnsliceTeardown(job);
+        return NULL;
+    }
+
+    JPEGDecompressorGo(job->dec, 0, &marker);
+    if(!JPEGDecompressorIsDone(job->dec)) {
+        UnsliceTeardown(job);
+        return NULL;
+    }
+
+    outWork->items = input->sensorWidth * input->sensorHeight;
+    outWork->bytes = bytes;
+    return job;
+}
+
+static int UnsliceRun(void *ctx, stage_stats_t *stats) {
+    unslice_job_t *job = ctx;
+    const bench_input_t *input = job->input;
+
+    const stage_interval_t interval = StageBegin(stats, kStageUnslice);
+    const int err = CR2Unslice(job->dec, job->plane, job->slices, input->sensorWidth, input->sensorHeight);
+    StageEnd(stats, &interval, input->sensorWidth * input->sensorHeight * sizeof(uint16_t));
+
+    return err;
+}
+
+// MARK: - Raw stats
+typedef struct rawstats_job {
+    const bench_input_t *input;
+    uint16_t *plane;
+    size_t planeBytes;
+    cr2_raw_stats_t stats;
+} rawstats_job_t;
+
+static void RawStatsTeardown(void *ctx) {
+    rawstats_job_t *job = ctx;
+    free(job->plane);
+    free(job);
+}
+
+static void *RawStatsSetup(const bench_input_t *input, bench_work_t *outWork) {
+    rawstats_job_t *job = calloc(1, sizeof(rawstats_job_t));
+    if(!job) return NULL;
+
+    job->input = input;
+    job->planeBytes = input->sensorWidth * input->sensorHeight * sizeof(uint16_t);
+    job->plane = AllocTouched(job->planeBytes);
+
+    if(!job->plane) {
+        RawStatsTeardown(job);
+        return NULL;
+    }
+
+    outWork->items = input->sensorWidth * input->sensorHeight;
+    outWork->bytes = input->visibleWidth * input->visibleHeight * sizeof(uint16_t);
+    return job;
+}
+
+/**
+ * Restores the untrimmed sensor data, since it's trimmed in place.
+ */
+static int RawStatsPrepare(void *ctx) {
+    rawstats_job_t *job = ctx;
+
+    memcpy(job->plane, job->input->sensor, job->planeBytes);
+    memset(&job->stats, 0, sizeof(job->stats));
+    return 0;
+}
+
+static int RawStatsRun(void *ctx, stage_stats_t *stats) {
+    rawstats_job_t *job = ctx;
+    const bench_input_t *input = job->input;
+
+    size_t borders[4];
+    memcpy(borders, input->borders, sizeof(borders));
+
+    const stage_interval_t interval = StageBegin(stats, kStageRawStats);
+    const size_t bytes = CR2CollectStats(job->plane, input->sensorWidth, input->sensorHeight, borders, true,
+                                         &job->stats);
+    StageEnd(stats, &interval, bytes);
+
+    return bytes ? 0 : -1;
+}
+
+// MARK: - Debayering
+typedef struct debayer_job {
+    const bench_input_t *input;
+    debayer_algorithm_t algo;
+    uint16_t *plane;
+} debayer_job_t;
+
+static void DebayerTeardown(void *ctx) {
+    debayer_job_t *job = ctx;
+    free(job->plane);
+    free(job);
+}
+
+static void *DebayerSetupCommon(const bench_input_t *input, bench_work_t *outWork, debayer_algorithm_t algo) {
+    debayer_job_t *job = calloc(1, sizeof(debayer_job_t));
+    if(!job) return NULL;
+
+    const size_t factor = DebayerScaleFactor(algo);
+    const size_t bytes = (input->visibleWidth / factor) * (input->visibleHeight / factor) * 4 * sizeof(uint16_t);
+
+    job->input = input;
+    job->algo = algo;
+    job->plane = AllocTouched(bytes);
+
+    if(!job->plane) {
+        DebayerTeardown(job);
+        return NULL;
+    }
+
+    // throughput is measured in input pixels, so binning and interpolation can be compared
+    outWork->items = input->visibleWidth * input->visibleHeight;
+    outWork->bytes = bytes;
+    return job;
+}
+
+static void *DebayerBilinearSetup(const bench_input_t *input, bench_work_t *outWork) {
+    return DebayerSetupCommon(input, outWork, kBayerAlgorithmBilinear);
+}
+static void *DebayerLMMSESetup(const bench_input_t *input, bench_work_t *outWork) {
+    return DebayerSetupCommon(input, outWork, kBayerAlgorithmLMMSE);
+}
+static void *DebayerHalfSizeSetup(const bench_input_t *input, bench_work_t *outWork) {
+    return DebayerSetupCommon(input, outWork, kBayerAlgorithmHalfSize);
+}
+static void *DebayerQuarterSizeSetup(const bench_input_t *input, bench_work_t *outWork) {
+    return DebayerSetupCommon(input, outWork, kBayerAlgorithmQuarterSize);
+}
+static void *DebayerLMMSEMedianSetup(const bench_input_t *input, bench_work_t *outWork) {
+    return DebayerSetupCommon(input, outWork, kBayerAlgorithmLMMSEMedian);
+}
+
+static int DebayerRun(void *ctx, stage_stats_t *stats) {
+    debayer_job_t *job = ctx;
+    const bench_input_t *input = job->input;
+
+    const stage_interval_t interval = StageBegin(stats, kStageDemosaic);
+    const int err = Debayer(job->algo, input->visible, job->plane, input->visibleWidth, input->visibleHeight,
+                            input->vShift, input->wb, input->black);
+    StageEnd(stats, &interval, 0);
+
+    return err;
+}
+
+// MARK: - Color conversion
+typedef struct convert_job {
+    const bench_input_t *input;
+    /// Pixel buffer converted in place; sized for the float output
+    uint16_t *pixels;
+    pixel_histogram_t histogram;
+} convert_job_t;
+
+static void ConvertTeardown(void *ctx) {
+    convert_job_t *job = ctx;
+    free(job->pixels);
+    free(job->histogram.counts);
+    free(job);
+}
+
+static void *ConvertSetup(const bench_input_t *input, bench_work_t *outWork) {
+    convert_job_t *job = calloc(1, sizeof(convert_job_t));
+    if(!job) return NULL;
+
+    const size_t pixels = input->visibleWidth * input->visibleHeight;
+
+    job->input = input;
+    job->pixels = AllocTouched(pixels * 3 * sizeof(float));
+
+    job->histogram.buckets = 256;
+    job->histogram.min = 0.f;
+    job->histogram.max = 1.f;
+    job->histogram.counts = AllocTouched(4 * job->histogram.buckets * sizeof(uint32_t));
+
+    if(!job->pixels || !job->histogram.counts) {
+        ConvertTeardown(job);
+        return NULL;
+    }
+
+    outWork->items = pixels;
+    outWork->bytes = pixels * 3 * sizeof(float);
+    return job;
+}
+
+/**
+ * Restores the interpolated RGB image, since it's converted in place.
+ */
+static int ConvertPrepare(void *ctx) {
+    convert_job_t *job = ctx;
+    const bench_input_t *input = job->input;
+
+    memcpy(job->pixels, input->rgb, input->visibleWidth * input->visibleHeight * 3 * sizeof(uint16_t));
+    memset(job->histogram.counts, 0, 4 * job->histogram.buckets * sizeof(uint32_t));
+    return 0;
+}
+
+static int ConvertRun(void *ctx, stage_stats_t *stats) {
+    convert_job_t *job = ctx;
+    const bench_input_t *input = job->input;
+
+    const stage_interval_t interval = StageBegin(stats, kStageColorConvert);
+    const long err = ConvertToWorking(job->pixels, input->visibleWidth, input->visibleHeight, kCamXyz,
+                                      &job->histogram);
+    StageEnd(stats, &interval, input->visibleWidth * input->visibleHeight * 3 * sizeof(float));
+
+    return (int) err;
+}
+
+// MARK: - LibRaw helpers
+/// CFA color of a pixel, like LibRaw's FC() macro
+#define FC(row, col, filters) (((filters) >> ((((row) << 1 & 14) + ((col) & 1)) << 1)) & 3)
+
+typedef struct libraw_job {
+    const bench_input_t *input;
+    /// Just enough of the LibRaw state for the helpers: the image size, its CFA pattern and color info
+    libraw_data_t *raw;
+
+    /// Image before processing, and the copy each run works on
+    uint16_t (*source)[4];
+    uint16_t (*image)[4];
+
+    /// Output of the RGB conversion, with its histogram and gamma curve
+    uint16_t (*output)[4];
+    int *histogram;
+    uint16_t *gammaCurve;
+} libraw_job_t;
+
+static void LibRawTeardown(void *ctx) {
+    libraw_job_t *job = ctx;
+    free(job->raw);
+    free(job->source);
+    free(job->image);
+    free(job->output);
+    free(job->histogram);
+    free(job->gammaCurve);
+    free(job);
+}
+
+/**
+ * Sets up the LibRaw state for the visible area of the input, as if it had been opened and unpacked by LibRaw.
+ * The image buffers are allocated, but not filled in.
+ */
+static libraw_job_t *LibRawSetupCommon(const bench_input_t *input) {
+    // LibRaw sizes are 16 bits
+    if(input->visibleWidth > 0xFFFF || input->visibleHeight > 0xFFFF) {
+        return NULL;
+    }
+
+    libraw_job_t *job = calloc(1, sizeof(libraw_job_t));
+    if(!job) return NULL;
+
+    const size_t pixels = input->visibleWidth * input->visibleHeight;
+
+    job->input = input;
+    job->raw = calloc(1, sizeof(libraw_data_t));
+    job->source = AllocTouched(pixels * sizeof(*job->source));
+    job->image = AllocTouched(pixels * sizeof(*job->image));
+
+    if(!job->raw || !job->source || !job->image) {
+        LibRawTeardown(job);
+        return NULL;
+    }
+
+    libraw_data_t *raw = job->raw;
+    raw->sizes.width = raw->sizes.iwidth = (ushort) input->visibleWidth;
+    raw->sizes.height = raw->sizes.iheight = (ushort) input->visibleHeight;
+
+    // RG/GB, or GB/RG when the pattern is shifted; the second green is already folded into the first
+    raw->idata.filters = input->vShift ? 0x49494949 : 0x94949494;
+    raw->idata.colors = 3;
+
+    for(size_t i = 0; i < 3; i++) {
+        raw->color.rgb_cam[i][i] = 1.f;
+    }
+    for(size_t i = 0; i < 0x10000; i++) {
+        raw->color.curve[i] = (ushort) i;
+    }
+
+    return job;
+}
+
+// MARK: - AHD interpolation
+/**
+ * Fills in the CFA value of each pixel, with the black level subtracted and scaled up to 16 bits like the
+ * LibRaw reader does before interpolating.
+ */
+static void *AHDSetup(const bench_input_t *input, bench_work_t *outWork) {
+    libraw_job_t *job = LibRawSetupCommon(input);
+    if(!job) return NULL;
+
+    const unsigned int filters = job->raw->idata.filters;
+
+    for(size_t y = 0; y < input->visibleHeight; y++) {
+        for(size_t x = 0; x < input->visibleWidth; x++) {
+            const size_t i = (y * input->visibleWidth) + x;
+            const size_t cfa = (((y + input->vShift) & 1) << 1) | (x & 1);
+            const int value = ((int) input->visible[i] - input->black[cfa]) << 2;
+
+            job->source[i][FC(y, x, filters)] = (uint16_t) MIN(MAX(value, 0), 0xFFFF);
+        }
+    }
+
+    outWork->items = input->visibleWidth * input->visibleHeight;
+    outWork->bytes = outWork->items * sizeof(*job->image);
+    return job;
+}
+
+/**
+ * Restores the CFA only image, since it's interpolated in place.
+ */
+static int AHDPrepare(void *ctx) {
+    libraw_job_t *job = ctx;
+    memcpy(job->image, job->source,
+           job->input->visibleWidth * job->input->visibleHeight * sizeof(*job->image));
+    return 0;
+}
+
+static int AHDRun(void *ctx, stage_stats_t *stats) {
+    libraw_job_t *job = ctx;
+
+    const stage_interval_t interval = StageBegin(stats, kStageDemosaic);
+    ahd_interpolate_mod(job->raw, job->image);
+    StageEnd(stats, &interval, job->input->visibleWidth * job->input->visibleHeight * sizeof(*job->image));
+
+    return 0;
+}
+
+// MARK: - RGB conversion
+/**
+ * Uses the bilinear interpolated image of the input as the interpolated image to convert.
+ */
+static void *RGBSetup(const bench_input_t *input, bench_work_t *outWork) {
+    libraw_job_t *job = LibRawSetupCommon(input);
+    if(!job) return NULL;
+
+    const size_t pixels = input->visibleWidth * input->visibleHeight;
+
+    job->output = AllocTouched(pixels * sizeof(*job->output));
+    job->histogram = AllocTouched(0x2000 * 4 * sizeof(int));
+    job->gammaCurve = AllocTouched(0x10000 * sizeof(uint16_t));
+
+    if(!job->output || !job->histogram || !job->gammaCurve) {
+        LibRawTeardown(job);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < pixels; i++) {
+        memcpy(job->source[i], input->rgb + (i * 3), 3 * sizeof(uint16_t));
+    }
+
+    outWork->items = pixels;
+    outWork->bytes = pixels * sizeof(*job->output);
+    return job;
+}
+
+static int RGBRun(void *ctx, stage_stats_t *stats) {
+    libraw_job_t *job = ctx;
+
+    const stage_interval_t interval = StageBegin(stats, kStageColorConvert);
+    const int err = TSRawConvertToRGB(job->raw, job->source, job->output, job->histogram, job->gammaCurve);
+    StageEnd(stats, &interval, err ? 0 : (job->input->visibleWidth * job->input->visibleHeight * sizeof(*job->output)));
+
+    return err;
+}
+
+// MARK: - Case list
+const bench_case_t kBenchCases[] = {
+    {"huffman-find", "code", HuffmanSetup, NULL, HuffmanRun, HuffmanTeardown},
+    {"decompress", "pixel", DecompressSetup, DecompressPrepare, DecompressRun, DecompressTeardown},
+    {"decompress-unsliced", "pixel", DecompressUnslicedSetup, DecompressPrepare, DecompressRun,
+        DecompressTeardown},
+    {"unslice", "pixel", UnsliceSetup, NULL, UnsliceRun, UnsliceTeardown},
+    {"rawstats-trim", "pixel", RawStatsSetup, RawStatsPrepare, RawStatsRun, RawStatsTeardown},
+    {"debayer-bilinear", "pixel", DebayerBilinearSetup, NULL, DebayerRun, DebayerTeardown},
+    {"debayer-lmmse", "pixel", DebayerLMMSESetup, NULL, DebayerRun, DebayerTeardown},
+    {"debayer-half", "pixel", DebayerHalfSizeSetup, NULL, DebayerRun, DebayerTeardown},
+    {"debayer-quarter", "pixel", DebayerQuarterSizeSetup, NULL, DebayerRun, DebayerTeardown},
+    {"debayer-lmmse-median", "pixel", DebayerLMMSEMedianSetup, NULL, DebayerRun, DebayerTeardown},
+    {"convert-working", "pixel", ConvertSetup, ConvertPrepare, ConvertRun, ConvertTeardown},
+    {"libraw-ahd", "pixel", AHDSetup, AHDPrepare, AHDRun, LibRawTeardown},
+    {"libraw-rgb", "pixel", RGBSetup, NULL, RGBRun, LibRawTeardown},
+};
+
+const size_t kBenchNumCases = sizeof(kBenchCases) / sizeof(kBenchCases[0]);
@@ -0,0 +1,686 @@
+//
+//  inputs.c
+//  PaperBench
+//
+//  Created by Tristan Seifert on 20200911.
+//
+
+#include "inputs.h"
+
+#include "decompress.h"
+#include "huffman.h"
+#include "unslice.h"
+#include "debayer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/param.h>
+
+/// White balance used for all inputs, in RG/GB order
+static const double kWhiteBalance[4] = {2.1, 1.0, 1.0, 1.5};
+
+static int ParseJPEG(bench_input_t *input, const uint8_t *jpeg, size_t length);
+static int DecodeInput(bench_input_t *input);
+
+// MARK: - TIFF
+/**
+ * Reads a little endian 16-bit value; values beyond the end of the file read as 0.
+ */
+static uint16_t ReadU16(const bench_input_t *input, size_t offset) {
+    if(offset + 2 > input->fileLength) return 0;
+    return (uint16_t) (input->file[offset] | (input->file[offset + 1] << 8));
+}
+
+/**
+ * Reads a little endian 32-bit value; values beyond the end of the file read as 0.
+ */
+static uint32_t ReadU32(const bench_input_t *input, size_t offset) {
+    if(offset + 4 > input->fileLength) return 0;
+    return ((uint32_t) ReadU16(input, offset)) | (((uint32_t) ReadU16(input, offset + 2)) << 16);
+}
+
+/**
+ * Finds a tag in the IFD at the given offset.
+ *
+ * @return Offset of the tag's 12 byte entry, or 0 if it doesn't exist
+ */
+static size_t FindTag(const bench_input_t *input, size_t ifd, uint16_t tag) {
+    const size_t numTags = ReadU16(input, ifd);
+
+    for(size_t i = 0; i < numTags; i++) {
+        const size_t entry = ifd + 2 + (i * 12);
+        if(ReadU16(input, entry) == tag) {
+            return entry;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Reads an unsigned value (a short or long) at the given index of a tag.
+ */
+static uint32_t ReadTagValue(const bench_input_t *input, size_t entry, size_t index) {
+    const uint16_t type = ReadU16(input, entry + 2);
+    const uint32_t count = ReadU32(input, entry + 4);
+    const size_t size = (type == 3) ? 2 : 4;
+
+    if(index >= count) return 0;
+
+    // values that fit into the entry are stored inline
+    const size_t values = (count * size <= 4) ? (entry + 8) : ReadU32(input, entry + 8);
+    return (size == 2) ? ReadU16(input, values + (index * 2)) : ReadU32(input, values + (index * 4));
+}
+
+// MARK: - Files
+/**
+ * Reads the CR2 file at the given path, and decodes it.
+ */
+int BenchInputLoadCR2(const char *path, bench_input_t *outInput) {
+    int err = 0;
+    bench_input_t *input = outInput;
+    memset(input, 0, sizeof(*input));
+
+    const char *name = strrchr(path, '/');
+    strlcpy(input->name, name ? (name + 1) : path, sizeof(input->name));
+
+    // read the entire file
+    FILE *file = fopen(path, "rb");
+    if(!file) {
+        fprintf(stderr, "%s: failed to open (%s)\n", input->name, strerror(errno));
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    const long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    if(length > 0 && (input->file = malloc(length))) {
+        input->fileLength = fread(input->file, 1, length, file);
+    }
+    fclose(file);
+
+    if(!input->file || input->fileLength != (size_t) length) {
+        fprintf(stderr, "%s: failed to read\n", input->name);
+        err = -1;
+        goto fail;
+    }
+
+    // little endian TIFF with the CR2 signature
+    if(input->fileLength < 16 || memcmp(input->file, "II*\0", 4) || memcmp(input->file + 8, "CR", 2)) {
+        fprintf(stderr, "%s: not a CR2 file (is it still a Git LFS pointer?)\n", input->name);
+        err = -2;
+        goto fail;
+    }
+
+    // sensor info is in the Canon maker notes, found through the EXIF IFD
+    const size_t ifd0 = ReadU32(input, 4);
+    const size_t exifTag = FindTag(input, ifd0, 0x8769);
+    const size_t noteTag = exifTag ? FindTag(input, ReadTagValue(input, exifTag, 0), 0x927C) : 0;
+    const size_t infoTag = noteTag ? FindTag(input, ReadU32(input, noteTag + 8), 0x00E0) : 0;
+
+    if(!infoTag) {
+        fprintf(stderr, "%s: missing sensor info\n", input->name);
+        err = -3;
+        goto fail;
+    }
+
+    input->sensorWidth = ReadTagValue(input, infoTag, 1);
+    input->sensorHeight = ReadTagValue(input, infoTag, 2);
+
+    input->borders[3] = ReadTagValue(input, infoTag, 5);
+    input->borders[0] = ReadTagValue(input, infoTag, 6);
+    input->borders[1] = ReadTagValue(input, infoTag, 7);
+    input->borders[2] = ReadTagValue(input, infoTag, 8);
+
+    // the raw IFD holds the location of the lossless JPEG and how it's sliced
+    const size_t rawIfd = ReadU32(input, 12);
+    const size_t offsetTag = FindTag(input, rawIfd, 0x111), lengthTag = FindTag(input, rawIfd, 0x117);
+    const size_t slicesTag = FindTag(input, rawIfd, 0xc640);
+
+    if(!offsetTag || !lengthTag || !slicesTag) {
+        fprintf(stderr, "%s: missing raw image tags\n", input->name);
+        err = -3;
+        goto fail;
+    }
+
+    for(size_t i = 0; i < 3; i++) {
+        input->slices[i] = (uint16_t) ReadTagValue(input, slicesTag, i);
+    }
+
+    const size_t rawOffset = ReadTagValue(input, offsetTag, 0);
+    const size_t rawLength = ReadTagValue(input, lengthTag, 0);
+
+    if(rawOffset + rawLength > input->fileLength) {
+        fprintf(stderr, "%s: raw image extends beyond end of file\n", input->name);
+        err = -3;
+        goto fail;
+    }
+
+    if((err = ParseJPEG(input, input->file + rawOffset, rawLength))) {
+        goto fail;
+    }
+    if((err = DecodeInput(input))) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:;
+    BenchInputRelease(input);
+    return err;
+}
+
+// MARK: - Synthetic images
+/**
+ * State of the lossless JPEG encoder
+ */
+typedef struct encoder {
+    uint8_t *buffer;
+    size_t length, capacity;
+
+    uint64_t bits;
+    size_t numBits;
+
+    /// Code and its length for each SSSS value
+    uint16_t codes[17];
+    uint8_t codeLengths[17];
+} encoder_t;
+
+/// Huffman table used for synthetic images, as code counts and values
+static const uint8_t kSyntheticCounts[16] = {0, 2, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0};
+static const uint8_t kSyntheticValues[17] = {4, 6, 3, 5, 7, 2, 8, 1, 0, 9, 10, 11, 12, 13, 14, 15, 16};
+
+/**
+ * Ensures there's room for at least the given number of bytes in the output.
+ */
+static int EncoderReserve(encoder_t *enc, size_t bytes) {
+    if(enc->length + bytes <= enc->capacity) return 0;
+
+    const size_t capacity = MAX(enc->capacity * 2, enc->length + bytes);
+    uint8_t *buffer = realloc(enc->buffer, capacity);
+    if(!buffer) return -1;
+
+    enc->buffer = buffer;
+    enc->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Appends a byte, without stuffing.
+ */
+static void EncoderPutByte(encoder_t *enc, uint8_t byte) {
+    enc->buffer[enc->length++] = byte;
+}
+
+/**
+ * Appends a 16-bit big endian value, such as a marker or segment length.
+ */
+static void EncoderPutWord(encoder_t *enc, uint16_t word) {
+    EncoderPutByte(enc, word >> 8);
+    EncoderPutByte(enc, word & 0xFF);
+}
+
+/**
+ * Appends up to 32 bits of entropy coded data, stuffing a zero byte after each 0xFF. At most 10 bytes are
+ * written, which must have been reserved already.
+ */
+static void EncoderPutBits(encoder_t *enc, uint32_t value, size_t numBits) {
+    enc->bits = (enc->bits << numBits) | (value & ((1ULL << numBits) - 1));
+    enc->numBits += numBits;
+
+    while(enc->numBits >= 8) {
+        const uint8_t byte = (enc->bits >> (enc->numBits - 8)) & 0xFF;
+        enc->numBits -= 8;
+
+        EncoderPutByte(enc, byte);
+        if(byte == 0xFF) EncoderPutByte(enc, 0x00);
+    }
+}
+
+/**
+ * Writes the headers of a lossless JPEG (SOI, DHT, SOF3 and SOS) with one Huffman table for all components.
+ */
+static void EncoderPutHeaders(encoder_t *enc, size_t cols, size_t rows, uint8_t precision, size_t components,
+                              uint8_t predictor) {
+    EncoderPutWord(enc, 0xFFD8);
+
+    EncoderPutWord(enc, 0xFFC4);
+    EncoderPutWord(enc, 2 + 1 + 16 + sizeof(kSyntheticValues));
+    EncoderPutByte(enc, 0x00);
+    for(size_t i = 0; i < 16; i++) EncoderPutByte(enc, kSyntheticCounts[i]);
+    for(size_t i = 0; i < sizeof(kSyntheticValues); i++) EncoderPutByte(enc, kSyntheticValues[i]);
+
+    EncoderPutWord(enc, 0xFFC3);
+    EncoderPutWord(enc, 8 + (3 * components));
+    EncoderPutByte(enc, precision);
+    EncoderPutWord(enc, rows);
+    EncoderPutWord(enc, cols);
+    EncoderPutByte(enc, components);
+    for(size_t c = 0; c < components; c++) {
+        EncoderPutByte(enc, c + 1);
+        EncoderPutByte(enc, 0x11);
+        EncoderPutByte(enc, 0x00);
+    }
+
+    EncoderPutWord(enc, 0xFFDA);
+    EncoderPutWord(enc, 6 + (2 * components));
+    EncoderPutByte(enc, components);
+    for(size_t c = 0; c < components; c++) {
+        EncoderPutByte(enc, c + 1);
+        EncoderPutByte(enc, 0x00);
+    }
+    EncoderPutByte(enc, predictor);
+    EncoderPutByte(enc, 0);
+    EncoderPutByte(enc, 0);
+}
+
+/**
+ * Entropy codes a frame of interleaved samples with prediction algorithm 1 (the sample to the left), which
+ * is what Canon cameras use.
+ */
+static int EncoderPutFrame(encoder_t *enc, const uint16_t *frame, size_t cols, size_t rows, uint8_t precision,
+                           size_t components) {
+    const size_t rowSamples = cols * components;
+
+    for(size_t y = 0; y < rows; y++) {
+        if(EncoderReserve(enc, rowSamples * 10)) return -1;
+
+        for(size_t x = 0; x < rowSamples; x++) {
+            const size_t i = (y * rowSamples) + x;
+            int predicted;
+
+            // the first column is predicted from the line above, and the first line from the midpoint
+            if(x < components) {
+                predicted = y ? frame[i - rowSamples] : (1 << (precision - 1));
+            } else {
+                predicted = frame[i - components];
+            }
+
+            const int diff = (int16_t) (uint16_t) (frame[i] - predicted);
+            const int magnitude = (diff < 0) ? -diff : diff;
+            const size_t ssss = magnitude ? (32 - __builtin_clz(magnitude)) : 0;
+
+            if(ssss == 16) {
+                EncoderPutBits(enc, enc->codes[16], enc->codeLengths[16]);
+                continue;
+            }
+
+            EncoderPutBits(enc, enc->codes[ssss], enc->codeLengths[ssss]);
+            if(ssss) {
+                EncoderPutBits(enc, (diff < 0) ? (diff + (1 << ssss) - 1) : diff, ssss);
+            }
+        }
+    }
+
+    // pad the last byte with ones, then end the image
+    if(EncoderReserve(enc, 16)) return -1;
+    if(enc->numBits) {
+        EncoderPutBits(enc, 0xFF, 8 - enc->numBits);
+    }
+    EncoderPutWord(enc, 0xFFD9);
+
+    return 0;
+}
+
+/**
+ * Synthesizes and compresses an image.
+ *
+ * The sensor has a dark border at its top and left, like Canon sensors; the visible area is a set of smooth
+ * gradients with some fine texture and noise, so that it compresses to about the size of real images and
+ * interpolation takes the same paths through the kernels as it would for a photo.
+ */
+int BenchInputMakeSynthetic(size_t width, size_t height, bench_input_t *outInput) {
+    bench_input_t *input = outInput;
+    uint16_t *sensor = NULL, *frame = NULL;
+    encoder_t enc;
+
+    memset(input, 0, sizeof(*input));
+    memset(&enc, 0, sizeof(enc));
+
+    // two components per sample, and three slices, all multiples of the component count
+    width &= ~3UL;
+    height &= ~1UL;
+
+    snprintf(input->name, sizeof(input->name), "synthetic-%zux%zu", width, height);
+    input->synthetic = true;
+
+    if(width < 256 || height < 128 || width > 0xFFFF || height > 0xFFFF) {
+        fprintf(stderr, "%s: unsupported size\n", input->name);
+        return -1;
+    }
+
+    input->sensorWidth = width;
+    input->sensorHeight = height;
+    input->borders[0] = 38;
+    input->borders[1] = width - 1;
+    input->borders[2] = height - 1;
+    input->borders[3] = 72;
+
+    input->slices[0] = 2;
+    input->slices[1] = (uint16_t) ((width / 3) & ~1UL);
+    input->slices[2] = (uint16_t) (width - (input->slices[0] * input->slices[1]));
+
+    // fill the sensor
+    const size_t samples = width * height;
+    sensor = malloc(samples * sizeof(uint16_t));
+    frame = malloc(samples * sizeof(uint16_t));
+
+    if(!sensor || !frame) {
+        fprintf(stderr, "%s: failed to allocate image\n", input->name);
+        goto fail;
+    }
+
+    uint32_t seed = 0x5EED1234;
+
+    for(size_t y = 0; y < height; y++) {
+        for(size_t x = 0; x < width; x++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+
+            const int noise = (int) (seed & 31) - 16;
+            int value = 2048 + noise;
+
+            if(y >= input->borders[0] && x >= input->borders[3]) {
+                const size_t cfa = ((y & 1) << 1) | (x & 1);
+                const int gradient = (cfa == 0) ? (int) ((x * 6000) / width) :
+                                     (cfa == 3) ? (int) ((y * 6000) / height) :
+                                                  (int) (((x + y) * 4000) / (width + height));
+                const int texture = (int) (((x * 7) ^ (y * 5)) & 0xFF) * 4;
+
+                value += 1000 + gradient + texture;
+            }
+
+            sensor[(y * width) + x] = (uint16_t) MIN(MAX(value, 0), 16383);
+        }
+    }
+
+    // put the sensor data into slice order, and compress it as two component frame
+    size_t j = 0;
+
+    for(size_t s = 0; s <= input->slices[0]; s++) {
+        const size_t start = s * input->slices[1];
+        const size_t end = (s < input->slices[0]) ? (start + input->slices[1]) : width;
+
+        for(size_t y = 0; y < height; y++) {
+            memcpy(frame + j, sensor + (y * width) + start, (end - start) * sizeof(uint16_t));
+            j += (end - start);
+        }
+    }
+
+    for(size_t l = 1, k = 0, code = 0; l <= 16; l++, code <<= 1) {
+        for(size_t i = 0; i < kSyntheticCounts[l - 1]; i++, k++, code++) {
+            enc.codes[kSyntheticValues[k]] = (uint16_t) code;
+            enc.codeLengths[kSyntheticValues[k]] = (uint8_t) l;
+        }
+    }
+
+    if(EncoderReserve(&enc, 1024 + samples)) goto fail;
+    EncoderPutHeaders(&enc, width / 2, height, 14, 2, 1);
+    if(EncoderPutFrame(&enc, frame, width / 2, height, 14, 2)) goto fail;
+
+    free(frame);
+    free(sensor);
+    frame = sensor = NULL;
+
+    // then read it back like a file
+    input->file = enc.buffer;
+    input->fileLength = enc.length;
+    enc.buffer = NULL;
+
+    if(ParseJPEG(input, input->file, input->fileLength) || DecodeInput(input)) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:;
+    free(enc.buffer);
+    free(frame);
+    free(sensor);
+    BenchInputRelease(input);
+
+    return -1;
+}
+
+// MARK: - JPEG
+/**
+ * Reads the headers of the lossless JPEG, up to the start of its scan.
+ */
+static int ParseJPEG(bench_input_t *input, const uint8_t *jpeg, size_t length) {
+    size_t offset = 2;
+    bool hasFrame = false;
+
+    if(length < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+        fprintf(stderr, "%s: raw image isn't a JPEG\n", input->name);
+        return -4;
+    }
+
+    while(offset + 4 <= length) {
+        const uint8_t marker = jpeg[offset + 1];
+        const size_t segmentLength = (jpeg[offset + 2] << 8) | jpeg[offset + 3];
+        const uint8_t *segment = jpeg + offset + 4;
+        const size_t end = offset + 2 + segmentLength;
+
+        if(jpeg[offset] != 0xFF || segmentLength < 2 || end > length) {
+            break;
+        }
+
+        // Huffman tables; a segment may define several
+        if(marker == 0xC4) {
+            const uint8_t *table = segment;
+
+            while(table + 17 <= jpeg + end) {
+                const size_t slot = table[0] & 0x0F;
+                if(slot >= 4) break;
+
+                bench_dht_t *dht = &input->tables[slot];
+                memcpy(dht->counts, table + 1, 16);
+
+                dht->numValues = 0;
+                for(size_t i = 0; i < 16; i++) dht->numValues += dht->counts[i];
+                if(table + 17 + dht->numValues > jpeg + end || dht->numValues > 256) break;
+
+                memcpy(dht->values, table + 17, dht->numValues);
+                input->hasTable[slot] = true;
+
+                table += 17 + dht->numValues;
+            }
+        }
+        // lossless frame
+        else if(marker == 0xC3 && segmentLength >= 8) {
+            input->precision = segment[0];
+            input->rows = (segment[1] << 8) | segment[2];
+            input->cols = (segment[3] << 8) | segment[4];
+            input->components = segment[5];
+            hasFrame = true;
+        }
+        // start of scan; the entropy coded data follows it directly
+        else if(marker == 0xDA && hasFrame) {
+            const size_t numComponents = segment[0];
+            if(numComponents != input->components || numComponents > 4 ||
+               segmentLength < 6 + (2 * numComponents)) {
+                break;
+            }
+
+            for(size_t c = 0; c < numComponents; c++) {
+                input->tableForComponent[c] = (segment[2 + (c * 2)] >> 4) & 0x03;
+            }
+            input->predictor = segment[1 + (numComponents * 2)];
+
+            input->scan = jpeg + end;
+            input->scanLength = length - end;
+            break;
+        }
+
+        offset = end;
+    }
+
+    if(!input->scan) {
+        fprintf(stderr, "%s: failed to find lossless JPEG scan\n", input->name);
+        return -4;
+    }
+
+    // only regular raw images, where the frame covers the sensor exactly, are supported
+    if(input->cols * input->components != input->sensorWidth || input->rows != input->sensorHeight) {
+        fprintf(stderr, "%s: frame (%zu x %zu, %zu components) doesn't match the sensor (%zu x %zu)\n",
+                input->name, input->cols, input->rows, input->components, input->sensorWidth,
+                input->sensorHeight);
+        return -4;
+    }
+
+    for(size_t c = 0; c < input->components; c++) {
+        if(!input->hasTable[input->tableForComponent[c]]) {
+            fprintf(stderr, "%s: missing Huffman table for component %zu\n", input->name, c);
+            return -4;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Sets up a decompressor to decode the input's scan into the given plane. The decompressor was created with
+ * the size of the input's frame, or reset to it.
+ */
+int BenchInputConfigureDecompressor(const bench_input_t *input, jpeg_decompressor_t *dec, uint16_t *plane,
+                                    size_t length, bool unsliced) {
+    int err;
+
+    for(size_t slot = 0; slot < 4; slot++) {
+        if(!input->hasTable[slot]) continue;
+
+        const bench_dht_t *dht = &input->tables[slot];
+        jpeg_huffman_t *table = JPEGHuffmanNewFromDHT(dht->counts, dht->values, dht->numValues);
+        if(!table) return -1;
+
+        err = JPEGDecompressorAddTable(dec, slot, table);
+        JPEGHuffmanRelease(table);
+        if(err) return err;
+    }
+
+    for(size_t c = 0; c < input->components; c++) {
+        if((err = JPEGDecompressorSetTableForPlane(dec, c, input->tableForComponent[c]))) return err;
+    }
+
+    if((err = JPEGDecompressorSetPredictionAlgo(dec, input->predictor))) return err;
+    if((err = JPEGDecompressorSetUnstuffInput(dec, true))) return err;
+
+    if(unsliced) {
+        err = JPEGDecompressorSetUnslicedOutput(dec, plane, length, input->slices);
+    } else {
+        err = JPEGDecompressorSetOutput(dec, plane, length);
+    }
+    if(err) return err;
+
+    return JPEGDecompressorSetInput(dec, input->scan, input->scanLength);
+}
+
+// MARK: - Decoding
+/**
+ * Decodes the input once to get the planes the kernels after decompression work on: the sensor data, its
+ * trimmed visible area, and an RGB image interpolated from it.
+ */
+static int DecodeInput(bench_input_t *input) {
+    int err = 0;
+    bool marker;
+    cr2_raw_stats_t *stats = NULL;
+    uint16_t *debayered = NULL;
+    jpeg_decompressor_t *dec = NULL;
+
+    const size_t sensorBytes = input->sensorWidth * input->sensorHeight * sizeof(uint16_t);
+
+    if(input->borders[1] >= input->sensorWidth || input->borders[2] >= input->sensorHeight ||
+       input->borders[3] >= input->borders[1] || input->borders[0] >= input->borders[2]) {
+        fprintf(stderr, "%s: invalid sensor borders\n", input->name);
+        return -5;
+    }
+
+    // decompress straight into the sensor layout
+    input->sensor = malloc(sensorBytes);
+    dec = JPEGDecompressorNew(input->cols, input->rows, input->precision, input->components);
+
+    if(!input->sensor || !dec) {
+        err = -1;
+        goto done;
+    }
+
+    if((err = BenchInputConfigureDecompressor(input, dec, input->sensor, sensorBytes, true))) {
+        goto done;
+    }
+
+    JPEGDecompressorGo(dec, 0, &marker);
+
+    if(!JPEGDecompressorIsDone(dec)) {
+        fprintf(stderr, "%s: decompression failed (error %d at offset %zu)\n", input->name, dec->error,
+                dec->errorOffset);
+        err = -5;
+        goto done;
+    }
+
+    // trim a copy of it; this also gets the black level and Bayer shift
+    input->visible = malloc(sensorBytes);
+    stats = calloc(1, sizeof(cr2_raw_stats_t));
+
+    if(!input->visible || !stats) {
+        err = -1;
+        goto done;
+    }
+
+    memcpy(input->visible, input->sensor, sensorBytes);
+
+    size_t borders[4];
+    memcpy(borders, input->borders, sizeof(borders));
+    CR2CollectStats(input->visible, input->sensorWidth, input->sensorHeight, borders, true, stats);
+
+    input->visibleWidth = (input->borders[1] - input->borders[3]) + 1;
+    input->visibleHeight = (input->borders[2] - input->borders[0]) + 1;
+    input->vShift = CR2CalculateBayerShift(stats);
+    CR2CalculateBlackLevel(stats, input->black);
+    memcpy(input->wb, kWhiteBalance, sizeof(input->wb));
+
+    // interpolate it, and drop the alpha component
+    const size_t pixels = input->visibleWidth * input->visibleHeight;
+
+    debayered = malloc(pixels * 4 * sizeof(uint16_t));
+    input->rgb = malloc(pixels * 3 * sizeof(uint16_t));
+
+    if(!debayered || !input->rgb) {
+        err = -1;
+        goto done;
+    }
+
+    if((err = Debayer(kBayerAlgorithmBilinear, input->visible, debayered, input->visibleWidth,
+                      input->visibleHeight, input->vShift, input->wb, input->black))) {
+        fprintf(stderr, "%s: debayering failed (%d)\n", input->name, err);
+        goto done;
+    }
+
+    for(size_t i = 0; i < pixels; i++) {
+        memcpy(input->rgb + (i * 3), debayered + (i * 4), 3 * sizeof(uint16_t));
+    }
+
+done:;
+    free(debayered);
+    free(stats);
+    if(dec) JPEGDecompressorRelease(dec);
+
+    return err;
+}
+
+/**
+ * Releases all buffers of an input.
+ */
+void BenchInputRelease(bench_input_t *input) {
+    free(input->file);
+    free(input->sensor);
+    free(input->visible);
+    free(input->rgb);
+
+    input->file = NULL;
+    input->sensor = input->visible = input->rgb = NULL;
+    input->scan = NULL;
+}
@@ -0,0 +1,124 @@
+//
+//  inputs.h
+//  PaperBench
+//
+//  Images the benchmarks run on: either read from a CR2 file, or synthesized
+//  and compressed the same way a camera would. Each input is decoded once up
+//  front, so that every kernel can be benchmarked with the output of the ones
+//  that run before it.
+//
+//  Created by Tristan Seifert on 20200911.
+//
+
+#ifndef PAPERBENCH_INPUTS_H
+#define PAPERBENCH_INPUTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// forward declarations
+typedef struct jpeg_decompressor jpeg_decompressor_t;
+
+/**
+ * A Huffman table, as stored in the JPEG stream
+ */
+typedef struct bench_dht {
+    /// Number of codes of each length, from 1 to 16 bits
+    uint8_t counts[16];
+    /// Values of the codes, in order of increasing code length
+    uint8_t values[256];
+    /// Number of values
+    size_t numValues;
+} bench_dht_t;
+
+/**
+ * An image to benchmark with
+ */
+typedef struct bench_input {
+    /// Name of the input in results: the file name, or the size of a synthetic image
+    char name[256];
+    /// Whether the image was synthesized
+    bool synthetic;
+
+    /// Contents of the file (or the synthesized JPEG stream)
+    uint8_t *file;
+    size_t fileLength;
+
+    /// Entropy coded data of the lossless JPEG scan, up to the end of the raw data
+    const uint8_t *scan;
+    size_t scanLength;
+
+    /// Samples per line, lines, sample precision and number of components of the JPEG frame
+    size_t cols, rows;
+    uint8_t precision;
+    size_t components;
+    /// Prediction algorithm of the scan
+    uint8_t predictor;
+    /// Huffman tables, by slot, and which of them each component is decoded with
+    bench_dht_t tables[4];
+    bool hasTable[4];
+    size_t tableForComponent[4];
+
+    /// Slicing info (tag 0xc640)
+    uint16_t slices[3];
+    /// Size of the sensor data, and the position of its borders, starting with top and going clockwise
+    size_t sensorWidth, sensorHeight;
+    size_t borders[4];
+
+    /// Decoded sensor data, in the unsliced layout
+    uint16_t *sensor;
+
+    /// Trimmed visible area of the sensor data
+    uint16_t *visible;
+    size_t visibleWidth, visibleHeight;
+    /// Black level of each CFA index, and vertical shift of the Bayer pattern of the visible area
+    uint16_t black[4];
+    size_t vShift;
+    /// White balance multipliers; CR2 files store these in their color data, which isn't read, so all inputs
+    /// use the same ones
+    double wb[4];
+
+    /// Visible area debayered with bilinear interpolation; 3 components per pixel
+    uint16_t *rgb;
+} bench_input_t;
+
+/**
+ * Reads the CR2 file at the given path, and decodes it.
+ *
+ * @return 0 on success, or an error code; a message is printed on failure
+ */
+int BenchInputLoadCR2(const char *path, bench_input_t *outInput);
+
+/**
+ * Synthesizes a CR2-like image of the given sensor size, with borders and slicing like that of a Canon
+ * camera, and compresses it. It's then decoded like a file would be.
+ *
+ * @return 0 on success, or an error code; a message is printed on failure
+ */
+int BenchInputMakeSynthetic(size_t width, size_t height, bench_input_t *outInput);
+
+/**
+ * Sets up a decompressor to decode the input's scan into the given plane, with unstuffing enabled like the
+ * decoder of the framework does. The decompressor must have been created with the size of the input's frame,
+ * or reset to it.
+ *
+ * @param length Size of the plane, in bytes
+ * @param unsliced Whether samples are written in the sensor layout, rather than frame order
+ */
+int BenchInputConfigureDecompressor(const bench_input_t *input, jpeg_decompressor_t *dec, uint16_t *plane,
+                                    size_t length, bool unsliced);
+
+/**
+ * Releases all buffers of an input.
+ */
+void BenchInputRelease(bench_input_t *input);
+
+/**
+ * Gets the Huffman table a component is decoded with.
+ */
+static inline const bench_dht_t *BenchInputTable(const bench_input_t *input, size_t component) {
+    return &input->tables[input->tableForComponent[component]];
+}
+
+#endif /* PAPERBENCH_INPUTS_H */
@@ -0,0 +1,250 @@
+//
+//  main.c
+//  PaperBench
+//
+//  Benchmarks the C kernels of Paper: each case runs on every input, once for
+//  each of the thread counts. Results are written to the standard output (or a
+//  file) as JSON lines or CSV; a readable summary goes to the standard error.
+//
+//  Created by Tristan Seifert on 20200911.
+//
+
+#include "bench.h"
+#include "inputs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+
+/// Most thread counts and synthetic image sizes that may be specified
+#define kMaxListLength 16
+
+/// Size of the synthetic image used if none are specified; the sensor of a 30 MP camera
+#define kDefaultSyntheticWidth 6744
+#define kDefaultSyntheticHeight 4502
+
+static void PrintUsage(const char *name, FILE *out) {
+    fprintf(out, "usage: %s [options] [file.cr2 ...]\n\n"
+            "Benchmarks the decoding and developing kernels on the given CR2 files, and synthetic images.\n\n"
+            "options:\n"
+            "  -t, --threads N[,N...]   numbers of concurrent jobs to run each case with (default: 1,<cpus>)\n"
+            "  -i, --iterations N       timed iterations of each case (default: 5)\n"
+            "  -s, --synthetic WxH      add a synthetic image of this sensor size; may be repeated, or\n"
+            "                           'none' to only use files (default: %dx%d)\n"
+            "  -c, --case NAME          only run cases whose name contains this; may be repeated\n"
+            "  -f, --format json|csv    output format (default: json, one object per line)\n"
+            "  -o, --output FILE        write results to a file rather than the standard output\n"
+            "  -l, --list               list all cases and exit\n"
+            "  -h, --help               show this help\n", name,
+            kDefaultSyntheticWidth, kDefaultSyntheticHeight);
+}
+
+/**
+ * Parses a comma separated list of positive numbers.
+ *
+ * @return Number of values, or 0 if the list is invalid
+ */
+static size_t ParseList(const char *str, size_t *outValues) {
+    size_t count = 0;
+
+    while(*str && count < kMaxListLength) {
+        char *end;
+        const long value = strtol(str, &end, 10);
+
+        if(end == str || value <= 0 || (*end && *end != ',')) return 0;
+        outValues[count++] = (size_t) value;
+
+        str = *end ? (end + 1) : end;
+    }
+
+    return *str ? 0 : count;
+}
+
+/**
+ * Checks whether a case should run, given the filters.
+ */
+static bool CaseSelected(const bench_case_t *bc, const char **filters, size_t numFilters) {
+    if(!numFilters) return true;
+
+    for(size_t i = 0; i < numFilters; i++) {
+        if(strstr(bc->name, filters[i])) return true;
+    }
+    return false;
+}
+
+/**
+ * Benchmarks all selected cases with an input.
+ *
+ * @return Number of cases that failed
+ */
+static size_t RunInput(const bench_input_t *input, const size_t *threads, size_t numThreads, size_t iterations,
+                       const char **filters, size_t numFilters, FILE *out, bench_format_t format) {
+    size_t failures = 0;
+
+    fprintf(stderr, "%s: %zu x %zu sensor, %zu x %zu visible\n", input->name, input->sensorWidth,
+            input->sensorHeight, input->visibleWidth, input->visibleHeight);
+
+    for(size_t i = 0; i < kBenchNumCases; i++) {
+        const bench_case_t *bc = &kBenchCases[i];
+        if(!CaseSelected(bc, filters, numFilters)) continue;
+
+        for(size_t t = 0; t < numThreads; t++) {
+            bench_result_t result;
+            const int err = BenchRun(bc, input, threads[t], iterations, &result);
+
+            if(err == 1) {
+                fprintf(stderr, "  %-22s skipped (input not supported)\n", bc->name);
+                break;
+            } else if(err) {
+                fprintf(stderr, "  %-22s x%-3zu failed (%d)\n", bc->name, threads[t], err);
+                failures++;
+            } else {
+                fprintf(stderr, "  %-22s x%-3zu %10.2f M%s/s %10.1f MB/s %8.1f MB scratch (median %.2f ms)\n",
+                        bc->name, threads[t], result.itemsPerSecond / 1e6,
+                        !strcmp(bc->unit, "pixel") ? "P" : bc->unit, result.bytesPerSecond / 1e6,
+                        result.peakScratchBytes / 1e6, result.medianSeconds * 1e3);
+            }
+
+            BenchPrintResult(out, format, bc, input, &result);
+        }
+    }
+
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    size_t threads[kMaxListLength], numThreads = 0;
+    size_t widths[kMaxListLength], heights[kMaxListLength], numSynthetic = 0;
+    bool syntheticSpecified = false;
+    size_t iterations = 5;
+    const char *filters[kMaxListLength];
+    size_t numFilters = 0;
+    bench_format_t format = kBenchFormatJSON;
+    FILE *out = stdout;
+
+    static const struct option options[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"iterations", required_argument, NULL, 'i'},
+        {"synthetic", required_argument, NULL, 's'},
+        {"case", required_argument, NULL, 'c'},
+        {"format", required_argument, NULL, 'f'},
+        {"output", required_argument, NULL, 'o'},
+        {"list", no_argument, NULL, 'l'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "t:i:s:c:f:o:lh", options, NULL)) != -1) {
+        switch(opt) {
+            case 't':
+                if(!(numThreads = ParseList(optarg, threads))) {
+                    fprintf(stderr, "invalid thread counts: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'i':
+                iterations = (size_t) strtoul(optarg, NULL, 10);
+                if(!iterations) {
+                    fprintf(stderr, "invalid iteration count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 's':
+                syntheticSpecified = true;
+                if(!strcmp(optarg, "none")) break;
+
+                if(numSynthetic == kMaxListLength ||
+                   sscanf(optarg, "%zux%zu", &widths[numSynthetic], &heights[numSynthetic]) != 2) {
+                    fprintf(stderr, "invalid synthetic image size: %s\n", optarg);
+                    return 1;
+                }
+                numSynthetic++;
+                break;
+
+            case 'c':
+                if(numFilters < kMaxListLength) filters[numFilters++] = optarg;
+                break;
+
+            case 'f':
+                if(!strcmp(optarg, "json")) {
+                    format = kBenchFormatJSON;
+                } else if(!strcmp(optarg, "csv")) {
+                    format = kBenchFormatCSV;
+                } else {
+                    fprintf(stderr, "invalid format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'o':
+                if(!(out = fopen(optarg, "w"))) {
+                    fprintf(stderr, "failed to open %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'l':
+                for(size_t i = 0; i < kBenchNumCases; i++) {
+                    printf("%s\n", kBenchCases[i].name);
+                }
+                return 0;
+
+            case 'h':
+                PrintUsage(argv[0], stdout);
+                return 0;
+
+            default:
+                PrintUsage(argv[0], stderr);
+                return 1;
+        }
+    }
+
+    if(!numThreads) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        threads[numThreads++] = 1;
+        if(cpus > 1) threads[numThreads++] = (size_t) cpus;
+    }
+
+    if(!syntheticSpecified) {
+        widths[0] = kDefaultSyntheticWidth;
+        heights[0] = kDefaultSyntheticHeight;
+        numSynthetic = 1;
+    }
+
+    // run each input in turn, so only one is in memory at a time
+    size_t failures = 0;
+    BenchPrintHeader(out, format);
+
+    for(int i = optind; i < argc; i++) {
+        bench_input_t input;
+
+        if(BenchInputLoadCR2(argv[i], &input)) {
+            failures++;
+            continue;
+        }
+
+        failures += RunInput(&input, threads, numThreads, iterations, filters, numFilters, out, format);
+        BenchInputRelease(&input);
+    }
+
+    for(size_t i = 0; i < numSynthetic; i++) {
+        bench_input_t input;
+
+        if(BenchInputMakeSynthetic(widths[i], heights[i], &input)) {
+            failures++;
+            continue;
+        }
+
+        failures += RunInput(&input, threads, numThreads, iterations, filters, numFilters, out, format);
+        BenchInputRelease(&input);
+    }
+
+    if(out != stdout) fclose(out);
+    return failures ? 2 : 0;
+}
@@ -0,0 +1,125 @@
+//
+//  AHDInterpolationTests.m
+//  PaperTests
+//
+//  Compares the parallel, vectorized AHD interpolation against the sequential
+//  implementation it replaced.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "ahd_interpolate_mod.h"
+
+#import "ahd_reference.h"
+#import "test_images.h"
+
+/// LibRaw filter pattern for an RG/GB sensor, with both greens as color 1
+static const unsigned int kFilters = 0x94949494;
+
+@interface AHDInterpolationTests : XCTestCase
+
+@end
+
+@implementation AHDInterpolationTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Interpolates a synthetic image of the given size with both implementations, and ensures that every
+ * component of every pixel is the same.
+ */
+- (void) compareWidth:(size_t) width height:(size_t) height seed:(uint32_t) seed {
+    NSString *desc = [NSString stringWithFormat:@"%zux%zu", width, height];
+
+    // LibRaw state the interpolation reads, with a typical camera to sRGB matrix
+    static const float rgbCam[3][3] = {
+        { 1.60f, -0.45f, -0.15f },
+        { -0.20f, 1.45f, -0.25f },
+        { 0.05f, -0.50f, 1.45f },
+    };
+
+    libraw_data_t *raw = calloc(1, sizeof(libraw_data_t));
+    XCTAssert(raw != NULL, @"%@", desc);
+
+    raw->sizes.width = (ushort) width;
+    raw->sizes.height = (ushort) height;
+    raw->idata.filters = kFilters;
+    raw->idata.colors = 3;
+
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 3; j++) {
+            raw->color.rgb_cam[i][j] = rgbCam[i][j];
+        }
+    }
+
+    // place each CFA value in its color's component, as LibRaw does
+    uint16_t *cfa = TestImageMakeBayer(width, height, 65535, seed);
+    uint16_t (*expected)[4] = calloc(width * height, sizeof(*expected));
+    uint16_t (*actual)[4] = calloc(width * height, sizeof(*actual));
+    XCTAssert(cfa && expected && actual, @"%@", desc);
+
+    for (size_t row = 0; row < height; row++) {
+        for (size_t col = 0; col < width; col++) {
+            const size_t color = (kFilters >> ((((row << 1) & 14) + (col & 1)) << 1)) & 3;
+            const size_t i = (row * width) + col;
+
+            expected[i][color] = actual[i][color] = cfa[i];
+        }
+    }
+
+    ahd_interpolate_reference(raw, expected);
+    XCTAssertEqual(ahd_interpolate_mod_cancellable(raw, actual, NULL, NULL), kAHDResultSuccess, @"%@", desc);
+
+    for (size_t i = 0; i < (width * height); i++) {
+        if (memcmp(expected[i], actual[i], sizeof(*actual)) != 0) {
+            XCTFail(@"%@: pixel (%zu, %zu) is (%u, %u, %u), expected (%u, %u, %u)", desc, i % width,
+                    i / width, actual[i][0], actual[i][1], actual[i][2], expected[i][0], expected[i][1],
+                    expected[i][2]);
+            break;
+        }
+    }
+
+    free(actual);
+    free(expected);
+    free(cfa);
+    free(raw);
+}
+
+// MARK: - Tests
+/**
+ * Interpolates images that are split into many tiles, so that several workers run at once and share the
+ * edges of their tiles; their output must not depend on which worker got to a tile first.
+ */
+- (void) testParallelTilesMatchSequential {
+    [self compareWidth:1000 height:760 seed:0x5EED0008];
+    [self compareWidth:600 height:520 seed:0x5EED0108];
+}
+
+/**
+ * Interpolates images whose size isn't a multiple of the tile stride, nor of the vector width, so that the
+ * last tiles of each row and column are partial and the scalar tails of the vectorized loops run.
+ */
+- (void) testPartialTilesMatchSequential {
+    [self compareWidth:257 height:250 seed:0x5EED0208];
+    [self compareWidth:503 height:251 seed:0x5EED0308];
+    [self compareWidth:64 height:40 seed:0x5EED0408];
+}
+
+/**
+ * Interpolates images that are too small for any tiles, which only have their borders interpolated.
+ */
+- (void) testTinyImagesMatchSequential {
+    [self compareWidth:9 height:9 seed:0x5EED0508];
+    [self compareWidth:12 height:11 seed:0x5EED0608];
+}
+
+@end
@@ -0,0 +1,266 @@
+//
+//  BatchDecoderTests.swift
+//  PaperTests
+//
+//  Exercises the scheduling of the batch decoder: admission against the memory
+//  budget, releasing reservations as images finish, and discarding images of
+//  cancelled generations. The files read are not valid CR2 files, so every
+//  image that isn't cancelled fails in the decode stage.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+import XCTest
+
+@testable import Paper
+
+class BatchDecoderTests: XCTestCase {
+    /// Size of each file, in bytes; with an expansion of 1, this is also the estimate of each image
+    private static let fileSize = 1000
+
+    /// Directory holding the files of a test
+    private var directory: URL!
+
+    /**
+     * Creates a directory for the files of the test.
+     */
+    override func setUpWithError() throws {
+        self.continueAfterFailure = false
+
+        self.directory = FileManager.default.temporaryDirectory
+            .appendingPathComponent("BatchDecoderTests-\(UUID().uuidString)", isDirectory: true)
+        try FileManager.default.createDirectory(at: self.directory, withIntermediateDirectories: true,
+                                                attributes: nil)
+    }
+
+    /**
+     * Removes the files of the test.
+     */
+    override func tearDownWithError() throws {
+        try FileManager.default.removeItem(at: self.directory)
+    }
+
+    // MARK: - Helpers
+    /**
+     * Writes the given number of files of junk to the test's directory.
+     */
+    private func makeFiles(_ count: Int) throws -> [URL] {
+        return try (0..<count).map { i in
+            let url = self.directory.appendingPathComponent("\(i).cr2", isDirectory: false)
+            try Data(repeating: UInt8(truncatingIfNeeded: i), count: Self.fileSize).write(to: url)
+            return url
+        }
+    }
+
+    /**
+     * Creates a decoder that estimates each image to need as many bytes as its file, and reads files on enough
+     * workers that only the memory budget limits how many are in flight.
+     */
+    private func makeDecoder(budget: UInt64) -> CR2BatchDecoder {
+        let decoder = CR2BatchDecoder()
+        decoder.estimatedExpansion = 1
+        decoder.ioWorkers = 8
+        decoder.memoryBudget = budget
+        return decoder
+    }
+
+    /**
+     * Decodes the files, and waits for all of them to complete. Returns the results by URL.
+     */
+    private func decode(_ decoder: CR2BatchDecoder, _ urls: [URL],
+                        started: (() -> Void)? = nil) -> [URL: Result<CR2BatchDecoder.Output, Error>] {
+        let lock = NSLock()
+        var results: [URL: Result<CR2BatchDecoder.Output, Error>] = [:]
+        let done = self.expectation(description: "batch finished")
+
+        decoder.decode(urls, completion: { url, result in
+            lock.lock()
+            XCTAssertNil(results[url], "\(url) completed twice")
+            results[url] = result
+            lock.unlock()
+        }, finished: {
+            done.fulfill()
+        })
+
+        started?()
+        self.wait(for: [done], timeout: 30)
+
+        lock.lock()
+        defer { lock.unlock() }
+        return results
+    }
+
+    /**
+     * Whether the result is a failure because the image was cancelled.
+     */
+    private static func isCancelled(_ result: Result<CR2BatchDecoder.Output, Error>) -> Bool {
+        if case .failure(CR2BatchDecoder.Errors.cancelled) = result {
+            return true
+        }
+        return false
+    }
+
+    /**
+     * Records the largest reservation of the decoder seen while files are read.
+     */
+    private class ReservationRecorder {
+        private let lock = NSLock()
+        private(set) var maxImages = 0
+        private(set) var maxBytes: UInt64 = 0
+
+        func record(_ decoder: CR2BatchDecoder?) {
+            guard let reservation = decoder?.reservation else {
+                return
+            }
+
+            self.lock.lock()
+            self.maxImages = max(self.maxImages, reservation.images)
+            self.maxBytes = max(self.maxBytes, reservation.bytes)
+            self.lock.unlock()
+        }
+    }
+
+    // MARK: - Admission
+    /**
+     * Decodes more images than fit into the budget at once. No more than fit may be in flight at any time, and all
+     * of them must eventually complete, since finished images release their reservation.
+     */
+    func testAdmissionRespectsBudget() throws {
+        let urls = try self.makeFiles(8)
+        let decoder = self.makeDecoder(budget: UInt64(Self.fileSize * 5 / 2))
+        let recorder = ReservationRecorder()
+
+        decoder.readFile = { [weak decoder] url in
+            recorder.record(decoder)
+            Thread.sleep(forTimeInterval: 0.02)
+            return try Data(contentsOf: url)
+        }
+
+        let results = self.decode(decoder, urls)
+
+        XCTAssertEqual(results.count, urls.count)
+        for (url, result) in results {
+            XCTAssertFalse(Self.isCancelled(result), "\(url) was cancelled")
+            XCTAssertThrowsError(try result.get(), "\(url) decoded from junk")
+        }
+
+        XCTAssertEqual(recorder.maxImages, 2)
+        XCTAssertLessThanOrEqual(recorder.maxBytes, decoder.memoryBudget)
+
+        XCTAssertEqual(decoder.reservation.images, 0)
+        XCTAssertEqual(decoder.reservation.bytes, 0)
+    }
+
+    /**
+     * Decodes images that are each larger than the budget; they're admitted one at a time, rather than never.
+     */
+    func testOversizedImagesAreAdmittedAlone() throws {
+        let urls = try self.makeFiles(4)
+        let decoder = self.makeDecoder(budget: UInt64(Self.fileSize / 2))
+        let recorder = ReservationRecorder()
+
+        decoder.readFile = { [weak decoder] url in
+            recorder.record(decoder)
+            Thread.sleep(forTimeInterval: 0.02)
+            return try Data(contentsOf: url)
+        }
+
+        let results = self.decode(decoder, urls)
+
+        XCTAssertEqual(results.count, urls.count)
+        XCTAssertEqual(recorder.maxImages, 1)
+        XCTAssertEqual(decoder.reservation.bytes, 0)
+    }
+
+    /**
+     * Fails every read. The reservations of failed images must be released, so a later batch still runs with the
+     * entire budget.
+     */
+    func testBudgetIsReleased() throws {
+        let urls = try self.makeFiles(6)
+        let decoder = self.makeDecoder(budget: UInt64(Self.fileSize * 3))
+
+        decoder.readFile = { url in
+            throw CocoaError(.fileReadNoPermission, userInfo: [NSURLErrorKey: url])
+        }
+
+        let failed = self.decode(decoder, urls)
+
+        XCTAssertEqual(failed.count, urls.count)
+        for (url, result) in failed {
+            XCTAssertThrowsError(try result.get(), "\(url) succeeded") { error in
+                XCTAssertEqual((error as? CocoaError)?.code, .fileReadNoPermission)
+            }
+        }
+
+        XCTAssertEqual(decoder.reservation.images, 0)
+        XCTAssertEqual(decoder.reservation.bytes, 0)
+
+        // the next batch is admitted up to the full budget
+        let recorder = ReservationRecorder()
+
+        decoder.readFile = { [weak decoder] url in
+            recorder.record(decoder)
+            Thread.sleep(forTimeInterval: 0.02)
+            return try Data(contentsOf: url)
+        }
+
+        let results = self.decode(decoder, urls)
+
+        XCTAssertEqual(results.count, urls.count)
+        XCTAssertEqual(recorder.maxImages, 3)
+        XCTAssertEqual(decoder.reservation.bytes, 0)
+    }
+
+    // MARK: - Cancellation
+    /**
+     * Cancels a batch while its first images are being read. Images that weren't admitted yet are cancelled right
+     * away; those in flight are discarded before the next stage. Images submitted afterwards belong to the new
+     * generation and are decoded as usual.
+     */
+    func testCancelDiscardsEarlierGenerations() throws {
+        let urls = try self.makeFiles(6)
+        let decoder = self.makeDecoder(budget: UInt64(Self.fileSize * 2))
+
+        let reading = DispatchSemaphore(value: 0)
+        let gate = DispatchSemaphore(value: 0)
+
+        decoder.readFile = { url in
+            reading.signal()
+            gate.wait()
+            return try Data(contentsOf: url)
+        }
+
+        let results = self.decode(decoder, urls, started: {
+            // wait for both admitted images to be read, then cancel everything
+            reading.wait()
+            reading.wait()
+
+            XCTAssertEqual(decoder.reservation.images, 2)
+            decoder.cancelAll()
+
+            gate.signal()
+            gate.signal()
+        })
+
+        XCTAssertEqual(results.count, urls.count)
+        for (url, result) in results {
+            XCTAssertTrue(Self.isCancelled(result), "\(url) wasn't cancelled")
+        }
+
+        XCTAssertEqual(decoder.reservation.images, 0)
+        XCTAssertEqual(decoder.reservation.bytes, 0)
+
+        // images of the new generation aren't discarded
+        decoder.readFile = { url in
+            return try Data(contentsOf: url)
+        }
+
+        let later = self.decode(decoder, Array(urls.prefix(2)))
+
+        XCTAssertEqual(later.count, 2)
+        for (url, result) in later {
+            XCTAssertFalse(Self.isCancelled(result), "\(url) of the new generation was cancelled")
+        }
+    }
+}
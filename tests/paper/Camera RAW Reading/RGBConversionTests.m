@@ -0,0 +1,240 @@
+//
+//  RGBConversionTests.m
+//  PaperTests
+//
+//  Compares the parallel conversion of interpolated LibRaw output to RGB
+//  against the sequential implementation it replaced: the matrix product of
+//  each pixel, the merged histogram, and the composed output curve.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "TSRawImageDataHelpers.h"
+
+#import "rgb_reference.h"
+#import "test_images.h"
+
+/// Size of the test image; the lines don't split evenly among the workers
+static const size_t kImageWidth = 301;
+static const size_t kImageHeight = 157;
+
+/// Number of histogram bins of each colour
+static const size_t kHistogramBins = 0x2000;
+
+@interface RGBConversionTests : XCTestCase
+
+@end
+
+@implementation RGBConversionTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Creates the LibRaw state the conversion reads, with a typical camera to sRGB matrix; negative coefficients
+ * push some components below zero, while others saturate. The output curve is not the identity, so that it
+ * must be composed with the gamma curve correctly.
+ */
+static libraw_data_t *MakeLibRaw(int colors) {
+    static const float rgbCam[3][4] = {
+        { 1.60f, -0.45f, -0.15f, 0.10f },
+        { -0.20f, 1.45f, -0.25f, -0.05f },
+        { 0.05f, -0.50f, 1.45f, 0.20f },
+    };
+
+    libraw_data_t *raw = calloc(1, sizeof(libraw_data_t));
+    if (!raw) return NULL;
+
+    raw->sizes.width = raw->sizes.iwidth = (ushort) kImageWidth;
+    raw->sizes.height = raw->sizes.iheight = (ushort) kImageHeight;
+    raw->idata.colors = colors;
+
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < (size_t) colors; j++) {
+            raw->color.rgb_cam[i][j] = rgbCam[i][j];
+        }
+    }
+    for (size_t i = 0; i < 0x10000; i++) {
+        raw->color.curve[i] = (ushort) (i - (i >> 4));
+    }
+
+    return raw;
+}
+
+/**
+ * Creates interpolated pixels, with the given number of colours; the others are cleared.
+ */
+static uint16_t (*MakePixels(int colors, uint32_t seed))[4] {
+    uint16_t *values = TestImageMakeBayer(kImageWidth * 4, kImageHeight, 65535, seed);
+    if (!values) return NULL;
+
+    for (size_t i = 0; i < (kImageWidth * kImageHeight * 4); i++) {
+        if ((int) (i % 4) >= colors) {
+            values[i] = 0;
+        }
+    }
+
+    return (uint16_t (*)[4]) values;
+}
+
+/**
+ * Counts the histogram of the pixels, after they were multiplied by the matrix.
+ */
+static void CountHistogram(const uint16_t (*image)[4], int colors, int *histogram) {
+    memset(histogram, 0, sizeof(int) * kHistogramBins * 4);
+
+    for (size_t i = 0; i < (kImageWidth * kImageHeight); i++) {
+        for (int c = 0; c < colors; c++) {
+            histogram[(c * kHistogramBins) + (image[i][c] >> 3)]++;
+        }
+    }
+}
+
+/**
+ * Converts an image with both implementations. The matrix products may only differ by rounding (the parallel
+ * version may contract them differently); the histogram must be that of the converted pixels, and the output
+ * must be the curves the reference builds from it, applied to those pixels.
+ */
+- (void) compareColors:(int) colors seed:(uint32_t) seed {
+    NSString *desc = [NSString stringWithFormat:@"%d colors", colors];
+    const size_t pixels = kImageWidth * kImageHeight;
+
+    libraw_data_t *raw = MakeLibRaw(colors);
+    uint16_t (*expected)[4] = MakePixels(colors, seed);
+    uint16_t (*actual)[4] = calloc(pixels, sizeof(*actual));
+    uint16_t (*expectedOut)[4] = calloc(pixels, sizeof(*expectedOut));
+    uint16_t (*actualOut)[4] = calloc(pixels, sizeof(*actualOut));
+    XCTAssert(raw && expected && actual && expectedOut && actualOut, @"%@", desc);
+
+    memcpy(actual, expected, pixels * sizeof(*actual));
+
+    NSMutableData *histogramData = [NSMutableData dataWithLength:(sizeof(int) * kHistogramBins * 4)];
+    NSMutableData *expectedHistogramData = [NSMutableData dataWithLength:histogramData.length];
+    NSMutableData *gammaData = [NSMutableData dataWithLength:(sizeof(uint16_t) * 0x10000)];
+    NSMutableData *expectedGammaData = [NSMutableData dataWithLength:gammaData.length];
+
+    rgb_convert_reference_matrix(raw, expected, expectedHistogramData.mutableBytes);
+    XCTAssertEqual(TSRawConvertToRGB(raw, actual, actualOut, histogramData.mutableBytes, gammaData.mutableBytes),
+                   0, @"%@", desc);
+
+    // the image holds the matrix products
+    BOOL matches = YES;
+
+    for (size_t i = 0; matches && i < pixels; i++) {
+        for (size_t c = 0; c < 3; c++) {
+            if (abs((int) actual[i][c] - (int) expected[i][c]) > 1) {
+                XCTFail(@"%@: component %zu of pixel %zu is %u, expected %u", desc, c, i, actual[i][c],
+                        expected[i][c]);
+                matches = NO;
+                break;
+            }
+        }
+    }
+
+    if (!matches) {
+        free(actualOut);
+        free(expectedOut);
+        free(actual);
+        free(expected);
+        free(raw);
+        return;
+    }
+
+    NSMutableData *countedData = [NSMutableData dataWithLength:histogramData.length];
+    CountHistogram((const uint16_t (*)[4]) actual, colors, countedData.mutableBytes);
+    XCTAssertEqualObjects(histogramData, countedData, @"%@: histogram doesn't match the image", desc);
+
+    // the curves built from that histogram
+    rgb_convert_reference_curve(raw, (const uint16_t (*)[4]) actual, expectedOut, histogramData.bytes,
+                                expectedGammaData.mutableBytes);
+    XCTAssertEqualObjects(gammaData, expectedGammaData, @"%@: gamma curve differs", desc);
+
+    for (size_t i = 0; i < pixels; i++) {
+        if (memcmp(actualOut[i], expectedOut[i], 3 * sizeof(uint16_t)) != 0) {
+            XCTFail(@"%@: pixel %zu is (%u, %u, %u), expected (%u, %u, %u)", desc, i, actualOut[i][0],
+                    actualOut[i][1], actualOut[i][2], expectedOut[i][0], expectedOut[i][1], expectedOut[i][2]);
+            break;
+        }
+    }
+
+    free(actualOut);
+    free(expectedOut);
+    free(actual);
+    free(expected);
+    free(raw);
+}
+
+// MARK: - Tests
+/**
+ * Converts an image with three colours, as the interactive pipeline produces.
+ */
+- (void) testThreeColorsMatchSequential {
+    [self compareColors:3 seed:0x5EED0021];
+}
+
+/**
+ * Converts an image with four colours, whose fourth colour contributes to the matrix products and the
+ * histogram as well.
+ */
+- (void) testFourColorsMatchSequential {
+    [self compareColors:4 seed:0x5EED0121];
+}
+
+/**
+ * Converts an image to half floats in place; each component must be the integer output scaled to [0, 1], with
+ * an opaque alpha component. The histogram and gamma curve are the same as those of the integer conversion.
+ */
+- (void) testHalfMatchesIntegerConversion {
+    const size_t pixels = kImageWidth * kImageHeight;
+
+    libraw_data_t *raw = MakeLibRaw(3);
+    uint16_t (*image)[4] = MakePixels(3, 0x5EED0023);
+    uint16_t (*halfImage)[4] = calloc(pixels, sizeof(*halfImage));
+    uint16_t (*out)[4] = calloc(pixels, sizeof(*out));
+    XCTAssert(raw && image && halfImage && out);
+
+    memcpy(halfImage, image, pixels * sizeof(*halfImage));
+
+    NSMutableData *histogramData = [NSMutableData dataWithLength:(sizeof(int) * kHistogramBins * 4)];
+    NSMutableData *halfHistogramData = [NSMutableData dataWithLength:histogramData.length];
+    NSMutableData *gammaData = [NSMutableData dataWithLength:(sizeof(uint16_t) * 0x10000)];
+    NSMutableData *halfGammaData = [NSMutableData dataWithLength:gammaData.length];
+
+    XCTAssertEqual(TSRawConvertToRGB(raw, image, out, histogramData.mutableBytes, gammaData.mutableBytes), 0);
+    XCTAssertEqual(TSRawConvertToRGBHalf(raw, halfImage, (__fp16 (*)[4]) halfImage,
+                                         halfHistogramData.mutableBytes, halfGammaData.mutableBytes), 0);
+
+    XCTAssertEqualObjects(halfHistogramData, histogramData);
+    XCTAssertEqualObjects(halfGammaData, gammaData);
+
+    const __fp16 (*halfOut)[4] = (const __fp16 (*)[4]) halfImage;
+    BOOL matches = YES;
+
+    for (size_t i = 0; matches && i < pixels; i++) {
+        for (size_t c = 0; c < 4; c++) {
+            const __fp16 expected = (c < 3) ? (__fp16) (out[i][c] / 65536.f) : (__fp16) 1.f;
+
+            if (halfOut[i][c] != expected) {
+                XCTFail(@"component %zu of pixel %zu is %g, expected %g", c, i, (double) halfOut[i][c],
+                        (double) expected);
+                matches = NO;
+                break;
+            }
+        }
+    }
+
+    free(out);
+    free(halfImage);
+    free(image);
+    free(raw);
+}
+
+@end
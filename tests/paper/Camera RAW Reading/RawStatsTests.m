@@ -0,0 +1,208 @@
+//
+//  RawStatsTests.m
+//  PaperTests
+//
+//  Compares the single pass statistics and trimming of raw sensor data against
+//  straightforward separate passes over the image.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "unslice.h"
+
+#import "test_images.h"
+
+/// Size of the test sensor; the visible area has an odd width and starts on an odd line and column, so that
+/// its CFA pattern is offset from that of the sensor
+static const size_t kSensorWidth = 301;
+static const size_t kSensorHeight = 203;
+static const size_t kBorders[4] = {13, 299, 201, 41};
+
+@interface RawStatsTests : XCTestCase
+
+@end
+
+@implementation RawStatsTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Reference
+/**
+ * Calculates the statistics of the lines `[firstLine, firstLine + numLines)` of the sensor, only considering
+ * columns left of `maxCol`, with a separate simple loop for each of them.
+ */
+static void ReferenceStats(const uint16_t *sensor, size_t firstLine, size_t numLines, size_t maxCol,
+                           cr2_raw_stats_t *stats) {
+    // black level: the left border of every line, except for its first two columns
+    for (size_t line = firstLine; line < (firstLine + numLines); line++) {
+        for (size_t col = 2; col < kBorders[3] && col < maxCol; col++) {
+            const size_t color = ((line & 1) << 1) | (col & 1);
+
+            stats->blackSums[color] += sensor[(line * kSensorWidth) + col];
+            stats->blackCounts[color]++;
+        }
+    }
+
+    // sums and histogram: the visible area, with colors relative to its top left corner
+    for (size_t line = MAX(firstLine, kBorders[0]); line < (firstLine + numLines) && line <= kBorders[2];
+         line++) {
+        for (size_t col = kBorders[3]; col <= kBorders[1] && col < maxCol; col++) {
+            const size_t color = (((line - kBorders[0]) & 1) << 1) | ((col - kBorders[3]) & 1);
+            const uint16_t value = sensor[(line * kSensorWidth) + col];
+
+            stats->sums[color] += value;
+            stats->histogram[color][MIN(value >> CR2_HISTOGRAM_SHIFT, CR2_HISTOGRAM_BINS - 1)]++;
+        }
+    }
+}
+
+/**
+ * Ensures two sets of statistics are identical, reporting the first field that differs.
+ */
+- (void) compareStats:(const cr2_raw_stats_t *) actual expected:(const cr2_raw_stats_t *) expected
+                 desc:(NSString *) desc {
+    for (size_t c = 0; c < 4; c++) {
+        XCTAssertEqual(actual->blackSums[c], expected->blackSums[c], @"%@: black sum %zu", desc, c);
+        XCTAssertEqual(actual->blackCounts[c], expected->blackCounts[c], @"%@: black count %zu", desc, c);
+        XCTAssertEqual(actual->sums[c], expected->sums[c], @"%@: sum %zu", desc, c);
+
+        for (size_t bin = 0; bin < CR2_HISTOGRAM_BINS; bin++) {
+            XCTAssertEqual(actual->histogram[c][bin], expected->histogram[c][bin], @"%@: histogram %zu, bin %zu",
+                           desc, c, bin);
+        }
+    }
+}
+
+// MARK: - Tests
+/**
+ * Collects statistics and trims the image in one pass, then checks both against the reference: the black
+ * levels, Bayer shift and histogram must come out the same, and the trimmed image must be exactly the
+ * visible area of the sensor.
+ */
+- (void) testCollectAndTrimMatchesSeparatePasses {
+    uint16_t *sensor = TestImageMakeBayer(kSensorWidth, kSensorHeight, 16383, 0x5EED0011);
+    XCTAssert(sensor != NULL);
+
+    NSMutableData *trimmed = [NSMutableData dataWithBytes:sensor
+                                                   length:(kSensorWidth * kSensorHeight * sizeof(uint16_t))];
+
+    cr2_raw_stats_t *stats = calloc(1, sizeof(cr2_raw_stats_t));
+    cr2_raw_stats_t *expected = calloc(1, sizeof(cr2_raw_stats_t));
+    XCTAssert(stats && expected);
+
+    size_t borders[4];
+    memcpy(borders, kBorders, sizeof(borders));
+
+    const size_t bytes = CR2CollectStats(trimmed.mutableBytes, kSensorWidth, kSensorHeight, borders, true, stats);
+    ReferenceStats(sensor, 0, kSensorHeight, kSensorWidth, expected);
+
+    [self compareStats:stats expected:expected desc:@"collect and trim"];
+
+    // the derived values must therefore match too
+    uint16_t black[4] = {0, 0, 0, 0}, expectedBlack[4] = {0, 0, 0, 0};
+    CR2CalculateBlackLevel(stats, black);
+
+    for (size_t c = 0; c < 4; c++) {
+        expectedBlack[c] = (uint16_t) (expected->blackSums[c] / expected->blackCounts[c]);
+        XCTAssertEqual(black[c], expectedBlack[c], @"black level %zu", c);
+    }
+
+    const int64_t redBlue = (int64_t) expected->sums[0] - (int64_t) expected->sums[3];
+    const int64_t greens = (int64_t) expected->sums[1] - (int64_t) expected->sums[2];
+    XCTAssertEqual(CR2CalculateBayerShift(stats), (llabs(redBlue) < llabs(greens)) ? 1 : 0);
+
+    // trimmed image is the visible area, packed
+    const size_t visibleWidth = (kBorders[1] - kBorders[3]) + 1;
+    const size_t visibleHeight = (kBorders[2] - kBorders[0]) + 1;
+    XCTAssertEqual(bytes, visibleWidth * visibleHeight * sizeof(uint16_t));
+
+    const uint16_t *out = trimmed.bytes;
+
+    for (size_t line = 0; line < visibleHeight; line++) {
+        const uint16_t *expectedLine = sensor + ((line + kBorders[0]) * kSensorWidth) + kBorders[3];
+
+        XCTAssertEqual(memcmp(out + (line * visibleWidth), expectedLine, visibleWidth * sizeof(uint16_t)), 0,
+                       @"trimmed line %zu", line);
+    }
+
+    free(expected);
+    free(stats);
+    free(sensor);
+}
+
+/**
+ * Collects statistics without trimming, which must leave the image untouched.
+ */
+- (void) testCollectWithoutTrimming {
+    uint16_t *sensor = TestImageMakeBayer(kSensorWidth, kSensorHeight, 16383, 0x5EED0111);
+    XCTAssert(sensor != NULL);
+
+    const size_t sensorBytes = kSensorWidth * kSensorHeight * sizeof(uint16_t);
+    NSMutableData *copy = [NSMutableData dataWithBytes:sensor length:sensorBytes];
+
+    cr2_raw_stats_t *stats = calloc(1, sizeof(cr2_raw_stats_t));
+    cr2_raw_stats_t *expected = calloc(1, sizeof(cr2_raw_stats_t));
+    XCTAssert(stats && expected);
+
+    size_t borders[4];
+    memcpy(borders, kBorders, sizeof(borders));
+
+    XCTAssertEqual(CR2CollectStats(copy.mutableBytes, kSensorWidth, kSensorHeight, borders, false, stats),
+                   (size_t) 0);
+    XCTAssertEqual(memcmp(copy.bytes, sensor, sensorBytes), 0);
+
+    ReferenceStats(sensor, 0, kSensorHeight, kSensorWidth, expected);
+    [self compareStats:stats expected:expected desc:@"collect"];
+
+    free(expected);
+    free(stats);
+    free(sensor);
+}
+
+/**
+ * Accumulates statistics a few lines at a time, and for only part of each line, as is done while an image
+ * is still being decoded.
+ */
+- (void) testAccumulatePartialImage {
+    static const size_t chunkLines[] = {1, 7, 64};
+    static const size_t maxCols[] = {kSensorWidth, 1000, 180, kBorders[3] + 1, kBorders[3], 20, 0};
+
+    uint16_t *sensor = TestImageMakeBayer(kSensorWidth, kSensorHeight, 16383, 0x5EED0211);
+    XCTAssert(sensor != NULL);
+
+    cr2_raw_stats_t *stats = calloc(1, sizeof(cr2_raw_stats_t));
+    cr2_raw_stats_t *expected = calloc(1, sizeof(cr2_raw_stats_t));
+    XCTAssert(stats && expected);
+
+    for (size_t m = 0; m < (sizeof(maxCols) / sizeof(*maxCols)); m++) {
+        for (size_t c = 0; c < (sizeof(chunkLines) / sizeof(*chunkLines)); c++) {
+            memset(stats, 0, sizeof(*stats));
+            memset(expected, 0, sizeof(*expected));
+
+            for (size_t line = 0; line < kSensorHeight; line += chunkLines[c]) {
+                const size_t lines = MIN(chunkLines[c], kSensorHeight - line);
+                CR2AccumulateStats(sensor, kSensorWidth, line, lines, kBorders, maxCols[m], stats);
+            }
+
+            ReferenceStats(sensor, 0, kSensorHeight, maxCols[m], expected);
+
+            NSString *desc = [NSString stringWithFormat:@"%zu lines at a time, %zu columns", chunkLines[c],
+                              maxCols[m]];
+            [self compareStats:stats expected:expected desc:desc];
+        }
+    }
+
+    free(expected);
+    free(stats);
+    free(sensor);
+}
+
+@end
@@ -0,0 +1,259 @@
+//
+//  RawStreamTests.m
+//  PaperTests
+//
+//  Decodes a synthetic sliced CR2 scan through the band streaming pipeline, and
+//  ensures that its output and statistics are identical to decoding the entire
+//  image first, then trimming and debayering it in one piece.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "rawstream.h"
+#import "decompress.h"
+#import "huffman.h"
+
+#import "test_images.h"
+
+/// Size of the sensor; two components per sample, as in Canon's files. The visible area is tall enough to
+/// be split into several bands
+static const size_t kSensorWidth = 520;
+static const size_t kSensorHeight = 410;
+
+/// Slicing info: two slices of 172 samples, and a last one of 176
+static const uint16_t kSlices[3] = {2, 172, 176};
+
+/// White balance, color matrix and scale the image is debayered with
+static const double kWhiteBalance[4] = {2.1, 1.0, 1.0, 1.5};
+static const float kMatrix[9] = {
+    1.60f, -0.45f, -0.15f,
+    -0.20f, 1.45f, -0.25f,
+    0.05f, -0.50f, 1.45f,
+};
+static const float kScale = 1.f / 16384.f;
+
+/// Number of lines decoded between updates of the stream
+static const size_t kDecodeLines = 16;
+
+@interface RawStreamTests : XCTestCase
+
+@end
+
+@implementation RawStreamTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Synthesizes a sensor image with a dark border above and left of the visible area, puts it into slice
+ * order and compresses it as a two component lossless JPEG scan.
+ */
+- (NSData *) makeScanWithBorders:(const size_t *) borders seed:(uint32_t) seed {
+    uint16_t *sensor = TestImageMakeBayer(kSensorWidth, kSensorHeight, 16383, seed);
+    uint16_t *frame = malloc(kSensorWidth * kSensorHeight * sizeof(uint16_t));
+    XCTAssert(sensor && frame);
+
+    for (size_t y = 0; y < kSensorHeight; y++) {
+        for (size_t x = 0; x < kSensorWidth; x++) {
+            if (y < borders[0] || x < borders[3]) {
+                uint16_t *value = &sensor[(y * kSensorWidth) + x];
+                *value = 2040 + (*value & 15);
+            }
+        }
+    }
+
+    // slices are stored one after another, each from top to bottom
+    size_t j = 0;
+
+    for (size_t s = 0; s <= kSlices[0]; s++) {
+        const size_t start = s * kSlices[1];
+        const size_t end = (s < kSlices[0]) ? (start + kSlices[1]) : kSensorWidth;
+
+        for (size_t y = 0; y < kSensorHeight; y++) {
+            memcpy(frame + j, sensor + (y * kSensorWidth) + start, (end - start) * sizeof(uint16_t));
+            j += (end - start);
+        }
+    }
+
+    size_t scanLength = 0;
+    uint8_t *scan = TestImageEncodeScan(frame, kSensorWidth / 2, kSensorHeight, 2, 14, 1, &scanLength);
+    XCTAssert(scan != NULL);
+
+    free(frame);
+    free(sensor);
+
+    return [NSData dataWithBytesNoCopy:scan length:scanLength freeWhenDone:YES];
+}
+
+/**
+ * Creates a decompressor that decodes the scan into the given plane, in the sensor layout.
+ */
+- (jpeg_decompressor_t *) decompressorForScan:(NSData *) scan plane:(NSMutableData *) plane {
+    jpeg_decompressor_t *dec = JPEGDecompressorNew(kSensorWidth / 2, kSensorHeight, 14, 2);
+    XCTAssert(dec != NULL);
+
+    jpeg_huffman_t *table = JPEGHuffmanNewFromDHT(kTestHuffmanCounts, kTestHuffmanValues,
+                                                  sizeof(kTestHuffmanValues));
+    XCTAssert(table != NULL);
+    XCTAssertEqual(JPEGDecompressorAddTable(dec, 0, table), 0);
+    JPEGHuffmanRelease(table);
+
+    XCTAssertEqual(JPEGDecompressorSetTableForPlane(dec, 0, 0), 0);
+    XCTAssertEqual(JPEGDecompressorSetTableForPlane(dec, 1, 0), 0);
+    XCTAssertEqual(JPEGDecompressorSetPredictionAlgo(dec, 1), 0);
+    XCTAssertEqual(JPEGDecompressorSetUnstuffInput(dec, true), 0);
+
+    XCTAssertEqual(JPEGDecompressorSetUnslicedOutput(dec, plane.mutableBytes, plane.length, kSlices), 0);
+    XCTAssertEqual(JPEGDecompressorSetInput(dec, scan.bytes, scan.length), 0);
+
+    return dec;
+}
+
+/**
+ * Streams the scan through the pipeline, a few lines at a time, and compares the output and statistics
+ * against those of the whole image: it's decoded at once, trimmed and debayered into a buffer with the
+ * same layout.
+ */
+- (void) compareAlgorithm:(debayer_algorithm_t) algo borders:(const size_t *) borders seed:(uint32_t) seed {
+    NSString *desc = [NSString stringWithFormat:@"algorithm %d, borders (%zu, %zu, %zu, %zu)", algo,
+                      borders[0], borders[1], borders[2], borders[3]];
+
+    NSData *scan = [self makeScanWithBorders:borders seed:seed];
+
+    const size_t sensorBytes = kSensorWidth * kSensorHeight * sizeof(uint16_t);
+    const size_t visibleWidth = (borders[1] - borders[3]) + 1;
+    const size_t visibleHeight = (borders[2] - borders[0]) + 1;
+
+    const size_t factor = DebayerScaleFactor(algo);
+    const size_t outWidth = visibleWidth / factor, outHeight = visibleHeight / factor;
+
+    pixel_layout_t layout = {
+        .format = kPixelFormatF32, .channels = 4, .order = kPixelChannelOrderRGB,
+        .stride = outWidth * 4 * sizeof(float),
+    };
+
+    // stream it
+    NSMutableData *streamPlane = [NSMutableData dataWithLength:sensorBytes];
+    NSMutableData *streamOut = [NSMutableData dataWithLength:(layout.stride * outHeight)];
+    jpeg_decompressor_t *dec = [self decompressorForScan:scan plane:streamPlane];
+
+    cr2_stream_config_t cfg = {
+        .rowWidth = kSensorWidth, .numRows = kSensorHeight,
+        .algo = algo, .scale = kScale,
+        .output = layout, .outLength = streamOut.length,
+    };
+    memcpy(cfg.borders, borders, sizeof(cfg.borders));
+    memcpy(cfg.wb, kWhiteBalance, sizeof(cfg.wb));
+    memcpy(cfg.matrix, kMatrix, sizeof(cfg.matrix));
+    cfg.output.base = streamOut.mutableBytes;
+
+    cr2_stream_t *stream = CR2StreamNew(dec, &cfg);
+    XCTAssert(stream != NULL, @"%@", desc);
+
+    size_t offset = 0;
+    bool foundMarker = false;
+
+    while (!JPEGDecompressorIsDone(dec) && dec->error == kJPEGErrorNone) {
+        offset = JPEGDecompressorGoLines(dec, offset, kDecodeLines, &foundMarker);
+        XCTAssertEqual(CR2StreamUpdate(stream), 0, @"%@", desc);
+    }
+    XCTAssertEqual(dec->error, kJPEGErrorNone, @"%@", desc);
+
+    cr2_raw_stats_t *streamStats = calloc(1, sizeof(cr2_raw_stats_t));
+    size_t vShift = 0;
+    XCTAssertEqual(CR2StreamFinish(stream, streamStats, &vShift), 0, @"%@", desc);
+
+    CR2StreamRelease(stream);
+    JPEGDecompressorRelease(dec);
+
+    // decode the whole image, then trim and debayer it
+    NSMutableData *plane = [NSMutableData dataWithLength:sensorBytes];
+    dec = [self decompressorForScan:scan plane:plane];
+
+    JPEGDecompressorGo(dec, 0, &foundMarker);
+    XCTAssertTrue(JPEGDecompressorIsDone(dec), @"%@", desc);
+    JPEGDecompressorRelease(dec);
+
+    XCTAssertEqual(memcmp(plane.bytes, streamPlane.bytes, sensorBytes), 0, @"%@: decoded image differs", desc);
+
+    cr2_raw_stats_t *stats = calloc(1, sizeof(cr2_raw_stats_t));
+    size_t trimBorders[4];
+    memcpy(trimBorders, borders, sizeof(trimBorders));
+
+    CR2CollectStats(plane.mutableBytes, kSensorWidth, kSensorHeight, trimBorders, true, stats);
+
+    uint16_t black[4], streamBlack[4];
+    CR2CalculateBlackLevel(stats, black);
+    CR2CalculateBlackLevel(streamStats, streamBlack);
+
+    XCTAssertEqual(memcmp(stats, streamStats, sizeof(*stats)), 0, @"%@: statistics differ", desc);
+    XCTAssertEqual(memcmp(black, streamBlack, sizeof(black)), 0, @"%@: black levels differ", desc);
+
+    NSMutableData *out = [NSMutableData dataWithLength:streamOut.length];
+    layout.base = out.mutableBytes;
+
+    XCTAssertEqual(DebayerRegionToLayout(algo, plane.bytes, visibleWidth, visibleHeight, vShift, kWhiteBalance,
+                                         black, kMatrix, kScale, 0, 0, visibleWidth, visibleHeight, &layout), 0,
+                   @"%@", desc);
+
+    // the output must be identical; find the first line that isn't
+    for (size_t line = 0; line < outHeight; line++) {
+        const size_t lineOffset = line * layout.stride;
+
+        if (memcmp(((const uint8_t *) out.bytes) + lineOffset, ((const uint8_t *) streamOut.bytes) + lineOffset,
+                   layout.stride) != 0) {
+            XCTFail(@"%@: output line %zu differs", desc, line);
+            break;
+        }
+    }
+
+    free(stats);
+    free(streamStats);
+}
+
+// MARK: - Tests
+/**
+ * Streams an image whose left border lies within the first slices, so that bands are debayered while the
+ * last slice is still being decoded.
+ */
+- (void) testStreamMatchesWholeImage {
+    static const debayer_algorithm_t algos[] = {
+        kBayerAlgorithmBilinear, kBayerAlgorithmLMMSE, kBayerAlgorithmHalfSize, kBayerAlgorithmQuarterSize,
+    };
+    const size_t borders[4] = {37, kSensorWidth - 1, kSensorHeight - 1, 71};
+
+    for (size_t a = 0; a < (sizeof(algos) / sizeof(*algos)); a++) {
+        [self compareAlgorithm:algos[a] borders:borders seed:(0x5EED0015 + (uint32_t) a)];
+    }
+}
+
+/**
+ * Streams an image whose visible area is shorter and narrower than the sensor on all sides.
+ */
+- (void) testStreamWithInsetVisibleArea {
+    const size_t borders[4] = {12, kSensorWidth - 6, kSensorHeight - 9, 40};
+
+    [self compareAlgorithm:kBayerAlgorithmLMMSE borders:borders seed:0x5EED0115];
+    [self compareAlgorithm:kBayerAlgorithmHalfSize borders:borders seed:0x5EED0215];
+}
+
+/**
+ * Streams an image whose left border extends into the last slice. Its black level can't be known until the
+ * entire image has been decoded, so all bands are processed when the stream is finished.
+ */
+- (void) testStreamWithBorderInLastSlice {
+    const size_t borders[4] = {20, kSensorWidth - 1, kSensorHeight - 1, 351};
+
+    [self compareAlgorithm:kBayerAlgorithmLMMSE borders:borders seed:0x5EED0315];
+    [self compareAlgorithm:kBayerAlgorithmQuarterSize borders:borders seed:0x5EED0415];
+}
+
+@end
@@ -0,0 +1,24 @@
+//
+//  ahd_reference.h
+//  PaperTests
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#ifndef ahd_reference_h
+#define ahd_reference_h
+
+#include <stdint.h>
+
+#include "libraw.h"
+
+/**
+ * Interpolates the image with the sequential, scalar AHD implementation that `ahd_interpolate_mod` was
+ * derived from. The output of both must be identical.
+ *
+ * @param imageData Pointer to the libraw structure
+ * @param image Image pointer, input
+ */
+void ahd_interpolate_reference(libraw_data_t *imageData, uint16_t (*image)[4]);
+
+#endif /* ahd_reference_h */
@@ -0,0 +1,180 @@
+/**
+ * Sequential conversion of interpolated LibRaw output to RGB, as it was before
+ * the image was converted in parallel bands with a composed output curve. It's
+ * kept only as the reference the tests compare TSRawConvertToRGB() against,
+ * split at the point where the histogram is complete, since the gamma curve
+ * depends on it.
+ *
+ * The code is unchanged from TSRawImageDataHelpers.m, other than the split.
+ */
+#include "rgb_reference.h"
+
+#include <string.h>
+#include <math.h>
+
+#include "interpolation_shared.h"
+
+static void TSBuildGammaCurve(double pwr, double ts, int mode, int imax, uint16_t *curve, double *gamm);
+
+// define some shorthands
+/// size struct
+#define S libRaw->sizes
+
+/**
+ * Multiplies each pixel by the output camera matrix, and counts the histogram.
+ */
+void rgb_convert_reference_matrix(libraw_data_t *libRaw, uint16_t (*image)[4], int *histogram) {
+	size_t i, j, k;
+	size_t row, col, c;
+	uint16_t *img;
+	
+	// get some data from the struct
+	ushort width = libRaw->sizes.width;
+	ushort height = libRaw->sizes.height;
+	
+	// build the camera output profile
+	float out[3], out_cam[3][4];
+	
+	// calculate the output camera matrix
+	memcpy(out_cam, libRaw->color.rgb_cam, sizeof out_cam);
+	
+	for(i = 0; i < 3; i++) {
+		for(j = 0; j < libRaw->idata.colors; j++) {
+			for(out_cam[i][j] = k = 0; k < 3; k++) {
+				out_cam[i][j] += prophoto_rgb[i][k] * libRaw->color.rgb_cam[k][j];
+			}
+		}
+	}
+	
+	// Set up for conversion to RGB
+	img = image[0];
+	
+	memset(histogram, 0, sizeof(int) * 0x2000 * 4);
+	
+	for(row = 0; row < height; row++) {
+		for(col = 0; col < width; col++, img += 4) {
+			// perform conversion
+			out[0] = out[1] = out[2] = 0;
+			
+			for(c = 0; c < libRaw->idata.colors; c++) {
+				out[0] += out_cam[0][c] * img[c];
+				out[1] += out_cam[1][c] * img[c];
+				out[2] += out_cam[2][c] * img[c];
+			}
+			
+			// write it back into the image buffer, as an integer value
+			for(c = 0; c < 3; c++) {
+				img[c] = CLIP((int) out[c]);
+			}
+			
+			// update histogram
+			for(c = 0; c < libRaw->idata.colors; c++) {
+				histogram[(c * 0x2000) + (img[c] >> 3)]++;
+			}
+		}
+	}
+}
+
+/**
+ * Builds the gamma curve from the histogram, and applies the curves.
+ */
+void rgb_convert_reference_curve(libraw_data_t *libRaw, const uint16_t (*image)[4], uint16_t (*outBuf)[4],
+                                 const int *histogram, uint16_t *gammaCurve) {
+	size_t row, col, c;
+	const uint16_t *img;
+	uint16_t *outPtr;
+	
+	// fill the gamma array
+	double gamm[6];
+	
+	// ProPhoto gamma
+	gamm[0] = (1.f / 1.8f);
+	gamm[1] = 0.f;
+	
+	TSBuildGammaCurve(gamm[0], gamm[1], 0, 0, gammaCurve, gamm);
+	
+	// get some data from the struct
+	ushort width = libRaw->sizes.width;
+	ushort height = libRaw->sizes.height;
+	
+	// calculate gamma curve based off histogram? idk
+	int perc, val, total, t_white = 0x2000;
+	perc = S.width * S.height;
+	
+	for (t_white = c = 0; c < libRaw->idata.colors; c++) {
+		for (val = 0x2000, total = 0; --val > 32;) {
+			if ((total += histogram[(c * 0x2000) + val]) > perc) break;
+			if (t_white < val) t_white = val;
+		}
+	}
+	
+	TSBuildGammaCurve(gamm[0], gamm[1], 2, (t_white << 3), gammaCurve, gamm);
+	
+	// do gamma correction
+	img = image[0];
+	outPtr = outBuf[0];
+	
+	for(row = 0; row < height; row++) {
+		for(col = 0; col < width; col++, img += 4, outPtr += 4) {
+			for(c = 0; c < 3; c++) {
+				// apply curve
+				outPtr[c] = libRaw->color.curve[gammaCurve[img[c]]];
+			}
+		}
+	}
+}
+
+/**
+ * Builds the gamma curve.
+ */
+static void TSBuildGammaCurve(double pwr, double ts, int mode, int imax, uint16_t *curve, double *gamm) {
+	int i;
+	double g[6], bnd[2] = {0,0}, r;
+	
+	g[0] = pwr;
+	g[1] = ts;
+	g[2] = g[3] = g[4] = 0;
+	bnd[g[1] >= 1] = 1;
+	
+	if (g[1] && (g[1] - 1) * (g[0] - 1) <= 0) {
+		for (i = 0; i < 48; i++) {
+			g[2] = (bnd[0] + bnd[1])/2;
+			
+			if (g[0]) {
+				bnd[(pow(g[2]/g[1],-g[0]) - 1)/g[0] - 1/g[2] > -1] = g[2];
+			} else {
+				bnd[g[2]/exp(1-1/g[2]) < g[1]] = g[2];
+			}
+		}
+		
+		g[3] = g[2] / g[1];
+		
+		if (g[0]) {
+			g[4] = g[2] * (1/g[0] - 1);
+		}
+	}
+	
+	if (g[0]) {
+		g[5] = 1 / (g[1]*SQR(g[3])/2 - g[4]*(1 - g[3]) +
+						  (1 - pow(g[3],1+g[0]))*(1 + g[4])/(1 + g[0])) - 1;
+	} else {
+		g[5] = 1 / (g[1]*SQR(g[3])/2 + 1
+						  - g[2] - g[3] -	g[2]*g[3]*(log(g[3]) - 1)) - 1;
+	}
+		
+	// no clue what the hell this is supposed to do
+	if (!mode--) {
+		memcpy(gamm, g, (sizeof(double) * 6));
+		return;
+	}
+	
+	// actually build the curve?
+	for (i = 0; i < 0x10000; i++) {
+		curve[i] = 0xffff;
+		
+		if ((r = (double) i / imax) < 1)
+			curve[i] = 0x10000 * (mode
+								  ? (r < g[3] ? r*g[1] : (g[0] ? pow( r,g[0])*(1+g[4])-g[4]    : log(r)*g[2]+1))
+								  : (r < g[2] ? r/g[1] : (g[0] ? pow((r+g[4])/(1+g[4]),1/g[0]) : exp((r-1)/g[2]))));
+	}
+}
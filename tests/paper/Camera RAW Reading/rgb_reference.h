@@ -0,0 +1,38 @@
+//
+//  rgb_reference.h
+//  PaperTests
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#ifndef rgb_reference_h
+#define rgb_reference_h
+
+#include <stdint.h>
+
+#include "libraw.h"
+
+/**
+ * Multiplies each pixel by the output camera matrix in place, one after another, and counts the histogram of
+ * the result; this is the first half of the sequential conversion that `TSRawConvertToRGB` replaced.
+ *
+ * @param libRaw LibRaw instance from which to acquire some image info
+ * @param image Image buffer (after interpolation)
+ * @param histogram Histogram to fill; 0x2000 bins for each of four colours
+ */
+void rgb_convert_reference_matrix(libraw_data_t *libRaw, uint16_t (*image)[4], int *histogram);
+
+/**
+ * Builds the gamma curve for the given histogram, and applies it and the output curve to each pixel; this is
+ * the second half of the sequential conversion.
+ *
+ * @param libRaw LibRaw instance from which to acquire some image info
+ * @param image Image buffer, after it was multiplied by the matrix
+ * @param outBuf Output data buffer
+ * @param histogram Histogram of the image
+ * @param gammaCurve Gamma curve buffer
+ */
+void rgb_convert_reference_curve(libraw_data_t *libRaw, const uint16_t (*image)[4], uint16_t (*outBuf)[4],
+                                 const int *histogram, uint16_t *gammaCurve);
+
+#endif /* rgb_reference_h */
@@ -0,0 +1,186 @@
+//
+//  ColorConversionRegionTests.m
+//  PaperTests
+//
+//  Converts regions of interest to the working color space and ensures that
+//  they match the same area of the whole image, converted in place.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "colorspace.h"
+#import "pixel_layout.h"
+
+#import "test_images.h"
+
+/// Size of the test image
+static const size_t kImageWidth = 151;
+static const size_t kImageHeight = 97;
+
+/// Camera to XYZ matrix the image is converted with
+static const double kCamXyz[9] = {
+    0.6722, -0.0635, -0.0963,
+    -0.4287, 1.2460, 0.2028,
+    -0.0908, 0.2162, 0.5668,
+};
+
+/// Regions that are converted: x, y, width and height
+static const size_t kRegions[][4] = {
+    {0, 0, kImageWidth, kImageHeight},
+    {1, 1, 17, 9},
+    {37, 5, 101, 50},
+    {150, 0, 1, 97},
+    {0, 96, 151, 1},
+};
+
+/// Value that the unused bytes of output buffers are filled with
+static const uint8_t kCanary = 0xA5;
+
+@interface ColorConversionRegionTests : XCTestCase
+
+@end
+
+@implementation ColorConversionRegionTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Creates a 3 component image with 14-bit components, as produced by debayering.
+ */
+- (NSData *) makeImageWithSeed:(uint32_t) seed {
+    uint16_t *pixels = TestImageMakeFrame(kImageWidth, kImageHeight, 3, 14, 1, seed);
+    XCTAssert(pixels != NULL);
+
+    return [NSData dataWithBytesNoCopy:pixels length:(kImageWidth * kImageHeight * 3 * sizeof(uint16_t))
+                          freeWhenDone:YES];
+}
+
+/**
+ * Converts the whole image in place, which is the reference that regions are compared against.
+ *
+ * @return 3 floats per pixel
+ */
+- (NSData *) convertWhole:(NSData *) pixels {
+    NSMutableData *whole = [NSMutableData dataWithLength:(kImageWidth * kImageHeight * 3 * sizeof(float))];
+    memcpy(whole.mutableBytes, pixels.bytes, pixels.length);
+
+    XCTAssertEqual(ConvertToWorking(whole.mutableBytes, kImageWidth, kImageHeight, kCamXyz, NULL), 0);
+    return whole;
+}
+
+// MARK: - Tests
+/**
+ * Converts each region through an output descriptor with padded lines. This uses the same matrix and
+ * writer as the in place conversion, so it must be identical to it, and leave the padding alone.
+ */
+- (void) testLayoutRegionsMatchWholeImage {
+    NSData *pixels = [self makeImageWithSeed:0x5EED0412];
+    NSData *whole = [self convertWhole:pixels];
+    const float *ref = whole.bytes;
+
+    for (size_t r = 0; r < (sizeof(kRegions) / sizeof(*kRegions)); r++) {
+        const size_t x = kRegions[r][0], y = kRegions[r][1], w = kRegions[r][2], h = kRegions[r][3];
+        NSString *desc = [NSString stringWithFormat:@"region (%zu, %zu) %zux%zu", x, y, w, h];
+
+        const size_t lineBytes = w * 3 * sizeof(float);
+        const size_t stride = lineBytes + 20;
+
+        NSMutableData *out = [NSMutableData dataWithLength:(stride * h)];
+        memset(out.mutableBytes, kCanary, out.length);
+
+        const pixel_layout_t layout = {
+            .format = kPixelFormatF32, .channels = 3, .order = kPixelChannelOrderRGB,
+            .base = out.mutableBytes, .stride = stride,
+        };
+        XCTAssertEqual(ConvertRegionToLayout(pixels.bytes, kImageWidth, kImageHeight, kCamXyz, 1.f / 16384.f,
+                                             x, y, w, h, &layout), 0, @"%@", desc);
+
+        const uint8_t *bytes = out.bytes;
+
+        for (size_t line = 0; line < h; line++) {
+            const float *expected = ref + ((((y + line) * kImageWidth) + x) * 3);
+
+            XCTAssertEqual(memcmp(bytes + (line * stride), expected, lineBytes), 0, @"%@: line %zu", desc,
+                           y + line);
+
+            for (size_t i = lineBytes; i < stride; i++) {
+                XCTAssertEqual(bytes[(line * stride) + i], kCanary, @"%@: padding of line %zu", desc, line);
+            }
+        }
+    }
+}
+
+/**
+ * Converts each region through the planar path, which multiplies with vImage rather than the layout
+ * writer; its results may be rounded differently, but otherwise must be the same as the whole image.
+ */
+- (void) testPlanarRegionsMatchWholeImage {
+    NSData *pixels = [self makeImageWithSeed:0x5EED0512];
+    NSData *whole = [self convertWhole:pixels];
+    const float *ref = whole.bytes;
+
+    for (size_t r = 0; r < (sizeof(kRegions) / sizeof(*kRegions)); r++) {
+        const size_t x = kRegions[r][0], y = kRegions[r][1], w = kRegions[r][2], h = kRegions[r][3];
+        NSString *desc = [NSString stringWithFormat:@"region (%zu, %zu) %zux%zu", x, y, w, h];
+
+        const size_t stride = (w * 3 * sizeof(float)) + 20;
+        NSMutableData *out = [NSMutableData dataWithLength:(stride * h)];
+
+        XCTAssertEqual(ConvertRegionToWorking(pixels.bytes, kImageWidth, kImageHeight, kCamXyz, x, y, w, h,
+                                              out.mutableBytes, stride), 0, @"%@", desc);
+
+        for (size_t line = 0; line < h; line++) {
+            const float *row = (const float *) (((const uint8_t *) out.bytes) + (line * stride));
+            const float *expected = ref + ((((y + line) * kImageWidth) + x) * 3);
+
+            for (size_t i = 0; i < (w * 3); i++) {
+                if (fabsf(row[i] - expected[i]) > 1e-5f) {
+                    XCTFail(@"%@: component %zu of pixel (%zu, %zu) is %f, expected %f", desc, i % 3,
+                            x + (i / 3), y + line, row[i], expected[i]);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Ensures that regions that are empty or not entirely inside the image are rejected.
+ */
+- (void) testInvalidRegionsAreRejected {
+    static const size_t invalid[][4] = {
+        {0, 0, 0, 10},
+        {0, 0, 10, 0},
+        {150, 0, 2, 10},
+        {0, 90, 10, 8},
+        {kImageWidth, 0, 1, 1},
+    };
+
+    NSData *pixels = [self makeImageWithSeed:0x5EED0612];
+    NSMutableData *out = [NSMutableData dataWithLength:(kImageWidth * kImageHeight * 3 * sizeof(float))];
+
+    const pixel_layout_t layout = {
+        .format = kPixelFormatF32, .channels = 3, .order = kPixelChannelOrderRGB,
+        .base = out.mutableBytes, .stride = kImageWidth * 3 * sizeof(float),
+    };
+
+    for (size_t i = 0; i < (sizeof(invalid) / sizeof(*invalid)); i++) {
+        XCTAssertEqual(ConvertRegionToWorking(pixels.bytes, kImageWidth, kImageHeight, kCamXyz, invalid[i][0],
+                                              invalid[i][1], invalid[i][2], invalid[i][3], out.mutableBytes,
+                                              layout.stride), -1, @"region %zu", i);
+        XCTAssertEqual(ConvertRegionToLayout(pixels.bytes, kImageWidth, kImageHeight, kCamXyz, 1.f / 16384.f,
+                                             invalid[i][0], invalid[i][1], invalid[i][2], invalid[i][3],
+                                             &layout), -1, @"region %zu", i);
+    }
+}
+
+@end
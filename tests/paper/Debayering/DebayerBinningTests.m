@@ -0,0 +1,182 @@
+//
+//  DebayerBinningTests.m
+//  PaperTests
+//
+//  Checks the half and quarter size superpixel debayering against averages of
+//  each block of CFA values, computed directly in the test.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "debayer.h"
+
+#import "test_images.h"
+
+/// Size of the test image; neither dimension is a multiple of the block size, so the partial blocks at the
+/// right and bottom edges are dropped. It's tall enough to be binned in several bands.
+static const size_t kImageWidth = 205;
+static const size_t kImageHeight = 301;
+
+/// White balance and black levels the images are binned with; red is boosted enough for clipped values to
+/// saturate the output
+static const double kWhiteBalance[4] = {2.1, 1.0, 1.0, 1.5};
+static const uint16_t kBlackLevel[4] = {512, 510, 509, 515};
+
+@interface DebayerBinningTests : XCTestCase
+
+@end
+
+@implementation DebayerBinningTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Reference
+/**
+ * Bins the block of CFA values with the given top left corner. Each value is black level corrected, then
+ * the values of each color are averaged with their white balance applied; both greens are averaged
+ * together. This is done with the same single precision math as the debayering code, so that the results
+ * are rounded identically.
+ */
+static void ReferenceBin(const uint16_t *image, size_t left, size_t top, size_t factor, uint16_t *outPixel) {
+    float sum[4] = {0.f, 0.f, 0.f, 0.f};
+    float mul[4];
+
+    for (size_t color = 0; color < 4; color++) {
+        mul[color] = kWhiteBalance[color] / ((float) ((factor * factor) / 4));
+    }
+    mul[1] /= 2.f;
+    mul[2] /= 2.f;
+
+    for (size_t dy = 0; dy < factor; dy++) {
+        for (size_t dx = 0; dx < factor; dx++) {
+            const size_t color = ((dy & 1) << 1) | (dx & 1);
+            const uint16_t value = image[((top + dy) * kImageWidth) + left + dx];
+
+            sum[color] += (value > kBlackLevel[color]) ? (value - kBlackLevel[color]) : 0;
+        }
+    }
+
+    const float r = (sum[0] * mul[0]) + 0.5f;
+    const float g = (sum[1] * mul[1]) + (sum[2] * mul[2]) + 0.5f;
+    const float b = (sum[3] * mul[3]) + 0.5f;
+
+    outPixel[0] = (r < 65535.f) ? (uint16_t) r : 65535;
+    outPixel[1] = (g < 65535.f) ? (uint16_t) g : 65535;
+    outPixel[2] = (b < 65535.f) ? (uint16_t) b : 65535;
+}
+
+// MARK: - Tests
+/**
+ * Bins the whole image with both block sizes, and compares every output pixel against the reference. The
+ * output is opaque, and has one pixel per complete block.
+ */
+- (void) testBinningMatchesBlockAverages {
+    static const debayer_algorithm_t algos[] = {
+        kBayerAlgorithmHalfSize, kBayerAlgorithmQuarterSize,
+    };
+
+    uint16_t *image = TestImageMakeBayer(kImageWidth, kImageHeight, 65535, 0x5EED0013);
+    XCTAssert(image != NULL);
+
+    size_t saturated = 0;
+
+    for (size_t a = 0; a < (sizeof(algos) / sizeof(*algos)); a++) {
+        const size_t factor = DebayerScaleFactor(algos[a]);
+        XCTAssertEqual(factor, (size_t) ((algos[a] == kBayerAlgorithmHalfSize) ? 2 : 4));
+
+        const size_t outWidth = kImageWidth / factor, outHeight = kImageHeight / factor;
+        NSMutableData *out = [NSMutableData dataWithLength:(outWidth * outHeight * 4 * sizeof(uint16_t))];
+
+        XCTAssertEqual(Debayer(algos[a], image, out.mutableBytes, kImageWidth, kImageHeight, 0, kWhiteBalance,
+                               kBlackLevel), 0, @"factor %zu", factor);
+
+        const uint16_t *px = out.bytes;
+
+        for (size_t line = 0; line < outHeight; line++) {
+            for (size_t col = 0; col < outWidth; col++) {
+                const uint16_t *actual = px + (((line * outWidth) + col) * 4);
+                uint16_t expected[3];
+
+                ReferenceBin(image, col * factor, line * factor, factor, expected);
+
+                if (memcmp(actual, expected, sizeof(expected)) != 0 || actual[3] != UINT16_MAX) {
+                    XCTFail(@"factor %zu: pixel (%zu, %zu) is (%u, %u, %u, %u), expected (%u, %u, %u)", factor,
+                            col, line, actual[0], actual[1], actual[2], actual[3], expected[0], expected[1],
+                            expected[2]);
+                    free(image);
+                    return;
+                }
+
+                if (expected[0] == UINT16_MAX) saturated++;
+            }
+        }
+    }
+
+    // some of the clipped values should have saturated, or the clamping isn't tested
+    XCTAssertGreaterThan(saturated, (size_t) 0);
+
+    free(image);
+}
+
+/**
+ * Bins regions of the image that start on block boundaries into padded buffers; these must be the same as
+ * the corresponding area of the whole binned image. Regions whose size isn't a multiple of the block size
+ * drop their partial blocks.
+ */
+- (void) testBinnedRegionsMatchWholeImage {
+    static const debayer_algorithm_t algos[] = {
+        kBayerAlgorithmHalfSize, kBayerAlgorithmQuarterSize,
+    };
+    static const size_t regions[][4] = {
+        {0, 0, kImageWidth, kImageHeight},
+        {4, 8, 51, 203},
+        {100, 284, 105, 17},
+        {196, 0, 8, 300},
+    };
+
+    uint16_t *image = TestImageMakeBayer(kImageWidth, kImageHeight, 16383, 0x5EED0113);
+    XCTAssert(image != NULL);
+
+    for (size_t a = 0; a < (sizeof(algos) / sizeof(*algos)); a++) {
+        const size_t factor = DebayerScaleFactor(algos[a]);
+        const size_t wholeWidth = kImageWidth / factor, wholeHeight = kImageHeight / factor;
+
+        NSMutableData *whole = [NSMutableData dataWithLength:(wholeWidth * wholeHeight * 4 * sizeof(uint16_t))];
+        XCTAssertEqual(Debayer(algos[a], image, whole.mutableBytes, kImageWidth, kImageHeight, 0, kWhiteBalance,
+                               kBlackLevel), 0);
+        const uint16_t *ref = whole.bytes;
+
+        for (size_t r = 0; r < (sizeof(regions) / sizeof(*regions)); r++) {
+            const size_t x = regions[r][0], y = regions[r][1], w = regions[r][2], h = regions[r][3];
+            NSString *desc = [NSString stringWithFormat:@"factor %zu, region (%zu, %zu) %zux%zu", factor, x, y,
+                              w, h];
+
+            const size_t outWidth = w / factor, outHeight = h / factor;
+            const size_t stride = (outWidth * 4 * sizeof(uint16_t)) + 16;
+            NSMutableData *out = [NSMutableData dataWithLength:(stride * outHeight)];
+
+            XCTAssertEqual(DebayerRegion(algos[a], image, kImageWidth, kImageHeight, 0, kWhiteBalance,
+                                         kBlackLevel, x, y, w, h, out.mutableBytes, stride), 0, @"%@", desc);
+
+            for (size_t line = 0; line < outHeight; line++) {
+                const uint16_t *row = (const uint16_t *) (((const uint8_t *) out.bytes) + (line * stride));
+                const uint16_t *expected = ref + (((((y / factor) + line) * wholeWidth) + (x / factor)) * 4);
+
+                XCTAssertEqual(memcmp(row, expected, outWidth * 4 * sizeof(uint16_t)), 0, @"%@: line %zu",
+                               desc, line);
+            }
+        }
+    }
+
+    free(image);
+}
+
+@end
@@ -0,0 +1,204 @@
+//
+//  DebayerFloatTests.m
+//  PaperTests
+//
+//  Checks the fused debayer and color conversion against the separate steps
+//  it replaced: debayering to 16-bit RGB, then multiplying each pixel by the
+//  color matrix and scale factor.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <math.h>
+
+#import "debayer.h"
+
+#import "test_images.h"
+
+/// Size of the test image; it's split into several bands for the interpolating algorithms
+static const size_t kImageWidth = 160;
+static const size_t kImageHeight = 96;
+
+/// White balance and black levels the image is debayered with
+static const double kWhiteBalance[4] = {2.1, 1.0, 1.0, 1.5};
+static const uint16_t kBlackLevel[4] = {512, 510, 509, 515};
+
+/// Row major color matrix; its negative coefficients push some components below zero
+static const float kMatrix[9] = {
+    1.80f, -0.60f, -0.20f,
+    -0.25f, 1.50f, -0.25f,
+    0.05f, -0.55f, 1.50f,
+};
+
+/// Factor to convert the 14-bit components to floating point
+static const float kScale = 1.f / 16384.f;
+
+@interface DebayerFloatTests : XCTestCase
+
+@end
+
+@implementation DebayerFloatTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Debayers the image to 16-bit RGB, then converts each pixel in double precision, with the same single
+ * precision matrix (with the scale folded in) that the fused path uses.
+ *
+ * @param outMagnitudes Sum of the magnitudes of the terms of each component, which bounds its rounding error
+ * @return Expected pixels, 4 components per pixel; the fourth component is always 1
+ */
+static double *ConvertReference(const uint16_t *image, debayer_algorithm_t algo, size_t vShift,
+                                double *outMagnitudes) {
+    const size_t factor = DebayerScaleFactor(algo);
+    const size_t pixels = (kImageWidth / factor) * (kImageHeight / factor);
+
+    uint16_t *rgb = malloc(pixels * 4 * sizeof(uint16_t));
+    double *expected = malloc(pixels * 4 * sizeof(double));
+
+    if (!rgb || !expected || Debayer(algo, image, rgb, kImageWidth, kImageHeight, vShift, kWhiteBalance,
+                                     kBlackLevel) != 0) {
+        free(expected);
+        free(rgb);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < pixels; i++) {
+        const uint16_t *px = rgb + (i * 4);
+
+        for (size_t c = 0; c < 3; c++) {
+            double sum = 0, magnitude = 0;
+
+            for (size_t k = 0; k < 3; k++) {
+                const double term = (double) (kMatrix[(c * 3) + k] * kScale) * px[k];
+
+                sum += term;
+                magnitude += fabs(term);
+            }
+
+            expected[(i * 4) + c] = sum;
+            outMagnitudes[(i * 4) + c] = magnitude;
+        }
+
+        expected[(i * 4) + 3] = 1;
+        outMagnitudes[(i * 4) + 3] = 0;
+    }
+
+    free(rgb);
+    return expected;
+}
+
+/**
+ * Debayers the image to single and half precision floats with the given algorithm, and compares both
+ * against the separately converted reference. Single precision components may only differ from it by
+ * rounding of the matrix product, and half precision ones from those by one unit in the last place.
+ */
+- (void) compareImage:(const uint16_t *) image algorithm:(debayer_algorithm_t) algo vShift:(size_t) vShift {
+    NSString *desc = [NSString stringWithFormat:@"algorithm %d, vShift %zu", algo, vShift];
+
+    const size_t factor = DebayerScaleFactor(algo);
+    const size_t values = (kImageWidth / factor) * (kImageHeight / factor) * 4;
+
+    NSMutableData *magnitudeData = [NSMutableData dataWithLength:(values * sizeof(double))];
+    double *magnitudes = magnitudeData.mutableBytes;
+
+    double *expected = ConvertReference(image, algo, vShift, magnitudes);
+    XCTAssert(expected != NULL, @"%@", desc);
+
+    NSMutableData *floatData = [NSMutableData dataWithLength:(values * sizeof(float))];
+    NSMutableData *halfData = [NSMutableData dataWithLength:(values * sizeof(__fp16))];
+
+    XCTAssertEqual(DebayerToFloat(algo, image, floatData.mutableBytes, kImageWidth, kImageHeight, vShift,
+                                  kWhiteBalance, kBlackLevel, kMatrix, kScale), 0, @"%@", desc);
+    XCTAssertEqual(DebayerToHalf(algo, image, halfData.mutableBytes, kImageWidth, kImageHeight, vShift,
+                                 kWhiteBalance, kBlackLevel, kMatrix, kScale), 0, @"%@", desc);
+
+    const float *single = floatData.bytes;
+    const __fp16 *half = halfData.bytes;
+
+    for (size_t i = 0; i < values; i++) {
+        const double singleError = fabs(single[i] - expected[i]);
+        const double halfError = fabs((double) half[i] - single[i]);
+
+        // the smallest half float subnormal is about 6e-8
+        if (singleError > ((magnitudes[i] * 1e-6) + 1e-9) ||
+            halfError > ((fabs(single[i]) / 1024.) + 6e-8)) {
+            XCTFail(@"%@: component %zu of pixel %zu is %g (half %g), expected %g", desc, i % 4, i / 4,
+                    single[i], (double) half[i], expected[i]);
+            break;
+        }
+    }
+
+    free(expected);
+}
+
+// MARK: - Tests
+/**
+ * Compares the fused output of every algorithm against the separate steps, for both CFA phases.
+ */
+- (void) testFusedOutputMatchesSeparateConversion {
+    static const debayer_algorithm_t algos[] = {
+        kBayerAlgorithmBilinear, kBayerAlgorithmLMMSE, kBayerAlgorithmLMMSEMedian,
+        kBayerAlgorithmHalfSize, kBayerAlgorithmQuarterSize,
+    };
+
+    uint16_t *image = TestImageMakeBayer(kImageWidth, kImageHeight, 16383, 0x5EED0009);
+    XCTAssert(image != NULL);
+
+    for (size_t a = 0; a < (sizeof(algos) / sizeof(*algos)); a++) {
+        for (size_t vShift = 0; vShift < 2; vShift++) {
+            [self compareImage:image algorithm:algos[a] vShift:vShift];
+        }
+    }
+
+    free(image);
+}
+
+/**
+ * Debayers without a matrix; the float output is still scaled, which makes it the 16-bit output divided by
+ * the full range of the data.
+ */
+- (void) testScaleWithoutMatrix {
+    uint16_t *image = TestImageMakeBayer(kImageWidth, kImageHeight, 16383, 0x5EED0109);
+    XCTAssert(image != NULL);
+
+    const size_t pixels = kImageWidth * kImageHeight;
+
+    NSMutableData *rgbData = [NSMutableData dataWithLength:(pixels * 4 * sizeof(uint16_t))];
+    NSMutableData *floatData = [NSMutableData dataWithLength:(pixels * 4 * sizeof(float))];
+
+    XCTAssertEqual(Debayer(kBayerAlgorithmBilinear, image, rgbData.mutableBytes, kImageWidth, kImageHeight,
+                           0, kWhiteBalance, kBlackLevel), 0);
+    XCTAssertEqual(DebayerToFloat(kBayerAlgorithmBilinear, image, floatData.mutableBytes, kImageWidth,
+                                  kImageHeight, 0, kWhiteBalance, kBlackLevel, NULL, kScale), 0);
+
+    const uint16_t *rgb = rgbData.bytes;
+    const float *single = floatData.bytes;
+
+    for (size_t i = 0; i < pixels; i++) {
+        for (size_t c = 0; c < 3; c++) {
+            const float expected = rgb[(i * 4) + c] * kScale;
+
+            if (single[(i * 4) + c] != expected) {
+                XCTFail(@"component %zu of pixel %zu is %g, expected %g", c, i, single[(i * 4) + c], expected);
+                free(image);
+                return;
+            }
+        }
+
+        XCTAssertEqual(single[(i * 4) + 3], 1.f, @"alpha of pixel %zu", i);
+    }
+
+    free(image);
+}
+
+@end
@@ -0,0 +1,278 @@
+//
+//  DebayerRegionTests.m
+//  PaperTests
+//
+//  Debayers regions of interest at arbitrary offsets and ensures that they're
+//  identical to the same area of the whole image, debayered at once.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "debayer.h"
+#import "pixel_layout.h"
+
+#import "test_images.h"
+
+/// Size of the test image; the height is the largest that `Debayer` interpolates in place as a single piece,
+/// which makes its output the reference
+static const size_t kImageWidth = 204;
+static const size_t kImageHeight = 64;
+
+/// White balance and black levels the images are debayered with
+static const double kWhiteBalance[4] = {2.1, 1.0, 1.0, 1.5};
+static const uint16_t kBlackLevel[4] = {512, 510, 509, 515};
+
+/// Color matrix and scale for the float output
+static const float kMatrix[9] = {
+    1.60f, -0.45f, -0.15f,
+    -0.20f, 1.45f, -0.25f,
+    0.05f, -0.50f, 1.45f,
+};
+static const float kScale = 1.f / 16384.f;
+
+/// Regions that are debayered: x, y, width and height. Most start on odd lines and columns, and some touch
+/// the edges of the image, where there's less context than the halo
+static const size_t kRegions[][4] = {
+    {0, 0, kImageWidth, kImageHeight},
+    {1, 1, 17, 9},
+    {37, 5, 101, 50},
+    {5, 30, 198, 1},
+    {191, 0, 13, 64},
+    {0, 51, 3, 13},
+    {203, 63, 1, 1},
+};
+
+/// Value that the unused bytes of output buffers are filled with
+static const uint8_t kCanary = 0xA5;
+
+@interface DebayerRegionTests : XCTestCase
+
+@end
+
+@implementation DebayerRegionTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Ensures that the bytes past the end of each line of a region's output, up to the stride, weren't touched.
+ */
+- (void) checkPaddingOf:(NSData *) out lines:(size_t) lines lineBytes:(size_t) lineBytes
+                 stride:(size_t) stride desc:(NSString *) desc {
+    const uint8_t *bytes = out.bytes;
+
+    for (size_t line = 0; line < lines; line++) {
+        for (size_t i = lineBytes; i < stride; i++) {
+            if (bytes[(line * stride) + i] != kCanary) {
+                XCTFail(@"%@: padding byte %zu of line %zu was overwritten", desc, i, line);
+                return;
+            }
+        }
+    }
+}
+
+// MARK: - 16-bit output
+/**
+ * Debayers each region into a buffer whose lines are padded, and compares it against the whole image. The
+ * padding must be left alone, and the alpha component is always opaque.
+ *
+ * Only the color components are compared: the whole image is interpolated in place, which leaves its
+ * fourth component undefined.
+ */
+- (void) testRegionsMatchWholeImage {
+    static const debayer_algorithm_t algos[] = {
+        kBayerAlgorithmBilinear, kBayerAlgorithmLMMSE, kBayerAlgorithmLMMSEMedian,
+    };
+
+    uint16_t *image = TestImageMakeBayer(kImageWidth, kImageHeight, 16383, 0x5EED0012);
+    XCTAssert(image != NULL);
+
+    NSMutableData *whole = [NSMutableData dataWithLength:(kImageWidth * kImageHeight * 4 * sizeof(uint16_t))];
+
+    for (size_t a = 0; a < (sizeof(algos) / sizeof(*algos)); a++) {
+        for (size_t vShift = 0; vShift < 2; vShift++) {
+            XCTAssertEqual(Debayer(algos[a], image, whole.mutableBytes, kImageWidth, kImageHeight, vShift,
+                                   kWhiteBalance, kBlackLevel), 0);
+            const uint16_t *ref = whole.bytes;
+
+            for (size_t r = 0; r < (sizeof(kRegions) / sizeof(*kRegions)); r++) {
+                const size_t x = kRegions[r][0], y = kRegions[r][1], w = kRegions[r][2], h = kRegions[r][3];
+                NSString *desc = [NSString stringWithFormat:@"algorithm %d, vShift %zu, region (%zu, %zu) %zux%zu",
+                                  algos[a], vShift, x, y, w, h];
+
+                const size_t lineBytes = w * 4 * sizeof(uint16_t);
+                const size_t stride = lineBytes + 24;
+
+                NSMutableData *out = [NSMutableData dataWithLength:(stride * h)];
+                memset(out.mutableBytes, kCanary, out.length);
+
+                XCTAssertEqual(DebayerRegion(algos[a], image, kImageWidth, kImageHeight, vShift, kWhiteBalance,
+                                             kBlackLevel, x, y, w, h, out.mutableBytes, stride), 0, @"%@", desc);
+
+                for (size_t line = 0; line < h; line++) {
+                    const uint16_t *row = (const uint16_t *) (((const uint8_t *) out.bytes) + (line * stride));
+
+                    for (size_t col = 0; col < w; col++) {
+                        const uint16_t *expected = ref + ((((y + line) * kImageWidth) + (x + col)) * 4);
+                        const uint16_t *actual = row + (col * 4);
+
+                        if (memcmp(expected, actual, 3 * sizeof(uint16_t)) != 0 || actual[3] != UINT16_MAX) {
+                            XCTFail(@"%@: pixel (%zu, %zu) is (%u, %u, %u, %u), expected (%u, %u, %u)", desc,
+                                    x + col, y + line, actual[0], actual[1], actual[2], actual[3], expected[0],
+                                    expected[1], expected[2]);
+                            free(image);
+                            return;
+                        }
+                    }
+                }
+
+                [self checkPaddingOf:out lines:h lineBytes:lineBytes stride:stride desc:desc];
+            }
+        }
+    }
+
+    free(image);
+}
+
+/**
+ * Debayers each region through an output descriptor, into packed 3 component BGR pixels without color
+ * conversion; these must be the interpolated values of the whole image, in the other order.
+ */
+- (void) testRegionLayoutMatchesWholeImage {
+    uint16_t *image = TestImageMakeBayer(kImageWidth, kImageHeight, 16383, 0x5EED0112);
+    XCTAssert(image != NULL);
+
+    NSMutableData *whole = [NSMutableData dataWithLength:(kImageWidth * kImageHeight * 4 * sizeof(uint16_t))];
+    XCTAssertEqual(Debayer(kBayerAlgorithmLMMSE, image, whole.mutableBytes, kImageWidth, kImageHeight, 0,
+                           kWhiteBalance, kBlackLevel), 0);
+    const uint16_t *ref = whole.bytes;
+
+    for (size_t r = 0; r < (sizeof(kRegions) / sizeof(*kRegions)); r++) {
+        const size_t x = kRegions[r][0], y = kRegions[r][1], w = kRegions[r][2], h = kRegions[r][3];
+        NSString *desc = [NSString stringWithFormat:@"region (%zu, %zu) %zux%zu", x, y, w, h];
+
+        NSMutableData *out = [NSMutableData dataWithLength:(w * h * 3 * sizeof(uint16_t))];
+        const pixel_layout_t layout = {
+            .format = kPixelFormatU16, .channels = 3, .order = kPixelChannelOrderBGR,
+            .base = out.mutableBytes, .stride = w * 3 * sizeof(uint16_t),
+        };
+
+        XCTAssertEqual(DebayerRegionToLayout(kBayerAlgorithmLMMSE, image, kImageWidth, kImageHeight, 0,
+                                             kWhiteBalance, kBlackLevel, NULL, 1.f, x, y, w, h, &layout), 0,
+                       @"%@", desc);
+
+        const uint16_t *px = out.bytes;
+
+        for (size_t line = 0; line < h; line++) {
+            for (size_t col = 0; col < w; col++) {
+                const uint16_t *expected = ref + ((((y + line) * kImageWidth) + (x + col)) * 4);
+                const uint16_t *actual = px + (((line * w) + col) * 3);
+
+                if (actual[0] != expected[2] || actual[1] != expected[1] || actual[2] != expected[0]) {
+                    XCTFail(@"%@: pixel (%zu, %zu) is (%u, %u, %u), expected (%u, %u, %u)", desc, x + col,
+                            y + line, actual[2], actual[1], actual[0], expected[0], expected[1], expected[2]);
+                    free(image);
+                    return;
+                }
+            }
+        }
+    }
+
+    free(image);
+}
+
+// MARK: - Float output
+/**
+ * Debayers and color converts each region to floating point, and compares it against the same conversion
+ * of the whole image. Both go through the same kernels, so every component must be identical.
+ */
+- (void) testFloatRegionsMatchWholeImage {
+    uint16_t *image = TestImageMakeBayer(kImageWidth, kImageHeight, 16383, 0x5EED0212);
+    XCTAssert(image != NULL);
+
+    NSMutableData *whole = [NSMutableData dataWithLength:(kImageWidth * kImageHeight * 4 * sizeof(float))];
+    XCTAssertEqual(DebayerToFloat(kBayerAlgorithmLMMSE, image, whole.mutableBytes, kImageWidth, kImageHeight, 1,
+                                  kWhiteBalance, kBlackLevel, kMatrix, kScale), 0);
+    const float *ref = whole.bytes;
+
+    for (size_t r = 0; r < (sizeof(kRegions) / sizeof(*kRegions)); r++) {
+        const size_t x = kRegions[r][0], y = kRegions[r][1], w = kRegions[r][2], h = kRegions[r][3];
+        NSString *desc = [NSString stringWithFormat:@"region (%zu, %zu) %zux%zu", x, y, w, h];
+
+        const size_t lineBytes = w * 4 * sizeof(float);
+        const size_t stride = lineBytes + 32;
+
+        NSMutableData *out = [NSMutableData dataWithLength:(stride * h)];
+        memset(out.mutableBytes, kCanary, out.length);
+
+        XCTAssertEqual(DebayerRegionToFloat(kBayerAlgorithmLMMSE, image, kImageWidth, kImageHeight, 1,
+                                            kWhiteBalance, kBlackLevel, kMatrix, kScale, x, y, w, h,
+                                            out.mutableBytes, stride), 0, @"%@", desc);
+
+        for (size_t line = 0; line < h; line++) {
+            const float *row = (const float *) (((const uint8_t *) out.bytes) + (line * stride));
+            const float *expected = ref + ((((y + line) * kImageWidth) + x) * 4);
+
+            if (memcmp(row, expected, lineBytes) != 0) {
+                XCTFail(@"%@: line %zu differs from the whole image", desc, y + line);
+                free(image);
+                return;
+            }
+        }
+
+        [self checkPaddingOf:out lines:h lineBytes:lineBytes stride:stride desc:desc];
+    }
+
+    free(image);
+}
+
+// MARK: - Validation
+/**
+ * Ensures that regions that aren't entirely inside the image, are empty, or (for binning) don't start on a
+ * block boundary are rejected without writing anything.
+ */
+- (void) testInvalidRegionsAreRejected {
+    static const struct {
+        debayer_algorithm_t algo;
+        size_t x, y, w, h;
+    } invalid[] = {
+        {kBayerAlgorithmBilinear, 0, 0, 0, 10},
+        {kBayerAlgorithmBilinear, 0, 0, 10, 0},
+        {kBayerAlgorithmLMMSE, 201, 0, 4, 10},
+        {kBayerAlgorithmLMMSE, 0, 60, 10, 5},
+        {kBayerAlgorithmLMMSE, kImageWidth, 0, 1, 1},
+        {kBayerAlgorithmHalfSize, 1, 0, 10, 10},
+        {kBayerAlgorithmHalfSize, 0, 3, 10, 10},
+        {kBayerAlgorithmQuarterSize, 2, 0, 16, 16},
+        {kBayerAlgorithmQuarterSize, 0, 0, 3, 16},
+        {(debayer_algorithm_t) 0, 0, 0, 10, 10},
+    };
+
+    uint16_t *image = TestImageMakeBayer(kImageWidth, kImageHeight, 16383, 0x5EED0312);
+    XCTAssert(image != NULL);
+
+    const size_t stride = kImageWidth * 4 * sizeof(uint16_t);
+    NSMutableData *out = [NSMutableData dataWithLength:(stride * kImageHeight)];
+
+    for (size_t i = 0; i < (sizeof(invalid) / sizeof(*invalid)); i++) {
+        memset(out.mutableBytes, kCanary, out.length);
+
+        XCTAssertEqual(DebayerRegion(invalid[i].algo, image, kImageWidth, kImageHeight, 0, kWhiteBalance,
+                                     kBlackLevel, invalid[i].x, invalid[i].y, invalid[i].w, invalid[i].h,
+                                     out.mutableBytes, stride), -1, @"region %zu", i);
+        [self checkPaddingOf:out lines:kImageHeight lineBytes:0 stride:stride
+                        desc:[NSString stringWithFormat:@"region %zu", i]];
+    }
+
+    free(image);
+}
+
+@end
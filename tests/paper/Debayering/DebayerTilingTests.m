@@ -0,0 +1,151 @@
+//
+//  DebayerTilingTests.m
+//  PaperTests
+//
+//  Ensures that debayering an image in pieces, as the band and tile workers
+//  do, gives exactly the same output as interpolating the whole image at once.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "debayer.h"
+
+#import "test_images.h"
+
+/// Number of lines in the test images; this is the largest height that `Debayer` interpolates in place as
+/// a single piece, which makes its output the reference
+static const size_t kImageHeight = 64;
+
+/// White balance and black levels the images are debayered with
+static const double kWhiteBalance[4] = {2.1, 1.0, 1.0, 1.5};
+static const uint16_t kBlackLevel[4] = {512, 510, 509, 515};
+
+@interface DebayerTilingTests : XCTestCase
+
+@end
+
+@implementation DebayerTilingTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Debayers the entire image in one piece.
+ *
+ * @return Interpolated image, 4 components per pixel
+ */
+- (NSMutableData *) debayerWhole:(const uint16_t *) image width:(size_t) width
+                       algorithm:(debayer_algorithm_t) algo vShift:(size_t) vShift {
+    NSMutableData *out = [NSMutableData dataWithLength:(width * kImageHeight * 4 * sizeof(uint16_t))];
+
+    XCTAssertEqual(Debayer(algo, image, out.mutableBytes, width, kImageHeight, vShift, kWhiteBalance,
+                           kBlackLevel), 0);
+    return out;
+}
+
+/**
+ * Debayers a region of the image, and compares it against the same area of the reference.
+ *
+ * Only the color components are compared: the whole image is interpolated in place, which leaves its
+ * fourth component undefined.
+ */
+- (void) compareRegionX:(size_t) x y:(size_t) y width:(size_t) w height:(size_t) h
+                ofImage:(const uint16_t *) image width:(size_t) width algorithm:(debayer_algorithm_t) algo
+                 vShift:(size_t) vShift reference:(NSData *) reference {
+    NSString *desc = [NSString stringWithFormat:@"algorithm %d, vShift %zu, region (%zu, %zu) %zux%zu",
+                      algo, vShift, x, y, w, h];
+
+    NSMutableData *out = [NSMutableData dataWithLength:(w * h * 4 * sizeof(uint16_t))];
+    XCTAssertEqual(DebayerRegion(algo, image, width, kImageHeight, vShift, kWhiteBalance, kBlackLevel,
+                                 x, y, w, h, out.mutableBytes, w * 4 * sizeof(uint16_t)), 0, @"%@", desc);
+
+    const uint16_t *ref = reference.bytes;
+    const uint16_t *px = out.bytes;
+
+    for (size_t line = 0; line < h; line++) {
+        for (size_t col = 0; col < w; col++) {
+            const uint16_t *expected = ref + ((((y + line) * width) + (x + col)) * 4);
+            const uint16_t *actual = px + (((line * w) + col) * 4);
+
+            if (memcmp(expected, actual, 3 * sizeof(uint16_t)) != 0) {
+                XCTFail(@"%@: pixel (%zu, %zu) is (%u, %u, %u), expected (%u, %u, %u)", desc, x + col,
+                        y + line, actual[0], actual[1], actual[2], expected[0], expected[1], expected[2]);
+                return;
+            }
+        }
+    }
+}
+
+// MARK: - Bands
+/**
+ * Debayers the image in horizontal bands of various heights, ensuring that the halo of context lines around
+ * each band is enough for it to come out the same as in the whole image. This is how `Debayer` splits up
+ * larger images between cores.
+ */
+- (void) testBandsMatchWholeImage {
+    static const debayer_algorithm_t algos[] = {
+        kBayerAlgorithmBilinear, kBayerAlgorithmLMMSE, kBayerAlgorithmLMMSEMedian,
+    };
+    static const size_t bandLines[] = {2, 6, 16, 30};
+
+    const size_t width = 160;
+    uint16_t *image = TestImageMakeBayer(width, kImageHeight, 16383, 0x5EED0006);
+    XCTAssert(image != NULL);
+
+    for (size_t a = 0; a < (sizeof(algos) / sizeof(*algos)); a++) {
+        for (size_t vShift = 0; vShift < 2; vShift++) {
+            NSData *ref = [self debayerWhole:image width:width algorithm:algos[a] vShift:vShift];
+
+            for (size_t b = 0; b < (sizeof(bandLines) / sizeof(*bandLines)); b++) {
+                for (size_t y = 0; y < kImageHeight; y += bandLines[b]) {
+                    [self compareRegionX:0 y:y width:width height:MIN(bandLines[b], kImageHeight - y)
+                                 ofImage:image width:width algorithm:algos[a] vShift:vShift reference:ref];
+                }
+            }
+        }
+    }
+
+    free(image);
+}
+
+// MARK: - Tiles
+/**
+ * Interpolates an image wider than two LMMSE tiles in one piece, so that it's split into tiles across its
+ * width, and compares it against narrow strips of it. The strips are small enough, with their context,
+ * to each fit in a single tile, so none of their pixels are near a tile edge.
+ */
+- (void) testLMMSETilesMatchUntiledStrips {
+    static const debayer_algorithm_t algos[] = {
+        kBayerAlgorithmLMMSE, kBayerAlgorithmLMMSEMedian,
+    };
+    static const size_t stripCols[] = {100, 37};
+
+    const size_t width = 600;
+    uint16_t *image = TestImageMakeBayer(width, kImageHeight, 16383, 0x5EED0007);
+    XCTAssert(image != NULL);
+
+    for (size_t a = 0; a < (sizeof(algos) / sizeof(*algos)); a++) {
+        for (size_t vShift = 0; vShift < 2; vShift++) {
+            NSData *ref = [self debayerWhole:image width:width algorithm:algos[a] vShift:vShift];
+
+            for (size_t s = 0; s < (sizeof(stripCols) / sizeof(*stripCols)); s++) {
+                for (size_t x = 0; x < width; x += stripCols[s]) {
+                    [self compareRegionX:x y:0 width:MIN(stripCols[s], width - x) height:kImageHeight
+                                 ofImage:image width:width algorithm:algos[a] vShift:vShift reference:ref];
+                }
+            }
+        }
+    }
+
+    free(image);
+}
+
+@end
@@ -0,0 +1,222 @@
+//
+//  MedianFilterTests.m
+//  PaperTests
+//
+//  Checks the vectorized 3x3 median filter against the scalar exchange network
+//  that the LMMSE refinement used before it, for every kind of line width.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "median.h"
+
+#import "test_images.h"
+
+/// Line widths that are filtered: too narrow for a neighbourhood, narrower than a vector, and ones that
+/// leave every possible number of values for the scalar tail
+static const size_t kWidths[] = {
+    1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 13, 64, 65, 66, 67, 131,
+};
+
+/// Number of extra values at the end of each input and output line
+static const size_t kPadding = 5;
+
+/// Value that the padding of output lines is filled with
+static const float kCanary = -12345.f;
+
+@interface MedianFilterTests : XCTestCase
+
+@end
+
+@implementation MedianFilterTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Creates a plane of values with the given stride. Quantized planes have only a few distinct values, so
+ * most neighbourhoods contain ties; otherwise, the values are spread over a wide range. Both contain
+ * negative values, as the color differences that are filtered do.
+ */
+static float *MakePlane(size_t width, size_t lines, size_t stride, bool quantized, uint32_t seed) {
+    uint16_t *values = TestImageMakeBayer(width, lines, 16383, seed);
+    float *plane = calloc(stride * lines, sizeof(float));
+
+    if (!values || !plane) {
+        free(values);
+        free(plane);
+        return NULL;
+    }
+
+    for (size_t y = 0; y < lines; y++) {
+        for (size_t x = 0; x < width; x++) {
+            const uint16_t v = values[(y * width) + x];
+            plane[(y * stride) + x] = quantized ? (((int) (v & 7) - 4) * 0.25f) : ((v - 8192.f) / 1000.f);
+        }
+    }
+
+    free(values);
+    return plane;
+}
+
+/**
+ * Gets the median of a neighbourhood with the exchange network of the old LMMSE refinement.
+ */
+static float ReferenceMedian(const float *above, const float *line, const float *below) {
+    float p1 = above[-1], p2 = above[0], p3 = above[1];
+    float p4 = line[-1], p5 = line[0], p6 = line[1];
+    float p7 = below[-1], p8 = below[0], p9 = below[1];
+    float temp;
+
+#define PIX_SORT(a,b) { if ((a)>(b)) {temp=(a);(a)=(b);(b)=temp;} }
+    PIX_SORT(p2,p3); PIX_SORT(p5,p6); PIX_SORT(p8,p9);
+    PIX_SORT(p1,p2); PIX_SORT(p4,p5); PIX_SORT(p7,p8);
+    PIX_SORT(p2,p3); PIX_SORT(p5,p6); PIX_SORT(p8,p9);
+    PIX_SORT(p1,p4); PIX_SORT(p6,p9); PIX_SORT(p5,p8);
+    PIX_SORT(p4,p7); PIX_SORT(p2,p5); PIX_SORT(p3,p6);
+    PIX_SORT(p5,p8); PIX_SORT(p5,p3); PIX_SORT(p7,p5);
+    PIX_SORT(p5,p3);
+#undef PIX_SORT
+
+    return p5;
+}
+
+/**
+ * Filters a plane the way the old code did: every value with a full neighbourhood is replaced by its
+ * median, and the first and last columns are copied.
+ */
+static void ReferenceFilter(const float *in, size_t inStride, float *out, size_t outStride, size_t width,
+                            size_t lines) {
+    for (size_t line = 0; line < lines; line++) {
+        const float *middle = in + ((line + 1) * inStride);
+        float *dst = out + (line * outStride);
+
+        for (size_t col = 0; col < width; col++) {
+            if (col == 0 || col == (width - 1)) {
+                dst[col] = middle[col];
+            } else {
+                dst[col] = ReferenceMedian(middle + col - inStride, middle + col, middle + col + inStride);
+            }
+        }
+    }
+}
+
+/**
+ * Filters a plane of the given size, and compares it to the reference. The padding at the end of output
+ * lines must not be written.
+ */
+- (void) compareWidth:(size_t) width lines:(size_t) lines quantized:(bool) quantized seed:(uint32_t) seed {
+    NSString *desc = [NSString stringWithFormat:@"%zux%zu, %s", width, lines,
+                      quantized ? "quantized" : "continuous"];
+
+    const size_t inStride = width + kPadding, outStride = width + kPadding;
+
+    float *in = MakePlane(width, lines + 2, inStride, quantized, seed);
+    float *out = malloc(outStride * lines * sizeof(float));
+    float *expected = malloc(outStride * lines * sizeof(float));
+    XCTAssert(in && out && expected, @"%@", desc);
+
+    for (size_t i = 0; i < (outStride * lines); i++) {
+        out[i] = kCanary;
+    }
+
+    MedianFilter3x3(in, inStride, out, outStride, width, lines);
+    ReferenceFilter(in, inStride, expected, outStride, width, lines);
+
+    for (size_t line = 0; line < lines; line++) {
+        const float *row = out + (line * outStride);
+        const float *ref = expected + (line * outStride);
+
+        for (size_t col = 0; col < width; col++) {
+            if (memcmp(&row[col], &ref[col], sizeof(float)) != 0) {
+                XCTFail(@"%@: value (%zu, %zu) is %f, expected %f", desc, col, line, row[col], ref[col]);
+                free(expected);
+                free(out);
+                free(in);
+                return;
+            }
+        }
+
+        for (size_t col = width; col < outStride; col++) {
+            XCTAssertEqual(row[col], kCanary, @"%@: padding of line %zu", desc, line);
+        }
+    }
+
+    free(expected);
+    free(out);
+    free(in);
+}
+
+// MARK: - Tests
+/**
+ * Filters planes of every width with values that are mostly ties; the vectorized network must pick the
+ * same value as the scalar one.
+ */
+- (void) testQuantizedValuesMatchReference {
+    for (size_t w = 0; w < (sizeof(kWidths) / sizeof(*kWidths)); w++) {
+        [self compareWidth:kWidths[w] lines:7 quantized:true seed:(0x5EED0022 + (uint32_t) w)];
+    }
+}
+
+/**
+ * Filters planes of every width with values spread over a wide range.
+ */
+- (void) testContinuousValuesMatchReference {
+    for (size_t w = 0; w < (sizeof(kWidths) / sizeof(*kWidths)); w++) {
+        [self compareWidth:kWidths[w] lines:7 quantized:false seed:(0x5EED0122 + (uint32_t) w)];
+    }
+}
+
+/**
+ * Filters a single output line, which still reads one line above and below it.
+ */
+- (void) testSingleLine {
+    [self compareWidth:67 lines:1 quantized:true seed:0x5EED0222];
+    [self compareWidth:67 lines:1 quantized:false seed:0x5EED0322];
+}
+
+/**
+ * Filters a plane in bands of different heights, each reading the lines around it from the same input, as
+ * the parallel post-interpolation filter does. The result must be the same as filtering it in one go.
+ */
+- (void) testBandsMatchSinglePass {
+    static const size_t kLines = 61;
+    static const size_t bandLines[] = {1, 2, 7, 16, 60};
+
+    const size_t width = 131, stride = width + kPadding;
+
+    float *in = MakePlane(width, kLines + 2, stride, false, 0x5EED0422);
+    float *whole = malloc(stride * kLines * sizeof(float));
+    float *banded = malloc(stride * kLines * sizeof(float));
+    XCTAssert(in && whole && banded);
+
+    MedianFilter3x3(in, stride, whole, stride, width, kLines);
+
+    for (size_t b = 0; b < (sizeof(bandLines) / sizeof(*bandLines)); b++) {
+        memset(banded, 0, stride * kLines * sizeof(float));
+
+        for (size_t line = 0; line < kLines; line += bandLines[b]) {
+            const size_t lines = MIN(bandLines[b], kLines - line);
+            MedianFilter3x3(in + (line * stride), stride, banded + (line * stride), stride, width, lines);
+        }
+
+        for (size_t line = 0; line < kLines; line++) {
+            XCTAssertEqual(memcmp(whole + (line * stride), banded + (line * stride), width * sizeof(float)), 0,
+                           @"bands of %zu lines: line %zu", bandLines[b], line);
+        }
+    }
+
+    free(banded);
+    free(whole);
+    free(in);
+}
+
+@end
@@ -0,0 +1,158 @@
+//
+//  WBScaleTests.m
+//  PaperTests
+//
+//  Compares the vectorized white balance kernels against the per value
+//  definition of the scaling, for lengths that leave a tail for the scalar
+//  path and for values below the black level or saturating when scaled.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "wb_scale.h"
+
+#import "test_images.h"
+
+/// Black levels and scale factors of each component; the largest factor saturates most values
+static const uint16_t kBlackLevel[4] = {512, 510, 509, 515};
+static const float kWhiteBalance[4] = {2.1f, 1.0f, 1.0f, 4.5f};
+
+/// Values around the edges of the scaling, written over the start of the random data
+static const uint16_t kEdgeValues[] = {0, 1, 508, 509, 510, 511, 512, 513, 516, 15000, 31000, 65534, 65535};
+
+@interface WBScaleTests : XCTestCase
+
+@end
+
+@implementation WBScaleTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Scales a single value: the black level is subtracted, clamping at zero, then it's multiplied by the factor,
+ * truncated and clamped to 16 bits.
+ */
+static uint16_t ScaleReference(uint16_t value, uint16_t black, float mul) {
+    const float scaled = (float) ((value > black) ? (value - black) : 0) * mul;
+    return (scaled < 65535.f) ? (uint16_t) scaled : 65535;
+}
+
+/**
+ * Creates random values over the full 16-bit range, starting with the edge values.
+ */
+static uint16_t *MakeValues(size_t count, uint32_t seed) {
+    uint16_t *values = TestImageMakeBayer(count, 1, 65535, seed);
+
+    if (values) {
+        const size_t edges = sizeof(kEdgeValues) / sizeof(*kEdgeValues);
+        for (size_t i = 0; i < count && i < (edges * 4); i++) {
+            values[i] = kEdgeValues[i % edges];
+        }
+    }
+
+    return values;
+}
+
+// MARK: - Tests
+/**
+ * Expands lines of every width up to several vectors into both halves of the output pixels. The components
+ * that aren't written must be cleared, and nothing past the end of the line may be touched.
+ */
+- (void) testBayerLineMatchesReference {
+    static const uint16_t kCanary = 0xA5A5;
+
+    for (size_t width = 1; width <= 70; width++) {
+        for (size_t color = 0; color <= 2; color += 2) {
+            NSString *desc = [NSString stringWithFormat:@"width %zu, color %zu", width, color];
+
+            uint16_t *in = MakeValues(width, 0x5EED0010 + (uint32_t) width);
+            XCTAssert(in != NULL, @"%@", desc);
+
+            NSMutableData *outData = [NSMutableData dataWithLength:((width + 1) * 4 * sizeof(uint16_t))];
+            uint16_t *out = outData.mutableBytes;
+            for (size_t i = 0; i < (width + 1) * 4; i++) {
+                out[i] = kCanary;
+            }
+
+            const uint16_t black[2] = {kBlackLevel[color], kBlackLevel[color + 1]};
+            const float mul[2] = {kWhiteBalance[color], kWhiteBalance[color + 1]};
+
+            WBScaleBayerLine(in, out, width, color, black, mul);
+
+            for (size_t col = 0; col < width; col++) {
+                for (size_t c = 0; c < 4; c++) {
+                    const uint16_t expected = (c == color + (col & 1)) ?
+                        ScaleReference(in[col], black[col & 1], mul[col & 1]) : 0;
+
+                    if (out[(col * 4) + c] != expected) {
+                        XCTFail(@"%@: component %zu of column %zu (input %u) is %u, expected %u", desc, c, col,
+                                in[col], out[(col * 4) + c], expected);
+                        free(in);
+                        return;
+                    }
+                }
+            }
+
+            for (size_t c = 0; c < 4; c++) {
+                XCTAssertEqual(out[(width * 4) + c], kCanary, @"%@: wrote past the end of the line", desc);
+            }
+
+            free(in);
+        }
+    }
+}
+
+/**
+ * Scales interleaved pixels in place, both with and without scale factors, for counts that cover the vector
+ * loop and the scalar tail. The returned maximum must cover the values of both.
+ */
+- (void) testInterleavedMatchesReference {
+    for (size_t pixels = 0; pixels <= 40; pixels++) {
+        for (int useMul = 0; useMul < 2; useMul++) {
+            NSString *desc = [NSString stringWithFormat:@"%zu pixels, %@", pixels,
+                              useMul ? @"scaled" : @"unscaled"];
+
+            // one extra pixel past the end, which must be left alone
+            uint16_t *values = MakeValues((pixels + 1) * 4, 0x5EED0110 + (uint32_t) pixels);
+            XCTAssert(values != NULL, @"%@", desc);
+
+            NSData *original = [NSData dataWithBytes:values length:((pixels + 1) * 4 * sizeof(uint16_t))];
+            const uint16_t *in = original.bytes;
+
+            const uint16_t max = WBScaleInterleaved((uint16_t (*)[4]) values, pixels, kBlackLevel,
+                                                    useMul ? kWhiteBalance : NULL);
+
+            uint16_t expectedMax = 0;
+
+            for (size_t i = 0; i < (pixels * 4); i++) {
+                const uint16_t expected = ScaleReference(in[i], kBlackLevel[i % 4],
+                                                         useMul ? kWhiteBalance[i % 4] : 1.f);
+                expectedMax = MAX(expectedMax, expected);
+
+                if (values[i] != expected) {
+                    XCTFail(@"%@: component %zu of pixel %zu (input %u) is %u, expected %u", desc, i % 4, i / 4,
+                            in[i], values[i], expected);
+                    free(values);
+                    return;
+                }
+            }
+
+            XCTAssertEqual(max, expectedMax, @"%@", desc);
+            XCTAssertEqual(memcmp(values + (pixels * 4), in + (pixels * 4), 4 * sizeof(uint16_t)), 0,
+                           @"%@: wrote past the end of the image", desc);
+
+            free(values);
+        }
+    }
+}
+
+@end
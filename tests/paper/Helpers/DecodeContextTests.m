@@ -0,0 +1,224 @@
+//
+//  DecodeContextTests.m
+//  PaperTests
+//
+//  Ensures that buffers handed out by a decode context go back into its pool
+//  under the size they were allocated with, including output planes that were
+//  trimmed after decoding, and that trimmed images can be moved out of them.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "PAPDecodeContext.h"
+#import "CJPEGDecompressor.h"
+#import "CR2Unslicer.h"
+
+#import "test_images.h"
+
+/// Size of the sensor; two components per sample, in three slices
+static const size_t kSensorWidth = 300;
+static const size_t kSensorHeight = 200;
+static const size_t kBorders[4] = {13, 297, 197, 41};
+
+@interface DecodeContextTests : XCTestCase
+
+@end
+
+@implementation DecodeContextTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Checks that the idle buffers of the context hold a single buffer whose size class fits the given length.
+ */
+- (void) assertContext:(PAPDecodeContext *) context holdsBufferOfLength:(NSUInteger) length {
+    const NSUInteger idle = context.idleBytes;
+
+    XCTAssertGreaterThanOrEqual(idle, length, @"buffer filed under a smaller class");
+    XCTAssertLessThanOrEqual(idle, length + (length / 8) + 4096, @"buffer filed under a larger class");
+}
+
+/**
+ * Creates a decompressor with an unsliced output plane from the context, and fills the plane with the sensor.
+ */
+- (CJPEGDecompressor *) decompressorWithContext:(PAPDecodeContext *) context sensor:(const uint16_t *) sensor {
+    CJPEGDecompressor *dec = [[CJPEGDecompressor alloc] initWithCols:(kSensorWidth / 2) rows:kSensorHeight
+                                                           precision:14 numPlanes:2 context:context];
+    [dec setUnslicedOutputWithSlicingInfo:@[@2, @100, @100]];
+
+    XCTAssertEqual(dec.output.length, (NSUInteger) (kSensorWidth * kSensorHeight * sizeof(uint16_t)));
+    memcpy(dec.output.mutableBytes, sensor, dec.output.length);
+
+    return dec;
+}
+
+/**
+ * Creates an unslicer for the decompressor's plane, and collects the statistics of the sensor.
+ */
+- (CR2Unslicer *) unslicerWithInput:(CJPEGDecompressor *) dec trim:(BOOL) trim {
+    CR2Unslicer *unslicer = [[CR2Unslicer alloc] initWithInput:dec andOutput:dec.output
+                                                   slicingInfo:@[@2, @100, @100]
+                                                    sensorSize:CGSizeMake(kSensorWidth, kSensorHeight)];
+    XCTAssertEqual(unslicer.trimmedLength, dec.output.length);
+
+    NSArray<NSNumber *> *borders = @[@(kBorders[0]), @(kBorders[1]), @(kBorders[2]), @(kBorders[3])];
+    [unslicer collectStatsWithBorders:borders trim:trim];
+
+    return unslicer;
+}
+
+/**
+ * Checks that the start of the buffer holds the visible area of the sensor.
+ */
+- (void) assertTrimmed:(NSData *) buffer matchesSensor:(const uint16_t *) sensor {
+    const size_t visibleWidth = (kBorders[1] - kBorders[3]) + 1;
+    const size_t visibleHeight = (kBorders[2] - kBorders[0]) + 1;
+
+    XCTAssertGreaterThanOrEqual(buffer.length, (NSUInteger) (visibleWidth * visibleHeight * sizeof(uint16_t)));
+    const uint16_t *trimmed = buffer.bytes;
+
+    for (size_t y = 0; y < visibleHeight; y++) {
+        const uint16_t *expected = sensor + ((y + kBorders[0]) * kSensorWidth) + kBorders[3];
+
+        if (memcmp(trimmed + (y * visibleWidth), expected, visibleWidth * sizeof(uint16_t)) != 0) {
+            XCTFail(@"line %zu of the trimmed image differs", y);
+            return;
+        }
+    }
+}
+
+// MARK: - Tests
+/**
+ * Returns a buffer to the pool, then requests one of the same length; it must be taken from the pool.
+ */
+- (void) testBufferIsReused {
+    static const NSUInteger kLength = 3 * 1024 * 1024 + 17;
+
+    PAPDecodeContext *context = [[PAPDecodeContext alloc] initWithMaxIdleBytes:(64 * 1024 * 1024)];
+    XCTAssertEqual(context.idleBytes, (NSUInteger) 0);
+
+    @autoreleasepool {
+        NSMutableData *buffer = [context bufferWithLength:kLength];
+        XCTAssertNotNil(buffer);
+        XCTAssertEqual(buffer.length, kLength);
+    }
+
+    [self assertContext:context holdsBufferOfLength:kLength];
+
+    @autoreleasepool {
+        NSMutableData *buffer = [context bufferWithLength:kLength];
+        XCTAssertNotNil(buffer);
+        XCTAssertEqual(context.idleBytes, (NSUInteger) 0, @"buffer not taken from the pool");
+    }
+
+    [self assertContext:context holdsBufferOfLength:kLength];
+
+    [context purge];
+    XCTAssertEqual(context.idleBytes, (NSUInteger) 0);
+}
+
+/**
+ * Trims an output plane taken from the context, as the CR2 reader does. The plane must keep its length,
+ * with the image in its first `trimmedLength` bytes, and return to the pool under its original size.
+ */
+- (void) testTrimmedPlaneKeepsSize {
+    const NSUInteger planeBytes = kSensorWidth * kSensorHeight * sizeof(uint16_t);
+    const size_t visibleWidth = (kBorders[1] - kBorders[3]) + 1;
+    const size_t visibleHeight = (kBorders[2] - kBorders[0]) + 1;
+
+    PAPDecodeContext *context = [[PAPDecodeContext alloc] initWithMaxIdleBytes:(64 * 1024 * 1024)];
+
+    uint16_t *sensor = TestImageMakeBayer(kSensorWidth, kSensorHeight, 16383, 0x5EED0017);
+    XCTAssert(sensor != NULL);
+
+    @autoreleasepool {
+        CJPEGDecompressor *dec = [self decompressorWithContext:context sensor:sensor];
+        NSMutableData *plane = dec.output;
+
+        CR2Unslicer *unslicer = [self unslicerWithInput:dec trim:YES];
+
+        XCTAssertEqual(plane.length, planeBytes, @"pooled plane was resized");
+        XCTAssertEqual(unslicer.trimmedLength, (NSUInteger) (visibleWidth * visibleHeight * sizeof(uint16_t)));
+        XCTAssertEqual(unslicer.output, plane);
+
+        [self assertTrimmed:plane matchesSensor:sensor];
+    }
+
+    free(sensor);
+
+    [self assertContext:context holdsBufferOfLength:planeBytes];
+}
+
+/**
+ * Moves a trimmed image out of its plane. The image must be copied into a buffer of the trimmed size from
+ * the same context, and the plane must return to the pool once the decompressor goes away, while the image
+ * is still in use.
+ */
+- (void) testReleaseTrimmedCapacity {
+    const NSUInteger planeBytes = kSensorWidth * kSensorHeight * sizeof(uint16_t);
+
+    PAPDecodeContext *context = [[PAPDecodeContext alloc] initWithMaxIdleBytes:(64 * 1024 * 1024)];
+
+    uint16_t *sensor = TestImageMakeBayer(kSensorWidth, kSensorHeight, 16383, 0x5EED0019);
+    XCTAssert(sensor != NULL);
+
+    NSMutableData *image = nil;
+
+    @autoreleasepool {
+        CJPEGDecompressor *dec = [self decompressorWithContext:context sensor:sensor];
+        NSMutableData *plane = dec.output;
+
+        CR2Unslicer *unslicer = [self unslicerWithInput:dec trim:YES];
+        [unslicer releaseTrimmedCapacity];
+
+        image = unslicer.output;
+        XCTAssertNotEqual(image, plane);
+        XCTAssertEqual(image.length, unslicer.trimmedLength);
+        XCTAssertEqual(plane.length, planeBytes);
+    }
+
+    // only the plane is idle, while the image is still alive
+    [self assertContext:context holdsBufferOfLength:planeBytes];
+    [self assertTrimmed:image matchesSensor:sensor];
+
+    const NSUInteger imageBytes = image.length;
+    image = nil;
+
+    XCTAssertGreaterThanOrEqual(context.idleBytes, planeBytes + imageBytes, @"image not returned to the pool");
+
+    free(sensor);
+}
+
+/**
+ * Leaves an image that wasn't trimmed in its plane, since there's no capacity to release.
+ */
+- (void) testReleaseUntrimmedCapacity {
+    PAPDecodeContext *context = [[PAPDecodeContext alloc] initWithMaxIdleBytes:(64 * 1024 * 1024)];
+
+    uint16_t *sensor = TestImageMakeBayer(kSensorWidth, kSensorHeight, 16383, 0x5EED0119);
+    XCTAssert(sensor != NULL);
+
+    @autoreleasepool {
+        CJPEGDecompressor *dec = [self decompressorWithContext:context sensor:sensor];
+        NSMutableData *plane = dec.output;
+
+        CR2Unslicer *unslicer = [self unslicerWithInput:dec trim:NO];
+        [unslicer releaseTrimmedCapacity];
+
+        XCTAssertEqual(unslicer.output, plane);
+        XCTAssertEqual(memcmp(plane.bytes, sensor, plane.length), 0);
+    }
+
+    free(sensor);
+}
+
+@end
@@ -0,0 +1,229 @@
+//
+//  PixelHistogramTests.m
+//  PaperTests
+//
+//  Checks the histograms counted while pixels are written through a layout
+//  against histograms counted from the written pixels afterwards, including
+//  when an image is debayered in several bands that each count separately.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <math.h>
+
+#import "debayer.h"
+#import "pixel_layout.h"
+
+#import "test_images.h"
+
+/// Size of the test image; it's debayered in several bands
+static const size_t kImageWidth = 160;
+static const size_t kImageHeight = 200;
+
+/// Number of buckets per channel
+static const size_t kBuckets = 256;
+
+/// White balance and black levels the image is debayered with
+static const double kWhiteBalance[4] = {2.1, 1.0, 1.0, 1.5};
+static const uint16_t kBlackLevel[4] = {512, 510, 509, 515};
+
+@interface PixelHistogramTests : XCTestCase
+
+@end
+
+@implementation PixelHistogramTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Gets the bucket a value normalized to [0, 1] goes into.
+ *
+ * @param outAmbiguous Set if the value is close enough to the boundary between two buckets that rounding may
+ * put it in either one; it's left alone otherwise
+ */
+static size_t BucketOf(double t, BOOL *outAmbiguous) {
+    const double position = t * (kBuckets - 1);
+
+    if (outAmbiguous && fabs((position - floor(position)) - 0.5) < 1e-3) {
+        *outAmbiguous = YES;
+    }
+    return (size_t) (position + 0.5);
+}
+
+/**
+ * Counts 16-bit RGB pixels into a histogram over the full 16-bit range, in double precision.
+ *
+ * @param counts Buckets of each channel, as in `pixel_histogram_t`
+ * @return Number of pixels whose luminance may go into either of two buckets
+ */
+static size_t CountReference(const uint16_t *pixels, size_t count, size_t channels, uint32_t *counts) {
+    size_t ambiguous = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const uint16_t *px = pixels + (i * channels);
+        const double r = px[0] / 65535., g = px[1] / 65535., b = px[2] / 65535.;
+
+        // with 256 buckets over 16-bit values, no value is near a boundary
+        counts[BucketOf(r, NULL)]++;
+        counts[kBuckets + BucketOf(g, NULL)]++;
+        counts[(2 * kBuckets) + BucketOf(b, NULL)]++;
+
+        BOOL isAmbiguous = NO;
+        const double y = sqrt((0.299 * r * r) + (0.587 * g * g) + (0.114 * b * b));
+        counts[(3 * kBuckets) + BucketOf(y, &isAmbiguous)]++;
+
+        if (isAmbiguous) {
+            ambiguous++;
+        }
+    }
+
+    return ambiguous;
+}
+
+/**
+ * Compares a histogram against the reference. The color channels must be identical; buckets of the luminance
+ * channel may only differ by the number of ambiguous pixels, and must hold the same total.
+ */
+- (void) compareHistogram:(const uint32_t *) counts withReference:(const uint32_t *) expected
+                ambiguous:(size_t) ambiguous desc:(NSString *) desc {
+    static NSString * const kChannels[4] = {@"red", @"green", @"blue", @"luminance"};
+
+    for (size_t c = 0; c < 4; c++) {
+        uint64_t total = 0, expectedTotal = 0;
+
+        for (size_t i = 0; i < kBuckets; i++) {
+            const uint32_t actual = counts[(c * kBuckets) + i], want = expected[(c * kBuckets) + i];
+            const size_t slack = (c == 3) ? ambiguous : 0;
+
+            if ((actual > want ? actual - want : want - actual) > slack) {
+                XCTFail(@"%@: %@ bucket %zu holds %u, expected %u", desc, kChannels[c], i, actual, want);
+                return;
+            }
+
+            total += actual;
+            expectedTotal += want;
+        }
+
+        XCTAssertEqual(total, expectedTotal, @"%@: %@ total", desc, kChannels[c]);
+    }
+}
+
+// MARK: - Tests
+/**
+ * Debayers the whole image through a layout with a histogram, in both component orders. The bands each count
+ * into their own histogram, which must add up to the histogram of the output.
+ */
+- (void) testDebayeredHistogramMatchesOutput {
+    static const pixel_channel_order_t orders[] = {kPixelChannelOrderRGB, kPixelChannelOrderBGR};
+
+    uint16_t *image = TestImageMakeBayer(kImageWidth, kImageHeight, 16383, 0x5EED0025);
+    XCTAssert(image != NULL);
+
+    const size_t pixels = kImageWidth * kImageHeight;
+
+    for (size_t o = 0; o < (sizeof(orders) / sizeof(*orders)); o++) {
+        NSString *desc = (orders[o] == kPixelChannelOrderRGB) ? @"RGB" : @"BGR";
+
+        NSMutableData *out = [NSMutableData dataWithLength:(pixels * 4 * sizeof(uint16_t))];
+        NSMutableData *countData = [NSMutableData dataWithLength:(4 * kBuckets * sizeof(uint32_t))];
+
+        pixel_histogram_t histogram = {
+            .buckets = kBuckets, .min = 0.f, .max = 65535.f, .counts = countData.mutableBytes,
+        };
+        const pixel_layout_t layout = {
+            .format = kPixelFormatU16, .channels = 4, .order = orders[o],
+            .base = out.mutableBytes, .stride = kImageWidth * 4 * sizeof(uint16_t), .histogram = &histogram,
+        };
+
+        XCTAssertEqual(DebayerRegionToLayout(kBayerAlgorithmLMMSE, image, kImageWidth, kImageHeight, 0,
+                                             kWhiteBalance, kBlackLevel, NULL, 1.f, 0, 0, kImageWidth,
+                                             kImageHeight, &layout), 0, @"%@", desc);
+
+        // put the output back into RGB order, which the histogram is always in
+        uint16_t *px = out.mutableBytes;
+        if (orders[o] == kPixelChannelOrderBGR) {
+            for (size_t i = 0; i < pixels; i++) {
+                const uint16_t temp = px[(i * 4) + 0];
+                px[(i * 4) + 0] = px[(i * 4) + 2];
+                px[(i * 4) + 2] = temp;
+            }
+        }
+
+        NSMutableData *expected = [NSMutableData dataWithLength:(4 * kBuckets * sizeof(uint32_t))];
+        const size_t ambiguous = CountReference(px, pixels, 4, expected.mutableBytes);
+
+        [self compareHistogram:histogram.counts withReference:expected.bytes ambiguous:ambiguous desc:desc];
+    }
+
+    free(image);
+}
+
+/**
+ * Writes pixels outside the histogram's range; they must be clamped into its first and last buckets.
+ */
+- (void) testOutOfRangeValuesAreClamped {
+    static const uint16_t in[][3] = {
+        {0, 100, 16383},
+        {49152, 65535, 60000},
+        {16384, 49151, 32768},
+    };
+    uint16_t out[sizeof(in) / sizeof(uint16_t)];
+    uint32_t counts[4 * 16] = {0};
+
+    pixel_histogram_t histogram = {
+        .buckets = 16, .min = 16384.f, .max = 49151.f, .counts = counts,
+    };
+    const pixel_layout_t layout = {
+        .format = kPixelFormatU16, .channels = 3, .order = kPixelChannelOrderRGB,
+        .base = out, .stride = sizeof(out), .histogram = &histogram,
+    };
+
+    PixelLayoutWriteRow(&layout, 0, 0, &in[0][0], 3, sizeof(in) / sizeof(*in), NULL);
+
+    // red: first, last, first; green: first, last, last; blue: first, last, middle
+    XCTAssertEqual(counts[0], (uint32_t) 2);
+    XCTAssertEqual(counts[15], (uint32_t) 1);
+    XCTAssertEqual(counts[16 + 0], (uint32_t) 1);
+    XCTAssertEqual(counts[16 + 15], (uint32_t) 2);
+    XCTAssertEqual(counts[32 + 0], (uint32_t) 1);
+    XCTAssertEqual(counts[32 + 15], (uint32_t) 1);
+    XCTAssertEqual(counts[32 + 8], (uint32_t) 1);
+
+    // the first pixel is entirely below the range, the second entirely above it
+    XCTAssertEqual(counts[48 + 0], (uint32_t) 1);
+    XCTAssertEqual(counts[48 + 15], (uint32_t) 1);
+}
+
+/**
+ * Merges histograms into one that already holds counts; every bucket must be the sum.
+ */
+- (void) testMergeAddsCounts {
+    NSMutableData *aData = [NSMutableData dataWithLength:(4 * kBuckets * sizeof(uint32_t))];
+    NSMutableData *bData = [NSMutableData dataWithLength:(4 * kBuckets * sizeof(uint32_t))];
+    NSMutableData *sumData = [NSMutableData dataWithLength:(4 * kBuckets * sizeof(uint32_t))];
+
+    uint32_t *a = aData.mutableBytes, *b = bData.mutableBytes, *sum = sumData.mutableBytes;
+
+    for (size_t i = 0; i < (4 * kBuckets); i++) {
+        a[i] = (uint32_t) (i * 7);
+        b[i] = (i % 3) ? (uint32_t) (i + 1) : 0;
+        sum[i] = a[i] + b[i];
+    }
+
+    pixel_histogram_t into = {.buckets = kBuckets, .min = 0.f, .max = 1.f, .counts = a};
+    const pixel_histogram_t from = {.buckets = kBuckets, .min = 0.f, .max = 1.f, .counts = b};
+
+    PixelHistogramMerge(&into, &from);
+    XCTAssertEqualObjects(aData, sumData);
+}
+
+@end
@@ -0,0 +1,277 @@
+//
+//  PyramidTests.m
+//  PaperTests
+//
+//  Checks the reduced levels of image pyramids against averages of the level
+//  above them, and that building an image in bands, in any order, gives the
+//  same levels as building it all at once.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import <math.h>
+
+#import "pyramid.h"
+
+#import "test_images.h"
+
+/// Size of the full size image; both are odd, so every level drops a column and line somewhere
+static const size_t kImageWidth = 203;
+static const size_t kImageHeight = 157;
+
+/// Pixels of padding at the end of each line of the full size image
+static const size_t kLinePadding = 5;
+
+@interface PyramidTests : XCTestCase
+
+@end
+
+@implementation PyramidTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Creates a full size image with four components per pixel in the given format, with values between 0 and 1.
+ *
+ * @param outLayout Layout of the image; its base is the returned buffer, which must be freed
+ */
+static void *MakeImage(pixel_format_t format, uint32_t seed, pixel_layout_t *outLayout) {
+    const size_t valuesPerLine = (kImageWidth + kLinePadding) * 4;
+    uint16_t *random = TestImageMakeBayer(valuesPerLine, kImageHeight, 65535, seed);
+    if (!random) return NULL;
+
+    const size_t count = valuesPerLine * kImageHeight;
+    void *image = malloc(count * ((format == kPixelFormatF32) ? sizeof(float) : sizeof(__fp16)));
+
+    for (size_t i = 0; image && i < count; i++) {
+        const float value = random[i] / 65535.f;
+
+        if (format == kPixelFormatF32) {
+            ((float *) image)[i] = value;
+        } else {
+            ((__fp16 *) image)[i] = (__fp16) value;
+        }
+    }
+
+    free(random);
+
+    *outLayout = (pixel_layout_t) {
+        .format = format,
+        .channels = 4,
+        .order = kPixelChannelOrderRGB,
+        .base = image,
+        .stride = valuesPerLine * ((format == kPixelFormatF32) ? sizeof(float) : sizeof(__fp16)),
+    };
+    return image;
+}
+
+/**
+ * Reads a component of a pixel of an image.
+ */
+static double ReadComponent(const pixel_layout_t *layout, size_t x, size_t y, size_t c) {
+    const uint8_t *line = ((const uint8_t *) layout->base) + (y * layout->stride);
+
+    if (layout->format == kPixelFormatF32) {
+        return ((const float *) line)[(x * 4) + c];
+    } else {
+        return ((const __fp16 *) line)[(x * 4) + c];
+    }
+}
+
+/**
+ * Compares every level against the average of each 2x2 block of the level above it (or the full size image,
+ * for the first level.) Each level may only differ from the averages by rounding to its format.
+ */
+- (void) compareLevelsOf:(const image_pyramid_t *) pyramid withImage:(const pixel_layout_t *) src
+                    name:(NSString *) name {
+    const double epsilon = (src->format == kPixelFormatF32) ? (4. / (1 << 24)) : (1. / 1024);
+
+    pixel_layout_t above = *src;
+    size_t aboveWidth = kImageWidth, aboveHeight = kImageHeight;
+
+    for (size_t level = 1; level <= PyramidNumLevels(pyramid); level++) {
+        pixel_layout_t layout;
+        size_t width = 0, height = 0;
+
+        XCTAssertEqual(PyramidGetLevel(pyramid, level, &layout, &width, &height), 0, @"%@", name);
+        XCTAssertEqual(width, aboveWidth / 2, @"%@: width of level %zu", name, level);
+        XCTAssertEqual(height, aboveHeight / 2, @"%@: height of level %zu", name, level);
+        XCTAssertEqual(layout.format, src->format, @"%@", name);
+        XCTAssertEqual(layout.channels, (size_t) 4, @"%@", name);
+
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 0; x < width; x++) {
+                for (size_t c = 0; c < 4; c++) {
+                    const double expected = (ReadComponent(&above, (x * 2), (y * 2), c) +
+                                             ReadComponent(&above, (x * 2) + 1, (y * 2), c) +
+                                             ReadComponent(&above, (x * 2), (y * 2) + 1, c) +
+                                             ReadComponent(&above, (x * 2) + 1, (y * 2) + 1, c)) / 4;
+                    const double actual = ReadComponent(&layout, x, y, c);
+
+                    // the smallest half float subnormal is about 6e-8
+                    if (fabs(actual - expected) > ((expected * epsilon) + 6e-8)) {
+                        XCTFail(@"%@: component %zu of pixel (%zu, %zu) of level %zu is %g, expected %g", name,
+                                c, x, y, level, actual, expected);
+                        return;
+                    }
+                }
+            }
+        }
+
+        above = layout;
+        aboveWidth = width;
+        aboveHeight = height;
+    }
+}
+
+/**
+ * Copies all levels of the pyramid into a single buffer.
+ */
+static NSData *CopyLevels(const image_pyramid_t *pyramid) {
+    NSMutableData *data = [NSMutableData new];
+
+    for (size_t level = 1; level <= PyramidNumLevels(pyramid); level++) {
+        pixel_layout_t layout;
+        size_t width = 0, height = 0;
+        PyramidGetLevel(pyramid, level, &layout, &width, &height);
+
+        for (size_t y = 0; y < height; y++) {
+            [data appendBytes:(((const uint8_t *) layout.base) + (y * layout.stride))
+                       length:(width * PixelLayoutBytesPerPixel(&layout))];
+        }
+    }
+
+    return data;
+}
+
+// MARK: - Setup
+/**
+ * Requests more levels than the image has; they're clamped to those at least a pixel in size, and only those
+ * can be described.
+ */
+- (void) testLevelsAreClamped {
+    image_pyramid_t *pyramid = PyramidNew(kPixelFormatF32, kImageWidth, kImageHeight, kPyramidMaxLevels);
+    XCTAssert(pyramid != NULL);
+
+    // 157 lines have 7 halvings to a single line
+    XCTAssertEqual(PyramidNumLevels(pyramid), (size_t) 7);
+    XCTAssertEqual(PyramidLineAlignment(pyramid), (size_t) 128);
+
+    size_t width = 0, height = 0;
+    XCTAssertEqual(PyramidGetLevel(pyramid, 7, NULL, &width, &height), 0);
+    XCTAssertEqual(width, (size_t) 1);
+    XCTAssertEqual(height, (size_t) 1);
+
+    XCTAssertEqual(PyramidGetLevel(pyramid, 0, NULL, NULL, NULL), -1);
+    XCTAssertEqual(PyramidGetLevel(pyramid, 8, NULL, NULL, NULL), -1);
+
+    PyramidRelease(pyramid);
+
+    // no levels of an image that's a single line
+    XCTAssert(PyramidNew(kPixelFormatF32, kImageWidth, 1, 4) == NULL);
+    XCTAssert(PyramidNew(kPixelFormatU16, kImageWidth, kImageHeight, 4) == NULL);
+}
+
+// MARK: - Building
+/**
+ * Builds all levels of single precision and half float images, and compares them against the averages.
+ */
+- (void) testLevelsAreAverages {
+    static const pixel_format_t formats[] = {kPixelFormatF32, kPixelFormatF16};
+
+    for (size_t f = 0; f < (sizeof(formats) / sizeof(*formats)); f++) {
+        NSString *name = (formats[f] == kPixelFormatF32) ? @"float" : @"half";
+
+        pixel_layout_t src;
+        void *image = MakeImage(formats[f], 0x5EED0026 + (uint32_t) f, &src);
+        XCTAssert(image != NULL, @"%@", name);
+
+        image_pyramid_t *pyramid = PyramidNew(formats[f], kImageWidth, kImageHeight, 5);
+        XCTAssert(pyramid != NULL, @"%@", name);
+        XCTAssertEqual(PyramidNumLevels(pyramid), (size_t) 5, @"%@", name);
+
+        XCTAssertEqual(PyramidBuildImage(pyramid, &src), 0, @"%@", name);
+        [self compareLevelsOf:pyramid withImage:&src name:name];
+
+        PyramidRelease(pyramid);
+        free(image);
+    }
+}
+
+/**
+ * Builds the levels in aligned bands, starting from the bottom of the image; they must be the same as when
+ * building the whole image at once. Bands that aren't aligned are rejected.
+ */
+- (void) testBandsMatchWholeImage {
+    pixel_layout_t src;
+    void *image = MakeImage(kPixelFormatF32, 0x5EED0126, &src);
+    XCTAssert(image != NULL);
+
+    image_pyramid_t *whole = PyramidNew(kPixelFormatF32, kImageWidth, kImageHeight, 3);
+    image_pyramid_t *banded = PyramidNew(kPixelFormatF32, kImageWidth, kImageHeight, 3);
+    XCTAssert(whole != NULL && banded != NULL);
+
+    XCTAssertEqual(PyramidBuildImage(whole, &src), 0);
+
+    const size_t align = PyramidLineAlignment(banded);
+    XCTAssertEqual(align, (size_t) 8);
+
+    XCTAssertEqual(PyramidBuild(banded, &src, align / 2, align), -1);
+    XCTAssertEqual(PyramidBuild(banded, &src, 0, align + 1), -1);
+    XCTAssertEqual(PyramidBuild(banded, &src, 0, kImageHeight + 1), -1);
+
+    // the last band has the leftover lines at the bottom of the image
+    const size_t lastBand = (kImageHeight / (align * 2)) * (align * 2);
+    XCTAssertEqual(PyramidBuild(banded, &src, lastBand, kImageHeight - lastBand), 0);
+
+    for (size_t first = lastBand; first > 0; first -= (align * 2)) {
+        XCTAssertEqual(PyramidBuild(banded, &src, first - (align * 2), align * 2), 0, @"band at %zu", first);
+    }
+
+    XCTAssertEqualObjects(CopyLevels(banded), CopyLevels(whole));
+
+    PyramidRelease(banded);
+    PyramidRelease(whole);
+    free(image);
+}
+
+/**
+ * Rejects images that don't match the pyramid.
+ */
+- (void) testValidation {
+    pixel_layout_t src;
+    void *image = MakeImage(kPixelFormatF32, 0x5EED0226, &src);
+    XCTAssert(image != NULL);
+
+    image_pyramid_t *pyramid = PyramidNew(kPixelFormatF32, kImageWidth, kImageHeight, 3);
+    XCTAssert(pyramid != NULL);
+
+    XCTAssertEqual(PyramidValidate(pyramid, &src, kImageWidth, kImageHeight), 0);
+    XCTAssertEqual(PyramidValidate(pyramid, &src, kImageWidth - 1, kImageHeight), -1);
+
+    pixel_layout_t wrong = src;
+    wrong.format = kPixelFormatF16;
+    XCTAssertEqual(PyramidBuildImage(pyramid, &wrong), -1);
+
+    wrong = src;
+    wrong.channels = 3;
+    XCTAssertEqual(PyramidBuildImage(pyramid, &wrong), -1);
+
+    wrong = src;
+    wrong.stride = (kImageWidth * 4 * sizeof(float)) - 1;
+    XCTAssertEqual(PyramidBuildImage(pyramid, &wrong), -1);
+
+    PyramidRelease(pyramid);
+    free(image);
+}
+
+@end
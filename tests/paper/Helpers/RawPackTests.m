@@ -0,0 +1,493 @@
+//
+//  RawPackTests.m
+//  PaperTests
+//
+//  Packs sensor data of various sizes and layouts and ensures it unpacks to
+//  exactly the same values, and that truncated or corrupted packed data is
+//  rejected rather than decoded.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "rawpack.h"
+#import "PAPRawPacker.h"
+
+#import "test_images.h"
+
+/// Sizes of the sensor data that is packed: a single pixel and line, partial blocks and bands, and sizes that
+/// end exactly on a block or band
+static const size_t kSizes[][2] = {
+    {1, 1},
+    {7, 2},
+    {127, 3},
+    {128, 64},
+    {129, 65},
+    {301, 203},
+    {1000, 130},
+};
+
+/// Black levels stored with the sensor data
+static const uint16_t kBlackLevel[4] = {2047, 2049, 2050, 2046};
+
+/// Value that the unused bytes of output buffers are filled with
+static const uint8_t kCanary = 0xA5;
+
+/// Offsets of fields in the header of packed data, as laid out in rawpack.c
+static const size_t kHeaderMagicOffset = 0;
+static const size_t kHeaderVersionOffset = 4;
+static const size_t kHeaderVShiftOffset = 16;
+static const size_t kHeaderLength = 48;
+
+@interface RawPackTests : XCTestCase
+
+@end
+
+@implementation RawPackTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Creates sensor data with the given number of bytes per row; the padding at the end of each line is filled
+ * with garbage, which must not be packed.
+ */
+static uint16_t *MakeValues(size_t width, size_t height, size_t bytesPerRow, uint16_t maxValue, uint32_t seed) {
+    uint16_t *image = TestImageMakeBayer(width, height, maxValue, seed);
+    uint8_t *values = malloc(bytesPerRow * height);
+
+    if (!image || !values) {
+        free(image);
+        free(values);
+        return NULL;
+    }
+
+    memset(values, kCanary, bytesPerRow * height);
+
+    for (size_t y = 0; y < height; y++) {
+        memcpy(values + (y * bytesPerRow), image + (y * width), width * sizeof(uint16_t));
+    }
+
+    free(image);
+    return (uint16_t *) values;
+}
+
+/**
+ * Packs sensor data into a buffer of the worst case size.
+ *
+ * @return Packed data, trimmed to the number of bytes written
+ */
+- (NSMutableData *) pack:(const uint16_t *) values bytesPerRow:(size_t) bytesPerRow
+                     info:(const rawpack_info_t *) info {
+    const size_t maxLength = RawPackMaxLength(info);
+    XCTAssertGreaterThan(maxLength, (size_t) 0);
+
+    NSMutableData *packed = [NSMutableData dataWithLength:maxLength];
+    size_t written = 0;
+
+    XCTAssertEqual(RawPackEncode(values, bytesPerRow, info, packed.mutableBytes, packed.length, &written), 0);
+    XCTAssertGreaterThan(written, (size_t) 0);
+    XCTAssertLessThanOrEqual(written, maxLength);
+
+    packed.length = written;
+    return packed;
+}
+
+/**
+ * Gets the offset of the band table in packed data: it follows the header, the user info and a byte of block
+ * width for every block, aligned to 8 bytes.
+ */
+static size_t BandTableOffset(size_t width, size_t height, size_t userInfoLength) {
+    const size_t blocksPerLine = (width + kRawPackBlockValues - 1) / kRawPackBlockValues;
+    return (kHeaderLength + userInfoLength + (blocksPerLine * height) + 7) & ~((size_t) 7);
+}
+
+/**
+ * Packs and unpacks sensor data, and compares the values and the info read back. The output has a different
+ * number of bytes per row than the input, with padding that must not be written.
+ */
+- (void) roundTripWidth:(size_t) width height:(size_t) height padding:(size_t) padding
+               maxValue:(uint16_t) maxValue userInfo:(NSData *) userInfo seed:(uint32_t) seed {
+    NSString *desc = [NSString stringWithFormat:@"%zux%zu, padding %zu, max %u, %zu bytes of user info",
+                      width, height, padding, maxValue, userInfo.length];
+
+    const size_t inBytesPerRow = (width * sizeof(uint16_t)) + padding;
+    const size_t outBytesPerRow = (width * sizeof(uint16_t)) + 6;
+
+    uint16_t *values = MakeValues(width, height, inBytesPerRow, maxValue, seed);
+    XCTAssert(values != NULL, @"%@", desc);
+
+    rawpack_info_t info = {
+        .width = width, .height = height, .vShift = (seed & 1),
+        .userInfo = userInfo.bytes, .userInfoLength = userInfo.length,
+    };
+    memcpy(info.blackLevel, kBlackLevel, sizeof(kBlackLevel));
+
+    NSData *packed = [self pack:values bytesPerRow:inBytesPerRow info:&info];
+
+    // read the info back
+    rawpack_info_t read;
+    memset(&read, 0, sizeof(read));
+    XCTAssertEqual(RawPackReadInfo(packed.bytes, packed.length, &read), 0, @"%@", desc);
+
+    XCTAssertEqual(read.width, width, @"%@", desc);
+    XCTAssertEqual(read.height, height, @"%@", desc);
+    XCTAssertEqual(read.vShift, info.vShift, @"%@", desc);
+    XCTAssertEqual(memcmp(read.blackLevel, kBlackLevel, sizeof(kBlackLevel)), 0, @"%@", desc);
+    XCTAssertEqual(read.userInfoLength, userInfo.length, @"%@", desc);
+
+    if (userInfo.length) {
+        XCTAssert(read.userInfo != NULL, @"%@", desc);
+        XCTAssertEqual(memcmp(read.userInfo, userInfo.bytes, userInfo.length), 0, @"%@", desc);
+    } else {
+        XCTAssert(read.userInfo == NULL, @"%@", desc);
+    }
+
+    // unpack it, and compare every line
+    NSMutableData *out = [NSMutableData dataWithLength:(outBytesPerRow * height)];
+    memset(out.mutableBytes, kCanary, out.length);
+
+    XCTAssertEqual(RawPackDecode(packed.bytes, packed.length, out.mutableBytes, outBytesPerRow), 0, @"%@", desc);
+
+    const uint8_t *outBytes = out.bytes;
+
+    for (size_t y = 0; y < height; y++) {
+        const uint8_t *row = outBytes + (y * outBytesPerRow);
+        const uint8_t *expected = ((const uint8_t *) values) + (y * inBytesPerRow);
+
+        XCTAssertEqual(memcmp(row, expected, width * sizeof(uint16_t)), 0, @"%@: line %zu", desc, y);
+
+        for (size_t i = (width * sizeof(uint16_t)); i < outBytesPerRow; i++) {
+            XCTAssertEqual(row[i], kCanary, @"%@: padding of line %zu", desc, y);
+        }
+    }
+
+    free(values);
+}
+
+/**
+ * Creates packed data with two bands, and a little bit of user info, for the corruption tests.
+ */
+- (NSData *) makePackedWithInfo:(rawpack_info_t *) info {
+    static const char kUserInfo[] = "user info";
+
+    memset(info, 0, sizeof(*info));
+    info->width = 301;
+    info->height = 2 * kRawPackBandLines;
+    info->userInfo = kUserInfo;
+    info->userInfoLength = sizeof(kUserInfo);
+    memcpy(info->blackLevel, kBlackLevel, sizeof(kBlackLevel));
+
+    uint16_t *values = MakeValues(info->width, info->height, info->width * sizeof(uint16_t), 16383, 0x5EED0727);
+    XCTAssert(values != NULL);
+
+    NSData *packed = [self pack:values bytesPerRow:(info->width * sizeof(uint16_t)) info:info];
+    free(values);
+
+    return packed;
+}
+
+/**
+ * Ensures that corrupted packed data can't be unpacked. Parts of the output may still be written, but never
+ * more than its size.
+ */
+- (void) assertDecodeFails:(NSData *) packed info:(const rawpack_info_t *) info desc:(NSString *) desc {
+    NSMutableData *out = [NSMutableData dataWithLength:(info->width * info->height * sizeof(uint16_t))];
+    const void *bytes = packed.bytes ? packed.bytes : "";
+
+    XCTAssertEqual(RawPackDecode(bytes, packed.length, out.mutableBytes, info->width * sizeof(uint16_t)), -1,
+                   @"%@", desc);
+}
+
+// MARK: - Round trips
+/**
+ * Packs smooth 14-bit sensor data of every size, which must also be smaller than the sensor data itself.
+ */
+- (void) testRoundTrip {
+    for (size_t s = 0; s < (sizeof(kSizes) / sizeof(*kSizes)); s++) {
+        [self roundTripWidth:kSizes[s][0] height:kSizes[s][1] padding:0 maxValue:16383 userInfo:nil
+                        seed:(0x5EED0027 + (uint32_t) s)];
+    }
+
+    // check that it actually compresses
+    const size_t width = 1000, height = 130;
+    uint16_t *values = MakeValues(width, height, width * sizeof(uint16_t), 16383, 0x5EED0127);
+    XCTAssert(values != NULL);
+
+    rawpack_info_t info = {.width = width, .height = height};
+    NSData *packed = [self pack:values bytesPerRow:(width * sizeof(uint16_t)) info:&info];
+    XCTAssertLessThan(packed.length, width * height * sizeof(uint16_t));
+
+    free(values);
+}
+
+/**
+ * Packs sensor data with padding at the end of each line, and user info of a length that misaligns the
+ * following sections.
+ */
+- (void) testRoundTripWithPaddingAndUserInfo {
+    NSMutableData *userInfo = [NSMutableData dataWithLength:37];
+    for (size_t i = 0; i < userInfo.length; i++) {
+        ((uint8_t *) userInfo.mutableBytes)[i] = (uint8_t) (i * 7);
+    }
+
+    for (size_t s = 0; s < (sizeof(kSizes) / sizeof(*kSizes)); s++) {
+        [self roundTripWidth:kSizes[s][0] height:kSizes[s][1] padding:10 maxValue:16383 userInfo:userInfo
+                        seed:(0x5EED0227 + (uint32_t) s)];
+    }
+}
+
+/**
+ * Packs 16-bit sensor data, whose residuals need every width up to the full 16 bits.
+ */
+- (void) testRoundTripFullRange {
+    for (size_t s = 0; s < (sizeof(kSizes) / sizeof(*kSizes)); s++) {
+        [self roundTripWidth:kSizes[s][0] height:kSizes[s][1] padding:2 maxValue:65535 userInfo:nil
+                        seed:(0x5EED0327 + (uint32_t) s)];
+    }
+
+    // alternating extremes have the largest possible residuals
+    const size_t width = 200, height = 70;
+    uint16_t *values = malloc(width * height * sizeof(uint16_t));
+    XCTAssert(values != NULL);
+
+    for (size_t i = 0; i < (width * height); i++) {
+        values[i] = ((i / 2) & 1) ? UINT16_MAX : 0;
+    }
+
+    rawpack_info_t info = {.width = width, .height = height};
+    NSData *packed = [self pack:values bytesPerRow:(width * sizeof(uint16_t)) info:&info];
+
+    NSMutableData *out = [NSMutableData dataWithLength:(width * height * sizeof(uint16_t))];
+    XCTAssertEqual(RawPackDecode(packed.bytes, packed.length, out.mutableBytes, width * sizeof(uint16_t)), 0);
+    XCTAssertEqual(memcmp(out.bytes, values, out.length), 0);
+
+    free(values);
+}
+
+/**
+ * Ensures that invalid info and buffers that are too small are rejected when packing.
+ */
+- (void) testInvalidEncodeIsRejected {
+    const size_t width = 129, height = 65, bytesPerRow = width * sizeof(uint16_t);
+    uint16_t *values = MakeValues(width, height, bytesPerRow, 16383, 0x5EED0427);
+    XCTAssert(values != NULL);
+
+    rawpack_info_t info = {.width = width, .height = height};
+    const size_t maxLength = RawPackMaxLength(&info);
+    NSMutableData *out = [NSMutableData dataWithLength:maxLength];
+    size_t written = 0;
+
+    // empty sensor data
+    rawpack_info_t empty = {.width = 0, .height = height};
+    XCTAssertEqual(RawPackMaxLength(&empty), (size_t) 0);
+    XCTAssertEqual(RawPackEncode(values, bytesPerRow, &empty, out.mutableBytes, out.length, &written), -1);
+
+    // invalid Bayer shift
+    rawpack_info_t shifted = {.width = width, .height = height, .vShift = 2};
+    XCTAssertEqual(RawPackEncode(values, bytesPerRow, &shifted, out.mutableBytes, out.length, &written), -1);
+
+    // lines that are too short, or not made up of whole values
+    XCTAssertEqual(RawPackEncode(values, bytesPerRow - 2, &info, out.mutableBytes, out.length, &written), -1);
+    XCTAssertEqual(RawPackEncode(values, bytesPerRow + 1, &info, out.mutableBytes, out.length, &written), -1);
+
+    // user info without any data
+    rawpack_info_t noUserInfo = {.width = width, .height = height, .userInfoLength = 10};
+    XCTAssertEqual(RawPackEncode(values, bytesPerRow, &noUserInfo, out.mutableBytes, out.length, &written), -1);
+
+    // buffers too small for the header, or for the packed blocks
+    XCTAssertEqual(RawPackEncode(values, bytesPerRow, &info, out.mutableBytes, kHeaderLength, &written), -1);
+
+    XCTAssertEqual(RawPackEncode(values, bytesPerRow, &info, out.mutableBytes, out.length, &written), 0);
+    XCTAssertEqual(RawPackEncode(values, bytesPerRow, &info, out.mutableBytes, written - 1, &written), -1);
+
+    free(values);
+}
+
+// MARK: - Corrupt data
+/**
+ * Truncates packed data at various points; neither the info nor the sensor data may be read from it.
+ */
+- (void) testTruncatedDataIsRejected {
+    rawpack_info_t info;
+    NSData *packed = [self makePackedWithInfo:&info];
+
+    const size_t bandsOffset = BandTableOffset(info.width, info.height, info.userInfoLength);
+    const size_t lengths[] = {
+        0, 1, kHeaderLength - 1, kHeaderLength, kHeaderLength + info.userInfoLength, bandsOffset,
+        bandsOffset + 8, packed.length / 2, packed.length - 16, packed.length - 1,
+    };
+
+    for (size_t i = 0; i < (sizeof(lengths) / sizeof(*lengths)); i++) {
+        NSString *desc = [NSString stringWithFormat:@"truncated to %zu of %zu bytes", lengths[i], packed.length];
+        NSData *truncated = [packed subdataWithRange:NSMakeRange(0, lengths[i])];
+
+        // empty data may not have any bytes
+        rawpack_info_t read;
+        XCTAssertEqual(RawPackReadInfo(truncated.bytes ? truncated.bytes : "", truncated.length, &read), -1,
+                       @"%@", desc);
+        [self assertDecodeFails:truncated info:&info desc:desc];
+    }
+}
+
+/**
+ * Corrupts fields of the header; the data must no longer be recognized.
+ */
+- (void) testCorruptHeaderIsRejected {
+    rawpack_info_t info;
+    NSData *packed = [self makePackedWithInfo:&info];
+
+    const size_t offsets[] = {kHeaderMagicOffset, kHeaderVersionOffset, kHeaderVShiftOffset};
+
+    for (size_t i = 0; i < (sizeof(offsets) / sizeof(*offsets)); i++) {
+        NSString *desc = [NSString stringWithFormat:@"header byte %zu corrupted", offsets[i]];
+
+        NSMutableData *corrupt = [packed mutableCopy];
+        ((uint8_t *) corrupt.mutableBytes)[offsets[i]] ^= 0x02;
+
+        rawpack_info_t read;
+        XCTAssertEqual(RawPackReadInfo(corrupt.bytes, corrupt.length, &read), -1, @"%@", desc);
+        [self assertDecodeFails:corrupt info:&info desc:desc];
+    }
+}
+
+/**
+ * Corrupts the band table, so that bands overlap, leave gaps or don't end with the payload, and the block
+ * widths, so the blocks don't fill their band. The info can still be read, but unpacking must fail.
+ */
+- (void) testCorruptBandTableIsRejected {
+    rawpack_info_t info;
+    NSData *packed = [self makePackedWithInfo:&info];
+
+    const size_t bandsOffset = BandTableOffset(info.width, info.height, info.userInfoLength);
+    const size_t numBands = (info.height + kRawPackBandLines - 1) / kRawPackBandLines;
+
+    uint64_t bands[numBands + 1];
+    memcpy(bands, ((const uint8_t *) packed.bytes) + bandsOffset, sizeof(bands));
+
+    XCTAssertEqual(bands[0], (uint64_t) 0);
+    XCTAssertLessThan(bands[1], bands[2]);
+
+    // changes to entries of the band table: index and new value
+    const uint64_t changes[][2] = {
+        {0, 16},
+        {1, bands[1] + 16},
+        {1, bands[1] - 16},
+        {1, bands[2] + 16},
+        {2, bands[2] + 16},
+        {2, bands[2] - 16},
+    };
+
+    for (size_t i = 0; i < (sizeof(changes) / sizeof(*changes)); i++) {
+        NSString *desc = [NSString stringWithFormat:@"band %llu offset changed to %llu", changes[i][0],
+                          changes[i][1]];
+
+        NSMutableData *corrupt = [packed mutableCopy];
+        uint64_t *entry = (uint64_t *) (((uint8_t *) corrupt.mutableBytes) + bandsOffset) + changes[i][0];
+        *entry = changes[i][1];
+
+        rawpack_info_t read;
+        XCTAssertEqual(RawPackReadInfo(corrupt.bytes, corrupt.length, &read), 0, @"%@", desc);
+        [self assertDecodeFails:corrupt info:&info desc:desc];
+    }
+
+    // block widths that are impossible, or don't match the band lengths
+    const size_t widthsOffset = kHeaderLength + info.userInfoLength;
+    const uint8_t widths[] = {17, 255, 0, 16};
+
+    for (size_t i = 0; i < (sizeof(widths) / sizeof(*widths)); i++) {
+        NSString *desc = [NSString stringWithFormat:@"block width changed to %u", widths[i]];
+
+        NSMutableData *corrupt = [packed mutableCopy];
+        uint8_t *width = ((uint8_t *) corrupt.mutableBytes) + widthsOffset + 5;
+        XCTAssertNotEqual(*width, widths[i], @"%@", desc);
+        *width = widths[i];
+
+        [self assertDecodeFails:corrupt info:&info desc:desc];
+    }
+}
+
+// MARK: - Objective-C interface
+/**
+ * Packs and unpacks sensor data through the Objective-C interface.
+ */
+- (void) testPackerRoundTrip {
+    const size_t width = 301, height = 203, bytesPerRow = (width * sizeof(uint16_t)) + 8;
+
+    uint16_t *values = MakeValues(width, height, bytesPerRow, 16383, 0x5EED0527);
+    XCTAssert(values != NULL);
+    NSData *valueData = [NSData dataWithBytesNoCopy:values length:(bytesPerRow * height) freeWhenDone:YES];
+
+    NSArray<NSNumber *> *blackLevel = @[@(kBlackLevel[0]), @(kBlackLevel[1]), @(kBlackLevel[2]),
+                                        @(kBlackLevel[3])];
+    NSData *userInfo = [@"metadata" dataUsingEncoding:NSUTF8StringEncoding];
+
+    NSError *err = nil;
+    NSData *packed = [PAPRawPacker packValues:valueData size:CGSizeMake(width, height) bytesPerRow:bytesPerRow
+                                       vShift:1 blackLevel:blackLevel userInfo:userInfo error:&err];
+    XCTAssertNotNil(packed, @"%@", err);
+
+    PAPRawPacker *packer = [[PAPRawPacker alloc] initWithData:packed error:&err];
+    XCTAssertNotNil(packer, @"%@", err);
+
+    XCTAssertEqual(packer.size.width, (CGFloat) width);
+    XCTAssertEqual(packer.size.height, (CGFloat) height);
+    XCTAssertEqual(packer.vShift, (NSUInteger) 1);
+    XCTAssertEqualObjects(packer.blackLevel, blackLevel);
+    XCTAssertEqualObjects(packer.userInfo, userInfo);
+
+    NSMutableData *unpacked = [packer unpackWithContext:nil error:&err];
+    XCTAssertNotNil(unpacked, @"%@", err);
+    XCTAssertEqual(unpacked.length, width * height * sizeof(uint16_t));
+
+    for (size_t y = 0; y < height; y++) {
+        XCTAssertEqual(memcmp(((const uint8_t *) unpacked.bytes) + (y * width * sizeof(uint16_t)),
+                              ((const uint8_t *) valueData.bytes) + (y * bytesPerRow), width * sizeof(uint16_t)),
+                       0, @"line %zu", y);
+    }
+}
+
+/**
+ * Ensures that the Objective-C interface reports truncated or corrupted packed data as errors.
+ */
+- (void) testPackerReportsErrors {
+    rawpack_info_t info;
+    NSData *packed = [self makePackedWithInfo:&info];
+
+    // truncated data can't be opened
+    NSError *err = nil;
+    PAPRawPacker *packer = [[PAPRawPacker alloc] initWithData:[packed subdataWithRange:NSMakeRange(0, 20)]
+                                                        error:&err];
+    XCTAssertNil(packer);
+    XCTAssertEqualObjects(err.domain, PAPRawPackerErrorDomain);
+
+    // nor can data with a corrupted header
+    NSMutableData *corrupt = [packed mutableCopy];
+    ((uint8_t *) corrupt.mutableBytes)[kHeaderMagicOffset] ^= 0xFF;
+
+    err = nil;
+    packer = [[PAPRawPacker alloc] initWithData:corrupt error:&err];
+    XCTAssertNil(packer);
+    XCTAssertEqualObjects(err.domain, PAPRawPackerErrorDomain);
+
+    // a corrupted band table is only noticed when unpacking
+    corrupt = [packed mutableCopy];
+    const size_t bandsOffset = BandTableOffset(info.width, info.height, info.userInfoLength);
+    ((uint64_t *) (((uint8_t *) corrupt.mutableBytes) + bandsOffset))[1] += 16;
+
+    err = nil;
+    packer = [[PAPRawPacker alloc] initWithData:corrupt error:&err];
+    XCTAssertNotNil(packer, @"%@", err);
+
+    XCTAssertNil([packer unpackWithContext:nil error:&err]);
+    XCTAssertEqualObjects(err.domain, PAPRawPackerErrorDomain);
+}
+
+@end
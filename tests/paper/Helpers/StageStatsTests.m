@@ -0,0 +1,296 @@
+//
+//  StageStatsTests.m
+//  PaperTests
+//
+//  Checks the values the decompressor records into stage stats: the slow path
+//  events it counts, the bytes and intervals of the decompress stage, and its
+//  errors, along with how the stats combine what they're given.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "decompress.h"
+#import "huffman.h"
+#import "stagestats.h"
+
+#import "test_images.h"
+
+/// Size of the test frames
+static const size_t kFrameCols = 64;
+static const size_t kFrameRows = 40;
+static const size_t kFrameComponents = 2;
+
+@interface StageStatsTests : XCTestCase
+
+@end
+
+@implementation StageStatsTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Encodes a frame of the test size as a scan, predicted from the left.
+ */
+static uint8_t *MakeScan(uint8_t precision, uint32_t seed, size_t *outLength) {
+    uint16_t *frame = TestImageMakeFrame(kFrameCols, kFrameRows, kFrameComponents, precision, 1, seed);
+    if (!frame) return NULL;
+
+    uint8_t *scan = TestImageEncodeScan(frame, kFrameCols, kFrameRows, kFrameComponents, precision, 1,
+                                        outLength);
+    free(frame);
+    return scan;
+}
+
+/**
+ * Decodes a scan of the test size, recording into the given stats.
+ *
+ * @param maxLines Number of lines to decode per call, or 0 to decode the scan in a single call
+ * @param outError Error the decompressor stopped with
+ * @return Whether the decompressor could be set up
+ */
+static BOOL DecodeScan(const uint8_t *scan, size_t scanLength, uint8_t precision, BOOL unstuff, size_t maxLines,
+                       stage_stats_t *stats, jpeg_decompress_error_t *outError) {
+    jpeg_decompressor_t *dec = JPEGDecompressorNew(kFrameCols, kFrameRows, precision, kFrameComponents);
+    jpeg_huffman_t *table = JPEGHuffmanNewFromDHT(kTestHuffmanCounts, kTestHuffmanValues,
+                                                  sizeof(kTestHuffmanValues));
+
+    if (!dec || !table || JPEGDecompressorAddTable(dec, 0, table) != 0) {
+        JPEGHuffmanRelease(table);
+        JPEGDecompressorRelease(dec);
+        return NO;
+    }
+    JPEGHuffmanRelease(table);
+
+    for (size_t c = 0; c < kFrameComponents; c++) {
+        JPEGDecompressorSetTableForPlane(dec, c, 0);
+    }
+    JPEGDecompressorSetPredictionAlgo(dec, 1);
+    JPEGDecompressorSetUnstuffInput(dec, unstuff);
+    JPEGDecompressorSetStats(dec, stats);
+
+    NSMutableData *out = [NSMutableData dataWithLength:(kFrameCols * kFrameRows * kFrameComponents *
+                                                        sizeof(uint16_t))];
+    JPEGDecompressorSetOutput(dec, out.mutableBytes, out.length);
+    JPEGDecompressorSetInput(dec, scan, scanLength);
+
+    bool foundMarker = false;
+
+    if (maxLines) {
+        size_t offset = 0;
+
+        while (!JPEGDecompressorIsDone(dec) && dec->error == kJPEGErrorNone) {
+            offset = JPEGDecompressorGoLines(dec, offset, maxLines, &foundMarker);
+        }
+    } else {
+        JPEGDecompressorGo(dec, 0, &foundMarker);
+    }
+
+    *outError = dec->error;
+
+    JPEGDecompressorRelease(dec);
+    return YES;
+}
+
+/**
+ * Checks that the decompress stage recorded the given number of intervals, and produced the entire frame.
+ */
+- (void) assertStats:(const stage_stats_t *) stats decodedFrameIn:(uint64_t) intervals {
+    stage_summary_t summary;
+    StageStatsGetSummary(stats, kStageDecompress, &summary);
+
+    XCTAssertEqual(summary.intervals, intervals);
+    XCTAssertEqual(summary.bytes, (uint64_t) (kFrameCols * kFrameRows * kFrameComponents * sizeof(uint16_t)));
+    XCTAssertEqual(StageStatsGetError(stats, NULL), 0);
+}
+
+// MARK: - Decompressor
+/**
+ * Decodes the unstuffed copy of a scan whose codes all fit into the lookup table: neither slow path may be
+ * taken, and the only buffer allocated is the one holding the unstuffed scan.
+ */
+- (void) testUnstuffedScanTakesNoSlowPaths {
+    size_t scanLength = 0;
+    uint8_t *scan = MakeScan(14, 0x5EED0029, &scanLength);
+    XCTAssert(scan != NULL);
+
+    stage_stats_t *stats = StageStatsNew();
+    jpeg_decompress_error_t error = kJPEGErrorNone;
+
+    XCTAssert(DecodeScan(scan, scanLength, 14, YES, 0, stats, &error));
+    XCTAssertEqual(error, kJPEGErrorNone);
+
+    [self assertStats:stats decodedFrameIn:1];
+
+    XCTAssertEqual(StageStatsGetCounter(stats, kStageCounterSlowRefills), (uint64_t) 0);
+    XCTAssertEqual(StageStatsGetCounter(stats, kStageCounterTreeWalks), (uint64_t) 0);
+
+    XCTAssertEqual(StageStatsGetCounter(stats, kStageCounterAllocations), (uint64_t) 1);
+    XCTAssertGreaterThanOrEqual(StageStatsGetCounter(stats, kStageCounterAllocatedBytes), (uint64_t) scanLength);
+    XCTAssertEqual(StageStatsGetCounter(stats, kStageCounterLargestAllocation),
+                   StageStatsGetCounter(stats, kStageCounterAllocatedBytes));
+
+    StageStatsRelease(stats);
+    free(scan);
+}
+
+/**
+ * Decodes the same scan without unstuffing it; every refill reads the stuffed scan, and must be counted.
+ */
+- (void) testStuffedScanCountsSlowRefills {
+    size_t scanLength = 0;
+    uint8_t *scan = MakeScan(14, 0x5EED0029, &scanLength);
+    XCTAssert(scan != NULL);
+
+    stage_stats_t *stats = StageStatsNew();
+    jpeg_decompress_error_t error = kJPEGErrorNone;
+
+    XCTAssert(DecodeScan(scan, scanLength, 14, NO, 0, stats, &error));
+    XCTAssertEqual(error, kJPEGErrorNone);
+
+    [self assertStats:stats decodedFrameIn:1];
+
+    XCTAssertGreaterThan(StageStatsGetCounter(stats, kStageCounterSlowRefills), (uint64_t) 0);
+    XCTAssertEqual(StageStatsGetCounter(stats, kStageCounterAllocations), (uint64_t) 0);
+
+    StageStatsRelease(stats);
+    free(scan);
+}
+
+/**
+ * Decodes a 16-bit scan, whose differences need the two codes that don't fit into the lookup table. Decoding
+ * it a few lines at a time must record an interval per call, and add up to the same counts as a single call.
+ */
+- (void) testLongCodesCountTreeWalks {
+    static const size_t kMaxLines = 7;
+
+    size_t scanLength = 0;
+    uint8_t *scan = MakeScan(16, 0x5EED0129, &scanLength);
+    XCTAssert(scan != NULL);
+
+    stage_stats_t *whole = StageStatsNew();
+    stage_stats_t *chunked = StageStatsNew();
+    jpeg_decompress_error_t error = kJPEGErrorNone;
+
+    XCTAssert(DecodeScan(scan, scanLength, 16, YES, 0, whole, &error));
+    XCTAssertEqual(error, kJPEGErrorNone);
+    XCTAssert(DecodeScan(scan, scanLength, 16, YES, kMaxLines, chunked, &error));
+    XCTAssertEqual(error, kJPEGErrorNone);
+
+    [self assertStats:whole decodedFrameIn:1];
+    [self assertStats:chunked decodedFrameIn:((kFrameRows + kMaxLines - 1) / kMaxLines)];
+
+    XCTAssertGreaterThan(StageStatsGetCounter(whole, kStageCounterTreeWalks), (uint64_t) 0);
+    XCTAssertEqual(StageStatsGetCounter(whole, kStageCounterSlowRefills), (uint64_t) 0);
+
+    XCTAssertEqual(StageStatsGetCounter(chunked, kStageCounterTreeWalks),
+                   StageStatsGetCounter(whole, kStageCounterTreeWalks));
+    XCTAssertEqual(StageStatsGetCounter(chunked, kStageCounterSlowRefills), (uint64_t) 0);
+
+    StageStatsRelease(chunked);
+    StageStatsRelease(whole);
+    free(scan);
+}
+
+/**
+ * Decodes a truncated scan; the error must be recorded for the decompress stage, along with the part of the
+ * frame that was decoded.
+ */
+- (void) testTruncatedScanRecordsError {
+    size_t scanLength = 0;
+    uint8_t *scan = MakeScan(14, 0x5EED0229, &scanLength);
+    XCTAssert(scan != NULL);
+
+    stage_stats_t *stats = StageStatsNew();
+    jpeg_decompress_error_t error = kJPEGErrorNone;
+
+    XCTAssert(DecodeScan(scan, scanLength / 2, 14, YES, 0, stats, &error));
+    XCTAssertNotEqual(error, kJPEGErrorNone);
+
+    stage_t stage = kStageColorConvert;
+    XCTAssertEqual(StageStatsGetError(stats, &stage), (int) error);
+    XCTAssertEqual(stage, kStageDecompress);
+
+    stage_summary_t summary;
+    StageStatsGetSummary(stats, kStageDecompress, &summary);
+
+    XCTAssertEqual(summary.intervals, (uint64_t) 1);
+    XCTAssertLessThan(summary.bytes, (uint64_t) (kFrameCols * kFrameRows * kFrameComponents * sizeof(uint16_t)));
+
+    StageStatsRelease(stats);
+    free(scan);
+}
+
+// MARK: - Recording
+/**
+ * Counters are added up, except for the largest allocation, which is kept as a maximum. Only the first error
+ * is kept, and resetting clears everything.
+ */
+- (void) testCountersCombine {
+    stage_stats_t *stats = StageStatsNew();
+    XCTAssert(stats != NULL);
+
+    StageCount(stats, kStageCounterSlowRefills, 5);
+    StageCount(stats, kStageCounterSlowRefills, 7);
+    StageCount(stats, kStageCounterTreeWalks, 0);
+    XCTAssertEqual(StageStatsGetCounter(stats, kStageCounterSlowRefills), (uint64_t) 12);
+    XCTAssertEqual(StageStatsGetCounter(stats, kStageCounterTreeWalks), (uint64_t) 0);
+
+    StageCountAllocation(stats, 4096);
+    StageCountAllocation(stats, 65536);
+    StageCountAllocation(stats, 1024);
+    XCTAssertEqual(StageStatsGetCounter(stats, kStageCounterAllocations), (uint64_t) 3);
+    XCTAssertEqual(StageStatsGetCounter(stats, kStageCounterAllocatedBytes), (uint64_t) (4096 + 65536 + 1024));
+    XCTAssertEqual(StageStatsGetCounter(stats, kStageCounterLargestAllocation), (uint64_t) 65536);
+
+    StageFail(stats, kStageUnslice, 0);
+    XCTAssertEqual(StageStatsGetError(stats, NULL), 0);
+
+    StageFail(stats, kStageTrim, 4);
+    StageFail(stats, kStageDemosaic, 2);
+
+    stage_t stage = kStageDecompress;
+    XCTAssertEqual(StageStatsGetError(stats, &stage), 4);
+    XCTAssertEqual(stage, kStageTrim);
+
+    // a single interval's duration is the elapsed time
+    stage_interval_t interval = StageBegin(stats, kStageWhiteBalance);
+    StageEnd(stats, &interval, 100);
+
+    stage_summary_t summary;
+    StageStatsGetSummary(stats, kStageWhiteBalance, &summary);
+    XCTAssertEqual(summary.intervals, (uint64_t) 1);
+    XCTAssertEqual(summary.bytes, (uint64_t) 100);
+    XCTAssertEqual(StageStatsGetElapsed(stats), summary.nanos);
+
+    StageStatsReset(stats);
+
+    for (size_t i = 0; i < kStageCounterCount; i++) {
+        XCTAssertEqual(StageStatsGetCounter(stats, (stage_counter_t) i), (uint64_t) 0, @"counter %zu", i);
+    }
+    StageStatsGetSummary(stats, kStageWhiteBalance, &summary);
+    XCTAssertEqual(summary.intervals, (uint64_t) 0);
+    XCTAssertEqual(StageStatsGetElapsed(stats), (uint64_t) 0);
+    XCTAssertEqual(StageStatsGetError(stats, NULL), 0);
+
+    // nothing is recorded without stats
+    StageCount(NULL, kStageCounterSlowRefills, 1);
+    StageCountAllocation(NULL, 1024);
+    StageFail(NULL, kStageTrim, 1);
+
+    interval = StageBegin(NULL, kStageTrim);
+    XCTAssertEqual(interval.start, (uint64_t) 0);
+    StageEnd(NULL, &interval, 100);
+
+    StageStatsRelease(stats);
+}
+
+@end
@@ -0,0 +1,228 @@
+//
+//  test_images.c
+//  PaperTests
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#include "test_images.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Codes of 2 to 7 bits cover the common small differences; the two longest ones are only found by walking
+/// the table, as they're longer than its lookup index
+const uint8_t kTestHuffmanCounts[16] = {0, 1, 3, 3, 3, 3, 2, 0, 0, 0, 0, 1, 0, 1, 0, 0};
+const uint8_t kTestHuffmanValues[17] = {3, 2, 4, 5, 1, 6, 7, 0, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+
+/**
+ * Advances a xorshift generator, returning its next value.
+ */
+static uint32_t NextRandom(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return (*state = x);
+}
+
+// MARK: - Images
+/**
+ * Synthesizes Bayer sensor data.
+ */
+uint16_t *TestImageMakeBayer(size_t width, size_t height, uint16_t maxValue, uint32_t seed) {
+    uint16_t *image = malloc(width * height * sizeof(uint16_t));
+    if(!image) return NULL;
+
+    uint32_t state = seed | 1;
+    const int range = (int) maxValue;
+
+    for(size_t y = 0; y < height; y++) {
+        for(size_t x = 0; x < width; x++) {
+            const size_t cfa = ((y & 1) << 1) | (x & 1);
+            const uint32_t r = NextRandom(&state);
+
+            // a different gradient for each color, so the interpolated colors aren't all alike
+            int value = (cfa == 0) ? (int) ((x * range) / (2 * width)) :
+                        (cfa == 3) ? (int) ((y * range) / (2 * height)) :
+                                     (int) (((x + y) * range) / (3 * (width + height)));
+
+            value += (int) ((((x * 7) ^ (y * 5)) & 0xFF) * (size_t) range) / 1024;
+            value += (int) (r & 63) - 32;
+
+            // sprinkle in some clipped and black pixels
+            if((r >> 8) % 997 == 0) value = range;
+            else if((r >> 8) % 991 == 0) value = 0;
+
+            image[(y * width) + x] = (uint16_t) ((value < 0) ? 0 : ((value > range) ? range : value));
+        }
+    }
+
+    return image;
+}
+
+/**
+ * Gets the prediction for a sample of a frame, per ITU-T81 H.1.2.1: the first line is predicted from the
+ * sample to the left and the first sample of every other line from the one above; the very first sample
+ * is predicted from the middle of the sample range.
+ */
+static int Predict(const uint16_t *frame, size_t x, size_t y, size_t c, size_t cols, size_t components,
+                   uint8_t precision, uint8_t predictor) {
+    const size_t stride = cols * components;
+    const size_t i = (y * stride) + (x * components) + c;
+
+    if(x == 0) {
+        return y ? frame[i - stride] : (1 << (precision - 1));
+    } else if(y == 0) {
+        return frame[i - components];
+    }
+
+    const int ra = frame[i - components];
+    const int rb = frame[i - stride];
+    const int rc = frame[i - stride - components];
+
+    switch(predictor) {
+        case 1:
+            return ra;
+        case 2:
+            return rb;
+        case 3:
+            return rc;
+        case 4:
+            return ra + rb - rc;
+        case 5:
+            return ra + ((rb - rc) >> 1);
+        case 6:
+            return rb + ((ra - rc) >> 1);
+        case 7:
+            return (ra + rb) >> 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Synthesizes samples of a frame. Each sample is a random value of random width, so the differences span
+ * all SSSS categories; for 16-bit frames, some samples are also placed exactly 32768 away from their
+ * predicted value, which is the only way to get category 16.
+ */
+uint16_t *TestImageMakeFrame(size_t cols, size_t rows, size_t components, uint8_t precision, uint8_t predictor,
+                             uint32_t seed) {
+    if(precision < 2 || precision > 16 || predictor < 1 || predictor > 7) return NULL;
+
+    uint16_t *frame = malloc(cols * rows * components * sizeof(uint16_t));
+    if(!frame) return NULL;
+
+    uint32_t state = seed | 1;
+
+    for(size_t y = 0; y < rows; y++) {
+        for(size_t x = 0; x < cols; x++) {
+            for(size_t c = 0; c < components; c++) {
+                const size_t i = (((y * cols) + x) * components) + c;
+                const uint32_t r = NextRandom(&state);
+
+                if(precision == 16 && (r & 15) == 0) {
+                    const int pred = Predict(frame, x, y, c, cols, components, precision, predictor);
+                    frame[i] = (uint16_t) (pred + 32768);
+                    continue;
+                }
+
+                const uint32_t bits = (r >> 4) % (precision + 1);
+                frame[i] = (uint16_t) ((r >> 12) & ((1U << bits) - 1));
+            }
+        }
+    }
+
+    return frame;
+}
+
+// MARK: - Lossless JPEG
+/**
+ * State of the entropy coder
+ */
+typedef struct test_encoder {
+    uint8_t *buffer;
+    size_t length;
+
+    uint64_t bits;
+    size_t numBits;
+
+    /// Code and its length for each SSSS value
+    uint16_t codes[17];
+    uint8_t codeLengths[17];
+} test_encoder_t;
+
+/**
+ * Appends up to 32 bits of entropy coded data, stuffing a zero byte after each 0xFF. The buffer is large
+ * enough for the worst case of every sample, so it's not checked here.
+ */
+static void PutBits(test_encoder_t *enc, uint32_t value, size_t numBits) {
+    enc->bits = (enc->bits << numBits) | (value & ((1ULL << numBits) - 1));
+    enc->numBits += numBits;
+
+    while(enc->numBits >= 8) {
+        const uint8_t byte = (enc->bits >> (enc->numBits - 8)) & 0xFF;
+        enc->numBits -= 8;
+
+        enc->buffer[enc->length++] = byte;
+        if(byte == 0xFF) enc->buffer[enc->length++] = 0x00;
+    }
+}
+
+/**
+ * Encodes a frame into a lossless JPEG scan.
+ */
+uint8_t *TestImageEncodeScan(const uint16_t *frame, size_t cols, size_t rows, size_t components,
+                             uint8_t precision, uint8_t predictor, size_t *outLength) {
+    test_encoder_t enc;
+    memset(&enc, 0, sizeof(enc));
+
+    if(!frame || !outLength || !cols || !rows || !components || components > 4 || precision < 2 ||
+       precision > 16 || predictor < 1 || predictor > 7) {
+        return NULL;
+    }
+
+    // assign codes in order of length, as a DHT segment does
+    for(size_t l = 1, k = 0, code = 0; l <= 16; l++, code <<= 1) {
+        for(size_t i = 0; i < kTestHuffmanCounts[l - 1]; i++, k++, code++) {
+            enc.codes[kTestHuffmanValues[k]] = (uint16_t) code;
+            enc.codeLengths[kTestHuffmanValues[k]] = (uint8_t) l;
+        }
+    }
+
+    // each sample takes at most 30 bits; if all of them were 0xFF, they'd double in size
+    const size_t samples = cols * rows * components;
+    enc.buffer = malloc((samples * 8) + 16);
+    if(!enc.buffer) return NULL;
+
+    for(size_t y = 0; y < rows; y++) {
+        for(size_t x = 0; x < cols; x++) {
+            for(size_t c = 0; c < components; c++) {
+                const size_t i = (((y * cols) + x) * components) + c;
+                const int pred = Predict(frame, x, y, c, cols, components, precision, predictor);
+
+                // differences are taken modulo 2^16
+                const int diff = (int16_t) (uint16_t) (frame[i] - pred);
+                const int magnitude = (diff < 0) ? -diff : diff;
+                const size_t ssss = magnitude ? (32 - __builtin_clz(magnitude)) : 0;
+
+                PutBits(&enc, enc.codes[ssss], enc.codeLengths[ssss]);
+
+                if(ssss && ssss != 16) {
+                    PutBits(&enc, (diff < 0) ? (diff + (1 << ssss) - 1) : diff, ssss);
+                }
+            }
+        }
+    }
+
+    // pad the last byte with ones, then end the image
+    if(enc.numBits) {
+        PutBits(&enc, 0xFF, 8 - enc.numBits);
+    }
+    enc.buffer[enc.length++] = 0xFF;
+    enc.buffer[enc.length++] = 0xD9;
+
+    *outLength = enc.length;
+    return enc.buffer;
+}
@@ -0,0 +1,62 @@
+//
+//  test_images.h
+//  PaperTests
+//
+//  Synthetic inputs for the tests of the C decode and develop kernels: Bayer
+//  sensor data with known content, and lossless JPEG scans encoded from it
+//  with any predictor, so the decoder's output can be compared against the
+//  samples that went in.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#ifndef PAPERTESTS_TEST_IMAGES_H
+#define PAPERTESTS_TEST_IMAGES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Code counts (for lengths of 1 to 16 bits) of the Huffman table scans are encoded with
+extern const uint8_t kTestHuffmanCounts[16];
+/// Values of the Huffman table scans are encoded with; all SSSS values from 0 to 16 have a code
+extern const uint8_t kTestHuffmanValues[17];
+
+/**
+ * Synthesizes sensor data in an RG/GB Bayer layout: smooth gradients that differ per CFA color, with fine
+ * texture, noise, and a few clipped and black pixels so that every branch of the kernels is taken. The
+ * same seed always produces the same image.
+ *
+ * @param width Number of pixels per line
+ * @param height Number of lines
+ * @param maxValue Largest value in the image, e.g. 16383 for 14-bit data
+ * @param seed Seed for the noise
+ * @return Image with one value per pixel, to be freed by the caller, or NULL if it couldn't be allocated
+ */
+uint16_t *TestImageMakeBayer(size_t width, size_t height, uint16_t maxValue, uint32_t seed);
+
+/**
+ * Synthesizes interleaved samples for a lossless JPEG frame. Unlike `TestImageMakeBayer`, the values
+ * jump around a lot between neighbours, so that the differences cover all SSSS categories the precision
+ * allows, including 16 for 16-bit samples.
+ *
+ * @param predictor Prediction algorithm the frame will be encoded with, from 1 to 7
+ * @return Samples, to be freed by the caller, or NULL if the arguments are invalid or they couldn't be
+ * allocated
+ */
+uint16_t *TestImageMakeFrame(size_t cols, size_t rows, size_t components, uint8_t precision, uint8_t predictor,
+                             uint32_t seed);
+
+/**
+ * Entropy codes the given frame as the scan of a lossless JPEG, with the given prediction algorithm and
+ * the table described by `kTestHuffmanCounts` and `kTestHuffmanValues` for all components. Stuffed zero
+ * bytes are inserted after each 0xFF, and the scan is terminated with an EOI marker.
+ *
+ * @param frame Interleaved samples, `cols * components` per line
+ * @param predictor Prediction algorithm, from 1 to 7
+ * @param outLength Number of bytes in the scan, including the marker
+ * @return Scan, to be freed by the caller, or NULL if the arguments are invalid or it couldn't be allocated
+ */
+uint8_t *TestImageEncodeScan(const uint16_t *frame, size_t cols, size_t rows, size_t components,
+                             uint8_t precision, uint8_t predictor, size_t *outLength);
+
+#endif /* PAPERTESTS_TEST_IMAGES_H */
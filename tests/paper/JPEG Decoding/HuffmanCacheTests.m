@@ -0,0 +1,317 @@
+//
+//  HuffmanCacheTests.m
+//  PaperTests
+//
+//  Checks that the Huffman table cache shares one immutable table between all
+//  users of the same DHT contents, and keeps its reference counts balanced.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "huffman.h"
+
+#import "test_images.h"
+
+/// Number of tables the cache holds
+static const size_t kCacheSize = 16;
+
+@interface HuffmanCacheTests : XCTestCase
+
+@end
+
+@implementation HuffmanCacheTests
+
+/**
+ * Starts each test with an empty cache, so that tables cached by earlier tests don't hold references.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+
+    JPEGHuffmanCachePurge();
+}
+
+/**
+ * Leaves the cache empty for the other tests.
+ */
+- (void) tearDown {
+    JPEGHuffmanCachePurge();
+    [super tearDown];
+}
+
+// MARK: - Helpers
+/**
+ * Gets the values of a variant of the test table: the first value is swapped with another one, so each
+ * variant has the same code lengths but decodes to different values.
+ */
+static void MakeVariant(size_t variant, uint8_t values[17]) {
+    memcpy(values, kTestHuffmanValues, sizeof(kTestHuffmanValues));
+
+    const uint8_t temp = values[0];
+    values[0] = values[variant];
+    values[variant] = temp;
+}
+
+/**
+ * Gets a table variant from the cache.
+ */
+static jpeg_huffman_t *GetVariant(size_t variant) {
+    uint8_t values[17];
+    MakeVariant(variant, values);
+
+    return JPEGHuffmanCacheGet(kTestHuffmanCounts, values, sizeof(values));
+}
+
+/**
+ * Gets the current reference count of a table.
+ */
+static size_t RefCount(jpeg_huffman_t *table) {
+    return atomic_load(&table->refCount);
+}
+
+// MARK: - Sharing
+/**
+ * Gets the same table twice; both times, the same immutable table must be returned, retained once for the
+ * caller in addition to the cache's own reference.
+ */
+- (void) testSameDHTSharesTable {
+    jpeg_huffman_t *a = GetVariant(0);
+    XCTAssert(a != NULL);
+    XCTAssertTrue(a->immutable);
+    XCTAssertEqual(RefCount(a), (size_t) 2);
+
+    jpeg_huffman_t *b = GetVariant(0);
+    XCTAssertEqual(a, b);
+    XCTAssertEqual(RefCount(a), (size_t) 3);
+
+    XCTAssertEqual(JPEGHuffmanRelease(b), a);
+    XCTAssertEqual(RefCount(a), (size_t) 2);
+
+    // purging drops only the cache's reference; the table stays usable
+    JPEGHuffmanCachePurge();
+    XCTAssertEqual(RefCount(a), (size_t) 1);
+
+    size_t bits = 0;
+    uint8_t value = 0;
+    XCTAssertTrue(JPEGHuffmanFind(a, 0x0000, &bits, &value));
+    XCTAssertEqual(bits, (size_t) 2);
+    XCTAssertEqual(value, kTestHuffmanValues[0]);
+
+    // and a new table is built next time
+    jpeg_huffman_t *c = GetVariant(0);
+    XCTAssertNotEqual(a, c);
+    XCTAssertEqual(RefCount(c), (size_t) 2);
+
+    XCTAssert(JPEGHuffmanRelease(a) == NULL);
+    JPEGHuffmanRelease(c);
+}
+
+/**
+ * Gets tables whose code lengths are the same, but values differ; each must get its own table.
+ */
+- (void) testDifferentDHTsGetDifferentTables {
+    jpeg_huffman_t *tables[4];
+
+    for (size_t i = 0; i < 4; i++) {
+        tables[i] = GetVariant(i * 3);
+        XCTAssert(tables[i] != NULL);
+
+        for (size_t j = 0; j < i; j++) {
+            XCTAssertNotEqual(tables[i], tables[j], @"variants %zu and %zu", i * 3, j * 3);
+        }
+
+        // the shortest code decodes to the first value of the variant
+        uint8_t values[17];
+        MakeVariant(i * 3, values);
+
+        size_t bits = 0;
+        uint8_t value = 0;
+        XCTAssertTrue(JPEGHuffmanFind(tables[i], 0x0000, &bits, &value));
+        XCTAssertEqual(value, values[0], @"variant %zu", i * 3);
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        JPEGHuffmanRelease(tables[i]);
+    }
+}
+
+/**
+ * Fills the cache, then inserts another table. The least recently used one must be evicted, releasing the
+ * cache's reference to it, while more recently used ones stay cached.
+ */
+- (void) testEvictsLeastRecentlyUsed {
+    jpeg_huffman_t *tables[kCacheSize + 1];
+
+    for (size_t i = 0; i < kCacheSize; i++) {
+        tables[i] = GetVariant(i);
+        XCTAssert(tables[i] != NULL);
+        XCTAssertEqual(RefCount(tables[i]), (size_t) 2);
+    }
+
+    // use the first table again, so the second is the least recently used one
+    JPEGHuffmanRelease(GetVariant(0));
+
+    tables[kCacheSize] = GetVariant(kCacheSize);
+    XCTAssert(tables[kCacheSize] != NULL);
+
+    XCTAssertEqual(RefCount(tables[1]), (size_t) 1);
+    XCTAssertEqual(RefCount(tables[0]), (size_t) 2);
+
+    for (size_t i = 2; i <= kCacheSize; i++) {
+        XCTAssertEqual(RefCount(tables[i]), (size_t) 2, @"table %zu", i);
+    }
+
+    // the evicted table is rebuilt when it's needed again
+    jpeg_huffman_t *rebuilt = GetVariant(1);
+    XCTAssertNotEqual(rebuilt, tables[1]);
+    JPEGHuffmanRelease(rebuilt);
+
+    for (size_t i = 0; i <= kCacheSize; i++) {
+        JPEGHuffmanRelease(tables[i]);
+    }
+}
+
+/**
+ * Gets tables from many threads at once. Every thread asking for the same contents must get the same
+ * table, even when several of them build it at the same time, and all references must be balanced.
+ */
+- (void) testConcurrentGets {
+    static const size_t kIterations = 256;
+    static const size_t kVariants = 4;
+
+    jpeg_huffman_t **results = calloc(kIterations, sizeof(jpeg_huffman_t *));
+    XCTAssert(results != NULL);
+
+    dispatch_apply(kIterations, DISPATCH_APPLY_AUTO, ^(size_t i) {
+        results[i] = GetVariant(i % kVariants);
+    });
+
+    for (size_t i = 0; i < kIterations; i++) {
+        XCTAssert(results[i] != NULL);
+        XCTAssertEqual(results[i], results[i % kVariants], @"iteration %zu", i);
+    }
+
+    // the cache plus one reference for each thread
+    for (size_t v = 0; v < kVariants; v++) {
+        XCTAssertEqual(RefCount(results[v]), (kIterations / kVariants) + 1, @"variant %zu", v);
+    }
+
+    dispatch_apply(kIterations, DISPATCH_APPLY_AUTO, ^(size_t i) {
+        JPEGHuffmanRelease(results[i]);
+    });
+
+    for (size_t v = 0; v < kVariants; v++) {
+        XCTAssertEqual(RefCount(results[v]), (size_t) 1, @"variant %zu", v);
+    }
+
+    free(results);
+}
+
+// MARK: - Building
+/**
+ * Decodes the code at the top of the word by walking the canonical code ranges of the DHT contents one
+ * length at a time, as described in the JPEG spec.
+ */
+static bool ReferenceDecode(const uint8_t counts[16], const uint8_t *values, uint16_t word, size_t *outBits,
+                            uint8_t *outValue) {
+    uint32_t firstCode = 0;
+    size_t firstIndex = 0;
+
+    for (size_t bits = 1; bits <= 16; bits++) {
+        const uint32_t prefix = word >> (16 - bits);
+
+        if (prefix >= firstCode && (prefix - firstCode) < counts[bits - 1]) {
+            *outBits = bits;
+            *outValue = values[firstIndex + (prefix - firstCode)];
+            return true;
+        }
+
+        firstIndex += counts[bits - 1];
+        firstCode = (firstCode + counts[bits - 1]) << 1;
+    }
+
+    return false;
+}
+
+/**
+ * Builds a table from DHT contents, and decodes every possible 16-bit word with it. The code and value must
+ * match the canonical codes; the lookup table entry for words whose code is short enough must also
+ * consume the diff bits that fit in its index.
+ */
+- (void) testTableMatchesCanonicalCodes {
+    jpeg_huffman_t *table = JPEGHuffmanNewFromDHT(kTestHuffmanCounts, kTestHuffmanValues,
+                                                  sizeof(kTestHuffmanValues));
+    XCTAssert(table != NULL);
+    XCTAssertTrue(table->immutable);
+
+    size_t unassigned = 0;
+
+    for (uint32_t word = 0; word <= 0xFFFF; word++) {
+        size_t bits = 0, expectedBits = 0;
+        uint8_t value = 0, expectedValue = 0;
+
+        const bool found = JPEGHuffmanFind(table, (uint16_t) word, &bits, &value);
+        const bool expectedFound = ReferenceDecode(kTestHuffmanCounts, kTestHuffmanValues, (uint16_t) word,
+                                                   &expectedBits, &expectedValue);
+
+        if (found != expectedFound || (found && (bits != expectedBits || value != expectedValue))) {
+            XCTFail(@"word %04x decoded as (%d, %zu, %u), expected (%d, %zu, %u)", word, found, bits, value,
+                    expectedFound, expectedBits, expectedValue);
+            break;
+        }
+
+        if (!found) {
+            unassigned++;
+            continue;
+        }
+
+        // check the lookup table entry, if the code fits in it
+        const jpeg_huffman_lookup_t *entry = &table->lookup[word >> (16 - JPEG_HUFFMAN_LOOKUP_BITS)];
+
+        if (bits > JPEG_HUFFMAN_LOOKUP_BITS) {
+            XCTAssertEqual(entry->length, (uint8_t) 0, @"word %04x", word);
+        } else if (value == 0 || value == 16) {
+            XCTAssertEqual((size_t) entry->length, bits, @"word %04x", word);
+            XCTAssertEqual(entry->diffBits, (uint8_t) 0, @"word %04x", word);
+            XCTAssertEqual(entry->delta, (int16_t) ((value == 16) ? INT16_MIN : 0), @"word %04x", word);
+        } else if ((bits + value) <= JPEG_HUFFMAN_LOOKUP_BITS) {
+            const int raw = (int) ((word >> (16 - bits - value)) & ((1 << value) - 1));
+
+            XCTAssertEqual((size_t) entry->length, bits + value, @"word %04x", word);
+            XCTAssertEqual(entry->diffBits, (uint8_t) 0, @"word %04x", word);
+            XCTAssertEqual((int) entry->delta, JPEGHuffmanExtend(raw, value), @"word %04x", word);
+        } else {
+            XCTAssertEqual((size_t) entry->length, bits, @"word %04x", word);
+            XCTAssertEqual(entry->diffBits, value, @"word %04x", word);
+        }
+    }
+
+    // the test table doesn't use the entire code space, so some words must have no code
+    XCTAssertGreaterThan(unassigned, (size_t) 0);
+
+    JPEGHuffmanRelease(table);
+}
+
+/**
+ * Ensures that DHT contents that don't describe a valid table are rejected, and aren't cached.
+ */
+- (void) testInvalidDHTIsRejected {
+    // the counts add up to more values than are given
+    XCTAssert(JPEGHuffmanNewFromDHT(kTestHuffmanCounts, kTestHuffmanValues, 16) == NULL);
+    XCTAssert(JPEGHuffmanCacheGet(kTestHuffmanCounts, kTestHuffmanValues, 16) == NULL);
+
+    // three 1-bit codes don't exist
+    static const uint8_t overfull[16] = {3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    XCTAssert(JPEGHuffmanNewFromDHT(overfull, kTestHuffmanValues, 3) == NULL);
+    XCTAssert(JPEGHuffmanCacheGet(overfull, kTestHuffmanValues, 3) == NULL);
+
+    // the valid table is still built afterwards
+    jpeg_huffman_t *table = GetVariant(0);
+    XCTAssert(table != NULL);
+    XCTAssertEqual(RefCount(table), (size_t) 2);
+    JPEGHuffmanRelease(table);
+}
+
+@end
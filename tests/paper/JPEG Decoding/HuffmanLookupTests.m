@@ -0,0 +1,152 @@
+//
+//  HuffmanLookupTests.m
+//  PaperTests
+//
+//  Checks the primary lookup table of Huffman tables against the canonical
+//  code ranges that long codes are decoded with, for every possible 16-bit
+//  prefix of the stream.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "huffman.h"
+
+#import "test_images.h"
+
+/// A table whose codes are all shorter than the lookup index, so that codes for large SSSS values leave
+/// their diff bits to be read separately
+static const uint8_t kShortCounts[16] = {0, 1, 4, 2, 2, 2, 2, 2, 1, 1, 0, 0, 0, 0, 0, 0};
+static const uint8_t kShortValues[17] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+
+/// Bits following each 16-bit prefix; the diff bits of a code may extend into them
+static const uint16_t kTails[] = {0x0000, 0xFFFF, 0xA5A5, 0x5A5A};
+
+@interface HuffmanLookupTests : XCTestCase
+
+@end
+
+@implementation HuffmanLookupTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Decodes the code at the start of each possible 32-bit window with a single probe of the lookup table,
+ * reading the remaining diff bits from the window if the entry asks for them. The number of bits consumed
+ * and the delta must be the same as when the code is found in the canonical code ranges and its diff
+ * bits are extended separately. Codes longer than the lookup index must be left to the slow path.
+ *
+ * @param outSlow Number of 16-bit prefixes that start with a code longer than the lookup index
+ * @param outPartial Number of 16-bit prefixes whose entry leaves diff bits to be read
+ */
+- (void) compareTable:(jpeg_huffman_t *) table name:(NSString *) name slowPrefixes:(size_t *) outSlow
+      partialPrefixes:(size_t *) outPartial {
+    size_t slow = 0, partial = 0;
+
+    for (uint32_t prefix = 0; prefix <= 0xFFFF; prefix++) {
+        const jpeg_huffman_lookup_t *entry = &table->lookup[prefix >> (16 - JPEG_HUFFMAN_LOOKUP_BITS)];
+
+        size_t codeBits = 0;
+        uint8_t ssss = 0;
+
+        // prefixes that aren't codes must not be decoded
+        if (!JPEGHuffmanFind(table, (uint16_t) prefix, &codeBits, &ssss)) {
+            if (entry->length) {
+                XCTFail(@"%@: invalid prefix %04x decoded", name, prefix);
+                return;
+            }
+            continue;
+        }
+        // long codes are only found by the slow path
+        else if (codeBits > JPEG_HUFFMAN_LOOKUP_BITS) {
+            if (entry->length) {
+                XCTFail(@"%@: prefix %04x starts a long code, but has an entry", name, prefix);
+                return;
+            }
+
+            slow++;
+            continue;
+        }
+
+        if (entry->diffBits) {
+            partial++;
+        }
+
+        for (size_t t = 0; t < (sizeof(kTails) / sizeof(*kTails)); t++) {
+            const uint32_t window = (prefix << 16) | kTails[t];
+
+            // slow path: the code, then its diff bits
+            const size_t diffBits = (ssss == 16) ? 0 : ssss;
+            const int raw = diffBits ? (int) ((window << codeBits) >> (32 - diffBits)) : 0;
+            const int16_t expected = (int16_t) JPEGHuffmanExtend(raw, ssss);
+            const size_t expectedBits = codeBits + diffBits;
+
+            // fast path: a single probe, and the diff bits only if they didn't fit
+            int16_t delta = entry->delta;
+            size_t bits = entry->length;
+
+            if (entry->diffBits) {
+                const int remaining = (int) ((window << entry->length) >> (32 - entry->diffBits));
+
+                delta = (int16_t) JPEGHuffmanExtend(remaining, entry->diffBits);
+                bits += entry->diffBits;
+            }
+
+            if (bits != expectedBits || delta != expected) {
+                XCTFail(@"%@: window %08x decodes to %d (%zu bits), expected %d (%zu bits)", name, window,
+                        delta, bits, expected, expectedBits);
+                return;
+            }
+        }
+    }
+
+    *outSlow = slow;
+    *outPartial = partial;
+}
+
+// MARK: - Tests
+/**
+ * Compares the lookup table of the table scans are encoded with; its two longest codes, for SSSS values of
+ * 15 and 16, don't fit into the lookup index.
+ */
+- (void) testLookupMatchesCodeRanges {
+    jpeg_huffman_t *table = JPEGHuffmanNewFromDHT(kTestHuffmanCounts, kTestHuffmanValues,
+                                                  sizeof(kTestHuffmanValues));
+    XCTAssert(table != NULL);
+
+    size_t slow = 0, partial = 0;
+    [self compareTable:table name:@"test table" slowPrefixes:&slow partialPrefixes:&partial];
+
+    // one 12-bit and one 14-bit code
+    XCTAssertEqual(slow, (size_t) ((1 << 4) + (1 << 2)));
+    XCTAssertGreaterThan(partial, (size_t) 0);
+
+    JPEGHuffmanRelease(table);
+}
+
+/**
+ * Compares the lookup table of a table without long codes; every code is decoded by the lookup table, and
+ * codes for most SSSS values have their diff bits decoded along with them.
+ */
+- (void) testLookupWithoutLongCodes {
+    jpeg_huffman_t *table = JPEGHuffmanNewFromDHT(kShortCounts, kShortValues, sizeof(kShortValues));
+    XCTAssert(table != NULL);
+
+    size_t slow = 0, partial = 0;
+    [self compareTable:table name:@"short table" slowPrefixes:&slow partialPrefixes:&partial];
+
+    XCTAssertEqual(slow, (size_t) 0);
+    XCTAssertGreaterThan(partial, (size_t) 0);
+
+    JPEGHuffmanRelease(table);
+}
+
+@end
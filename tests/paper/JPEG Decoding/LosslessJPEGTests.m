@@ -0,0 +1,645 @@
+//
+//  LosslessJPEGTests.m
+//  PaperTests
+//
+//  Decodes synthetic lossless JPEG scans and compares the result against the
+//  samples they were encoded from, both interleaved and unsliced into the CR2
+//  sensor layout. These are written against the C decoder directly, since it
+//  isn't visible to Swift.
+//
+//  Created by Tristan Seifert on 20200914.
+//
+
+#import <XCTest/XCTest.h>
+
+#import "decompress.h"
+#import "huffman.h"
+
+#import "test_images.h"
+
+/// Size of the sensor that sliced frames are unsliced into; each line holds 64 samples of 2 components
+static const size_t kSensorWidth = 128;
+static const size_t kSensorHeight = 40;
+
+/// Value that the unwritten parts of output buffers are filled with
+static const uint16_t kCanary = 0xA5A5;
+
+/// Differences coded for each sample of the 3x3 frame with up to 2 components that line starts are tested with;
+/// the first sample of each line has a nonzero difference
+static const int kLineStartDiffs[3][3][2] = {
+    {{10, -20}, {1, 4}, {-2, 0}},
+    {{3, 7}, {0, -1}, {1, 0}},
+    {{-5, 1}, {2, 0}, {0, -3}},
+};
+
+/// Samples that the differences decode to with predictor 1 and 8-bit precision: the first sample of each line is
+/// predicted from the one above it, rather than from the middle of the sample range
+static const uint16_t kLineStartSamples[3][3][2] = {
+    {{138, 108}, {139, 112}, {137, 112}},
+    {{141, 115}, {141, 114}, {142, 114}},
+    {{136, 116}, {138, 116}, {138, 113}},
+};
+
+@interface LosslessJPEGTests : XCTestCase
+
+@end
+
+@implementation LosslessJPEGTests
+
+/**
+ * Stop at the first failure, since later checks use the buffers the earlier ones validated.
+ */
+- (void) setUp {
+    [super setUp];
+    self.continueAfterFailure = NO;
+}
+
+// MARK: - Helpers
+/**
+ * Encodes a synthetic frame with the given format and predictor, decodes it again and ensures that the
+ * output matches it exactly.
+ *
+ * @param unstuff Whether the decoder unstuffs the scan up front (which enables the specialized kernels for
+ * 2 and 4 components) or reads the stuffed bytes as it goes
+ * @param maxLines If nonzero, the frame is decoded this many lines at a time
+ */
+- (void) roundTripCols:(size_t) cols rows:(size_t) rows components:(size_t) components
+             precision:(uint8_t) precision predictor:(uint8_t) predictor unstuff:(BOOL) unstuff
+              maxLines:(size_t) maxLines {
+    uint16_t *frame = TestImageMakeFrame(cols, rows, components, precision, predictor,
+                                         (uint32_t) ((predictor * 131) + (components * 17) + precision));
+    XCTAssert(frame != NULL);
+
+    [self roundTripFrame:frame cols:cols rows:rows components:components precision:precision
+               predictor:predictor unstuff:unstuff maxLines:maxLines];
+
+    free(frame);
+}
+
+/**
+ * Encodes the given frame, decodes it again and ensures that the output matches it exactly. When the scan
+ * is unstuffed, the end of the scan must be found at its EOI marker.
+ */
+- (void) roundTripFrame:(const uint16_t *) frame cols:(size_t) cols rows:(size_t) rows
+             components:(size_t) components precision:(uint8_t) precision predictor:(uint8_t) predictor
+                unstuff:(BOOL) unstuff maxLines:(size_t) maxLines {
+    NSString *desc = [NSString stringWithFormat:@"%zux%zu, %zu components, %u bits, predictor %u, unstuff %d",
+                      cols, rows, components, precision, predictor, unstuff];
+
+    size_t scanLength = 0;
+    uint8_t *scan = TestImageEncodeScan(frame, cols, rows, components, precision, predictor, &scanLength);
+    XCTAssert(scan != NULL, @"%@", desc);
+
+    // the scan should contain stuffed bytes, or this wouldn't test much
+    size_t stuffed = 0;
+    for (size_t i = 0; (i + 1) < scanLength; i++) {
+        if (scan[i] == 0xFF && scan[i + 1] == 0x00) stuffed++;
+    }
+    XCTAssertGreaterThan(stuffed, (size_t) 0, @"%@", desc);
+
+    // set up the decompressor
+    jpeg_decompressor_t *dec = JPEGDecompressorNew(cols, rows, precision, components);
+    XCTAssert(dec != NULL, @"%@", desc);
+
+    jpeg_huffman_t *table = JPEGHuffmanNewFromDHT(kTestHuffmanCounts, kTestHuffmanValues,
+                                                  sizeof(kTestHuffmanValues));
+    XCTAssert(table != NULL, @"%@", desc);
+    XCTAssertEqual(JPEGDecompressorAddTable(dec, 0, table), 0, @"%@", desc);
+    JPEGHuffmanRelease(table);
+
+    for (size_t c = 0; c < components; c++) {
+        XCTAssertEqual(JPEGDecompressorSetTableForPlane(dec, c, 0), 0, @"%@", desc);
+    }
+    XCTAssertEqual(JPEGDecompressorSetPredictionAlgo(dec, predictor), 0, @"%@", desc);
+    XCTAssertEqual(JPEGDecompressorSetUnstuffInput(dec, unstuff), 0, @"%@", desc);
+
+    const size_t outBytes = cols * rows * components * sizeof(uint16_t);
+    NSMutableData *out = [NSMutableData dataWithLength:outBytes];
+
+    XCTAssertEqual(JPEGDecompressorSetOutput(dec, out.mutableBytes, outBytes), 0, @"%@", desc);
+    XCTAssertEqual(JPEGDecompressorSetInput(dec, scan, scanLength), 0, @"%@", desc);
+
+    // decode it, all at once or a few lines at a time
+    bool foundMarker = false;
+
+    if (maxLines) {
+        size_t offset = 0;
+
+        while (!JPEGDecompressorIsDone(dec) && dec->error == kJPEGErrorNone) {
+            offset = JPEGDecompressorGoLines(dec, offset, maxLines, &foundMarker);
+        }
+    } else {
+        JPEGDecompressorGo(dec, 0, &foundMarker);
+    }
+
+    XCTAssertEqual(dec->error, kJPEGErrorNone, @"%@", desc);
+    XCTAssertTrue(JPEGDecompressorIsDone(dec), @"%@", desc);
+
+    if (unstuff) {
+        XCTAssertEqual((size_t) dec->scanMarkerOffset, scanLength - 2, @"%@", desc);
+    }
+
+    // compare against the input, and report the first mismatch
+    const uint16_t *decoded = out.bytes;
+
+    for (size_t i = 0; i < (cols * rows * components); i++) {
+        if (decoded[i] != frame[i]) {
+            XCTFail(@"%@: sample %zu (line %zu) is %u, expected %u", desc, i, i / (cols * components),
+                    decoded[i], frame[i]);
+            break;
+        }
+    }
+
+    JPEGDecompressorRelease(dec);
+    free(scan);
+}
+
+/**
+ * Synthesizes a frame in which every sample is 16383 more than its prediction with predictor 1. Each sample
+ * is coded as the 7-bit code for SSSS = 14 and 14 one bits, so almost every byte of the scan is a 0xFF that
+ * has to be unstuffed.
+ */
+static uint16_t *MakeStuffedFrame(size_t cols, size_t rows, size_t components) {
+    uint16_t *frame = malloc(cols * rows * components * sizeof(uint16_t));
+    if (!frame) return NULL;
+
+    const size_t stride = cols * components;
+
+    for (size_t y = 0; y < rows; y++) {
+        for (size_t x = 0; x < cols; x++) {
+            for (size_t c = 0; c < components; c++) {
+                const size_t i = (y * stride) + (x * components) + c;
+                const int pred = x ? frame[i - components] : (y ? frame[i - stride] : 32768);
+
+                frame[i] = (uint16_t) (pred + 16383);
+            }
+        }
+    }
+
+    return frame;
+}
+
+/**
+ * Puts the columns of a sensor image that the slices cover into slice order: each slice from top to bottom,
+ * one after another. These are followed by `surplus` more samples, which don't fit in any slice.
+ */
+static uint16_t *MakeSlicedFrame(const uint16_t *sensor, const uint16_t *slices, size_t surplus) {
+    uint16_t *frame = malloc(kSensorWidth * kSensorHeight * sizeof(uint16_t));
+    if (!frame) return NULL;
+
+    size_t j = 0;
+
+    for (size_t s = 0; s <= slices[0]; s++) {
+        const size_t start = s * slices[1];
+        const size_t width = (s < slices[0]) ? slices[1] : slices[2];
+
+        for (size_t y = 0; y < kSensorHeight; y++) {
+            memcpy(frame + j, sensor + (y * kSensorWidth) + start, width * sizeof(uint16_t));
+            j += width;
+        }
+    }
+
+    for (size_t i = 0; i < surplus; i++, j++) {
+        frame[j] = (uint16_t) (sensor[i] ^ 0x1555);
+    }
+
+    return frame;
+}
+
+/**
+ * Encodes a frame in slice order and decodes it into the sensor layout, which must contain the sensor image
+ * in all columns the slices cover; the others must not be written.
+ *
+ * @param surplus Number of samples the frame has in addition to what the slices hold; these must be dropped
+ * with an error, without overwriting any of the image
+ */
+- (void) unsliceSlices:(const uint16_t *) slices surplus:(size_t) surplus predictor:(uint8_t) predictor
+               unstuff:(BOOL) unstuff {
+    NSString *desc = [NSString stringWithFormat:@"slices (%u, %u, %u), predictor %u, unstuff %d", slices[0],
+                      slices[1], slices[2], predictor, unstuff];
+
+    uint16_t *sensor = TestImageMakeBayer(kSensorWidth, kSensorHeight, 16383, 0x5EED0001 + predictor);
+    uint16_t *frame = MakeSlicedFrame(sensor, slices, surplus);
+    XCTAssert(sensor && frame, @"%@", desc);
+
+    size_t scanLength = 0;
+    uint8_t *scan = TestImageEncodeScan(frame, kSensorWidth / 2, kSensorHeight, 2, 14, predictor, &scanLength);
+    XCTAssert(scan != NULL, @"%@", desc);
+
+    jpeg_decompressor_t *dec = JPEGDecompressorNew(kSensorWidth / 2, kSensorHeight, 14, 2);
+    XCTAssert(dec != NULL, @"%@", desc);
+
+    jpeg_huffman_t *table = JPEGHuffmanNewFromDHT(kTestHuffmanCounts, kTestHuffmanValues,
+                                                  sizeof(kTestHuffmanValues));
+    XCTAssertEqual(JPEGDecompressorAddTable(dec, 0, table), 0, @"%@", desc);
+    JPEGHuffmanRelease(table);
+
+    XCTAssertEqual(JPEGDecompressorSetTableForPlane(dec, 0, 0), 0, @"%@", desc);
+    XCTAssertEqual(JPEGDecompressorSetTableForPlane(dec, 1, 0), 0, @"%@", desc);
+    XCTAssertEqual(JPEGDecompressorSetPredictionAlgo(dec, predictor), 0, @"%@", desc);
+    XCTAssertEqual(JPEGDecompressorSetUnstuffInput(dec, unstuff), 0, @"%@", desc);
+
+    const size_t planeValues = kSensorWidth * kSensorHeight;
+    NSMutableData *plane = [NSMutableData dataWithLength:(planeValues * sizeof(uint16_t))];
+    uint16_t *out = plane.mutableBytes;
+
+    for (size_t i = 0; i < planeValues; i++) {
+        out[i] = kCanary;
+    }
+
+    XCTAssertEqual(JPEGDecompressorSetUnslicedOutput(dec, out, plane.length, slices), 0, @"%@", desc);
+    XCTAssertEqual(JPEGDecompressorSetInput(dec, scan, scanLength), 0, @"%@", desc);
+
+    bool foundMarker = false;
+    JPEGDecompressorGo(dec, 0, &foundMarker);
+
+    XCTAssertEqual(dec->error, surplus ? kJPEGErrorOutputOverrun : kJPEGErrorNone, @"%@", desc);
+
+    // columns covered by the slices hold the image, and the rest is untouched
+    const size_t coveredWidth = (slices[0] * slices[1]) + slices[2];
+
+    for (size_t i = 0; i < planeValues; i++) {
+        const size_t x = i % kSensorWidth, y = i / kSensorWidth;
+        const uint16_t expected = (x < coveredWidth) ? sensor[i] : kCanary;
+
+        if (out[i] != expected) {
+            XCTFail(@"%@: value (%zu, %zu) is %u, expected %u", desc, x, y, out[i], expected);
+            break;
+        }
+    }
+
+    JPEGDecompressorRelease(dec);
+    free(scan);
+    free(frame);
+    free(sensor);
+}
+
+/**
+ * Entropy codes the line start differences directly, without predicting anything, so the expected samples
+ * don't depend on the test encoder's predictor.
+ */
+static uint8_t *EncodeLineStartDiffs(size_t components, size_t *outLength) {
+    uint16_t codes[17];
+    uint8_t codeLengths[17];
+
+    for (size_t l = 1, k = 0, code = 0; l <= 16; l++, code <<= 1) {
+        for (size_t i = 0; i < kTestHuffmanCounts[l - 1]; i++, k++, code++) {
+            codes[kTestHuffmanValues[k]] = (uint16_t) code;
+            codeLengths[kTestHuffmanValues[k]] = (uint8_t) l;
+        }
+    }
+
+    // differences are at most 5 bits, so no code is longer than 10 bits and no byte can be 0xFF
+    uint8_t *scan = calloc(64, 1);
+    if (!scan) return NULL;
+
+    size_t length = 0, numBits = 0;
+    uint32_t bits = 0;
+
+    for (size_t y = 0; y < 3; y++) {
+        for (size_t x = 0; x < 3; x++) {
+            for (size_t c = 0; c < components; c++) {
+                const int diff = kLineStartDiffs[y][x][c];
+                const int magnitude = (diff < 0) ? -diff : diff;
+                const size_t ssss = magnitude ? (32 - __builtin_clz(magnitude)) : 0;
+                const uint32_t extra = (uint32_t) ((diff < 0) ? (diff + (1 << ssss) - 1) : diff);
+
+                bits = (bits << codeLengths[ssss]) | codes[ssss];
+                bits = (bits << ssss) | (extra & ((1U << ssss) - 1));
+                numBits += codeLengths[ssss] + ssss;
+
+                for (; numBits >= 8; numBits -= 8) {
+                    scan[length++] = (bits >> (numBits - 8)) & 0xFF;
+                }
+            }
+        }
+    }
+
+    // pad the last byte with ones, then end the image
+    if (numBits) {
+        scan[length++] = ((bits << (8 - numBits)) | ((1U << (8 - numBits)) - 1)) & 0xFF;
+    }
+    scan[length++] = 0xFF;
+    scan[length++] = 0xD9;
+
+    *outLength = length;
+    return scan;
+}
+
+/**
+ * Decodes the line start frame with predictor 1, and compares it against the expected samples.
+ *
+ * @param maxLines If nonzero, the frame is decoded this many lines at a time
+ */
+- (void) decodeLineStartsWithComponents:(size_t) components unstuff:(BOOL) unstuff maxLines:(size_t) maxLines {
+    NSString *desc = [NSString stringWithFormat:@"%zu components, unstuff %d, %zu lines at a time", components,
+                      unstuff, maxLines];
+
+    size_t scanLength = 0;
+    uint8_t *scan = EncodeLineStartDiffs(components, &scanLength);
+    XCTAssert(scan != NULL, @"%@", desc);
+
+    jpeg_decompressor_t *dec = JPEGDecompressorNew(3, 3, 8, components);
+    XCTAssert(dec != NULL, @"%@", desc);
+
+    jpeg_huffman_t *table = JPEGHuffmanNewFromDHT(kTestHuffmanCounts, kTestHuffmanValues,
+                                                  sizeof(kTestHuffmanValues));
+    XCTAssertEqual(JPEGDecompressorAddTable(dec, 0, table), 0, @"%@", desc);
+    JPEGHuffmanRelease(table);
+
+    for (size_t c = 0; c < components; c++) {
+        XCTAssertEqual(JPEGDecompressorSetTableForPlane(dec, c, 0), 0, @"%@", desc);
+    }
+    XCTAssertEqual(JPEGDecompressorSetPredictionAlgo(dec, 1), 0, @"%@", desc);
+    XCTAssertEqual(JPEGDecompressorSetUnstuffInput(dec, unstuff), 0, @"%@", desc);
+
+    uint16_t out[3 * 3 * 2];
+    XCTAssertEqual(JPEGDecompressorSetOutput(dec, out, 3 * 3 * components * sizeof(uint16_t)), 0, @"%@", desc);
+    XCTAssertEqual(JPEGDecompressorSetInput(dec, scan, scanLength), 0, @"%@", desc);
+
+    bool foundMarker = false;
+
+    if (maxLines) {
+        size_t offset = 0;
+
+        while (!JPEGDecompressorIsDone(dec) && dec->error == kJPEGErrorNone) {
+            offset = JPEGDecompressorGoLines(dec, offset, maxLines, &foundMarker);
+        }
+    } else {
+        JPEGDecompressorGo(dec, 0, &foundMarker);
+    }
+
+    XCTAssertEqual(dec->error, kJPEGErrorNone, @"%@", desc);
+    XCTAssertTrue(JPEGDecompressorIsDone(dec), @"%@", desc);
+
+    for (size_t y = 0; y < 3; y++) {
+        for (size_t x = 0; x < 3; x++) {
+            for (size_t c = 0; c < components; c++) {
+                const uint16_t decoded = out[(((y * 3) + x) * components) + c];
+
+                XCTAssertEqual(decoded, kLineStartSamples[y][x][c], @"%@: sample (%zu, %zu) of component %zu",
+                               desc, x, y, c);
+            }
+        }
+    }
+
+    JPEGDecompressorRelease(dec);
+    free(scan);
+}
+
+/**
+ * Decodes a 14-bit scan into an output buffer filled with canaries, optionally unsliced. Unstuffed scans of
+ * 2 and 4 components are decoded by the specialized kernels, all others by the generic decoder.
+ *
+ * @param slices Slicing info to unslice the output with, or NULL for interleaved output
+ * @param maxLines If nonzero, the frame is decoded this many lines at a time
+ * @param outError Error the decoder stopped with
+ * @param outDone Whether all samples of the frame were decoded
+ * @return Output buffer, or nil if the decoder couldn't be set up
+ */
+static NSMutableData *DecodeScan(const uint8_t *scan, size_t scanLength, size_t cols, size_t rows,
+                                 size_t components, uint8_t predictor, BOOL unstuff, const uint16_t *slices,
+                                 size_t maxLines, jpeg_decompress_error_t *outError, bool *outDone) {
+    jpeg_decompressor_t *dec = JPEGDecompressorNew(cols, rows, 14, components);
+    jpeg_huffman_t *table = JPEGHuffmanNewFromDHT(kTestHuffmanCounts, kTestHuffmanValues,
+                                                  sizeof(kTestHuffmanValues));
+
+    if (!dec || !table || JPEGDecompressorAddTable(dec, 0, table) != 0) {
+        JPEGHuffmanRelease(table);
+        JPEGDecompressorRelease(dec);
+        return nil;
+    }
+    JPEGHuffmanRelease(table);
+
+    for (size_t c = 0; c < components; c++) {
+        JPEGDecompressorSetTableForPlane(dec, c, 0);
+    }
+    JPEGDecompressorSetPredictionAlgo(dec, predictor);
+    JPEGDecompressorSetUnstuffInput(dec, unstuff);
+
+    const size_t values = cols * rows * components;
+    NSMutableData *out = [NSMutableData dataWithLength:(values * sizeof(uint16_t))];
+    uint16_t *outPtr = out.mutableBytes;
+
+    for (size_t i = 0; i < values; i++) {
+        outPtr[i] = kCanary;
+    }
+
+    if (slices) {
+        JPEGDecompressorSetUnslicedOutput(dec, outPtr, out.length, slices);
+    } else {
+        JPEGDecompressorSetOutput(dec, outPtr, out.length);
+    }
+    JPEGDecompressorSetInput(dec, scan, scanLength);
+
+    bool foundMarker = false;
+
+    if (maxLines) {
+        size_t offset = 0;
+
+        while (!JPEGDecompressorIsDone(dec) && dec->error == kJPEGErrorNone) {
+            offset = JPEGDecompressorGoLines(dec, offset, maxLines, &foundMarker);
+        }
+    } else {
+        JPEGDecompressorGo(dec, 0, &foundMarker);
+    }
+
+    *outError = dec->error;
+    *outDone = JPEGDecompressorIsDone(dec);
+
+    JPEGDecompressorRelease(dec);
+    return out;
+}
+
+/**
+ * Decodes a frame with the specialized kernel and with the generic decoder, and ensures that both decode it
+ * without errors into identical output buffers, down to the parts they don't write.
+ */
+- (void) compareKernelCols:(size_t) cols rows:(size_t) rows components:(size_t) components
+                 predictor:(uint8_t) predictor slices:(const uint16_t *) slices maxLines:(size_t) maxLines {
+    NSString *desc = [NSString stringWithFormat:@"%zux%zu, %zu components, predictor %u, %s, %zu lines at a time",
+                      cols, rows, components, predictor, slices ? "unsliced" : "interleaved", maxLines];
+
+    uint16_t *frame = TestImageMakeFrame(cols, rows, components, 14, predictor,
+                                         (uint32_t) ((predictor * 7) + (cols * 3) + components));
+    XCTAssert(frame != NULL, @"%@", desc);
+
+    size_t scanLength = 0;
+    uint8_t *scan = TestImageEncodeScan(frame, cols, rows, components, 14, predictor, &scanLength);
+    XCTAssert(scan != NULL, @"%@", desc);
+
+    jpeg_decompress_error_t kernelError = kJPEGErrorNone, genericError = kJPEGErrorNone;
+    bool kernelDone = false, genericDone = false;
+
+    NSData *kernel = DecodeScan(scan, scanLength, cols, rows, components, predictor, YES, slices, maxLines,
+                                &kernelError, &kernelDone);
+    NSData *generic = DecodeScan(scan, scanLength, cols, rows, components, predictor, NO, slices, maxLines,
+                                 &genericError, &genericDone);
+
+    XCTAssert(kernel && generic, @"%@", desc);
+    XCTAssertEqual(kernelError, kJPEGErrorNone, @"%@", desc);
+    XCTAssertEqual(genericError, kJPEGErrorNone, @"%@", desc);
+    XCTAssertTrue(kernelDone && genericDone, @"%@", desc);
+
+    const uint16_t *a = kernel.bytes, *b = generic.bytes;
+
+    for (size_t i = 0; i < (kernel.length / sizeof(uint16_t)); i++) {
+        if (a[i] != b[i]) {
+            XCTFail(@"%@: value %zu is %u with the kernel, %u with the generic decoder", desc, i, a[i], b[i]);
+            break;
+        }
+    }
+
+    free(scan);
+    free(frame);
+}
+
+// MARK: - Predictors
+/**
+ * Decodes frames with every predictor and component count, both with and without unstuffing. Component
+ * counts of 2 and 4 go through the specialized kernels when unstuffing, the others through the generic
+ * decoder.
+ */
+- (void) testPredictors {
+    for (uint8_t predictor = 1; predictor <= 7; predictor++) {
+        for (size_t components = 1; components <= 4; components++) {
+            for (int unstuff = 0; unstuff < 2; unstuff++) {
+                [self roundTripCols:61 rows:47 components:components precision:14 predictor:predictor
+                            unstuff:unstuff maxLines:0];
+            }
+        }
+    }
+}
+
+/**
+ * Decodes frames in chunks of a few lines, so that decoding resumes in the middle of the frame with the
+ * previous line still needed for prediction.
+ */
+- (void) testPredictorsLineByLine {
+    for (uint8_t predictor = 1; predictor <= 7; predictor++) {
+        [self roundTripCols:64 rows:40 components:2 precision:14 predictor:predictor unstuff:YES maxLines:7];
+        [self roundTripCols:64 rows:40 components:3 precision:14 predictor:predictor unstuff:NO maxLines:5];
+    }
+}
+
+/**
+ * Decodes a hand coded frame in which the first sample of every line differs from the one above it. With
+ * predictor 1, those samples are predicted from the sample above (H.1.2.1), not from the middle of the
+ * sample range as they were before predictors 2-7 were added; this doesn't rely on the test encoder, which
+ * shares the decoder's notion of prediction.
+ */
+- (void) testFirstColumnPredictedFromAbove {
+    for (size_t components = 1; components <= 2; components++) {
+        for (int unstuff = 0; unstuff < 2; unstuff++) {
+            [self decodeLineStartsWithComponents:components unstuff:unstuff maxLines:0];
+            [self decodeLineStartsWithComponents:components unstuff:unstuff maxLines:1];
+        }
+    }
+}
+
+/**
+ * Decodes frames with every predictor through the specialized kernels and the generic decoder, which must
+ * produce the same output. Frames as narrow as a single column have only a first column, and decoding a
+ * few lines at a time enters the kernels with the previous line already decoded.
+ */
+- (void) testKernelsMatchGenericDecoder {
+    static const size_t kCols[] = {1, 2, 3, 61};
+    static const uint16_t slices[3] = {2, 44, 40};
+
+    for (uint8_t predictor = 1; predictor <= 7; predictor++) {
+        for (size_t components = 2; components <= 4; components += 2) {
+            for (size_t i = 0; i < (sizeof(kCols) / sizeof(*kCols)); i++) {
+                [self compareKernelCols:kCols[i] rows:23 components:components predictor:predictor slices:NULL
+                               maxLines:0];
+                [self compareKernelCols:kCols[i] rows:23 components:components predictor:predictor slices:NULL
+                               maxLines:3];
+            }
+        }
+
+        [self compareKernelCols:(kSensorWidth / 2) rows:kSensorHeight components:2 predictor:predictor
+                         slices:slices maxLines:0];
+        [self compareKernelCols:(kSensorWidth / 2) rows:kSensorHeight components:2 predictor:predictor
+                         slices:slices maxLines:7];
+    }
+}
+
+/**
+ * Decodes frames of a few other precisions, which changes the default prediction of the first sample.
+ */
+- (void) testPrecisions {
+    for (uint8_t precision = 8; precision <= 15; precision++) {
+        [self roundTripCols:61 rows:47 components:2 precision:precision predictor:4 unstuff:YES maxLines:0];
+        [self roundTripCols:61 rows:47 components:1 precision:precision predictor:6 unstuff:NO maxLines:0];
+    }
+}
+
+// MARK: - Differences
+/**
+ * Decodes 16-bit frames, in which some samples are exactly 32768 away from their prediction. These are
+ * coded with SSSS = 16 and no additional bits, which the decoder must not try to read.
+ */
+- (void) testSSSS16 {
+    for (uint8_t predictor = 1; predictor <= 7; predictor++) {
+        for (size_t components = 1; components <= 4; components++) {
+            [self roundTripCols:61 rows:47 components:components precision:16 predictor:predictor
+                        unstuff:YES maxLines:0];
+            [self roundTripCols:61 rows:47 components:components precision:16 predictor:predictor
+                        unstuff:NO maxLines:0];
+        }
+    }
+}
+
+// MARK: - Stuffing
+/**
+ * Decodes scans in which stuffed bytes make up more than a third of the data, so that nearly every block the
+ * unstuffing pass looks at has to be handled byte by byte, and stuffed pairs straddle the blocks. Decoding
+ * them the same as without unstuffing also checks that the bit reader refills across the pairs.
+ */
+- (void) testDenselyStuffedScan {
+    static const size_t kCols = 61, kRows = 9;
+
+    for (size_t components = 1; components <= 4; components++) {
+        uint16_t *frame = MakeStuffedFrame(kCols, kRows, components);
+        XCTAssert(frame != NULL);
+
+        for (int unstuff = 0; unstuff < 2; unstuff++) {
+            [self roundTripFrame:frame cols:kCols rows:kRows components:components precision:16 predictor:1
+                         unstuff:unstuff maxLines:0];
+            [self roundTripFrame:frame cols:kCols rows:kRows components:components precision:16 predictor:1
+                         unstuff:unstuff maxLines:2];
+        }
+
+        free(frame);
+    }
+}
+
+// MARK: - Unslicing
+/**
+ * Decodes frames whose slices cover the entire sensor straight into the sensor layout, with both the
+ * specialized kernels and the generic decoder.
+ */
+- (void) testUnslicedOutput {
+    static const uint16_t slices[3] = {2, 44, 40};
+
+    for (uint8_t predictor = 1; predictor <= 7; predictor += 3) {
+        [self unsliceSlices:slices surplus:0 predictor:predictor unstuff:YES];
+        [self unsliceSlices:slices surplus:0 predictor:predictor unstuff:NO];
+    }
+}
+
+/**
+ * Decodes frames with more samples than their slices hold, as a corrupt slicing tag would describe. The
+ * samples that don't fit must be dropped and reported, rather than wrapping around and overwriting the top
+ * of the image.
+ */
+- (void) testScanLongerThanSlices {
+    static const uint16_t slices[3] = {2, 44, 20};
+    const size_t surplus = (kSensorWidth - ((slices[0] * slices[1]) + slices[2])) * kSensorHeight;
+
+    for (uint8_t predictor = 1; predictor <= 7; predictor += 3) {
+        [self unsliceSlices:slices surplus:surplus predictor:predictor unstuff:YES];
+        [self unsliceSlices:slices surplus:surplus predictor:predictor unstuff:NO];
+    }
+}
+
+@end